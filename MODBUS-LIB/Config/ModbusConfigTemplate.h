@@ -13,29 +13,729 @@
 
 
 
-/* Uncomment the following line to enable support for Modbus RTU over USB CDC profile. Only tested for BluePill f103 board. */
+/* Uncomment the following line to enable support for Modbus RTU over USB CDC profile. Only tested for BluePill f103 board.
+ * A handler with xTypeHW = USB_CDC_HW and xUsbDevice = &hUsbDeviceFS receives the bulk packets straight into u8Buffer,
+ * the frames end with the USB transfer and not at T35, see ModbusUsbRxCallback(). MB_USB_PACKET is the size of the
+ * OUT packets, 64 for a full speed device. Not available with ENABLE_MB_SHARED_TASK or ENABLE_USART_DMA_INPLACE */
 //#define ENABLE_USB_CDC 1
+//#define MB_USB_PACKET 64
 
-/* Uncomment the following line to enable support for Modbus TCP. Only tested for Nucleo144-F429ZI. */
+/* Uncomment the following line to enable support for Modbus TCP. A slave handler with xTypeHW = TCP_HW serves
+ * the clients of u16TcpPort (502 when 0) over the netconn API of lwIP 2.1, ModbusStart() must run after
+ * MX_LWIP_Init(). The requests are read from the pbufs of lwIP and answered by the same engine as RTU, without CRC.
+ * A master handler with xTypeHW = TCP_HW connects to xTcpServer:u16TcpPort for its first query and keeps up to
+ * TCPINFLIGHT queries of ModbusQuery() and ModbusQueryAsync() in flight on the connection. The poll table, merge,
+ * cache and backoff features only work for serial masters.
+ * Not available with ENABLE_MB_SHARED_TASK or ENABLE_USART_DMA_INPLACE */
 //#define ENABLE_TCP 1
 
+/* Uncomment the following line to enable support for Modbus over UDP, the MBAP ADU of Modbus TCP in one datagram.
+ * A slave handler with xTypeHW = UDP_HW binds u16TcpPort (502 when 0) and answers each datagram to its source with
+ * one netconn_sendto(), there are no connection slots. A master handler with xTypeHW = UDP_HW sends its queries to
+ * xTcpServer:u16TcpPort with up to TCPINFLIGHT in flight, a query without answer is sent again u8retries times.
+ * Works with or without ENABLE_TCP, not available with ENABLE_MB_SHARED_TASK or ENABLE_USART_DMA_INPLACE */
+//#define ENABLE_UDP 1
+
+/* Uncomment the following line to enable Modbus/TCP Security on the TCP_HW handlers given a TLS layer with
+ * ModbusSetTls(), on port 802 when u16TcpPort is 0. The library calls the modbusTlsOps_t of the application for
+ * each connection: its TLS stack (mbedTLS for instance) should run its AES, ECC and random numbers on the AES, PKA
+ * and RNG units of the MCU and keep session tickets or a session cache, a client reconnecting then skips the
+ * public key operations. The records are decrypted in the received pbufs and parsed in place as plain MBAP */
+//#define ENABLE_MB_TLS 1
+
 /* Uncomment the following line to enable support for Modbus RTU USART DMA mode. Only tested for Nucleo144-F429ZI.  */
 //#define ENABLE_USART_DMA 1
 
+#if ENABLE_USART_DMA == 1
+/* Settings for the USART_HW_DMA_CIRC mode: the RX DMA channel must be configured as circular in Cube-MX.
+ * The DMA never stops, every idle line event queues a frame descriptor (offset, length) in the RX ring. A queued
+ * frame the DMA wrapped over before the task took it is dropped and counted as ERR_BUFF_OVERFLOW. The ID of a frame
+ * is read in the ring and the frames of other slaves are dropped there; a frame for the slave is copied to u8Buffer in
+ * one or two blocks, as its answer is built over it and would overwrite the next frames of the ring */
+#define MAX_BUFFER_RX  (2 * MAX_BUFFER)  // Size of the circular RX ring in bytes, a power of two of at least MAX_BUFFER, two frames here
+#define MAX_RX_FRAMES  4    // Number of received frames that can wait in the RX ring for the Modbus task
+
+/* Uncomment the following line to receive the frames of the USART_HW_DMA mode straight into u8Buffer, the RX ring
+ * then shares its storage (MAX_BUFFER bytes less per handler). All the handlers must use USART_HW_DMA and
+ * MAX_BUFFER_RX must be MAX_BUFFER. The reception restarts once the answer or the query is sent, bytes received
+ * while a frame is served are lost. Not available with ENABLE_MB_SHARED_TASK or ENABLE_MB_TX_BUFFER */
+//#define ENABLE_USART_DMA_INPLACE 1
+
+/* Uncomment the following line to queue the frames of the USART_HW_DMA handlers in a FreeRTOS message buffer of
+ * MB_RX_QUEUE_BYTES: the RX event callback copies each frame there before it restarts the DMA, so frames arriving
+ * before the task served the previous one wait instead of being overwritten. Each frame takes its length plus
+ * sizeof(size_t) bytes, a frame that does not fit is lost and reported as ERR_BUFF_OVERFLOW. Needs stream_buffer.c,
+ * not available with ENABLE_USART_DMA_INPLACE and ENABLE_MB_ISR_DEFER */
+//#define ENABLE_MB_RX_QUEUE 1
+//#define MB_RX_QUEUE_BYTES  (2 * (MAX_BUFFER + 4))  // two full frames, more short ones
+
+/* Uncomment the following line to send the DMA frames with the LL drivers. The TX DMA channel, which must be in
+ * normal mode, is set up once by ModbusStart() and every frame only reloads its address and count, in place of
+ * HAL_UART_Transmit_DMA(). The DMA and USART interrupts of Cube-MX stay, the HAL still reports the end of TX */
+//#define ENABLE_USART_DMA_LL 1
+#endif
+
 
-#define T35  5              // Timer T35 period (in ticks) for end frame detection.
-#define MAX_BUFFER  128	    // Maximum size for the communication buffer in bytes.
+#define T35  5              // Initial timer T35 period (in ticks), ModbusStart() recomputes it from the baud rate.
+#define MAX_BUFFER  256	    // Maximum size for the communication buffer in bytes, 256 holds any RTU frame.
 #define TIMEOUT_MODBUS 1000 // Timeout for master query (in ticks)
 #define MAX_M_HANDLERS 2    //Maximum number of modbus handlers that can work concurrently
-#define MAX_TELEGRAMS 2     //Max number of Telegrams in master queue
+#define MAX_TELEGRAMS 2     //Max number of Telegrams in master queue, one more is kept for ModbusQueryInject(). 1 to 30
+#define MAX_USER_FUNCTIONS 4 //Max number of function codes added with ModbusRegisterFunction()
+#define MB_TASK_STACK  (128 * 4) //Stack size of the Modbus tasks in bytes
+
+/* Uncomment and set to 0 the following lines to remove the master or the slave code, and their fields of
+ * modbusHandler_t, from the build. Both roles are enabled by default */
+//#define MB_ENABLE_MASTER 1
+//#define MB_ENABLE_SLAVE 1
+
+/* Uncomment and set to 0 the following lines to remove function codes from the slave, it then answers them
+ * with an illegal function exception. All of them are enabled by default, a read only node keeps FC1 to FC4 */
+//#define MB_ENABLE_FC1  1  // Read coils
+//#define MB_ENABLE_FC2  1  // Read discrete inputs
+//#define MB_ENABLE_FC3  1  // Read holding registers
+//#define MB_ENABLE_FC4  1  // Read input registers
+//#define MB_ENABLE_FC5  1  // Write single coil
+//#define MB_ENABLE_FC6  1  // Write single register
+//#define MB_ENABLE_FC8  1  // Diagnostics, sub-functions 0x00, 0x0A to 0x12 (0x01 and 0x04 with ENABLE_MB_LISTEN_ONLY), off by default, needs ENABLE_MB_ERR_STATS
+//#define MB_ENABLE_FC15 1  // Write multiple coils
+//#define MB_ENABLE_FC16 1  // Write multiple registers
+//#define MB_ENABLE_FC20 1  // Read file record, files set by ModbusSetFiles()
+//#define MB_ENABLE_FC21 1  // Write file record
+//#define MB_ENABLE_FC22 1  // Mask write register
+//#define MB_ENABLE_FC23 1  // Read/write multiple registers
+//#define MB_ENABLE_FC24 1  // Read FIFO queue, queues set by ModbusSetFifos()
+//#define MB_ENABLE_FC43 1  // Read device identification (MEI type 14), objects set by ModbusSetDeviceId()
+//#define MB_ENABLE_FC_RANGES 1  // Read ranges: a list of (address, count) of one register table answered concatenated, off by default, master and slave
+//#define MB_RANGES_FC  65  // user defined function code of the read ranges, 65 to 72 or 100 to 110
+//#define MB_ENABLE_FC_DELTA 1  // Read delta: a block of ModbusSetDeltas() answered with the registers changed since the generation the master holds, off by default, master (ENABLE_MB_CACHE) and slave
+//#define MB_DELTA_FC  66  // user defined function code of the read delta, 65 to 72 or 100 to 110
+
+/* Uncomment the following line to serve all the handlers, masters and slaves, from one event driven Modbus task
+ * instead of one task per handler. */
+//#define ENABLE_MB_SHARED_TASK 1
+
+/* Uncomment the following line to have the UART, DMA and timer interrupts of all the handlers post their events for
+ * the shared task to a lock-free ring of MB_EVENT_RING entries (power of two) instead of a critical section and a
+ * notification each. Only the first event posted after the task emptied the ring wakes it, the next interrupts of
+ * the burst neither notify nor switch context and the task takes them all in one pass. A full ring falls back to
+ * the critical section, no event is lost. Needs ENABLE_MB_SHARED_TASK and the LDREX/STREX of a Cortex-M3 or higher */
+//#define ENABLE_MB_EVENT_RING 1
+//#define MB_EVENT_RING  32  // events waiting for the shared task, 2 bytes each
+
+/* Uncomment the following line to run the UART and DMA interrupts of the handlers above
+ * configMAX_SYSCALL_INTERRUPT_PRIORITY, where the critical sections of the kernel do not mask them. The bytes and
+ * FIFO blocks are still taken there, the T35 and timeout timer operations and the notifications of the task are
+ * recorded lock free and done in MB_DEFER_IRQn, an interrupt the application does not use otherwise, pended at
+ * MB_DEFER_PRIO: its handler calls ModbusDeferCallback(). ModbusInit() sets its priority and enables it. The
+ * interrupts at a kernel-aware priority call FreeRTOS directly as before. Needs a Cortex-M3 or higher, not
+ * available with ENABLE_TIM_T35, ENABLE_MB_TIMER_MUX, ENABLE_RX_MERGE and ENABLE_MB_FAST_READ, which take
+ * critical sections in the UART interrupts */
+//#define ENABLE_MB_ISR_DEFER 1
+//#define MB_DEFER_IRQn  EXTI15_10_IRQn  // software interrupt of the library, unused by the application
+//#define MB_DEFER_PRIO  configLIBRARY_LOWEST_INTERRUPT_PRIORITY  // NVIC priority of MB_DEFER_IRQn, kernel-aware
+
+/* Uncomment the following line to allocate the task, stack, timers, queue and semaphores of each handler inside
+ * modbusHandler_t instead of the FreeRTOS heap (needs configSUPPORT_STATIC_ALLOCATION). */
+//#define ENABLE_MB_STATIC 1
+
+/* Uncomment the following line to configure a handler from a const modbusConfig_t, kept in flash: xConfig of the
+ * handler points to it and ModbusInit() loads the role, the port, the flow control pin, the ID, the timeout, the
+ * tables and the task settings from it, so the application fills none of these fields at run time. The handler
+ * keeps its own copy, the frames never go through the pointer */
+//#define ENABLE_MB_CONST_CONFIG 1
+
+/* Uncomment the following line to build the library over the native FreeRTOS API, without CMSIS_RTOS_V2 and its
+ * cmsis_os2.c: ModbusPortRtos.h declares the osXxx() calls of the library as inline FreeRTOS calls, with the CMSIS
+ * priorities (scaled when configMAX_PRIORITIES is below 56). The project must not include cmsis_os.h itself. */
+//#define ENABLE_MB_NATIVE_RTOS 1
+
+/* Uncomment the following line to let the master merge queued FC3/FC4 reads of the same slave into one query.
+ * Reads whose ranges overlap or are at most MB_MERGE_GAP registers apart are sent as a single frame of up to
+ * 125 registers, the answer is copied back to the u16reg buffer of each telegram. With MB_ENABLE_FC_RANGES and the
+ * xMergeRanges of the master, reads of one slave too far apart are sent as one read ranges query of 125 registers */
+//#define ENABLE_MB_MERGE 1
+//#define MB_MERGE_GAP  4     // Registers that may be read in between two merged telegrams without being used
+//#define MB_MERGE_MAX  4     // Max number of telegrams merged into one query
+
+/* Uncomment the following line to cache ranges of slave data in the master (ModbusSetCache()). A read inside a range
+ * answered less than its xMaxAge ticks ago gets the cached values and ERR_OK_QUERY without a query on the bus.
+ * The answers of reads covering a range refresh it, the writes of the master to a range drop it */
+//#define ENABLE_MB_CACHE 1
+
+/* Uncomment the following line to give the master polls a report by exception mode. The FC3/FC4/FC23 answers of a
+ * poll with xOnChange are compared with its u16reg image while they are stored, xOnChange gets the list
+ * (address, old, new) of the changed registers and is not called when nothing changed */
+//#define ENABLE_MB_RBE 1
+//#define MB_RBE_CHANGES  16  // Changes listed per answer, more changes are only counted
+
+/* Uncomment the following line to let consumers subscribe to ranges of slave data (ModbusSubscribe()). Each answer of
+ * the master covering a range is compared with the values last reported to its subscription, the values that moved
+ * beyond its deadband are reported to its callback and posted to its queue, and nothing is reported otherwise */
+//#define ENABLE_MB_SUBSCRIBE 1
+
+/* Uncomment the following line to decode the answers of a serial master in a task of its own. Once an answer passed its
+ * CRC and checks, the master task copies its data to one of MB_DECODE_DEPTH slots and sends the next telegram at once,
+ * the decode task stores the data in u16reg under ModBusSphrHandle and calls the callbacks while the next query is on
+ * the wire. Merged, report by exception and cached answers and those of FC8, FC20, FC24 and FC43 are decoded by the
+ * master task as before, after the answers handed over before them, so the results keep their order */
+//#define ENABLE_MB_DEFERRED_DECODE 1
+//#define MB_DECODE_DEPTH  2                      // Answers waiting for the decode task, a full ring is decoded by the master task
+//#define MB_DECODE_PRIO   osPriorityBelowNormal  // Below the master task
+//#define MB_DECODE_STACK  (128 * 4)              // Stack of the decode task in bytes, it runs the callbacks
+
+/* Uncomment the following line to supervise the serial lines. A master waiting longer than the timeout of its query
+ * plus MB_WATCHDOG_TICKS lost the event of the timer or of the UART: the line is reset (UART and DMA aborted, the UART
+ * initialised again and the reception restarted) and the query goes on as if it timed out, sent again or failed with
+ * ERR_TIME_OUT. A transmission of a master or slave not completed in 250 ticks resets the line as well. Each reset
+ * is counted in u32Recoveries of the handler */
+//#define ENABLE_MB_WATCHDOG 1
+//#define MB_WATCHDOG_TICKS  100  // Wait of a master beyond the timeout of its query
+
+/* Uncomment the following line to let the master learn the answer time of each slave. Telegrams with u16timeOut = 0
+ * then wait mean + MB_TIMEOUT_K * deviation of the observed answer times, between MB_TIMEOUT_MIN and the handler u16timeOut */
+//#define ENABLE_MB_ADAPTIVE_TIMEOUT 1
+//#define MAX_SLAVES  8       // Slaves tracked by the master, the oldest entry is reused for a new slave
+//#define MB_TIMEOUT_K  4     // Deviations added to the mean answer time
+//#define MB_TIMEOUT_MIN  10  // Shortest adaptive timeout in ticks
+
+/* Uncomment the following line to stop polling slaves that do not answer. After MB_DEAD_TIMEOUTS consecutive timeouts
+ * the queries to a slave fail at once with ERR_SLAVE_OFFLINE, except one probe query every backoff period.
+ * The backoff doubles after each failed probe from MB_BACKOFF_MIN to MB_BACKOFF_MAX ticks. Uses the MAX_SLAVES table */
+//#define ENABLE_MB_BACKOFF 1
+//#define MB_DEAD_TIMEOUTS  3    // Consecutive timeouts before a slave is considered offline
+//#define MB_BACKOFF_MIN  1000   // First probe period in ticks
+//#define MB_BACKOFF_MAX  32000  // Longest probe period in ticks
+
+/* Uncomment the following line to keep per slave statistics in the master, for the first MB_NODE_STATS slave IDs it
+ * queries: queries sent, timeouts, CRC errors, exceptions and the smoothed answer time and jitter (ModbusGetNodes(),
+ * ModbusGetNodeStats()). A 256 bytes index by ID makes each update O(1). With ENABLE_MB_DIAG_REGS, a slave whose
+ * xNodeMaster points to the master serves the table after its diagnostics block (see MB_DIAG_NODES in Modbus.h) */
+//#define ENABLE_MB_NODE_STATS 1
+//#define MB_NODE_STATS  32  // Slaves tracked, the later ones are not
+
+/* Uncomment the following line to let a master on a serial line adapt its poll table to the bus. The wire time of
+ * every query and answer at the line settings, with T3.5, and the timeout of each query without answer add up to
+ * the bus load of a window of MB_ADAPT_WINDOW_MS (ModbusGetBusLoad()). Above MB_ADAPT_TARGET the periods of the polls
+ * with u8Priority from MB_ADAPT_PRIO are stretched, up to MB_ADAPT_SCALE_MAX and the u32MaxPeriodMs of each poll,
+ * and shortened back towards u32PeriodMs below it; the polls of higher priority keep their period, and so their
+ * deadlines. Each poll reports the period it runs with in u32EffPeriodMs and the one achieved in u32AchievedMs */
+//#define ENABLE_MB_POLL_ADAPT 1
+//#define MB_ADAPT_WINDOW_MS  1000  // Measurement window in ms
+//#define MB_ADAPT_TARGET     800   // Bus load kept at most, in 0.1 %
+//#define MB_ADAPT_PRIO       1     // Polls from this u8Priority may be slowed down
+//#define MB_ADAPT_SCALE_MAX  4000  // Longest stretch of their period, in 0.1 % of u32PeriodMs
+
+/* Uncomment the following line to publish the input registers of a slave as double buffered snapshots
+ * (ModbusSetROBanks()). A producer, also an ISR, fills ModbusROBackBank() and swaps it in with ModbusROPublish(),
+ * FC4 answers always come from one complete snapshot without taking a semaphore. */
+//#define ENABLE_MB_RO_SNAPSHOT 1
+
+/* Uncomment the following line to commit the holding register writes of a slave as a whole (ModbusSetHRBanks()).
+ * FC6, FC16, FC22 and FC23 write a staging bank, published with one sequence increment once the request is applied,
+ * and ModbusReadHR() copies registers of the committed bank without semaphore: a reader never sees half of a frame,
+ * a 32-bit position and its velocity for instance. The application writes them under ModbusLock() and commits its
+ * writes with ModbusHRCommit(). Only for a plain u16regsHR table, without xSegHR, xUnits or xRetain */
+//#define ENABLE_MB_HR_COMMIT 1
+
+/* Uncomment the following line to share the committed holding registers of ENABLE_MB_HR_COMMIT between slaves, an RTU
+ * and a TCP port serving one register map for instance. ModbusHRBankInit() sets up a bank with its own semaphore and
+ * ModbusSetHRBank() attaches a slave to it: the writes of all the slaves take that semaphore and are committed as a
+ * whole, their FC3 reads copy the committed registers without lock, in parallel. The application locks the bank with
+ * ModbusLock(modH, DB_HOLDING_REGISTER) of any of them and reads it with ModbusHRBankRead() */
+//#define ENABLE_MB_SHARED_HR 1
+
+/* Uncomment the following line to time stamp the samples of a slave. ModbusSetTimeSync() sets MB_TIME_REGS holding
+ * registers the master writes its time to with FC16, usually a broadcast, in milliseconds over 64 bits, most
+ * significant register first. ModbusGetTime() then runs from that time on the local clock, the 1 MHz timer of
+ * ENABLE_MB_TIMER_MUX or else the tick count, its rate corrected by up to MB_TIME_PPM_MAX from the error seen at each
+ * synchronisation. ModbusSegStamp() writes the time to the last MB_TIME_REGS registers of a segment once the
+ * application updated it, and with ENABLE_MB_RO_SNAPSHOT ModbusSetROStamp() lets ModbusROPublish() stamp each
+ * snapshot, so a master reads the values and their sample time in one FC3, FC4 or FC23 transaction */
+//#define ENABLE_MB_TIMESTAMP 1
+//#define MB_TIME_PPM_MAX 500
+
+/* Uncomment the following line to give each slave handler a TX buffer of MAX_BUFFER bytes. The answer is moved there
+ * and the slave task goes back to receiving while it is sent, instead of waiting for the end of the transmission. */
+//#define ENABLE_MB_TX_BUFFER 1
+
+/* Uncomment the following line to track the writes of the master in a slave. FC5, FC6, FC15, FC16, FC22 and FC23 set
+ * the bits of the written registers in the optional bitmaps u32DirtyHR and u32DirtyCoils and signal MB_DIRTY_HR or
+ * MB_DIRTY_COILS to the optional xWriteEvents event group and xWriteTask task. ModbusTakeDirty() collects the bitmap. */
+//#define ENABLE_MB_WRITE_NOTIFY 1
+
+/* Uncomment the following line for the hot standby node of a redundant slave pair on a serial line. In the listen only
+ * mode of ModbusSetListenOnly(), or of FC8 sub-function 0x04 with MB_ENABLE_FC8, the slave processes the requests for
+ * its ID, so its tables follow the writes of the master, and never transmits. Leaving the mode (0x01 Restart
+ * Communications) it answers at once with warm tables. ENABLE_MB_FAST_READ leaves its reads to the task meanwhile */
+//#define ENABLE_MB_LISTEN_ONLY 1
+
+/* Uncomment the following line to let the application update single coils of u16regsCoils without the coil semaphore
+ * (Cortex-M3 or higher). ModbusSetCoil() is a lock-free LDREXH/STREXH store, or one store to the bit-band alias of
+ * the coil with MB_COIL_BITBAND on the Cortex-M3/M4 parts that implement bit-banding (the table in the first MB of
+ * SRAM). FC5 and FC15 then update the coil words with LDREXH/STREXH too, so neither side loses the other's coils.
+ * A read of several words of the table still needs ModbusLock() for a consistent snapshot */
+//#define ENABLE_MB_ATOMIC_COILS 1
+//#define MB_COIL_BITBAND 1
+
+/* Uncomment the following line to protect the memory shared with the library with the ARMv7-M MPU (Cortex-M3, M4, M7).
+ * ModbusMpuProtect() gives each table of a slave an execute never region, read only for unprivileged code for the
+ * holding registers and coils, and ModbusMpuRegion() covers other memory, the MB_DMA_SECTION of the handlers for
+ * instance. A region is a power of two and its base aligned to it: declare the tables with MB_MPU_ALIGN(sizeof(table)).
+ * With FreeRTOS-MPU (needs ENABLE_MB_NATIVE_RTOS for privileged Modbus tasks) ModbusMpuTaskRegions() fills the
+ * regions of the unprivileged application tasks instead */
+//#define ENABLE_MB_MPU 1
+
+/* Uncomment the following line to support broadcast writes (unit ID 0) of FC5, FC6, FC15 and FC16. The master sends
+ * them and reports ERR_OK_QUERY MB_TURNAROUND ticks later (or after the u16timeOut of the telegram) without waiting for
+ * an answer, the slaves apply them to the tables of u8id and do not answer */
+//#define ENABLE_MB_BROADCAST 1
+//#define MB_TURNAROUND  100  // Turnaround delay after a broadcast in ticks
+
+/* Uncomment the following line to stamp each stage of a slave transaction with the DWT cycle counter (Cortex-M3 or
+ * higher): end of frame, task wake-up, validation, processing, start and end of the answer. The records of the last
+ * MB_TRACE_DEPTH transactions are kept in the handler and read with ModbusGetTrace(). Nothing is compiled without it */
+//#define ENABLE_MB_TRACE 1
+//#define MB_TRACE_DEPTH  8  // Transactions kept per handler
+
+/* Uncomment the following lines to mark the stages of a transaction on GPIO pins of MB_PROBE_PORT, for a logic
+ * analyzer beside the RS485 DE line (EN_Port/EN_Pin): each pin is raised by one BSRR write at its stage, the end
+ * of a frame lowers them all first and the end of the transmission lowers them again. The rising edges give the
+ * latencies of the slave to the cycle without the cost of the trace. Pins left at 0 are not driven, the
+ * application configures the used ones as push-pull outputs */
+//#define ENABLE_MB_PROBES 1
+//#define MB_PROBE_PORT       GPIOB
+//#define MB_PROBE_RX_END     GPIO_PIN_0  // end of the frame: T35, receiver timeout or idle event
+//#define MB_PROBE_WAKE       GPIO_PIN_1  // task woken for the frame
+//#define MB_PROBE_VALIDATED  0           // end of validateRequest()
+//#define MB_PROBE_PROCESSED  GPIO_PIN_4  // answer built by the process function
+//#define MB_PROBE_TX_START   GPIO_PIN_5  // transmission started
+
+/* Uncomment the following line to build the library on a PC: ModbusPort.h then includes ModbusPortHost.h, with the
+ * fake UARTs of ModbusPortHost.c and the POSIX port of FreeRTOS, instead of main.h. MODBUS_HOST is such a build */
+//#define MB_PORT_HOST 1
+
+/* Uncomment the following line with MB_PORT_HOST to run the library on Linux, a gateway for instance: ModbusPortPosix.h
+ * replaces ModbusPortHost.h and the USART_HW and ASCII_HW handlers use ttys, see ModbusPortPosix.c. Set pcDevice, Init,
+ * u8Loop and xRs485 of each UART_HandleTypeDef and call HAL_UART_Init() before ModbusStart(). MB_POSIX_LOOPS epoll
+ * loop tasks serve the ports, the engine runs on the POSIX port of FreeRTOS. Ports reach 2000000 baud. With ENABLE_TCP
+ * or ENABLE_UDP the TCP_HW and UDP_HW handlers use kernel sockets, served by loop 0; MB_POSIX_NET_TIMEOUT bounds in ticks
+ * the connection of a TCP master and a write to a full socket */
+//#define MB_PORT_POSIX 1
+//#define MB_POSIX_LOOPS 1
+//#define MB_POSIX_NET_TIMEOUT 3000
+
+/* Trace hooks, empty by default: MB_HOOK_ISR_ENTER/EXIT(id) around the UART and TIM callbacks, MB_HOOK_ENTER/EXIT(id)
+ * around the T35 and timeout timer callbacks and the processing of each function code. The IDs are the MB_HOOK_*
+ * constants of Modbus.h and ModbusHookName() names them. For SEGGER SystemView, for instance:
+ *   #include "SEGGER_SYSVIEW.h"
+ *   #define MB_HOOK_ISR_ENTER(u32Id)  SEGGER_SYSVIEW_RecordEnterISR()
+ *   #define MB_HOOK_ISR_EXIT(u32Id)   SEGGER_SYSVIEW_RecordExitISR()
+ *   #define MB_HOOK_ENTER(u32Id)      SEGGER_SYSVIEW_OnUserStart(u32Id)
+ *   #define MB_HOOK_EXIT(u32Id)       SEGGER_SYSVIEW_OnUserStop(u32Id) */
+//#define MB_HOOK_ENTER(u32Id)
+//#define MB_HOOK_EXIT(u32Id)
+
+/* Uncomment the following line to add ModbusBenchmark() to the slave (Cortex-M3 or higher): CPU cycles of calcCRC()
+ * and calcCRCByte() at 8 to 256 bytes, of the FC3 answers of 1 to 125 registers, of the FC1 answers of 1 to 2000
+ * coils and of validateRequest(), to choose CRC_MODE and catch regressions. Divide by SystemCoreClock for seconds */
+//#define ENABLE_MB_BENCH 1
+
+/* Uncomment the following line to add ModbusWcet() to the slave (Cortex-M3 or higher): the slowest of MB_WCET_RUNS
+ * runs of validateRequest() and of the process function of FC1 to FC6, FC15, FC16, FC22 and FC23 on their worst case
+ * requests (longest frames, first and last addresses, unaligned coils), per function code with the configuration of
+ * the build and the handler, and false when one of them exceeds a cycle budget. The writes store the values already
+ * in the tables. Keep the reports of each build to catch the regressions of the response time */
+//#define ENABLE_MB_WCET 1
+
+/* Uncomment the following line to add ModbusFuzzFrame() to the slave, the target of the libFuzzer and AFL harness of
+ * MODBUS_HOST: one received frame goes through the size checks of the slave loop, validateRequest() and the process
+ * function, the answer or the exception is left in u8Buffer and never sent, with the cost of the frame read from
+ * MB_COST_CLOCK(). The DWT cycle counter by default, a host build without it defines MB_COST_CLOCK() to its own clock
+ * (clock_gettime() for instance) so the harness can abort on a frame over its bound and keep it as a slow input */
+//#define ENABLE_MB_FUZZ 1
+//#define MB_COST_CLOCK()  hostNanoseconds()
+
+/* Uncomment the following line to add ModbusReplay() to the slave: a capture of the bus, records of the gap since the
+ * previous frame in microseconds (4 bytes), the length of the frame (2 bytes), both little endian, then the frame,
+ * is served by the slave path as ModbusFuzzFrame() does, with the timing of the capture or back to back. The report
+ * counts the answers, exceptions and dropped frames, the frames and bytes per tick and the cost of each frame in
+ * MB_COST_CLOCK() ticks, to measure an optimisation of the slave against the traffic of a real installation. On a
+ * PC, host_replay of MODBUS_HOST reads the capture from a file */
+//#define ENABLE_MB_REPLAY 1
+
+/* Uncomment the following line to record the last MB_EVENT_DEPTH bus events of all the handlers in a ring
+ * (Cortex-M3 or higher): frames received and sent, T35 and answer timeouts, with the cycle counter, slave ID,
+ * function code, length, CRC status and error. About 30 cycles per event, read with ModbusGetEvents() */
+//#define ENABLE_MB_EVENT_LOG 1
+//#define MB_EVENT_DEPTH  256  // Events kept, power of two
+
+/* Uncomment the following line to split u16errCnt in per cause counters (ModbusGetErrStats()): one per mb_errot_t code,
+ * one per exception code sent or received and the UART overrun, framing, noise and parity errors.
+ * The library then defines HAL_UART_ErrorCallback() in all the USART modes */
+//#define ENABLE_MB_ERR_STATS 1
+
+/* Uncomment the following line to serve the counters of a slave as MB_DIAG_REGS input registers from MB_DIAG_START
+ * (see MB_DIAG_IN_CNT in Modbus.h): traffic and error counters, task stack space and the latency summary of
+ * ENABLE_MB_STATS, read by FC4 from any unit ID. The block hides the input registers of its range */
+//#define ENABLE_MB_DIAG_REGS 1
+//#define MB_DIAG_START  0xF000  // Address of the diagnostics block
+
+/* Uncomment the following line to measure the CPU use of each handler (Cortex-M3 or higher): the share of its Modbus
+ * task from the run-time stats of FreeRTOS, the DWT cycles of its UART callbacks and the stack watermark of the task,
+ * read with ModbusGetRuntime() and in the MB_DIAG_TASK_LOAD and MB_DIAG_ISR_LOAD registers of ENABLE_MB_DIAG_REGS.
+ * FreeRTOSConfig.h sets configGENERATE_RUN_TIME_STATS and configUSE_TRACE_FACILITY to 1 with a run time counter,
+ * the DWT cycle counter for instance:
+ *   #define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS()  (CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk, DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk)
+ *   #define portGET_RUN_TIME_COUNTER_VALUE()          (DWT->CYCCNT)
+ * A 32-bit counter wraps, read the loads more often than its period (a minute at 64 MHz) */
+//#define ENABLE_MB_RUNTIME 1
+
+/* Uncomment the following line to keep log2 histograms with min, max and mean in the handlers (Cortex-M3 or higher):
+ * xStatFrame for the sizes of the received frames, xStatLatency of a slave for the microseconds from the end of a
+ * request to its answer and, in a master, the round trip ticks of each slave of the MAX_SLAVES table (ModbusGetRoundTrip()) */
+//#define ENABLE_MB_STATS 1
+
+/* Uncomment the following line to account the time of each serial handler on the line (Cortex-M3 or higher): the wire
+ * time of every frame it sends or takes, from its bytes and the word length, parity and stop bits of the UART, and the
+ * measured turnaround between a frame and its answer, from the cycle counter. ModbusGetWireStats() returns them with
+ * the bus utilisation, the idle time and the efficiency, the share of the busy time spent on the PDU bytes */
+//#define ENABLE_MB_WIRE_STATS 1
+
+/* CRC16 calculation backend, select one of:
+ * CRC_BITWISE -> shift/xor loop, 8 iterations per byte and no table
+ * CRC_TABLE   -> 256 entries lookup table, one lookup per byte (512 bytes of flash)
+ * CRC_NIBBLE  -> 16 entries lookup table, two lookups per byte (32 bytes of flash)
+ * CRC_HARDWARE-> CRC peripheral programmed for CRC-16/MODBUS, only on MCUs with a programmable
+ *                polynomial (F0, F3, F7, G0, G4, H7, L0, L4, WB...). Other MCUs fall back to CRC_TABLE
+ */
+#define CRC_MODE  CRC_TABLE
+
+/* Uncomment the following line to update the CRC in the RX interrupt (USART_HW mode only).
+ * The frame check after T35 becomes a single compare instead of a CRC over the whole frame. */
+//#define ENABLE_RX_CRC 1
+
+/* Uncomment the following line to detect T35 with the USART receiver timeout (RTOR) in USART_HW mode.
+ * The timeout is computed from the baud rate and the task is notified from the USART interrupt.
+ * Only for STM32 USARTs with receiver timeout (F0, F3, F7, G4, H7, L4, WB...), LPUARTs keep the software timer */
+//#define ENABLE_USART_RTO 1
+
+/* Uncomment the following line to receive through the USART RX FIFO in USART_HW mode (requires ENABLE_USART_RTO).
+ * The HAL drains a block of bytes per FIFO threshold interrupt instead of one interrupt per byte,
+ * the receiver timeout flushes the bytes under the threshold at the end of the frame. Only for USARTs with FIFO (G0, G4, H7, L5, WB...) */
+//#define ENABLE_USART_FIFO 1
+//#define USART_FIFO_THRESHOLD UART_RXFIFO_THRESHOLD_1_2 // RX FIFO threshold, 1/2 keeps margin for the interrupt latency
+
+/* Uncomment the following line to let the USART drive the RS485 DE pin in hardware (set xHwDE in the handler).
+ * The DE pin must be configured as USARTx_DE in Cube-MX, the turnaround times are set in bit times
+ * with u8DEAssertBits and u8DEDeassertBits. Only for USARTs with driver enable (F0, F3, F7, G4, H7, L4, WB...) */
+//#define ENABLE_USART_DE 1
+
+/* Uncomment the following line to detect T35 with a hardware timer in USART_HW mode.
+ * Assign the timer to xTimT35 in the handler, it must count at 1 MHz (prescaler set in Cube-MX) with the
+ * update interrupt enabled, and HAL_TIM_PeriodElapsedCallback() must call ModbusT35TimerCallback(htim).
+ * The library runs the timer in one-pulse mode, leave xTimT35 NULL to keep the software timer.
+ * Up to four handlers can share one free-running timer instead, each one with its compare channel in
+ * u8TimT35Channel: enable the capture compare interrupt and call ModbusT35CompareCallback(htim) from
+ * HAL_TIM_OC_DelayElapsedCallback(). Its period must be longer than T35 */
+//#define ENABLE_TIM_T35 1
+
+/* Uncomment the following line for battery powered nodes on an LPUART (xTypeHW = LPUART_HW).
+ * The port receives with one interrupt per byte like USART_HW and wakes the MCU from Stop mode (Stop2 on the WB)
+ * on MB_LPUART_WAKEUP, its kernel clock must keep running in Stop mode: LSE up to 9600 bps, or HSI.
+ * configPRE_SLEEP_PROCESSING() of the tickless idle calls ModbusLowPowerReady() to pick Stop or Sleep mode */
+//#define ENABLE_LPUART 1
+//#define MB_LPUART_WAKEUP UART_WAKEUP_ON_STARTBIT // RTU frames have no address mark, the start bit wakes the node
+
+/* Uncomment the following line to detect T35 of the LPUART_HW ports with an LPTIM, it keeps counting in Stop mode.
+ * Assign it to xLptimT35 (LPTIM1, not the HAL handle), clock it from the LSE at MB_LPTIM_HZ, enable its interrupt
+ * and its EXTI wake-up line, and call ModbusLptimCallback(LPTIM1) from LPTIM1_IRQHandler(). The LPTIM only
+ * runs while a frame is received, leave xLptimT35 NULL to keep the software timer */
+//#define ENABLE_LPTIM_T35 1
+//#define MB_LPTIM_HZ 32768
+
+/* Uncomment the following line for the tickless idle of FreeRTOS (configUSE_TICKLESS_IDLE): configPRE_SLEEP_PROCESSING(x)
+ * calls ModbusSleepHint(&x), which cancels the sleep while a handler needs the ticks and otherwise returns the depth
+ * allowed (MB_SLEEP_IDLE for Sleep mode, MB_SLEEP_STOP for Stop mode) with x shortened to the next request a slave
+ * expects from its poll period. A serial port suppresses the ticks between frames only when T35 is timed in hardware:
+ * ENABLE_USART_RTO, ENABLE_TIM_T35, ENABLE_LPTIM_T35 or ENABLE_MB_TIMER_MUX, or the IDLE event of USART_HW_DMA */
+//#define ENABLE_MB_TICKLESS 1
 
 #if ENABLE_TCP == 1
 #define NUMBERTCPCONN   4   // Maximum number of simultaneous client connections, it should be equal or less than LWIP configuration
-#define TCPAGINGCYCLES	1000 // Number of times the server will check for a incoming request before closing the connection for inactivity
-/* Note: the total aging time for a connection is approximately NUMBERTCPCONN*TCPAGINGCYCLES*u16timeOut ticks
+#define TCPIDLETIMEOUT  10000 // Ticks without a request before a connection is closed, 0 keeps it until the pool is full
+#define TCPTXBUFFER     1024  // Bytes of the answers to the requests pipelined by a client sent with one write, at least 6 + MAX_BUFFER
+#define TCPINFLIGHT     4   // Queries a TCP master sends before the first answer, matched by their transaction IDs
+/* Note: the slave task only wakes up for the lwIP events and the deadline of the oldest idle connection.
+ * A new client arriving when the NUMBERTCPCONN connections are in use replaces the least recently used one
 */
 #endif
 
+/* Uncomment the following line to make a TCP slave a gateway to RTU buses (ModbusSetGateway()). The requests to the
+ * unit IDs of a route are queued to the RTU master of its bus, each bus with its own task and queue, and answered
+ * when the bus completes them. The cache and the backoff of the bus master apply. A bus with MB_GW_BUS_QUERIES
+ * requests waiting answers 0x0A (path unavailable), a slave that does not answer gets 0x0B (target failed) */
+//#define ENABLE_MB_GATEWAY 1
+#if ENABLE_MB_GATEWAY == 1
+#define MB_GW_QUERIES      8   // Requests forwarded at the same time by the gateway, 32 at most
+#define MB_GW_BUS_QUERIES  2   // Requests waiting on one bus, the others get 0x0A
+#endif
+
+/* Uncomment the following line to use two RTU masters on redundant buses as one master (ModbusRedundantInit()).
+ * In failover mode a query goes to the bus that answered the slave last, with a short timeout and no retries,
+ * then to the other bus. In parallel mode it goes to both buses and the first answer wins, each query entry keeps
+ * two MB_RED_REGS scratch buffers for it. The health of both paths is kept per slave (ModbusRedundantPath()) */
+//#define ENABLE_MB_REDUNDANT 1
+#if ENABLE_MB_REDUNDANT == 1
+#define MB_RED_QUERIES  4   // Queries in progress at the same time on a redundant pair
+#define MB_RED_SLAVES   16  // Slaves whose path health is tracked, the oldest entry is replaced
+#endif
+
+/* Uncomment the following line to add ModbusDiscover() to the master: it probes a range of slave IDs on several
+ * buses at the same time, one FC3 or FC43 probe in flight per bus without retries. The timeout of a probe is the
+ * transmission of the query and of its answer at the baud rate of the bus, T3.5 and MB_DISCOVER_REPLY_US, so a
+ * scan of 247 IDs takes seconds. The IDs that answered and their latencies are kept per bus in modbusDiscovery_t */
+//#define ENABLE_MB_DISCOVERY 1
+//#define MB_DISCOVER_REPLY_US 2000  // Time a slave takes to answer a probe
+
+/* Uncomment the following line to add ModbusStress() to the master, a load generator to qualify the slaves: queries
+ * picked from a weighted mix of IDs, function codes and ranges are sent back to back, each one as soon as the last
+ * one completes, the register reads compared to a model of the slave that the writes keep up to date. It reports the
+ * queries, answers, exceptions, timeouts, other errors and mismatches with a histogram of the latencies in ticks,
+ * and adds to them at each call so a soak test of hours is a loop of calls with a report between them */
+//#define ENABLE_MB_STRESS 1
+
+/* Uncomment the following line to add ModbusBatchSubmit() to the master: a list of telegrams, each with its master,
+ * is sent on all the buses at the same time and reported once, by a callback or a notification of the calling task.
+ * A bus has one telegram of the batch in its queue at a time, the results are kept per telegram */
+//#define ENABLE_MB_BATCH 1
+
+/* Uncomment the following line to add the firmware update module of ModbusOta.h to a slave (ModbusOtaInit()). The image
+ * arrives in order as FC21 file records (MB_OTA_FILE()) or FC16 writes to a register window (MB_OTA_WINDOW()), each request
+ * is copied to one of two MB_OTA_CHUNK buffers and answered while the update task programs the other one into the
+ * download slot and updates the CRC-32 read back from the flash. The flash stalls the CPU while it erases a page, so the
+ * slave should receive with DMA (ENABLE_USART_DMA) to keep the bytes of the next request */
+//#define ENABLE_MB_OTA 1
+#if ENABLE_MB_OTA == 1
+#define MB_OTA_CHUNK      256  // Bytes of each chunk buffer, a multiple of 8 that divides FLASH_PAGE_SIZE
+#define MB_OTA_WAIT       50   // Ticks a request waits for a free chunk buffer before it is answered 0x06 (slave busy)
+#define MB_OTA_TASK_PRIO  osPriorityBelowNormal
+#define MB_OTA_STACK      (128 * 4)
+/* With the wireless stack running on CPU2 the flash is shared, define these two to also take and release its semaphores */
+//#define MB_OTA_FLASH_BEGIN()  HAL_FLASH_Unlock()
+//#define MB_OTA_FLASH_END()    HAL_FLASH_Lock()
+#endif
+
+/* Uncomment the following line to let a master send prebuilt frames (modbus_t u8Frame). The frame and CRC of a fixed
+ * telegram, a read of a poll table for example, are built once by ModbusBuildFrame() or at compile time by the
+ * constexpr builders of ModbusFrame.hpp, a serial master then transmits the frame straight from RAM or flash
+ * without building the query and computing its CRC at every cycle. Prebuilt telegrams are never merged */
+//#define ENABLE_MB_PREBUILT 1
+
+/* Uncomment the following line to give master telegrams native values (modbus_t pvValues, u8Type and u8Order). The
+ * register image of a FC3, FC4 or FC23 answer is converted to floats, 32 or 64 bit integers or a string once before
+ * the result is reported, and the values of a FC16 write are converted to its image before it is sent. The word
+ * and byte order (mb_wordorder_t) is the one of the slave. The slave tables have the same typed views without it,
+ * ModbusGetValues() and ModbusSetValues() */
+//#define ENABLE_MB_TYPED 1
+
+/* Uncomment the following line to let a master read into a gather list (modbus_t xGather). Each sub-range of the
+ * registers read by FC3, FC4 or FC23 is written from the answer straight to its own buffer, converted to its
+ * mb_type_t, instead of one contiguous u16reg image the application copies apart. Gather telegrams are not merged,
+ * not cached and do not report by exception */
+//#define ENABLE_MB_GATHER 1
+
+/* Uncomment the following line to let the USART_HW_DMA slaves with xFastRead answer plain FC1 to FC4 reads in the
+ * RX event interrupt, without waking the slave task. Reads of segments with an on-read callback, of the diagnostics
+ * block or of units, tables locked by the application and all the other requests still go to the task.
+ * Needs ENABLE_MB_TX_BUFFER, the answer is built in u8BufferTX */
+//#define ENABLE_MB_FAST_READ 1
+
+/* Uncomment the following line to drive T3.5 and the master timeouts of all the handlers from one free-running
+ * 32-bit TIM counting at 1 MHz instead of two software timers per handler. Call ModbusSetTimer() before ModbusInit()
+ * and ModbusTimerCallback() from HAL_TIM_OC_DelayElapsedCallback(), the multiplexer uses compare channel 1.
+ * ENABLE_TIM_T35, ENABLE_LPTIM_T35 and ENABLE_USART_RTO still end frames in hardware when set */
+//#define ENABLE_MB_TIMER_MUX 1
+
+/* Uncomment the following line to merge the fragments of a frame split by silences inside it. The IDLE event of the
+ * DMA modes ends a frame only when its CRC matches, otherwise the next fragments are appended until T35 elapsed
+ * after the last one. With ENABLE_MB_ERR_STATS the silences longer than T1.5 of USART_HW frames and the merged
+ * fragments are counted in u32Gaps */
+//#define ENABLE_RX_MERGE 1
+
+/* Uncomment the following line to end a received frame as soon as the length announced by its header arrived with
+ * a matching CRC, 3.5 characters before T35 or the IDLE event. USART_HW_DMA receives the header, then the rest of
+ * the frame, with programmed transfer counts. Function codes without a predictable length still end at T35.
+ * Needs ENABLE_RX_CRC */
+//#define ENABLE_RX_PREDICT 1
+
+/* Uncomment the following line to let the USART of a USART_HW or LPUART_HW slave mute the frames of the other slaves:
+ * once the address of a frame fails the filter of the RX interrupt, the receiver is put in mute mode and wakes up at
+ * the next idle line, so the rest of the frame raises no interrupt. The wake-up is the idle line one, Modbus RTU
+ * addresses have no address mark. A silence of a character inside a frame of another slave wakes the receiver early,
+ * its next byte is then filtered as an address */
+//#define ENABLE_MB_RX_MUTE 1
+
+/* Uncomment the following line to keep the answers of a slave within u32TurnMinUs and u32TurnMaxUs of its handler,
+ * counted from the end of the request. An earlier answer waits for u32TurnMinUs, an answer later than u32TurnMaxUs
+ * is dropped and counted as no response. With ENABLE_MB_TIMER_MUX the multiplexer starts the delayed answer,
+ * otherwise the task waits on the cycle counter. 0 disables a limit */
+//#define ENABLE_MB_TURNAROUND 1
+
+/* Uncomment the following line to hold a slave to a budget, a token bucket of u16ReqRate requests per second, up to
+ * u16ReqBurst in a row, and one of u32CpuUs microseconds of processing per second, measured on the cycle counter.
+ * A valid request over either budget is answered EXC_BUSY without being processed, so a master flooding the slave
+ * cannot starve the lower priority tasks. With ENABLE_MB_ERR_STATS those requests are counted in u32Throttled.
+ * 0 disables a limit. A slave with a limit set answers no read in the interrupt with ENABLE_MB_FAST_READ, the task
+ * takes all its requests from the budget */
+//#define ENABLE_MB_THROTTLE 1
+
+/* Uncomment the following line to recover the last complete frame of an overflowed RX ring of the USART_HW and
+ * LPUART_HW modes instead of dropping all its bytes. A frame starts with a unit ID received by the handler and ends
+ * at a matching CRC, the recovered frames are counted in u32Resync of ENABLE_MB_ERR_STATS */
+//#define ENABLE_RX_RESYNC 1
+
+/* Uncomment the following line to add the MB_MONITOR handler type, a passive listener of a USART_HW_DMA_CIRC bus.
+ * It pairs each request with its answer and keeps per slave the requests, answers, exceptions, missing answers, CRC
+ * errors and a latency histogram, plus the silences before the frames, see ModbusGetMonitor(). The frames are placed
+ * in time from their idle event. With ENABLE_MB_TRACE the paired transactions fill the trace ring. Needs
+ * ENABLE_USART_DMA, MB_MONITOR_SLAVES sets the slaves tracked (8) */
+//#define ENABLE_MB_MONITOR 1
+
+/* Uncomment the following line to keep the holding registers and coils of a slave in a flash journal (ModbusPersist.h,
+ * ModbusPersistInit()). Each register written by the master is appended as one double word record to the active page,
+ * a full page is compacted into the next one of the region with a snapshot of the tables, and the newest page is
+ * replayed into the tables before ModbusStart(). Needs ENABLE_MB_WRITE_NOTIFY and the u32DirtyHR and u32DirtyCoils
+ * bitmaps. The flash stalls the CPU while it erases a page, so the slave should receive with DMA (ENABLE_USART_DMA) */
+//#define ENABLE_MB_PERSIST 1
+#if ENABLE_MB_PERSIST == 1
+#define MB_PERSIST_REGS       256  // Largest table kept, in registers or coil words
+#define MB_PERSIST_DELAY      20   // Ticks a burst of writes settles before its records are programmed
+#define MB_PERSIST_TASK_PRIO  osPriorityBelowNormal
+#define MB_PERSIST_STACK      (128 * 4)
+/* With the wireless stack running on CPU2 the flash is shared, define these two to also take and release its semaphores */
+//#define MB_PERSIST_FLASH_BEGIN()  HAL_FLASH_Unlock()
+//#define MB_PERSIST_FLASH_END()    HAL_FLASH_Lock()
+#endif
+
+/* Uncomment the following line to keep the tables and counters of a slave across a watchdog or software reset. Place
+ * u16regsHR, u16regsCoils and a modbusRetain_t in MB_RETAIN memory (the .noinit section of the linker script) and set
+ * xRetain. ModbusInit() checks the CRC of the tables and sets xRetained when they survived, the application then skips
+ * their initialisation. The slave seals the image after every write of the master, ModbusRetainSeal() after the writes
+ * of the application */
+//#define ENABLE_MB_RETAIN 1
+
+/* Uncomment the following line to give the holding register segments of a slave write permissions. u32ReadOnly and
+ * u32Locked of a segment are bitmaps of its registers: a write to a read-only register is refused with EXC_ADDR_RANGE,
+ * one to a locked register with EXC_EXECUTE unless the application sets xWriteUnlocked. The request is checked a word
+ * of the bitmap at a time before the first register changes. A master that may only read gets its own unit id
+ * (xUnits) whose segments share the memory with u32ReadOnly set */
+//#define ENABLE_MB_ACCESS 1
+
+/* Uncomment the following line to check the values the master writes to the holding register segments of a slave.
+ * xLimits of a segment is a sorted table of register ranges with their min/max or list of accepted values. The whole
+ * payload of FC6, FC16 and FC23 is checked before the first register is stored, and the result of FC22 before it
+ * replaces the register, a value out of its limit refuses the write with EXC_REGS_QUANT (illegal data value) */
+//#define ENABLE_MB_LIMITS 1
+
+/* Uncomment the following line when the segments of a slave come from Tools/ModbusMapGen.py. The generator writes the
+ * storage, segment table, access bitmaps, limits and accessors of a CSV or JSON register map, and ModbusMapLookup(),
+ * which finds the segment of a request with a direct index table or with comparisons against the constants of the map.
+ * findSegment() then calls it in place of its binary search, the tables of other maps are still searched */
+//#define ENABLE_MB_MAP_LOOKUP 1
+
+/* Uncomment the following line to enable Modbus ASCII framing, xTypeHW = ASCII_HW. The RX interrupt finds the ':' and
+ * CRLF of a frame and decodes its hex pairs with a table into the RX ring, the task checks the LRC and serves the frame
+ * with the same process_FCx and SendQuery code as RTU, the answer is encoded back to text before it is sent. T35 is
+ * not used, prebuilt telegrams (ENABLE_MB_PREBUILT) are built again since their frame carries a CRC */
+//#define ENABLE_MB_ASCII 1
+
+/* Uncomment the following line to let a slave find the baud rate of an unknown bus with ModbusAutoBaud(). The slave is
+ * reconfigured to each candidate rate in turn (ModbusReconfigure()) until a request for its ID passes the CRC check,
+ * the one every request already goes through, and then keeps that rate */
+//#define ENABLE_MB_AUTOBAUD 1
+
+/* Uncomment the following line to share a serial bus between several masters. Each master gets a slot u8ArbSlot of
+ * u8ArbSlots and sends a query only after the line was idle for u32ArbIdleUs plus its slot, the end of every frame
+ * on the bus restarts the idle time and the master that had the last transaction waits one more round, the masters
+ * take the bus in turn without a token frame. Bus activity is seen through traceFrame() and the USART BUSY flag */
+//#define ENABLE_MB_ARBITRATION 1
+
+/* Uncomment the following line to pace the queries of a master on a serial line: a query goes out once the line was
+ * silent for T3.5 plus a guard since the end of the last frame, u32PaceGuardUs of the handler or the guard of the
+ * slave set by ModbusSetGuards(). Only the rest of the silence after the frame end was detected is waited for, so
+ * back to back queries follow each other by the minimum gap. With ENABLE_MB_TIMER_MUX the MB_TIMER_TIMEOUT slot of the
+ * handler starts the query, otherwise the task waits on the cycle counter. Not applied to ASCII_HW */
+//#define ENABLE_MB_PACING 1
+
+/* Uncomment the following line to let a master run a time-triggered cycle, see ModbusSetSchedule(). Every telegram
+ * of the table gets a slot sized from the wire time of its query and answer at the line settings, T3.5 and the
+ * turnaround of the slaves. The compare of the ENABLE_MB_TIMER_MUX timer sends each query at the offset of its slot
+ * from the interrupt, the task only builds the next frame and takes the answers, so the queries start with the jitter
+ * of the interrupt latency instead of the one of the task. Needs ENABLE_MB_TIMER_MUX */
+//#define ENABLE_MB_TDMA 1
+
+/* Uncomment the following line to let a slave send its last answers to FC3 and FC4 again when the same request comes
+ * back and the table was not written since. The cache is keyed by the request ADU, CRC included, and MB_RESP_CACHE
+ * entries keep the answers with their CRC. Each table has a generation raised by the writes of the master, by the
+ * accessors of the register API and by ModbusTableChanged() */
+//#define ENABLE_MB_RESP_CACHE 1
+
+/* Uncomment the following line to keep the last MB_EXC_CACHE exception answers of a slave with their CRC. The
+ * exceptions come in bursts, a misconfigured master or an address scan gets the same few (ID, function code,
+ * exception code) answers, which then go out without a CRC computation. RTU framing only */
+//#define ENABLE_MB_EXC_CACHE 1
+//#define MB_EXC_CACHE 4
+
+/* Uncomment the following line to let a register segment keep its registers in the byte order of the frame
+ * (xWireOrder of modbusSegment_t). FC3 and FC4 answers are then a memcpy of the segment and FC16 writes copy the
+ * frame as it is, without a swap per register; a DMA can also fill or send the segment directly. The application
+ * reads and writes such a segment with ModbusSegGetU16() and ModbusSegSetU16(), which do the swap on its side */
+//#define ENABLE_MB_WIRE_ORDER 1
+
+/* Uncomment the following line to send the FC3 and FC4 answers of a wire order segment without copying the registers.
+ * The USART_HW_DMA frame goes out in three DMA transfers chained by the TX DMA interrupt: the header from u8Buffer, the
+ * registers from the segment and the CRC, computed over the same two parts. The table stays locked until the end of
+ * TX. Answers below MB_TX_GATHER_MIN registers are copied as before. Needs ENABLE_USART_DMA_LL and ENABLE_MB_WIRE_ORDER;
+ * the DMA of these parts has no linked list mode, the chaining is done by the interrupt */
+//#define ENABLE_MB_TX_GATHER 1
+
+/* Uncomment the following line to stream the FC3 and FC4 answers of the USART_HW_DMA slaves: the registers are put in
+ * two chunks of MB_TX_CHUNK bytes, the TX DMA interrupt sends one while it fills the other and the CRC follows the last
+ * one, accumulated chunk by chunk. The answer never has to be whole in RAM, so reads of 125 registers are served with a
+ * small MAX_BUFFER, and its transmission starts once the first chunk is ready. Answers that fit MAX_BUFFER and have
+ * less than MB_TX_STREAM_MIN registers are built as before, a wire order segment of ENABLE_MB_TX_GATHER is sent from
+ * the segment. The table stays locked until the end of TX. Needs ENABLE_USART_DMA_LL, not available with
+ * ENABLE_MB_TX_BUFFER, ENABLE_MB_SHARED_TASK and ENABLE_MB_RESP_CACHE */
+//#define ENABLE_MB_TX_STREAM 1
+//#define MB_TX_CHUNK       32  // bytes of each chunk, even
+//#define MB_TX_STREAM_MIN  32  // registers of the shortest answer streamed when it fits MAX_BUFFER
+
+/* Uncomment the following line on a Cortex-M7 (STM32F7, STM32H7) with the data cache on. The DMA frames are then
+ * cleaned from the cache before the TX DMA reads them, and the RX buffer is cleaned and invalidated before its DMA
+ * starts and invalidated before the received bytes are read. The RX buffer is aligned on a cache line, MAX_BUFFER_RX
+ * must be a multiple of 32. To avoid all the maintenance, place the handlers in a non-cacheable region (MPU) instead
+ * and define MB_DMA_SECTION to its attribute, e.g. __attribute__((section(".dma_buffers"))), for the declaration
+ * modbusHandler_t ModbusH MB_DMA_SECTION; */
+//#define ENABLE_MB_DCACHE 1
+
+/* Uncomment the following line to run the hot paths from RAM, without the flash wait states: calcCRC(), calcCRCByte(),
+ * the UART and timer callbacks, answerFastRead(), process_FC3() and the register copies go in MB_HOT_CODE_SECTION
+ * (".RamFunc" by default) and the CRC table in MB_HOT_DATA_SECTION (".RamData"). The linker scripts of the example
+ * copy both to SRAM1 with .data; for a CCM RAM (STM32G4) or the ITCM (STM32F7/H7) set the two sections to the ones of
+ * that memory, see STM32WB55RGVX_FLASH.ld. The HAL_UART_IRQHandler() of the HAL stays in flash */
+//#define ENABLE_MB_RAM_HOT 1
+//#define MB_HOT_CODE_SECTION ".ccmram"
+//#define MB_HOT_DATA_SECTION ".ccmram.table" // not the section of the code, GCC refuses code and data in one section
+
+/* Uncomment the following line to serve a slave over Bluetooth LE. A handler with xTypeHW = BLE_HW takes the request PDUs,
+ * without ID and CRC, from the writes of a GATT characteristic and answers in its notifications. The radio core of the
+ * STM32WB runs the stack, the GATT server of STM32_WPAN forwards the writes to ModbusBleRxCallback() and the connection
+ * and MTU exchange events to ModbusBleLink(), xBleNotify() updates the characteristic value. A PDU spans writes of
+ * MTU - 3 bytes and ends with a shorter one, CFG_BLE_MAX_ATT_MTU 256 and a characteristic of 253 bytes let a read of
+ * 125 registers fit in one notification. Slave only, not available with ENABLE_MB_SHARED_TASK or ENABLE_USART_DMA_INPLACE */
+//#define ENABLE_MB_BLE 1
+
 
 
 
@@ -12,24 +12,878 @@
 #include "ModbusConfig.h"
 #include <inttypes.h>
 #include <stdbool.h>
-#include "FreeRTOS.h"
-#include "cmsis_os.h"
-#include "task.h"
-#include "queue.h"
-#include "timers.h"
+#include "ModbusPort.h"
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" { // the C++ front end of ModbusRegisterMap.hpp links to the C library
+#endif
+
+/* CRC16 backends, selected with CRC_MODE in ModbusConfig.h */
+#define CRC_BITWISE  0
+#define CRC_TABLE    1
+#define CRC_NIBBLE   2
+#define CRC_HARDWARE 3
+
+#ifndef CRC_MODE
+#define CRC_MODE  CRC_BITWISE
+#endif
+
+#ifndef MAX_BUFFER_RX
+#define MAX_BUFFER_RX  MAX_BUFFER
+#endif
+
+#ifndef MAX_RX_FRAMES
+#define MAX_RX_FRAMES  4
+#endif
+
+#ifndef USART_FIFO_THRESHOLD
+#define USART_FIFO_THRESHOLD  UART_RXFIFO_THRESHOLD_1_2
+#endif
+
+#define MB_FIFO_BLOCK  16 // largest USART RX FIFO threshold in bytes (full 16-deep FIFO of the H7)
+
+#ifndef MAX_USER_FUNCTIONS
+#define MAX_USER_FUNCTIONS  4 // function codes that can be added with ModbusRegisterFunction()
+#endif
+
+/* roles and slave function codes built into the library, all enabled by default */
+#ifndef MB_ENABLE_MASTER
+#define MB_ENABLE_MASTER  1
+#endif
+
+#ifndef MB_ENABLE_SLAVE
+#define MB_ENABLE_SLAVE  1
+#endif
+
+#if MB_ENABLE_MASTER != 1 && MB_ENABLE_SLAVE != 1
+#error "Enable MB_ENABLE_MASTER, MB_ENABLE_SLAVE or both in ModbusConfig.h"
+#endif
+
+#ifndef MB_ENABLE_FC1
+#define MB_ENABLE_FC1  1
+#endif
+#ifndef MB_ENABLE_FC2
+#define MB_ENABLE_FC2  1
+#endif
+#ifndef MB_ENABLE_FC3
+#define MB_ENABLE_FC3  1
+#endif
+#ifndef MB_ENABLE_FC4
+#define MB_ENABLE_FC4  1
+#endif
+#ifndef MB_ENABLE_FC5
+#define MB_ENABLE_FC5  1
+#endif
+#ifndef MB_ENABLE_FC6
+#define MB_ENABLE_FC6  1
+#endif
+#ifndef MB_ENABLE_FC8
+#define MB_ENABLE_FC8  0
+#endif
+#ifndef MB_ENABLE_FC15
+#define MB_ENABLE_FC15  1
+#endif
+#ifndef MB_ENABLE_FC16
+#define MB_ENABLE_FC16  1
+#endif
+#ifndef MB_ENABLE_FC20
+#define MB_ENABLE_FC20  1
+#endif
+#ifndef MB_ENABLE_FC21
+#define MB_ENABLE_FC21  1
+#endif
+#ifndef MB_ENABLE_FC22
+#define MB_ENABLE_FC22  1
+#endif
+#ifndef MB_ENABLE_FC23
+#define MB_ENABLE_FC23  1
+#endif
+#ifndef MB_ENABLE_FC24
+#define MB_ENABLE_FC24  1
+#endif
+#ifndef MB_ENABLE_FC43
+#define MB_ENABLE_FC43  1
+#endif
+#ifndef MB_ENABLE_FC_RANGES
+#define MB_ENABLE_FC_RANGES  0
+#endif
+#ifndef MB_RANGES_FC
+#define MB_RANGES_FC  65
+#endif
+
+#ifndef MB_ENABLE_FC_DELTA
+#define MB_ENABLE_FC_DELTA  0
+#endif
+#ifndef MB_DELTA_FC
+#define MB_DELTA_FC  66
+#endif
+
+#if MB_ENABLE_FC_DELTA == 1 && !((MB_DELTA_FC >= 65 && MB_DELTA_FC <= 72) || (MB_DELTA_FC >= 100 && MB_DELTA_FC <= 110))
+#error "MB_DELTA_FC must be a user defined function code, 65 to 72 or 100 to 110"
+#endif
+#if MB_ENABLE_FC_DELTA == 1 && MB_ENABLE_FC_RANGES == 1 && MB_DELTA_FC == MB_RANGES_FC
+#error "MB_DELTA_FC and MB_RANGES_FC must differ"
+#endif
+
+#if MB_ENABLE_FC_RANGES == 1 && !((MB_RANGES_FC >= 65 && MB_RANGES_FC <= 72) || (MB_RANGES_FC >= 100 && MB_RANGES_FC <= 110))
+#error "MB_RANGES_FC must be a user defined function code, 65 to 72 or 100 to 110"
+#endif
+
+#if MB_ENABLE_SLAVE != 1 && (ENABLE_MB_RO_SNAPSHOT == 1 || ENABLE_MB_TX_BUFFER == 1 || ENABLE_MB_WRITE_NOTIFY == 1 || ENABLE_MB_HR_COMMIT == 1)
+#error "ENABLE_MB_RO_SNAPSHOT, ENABLE_MB_TX_BUFFER, ENABLE_MB_WRITE_NOTIFY and ENABLE_MB_HR_COMMIT need MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_SHARED_HR == 1 && ENABLE_MB_HR_COMMIT != 1
+#error "ENABLE_MB_SHARED_HR needs ENABLE_MB_HR_COMMIT"
+#endif
+
+#if ENABLE_MB_EVENT_RING == 1 && (ENABLE_MB_SHARED_TASK != 1 || !defined(__CORTEX_M) || __CORTEX_M == 0U)
+#error "ENABLE_MB_EVENT_RING needs ENABLE_MB_SHARED_TASK and the LDREX/STREX of a Cortex-M3 or higher"
+#endif
+
+#if ENABLE_MB_ISR_DEFER == 1 && (!defined(__CORTEX_M) || __CORTEX_M == 0U || !defined(MB_DEFER_IRQn))
+#error "ENABLE_MB_ISR_DEFER needs the BASEPRI and LDREXH/STREXH of a Cortex-M3 or higher and an MB_DEFER_IRQn"
+#endif
+
+#if ENABLE_MB_ISR_DEFER == 1 && (ENABLE_TIM_T35 == 1 || ENABLE_MB_TIMER_MUX == 1 || ENABLE_RX_MERGE == 1 || ENABLE_MB_FAST_READ == 1)
+#error "ENABLE_MB_ISR_DEFER is not available with ENABLE_TIM_T35, ENABLE_MB_TIMER_MUX, ENABLE_RX_MERGE and ENABLE_MB_FAST_READ"
+#endif
+
+#if ENABLE_MB_ATOMIC_COILS == 1 && (!defined(__CORTEX_M) || __CORTEX_M == 0U)
+#error "ENABLE_MB_ATOMIC_COILS needs the LDREXH/STREXH of a Cortex-M3 or higher"
+#endif
+
+#if ENABLE_MB_ATOMIC_COILS == 1 && MB_COIL_BITBAND == 1 && __CORTEX_M != 3U && __CORTEX_M != 4U
+#error "MB_COIL_BITBAND needs the bit-band region of a Cortex-M3 or M4"
+#endif
+
+#if ENABLE_MB_MAP_LOOKUP == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_MAP_LOOKUP needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_LISTEN_ONLY == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_LISTEN_ONLY needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_AUTOBAUD == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_AUTOBAUD needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_ARBITRATION == 1 && MB_ENABLE_MASTER != 1
+#error "ENABLE_MB_ARBITRATION needs MB_ENABLE_MASTER"
+#endif
+
+#if ENABLE_MB_PACING == 1 && MB_ENABLE_MASTER != 1
+#error "ENABLE_MB_PACING needs MB_ENABLE_MASTER"
+#endif
+
+#if ENABLE_MB_RESP_CACHE == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_RESP_CACHE needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_EXC_CACHE == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_EXC_CACHE needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_TIMESTAMP == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_TIMESTAMP needs MB_ENABLE_SLAVE"
+#endif
+#define MB_TIME_REGS  4 // registers of a time of ENABLE_MB_TIMESTAMP, milliseconds over 64 bits, most significant first
+
+#if ENABLE_MB_WIRE_ORDER == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_WIRE_ORDER needs MB_ENABLE_SLAVE, it applies to the segments of a slave"
+#endif
+
+#if ENABLE_MB_TDMA == 1 && (MB_ENABLE_MASTER != 1 || ENABLE_MB_TIMER_MUX != 1 || ENABLE_MB_SHARED_TASK == 1)
+#error "ENABLE_MB_TDMA needs MB_ENABLE_MASTER and ENABLE_MB_TIMER_MUX, and a master task per handler"
+#endif
+
+#if ENABLE_MB_LIMITS == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_LIMITS needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_ACCESS == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_ACCESS needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_RETAIN == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_RETAIN needs MB_ENABLE_SLAVE"
+#endif
+#ifndef MB_RETAIN_SECTION
+#define MB_RETAIN_SECTION  ".noinit" // RAM section left alone by the startup code, see the linker script
+#endif
+#define MB_RETAIN        __attribute__((section(MB_RETAIN_SECTION))) // placement of the tables and of the modbusRetain_t kept across a reset
+#define MB_RETAIN_MAGIC  0x4D425254UL // u32Magic of a sealed image
+
+#if ENABLE_MB_RAM_HOT == 1
+#ifndef MB_HOT_CODE_SECTION
+#define MB_HOT_CODE_SECTION  ".RamFunc" // code copied to RAM with .data by the startup code, see the linker script
+#endif
+#ifndef MB_HOT_DATA_SECTION
+#define MB_HOT_DATA_SECTION  ".RamData" // tables copied to RAM with .data by the startup code
+#endif
+#define MB_HOT_CODE  __attribute__((section(MB_HOT_CODE_SECTION), noinline)) // CRC, interrupt callbacks and FC3 path
+#define MB_HOT_DATA  __attribute__((section(MB_HOT_DATA_SECTION)))           // CRC table
+#else
+#define MB_HOT_CODE
+#define MB_HOT_DATA
+#endif
+
+#if MB_ENABLE_FC8 == 1 && (MB_ENABLE_SLAVE != 1 || ENABLE_MB_ERR_STATS != 1)
+#error "MB_ENABLE_FC8 needs MB_ENABLE_SLAVE and the counters of ENABLE_MB_ERR_STATS"
+#endif
+
+#if ENABLE_MB_RX_MUTE == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_RX_MUTE needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_DIAG_REGS == 1 && (MB_ENABLE_SLAVE != 1 || MB_ENABLE_FC4 != 1)
+#error "ENABLE_MB_DIAG_REGS needs MB_ENABLE_SLAVE and MB_ENABLE_FC4"
+#endif
+
+#if ENABLE_MB_RX_QUEUE == 1 && (ENABLE_USART_DMA != 1 || ENABLE_USART_DMA_INPLACE == 1 || ENABLE_MB_ISR_DEFER == 1)
+#error "ENABLE_MB_RX_QUEUE needs ENABLE_USART_DMA, without ENABLE_USART_DMA_INPLACE and ENABLE_MB_ISR_DEFER"
+#endif
+
+#ifndef MB_RX_QUEUE_BYTES
+#define MB_RX_QUEUE_BYTES  (2 * (MAX_BUFFER + 4))
+#endif
+
+#if ENABLE_USART_DMA_INPLACE == 1 && (ENABLE_USART_DMA != 1 || MAX_BUFFER_RX != MAX_BUFFER || \
+		ENABLE_MB_SHARED_TASK == 1 || ENABLE_MB_TX_BUFFER == 1)
+#error "ENABLE_USART_DMA_INPLACE needs ENABLE_USART_DMA with MAX_BUFFER_RX equal to MAX_BUFFER, without ENABLE_MB_SHARED_TASK and ENABLE_MB_TX_BUFFER"
+#endif
+
+#if ENABLE_MB_TIMER_MUX == 1 && MAX_M_HANDLERS > 16
+#error "ENABLE_MB_TIMER_MUX keeps two deadlines per handler in 32 bits, MAX_M_HANDLERS is limited to 16"
+#endif
+#define MB_TIMER_T35      0 // deadline of the frame end of a handler, in the ENABLE_MB_TIMER_MUX slots
+#define MB_TIMER_TIMEOUT  1 // deadline of the answer of a master
+#define MB_TIMER_SLOTS    (2 * MAX_M_HANDLERS)
+
+#if ENABLE_MB_FAST_READ == 1 && (ENABLE_USART_DMA != 1 || ENABLE_MB_TX_BUFFER != 1 || ENABLE_MB_SHARED_TASK == 1)
+#error "ENABLE_MB_FAST_READ needs ENABLE_USART_DMA and ENABLE_MB_TX_BUFFER, without ENABLE_MB_SHARED_TASK"
+#endif
+
+#if ENABLE_USART_DMA_LL == 1 && ENABLE_USART_DMA != 1
+#error "ENABLE_USART_DMA_LL replaces the TX of ENABLE_USART_DMA"
+#endif
+
+#if ENABLE_MB_DCACHE == 1 && (ENABLE_USART_DMA != 1 || !defined(__DCACHE_PRESENT) || __DCACHE_PRESENT != 1)
+#error "ENABLE_MB_DCACHE needs ENABLE_USART_DMA on a core with a data cache (Cortex-M7)"
+#endif
+#define MB_DCACHE_LINE  32 // bytes of a data cache line of the Cortex-M7
+#if ENABLE_MB_DCACHE == 1 && MAX_BUFFER_RX % MB_DCACHE_LINE != 0
+#error "ENABLE_MB_DCACHE invalidates the RX buffer by cache lines, MAX_BUFFER_RX must be a multiple of MB_DCACHE_LINE"
+#endif
+#if ENABLE_MB_DCACHE == 1
+#define MB_DMA_ALIGN  __attribute__((aligned(MB_DCACHE_LINE))) // the RX buffer shares no cache line with other fields
+#else
+#define MB_DMA_ALIGN
+#endif
+#ifndef MB_DMA_SECTION
+#define MB_DMA_SECTION // attribute of the handlers, a non-cacheable section skips the cache maintenance
+#define MB_DCACHE_MAINT  (ENABLE_MB_DCACHE == 1)
+#else
+#define MB_DCACHE_MAINT  0
+#endif
+
+#if ENABLE_MB_MPU == 1
+#if !defined(__MPU_PRESENT) || __MPU_PRESENT != 1U || !defined(ARM_MPU_AP_URO)
+#error "ENABLE_MB_MPU needs the ARMv7-M MPU of a Cortex-M3, M4 or M7 (mpu_armv7.h)"
+#endif
+#if portUSING_MPU_WRAPPERS == 1 && ENABLE_MB_NATIVE_RTOS != 1
+#error "With FreeRTOS-MPU the Modbus tasks must be privileged, ENABLE_MB_MPU needs ENABLE_MB_NATIVE_RTOS"
+#endif
+/* region size of an MPU region covering n bytes, a table is aligned to it: uint16_t hr[64] MB_MPU_ALIGN(sizeof(hr)) */
+#define MB_MPU_SIZE(n)  ((n) <= 32 ? 32UL : (n) <= 64 ? 64UL : (n) <= 128 ? 128UL : (n) <= 256 ? 256UL : \
+		(n) <= 512 ? 512UL : (n) <= 1024 ? 1024UL : (n) <= 2048 ? 2048UL : (n) <= 4096 ? 4096UL : \
+		(n) <= 8192 ? 8192UL : (n) <= 16384 ? 16384UL : (n) <= 32768 ? 32768UL : 65536UL)
+#define MB_MPU_ALIGN(n)  __attribute__((aligned(MB_MPU_SIZE(n))))
+#endif
+
+#if ENABLE_MB_TX_GATHER == 1 && (ENABLE_USART_DMA_LL != 1 || ENABLE_MB_WIRE_ORDER != 1 || ENABLE_MB_TX_BUFFER == 1 || \
+		ENABLE_MB_SHARED_TASK == 1)
+#error "ENABLE_MB_TX_GATHER needs ENABLE_USART_DMA_LL and ENABLE_MB_WIRE_ORDER, without ENABLE_MB_TX_BUFFER and ENABLE_MB_SHARED_TASK"
+#endif
+#ifndef MB_TX_GATHER_MIN
+#define MB_TX_GATHER_MIN  16 // registers of the shortest answer sent from the segment, shorter ones are copied
+#endif
+
+#if ENABLE_MB_TX_STREAM == 1 && (ENABLE_USART_DMA_LL != 1 || ENABLE_MB_TX_BUFFER == 1 || ENABLE_MB_SHARED_TASK == 1 || \
+		ENABLE_MB_RESP_CACHE == 1)
+#error "ENABLE_MB_TX_STREAM needs ENABLE_USART_DMA_LL, without ENABLE_MB_TX_BUFFER, ENABLE_MB_SHARED_TASK and ENABLE_MB_RESP_CACHE"
+#endif
+#ifndef MB_TX_CHUNK
+#define MB_TX_CHUNK       32
+#endif
+#ifndef MB_TX_STREAM_MIN
+#define MB_TX_STREAM_MIN  32
+#endif
+#if ENABLE_MB_TX_STREAM == 1 && (MB_TX_CHUNK < 2 || (MB_TX_CHUNK & 1) != 0)
+#error "MB_TX_CHUNK must be an even number of bytes"
+#endif
+
+/* the answer of a slave goes out in DMA parts chained by txDoneDMA(), its payload outside u8Buffer */
+#define MB_TX_PARTS  (ENABLE_MB_TX_GATHER == 1 || ENABLE_MB_TX_STREAM == 1)
+
+#if ENABLE_MB_TURNAROUND == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_TURNAROUND needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_THROTTLE == 1 && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_THROTTLE needs MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_MONITOR == 1 && ENABLE_USART_DMA != 1
+#error "ENABLE_MB_MONITOR captures the bus with the circular DMA of ENABLE_USART_DMA"
+#endif
+#ifndef MB_MONITOR_SLAVES
+#define MB_MONITOR_SLAVES  8 // slaves tracked by the statistics of a monitor
+#endif
+
+#if ENABLE_MB_ASCII == 1
+#define MB_ASCII_MAX   (2 * MAX_BUFFER + 1) // ':', the hex pairs of the address, PDU and LRC, then CRLF
+#define MB_ASCII_NONE  0xFF // u8HexValue of a character that is no hex digit
+#endif
+
+#if ENABLE_RX_PREDICT == 1 && ENABLE_RX_CRC != 1
+#error "ENABLE_RX_PREDICT needs ENABLE_RX_CRC, a frame ends early only on a CRC match"
+#endif
+#define MB_RX_HEADER  11 // bytes of the longest request header before its length is known, FC23
+#if ENABLE_RX_PREDICT == 1
+#define MB_RX_DMA_FIRST  2 // bytes of the first USART_HW_DMA transfer of a frame, its address and function code
+#else
+#define MB_RX_DMA_FIRST  MAX_BUFFER
+#endif
+
+#if ENABLE_TCP == 1
+#ifndef NUMBERTCPCONN
+#define NUMBERTCPCONN  4
+#endif
+#ifndef TCPIDLETIMEOUT
+#define TCPIDLETIMEOUT  10000
+#endif
+#ifndef TCPTXBUFFER
+#define TCPTXBUFFER  1024
+#endif
+#define MB_TCP_NONE    0xFF         // end of the LRU list of the connections
+#define MB_TCP_ACCEPT  (1UL << 31)  // u32TcpReady: the listening netconn has a new client
+#endif
+
+#if ENABLE_TCP == 1 || ENABLE_UDP == 1
+#define MB_ENABLE_IP  1 // the MBAP transports on lwIP, TCP_HW and UDP_HW
+#ifndef TCPINFLIGHT
+#define TCPINFLIGHT  4
+#endif
+#define MB_TCP_PORT   502 // port of a TCP or UDP slave when u16TcpPort is 0
+#define MB_MBAP_SIZE  6   // transaction ID, protocol ID and length of the MBAP header, its unit ID is u8Buffer[ID]
+#endif
+#if ENABLE_MB_TLS == 1
+#define MB_TLS_PORT   802 // port of Modbus/TCP Security when u16TcpPort is 0
+#endif
+
+#if ENABLE_LPUART == 1
+#ifndef MB_LPUART_WAKEUP
+#define MB_LPUART_WAKEUP  UART_WAKEUP_ON_STARTBIT // Stop mode wake-up event of an LPUART_HW port
+#endif
+#endif
+
+#if ENABLE_LPTIM_T35 == 1
+#ifndef MB_LPTIM_HZ
+#define MB_LPTIM_HZ  32768 // counter clock of xLptimT35, the LSE
+#endif
+#endif
+
+#if ENABLE_LPTIM_T35 == 1 && ENABLE_LPUART != 1
+#error "ENABLE_LPTIM_T35 detects T35 of the LPUART_HW ports, it needs ENABLE_LPUART"
+#endif
+
+#if ENABLE_MB_TICKLESS == 1
+#if configUSE_TICKLESS_IDLE == 0
+#error "ENABLE_MB_TICKLESS is a hook of the tickless idle, set configUSE_TICKLESS_IDLE in FreeRTOSConfig.h"
+#endif
+#define MB_SLEEP_NONE  0 // the ticks must keep running, ModbusSleepHint() cancels the sleep
+#define MB_SLEEP_IDLE  1 // ticks suppressed in Sleep mode, the UARTs and timers of the handlers stay clocked
+#define MB_SLEEP_STOP  2 // Stop mode, every handler is an LPUART_HW port waiting for a frame
+#endif
+
+#if ENABLE_USB_CDC == 1
+#ifndef MB_USB_PACKET
+#define MB_USB_PACKET  64 // size of the bulk OUT packets, CDC_DATA_FS_MAX_PACKET_SIZE of a full speed device
+#endif
+#endif
+
+#if ENABLE_USB_CDC == 1 && (ENABLE_MB_SHARED_TASK == 1 || ENABLE_USART_DMA_INPLACE == 1)
+#error "ENABLE_USB_CDC is not available with ENABLE_MB_SHARED_TASK and ENABLE_USART_DMA_INPLACE"
+#endif
+
+#if ENABLE_USB_CDC == 1 && MAX_BUFFER < 2 * MB_USB_PACKET
+#error "MAX_BUFFER must hold at least two USB packets, 2 * MB_USB_PACKET bytes"
+#endif
+
+#if ENABLE_MB_BLE == 1
+#ifndef MB_BLE_MTU
+#define MB_BLE_MTU  23 // ATT MTU of a new connection before the exchange, for ModbusBleLink()
+#endif
+#define MB_BLE_PDU  253 // longest PDU, the 256 bytes of an RTU ADU without its ID and CRC
+#endif
+
+#if ENABLE_MB_BLE == 1 && (ENABLE_MB_SHARED_TASK == 1 || ENABLE_USART_DMA_INPLACE == 1)
+#error "ENABLE_MB_BLE is not available with ENABLE_MB_SHARED_TASK and ENABLE_USART_DMA_INPLACE"
+#endif
+
+#if ENABLE_MB_BLE == 1 && (MB_ENABLE_SLAVE != 1 || MAX_BUFFER < 256)
+#error "ENABLE_MB_BLE needs the slave and a MAX_BUFFER of 256 bytes, a PDU of 253 bytes and its ID and CRC"
+#endif
+
+#if MB_ENABLE_IP == 1 && (ENABLE_MB_SHARED_TASK == 1 || ENABLE_USART_DMA_INPLACE == 1)
+#error "ENABLE_TCP and ENABLE_UDP are not available with ENABLE_MB_SHARED_TASK and ENABLE_USART_DMA_INPLACE"
+#endif
+
+#if ENABLE_TCP == 1 && TCPTXBUFFER < MB_MBAP_SIZE + MAX_BUFFER
+#error "TCPTXBUFFER must hold at least one answer, MB_MBAP_SIZE + MAX_BUFFER bytes"
+#endif
+
+#if ENABLE_TCP == 1 && NUMBERTCPCONN > 31
+#error "NUMBERTCPCONN is limited to 31, one bit of u32TcpReady per connection"
+#endif
+
+#if ENABLE_MB_TLS == 1 && ENABLE_TCP != 1
+#error "ENABLE_MB_TLS secures the connections of ENABLE_TCP"
+#endif
+
+#if ENABLE_MB_GATEWAY == 1
+#ifndef MB_GW_QUERIES
+#define MB_GW_QUERIES  8
+#endif
+#ifndef MB_GW_BUS_QUERIES
+#define MB_GW_BUS_QUERIES  2
+#endif
+#define MB_GW_REGS  125 // data of the largest request, 125 registers or 2000 coils
+#endif
+
+#if ENABLE_MB_GATEWAY == 1 && (ENABLE_TCP != 1 || MB_ENABLE_MASTER != 1 || MB_ENABLE_SLAVE != 1)
+#error "ENABLE_MB_GATEWAY needs ENABLE_TCP, MB_ENABLE_MASTER and MB_ENABLE_SLAVE"
+#endif
+
+#if ENABLE_MB_GATEWAY == 1 && MB_GW_QUERIES > 32
+#error "MB_GW_QUERIES is limited to 32, one bit of u32GwDone per query"
+#endif
+
+#if ENABLE_MB_REDUNDANT == 1
+#ifndef MB_RED_QUERIES
+#define MB_RED_QUERIES  4
+#endif
+#ifndef MB_RED_SLAVES
+#define MB_RED_SLAVES  16
+#endif
+#define MB_RED_REGS  125 // data of the largest read, 125 registers or 2000 coils
+#endif
+
+#if ENABLE_MB_REDUNDANT == 1 && MB_ENABLE_MASTER != 1
+#error "ENABLE_MB_REDUNDANT needs MB_ENABLE_MASTER"
+#endif
+
+#if ENABLE_MB_DISCOVERY == 1
+#ifndef MB_DISCOVER_REPLY_US
+#define MB_DISCOVER_REPLY_US  2000 // time a slave takes to answer a probe, on top of the transmission times
+#endif
+#endif
+
+#if ENABLE_MB_DISCOVERY == 1 && MB_ENABLE_MASTER != 1
+#error "ENABLE_MB_DISCOVERY needs MB_ENABLE_MASTER"
+#endif
+
+#if ENABLE_MB_STRESS == 1 && MB_ENABLE_MASTER != 1
+#error "ENABLE_MB_STRESS needs MB_ENABLE_MASTER"
+#endif
+
+#if ENABLE_MB_BATCH == 1 && MB_ENABLE_MASTER != 1
+#error "ENABLE_MB_BATCH needs MB_ENABLE_MASTER"
+#endif
+
+#if (ENABLE_MB_PREBUILT == 1 || ENABLE_MB_TYPED == 1 || ENABLE_MB_GATHER == 1) && MB_ENABLE_MASTER != 1
+#error "ENABLE_MB_PREBUILT, ENABLE_MB_TYPED and ENABLE_MB_GATHER need MB_ENABLE_MASTER"
+#endif
+
+#if MB_ENABLE_MASTER != 1 && (ENABLE_MB_MERGE == 1 || ENABLE_MB_ADAPTIVE_TIMEOUT == 1 || ENABLE_MB_BACKOFF == 1 || \
+		ENABLE_MB_CACHE == 1 || ENABLE_MB_RBE == 1 || ENABLE_MB_SUBSCRIBE == 1)
+#error "ENABLE_MB_MERGE, ENABLE_MB_ADAPTIVE_TIMEOUT, ENABLE_MB_BACKOFF, ENABLE_MB_CACHE, ENABLE_MB_RBE and ENABLE_MB_SUBSCRIBE need MB_ENABLE_MASTER"
+#endif
+
+#if ENABLE_MB_WATCHDOG == 1 && !defined(MB_WATCHDOG_TICKS)
+#define MB_WATCHDOG_TICKS  100
+#endif
+
+#if ENABLE_MB_DEFERRED_DECODE == 1
+#if MB_ENABLE_MASTER != 1
+#error "ENABLE_MB_DEFERRED_DECODE needs MB_ENABLE_MASTER"
+#endif
+#ifndef MB_DECODE_DEPTH
+#define MB_DECODE_DEPTH  2
+#endif
+#if MB_DECODE_DEPTH < 1 || MB_DECODE_DEPTH > 128
+#error "MB_DECODE_DEPTH is 1 to 128"
+#endif
+#ifndef MB_DECODE_PRIO
+#define MB_DECODE_PRIO  osPriorityBelowNormal
+#endif
+#ifndef MB_DECODE_STACK
+#define MB_DECODE_STACK  (128 * 4)
+#endif
+#define MB_DECODE_BYTES  250 // data of the longest FC1 to FC4 or FC23 answer
+#endif
+
+// function codes implemented by the library
+#define MB_FUNCTIONS_BUILTIN  (MB_ENABLE_FC1 + MB_ENABLE_FC2 + MB_ENABLE_FC3 + MB_ENABLE_FC4 + MB_ENABLE_FC5 + \
+		MB_ENABLE_FC6 + MB_ENABLE_FC8 + MB_ENABLE_FC15 + MB_ENABLE_FC16 + MB_ENABLE_FC20 + MB_ENABLE_FC21 + \
+		MB_ENABLE_FC22 + MB_ENABLE_FC23 + MB_ENABLE_FC24 + MB_ENABLE_FC43 + MB_ENABLE_FC_RANGES + MB_ENABLE_FC_DELTA)
+
+// files of FC20 and FC21 served by a slave, see ModbusSetFiles()
+#define MB_SLAVE_FILES  (MB_ENABLE_SLAVE == 1 && (MB_ENABLE_FC20 == 1 || MB_ENABLE_FC21 == 1))
+// FIFO queues of FC24 served by a slave, see ModbusSetFifos()
+#define MB_SLAVE_FIFOS  (MB_ENABLE_SLAVE == 1 && MB_ENABLE_FC24 == 1)
+#define MB_FIFO_MAX     31 // entries of one FC24 answer
+// device identification objects of FC43/14 served by a slave, see ModbusSetDeviceId()
+#define MB_SLAVE_DEVID  (MB_ENABLE_SLAVE == 1 && MB_ENABLE_FC43 == 1)
+// register blocks answered with their changes by MB_FC_READ_DELTA, see ModbusSetDeltas()
+#define MB_SLAVE_DELTAS  (MB_ENABLE_SLAVE == 1 && MB_ENABLE_FC_DELTA == 1)
+// largest block of MB_FC_READ_DELTA: its full answer, header and CRC fit MAX_BUFFER
+#define MB_DELTA_REGS   (((MAX_BUFFER - DLT_DATA - 2) / 2) < 125 ? ((MAX_BUFFER - DLT_DATA - 2) / 2) : 125)
+// answer bytes of FC43/14 before the CRC: MAX_BUFFER less the CRC, 253 bytes of PDU at most
+#define MB_DEVID_ROOM   ((MAX_BUFFER - 2) < 254 ? (MAX_BUFFER - 2) : 254)
+// longest object, it must fit alone after the 8 byte header and its id and length
+#define MB_DEVID_MAX_LEN  (MB_DEVID_ROOM - 8 - 2)
+
+#if MB_ENABLE_SLAVE == 1
+#define MB_SEMAPHORES  4 // ModBusSphrHandle and the semaphores of the other tables of a slave
+#else
+#define MB_SEMAPHORES  1 // ModBusSphrHandle
+#endif
+
+#ifndef MB_TASK_STACK
+#define MB_TASK_STACK  (128 * 4) // stack of the Modbus tasks in bytes
+#endif
+
+/* events signalled to the Modbus task of a handler */
+#define MB_EV_RX       0x01 // frame received
+#define MB_EV_TIMEOUT  0x02 // no answer to the query of a master
+#define MB_EV_TX       0x04 // transmission completed
+#define MB_EV_QUERY    0x08 // telegram queued for a master
+#define MB_EV_RX_ERR   0x10 // the DMA reception stopped by a UART error waits for the task to restart it
+
+/* timer operations of the kernel-unaware interrupts done by ModbusDeferCallback(), see ENABLE_MB_ISR_DEFER.
+ * The MB_EV_ events take the low byte of u16DeferOps */
+#define MB_DEFER_T35         0x0100 // restart T35
+#define MB_DEFER_T35_STOP    0x0200 // stop T35
+#define MB_DEFER_TIMEOUT     0x0400 // start the answer timeout of a master
+#define MB_DEFER_TIMEOUT_STOP 0x0800 // stop it, the answer arrived
+
+#ifndef MB_DEFER_PRIO
+#define MB_DEFER_PRIO  configLIBRARY_LOWEST_INTERRUPT_PRIORITY
+#endif
+
+/* bits set in xWriteEvents and xWriteTask of a slave when the master writes a table, see ENABLE_MB_WRITE_NOTIFY */
+#ifndef MB_DIRTY_HR
+#define MB_DIRTY_HR     0x01 // holding registers written by FC6, FC16, FC22 or FC23
+#endif
+#ifndef MB_DIRTY_COILS
+#define MB_DIRTY_COILS  0x02 // coils written by FC5 or FC15
+#endif
+
+#define MB_DIRTY_WORDS(n)  (((n) + 31) / 32) // uint32_t words of a dirty bitmap for n registers
+
+/* IDs of the sections reported to the trace hooks, see ModbusHookName() */
+#define MB_HOOK_TX_CPLT   0 // HAL_UART_TxCpltCallback() or ModbusUsbTxCallback()
+#define MB_HOOK_RX_CPLT   1 // HAL_UART_RxCpltCallback()
+#define MB_HOOK_RX_EVENT  2 // HAL_UARTEx_RxEventCallback() or ModbusUsbRxCallback()
+#define MB_HOOK_T35       3 // vTimerCallbackT35(), ModbusT35TimerCallback() or ModbusTimerCallback()
+#define MB_HOOK_TIMEOUT   4 // vTimerCallbackTimeout() or ModbusTimerCallback()
+#define MB_HOOK_FC(fct)   (0x100 + (fct)) // process_FCx() or the registered handler of a function code
+
+/* trace hooks of the library, empty unless ModbusConfig.h maps them to a tracer */
+#ifndef MB_HOOK_ISR_ENTER
+#define MB_HOOK_ISR_ENTER(u32Id)
+#endif
+#ifndef MB_HOOK_ISR_EXIT
+#define MB_HOOK_ISR_EXIT(u32Id)
+#endif
+#ifndef MB_HOOK_ENTER
+#define MB_HOOK_ENTER(u32Id)
+#endif
+#ifndef MB_HOOK_EXIT
+#define MB_HOOK_EXIT(u32Id)
+#endif
+
+#ifndef MB_TRACE_DEPTH
+#define MB_TRACE_DEPTH  8
+#endif
+
+#if ENABLE_MB_PROBES == 1
+#ifndef MB_PROBE_PORT
+#error "ENABLE_MB_PROBES needs MB_PROBE_PORT, the GPIO port of the probe pins"
+#endif
+#ifndef MB_PROBE_RX_END
+#define MB_PROBE_RX_END     0 // GPIO_PIN_x raised at the end of a received frame, 0 for none
+#endif
+#ifndef MB_PROBE_WAKE
+#define MB_PROBE_WAKE       0 // raised when the task takes the frame
+#endif
+#ifndef MB_PROBE_VALIDATED
+#define MB_PROBE_VALIDATED  0 // raised at the end of validateRequest()
+#endif
+#ifndef MB_PROBE_PROCESSED
+#define MB_PROBE_PROCESSED  0 // raised when the answer is built
+#endif
+#ifndef MB_PROBE_TX_START
+#define MB_PROBE_TX_START   0 // raised when the transmission starts
+#endif
+#define MB_PROBE_ALL  ((uint32_t)(MB_PROBE_RX_END | MB_PROBE_WAKE | MB_PROBE_VALIDATED | MB_PROBE_PROCESSED | MB_PROBE_TX_START))
+/* BSRR word of a stage: its pin set, and at the end of a frame or of a transmission every pin reset first */
+#define MB_PROBE_BITS(xStage) \
+	((xStage) == MB_TS_RX_END ? (MB_PROBE_ALL << 16) | MB_PROBE_RX_END : \
+	 (xStage) == MB_TS_WAKE ? (uint32_t)MB_PROBE_WAKE : \
+	 (xStage) == MB_TS_VALIDATED ? (uint32_t)MB_PROBE_VALIDATED : \
+	 (xStage) == MB_TS_PROCESSED ? (uint32_t)MB_PROBE_PROCESSED : \
+	 (xStage) == MB_TS_TX_START ? (uint32_t)MB_PROBE_TX_START : MB_PROBE_ALL << 16)
+#define MB_PROBE(xStage)  ((MB_PROBE_BITS(xStage) != 0) ? (void)(MB_PROBE_PORT->BSRR = MB_PROBE_BITS(xStage)) : (void)0)
+#else
+#define MB_PROBE(xStage)  ((void)0)
+#endif
+
+#if (ENABLE_MB_TRACE == 1 || ENABLE_MB_STATS == 1 || ENABLE_MB_EVENT_LOG == 1 || ENABLE_MB_BENCH == 1 || ENABLE_MB_MONITOR == 1 || \
+	ENABLE_MB_WCET == 1 || ENABLE_MB_RUNTIME == 1 || ENABLE_MB_WIRE_STATS == 1) && !defined(DWT)
+#error "ENABLE_MB_TRACE, ENABLE_MB_STATS, ENABLE_MB_EVENT_LOG, ENABLE_MB_BENCH, ENABLE_MB_MONITOR, ENABLE_MB_WCET, ENABLE_MB_RUNTIME and ENABLE_MB_WIRE_STATS need the DWT cycle counter (Cortex-M3 or higher)"
+#endif
+
+#if ENABLE_MB_RUNTIME == 1 && (configGENERATE_RUN_TIME_STATS != 1 || configUSE_TRACE_FACILITY != 1)
+#error "ENABLE_MB_RUNTIME needs configGENERATE_RUN_TIME_STATS and configUSE_TRACE_FACILITY in FreeRTOSConfig.h"
+#endif
+
+#if (ENABLE_MB_BENCH == 1 || ENABLE_MB_WCET == 1 || ENABLE_MB_FUZZ == 1 || ENABLE_MB_REPLAY == 1) && MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_BENCH, ENABLE_MB_WCET, ENABLE_MB_FUZZ and ENABLE_MB_REPLAY need MB_ENABLE_SLAVE"
+#endif
+
+#define MB_REPLAY_HEADER  6 // bytes before each frame of a ModbusReplay() capture: gap in us, then length
+#ifndef MB_COST_CLOCK
+#ifdef DWT
+#define MB_COST_CLOCK()  (DWT->CYCCNT) // cost of a frame of ModbusFuzzFrame() and ModbusReplay() in CPU cycles
+#else
+#define MB_COST_CLOCK()  0 // no cycle counter, the host build defines a clock of its own
+#endif
+#endif
+
+#define MB_BENCH_SIZES  4 // sizes measured per kernel by ModbusBenchmark()
+#ifndef MB_BENCH_RUNS
+#define MB_BENCH_RUNS   8 // runs of each measure, the fastest one is kept
+#endif
+#define MB_WCET_FCS     10 // function codes measured by ModbusWcet(): 1 to 6, 15, 16, 22 and 23
+#ifndef MB_WCET_RUNS
+#define MB_WCET_RUNS    8 // runs of each request, the slowest one is kept
+#endif
+
+#ifndef MB_EVENT_DEPTH
+#define MB_EVENT_DEPTH  256
+#endif
+
+#if ENABLE_MB_EVENT_LOG == 1 && (MB_EVENT_DEPTH & (MB_EVENT_DEPTH - 1)) != 0
+#error "MB_EVENT_DEPTH must be a power of two"
+#endif
+
+#if ENABLE_MB_EVENT_LOG == 1 && (!defined(__CORTEX_M) || __CORTEX_M == 0U)
+#error "ENABLE_MB_EVENT_LOG needs the LDREX/STREX of a Cortex-M3 or higher"
+#endif
+
+#ifndef MB_EVENT_RING
+#define MB_EVENT_RING  32
+#endif
+
+#if ENABLE_MB_EVENT_RING == 1 && (MB_EVENT_RING & (MB_EVENT_RING - 1)) != 0
+#error "MB_EVENT_RING must be a power of two"
+#endif
+
+#define MB_HIST_BUCKETS  16 // log2 buckets of a histogram, the last one also counts the larger values
+#define MB_ERR_TYPES     12 // codes of mb_errot_t, from ERR_NOT_MASTER to ERR_SLAVE_OFFLINE
+#define MB_ERR_INDEX(e)  (-(e) - 1) // index of an mb_errot_t code in modbusErrStats_t
+#define MB_EXC_TYPES     11 // exception codes from 0x01 to 0x0B (gateway target failed)
+
+#if ENABLE_MB_STATIC == 1 && configSUPPORT_STATIC_ALLOCATION != 1
+#error "ENABLE_MB_STATIC needs configSUPPORT_STATIC_ALLOCATION in FreeRTOSConfig.h"
+#endif
+
+#ifndef MB_MERGE_GAP
+#define MB_MERGE_GAP  4
+#endif
+
+#ifndef MB_MERGE_MAX
+#define MB_MERGE_MAX  4
+#endif
+
+#if MB_ENABLE_MASTER == 1 && (MAX_TELEGRAMS < 1 || MAX_TELEGRAMS > 30)
+#error "MAX_TELEGRAMS must be 1 to 30, one bit of u32TelegramFree per pooled telegram"
+#endif
+#define MB_TELEGRAM_POOL  (MAX_TELEGRAMS + 2) // one more queued for MB_PRIO_URGENT, one for the query in progress
+
+#ifndef MAX_SLAVES
+#define MAX_SLAVES  8
+#endif
+
+#ifndef MB_NODE_STATS
+#define MB_NODE_STATS  32
+#endif
+#if ENABLE_MB_NODE_STATS == 1 && (MB_ENABLE_MASTER != 1 || MB_NODE_STATS < 1 || MB_NODE_STATS > 255)
+#error "ENABLE_MB_NODE_STATS needs MB_ENABLE_MASTER and MB_NODE_STATS of 1 to 255"
+#endif
+
+#ifndef MB_ADAPT_WINDOW_MS
+#define MB_ADAPT_WINDOW_MS  1000
+#endif
+#ifndef MB_ADAPT_TARGET
+#define MB_ADAPT_TARGET  800
+#endif
+#ifndef MB_ADAPT_PRIO
+#define MB_ADAPT_PRIO  1
+#endif
+#ifndef MB_ADAPT_SCALE_MAX
+#define MB_ADAPT_SCALE_MAX  4000
+#endif
+#if ENABLE_MB_POLL_ADAPT == 1 && (MB_ENABLE_MASTER != 1 || MB_ADAPT_TARGET < 1 || MB_ADAPT_TARGET > 1000 || \
+		MB_ADAPT_SCALE_MAX < 1000 || MB_ADAPT_SCALE_MAX > 0xFFFF)
+#error "ENABLE_MB_POLL_ADAPT needs MB_ENABLE_MASTER, MB_ADAPT_TARGET of 1 to 1000 and MB_ADAPT_SCALE_MAX of 1000 to 65535"
+#endif
+
+#ifndef MB_TURNAROUND
+#define MB_TURNAROUND  100
+#endif
+
+#ifndef MB_DIAG_START
+#define MB_DIAG_START  0xF000
+#endif
+
+/* input registers of the diagnostics block of ENABLE_MB_DIAG_REGS, offsets from MB_DIAG_START.
+ * The 32-bit values take two registers, high word first. The values of disabled features read 0 */
+enum
+{
+	MB_DIAG_IN_CNT = 0,       //!< u16InCnt
+	MB_DIAG_OUT_CNT = 1,      //!< u16OutCnt
+	MB_DIAG_ERR_CNT = 2,      //!< u16errCnt
+	MB_DIAG_STACK = 3,        //!< free stack of the Modbus task in bytes, ModbusGetStackSpace()
+	MB_DIAG_RX_OVERFLOW = 4,  //!< ERR_BUFF_OVERFLOW count, ENABLE_MB_ERR_STATS
+	MB_DIAG_CRC_ERR = 6,      //!< ERR_BAD_CRC count, ENABLE_MB_ERR_STATS
+	MB_DIAG_SIZE_ERR = 8,     //!< ERR_BAD_SIZE count, ENABLE_MB_ERR_STATS
+	MB_DIAG_EXCEPTIONS = 10,  //!< exceptions sent, ENABLE_MB_ERR_STATS
+	MB_DIAG_UART_ERR = 12,    //!< UART overrun, framing, noise and parity errors, ENABLE_MB_ERR_STATS
+	MB_DIAG_LAT_COUNT = 14,   //!< samples of xStatLatency, ENABLE_MB_STATS
+	MB_DIAG_LAT_MIN = 16,     //!< latency in microseconds, ENABLE_MB_STATS
+	MB_DIAG_LAT_MAX = 18,
+	MB_DIAG_LAT_MEAN = 20,
+	MB_DIAG_TASK_LOAD = 22,   //!< CPU of the Modbus task since the previous read of the block in 0.01 %, ENABLE_MB_RUNTIME
+	MB_DIAG_ISR_LOAD = 23,    //!< CPU of the UART callbacks of the handler over the same time in 0.01 %, ENABLE_MB_RUNTIME
+	MB_DIAG_REGS = 24         //!< size of the block
+};
+
+/* with ENABLE_MB_NODE_STATS, the MB_NODE_STATS entries of the node table of xNodeMaster follow the block:
+ * entry n at MB_DIAG_START + MB_DIAG_NODES + n * MB_DIAG_NODE_REGS, these offsets within it. Free entries read 0 */
+enum
+{
+	MB_DIAG_NODE_ID = 0,      //!< slave ID, 0 for a free entry
+	MB_DIAG_NODE_QUERIES = 1, //!< queries sent, retries included
+	MB_DIAG_NODE_TIMEOUTS = 3,
+	MB_DIAG_NODE_CRC_ERR = 5,
+	MB_DIAG_NODE_EXCEPTIONS = 7,
+	MB_DIAG_NODE_MEAN = 9,    //!< smoothed answer time in 1/8 ticks, 0xFFFF at most
+	MB_DIAG_NODE_JITTER = 10, //!< smoothed mean deviation of the answer time in 1/4 ticks, 0xFFFF at most
+	MB_DIAG_NODE_LOST = 11,   //!< consecutive timeouts of the last queries
+	MB_DIAG_NODE_REGS = 12    //!< size of an entry
+};
+#define MB_DIAG_NODES  MB_DIAG_REGS
+
+#if ENABLE_MB_DIAG_REGS == 1 && ENABLE_MB_NODE_STATS == 1
+#define MB_DIAG_SIZE  (MB_DIAG_NODES + MB_NODE_STATS * MB_DIAG_NODE_REGS) // input registers of the block with the node table
+#else
+#define MB_DIAG_SIZE  MB_DIAG_REGS
+#endif
+#if ENABLE_MB_DIAG_REGS == 1 && MB_DIAG_START + MB_DIAG_SIZE > 0x10000
+#error "the diagnostics block from MB_DIAG_START passes the last register address"
+#endif
+
+#ifndef MB_RBE_CHANGES
+#define MB_RBE_CHANGES  16
+#endif
+
+#ifndef MB_RESP_CACHE
+#define MB_RESP_CACHE  2
+#endif
+
+#ifndef MB_EXC_CACHE
+#define MB_EXC_CACHE  4
+#endif
+
+#ifndef MB_TIME_PPM_MAX
+#define MB_TIME_PPM_MAX  500 // largest rate correction of ENABLE_MB_TIMESTAMP, in parts per million
+#endif
+
+#ifndef MB_TDMA_SLOTS
+#define MB_TDMA_SLOTS  16
+#endif
+#define MB_TDMA_NONE  0xFF // no slot of the schedule is open yet
+
+#ifndef MB_TIMEOUT_K
+#define MB_TIMEOUT_K  4
+#endif
+
+#ifndef MB_TIMEOUT_MIN
+#define MB_TIMEOUT_MIN  10
+#endif
+
+#define MB_TIMEOUT_SAMPLES  4 // answers observed before the adaptive timeout is used
+
+#ifndef MB_DEAD_TIMEOUTS
+#define MB_DEAD_TIMEOUTS  3
+#endif
+
+#ifndef MB_BACKOFF_MIN
+#define MB_BACKOFF_MIN  1000
+#endif
+
+#ifndef MB_BACKOFF_MAX
+#define MB_BACKOFF_MAX  32000
+#endif
+
+#if ENABLE_MB_ADAPTIVE_TIMEOUT == 1 || ENABLE_MB_BACKOFF == 1 || (ENABLE_MB_STATS == 1 && MB_ENABLE_MASTER == 1)
+#define MB_SLAVE_TABLE  1 // the master keeps a modbusSlave_t per polled slave
+#endif
+
+#define MB_MERGE_REGS  125 // largest FC3/FC4 read of the specification
+
+#define MB_PORT_SLOTS  32 // slots of the UART to handler map used by the HAL callbacks, power of two
+
+#ifndef T35
+#define T35  5 // initial period of xTimerT35 in ticks, ModbusStart() derives the real one from the baud rate
+#endif
 
 
 typedef enum
 {
     USART_HW = 1,
+	USB_CDC_HW = 2, //!< Modbus RTU over the bulk endpoints of a USB CDC device, see ENABLE_USB_CDC
+	TCP_HW = 3, //!< Modbus TCP server on lwIP, see ENABLE_TCP
 	USART_HW_DMA = 4,
+	USART_HW_DMA_CIRC = 5, //!< circular DMA reception, frames are queued in the RX ring and copied to u8Buffer when they are for the slave
+	UDP_HW = 6, //!< Modbus over UDP on lwIP, one ADU per datagram, see ENABLE_UDP
+	LPUART_HW = 7, //!< LPUART with interrupts waking the MCU from Stop mode, see ENABLE_LPUART
+	ASCII_HW = 8, //!< Modbus ASCII on a USART with interrupts, see ENABLE_MB_ASCII
+	BLE_HW = 9, //!< Modbus PDUs in the writes and notifications of a GATT characteristic, see ENABLE_MB_BLE
 }mb_hardware_t ;
 
 
 typedef enum
 {
     MB_SLAVE = 3,
-    MB_MASTER = 4
+    MB_MASTER = 4,
+    MB_MONITOR = 5 //!< passive listener of a USART_HW_DMA_CIRC bus, see ENABLE_MB_MONITOR
 }mb_masterslave_t ;
 
 
@@ -39,7 +893,7 @@ typedef enum
  * Modbus function codes summary.
  * These are the implement function codes either for Master or for Slave.
  *
- * @see also fctsupported
+ * @see also ModbusRegisterFunction
  * @see also modbus_t
  */
 typedef enum MB_FC
@@ -50,21 +904,71 @@ typedef enum MB_FC
     MB_FC_READ_INPUT_REGISTER      = 4,	 /*!< FCT=4 -> read analog inputs */
     MB_FC_WRITE_COIL               = 5,	 /*!< FCT=5 -> write single coil or output */
     MB_FC_WRITE_REGISTER           = 6,	 /*!< FCT=6 -> write single register */
+    MB_FC_DIAGNOSTICS              = 8,	 /*!< FCT=8 -> diagnostics, serial line only */
     MB_FC_WRITE_MULTIPLE_COILS     = 15, /*!< FCT=15 -> write multiple coils or outputs */
-    MB_FC_WRITE_MULTIPLE_REGISTERS = 16	 /*!< FCT=16 -> write multiple registers */
+    MB_FC_WRITE_MULTIPLE_REGISTERS = 16, /*!< FCT=16 -> write multiple registers */
+    MB_FC_READ_FILE_RECORD         = 20, /*!< FCT=20 -> read file records, several sub-requests per frame */
+    MB_FC_WRITE_FILE_RECORD        = 21, /*!< FCT=21 -> write file records, several sub-requests per frame */
+    MB_FC_MASK_WRITE_REGISTER      = 22, /*!< FCT=22 -> AND/OR mask write of a single register */
+    MB_FC_READ_WRITE_MULTIPLE_REGISTERS = 23, /*!< FCT=23 -> write then read multiple registers */
+    MB_FC_READ_FIFO_QUEUE          = 24, /*!< FCT=24 -> read and drain a FIFO queue, MB_FIFO_MAX entries at most */
+    MB_FC_ENCAPSULATED             = 43, /*!< FCT=43 -> encapsulated interface, MEI type 14 read device identification */
+#if MB_ENABLE_FC_RANGES == 1
+    MB_FC_READ_RANGES              = MB_RANGES_FC, /*!< user defined, MB_ENABLE_FC_RANGES -> read several register ranges of one table in one frame */
+#endif
+#if MB_ENABLE_FC_DELTA == 1
+    MB_FC_READ_DELTA               = MB_DELTA_FC, /*!< user defined, MB_ENABLE_FC_DELTA -> read the registers of a block changed since a generation */
+#endif
 }mb_functioncode_t;
 
+/**
+ * @enum
+ * @brief
+ * Sub-functions of FC8 served by a slave with MB_ENABLE_FC8, the counters
+ * are the low 16 bits of the ones of the handler
+ */
+enum
+{
+	MB_FC8_ECHO      = 0x00, //!< return query data
+	MB_FC8_RESTART   = 0x01, //!< restart communications: leave the listen only mode and clear the counters, ENABLE_MB_LISTEN_ONLY
+	MB_FC8_LISTEN    = 0x04, //!< force listen only mode, not answered, ENABLE_MB_LISTEN_ONLY
+	MB_FC8_CLEAR     = 0x0A, //!< clear counters and diagnostic register
+	MB_FC8_BUS_MSG   = 0x0B, //!< bus message count, u16InCnt
+	MB_FC8_BUS_ERR   = 0x0C, //!< bus communication error count, CRC errors
+	MB_FC8_EXC_ERR   = 0x0D, //!< slave exception error count
+	MB_FC8_SLAVE_MSG = 0x0E, //!< slave message count
+	MB_FC8_NO_RESP   = 0x0F, //!< slave no response count, broadcasts
+	MB_FC8_NAK       = 0x10, //!< slave NAK count, exception 7
+	MB_FC8_BUSY      = 0x11, //!< slave busy count, exception 6
+	MB_FC8_OVERRUN   = 0x12  //!< bus character overrun count
+};
+
 
 typedef struct
 {
-uint8_t uxBuffer[MAX_BUFFER];
-uint8_t u8start;
-uint8_t u8end;
-uint8_t u8available;
-bool    overflow;
+uint8_t uxBuffer[MAX_BUFFER_RX] MB_DMA_ALIGN;
+volatile uint16_t u16head; // written only by the producer (RX interrupt)
+volatile uint16_t u16tail; // written only by the consumer (Modbus task)
+volatile bool overflow;
 }modbusRingBuffer_t;
 
 
+/**
+ * @struct modbusFrame_t
+ * @brief
+ * Descriptor of a frame received in the circular DMA ring
+ */
+typedef struct
+{
+	uint16_t u16Offset; //!< position of the first byte of the frame in the RX ring
+	uint16_t u16Length; //!< frame length in bytes
+	uint32_t u32Start;  //!< bytes written by the DMA before the frame, on the u32RxTotal count
+#if ENABLE_MB_MONITOR == 1
+	uint32_t u32End;    //!< DWT cycle counter at the idle event ending the frame
+#endif
+}modbusFrame_t;
+
+
 
 
 /**
@@ -83,6 +987,119 @@ typedef enum MESSAGE
     BYTE_CNT  //!< byte counter
 }mb_message_t;
 
+/**
+ * @enum MESSAGE_FC23
+ * @brief
+ * Indexes of the write block in a FC23 request, the read block uses ADD_HI to NB_LO
+ */
+typedef enum MESSAGE_FC23
+{
+    WR_ADD_HI                      = 6, //!< Write address high byte
+    WR_ADD_LO, //!< Write address low byte
+    WR_NB_HI, //!< Number of registers to write high byte
+    WR_NB_LO, //!< Number of registers to write low byte
+    WR_BYTE_CNT //!< byte counter of the write block
+}mb_message_fc23_t;
+
+/**
+ * @enum MESSAGE_FC22
+ * @brief
+ * Indexes of the masks in a FC22 request, the register address uses ADD_HI and ADD_LO
+ */
+typedef enum MESSAGE_FC22
+{
+    AND_HI                         = 4, //!< AND mask high byte
+    AND_LO, //!< AND mask low byte
+    OR_HI, //!< OR mask high byte
+    OR_LO //!< OR mask low byte
+}mb_message_fc22_t;
+
+/**
+ * @enum MESSAGE_FILE
+ * @brief
+ * Indexes in a sub-request of FC20 or FC21, from its reference type. The sub-requests
+ * follow the byte count at index 2, the data of FC21 follows its header
+ */
+typedef enum MESSAGE_FILE
+{
+    REC_REF                        = 0, //!< Reference type, MB_FILE_REF_TYPE
+    REC_FILE_HI, //!< File number high byte
+    REC_FILE_LO, //!< File number low byte
+    REC_NO_HI, //!< Record number high byte
+    REC_NO_LO, //!< Record number low byte
+    REC_LEN_HI, //!< Record length high byte
+    REC_LEN_LO, //!< Record length low byte
+    REC_DATA //!< FC21 only: first record written
+}mb_message_file_t;
+
+/**
+ * @enum MESSAGE_RANGES
+ * @brief
+ * Indexes in a MB_FC_READ_RANGES request. The table is the function code reading it, 3 or 4,
+ * the ranges follow the byte count, MB_RANGE_SIZE bytes each: the address then the count, high byte first.
+ * The answer is an FC3 one: the byte count at index 2 and the registers of every range in their order
+ */
+typedef enum MESSAGE_RANGES
+{
+    RNG_TABLE                      = 2, //!< MB_FC_READ_REGISTERS or MB_FC_READ_INPUT_REGISTER
+    RNG_BYTE_CNT, //!< bytes of the ranges
+    RNG_FIRST //!< address high byte of the first range
+}mb_message_ranges_t;
+
+#define MB_RANGE_SIZE  4 // bytes of a range in a MB_FC_READ_RANGES request
+
+/**
+ * @enum MESSAGE_DELTA
+ * @brief
+ * Indexes in a MB_FC_READ_DELTA request and its answer. The request names a block of
+ * ModbusSetDeltas() by its table (3 or 4), address and count, then the generation of the
+ * master copy, 0 for none. The answer carries the generation of the slave copy, the mode
+ * and the byte count of the data: the whole block for MB_DELTA_FULL, for MB_DELTA_RUNS
+ * runs of the changed registers, each an offset in the block (2 bytes), a count (1 byte)
+ * and the registers. All the fields are high byte first
+ */
+typedef enum MESSAGE_DELTA
+{
+    DLT_TABLE                      = 2, //!< request: MB_FC_READ_REGISTERS or MB_FC_READ_INPUT_REGISTER
+    DLT_ADD_HI, //!< request: first register of the block high byte
+    DLT_ADD_LO, //!< request: first register of the block low byte
+    DLT_NB_HI, //!< request: registers of the block high byte
+    DLT_NB_LO, //!< request: registers of the block low byte
+    DLT_GEN, //!< request: first of the 4 bytes of the generation of the master copy
+    DLT_REQUEST = 11, //!< bytes of a request before the CRC
+    DLT_ANS_GEN = 2, //!< answer: first of the 4 bytes of the generation of the slave copy
+    DLT_MODE = 6, //!< answer: MB_DELTA_FULL or MB_DELTA_RUNS
+    DLT_BYTE_CNT, //!< answer: bytes of the data
+    DLT_DATA //!< answer: first byte of the data
+}mb_message_delta_t;
+
+#define MB_DELTA_FULL  0 // the data is the whole block
+#define MB_DELTA_RUNS  1 // the data is the runs of the registers changed since the generation of the request
+
+/**
+ * @enum
+ * @brief
+ * MEI type 14 of FC43: read device identification codes and object ids
+ */
+enum
+{
+	MB_MEI_DEVICE_ID     = 0x0E, //!< MEI type of read device identification
+	MB_DEVID_BASIC       = 0x01, //!< stream access to objects 0x00 to 0x02
+	MB_DEVID_REGULAR     = 0x02, //!< stream access to objects 0x00 to 0x7F
+	MB_DEVID_EXTENDED    = 0x03, //!< stream access to objects 0x00 to 0xFF
+	MB_DEVID_SPECIFIC    = 0x04, //!< one object
+	MB_DEVID_VENDOR_NAME = 0x00, //!< basic, mandatory
+	MB_DEVID_PRODUCT_CODE = 0x01, //!< basic, mandatory
+	MB_DEVID_REVISION    = 0x02, //!< basic, mandatory, major and minor revision
+	MB_DEVID_VENDOR_URL  = 0x03, //!< regular
+	MB_DEVID_PRODUCT_NAME = 0x04, //!< regular
+	MB_DEVID_MODEL_NAME  = 0x05, //!< regular
+	MB_DEVID_USER_APP_NAME = 0x06 //!< regular
+};
+
+#define MB_FILE_REF_TYPE  6      // reference type of every file record sub-request
+#define MB_FILE_RECORDS   10000  // record numbers of a file, 0 to 9999
+
 typedef enum COM_STATES
 {
     COM_IDLE                     = 0,
@@ -102,7 +1119,8 @@ typedef enum ERR_LIST
     ERR_TIME_OUT		          = -8,
     ERR_BAD_SLAVE_ID		      = -9,
 	ERR_BAD_TCP_ID		          = -10,
-	ERR_OK_QUERY				  = -11
+	ERR_OK_QUERY				  = -11,
+	ERR_SLAVE_OFFLINE			  = -12
 
 }mb_errot_t;
 
@@ -111,7 +1129,10 @@ enum
     EXC_FUNC_CODE = 1,
     EXC_ADDR_RANGE = 2,
     EXC_REGS_QUANT = 3,
-    EXC_EXECUTE = 4
+    EXC_EXECUTE = 4,
+    EXC_BUSY = 6,        //!< slave device busy, the master sends the request again later
+    EXC_GW_PATH = 0x0A,  //!< gateway path unavailable, the bus has no room for the request
+    EXC_GW_TARGET = 0x0B //!< gateway target device failed to respond
 };
 
 typedef union {
@@ -138,112 +1159,3040 @@ enum
 };
 
 
+struct modbusSegment_s;
+
 /**
- * @struct modbus_t
+ * Segment callback, called by the slave task under the table semaphore for the
+ * registers u16Add to u16Add + u16Count - 1 of a request.
+ * Returns 0, or an exception code (EXC_EXECUTE...) sent to the master instead of the answer
+ */
+typedef uint8_t (*mb_segment_cb_t)(const struct modbusSegment_s *xSeg, uint16_t u16Add, uint16_t u16Count);
+
+#if ENABLE_MB_LIMITS == 1
+/**
+ * @struct modbusLimit_t
  * @brief
- * Master query structure:
- * This structure contains all the necessary fields to make the Master generate a Modbus query.
- * A Master may keep several of these structures and send them cyclically or
- * use them according to program needs.
+ * Values accepted by a range of registers of a segment, from u16Min to u16Max or one of the
+ * u8Enum values of u16Enum. The limits of a segment are sorted by u16First and do not overlap
  */
 typedef struct
 {
-    uint8_t u8id;          /*!< Slave address between 1 and 247. 0 means broadcast */
-    mb_functioncode_t u8fct;         /*!< Function code: 1, 2, 3, 4, 5, 6, 15 or 16 */
-    uint16_t u16RegAdd;    /*!< Address of the first register to access at slave/s */
-    uint16_t u16CoilsNo;   /*!< Number of coils or registers to access */
-    uint16_t *u16reg;     /*!< Pointer to memory image in master */
-    uint32_t *u32CurrentTask; /*!< Pointer to the task that will receive notifications from Modbus */
-}
-modbus_t;
+	uint16_t u16First; //!< first register of the range, offset in the segment
+	uint16_t u16Count; //!< number of registers
+	uint16_t u16Min;   //!< lowest value accepted
+	uint16_t u16Max;   //!< highest value accepted
+	bool xSigned;      //!< u16Min, u16Max and the values compare as int16_t
+	uint8_t u8Enum;    //!< size of u16Enum
+	const uint16_t *u16Enum; //!< optional sorted list of the values accepted, replaces u16Min/u16Max
+}modbusLimit_t;
+#endif
 
+/**
+ * @struct modbusSegment_t
+ * @brief
+ * Block of a sparse register map: Modbus addresses u16Start to u16Start + u16Length - 1
+ * are stored in u16regs[0] to u16regs[u16Length - 1]. The segments of a table are sorted
+ * by u16Start and do not overlap, a request must fit in one segment
+ */
+typedef struct modbusSegment_s
+{
+	uint16_t u16Start;  //!< first Modbus address of the segment
+	uint16_t u16Length; //!< number of registers
+	uint16_t *u16regs;  //!< backing memory of the segment
+	mb_segment_cb_t xOnRead;  //!< optional, fills the requested registers before they are sent
+	mb_segment_cb_t xOnWrite; //!< optional, called once per request after the registers are stored
+	void *pvContext;    //!< free for the callbacks
+#if ENABLE_MB_ACCESS == 1
+	const uint32_t *u32ReadOnly; //!< optional bitmap, bit i set: the master cannot write u16regs[i], EXC_ADDR_RANGE
+	const uint32_t *u32Locked;   //!< optional bitmap, bit i set: u16regs[i] is written only while xWriteUnlocked, else EXC_EXECUTE
+#endif
+#if ENABLE_MB_LIMITS == 1
+	const modbusLimit_t *xLimits; //!< optional, values accepted from the master, a write out of them is refused with EXC_REGS_QUANT
+	uint8_t u8Limits;             //!< size of xLimits
+#endif
+#if ENABLE_MB_WIRE_ORDER == 1
+	bool xWireOrder;    //!< u16regs holds the registers big endian as in the frame, the application reads and writes them with ModbusSegGetU16()/ModbusSegSetU16()
+#endif
+}modbusSegment_t;
 
 /**
- * @struct modbusHandler_t
+ * @struct modbusUnit_t
  * @brief
- * Modbus handler structure
- * Contains all the variables required for Modbus daemon operation
+ * Register map of a further unit ID answered by a slave handler, the fields
+ * mean the same as the ones of modbusHandler_t
  */
 typedef struct
 {
-
-	mb_masterslave_t uModbusType;
-	UART_HandleTypeDef *port; //HAL Serial Port handler
-	uint8_t u8id; //!< 0=master, 1..247=slave number
-	GPIO_TypeDef* EN_Port; //!< flow control pin: 0=USB or RS-232 mode, >1=RS-485 mode
-	uint16_t EN_Pin;  //!< flow control pin: 0=USB or RS-232 mode, >1=RS-485 mode
-	mb_errot_t i8lastError;
-	uint8_t u8Buffer[MAX_BUFFER]; //Modbus buffer for communication
-	uint8_t u8BufferSize;
-	uint8_t u8lastRec;
+	uint8_t u8id; //!< unit ID, 1..247, different from the one of the handler
 	uint16_t *u16regsHR;
-	uint16_t *u16regsRO;
-	uint16_t *u16regsCoils;
-	uint16_t *u16regsCoilsRO;
-	uint16_t u16InCnt, u16OutCnt, u16errCnt; //keep statistics of Modbus traffic
-	uint16_t u16timeOut;
 	uint16_t u16regHR_size;
+	uint16_t *u16regsRO;
 	uint16_t u16regRO_size;
+	uint16_t *u16regsCoils;
 	uint16_t u16regCoils_size;
+	uint16_t *u16regsCoilsRO;
 	uint16_t u16regCoilsRO_size;
-	uint8_t dataRX;
-	int8_t i8state;
+	const modbusSegment_t *xSegHR;
+	uint8_t u8SegHR_count;
+	const modbusSegment_t *xSegRO;
+	uint8_t u8SegRO_count;
+}modbusUnit_t;
 
-	//FreeRTOS components
+#if MB_SLAVE_FILES
+struct modbusFile_s;
 
-	//Queue Modbus Telegram
-	osMessageQueueId_t QueueTelegramHandle;
+/**
+ * File callback, called by the slave task under ModBusSphrHandle for the records
+ * u16Record to u16Record + u16Count - 1 of a sub-request. u8data holds the records
+ * high byte first: xRead writes them to the answer, xWrite takes them from the request.
+ * Returns 0, or an exception code (EXC_EXECUTE...) sent to the master instead of the answer
+ */
+typedef uint8_t (*mb_file_cb_t)(const struct modbusFile_s *xFile, uint16_t u16Record, uint16_t u16Count, uint8_t *u8data);
 
-	//Task Modbus slave
-	osThreadId_t myTaskModbusAHandle;
-	//Timer RX Modbus
-	xTimerHandle xTimerT35;
-	//Timer MasterTimeout
-	xTimerHandle xTimerTimeout;
-	//Semaphore for Modbus data
-	osSemaphoreId_t ModBusSphrHandle;
-	// RX ring buffer for USART
-	modbusRingBuffer_t xBufferRX;
-	// type of hardware  TCP, USB CDC, USART
-	mb_hardware_t xTypeHW;
+/**
+ * @struct modbusFile_t
+ * @brief
+ * File of FC20 and FC21, see ModbusSetFiles(). Its records are registers stored in
+ * u16regs, or produced and consumed by xRead and xWrite when u16regs is NULL
+ */
+typedef struct modbusFile_s
+{
+	uint16_t u16File;   //!< file number, 1 to 0xFFFF
+	uint16_t u16Records; //!< records 0 to u16Records - 1, MB_FILE_RECORDS at most
+	uint16_t *u16regs;  //!< backing memory of the records, NULL for a file served by xRead and xWrite
+	mb_file_cb_t xRead;  //!< u16regs NULL: fills the records read by FC20, NULL for a write only file
+	mb_file_cb_t xWrite; //!< u16regs NULL: stores the records written by FC21, NULL for a read only file
+	void *pvContext;    //!< free for the callbacks
+}modbusFile_t;
+#endif
 
-}
-modbusHandler_t;
+#if MB_SLAVE_DEVID
+/**
+ * @struct modbusDevIdObj_t
+ * @brief
+ * Device identification object of FC43/14. A const table of them stays in flash
+ * and the answers are copied from it, see ModbusSetDeviceId() and MB_DEVID_OBJ()
+ */
+typedef struct
+{
+	uint8_t u8Id;       //!< object id, the table is sorted by it
+	uint8_t u8Length;   //!< bytes of pcValue, MB_DEVID_MAX_LEN at most
+	const char *pcValue; //!< value, not NUL terminated in the answer
+}modbusDevIdObj_t;
 
+// object of a string literal, its length is computed by the compiler
+#define MB_DEVID_OBJ(id, str)  { (id), (uint8_t)(sizeof(str) - 1), (str) }
+#endif
 
-enum
-{
-    RESPONSE_SIZE = 6,
+#if MB_SLAVE_FIFOS
+/**
+ * @struct modbusFifo_t
+ * @brief
+ * FIFO queue of FC24, see ModbusSetFifos(). One producer, a task or an ISR, adds
+ * entries with ModbusFifoPush() without lock, the slave task drains up to MB_FIFO_MAX
+ * of them into each answer. Several producers must serialize their pushes
+ */
+typedef struct
+{
+	uint16_t u16Address; //!< FIFO pointer address of the FC24 requests
+	uint16_t *u16Data;   //!< storage of u16Size entries
+	uint16_t u16Size;    //!< entries of u16Data, a power of two
+	volatile uint16_t u16Head; // written only by the producer
+	volatile uint16_t u16Tail; // written only by the slave task
+	volatile uint32_t u32Dropped; //!< entries pushed while the queue was full, written only by the producer
+}modbusFifo_t;
+#endif
+
+#if MB_SLAVE_DELTAS
+/**
+ * @struct modbusDeltaBlock_t
+ * @brief
+ * Register block served by MB_FC_READ_DELTA, see ModbusSetDeltas(). Each request
+ * compares the block with u16Shadow, the changed registers get a new generation in
+ * u16Stamp, and only the registers stamped after the generation of the master are sent
+ */
+typedef struct
+{
+	uint8_t u8table;     //!< DB_HOLDING_REGISTER or DB_INPUT_REGISTERS
+	uint16_t u16Add;     //!< first register of the block
+	uint16_t u16Count;   //!< registers of the block, MB_DELTA_REGS at most
+	uint16_t *u16Shadow; //!< u16Count registers, the values of the block at the last request
+	uint16_t *u16Stamp;  //!< u16Count generations, the last change of each register
+	uint16_t u16Epoch;   //!< high half of the generations, a new value at each start (a boot counter) makes the masters read the whole block
+	uint16_t u16Gen;     // generation of the last change, maintained by the slave task
+}modbusDeltaBlock_t;
+#endif
+
+#if ENABLE_TCP == 1
+/**
+ * @struct modbusTcpConn_t
+ * @brief
+ * Client connection of a TCP slave
+ */
+typedef struct
+{
+	struct netconn *conn; //!< accepted netconn, NULL for a free entry
+	struct pbuf *xRx;     //!< received bytes not served yet, they may end inside an ADU
+	TickType_t xLastRx;   //!< tick of the last data from the client, the idle deadline is TCPIDLETIMEOUT later
+	uint8_t u8Prev;       //!< previous connection in the LRU list, MB_TCP_NONE for the oldest
+	uint8_t u8Next;       //!< next connection in the LRU list, MB_TCP_NONE for the newest
+#if ENABLE_MB_TLS == 1
+	void *pvTls;          //!< TLS session of the connection, from the open() of modbusTlsOps_t
+#endif
+}modbusTcpConn_t;
+#endif
+
+#if ENABLE_MB_TLS == 1
+/**
+ * @struct modbusTlsOps_t
+ * @brief
+ * TLS layer of Modbus/TCP Security, see ModbusSetTls(). The application implements
+ * it on its TLS stack, with the AES, PKA and RNG units of the MCU behind the crypto
+ * of the stack and its session tickets or cache in pvCtx, so that a client that
+ * reconnects resumes its session without a full handshake. The handler task is the
+ * only caller, the netconn is non blocking
+ */
+typedef struct
+{
+	void *(*open)(void *pvCtx, struct netconn *conn, bool xServer); //!< new session on an accepted (xServer) or connected netconn, NULL refuses the connection
+	err_t (*input)(void *pvSession, struct pbuf *p, struct pbuf **ppPlain); //!< takes the received pbufs, answers the handshake on conn and gives the application data of the complete records, decrypted in place, in *ppPlain (NULL for none yet). An error closes the connection
+	err_t (*output)(void *pvSession, const void *pvData, uint16_t u16Len, uint8_t u8Flags); //!< writes the data as records on conn, NETCONN_MORE in u8Flags: more data follows for the same record. Data written before the end of the handshake waits in the session
+	void (*close)(void *pvSession); //!< sends close_notify and frees the session, the resumption state stays in pvCtx
+	void *pvCtx; //!< context of the application: certificates, keys, session cache
+}modbusTlsOps_t;
+#endif
+
+
+/**
+ * Stages of a transaction stamped with the DWT cycle counter, see ENABLE_MB_TRACE,
+ * and marked on the probe pins of ENABLE_MB_PROBES
+ */
+typedef enum
+{
+	MB_TS_RX_END = 0,  //!< end of the frame: T35, receiver timeout or idle event
+	MB_TS_WAKE,        //!< slave task woken for the frame
+	MB_TS_VALIDATED,   //!< end of validateRequest()
+	MB_TS_PROCESSED,   //!< end of the process_FCx() of the function
+	MB_TS_TX_START,    //!< transmission started by sendTxBuffer()
+	MB_TS_TX_DONE,     //!< TC interrupt, RS485 transceiver released
+	MB_TS_STAGES
+}mb_tracestage_t;
+
+/**
+ * @struct modbusTrace_t
+ * @brief
+ * Cycle counter at each stage of one transaction, 0 for the stages not reached.
+ * The latency of a stage is the unsigned difference with the previous one
+ */
+typedef struct
+{
+	uint32_t u32Cyc[MB_TS_STAGES];
+}modbusTrace_t;
+
+/**
+ * @struct modbusHist_t
+ * @brief
+ * Histogram of ENABLE_MB_STATS and ENABLE_MB_MONITOR: u32Bucket[0] counts the 0 values and u32Bucket[b]
+ * the values from 2^(b-1) to 2^b - 1, the last bucket also the larger ones
+ */
+typedef struct
+{
+	uint32_t u32Count;  //!< samples
+	uint32_t u32Min;    //!< smallest sample, valid when u32Count > 0
+	uint32_t u32Max;    //!< largest sample
+	uint64_t u64Sum;    //!< sum of the samples, see ModbusHistMean()
+	uint32_t u32Bucket[MB_HIST_BUCKETS];
+}modbusHist_t;
+
+/**
+ * Kinds of the events of the ENABLE_MB_EVENT_LOG ring
+ */
+typedef enum
+{
+	MB_EVT_RX = 1,    //!< frame taken by the task, i8Error is 0 or ERR_BUFF_OVERFLOW
+	MB_EVT_TX,        //!< frame sent, i8Error is the exception code of an exception answer
+	MB_EVT_T35,       //!< T35 timer expired
+	MB_EVT_TIMEOUT    //!< no answer to the query of a master, ERR_TIME_OUT
+}mb_event_type_t;
+
+#define MB_EVF_CRC_OK   0x01 // CRC of the received frame checked and valid
+#define MB_EVF_CRC_BAD  0x02 // CRC of the received frame checked and wrong
+
+/**
+ * @struct modbusEvent_t
+ * @brief
+ * Record of the ENABLE_MB_EVENT_LOG ring shared by all the handlers, see ModbusGetEvents()
+ */
+typedef struct
+{
+	uint32_t u32Time;   //!< DWT cycle counter
+	uint8_t u8Handler;  //!< position of the handler in mHandlers
+	uint8_t u8Type;     //!< mb_event_type_t
+	uint8_t u8id;       //!< slave ID of the frame
+	uint8_t u8fct;      //!< function code of the frame
+	uint16_t u16Length; //!< bytes of the frame
+	int8_t i8Error;     //!< mb_errot_t code or exception
+	uint8_t u8Flags;    //!< MB_EVF_CRC_OK or MB_EVF_CRC_BAD, none when the CRC is checked later
+}modbusEvent_t;
+
+/**
+ * @struct modbusBench_t
+ * @brief
+ * Results of ModbusBenchmark() in CPU cycles, the fastest of MB_BENCH_RUNS runs.
+ * A size that does not fit MAX_BUFFER, the tables of the handler or a disabled
+ * function code reads 0
+ */
+typedef struct
+{
+	uint16_t u16CrcBytes[MB_BENCH_SIZES]; //!< frame sizes of u32Crc and u32CrcByte: 8, 64, 128 and 256 bytes
+	uint32_t u32Crc[MB_BENCH_SIZES];      //!< calcCRC() of the CRC_MODE backend
+	uint32_t u32CrcByte[MB_BENCH_SIZES];  //!< calcCRCByte() loop, the ENABLE_RX_CRC interrupt path
+	uint16_t u16Regs[MB_BENCH_SIZES];     //!< registers of u32FC3: 1, 16, 64 and 125
+	uint32_t u32FC3[MB_BENCH_SIZES];      //!< process_FC3() of an FC3 request
+	uint16_t u16Coils[MB_BENCH_SIZES];    //!< coils of u32FC1: 1, 16, 256 and 2000
+	uint32_t u32FC1[MB_BENCH_SIZES];      //!< process_FC1() of an FC1 request, the coil packing
+	uint32_t u32Validate;                 //!< validateRequest() of a 16 registers FC3 request, CRC included
+}modbusBench_t;
+
+/**
+ * @struct modbusWcetFc_t
+ * @brief
+ * Worst case of one function code in a report of ModbusWcet(), in CPU cycles
+ */
+typedef struct
+{
+	uint8_t u8fct;         //!< function code, 0 for an entry that was not measured
+	uint16_t u16Size;      //!< bytes of the longest request accepted, CRC included
+	uint16_t u16Add;       //!< address of the request of u32Process
+	uint16_t u16Count;     //!< coils or registers of that request
+	uint32_t u32Validate;  //!< slowest validateRequest(), CRC included
+	uint32_t u32Process;   //!< slowest process function
+}modbusWcetFc_t;
+
+/**
+ * @struct modbusWcet_t
+ * @brief
+ * Report of ModbusWcet(): the configuration it was measured on and the slowest run
+ * of each function code over its worst case requests
+ */
+typedef struct
+{
+	uint8_t u8CrcMode;     //!< CRC_MODE of the build
+	uint16_t u16MaxBuffer; //!< MAX_BUFFER of the build
+	uint16_t u16Coils;     //!< coils of the handler, u16regCoils_size * 16
+	uint16_t u16Inputs;    //!< discrete inputs, u16regCoilsRO_size * 16
+	uint16_t u16Holding;   //!< holding registers, u16regHR_size
+	uint16_t u16Input;     //!< input registers, u16regRO_size
+	uint32_t u32Worst;     //!< most cycles of validateRequest() and a process function together
+	modbusWcetFc_t xFc[MB_WCET_FCS]; //!< the enabled function codes first
+}modbusWcet_t;
+
+/**
+ * @struct modbusRuntime_t
+ * @brief
+ * CPU use of a handler, see ModbusGetRuntime(). The loads cover the time since
+ * the previous call, the totals the time since ModbusInit()
+ */
+typedef struct
+{
+	uint16_t u16TaskLoad;  //!< Modbus task, in 0.01 % of the run time counter of FreeRTOS
+	uint16_t u16IsrLoad;   //!< UART callbacks of the handler, in 0.01 % of the CPU cycles
+	uint32_t u32TaskTime;  //!< run time counter of the task, portGET_RUN_TIME_COUNTER_VALUE() units
+	uint64_t u64IsrCycles; //!< DWT cycles of the UART callbacks of the handler
+	uint32_t u32IsrCalls;  //!< UART callbacks of the handler
+	uint32_t u32IsrMax;    //!< cycles of the longest one
+	uint32_t u32StackFree; //!< bytes of the task stack never used, ModbusGetStackSpace()
+}modbusRuntime_t;
+
+/**
+ * @struct modbusWireStats_t
+ * @brief
+ * Time of a serial handler on the line since ModbusInit() or ModbusResetWireStats(),
+ * see ModbusGetWireStats(). Only the frames the handler sends or takes are counted
+ */
+typedef struct
+{
+	uint32_t u32TxFrames;    //!< frames sent
+	uint32_t u32RxFrames;    //!< frames received
+	uint32_t u32WireBytes;   //!< characters of those frames on the line, ASCII ones included
+	uint32_t u32Payload;     //!< bytes of their PDUs, function code and data
+	uint64_t u64WireUs;      //!< time of the frames on the line
+	uint64_t u64GapUs;       //!< turnarounds measured between a frame and its answer
+	uint64_t u64IdleUs;      //!< the rest of the elapsed time
+	uint64_t u64ElapsedUs;
+	uint16_t u16Utilisation; //!< frames and turnarounds over the elapsed time, in 0.1 %
+	uint16_t u16Efficiency;  //!< wire time of the PDU bytes over the frames and turnarounds, in 0.1 %
+}modbusWireStats_t;
+
+/**
+ * @struct modbusRuntimeMark_t
+ * @brief
+ * Counters at the previous read of the loads of a handler
+ */
+typedef struct
+{
+	uint32_t u32Task;  //!< run time counter of the task
+	uint32_t u32Total; //!< portGET_RUN_TIME_COUNTER_VALUE()
+	uint64_t u64Isr;   //!< u64IsrCycles
+	TickType_t xTick;  //!< tick of the read
+}modbusRuntimeMark_t;
+
+/**
+ * @struct modbusReplay_t
+ * @brief
+ * Report of ModbusReplay(). The throughput is u32Frames or u32Bytes over u32Ticks,
+ * or over u64Cost for the slave path alone
+ */
+typedef struct
+{
+	uint32_t u32Frames;     //!< records of the capture replayed
+	uint32_t u32Bytes;      //!< bytes of their frames
+	uint32_t u32Answers;    //!< requests answered with data
+	uint32_t u32Exceptions; //!< requests answered with an exception
+	uint32_t u32OtherUnit;  //!< frames of another slave ID, answers of the other slaves included
+	uint32_t u32Dropped;    //!< frames refused without an answer: size, CRC or broadcast
+	uint32_t u32Ticks;      //!< RTOS ticks of the whole replay, the gaps of a timed one included
+	uint64_t u64Cost;       //!< MB_COST_CLOCK() ticks of the frames, without the gaps
+	modbusHist_t xCost;     //!< MB_COST_CLOCK() ticks of each frame
+}modbusReplay_t;
+
+/**
+ * @struct modbusErrStats_t
+ * @brief
+ * Counters of ENABLE_MB_ERR_STATS, the u16errCnt total split by cause.
+ * The exceptions are the ones sent by a slave or received by a master
+ */
+typedef struct
+{
+	uint32_t u32Err[MB_ERR_TYPES]; //!< per mb_errot_t code, indexed by MB_ERR_INDEX()
+	uint32_t u32Exc[MB_EXC_TYPES]; //!< per exception code, u32Exc[0] for EXC_FUNC_CODE
+	uint32_t u32Overrun;           //!< UART overrun errors, a byte was lost
+	uint32_t u32Framing;           //!< UART framing errors, missing stop bit
+	uint32_t u32Noise;             //!< UART noise errors
+	uint32_t u32Parity;            //!< UART parity errors
+	uint32_t u32SlaveMsg;          //!< requests for the unit IDs of a slave with a valid CRC
+	uint32_t u32NoResponse;        //!< requests of a slave left unanswered, the broadcasts
+	uint32_t u32Gaps;              //!< ENABLE_RX_MERGE: silences longer than T1.5 inside a frame (USART_HW), fragments merged (USART_HW_DMA)
+	uint32_t u32RxDeferred;        //!< DMA receptions the error callback could not restart, left to the Modbus task
+	uint32_t u32Resync;            //!< ENABLE_RX_RESYNC: frames recovered from an overflowed RX ring
+	uint32_t u32Stray;             //!< master: frames received while waiting that were not the answer of the query
+	uint32_t u32Throttled;         //!< ENABLE_MB_THROTTLE: requests answered busy over the budget of the slave
+}modbusErrStats_t;
+
+/**
+ * @struct modbusRetain_t
+ * @brief
+ * Image of ENABLE_MB_RETAIN in MB_RETAIN memory: the CRCs of the tables of a slave and its
+ * counters, checked by ModbusInit() after a reset
+ */
+typedef struct
+{
+	uint32_t u32Magic;    //!< MB_RETAIN_MAGIC while the image is sealed
+	uint32_t u32Layout;   //!< sizes of the tables, another firmware layout discards the image
+	uint16_t u16TableCRC; //!< CRC of u16regsHR and u16regsCoils
+	uint16_t u16StatCRC;  //!< CRC of the counters below
+	uint16_t u16InCnt;
+	uint16_t u16OutCnt;
+	uint16_t u16errCnt;
+#if ENABLE_MB_ERR_STATS == 1
+	modbusErrStats_t xErrStats;
+#endif
+}modbusRetain_t;
+
+#if ENABLE_MB_HR_COMMIT == 1
+/**
+ * @struct modbusHRBank_t
+ * @brief
+ * Holding registers of ENABLE_MB_HR_COMMIT: two banks and their commit counter, the bank
+ * of one slave set by ModbusSetHRBanks() or, with ENABLE_MB_SHARED_HR, a bank allocated by
+ * the application and served by several slaves, see ModbusHRBankInit()
+ */
+typedef struct
+{
+	uint16_t *u16regs[2];     //!< u16regs[u32Seq & 1] holds the committed registers, the other one is the staging bank
+	uint16_t u16size;         //!< registers of a bank
+	volatile uint32_t u32Seq; //!< commit counter
+#if ENABLE_MB_SHARED_HR == 1
+	osSemaphoreId_t xLock;    //!< writers of all the slaves serving the bank, NULL for the bank of one slave
+#if ENABLE_MB_STATIC == 1
+	StaticSemaphore_t xLockCb;
+#endif
+#endif
+}modbusHRBank_t;
+#endif
+
+/**
+ * @struct modbusMonitorSlave_t
+ * @brief
+ * Traffic of one slave seen by an MB_MONITOR handler
+ */
+typedef struct
+{
+	uint32_t u32Requests;   //!< requests addressed to the slave
+	uint32_t u32Answers;    //!< answers paired with their request
+	uint32_t u32Exceptions; //!< answers that are exceptions
+	uint32_t u32NoAnswer;   //!< requests followed by another frame than their answer within u16timeOut
+	uint32_t u32BadCRC;     //!< frames of the slave ID with a wrong CRC
+	modbusHist_t xLatency;  //!< microseconds from the end of the request to the start of the answer
+	uint8_t u8id;           //!< slave ID, 0 for a free entry
+}modbusMonitorSlave_t;
+
+/**
+ * @struct modbusMonitor_t
+ * @brief
+ * Statistics of an MB_MONITOR handler, see ModbusGetMonitor()
+ */
+typedef struct
+{
+	uint32_t u32Frames;    //!< frames captured
+	uint32_t u32BadCRC;    //!< frames with a wrong CRC or shorter than 4 bytes
+	uint32_t u32Unpaired;  //!< exceptions without their request
+	uint32_t u32Broadcast; //!< requests to ID 0, no answer expected
+	uint32_t u32ShortGaps; //!< silences shorter than T3.5 before a frame
+	uint32_t u32Lost;      //!< frames dropped by a full RX ring or descriptor queue
+	modbusHist_t xGap;     //!< microseconds of silence before each frame
+	modbusMonitorSlave_t xSlaves[MB_MONITOR_SLAVES]; //!< per slave, the oldest entry is reused when full
+}modbusMonitor_t;
+
+/**
+ * @brief
+ * Mean of the samples of a histogram
+ *
+ * @return mean, 0 without samples
+ * @ingroup setup
+ */
+static inline uint32_t ModbusHistMean(const modbusHist_t *xHist)
+{
+	return (xHist->u32Count == 0) ? 0 : (uint32_t)(xHist->u64Sum / xHist->u32Count);
+}
+
+/**
+ * @brief
+ * Percentile of the samples of a histogram, to the log2 bucket: the largest value of the
+ * bucket of the sample at u8Percent % of them, u32Max for the last one
+ *
+ * @return bound of the percentile, 0 without samples
+ * @ingroup setup
+ */
+static inline uint32_t ModbusHistPercentile(const modbusHist_t *xHist, uint8_t u8Percent)
+{
+	uint64_t u64Rank = ((uint64_t)xHist->u32Count * u8Percent + 99) / 100;
+	uint32_t u32Seen = 0;
+
+	if (xHist->u32Count == 0) return 0;
+	for (uint8_t i = 0; i < MB_HIST_BUCKETS - 1; i++)
+	{
+		u32Seen += xHist->u32Bucket[i];
+		if (u32Seen >= u64Rank && u32Seen != 0) return ((1UL << i) - 1 < xHist->u32Max) ? (1UL << i) - 1 : xHist->u32Max;
+	}
+	return xHist->u32Max;
+}
+
+
+struct modbus_s;
+
+/**
+ * @struct modbusFileRec_t
+ * @brief
+ * Sub-request of a master FC20 or FC21 query, a telegram packs u16CoilsNo of them in one frame
+ */
+typedef struct
+{
+    uint16_t u16File;      /*!< File number, 1 to 0xFFFF */
+    uint16_t u16Record;    /*!< First record, 0 to 9999 */
+    uint16_t u16Length;    /*!< Number of records, one register each */
+    uint16_t *u16regs;     /*!< Records read by FC20 or written by FC21 */
+}
+modbusFileRec_t;
+
+/**
+ * @struct modbusRange_t
+ * @brief
+ * Range of a master MB_FC_READ_RANGES query, a telegram packs u16CoilsNo of them in one frame
+ */
+typedef struct
+{
+    uint16_t u16Add;       /*!< First register of the range */
+    uint16_t u16Count;     /*!< Registers of the range, at least 1 */
+    uint16_t *u16regs;     /*!< Registers read */
+}
+modbusRange_t;
+
+/**
+ * Order of the registers holding a 32 or 64 bit value, and of the two bytes in each register.
+ * Bit 0 swaps the words, bit 1 the bytes
+ */
+typedef enum
+{
+	MB_WORD_HL = 0,      //!< ABCD: most significant word in the lower address, the usual Modbus order
+	MB_WORD_LH = 1,      //!< CDAB: least significant word in the lower address, "word swapped"
+	MB_WORD_HL_SWAP = 2, //!< BADC: MB_WORD_HL with the two bytes of each register swapped
+	MB_WORD_LH_SWAP = 3  //!< DCBA: MB_WORD_LH with the two bytes of each register swapped, the value little endian
+}mb_wordorder_t;
+
+/**
+ * Native type of values held in consecutive registers, see ModbusRegsToValues()
+ */
+typedef enum
+{
+	MB_TYPE_U16 = 0, //!< one register per value
+	MB_TYPE_I16,
+	MB_TYPE_U32,     //!< two registers per value
+	MB_TYPE_I32,
+	MB_TYPE_F32,     //!< IEEE 754 single precision
+	MB_TYPE_U64,     //!< four registers per value
+	MB_TYPE_I64,
+	MB_TYPE_F64,     //!< IEEE 754 double precision
+	MB_TYPE_STRING   //!< two characters per register, high byte first, no terminator
+}mb_type_t;
+
+/**
+ * @struct modbusGather_t
+ * @brief
+ * Sub-range of the registers read by a master telegram, written straight to its
+ * destination when the answer arrives, see modbus_t xGather
+ */
+typedef struct
+{
+    uint16_t u16Offset;    /*!< First register of the sub-range, from the first register read */
+    uint16_t u16Count;     /*!< Registers of the sub-range */
+    void *pvDst;           /*!< Destination of the u16Count registers as u8Type values, aligned to 2 bytes at least */
+    uint8_t u8Type;        /*!< mb_type_t of the destination, MB_TYPE_U16 for plain registers */
+    uint8_t u8Order;       /*!< mb_wordorder_t of the values in the registers */
+}
+modbusGather_t;
+
+/**
+ * Completion callback of ModbusQueryAsync(), called from the master task with
+ * ERR_OK_QUERY or an error code. It must not block, it may submit new queries
+ */
+typedef void (*mb_query_cb_t)(struct modbus_s *telegram, int8_t i8result, void *pvContext);
+
+/**
+ * Level of a queued master query, see ModbusQueryPriority(). The master sends the
+ * oldest query of the highest level first, the polls of the table come before MB_PRIO_BACKGROUND
+ */
+typedef enum
+{
+	MB_PRIO_URGENT = 0,     //!< writes that must not wait, ModbusQueryInject()
+	MB_PRIO_CYCLIC = 1,     //!< cyclic reads, ModbusQuery() and ModbusQueryAsync()
+	MB_PRIO_BACKGROUND = 2, //!< diagnostics, sent when no poll is due
+	MB_PRIO_LEVELS
+}mb_priority_t;
+
+/**
+ * @struct modbus_t
+ * @brief
+ * Master query structure:
+ * This structure contains all the necessary fields to make the Master generate a Modbus query.
+ * A Master may keep several of these structures and send them cyclically or
+ * use them according to program needs.
+ */
+typedef struct modbus_s
+{
+    uint8_t u8id;          /*!< Slave address between 1 and 247. 0 means broadcast */
+    mb_functioncode_t u8fct;         /*!< Function code: 1, 2, 3, 4, 5, 6, 15, 16, 22 or 23 */
+    uint16_t u16RegAdd;    /*!< Address of the first register to access at slave/s, FC43 the read device id code in the high byte and the object id in the low one */
+    uint16_t u16CoilsNo;   /*!< Number of coils or registers to access */
+    uint16_t *u16reg;     /*!< Pointer to memory image in master, FC22 takes the AND mask from u16reg[0] and the OR mask from u16reg[1], FC24 stores the FIFO count then the entries, FC43 the answer as get_FC43() packs it */
+    uint32_t *u32CurrentTask; /*!< Pointer to the task that will receive notifications from Modbus */
+    uint16_t u16ReadAdd;   /*!< FC23 only: address of the first register to read, u16RegAdd/u16CoilsNo/u16reg are the write block */
+    uint16_t u16ReadNo;    /*!< FC23 only: number of registers to read */
+    uint16_t *u16ReadReg;  /*!< FC23 only: pointer to the memory image receiving the read registers */
+    const modbusFileRec_t *xRecords; /*!< FC20 and FC21 only: the u16CoilsNo sub-requests, u16RegAdd and u16reg are unused */
+#if MB_ENABLE_FC_RANGES == 1
+    const modbusRange_t *xRanges; /*!< MB_FC_READ_RANGES only: the u16CoilsNo ranges, u16RegAdd is the table (MB_FC_READ_REGISTERS or MB_FC_READ_INPUT_REGISTER), u16reg is unused */
+#endif
+    mb_query_cb_t xCallback; /*!< Completion callback, set by ModbusQueryAsync(), NULL to notify u32CurrentTask */
+    void *pvContext;       /*!< Context pointer passed to xCallback */
+    uint16_t u16timeOut;   /*!< Answer timeout in ticks, 0 uses the adaptive or the handler timeout */
+    uint8_t u8retries;     /*!< Times the query is sent again after a timeout before ERR_TIME_OUT is reported */
+    volatile uint8_t u8Refs; /*!< Set by the master: queries of ModbusQueryRef() queued or in progress for this telegram, it must not change while not 0 */
+#if ENABLE_MB_PREBUILT == 1
+    uint8_t u8FrameSize;   /*!< Bytes of u8Frame */
+    const uint8_t *u8Frame; /*!< Query frame with its CRC sent as it is, NULL to build it from the fields, see ModbusBuildFrame() */
+#endif
+#if ENABLE_MB_TYPED == 1
+    uint8_t u8Type;        /*!< mb_type_t of pvValues */
+    uint8_t u8Order;       /*!< mb_wordorder_t of the values in the registers */
+    void *pvValues;        /*!< Native values converted from u16reg once per answer of FC3/FC4 (u16ReadReg for FC23) and to u16reg before FC16 is sent, NULL for none */
+#endif
+#if ENABLE_MB_GATHER == 1
+    const modbusGather_t *xGather; /*!< FC3, FC4 and FC23: sub-ranges of the answer written to their own destinations instead of u16reg (u16ReadReg), NULL for none */
+    uint8_t u8GatherCount; /*!< Entries of xGather */
+#endif
+}
+modbus_t;
+
+/**
+ * @struct modbusTransaction_t
+ * @brief
+ * Destinations of the answer of one master query, taken from its telegram when the
+ * query is sent. A master never points the handler tables u16regsHR and u16regsCoils
+ * at its telegrams
+ */
+typedef struct
+{
+    uint16_t *u16Bits;     /*!< FC1 and FC2: memory image of the coils or discrete inputs read */
+    uint16_t *u16Regs;     /*!< FC3 and FC4: registers read, FC23 the read block, FC8 the data field */
+}
+modbusTransaction_t;
+
+#if ENABLE_MB_DEFERRED_DECODE == 1
+/**
+ * @struct modbusDecode_t
+ * @brief
+ * Checked answer handed over by the master task to its decode task, with the
+ * telegram it answers and the entry of the pool the telegram keeps until then
+ */
+typedef struct
+{
+    modbus_t *telegram;    /*!< telegram answered */
+    modbusTransaction_t xTrans; /*!< destinations of the data */
+    int8_t i8Slot;         /*!< entry of the pool of telegram, -1 for a poll of the table */
+    uint8_t u8fct;         /*!< function code of the answer */
+    uint8_t u8Bytes;       /*!< byte count of the data, 0 for the answers of the writes */
+    uint8_t u8Data[MB_DECODE_BYTES]; /*!< data of the answer as in the frame */
+}
+modbusDecode_t;
+#endif
+
+#if ENABLE_MB_GATEWAY == 1
+struct modbusHandler_s;
+
+/**
+ * @struct modbusRoute_t
+ * @brief
+ * Unit IDs a TCP gateway forwards to one RTU master, see ModbusSetGateway()
+ */
+typedef struct
+{
+    struct modbusHandler_s *xBus; /*!< RTU master of the bus, with its own task and telegram queue */
+    uint8_t u8First;       /*!< First unit ID on the bus */
+    uint8_t u8Last;        /*!< Last unit ID on the bus, inclusive */
+    uint8_t u8retries;     /*!< u8retries of the queries forwarded to the bus */
+    uint8_t u8Pending;     /*!< Queries of the gateway queued or in progress on the bus, maintained by the gateway */
+}
+modbusRoute_t;
+
+/**
+ * @struct modbusGwQuery_t
+ * @brief
+ * Request of a TCP client forwarded by the gateway, until its answer is sent back
+ */
+typedef struct
+{
+    modbus_t telegram;     /*!< Query of the bus, u16reg points to u16Data */
+    struct modbusHandler_s *xGateway; /*!< TCP slave of the request */
+    modbusRoute_t *xRoute; /*!< Bus of the query */
+    struct netconn *conn;  /*!< Connection of the request, its answer is dropped when it was closed meanwhile */
+    uint16_t u16TransactionID; /*!< Transaction ID of the request */
+    int8_t i8result;       /*!< Result of the query on the bus */
+    uint8_t u8Exception;   /*!< Exception code of the RTU slave when i8result is ERR_EXCEPTION */
+    bool xUsed;            /*!< false for a free entry */
+    uint16_t u16Data[MB_GW_REGS]; /*!< Registers or coils written or read by the query */
+}
+modbusGwQuery_t;
+#endif
+
+#if ENABLE_MB_REDUNDANT == 1
+struct modbusHandler_s;
+
+/**
+ * @enum mb_redundant_mode_t
+ * @brief
+ * How a redundant pair of masters sends its queries, see ModbusRedundantInit()
+ */
+typedef enum
+{
+    MB_RED_FAILOVER = 0, //!< one bus at a time, the other one gets the query after a failure
+    MB_RED_PARALLEL      //!< both buses at once, the first answer wins
+}
+mb_redundant_mode_t;
+
+/**
+ * @struct modbusPath_t
+ * @brief
+ * Health of the two paths to one slave of a redundant pair
+ */
+typedef struct
+{
+    uint8_t u8id;          /*!< Slave address, 0 for a free entry */
+    uint8_t u8Path;        /*!< Bus that answered last, 0 primary or 1 secondary, tried first in failover mode */
+    uint8_t u8Fails[2];    /*!< Failed queries in a row on each bus */
+    uint32_t u32Answers[2]; /*!< Answers received on each bus */
+    uint32_t u32Failovers; /*!< Queries answered by the second bus tried */
+}
+modbusPath_t;
+
+/**
+ * @struct modbusRedQuery_t
+ * @brief
+ * Query of the application in progress on the buses of a redundant pair
+ */
+typedef struct
+{
+    modbus_t telegram;     /*!< Query of the application, completed once */
+    struct modbusRedundant_s *xPair; /*!< Pair of the query */
+    modbusPath_t *xPath;   /*!< Health of the paths to the slave */
+    uint8_t u8Tried;       /*!< Bit 0 primary, bit 1 secondary: buses that got the query */
+    uint8_t u8Pending;     /*!< Legs queued or in progress on the buses */
+    int8_t i8result;       /*!< Result of the last leg that failed */
+    bool xDone;            /*!< Result reported to the application */
+    bool xUsed;            /*!< false for a free entry */
+    uint16_t u16Data[2][MB_RED_REGS]; /*!< Parallel mode: data read by each bus, copied by the winner */
+}
+modbusRedQuery_t;
+
+/**
+ * @struct modbusRedundant_t
+ * @brief
+ * Two RTU masters on redundant buses to the same slaves, used as one master.
+ * Allocated by the application, see ModbusRedundantInit()
+ */
+typedef struct modbusRedundant_s
+{
+    struct modbusHandler_s *xBus[2]; /*!< Primary and secondary master, each with its own task and telegram queue */
+    mb_redundant_mode_t xMode; /*!< MB_RED_FAILOVER or MB_RED_PARALLEL */
+    uint16_t u16FailoverTimeout; /*!< Failover mode: answer timeout in ticks of the first bus tried, 0 keeps the one of the telegram */
+    uint8_t u8PathNext;    /*!< Entry of xPaths replaced by the next new slave */
+    modbusPath_t xPaths[MB_RED_SLAVES]; /*!< Paths of the last MB_RED_SLAVES slaves queried */
+    modbusRedQuery_t xQueries[MB_RED_QUERIES]; /*!< Queries in progress */
+}
+modbusRedundant_t;
+#endif
+
+#if ENABLE_MB_DISCOVERY == 1
+/**
+ * @struct modbusDiscovery_t
+ * @brief
+ * Scan of the slave IDs of one bus, see ModbusDiscover(). The application sets the
+ * first fields, the results follow
+ */
+typedef struct
+{
+    struct modbusHandler_s *modH; /*!< Master of the bus */
+    uint8_t u8First;       /*!< First ID probed, 1 to 247 */
+    uint8_t u8Last;        /*!< Last ID probed, u8First to 247 */
+    mb_functioncode_t u8fct; /*!< Probe: MB_FC_ENCAPSULATED reads the basic device identification, any other value reads u16RegAdd with FC3 */
+    uint16_t u16RegAdd;    /*!< FC3 probe: holding register read */
+    uint16_t u16timeOut;   /*!< Answer timeout of a probe in ticks, 0 derives it from the baud rate */
+    uint32_t u32Found[8];  /*!< Bit u8id % 32 of word u8id / 32 set when u8id answered, an exception included */
+    uint16_t u16Latency[248]; /*!< Ticks from the probe of each ID found to its answer */
+    uint16_t u16Found;     /*!< IDs found */
+    uint8_t u8Next;        /*!< Next ID to probe */
+    volatile bool xBusy;   /*!< A probe is queued or in progress */
+    TickType_t xSent;      /*!< Tick the probe was queued */
+    TaskHandle_t xCaller;  /*!< Task of ModbusDiscover(), notified by each answer */
+    uint16_t u16Probe[2];  /*!< Registers of the answers */
+}
+modbusDiscovery_t;
+#endif
+
+#if ENABLE_MB_STRESS == 1
+/**
+ * @struct modbusStressOp_t
+ * @brief
+ * Query of the mix of a stress run, see ModbusStress()
+ */
+typedef struct
+{
+    uint8_t u8id;          /*!< Slave ID */
+    mb_functioncode_t u8fct; /*!< MB_FC_READ_COILS, MB_FC_READ_DISCRETE_INPUT, MB_FC_READ_REGISTERS, MB_FC_READ_INPUT_REGISTER, MB_FC_WRITE_REGISTER or MB_FC_WRITE_MULTIPLE_REGISTERS */
+    uint16_t u16RegAdd;    /*!< First coil or register */
+    uint16_t u16CoilsNo;   /*!< Coils (2000 at most) or registers (125 at most, 123 for FC16) */
+    uint8_t u8Weight;      /*!< Share of the op in the mix, relative to the sum of the weights */
+    uint16_t *u16Model;    /*!< Registers the slave is expected to hold for the range: an answer of FC3 or FC4 is compared to it, FC6 and FC16 store what they write. NULL for no check, always NULL for the coils */
+}
+modbusStressOp_t;
+
+/**
+ * @struct modbusStress_t
+ * @brief
+ * Stress run of one master. The application sets the first fields and zeroes the
+ * results once, each ModbusStress() call adds to them so a run of hours is made of
+ * calls of minutes with a report between them
+ */
+typedef struct
+{
+    struct modbusHandler_s *modH; /*!< Master of the bus */
+    const modbusStressOp_t *xOps; /*!< The mix */
+    uint8_t u8Ops;         /*!< Ops of xOps */
+    uint32_t u32Seed;      /*!< State of the random picks and written values, any value but 0 */
+    uint32_t u32Queries;   /*!< Queries completed */
+    uint32_t u32Ok;        /*!< Answers with the expected data */
+    uint32_t u32Exceptions; /*!< Exception answers */
+    uint32_t u32TimeOuts;  /*!< Queries without an answer */
+    uint32_t u32Errors;    /*!< Other failures: CRC, size, ID or function of the answer */
+    uint32_t u32Mismatch;  /*!< FC3 or FC4 answers other than the model */
+    uint32_t u32Ticks;     /*!< Ticks of the calls, TPS is u32Queries * configTICK_RATE_HZ / u32Ticks */
+    modbusHist_t xLatency; /*!< Ticks from the queuing of each query to its result, see ModbusHistPercentile() */
+    volatile bool xBusy;   /*!< A query is queued or in progress */
+    int8_t i8Result;       /*!< Result of the last query */
+    uint8_t u8Op;          /*!< Op of the query in progress */
+    bool xRetry;           /*!< The last write failed, it is sent again before any other op to keep the model */
+    TaskHandle_t xCaller;  /*!< Task of ModbusStress(), notified by each result */
+    uint16_t u16Regs[125]; /*!< Data of the query in progress */
+}
+modbusStress_t;
+#endif
+
+#if ENABLE_MB_BATCH == 1
+struct modbusBatch_s;
+
+/**
+ * @struct modbusBatchEntry_t
+ * @brief
+ * Telegram of a batch with its bus, see ModbusBatchSubmit()
+ */
+typedef struct
+{
+    struct modbusHandler_s *modH; /*!< Master of the bus of the telegram */
+    modbus_t telegram;     /*!< Query, with its own destination */
+    int8_t i8result;       /*!< ERR_OK_QUERY or the error of the query once the batch is reported */
+    bool xSent;            /*!< Queued on its bus, or failed before */
+    struct modbusBatch_s *xBatch; /*!< Batch of the entry */
+}
+modbusBatchEntry_t;
+
+/**
+ * Completion callback of ModbusBatchSubmit(), called once from the master task of
+ * the last telegram completed with the number of telegrams that failed
+ */
+typedef void (*mb_batch_cb_t)(struct modbusBatch_s *xBatch, uint8_t u8Failed, void *pvContext);
+
+/**
+ * @struct modbusBatch_t
+ * @brief
+ * Telegrams sent on several buses and reported at once, allocated by the application
+ * and zero-initialized, see ModbusBatchSubmit()
+ */
+typedef struct modbusBatch_s
+{
+    modbusBatchEntry_t *xEntries; /*!< Telegrams of the batch */
+    uint8_t u8Count;       /*!< Entries of xEntries */
+    volatile uint8_t u8Pending; /*!< Entries not completed, 0 once the batch is reported */
+    uint8_t u8Failed;      /*!< Entries that failed */
+    mb_batch_cb_t xCallback; /*!< Completion callback, NULL to notify xTask */
+    void *pvContext;       /*!< Context pointer passed to xCallback */
+    TaskHandle_t xTask;    /*!< Task of ModbusBatchSubmit() */
+}
+modbusBatch_t;
+#endif
+
+#if MB_ENABLE_IP == 1 && MB_ENABLE_MASTER == 1
+/**
+ * @struct modbusTcpQuery_t
+ * @brief
+ * Query of a TCP or UDP master waiting for its answer, matched by its transaction ID
+ */
+typedef struct
+{
+    modbus_t telegram;     /*!< Query as it was queued, its result goes to its submitter */
+    modbusTransaction_t xTransaction; /*!< Destinations of its answer */
+    TickType_t xDeadline;  /*!< Tick at which the query times out */
+    uint16_t u16TransactionID; /*!< Transaction ID of the MBAP header of the query */
+    uint8_t u8Retries;     /*!< Times a UDP query was sent again */
+    bool xUsed;            /*!< false for a free entry */
+}
+modbusTcpQuery_t;
+#endif
+
+#if MB_SLAVE_TABLE == 1
+/**
+ * @struct modbusSlave_t
+ * @brief
+ * Answer time statistics and health kept by the master for one slave
+ */
+typedef struct
+{
+    uint32_t u32Mean;      /*!< Smoothed answer time in 1/8 ticks */
+    uint32_t u32Dev;       /*!< Smoothed mean deviation of the answer time in 1/4 ticks */
+    uint32_t u32Backoff;   /*!< Current probe period in ticks while offline */
+    TickType_t xProbe;     /*!< Time of the next probe query while offline */
+    uint8_t u8id;          /*!< Slave address, 0 for a free entry */
+    uint8_t u8samples;     /*!< Answers observed, saturates at MB_TIMEOUT_SAMPLES */
+    uint8_t u8Timeouts;    /*!< Consecutive timeouts, the slave is offline from MB_DEAD_TIMEOUTS */
+#if ENABLE_MB_STATS == 1
+    modbusHist_t xRoundTrip; /*!< Ticks from the transmission of a query to its answer */
+#endif
+}
+modbusSlave_t;
+#endif
+
+#if ENABLE_MB_NODE_STATS == 1
+/**
+ * @struct modbusNodeStats_t
+ * @brief
+ * Statistics kept by the master for one slave ID, see ModbusGetNodeStats()
+ */
+typedef struct
+{
+    uint32_t u32Queries;    /*!< Queries sent, each retry counted */
+    uint32_t u32Timeouts;   /*!< Queries without answer */
+    uint32_t u32CrcErrors;  /*!< Answers with a wrong CRC */
+    uint32_t u32Exceptions; /*!< Exception answers */
+    uint32_t u32Mean;       /*!< Smoothed answer time in 1/8 ticks, gain 1/8 */
+    uint32_t u32Jitter;     /*!< Smoothed mean deviation of the answer time in 1/4 ticks, gain 1/4 */
+    uint32_t u32Answers;    /*!< Answer times sampled */
+    uint8_t u8id;           /*!< Slave address, 0 for a free entry */
+    uint8_t u8Lost;         /*!< Consecutive timeouts, saturates at 255 */
+}
+modbusNodeStats_t;
+#endif
+
+
+/**
+ * @struct modbusChange_t
+ * @brief
+ * Register of a report by exception poll whose value changed, see ENABLE_MB_RBE
+ */
+typedef struct
+{
+    uint16_t u16Add;       /*!< Address of the register in the slave */
+    uint16_t u16Old;       /*!< Value of the previous answer */
+    uint16_t u16New;       /*!< Value of the last answer */
+}
+modbusChange_t;
+
+struct modbusPoll_s;
+
+/**
+ * Change callback of a report by exception poll, called from the master task after
+ * an answer that changed u16Changed registers of the telegram image. xChanges lists the
+ * first MB_RBE_CHANGES of them in address order, the image holds all of them.
+ * It must not block
+ */
+typedef void (*mb_change_cb_t)(struct modbusPoll_s *xPoll, const modbusChange_t *xChanges, uint16_t u16Changed);
+
+/**
+ * @struct modbusPoll_t
+ * @brief
+ * Entry of the master poll table, see ModbusSetPollTable().
+ * Released entries are sent earliest deadline first, the deadline of a poll is its next release
+ */
+typedef struct modbusPoll_s
+{
+    modbus_t telegram;     /*!< Query sent every period, its xCallback reports each result when not NULL */
+    uint32_t u32PeriodMs;  /*!< Poll period in ms, greater than 0 */
+    uint32_t u32PhaseMs;   /*!< Delay of the first release in ms */
+    uint8_t u8Priority;    /*!< Order between equal deadlines, 0 is the highest */
+    TickType_t xRelease;   /*!< Next release, maintained by the master task */
+    TickType_t xDeadline;  /*!< Deadline of the query in progress, maintained by the master task */
+    uint16_t u16Overruns;  /*!< Queries completed after their deadline or released a whole period late */
+    int8_t i8lastResult;   /*!< Result of the last query, ERR_OK_QUERY or an error code */
+#if ENABLE_MB_POLL_ADAPT == 1
+    uint32_t u32MaxPeriodMs;  /*!< Longest period the bus load may stretch u32PeriodMs to, 0 for MB_ADAPT_SCALE_MAX only */
+    uint32_t u32EffPeriodMs;  /*!< Period in use, maintained by the master task */
+    uint32_t u32AchievedMs;   /*!< Mean period between the releases of the last window, 0 if none */
+    uint16_t u16Released;     /*!< Releases in the current window, maintained by the master task */
+#endif
+#if ENABLE_MB_RBE == 1
+    mb_change_cb_t xOnChange; /*!< Report by exception for FC3, FC4 and FC23 reads: NULL or called only when the answer changes the image */
+#endif
+}
+modbusPoll_t;
+
+#if ENABLE_MB_SUBSCRIBE == 1
+struct modbusSub_s;
+
+/**
+ * Callback of a subscription, called from the master task after an answer in which
+ * u16Crossed values of the range moved beyond the deadband, the first one at index
+ * u16First. u16Last holds the values reported. It must not block
+ */
+typedef void (*mb_sub_cb_t)(struct modbusSub_s *xSub, uint16_t u16First, uint16_t u16Crossed);
+
+/**
+ * @struct modbusSubEvent_t
+ * @brief
+ * Item posted to the xQueue of a subscription, the values are in u16Last of xSub
+ */
+typedef struct
+{
+    struct modbusSub_s *xSub; /*!< Subscription whose values moved */
+    uint16_t u16First;        /*!< Index in the range of the first value beyond the deadband */
+    uint16_t u16Crossed;      /*!< Values beyond the deadband */
+}
+modbusSubEvent_t;
+
+/**
+ * @struct modbusSub_t
+ * @brief
+ * Subscription of a consumer to a range of slave data, see ModbusSubscribe().
+ * Any answer of the master covering the range is compared with the values last
+ * reported, each value is reported again once it moved beyond u16Deadband
+ */
+typedef struct modbusSub_s
+{
+    uint8_t u8id;          /*!< Slave address, 1 to 247 */
+    uint8_t u8fct;         /*!< Table: MB_FC_READ_COILS, MB_FC_READ_DISCRETE_INPUT, MB_FC_READ_REGISTERS (FC3 and FC23 answers) or MB_FC_READ_INPUT_REGISTER */
+    uint16_t u16Add;       /*!< First coil or register of the range */
+    uint16_t u16Count;     /*!< Coils or registers of the range */
+    uint16_t u16Deadband;  /*!< Registers: change to report, greater than the deadband. Ignored for coils, any change is reported */
+    bool xSigned;          /*!< Registers: the deadband compares int16_t values */
+    uint16_t *u16Last;     /*!< Values last reported, u16Count registers or (u16Count + 15) / 16 words of coils */
+    mb_sub_cb_t xCallback; /*!< NULL or called with each report */
+    QueueHandle_t xQueue;  /*!< NULL or gets a modbusSubEvent_t with each report, without waiting */
+    void *pvContext;       /*!< Free for the consumer */
+    uint16_t u16Dropped;   /*!< Set by the master: reports not posted, xQueue was full */
+    bool xPrimed;          /*!< Set by the master: u16Last holds a report, the first answer reports every value */
+    struct modbusSub_s *xNext; /*!< Set by the master: next subscription of the handler */
+}
+modbusSub_t;
+#endif
+
+/**
+ * @struct modbusCache_t
+ * @brief
+ * Range of slave data cached by the master, see ModbusSetCache().
+ * A read inside a fresh range is answered from u16reg without a query
+ */
+typedef struct
+{
+    uint8_t u8id;          /*!< Slave address between 1 and 247 */
+    mb_functioncode_t u8fct; /*!< Read function code of the range: 1, 2, 3 or 4 */
+    uint16_t u16RegAdd;    /*!< Address of the first register or coil of the range */
+    uint16_t u16CoilsNo;   /*!< Number of registers or coils of the range */
+    uint16_t *u16reg;      /*!< Image of the range, the coils packed 16 per register like in telegrams */
+    TickType_t xMaxAge;    /*!< Ticks an answer stays fresh */
+    TickType_t xUpdated;   /*!< Tick of the answer in u16reg, maintained by the master task */
+    bool xValid;           /*!< u16reg holds an answer, maintained by the master task */
+#if MB_ENABLE_FC_DELTA == 1
+    bool xDelta;           /*!< FC3 or FC4 range that the slave serves as a block of MB_FC_READ_DELTA: a read of exactly the range asks for its changes only */
+    uint32_t u32Gen;       /*!< Generation of the slave copy in u16reg, 0 for none, maintained by the master task */
+#endif
+}
+modbusCache_t;
+
+/**
+ * @struct modbusGuard_t
+ * @brief
+ * Silence a slave needs before a query on top of T3.5, see ModbusSetGuards()
+ */
+typedef struct
+{
+    uint8_t u8id;          /*!< Slave address between 1 and 247, 0 for the broadcasts */
+    uint32_t u32GuardUs;   /*!< Microseconds of silence after T3.5 */
+}
+modbusGuard_t;
+
+
+/**
+ * @struct modbusRespCache_t
+ * @brief
+ * Answer of a slave kept for the next identical FC3 or FC4 request, see ENABLE_MB_RESP_CACHE
+ */
+typedef struct
+{
+	uint8_t u8Request[8];  //request ADU, its CRC included
+	uint8_t u8Table;       //DB_HOLDING_REGISTER or DB_INPUT_REGISTERS, 0 for a free entry
+	uint16_t u16Size;      //bytes of u8Answer, CRC included
+	uint32_t u32Gen;       //generation of the table the answer was read at
+	uint8_t u8Answer[MAX_BUFFER];
+}
+modbusRespCache_t;
+
+/**
+ * @struct modbusTransport_t
+ * @brief
+ * Operations of one physical layer. ModbusInit() selects the table of xTypeHW, the
+ * protocol core only goes through it, so a new PHY is one more table in Modbus.c
+ */
+#define MB_TP_UART    0x01 //!< the HAL UART callbacks of port serve the handler
+#define MB_TP_MBAP    0x02 //!< ADUs with an MBAP header and no CRC, the events of the task are counted
+#define MB_TP_RX_CRC  0x04 //!< the RX interrupt computes the CRC of the frame in u16FrameCRC
+#define MB_TP_LRC     0x08 //!< ASCII frames: the check field is an LRC byte and a pad byte in place of the CRC
+
+struct modbusHandler_s;
+
+typedef struct
+{
+	void (*start)(struct modbusHandler_s *modH);      //!< ModbusStart(): derives the line timing and arms the reception
+	void (*wait)(struct modbusHandler_s *modH);       //!< slave task: blocks until a request is signalled
+	int16_t (*recvFrame)(struct modbusHandler_s *modH); //!< moves the signalled frame to u8Buffer, 0 if there is none for us
+	void (*send)(struct modbusHandler_s *modH);       //!< sends u8Buffer, the CRC is already appended without MB_TP_MBAP
+	void (*abort)(struct modbusHandler_s *modH);      //!< master: drops what was received before a new query, may be NULL
+	void (*release)(struct modbusHandler_s *modH);    //!< slave: u8Buffer is free again after a request, master: after a stray frame, may be NULL
+	void (*serve)(struct modbusHandler_s *modH);      //!< one pass of the Modbus task replacing the RTU one, NULL on serial lines
+	uint8_t u8Flags; //!< MB_TP_xxx
+}
+modbusTransport_t;
+
+
+#if ENABLE_MB_CONST_CONFIG == 1
+/**
+ * @struct modbusConfig_t
+ * @brief
+ * Configuration of a handler, const and flash resident, loaded by ModbusInit() from xConfig.
+ * The fields have the meaning of those of modbusHandler_t with the same name
+ */
+typedef struct
+{
+	mb_masterslave_t uModbusType;
+	mb_hardware_t xTypeHW;
+	UART_HandleTypeDef *port;
+	GPIO_TypeDef *EN_Port; //!< NULL without flow control pin
+	uint16_t EN_Pin;
+	uint8_t u8id;
+	uint16_t u16timeOut; //!< master: timeout of the answers in ticks
+	uint16_t *u16regsHR;
+	uint16_t u16regHR_size;
+	uint16_t *u16regsCoils;
+	uint16_t u16regCoils_size;
+#if MB_ENABLE_SLAVE == 1
+	uint16_t *u16regsRO;
+	uint16_t u16regRO_size;
+	uint16_t *u16regsCoilsRO;
+	uint16_t u16regCoilsRO_size;
+#endif
+	osPriority_t xTaskPriority; //!< 0 for osPriorityNormal
+	uint32_t u32TaskStack; //!< 0 for MB_TASK_STACK
+}
+modbusConfig_t;
+#endif
+
+/**
+ * @struct modbusHandler_t
+ * @brief
+ * Modbus handler structure
+ * Contains all the variables required for Modbus daemon operation.
+ * The members are grouped by width to avoid padding, the state of the master
+ * and of the slave share the same storage
+ */
+typedef struct modbusHandler_s
+{
+
+	mb_masterslave_t uModbusType;
+	mb_hardware_t xTypeHW; // type of hardware  TCP, USB CDC, USART
+	const modbusTransport_t *xTransport; // operations of xTypeHW, selected by ModbusInit()
+#if ENABLE_MB_CONST_CONFIG == 1
+	const modbusConfig_t *xConfig; //!< configuration loaded by ModbusInit(), NULL keeps the fields set by the application
+#endif
+	UART_HandleTypeDef *port; //HAL Serial Port handler
+	GPIO_TypeDef* EN_Port; //!< flow control pin: 0=USB or RS-232 mode, >1=RS-485 mode
+	uint16_t *u16regsHR;
+	uint16_t *u16regsCoils;
+	osPriority_t xTaskPriority; //!< priority of the Modbus task, 0 for osPriorityNormal
+	uint32_t u32TaskStack; //!< stack of the Modbus task in bytes, 0 for MB_TASK_STACK
+#if ENABLE_TIM_T35 == 1
+	TIM_HandleTypeDef *xTimT35; //optional timer counting at 1 MHz for T35 in USART_HW mode, NULL keeps xTimerT35
+	uint8_t u8TimT35Channel; //1 to 4: xTimT35 runs free, shared by the handlers, and T35 is a compare of this channel. 0 runs it in one-pulse mode
+#endif
+#if ENABLE_LPTIM_T35 == 1
+	LPTIM_TypeDef *xLptimT35; //optional LPTIM counting at MB_LPTIM_HZ for T35 in LPUART_HW mode, NULL keeps xTimerT35
+#endif
+	mb_errot_t i8lastError;
+	uint32_t u32T15us; //inter-character timeout T1.5 in microseconds, computed by ModbusStart() from the port settings
+	uint32_t u32T35us; //inter-frame delay T3.5 in microseconds, computed by ModbusStart() from the port settings
+	uint16_t EN_Pin;  //!< flow control pin: 0=USB or RS-232 mode, >1=RS-485 mode
+	uint16_t u16timeOut;
+	uint16_t u16regHR_size;
+	uint16_t u16regCoils_size;
+	uint16_t u16BufferSize;
+	uint16_t u16InCnt, u16OutCnt, u16errCnt; //keep statistics of Modbus traffic
+#if ENABLE_MB_WATCHDOG == 1
+	uint32_t u32Recoveries; //!< resets of the line by the watchdog, after a lost event or a stuck transmission
+#endif
+#if ENABLE_RX_CRC == 1
+	uint16_t u16RxCRC; //running CRC of the bytes received by the RX interrupt
+	uint16_t u16FrameCRC; //CRC of the whole last frame including its CRC field, 0 when the frame is valid
+#endif
+#if ENABLE_LPTIM_T35 == 1
+	uint16_t u16LpT35; //T35 in counts of xLptimT35, computed by ModbusStart()
+	volatile uint16_t u16LpLast; //count of xLptimT35 at the last received byte
+#endif
+	uint8_t u8id; //!< 0=master, 1..247=slave number
+	uint8_t u8lastRec;
+	uint8_t dataRX;
+	int8_t i8state;
+	volatile bool xRxStart; //USART_HW mode: the next byte received is the address of a frame
+	volatile bool xRxDrop; //USART_HW mode: the frame in progress is for another slave, its bytes are not stored
+	volatile bool xStopped; //ModbusStop() holds ModBusSphrHandle until ModbusReconfigure()
+#if ENABLE_MB_LISTEN_ONLY == 1
+	volatile bool xListenOnly; //slave: the requests for its ID are applied and never answered, see ModbusSetListenOnly()
+#endif
+#if ENABLE_MB_ASCII == 1
+	volatile bool xAsciiFrame; //ASCII_HW mode: a ':' started the frame in progress, its CRLF has not come yet
+	uint8_t u8AsciiHigh; //ASCII_HW mode: high nibble of the byte in progress, MB_ASCII_NONE before it
+	uint16_t u16AsciiStart; //ASCII_HW mode: head of xBufferRX at the ':' of the frame in progress
+	uint8_t u8AsciiTx[MB_ASCII_MAX]; //ASCII_HW mode: text of the frame sent
+#endif
+#if ENABLE_LPTIM_T35 == 1
+	volatile bool xLpArmed; //the compare of xLptimT35 waits for T35 after the last received byte
+#endif
+#if ENABLE_MB_TICKLESS == 1
+	TickType_t xPollLast; //slave: tick of the last request for the node
+	TickType_t xPollPeriod; //slave: ticks between its last two requests, 0 before the second one
+#endif
+#if ENABLE_RX_PREDICT == 1
+	uint8_t u8RxHead[MB_RX_HEADER]; //USART_HW mode: first bytes of the frame in progress
+	uint16_t u16RxCount; //USART_HW mode: bytes of the frame in progress
+	uint16_t u16RxNeed; //USART_HW mode: bytes after which predictFrameLength() is asked again, 0 when the length is unpredictable
+	volatile bool xRxEarly; //USART_HW mode: the frame ended at its predicted length, T35 finds nothing to end
+#endif
+#if ENABLE_RX_MERGE == 1 && ENABLE_MB_ERR_STATS == 1
+	uint32_t u32RxLast; //USART_HW mode: cycle counter at the last received byte
+	uint32_t u32RxGap; //USART_HW mode: cycles from byte to byte beyond which the silence exceeds T1.5
+#endif
+#if ENABLE_USART_DE == 1
+	bool xHwDE; //true when the USART drives the RS485 DE pin itself (USARTx_DE alternate function), EN_Port must be NULL
+	uint8_t u8DEAssertBits; //DE assertion time before the start bit in bit times, clamped to 31 samples (1.9 bits at oversampling 16)
+	uint8_t u8DEDeassertBits; //DE deassertion time after the last stop bit in bit times, same limit
+#endif
+#if ENABLE_USART_RTO == 1
+	bool xRTO; //true when T35 is detected by the USART receiver timeout instead of xTimerT35
+#endif
+#if ENABLE_USART_FIFO == 1
+	bool xFIFO; //true when the RX FIFO delivers blocks of NbRxDataToProcess bytes per interrupt
+	uint8_t u8FifoRx[MB_FIFO_BLOCK]; //block received from the RX FIFO
+#endif
+#if ENABLE_MB_SHARED_TASK == 1
+	volatile uint8_t u8Events; //MB_EV_ events waiting for the shared task
+#endif
+#if ENABLE_MB_ISR_DEFER == 1
+	volatile uint16_t u16DeferOps; //MB_EV_ events and MB_DEFER_ operations waiting for ModbusDeferCallback()
+#endif
+#if ENABLE_MB_TRACE == 1
+	volatile uint8_t u8TraceHead; //record of xTrace stamped by the transaction in progress
+	modbusTrace_t xTrace[MB_TRACE_DEPTH]; //last transactions, see ModbusGetTrace()
+#endif
+#if ENABLE_MB_ERR_STATS == 1
+	modbusErrStats_t xErrStats; //see ModbusGetErrStats()
+#endif
+#if ENABLE_MB_EVENT_LOG == 1 || ENABLE_MB_TIMER_MUX == 1 || ENABLE_MB_EVENT_RING == 1
+	uint8_t u8Handler; //position in mHandlers, recorded in the events and slot of the ENABLE_MB_TIMER_MUX deadlines
+#endif
+#if ENABLE_MB_STATS == 1 || ENABLE_MB_TURNAROUND == 1 || ENABLE_MB_ARBITRATION == 1 || ENABLE_MB_PACING == 1 || ENABLE_MB_WIRE_STATS == 1
+	uint32_t u32RxEnd; //cycle counter at the end of the last frame
+#endif
+#if ENABLE_MB_WIRE_STATS == 1
+	modbusWireStats_t xWire; //counters of ModbusGetWireStats(), the derived fields are computed there
+	TickType_t xWireSince; //start of the accounting
+	uint32_t u32WireTxStart; //cycle counter at the start of the last query of a master
+	uint32_t u32WireTxUs; //wire time of that query
+#endif
+#if ENABLE_MB_STATS == 1
+	modbusHist_t xStatFrame; //!< sizes in bytes of the received frames
+#endif
+#if ENABLE_MB_RUNTIME == 1
+	uint64_t u64IsrCycles; //cycles of the UART callbacks of the handler, see ModbusGetRuntime()
+	uint32_t u32IsrCalls;
+	uint32_t u32IsrMax;
+	modbusRuntimeMark_t xRtApp; //counters at the previous ModbusGetRuntime()
+	modbusRuntimeMark_t xRtDiag; //counters at the previous read of the diagnostics block
+#endif
+#if ENABLE_MB_MONITOR == 1
+	// state of an MB_MONITOR handler, it uses none of the master or slave fields
+	modbusMonitor_t xMonitor; //see ModbusGetMonitor()
+	uint32_t u32MonChar; //cycles of one character at the port settings
+	uint32_t u32MonEnd; //cycle counter at the end of the last byte of the frame in u8Buffer
+	uint32_t u32MonLast; //cycle counter at the end of the previous frame
+	uint32_t u32MonReq; //cycle counter at the end of the pending request
+	uint8_t u8MonReqId; //slave ID of the pending request
+	uint8_t u8MonReqFct; //function code of the pending request
+	uint8_t u8MonNext; //entry of xMonitor.xSlaves reused next
+	bool xMonPending; //a request waits for its answer
+#endif
+#if MB_ENABLE_IP == 1
+	uint16_t u16TcpPort; //!< TCP_HW and UDP_HW: port of the server, 0 for MB_TCP_PORT (MB_TLS_PORT with TLS)
+	uint16_t u16TransactionID; //transaction ID of the last ADU received
+#endif
+#if ENABLE_MB_TLS == 1
+	const modbusTlsOps_t *xTls; //!< TCP_HW: TLS layer of the connections, NULL for plain Modbus TCP, see ModbusSetTls()
+#endif
+#if ENABLE_USB_CDC == 1
+	USBD_HandleTypeDef *xUsbDevice; //!< USB_CDC_HW: CDC device of the handler, &hUsbDeviceFS of usb_device.c
+	volatile uint16_t u16UsbRxLen; //USB_CDC_HW: bytes of the frame received so far in u8Buffer
+	volatile uint16_t u16UsbRxCRC; //USB_CDC_HW: running CRC of these bytes, 0 when they end with their own CRC
+	volatile bool xUsbRxArmed; //USB_CDC_HW: the OUT endpoint takes the next packet, false keeps the host NAKed
+#endif
+#if ENABLE_MB_BLE == 1
+	bool (*xBleNotify)(struct modbusHandler_s *modH, const uint8_t *u8Data, uint16_t u16Len); //!< BLE_HW: sends one notification of the Modbus characteristic, false while the stack has no buffer
+	void *pvBleContext; //!< BLE_HW: free for xBleNotify, the connection handle for instance
+	volatile uint16_t u16BleMtu; //BLE_HW: ATT MTU of the link, 0 while no central is connected
+	volatile uint16_t u16BleRxLen; //BLE_HW: bytes of the request PDU received so far, behind the ID in u8Buffer
+	volatile bool xBleRxArmed; //BLE_HW: the writes go to u8Buffer, false while the task serves a request
+	volatile bool xBleRxOver; //BLE_HW: the PDU did not fit in u8Buffer, its writes are dropped until it ends
+#endif
+
+	//FreeRTOS components
+
+	//Task Modbus slave
+	osThreadId_t myTaskModbusAHandle;
+#if ENABLE_MB_TIMER_MUX != 1
+	//Timer RX Modbus
+	xTimerHandle xTimerT35;
+#endif
+	//Semaphore for Modbus data, the holding registers of a slave
+	osSemaphoreId_t ModBusSphrHandle;
+
+#if ENABLE_USART_DMA_INPLACE == 1
+	union
+	{
+		uint8_t u8Buffer[MAX_BUFFER] MB_DMA_ALIGN; //Modbus buffer for communication, the RX DMA writes the frames in it
+		modbusRingBuffer_t xBufferRX; //xBufferRX.uxBuffer is u8Buffer, u16head holds the frame length
+	};
+#else
+	uint8_t u8Buffer[MAX_BUFFER]; //Modbus buffer for communication
+	// RX ring buffer for USART
+	modbusRingBuffer_t xBufferRX;
+#endif
+#if ENABLE_USART_DMA == 1
+	// frames received in USART_HW_DMA_CIRC mode waiting for the task
+	modbusFrame_t xRxFrames[MAX_RX_FRAMES];
+	uint16_t u16RxPos; //last DMA position processed by the RX event callback
+	uint32_t u32RxTotal; //bytes written by the circular DMA up to u16RxPos, runs free
+	uint16_t u16RxFrameStart; //ring position of the frame in progress
+	uint16_t u16RxFrameLen; //bytes received for the frame in progress
+	volatile uint8_t u8RxFrameHead; //written only by the RX event callback
+	volatile uint8_t u8RxFrameTail; //written only by the Modbus task
+#if ENABLE_RX_MERGE == 1 || ENABLE_RX_PREDICT == 1
+	uint16_t u16RxMerged; //bytes of the frame in progress covered by u16RxMergeCRC, the DMA of USART_HW_DMA goes on after them
+	uint16_t u16RxMergeCRC; //running CRC of these bytes, 0 when they end with their own CRC
+#endif
+#if ENABLE_RX_MERGE == 1
+	volatile bool xRxMerging; //an IDLE event came inside a frame, the frame ends at its CRC or at T35
+#endif
+	volatile bool xRxRestart; //the HAL refused to restart the reception after an error, the task retries it
+#endif
+#if ENABLE_MB_RX_QUEUE == 1
+	MessageBufferHandle_t xRxQueue; //frames of USART_HW_DMA waiting for the task, NULL on the other lines
+#if ENABLE_MB_STATIC == 1
+	StaticMessageBuffer_t xRxQueueCb;
+	uint8_t u8RxQueue[MB_RX_QUEUE_BYTES + 1]; //the message buffer keeps one byte free
+#endif
+#endif
+#if ENABLE_MB_STATIC == 1
+	// storage of the RTOS objects created by ModbusInit()
+#if ENABLE_MB_SHARED_TASK != 1
+	StaticTask_t xTaskCb;
+	StackType_t xTaskStack[MB_TASK_STACK / sizeof(StackType_t)];
+#endif
+#if ENABLE_MB_TIMER_MUX != 1
+	StaticTimer_t xTimerT35Cb;
+#endif
+	StaticSemaphore_t xSphrCb[MB_SEMAPHORES]; //ModBusSphrHandle, then ModBusSphrROHandle, ModBusSphrCoilsHandle and ModBusSphrCoilsROHandle of a slave
+#endif
+
+	// state of the role, a handler is either a master or a slave
+#if MB_ENABLE_MASTER == 1 && MB_ENABLE_SLAVE == 1
+	union
+	{
+#endif
+#if MB_ENABLE_MASTER == 1
+	struct
+	{
+		//Queue Modbus Telegram: pooled copies of the queued telegrams, one FIFO of pool indexes per mb_priority_t
+		osSemaphoreId_t QueueTelegramHandle; //counts the queued telegrams, the master task waits on it
+		modbus_t xTelegramPool[MB_TELEGRAM_POOL];
+		uint8_t u8TelegramQueue[MB_PRIO_LEVELS][MB_TELEGRAM_POOL];
+		uint8_t u8TelegramHead[MB_PRIO_LEVELS];
+		uint8_t u8TelegramCount[MB_PRIO_LEVELS];
+		uint32_t u32TelegramFree; //bit i is set while xTelegramPool[i] is free
+		modbus_t *xTelegramRef[MB_TELEGRAM_POOL]; //telegram of each entry, xTelegramPool[i] or the one of ModbusQueryRef()
+		int8_t i8TelegramSlot; //entry of the query in progress, -1 for none or a poll of the table
+#if ENABLE_MB_TIMER_MUX != 1
+		//Timer MasterTimeout
+		xTimerHandle xTimerTimeout;
+#endif
+		//Master poll table, see ModbusSetPollTable()
+		modbusPoll_t *xPollTable;
+		modbusPoll_t *xPollCurrent; //entry of the query in progress, NULL for queued queries
+#if ENABLE_MB_POLL_ADAPT == 1
+		TickType_t xAdaptStart; //start of the load window
+		uint32_t u32AdaptBusyUs; //wire time of the window so far
+		uint16_t u16AdaptScale; //period of the slowed down polls in 0.1 % of u32PeriodMs
+		uint16_t u16BusLoad; //load of the last window in 0.1 %
+#endif
+#if ENABLE_MB_SUBSCRIBE == 1
+		modbusSub_t *xSubs; //subscriptions of ModbusSubscribe(), compared with each answer
+#endif
+		modbusTransaction_t xTransaction; //destinations of the answer of the serial query in progress
+#if ENABLE_MB_DEFERRED_DECODE == 1
+		osThreadId_t xDecodeTask; //decodes the answers of xDecode, see StartTaskModbusDecode()
+		modbusDecode_t xDecode[MB_DECODE_DEPTH]; //ring of the answers handed over by the master task
+		volatile uint8_t u8DecodeHead; //written only by the master task
+		volatile uint8_t u8DecodeTail; //written only by the decode task, once its answer is reported
+#endif
+#if ENABLE_MB_ADAPTIVE_TIMEOUT == 1 || ENABLE_MB_STATS == 1 || ENABLE_MB_NODE_STATS == 1
+		TickType_t xQuerySent; //tick of the last transmission of the query in progress
+#endif
+		uint16_t u16QueryTimeOut; //timeout of the query in progress in ticks
+#if ENABLE_MB_WATCHDOG == 1
+		TickType_t xWatchStart; //tick of the last transmission of the query in progress, see watchdogLeft()
+#endif
+		uint8_t u8PollCount;
+		uint8_t u8Attempts; //number of times the query in progress was sent again
+#if ENABLE_MB_ARBITRATION == 1
+		uint8_t u8ArbSlot; //!< serial lines shared by masters: slot of this master, 0 to u8ArbSlots - 1, 0 wins an idle bus first
+		uint8_t u8ArbSlots; //!< masters on the bus, each one has its own u8ArbSlot. 0 sends without arbitration
+		uint32_t u32ArbIdleUs; //!< silence ending a transaction of another master, longer than the slowest answer of its slaves
+		uint32_t u32ArbSlotUs; //!< length of a slot, longer than the interrupt latency plus two characters
+		uint16_t u16ArbMark; //u16RxFrames when the last query of this master was sent
+#endif
+#if ENABLE_MB_ARBITRATION == 1 || ENABLE_MB_TDMA == 1
+		volatile uint16_t u16RxFrames; //frames heard on the bus, counted by traceFrame()
+#endif
+#if ENABLE_MB_TDMA == 1
+		modbus_t *xSchedule; //telegrams of the slots, see ModbusSetSchedule()
+		uint8_t u8SchedCount; //slots of the cycle, 0 without a schedule
+		bool xSchedDMA; //the timer interrupt sends the frames by DMA
+		volatile bool xSchedRun; //the timer starts the slots, cleared by ModbusStop()
+		uint32_t u32SchedTurnUs; //turnaround of the slaves in each slot
+		uint32_t u32SchedCycleMin; //cycle asked by ModbusSetSchedule(), 0 for the shortest
+		uint32_t u32SchedCycle; //!< length of the cycle in microseconds, computed when the schedule starts
+		uint32_t u32SchedOffset[MB_TDMA_SLOTS]; //!< start of each slot in the cycle in microseconds
+		uint32_t u32SchedBase; //timer count at the start of the current cycle
+		uint8_t u8SchedNext; //slot started by the next compare
+		uint8_t u8SchedOpen; //slot whose answer the task takes, MB_TDMA_NONE before the first one
+		bool xSchedAnswered; //the result of u8SchedOpen was reported
+		volatile uint32_t u32SchedStarts; //!< slots started by the timer
+		uint32_t u32SchedDone; //slot starts handled by the task
+		volatile uint32_t u32SchedLate; //!< slots left silent, their frame was not built in time
+		uint16_t u16SchedFrames; //frames of u16RxFrames taken by the task
+		uint16_t u16SchedMark[2]; //u16RxFrames at the last two slot starts
+		volatile uint32_t u32SchedTxFor[2]; //slot start each frame of u8SchedTx was built for
+		uint16_t u16SchedTxSize[2];
+		uint8_t u8SchedTx[2][MAX_BUFFER]; //frames of the next two slots, sent by the timer interrupt
+#endif
+#if ENABLE_MB_PREBUILT == 1
+		const uint8_t *u8TxFrame; //prebuilt frame of the query in progress sent by sendUart(), NULL to send u8Buffer
+#endif
+#if MB_SLAVE_TABLE == 1
+		uint8_t u8SlaveNext; //entry reused for the next new slave
+#endif
+#if ENABLE_MB_MERGE == 1
+		uint8_t u8Merged; //number of telegrams in xMerged, 0 when the query was not merged
+#endif
+#if ENABLE_MB_CACHE == 1
+		modbusCache_t *xCache; //ranges cached by the master, see ModbusSetCache()
+		uint8_t u8CacheCount;
+#if MB_ENABLE_FC_DELTA == 1
+		modbusCache_t *xDeltaCache; //range refreshed by the query in progress with MB_FC_READ_DELTA, NULL for the other queries
+#endif
+#endif
+#if ENABLE_MB_PACING == 1
+		uint32_t u32PaceGuardUs; //!< serial lines: silence after T3.5 before a query, for the slaves without a guard in xPaceGuards
+		const modbusGuard_t *xPaceGuards; //guards of the slower slaves, see ModbusSetGuards()
+		uint8_t u8PaceGuardCount;
+#if ENABLE_MB_TIMER_MUX == 1
+		const uint8_t *u8PaceTx; //query started by the MB_TIMER_TIMEOUT slot of the handler once the line was silent long enough
+		uint16_t u16PaceSize; //bytes of u8PaceTx
+		bool xPaceDMA; //the query of u8PaceTx goes out by DMA
+		uint32_t u32PaceUs; //silence of u8PaceTx counted from the stamp of the end of a frame
+		volatile bool xPacePending; //u8PaceTx waits for its slot, the line is not driven yet
+#endif
+#endif
+#if ENABLE_MB_RBE == 1
+		uint16_t u16Changed; //registers changed by the answer of the report by exception poll in progress
+		modbusChange_t xChanges[MB_RBE_CHANGES]; //first changes of that answer
+#endif
+#if ENABLE_MB_SHARED_TASK == 1
+		modbus_t *xTelegram; //telegram of the query in progress (master)
+#endif
+#if MB_SLAVE_TABLE == 1
+		modbusSlave_t xSlaves[MAX_SLAVES]; //answer times and health of the polled slaves
+#endif
+#if ENABLE_MB_NODE_STATS == 1
+		modbusNodeStats_t xNodes[MB_NODE_STATS]; //statistics of the slaves, in the order of their first query
+		uint8_t u8NodeIndex[256]; //entry + 1 of xNodes of each slave ID, 0 when not tracked
+		uint8_t u8NodeCount; //entries of xNodes in use
+#endif
+#if ENABLE_MB_MERGE == 1
+		modbus_t xMerged[MB_MERGE_MAX]; //telegrams answered by the query in progress
+#if MB_ENABLE_FC_RANGES == 1
+		bool xMergeRanges; //!< the polled slaves serve MB_FC_READ_RANGES: reads too far apart for one FC3/FC4 read are merged into one ranges query
+		modbusRange_t xMergedRanges[MB_MERGE_MAX]; //ranges of that query, one per merged telegram
+#endif
+		uint16_t u16MergeRegs[MB_MERGE_REGS]; //answer of a merged query before it is copied to each telegram
+#endif
+#if MB_ENABLE_IP == 1
+		ip_addr_t xTcpServer; //!< TCP_HW and UDP_HW: address of the slave, on port u16TcpPort
+		struct netconn *xTcpClient; //TCP connection or UDP netconn to the slave, opened by the master task for the first query
+		struct pbuf *xTcpRx; //received bytes not matched yet, they may end inside an ADU
+#if ENABLE_MB_TLS == 1
+		void *pvTlsClient; //TLS session of xTcpClient
+#endif
+		uint16_t u16TcpNextID; //transaction ID of the next query
+		modbusTcpQuery_t xTcpQueries[TCPINFLIGHT]; //queries on the connection waiting for their answer
+#endif
+#if ENABLE_MB_STATIC == 1
+#if ENABLE_MB_TIMER_MUX != 1
+		StaticTimer_t xTimerTimeoutCb;
+#endif
+		StaticSemaphore_t xQueueTelegramCb;
+#if ENABLE_MB_DEFERRED_DECODE == 1
+		StaticTask_t xDecodeTaskCb;
+		StackType_t xDecodeStack[MB_DECODE_STACK / sizeof(StackType_t)];
+#endif
+#endif
+	};
+#endif
+#if MB_ENABLE_SLAVE == 1
+	struct
+	{
+		const modbusSegment_t *xSegHR; //!< sparse holding register map, replaces u16regsHR/u16regHR_size when not NULL
+		const modbusSegment_t *xSegRO; //!< sparse input register map, replaces u16regsRO/u16regRO_size when not NULL
+		const modbusUnit_t *xUnits; //!< further unit IDs answered by a slave, set before ModbusStart()
+		const modbusUnit_t *xUnitActive; //unit whose tables are loaded in the handler
+		uint16_t *u16regsRO;
+		uint16_t *u16regsCoilsRO;
+#if ENABLE_MB_RO_SNAPSHOT == 1
+		uint16_t *u16regsROBank[2]; //!< input register snapshots, replace u16regsRO when set by ModbusSetROBanks()
+		volatile uint32_t u32ROSeq; //!< publish counter, u16regsROBank[u32ROSeq & 1] is the snapshot served to the master
+#if ENABLE_MB_TIMESTAMP == 1
+		uint16_t u16ROStamp; //input register of the time of a published snapshot, see ModbusSetROStamp()
+		bool xROStamp; //u16ROStamp is set
+#endif
+#endif
+#if ENABLE_MB_HR_COMMIT == 1
+		modbusHRBank_t xHROwn; //banks of ModbusSetHRBanks()
+		modbusHRBank_t *xHRBank; //!< committed holding registers, xHROwn or a shared bank, u16regsHR is its staging bank
+		uint16_t u16HRStageAdd; //first register written by the request in progress
+		uint16_t u16HRStageEnd; //register after the last one written, 0 when nothing is staged
+#endif
+#if ENABLE_MB_TIMESTAMP == 1
+		uint16_t u16TimeAdd; //holding register of the time written by the master, see ModbusSetTimeSync()
+		bool xTimeSync; //u16TimeAdd is set
+		int64_t i64TimeOffset; //time of the master minus the local time at the last synchronisation, in microseconds
+		uint64_t u64TimeSynced; //local time of the last synchronisation in microseconds, 0 before the first one
+		int32_t i32TimePpm; //rate of the clock of the master against the local one, in parts per million
+#endif
+		//Semaphore for the input registers u16regsRO
+		osSemaphoreId_t ModBusSphrROHandle;
+		//Semaphore for the coils u16regsCoils
+		osSemaphoreId_t ModBusSphrCoilsHandle;
+		//Semaphore for the discrete inputs u16regsCoilsRO
+		osSemaphoreId_t ModBusSphrCoilsROHandle;
+		modbusUnit_t xUnitMain; //tables of u8id, saved by ModbusStart() when there are xUnits
+		uint16_t u16regRO_size;
+		uint16_t u16regCoilsRO_size;
+		uint8_t u8SegHR_count;
+		uint8_t u8SegRO_count;
+		uint8_t u8UnitCount;
+#if MB_SLAVE_FILES
+		const modbusFile_t *xFiles; //!< files of FC20 and FC21, see ModbusSetFiles()
+		uint8_t u8FileCount;
+#endif
+#if MB_SLAVE_FIFOS
+		modbusFifo_t *xFifos; //!< FIFO queues of FC24, see ModbusSetFifos()
+		uint8_t u8FifoCount;
+#endif
+#if MB_SLAVE_DEVID
+		const modbusDevIdObj_t *xDevId; //!< identification objects of FC43/14, see ModbusSetDeviceId()
+		uint8_t u8DevIdCount;
+		uint8_t u8DevIdConformity; //conformity level of the answers, from the object ids of xDevId
+#endif
+#if MB_SLAVE_DELTAS
+		modbusDeltaBlock_t *xDeltas; //!< blocks of MB_FC_READ_DELTA, see ModbusSetDeltas()
+		uint8_t u8DeltaCount;
+#endif
+#if ENABLE_MB_STATS == 1
+		modbusHist_t xStatLatency; //!< microseconds from the end of a request to the start of its answer
+#endif
+#if ENABLE_MB_DIAG_REGS == 1 && ENABLE_MB_NODE_STATS == 1
+		struct modbusHandler_s *xNodeMaster; //!< master whose node table follows the diagnostics block, NULL reads 0
+#endif
+#if ENABLE_MB_TURNAROUND == 1
+		uint32_t u32TurnMinUs; //!< serial lines: shortest time from the end of a request to its answer in microseconds, 0 answers at once
+		uint32_t u32TurnMaxUs; //!< serial lines: an answer not ready this long after the end of its request is dropped, 0 for no limit
+#if ENABLE_MB_TIMER_MUX == 1
+		const uint8_t *u8TurnTx; //answer started by the MB_TIMER_TIMEOUT slot of the handler once u32TurnMinUs elapsed
+		uint16_t u16TurnSize; //bytes of u8TurnTx
+		bool xTurnDMA; //the answer of u8TurnTx goes out by DMA
+		volatile bool xTurnPending; //u8TurnTx waits for its slot, the line is not driven yet
+#endif
+#endif
+#if ENABLE_MB_THROTTLE == 1
+		uint16_t u16ReqRate; //!< requests processed per second, the others are answered EXC_BUSY, 0 for no limit
+		uint16_t u16ReqBurst; //!< requests processed in a row after a quiet time, 0 for u16ReqRate
+		uint32_t u32CpuUs; //!< microseconds of request processing per second, measured on the cycle counter, 0 for no limit
+		int32_t i32ReqCredit; //requests in the bucket, in 1 / configTICK_RATE_HZ
+		int64_t i64CpuCredit; //microseconds in the bucket, in 1 / configTICK_RATE_HZ, negative after a long request
+		TickType_t xThrottleTick; //last refill of the buckets
+#endif
+#if ENABLE_MB_WRITE_NOTIFY == 1
+		uint32_t *u32DirtyHR; //!< optional bitmap of MB_DIRTY_WORDS(u16regHR_size) words, bit i is set when the master writes u16regsHR[i]
+		uint32_t *u32DirtyCoils; //!< optional bitmap of MB_DIRTY_WORDS(u16regCoils_size) words, bit i is set when the master writes a coil of u16regsCoils[i]
+		EventGroupHandle_t xWriteEvents; //!< optional, gets the MB_DIRTY_ bits of the tables written by the master
+		TaskHandle_t xWriteTask; //!< optional, notified with the MB_DIRTY_ bits (eSetBits)
+#endif
+#if ENABLE_MB_ACCESS == 1
+		volatile bool xWriteUnlocked; //!< set by the application, for example from the xOnWrite of an unlock register, opens the u32Locked registers
+#endif
+#if ENABLE_MB_RETAIN == 1
+		modbusRetain_t *xRetain; //!< optional MB_RETAIN image, u16regsHR and u16regsCoils must be MB_RETAIN too
+		bool xRetained; //!< set by ModbusInit() when the tables of xRetain survived the reset, the application then keeps them
+#endif
+#if ENABLE_MB_AUTOBAUD == 1
+		volatile uint16_t u16BaudHits; //requests with a good CRC for the slave since ModbusAutoBaud() tried the current rate
+#endif
+#if ENABLE_MB_TX_BUFFER == 1
+		uint8_t u8BufferTX[MAX_BUFFER]; //answer being sent, u8Buffer is free for the next request meanwhile
+#endif
+#if ENABLE_MB_RESP_CACHE == 1
+		volatile uint32_t u32TableGen[4]; //generation of each DB_ table (index u8table - 1), raised by every write
+		modbusRespCache_t xRespCache[MB_RESP_CACHE]; //last answers to FC3 and FC4
+		modbusRespCache_t *xRespFill; //entry taking the answer being sent, see sendTxBuffer()
+		uint8_t u8RespNext; //entry replaced by the next answer
+#endif
+#if ENABLE_MB_EXC_CACHE == 1
+		uint8_t u8ExcAdu[MB_EXC_CACHE][5]; //exception answers sent before: ID, function code with bit 7, exception code and CRC
+		uint8_t u8ExcNext; //entry replaced by the next new exception answer
+#endif
+#if ENABLE_MB_FAST_READ == 1
+		bool xFastRead; //!< USART_HW_DMA: plain FC1 to FC4 reads are answered in the RX event interrupt, see answerFastRead()
+#endif
+#if MB_TX_PARTS
+		const uint8_t *u8TxGather; //payload of the FC3 or FC4 answer, sent from its wire order segment after the header in u8Buffer
+		uint16_t u16TxGather; //bytes of the payload, 0 when the whole answer is in u8Buffer
+		const uint8_t *u8TxPart[2]; //payload and CRC, started one after the other by txDoneDMA()
+		uint16_t u16TxPart[2]; //bytes of u8TxPart
+		volatile uint8_t u8TxNext; //next part of u8TxPart to send, 2 when the answer is complete
+#endif
+#if ENABLE_MB_TX_STREAM == 1
+		bool xTxStream; //the payload is streamed through u8TxChunk instead of sent from u8TxGather
+		bool xTxStreamWire; //its registers are in wire order, copied without swap
+		const uint16_t *u16TxStream; //registers not yet put in a chunk
+		uint16_t u16TxStreamLeft; //bytes of the payload not yet put in a chunk
+		uint16_t u16TxStreamCRC; //running CRC of the bytes put in the chunks so far, not swapped
+		uint8_t u8TxStreamCRC[2]; //CRC of the answer, sent after the last chunk
+		uint8_t u8TxChunk[2][MB_TX_CHUNK]; //one chunk on the line while txDoneDMA() fills the other
+		uint16_t u16TxChunk[2]; //bytes of each chunk, 0 once the payload is all sent
+		uint8_t u8TxChunkNext; //chunk started at the next TX DMA interrupt
+#endif
+#if ENABLE_TCP == 1
+		struct netconn *xTcpListen; //listening netconn, opened by ModbusStart()
+		modbusTcpConn_t *xTcpActive; //connection of the request being served
+		volatile uint32_t u32TcpReady; //connections with lwIP events, bit i for xTcpConn[i] and MB_TCP_ACCEPT
+		uint8_t u8TcpOldest; //LRU list of the connections by last activity, it is also
+		uint8_t u8TcpNewest; //their order of idle deadline
+		uint16_t u16TcpTxLen; //bytes of the answers waiting in u8TcpTx
+		uint8_t u8TcpTx[TCPTXBUFFER]; //answers with their MBAP header to the requests of one pass on a connection
+		modbusTcpConn_t xTcpConn[NUMBERTCPCONN]; //clients served concurrently by the slave task
+#endif
+#if ENABLE_UDP == 1
+		struct netconn *xUdpConn; //netconn bound to u16TcpPort, opened by ModbusStart()
+		struct netbuf *xUdpRx; //datagram of the request being served, its source gets the answer
+#endif
+#if ENABLE_MB_GATEWAY == 1
+		modbusRoute_t *xRoutes; //!< buses of the unit IDs forwarded by the gateway, see ModbusSetGateway()
+		uint8_t u8RouteCount;
+		volatile uint32_t u32GwDone; //queries answered by their bus, bit i for xGwQueries[i]
+		modbusGwQuery_t xGwQueries[MB_GW_QUERIES]; //requests forwarded to the buses
+#endif
+	};
+#endif
+#if MB_ENABLE_MASTER == 1 && MB_ENABLE_SLAVE == 1
+	};
+#endif
+
+}
+modbusHandler_t;
+
+
+/**
+ * @struct modbusFunction_t
+ * @brief
+ * Entry of the slave function table, see ModbusRegisterFunction()
+ */
+typedef uint8_t (*mb_fc_validator_t)(modbusHandler_t *modH); //returns 0 or an exception code
+typedef int16_t (*mb_fc_handler_t)(modbusHandler_t *modH); //returns 0 to send u8Buffer, an exception code, or <0 for no answer
+
+typedef struct
+{
+	uint8_t u8fct; //!< function code
+	mb_fc_validator_t validate; //!< request check after the CRC, NULL when not needed
+	mb_fc_handler_t process; //!< builds the answer in u8Buffer and u16BufferSize
+}modbusFunction_t;
+
+
+enum
+{
+    RESPONSE_SIZE = 6,
     EXCEPTION_SIZE = 3,
     CHECKSUM_SIZE = 2
 };
 
 
 
-extern modbusHandler_t *mHandlers[MAX_M_HANDLERS];
+extern modbusHandler_t *mHandlers[MAX_M_HANDLERS];
+extern modbusHandler_t **volatile mHandlersByPort; // MB_PORT_SLOTS entries, swapped by ModbusInit() and ModbusDeInit()
+
+/**
+ * @brief
+ * Writes the cached bytes of a DMA TX buffer back to memory before the DMA
+ * reads them, see ENABLE_MB_DCACHE. The lines around the buffer are only
+ * written back, so any buffer can be cleaned. ISR safe
+ *
+ * @ingroup buffer
+ */
+static inline void cleanDCache(const void *pvBuf, uint32_t u32Size)
+{
+#if MB_DCACHE_MAINT
+	uintptr_t uStart = (uintptr_t)pvBuf & ~(uintptr_t)(MB_DCACHE_LINE - 1);
+
+	SCB_CleanDCache_by_Addr((uint32_t *)uStart, (int32_t)((uintptr_t)pvBuf + u32Size - uStart));
+#else
+	(void)pvBuf;
+	(void)u32Size;
+#endif
+}
+
+/**
+ * @brief
+ * Drops the cached copy of a DMA RX buffer, the CPU then reads what the DMA
+ * wrote. Only for MB_DMA_ALIGN buffers of whole cache lines. ISR safe
+ *
+ * @ingroup buffer
+ */
+static inline void invalidateDCache(void *pvBuf, uint32_t u32Size)
+{
+#if MB_DCACHE_MAINT
+	SCB_InvalidateDCache_by_Addr((uint32_t *)pvBuf, (int32_t)u32Size);
+#else
+	(void)pvBuf;
+	(void)u32Size;
+#endif
+}
+
+/**
+ * @brief
+ * Cleans and drops the cached lines of an RX buffer before its DMA starts, a
+ * line written by the CPU is not evicted later over the received bytes. ISR safe
+ *
+ * @ingroup buffer
+ */
+static inline void flushDCache(void *pvBuf, uint32_t u32Size)
+{
+#if MB_DCACHE_MAINT
+	uintptr_t uStart = (uintptr_t)pvBuf & ~(uintptr_t)(MB_DCACHE_LINE - 1);
+
+	SCB_CleanInvalidateDCache_by_Addr((uint32_t *)uStart, (int32_t)((uintptr_t)pvBuf + u32Size - uStart));
+#else
+	(void)pvBuf;
+	(void)u32Size;
+#endif
+}
+
+#if ENABLE_MB_TRACE == 1 || ENABLE_MB_STATS == 1 || ENABLE_MB_TURNAROUND == 1 || ENABLE_MB_ARBITRATION == 1 || ENABLE_MB_TDMA == 1 || \
+	ENABLE_MB_PACING == 1 || ENABLE_MB_WIRE_STATS == 1
+/**
+ * @brief
+ * Stamps the end of a received frame: starts the trace record of a new
+ * transaction, the latency measure of the statistics, the turnaround,
+ * the bus idle time of the arbitration and the pacing, the answers of a schedule
+ * and the turnarounds of the wire statistics, ISR safe
+ *
+ * @ingroup huart UART HAL handler
+ */
+static inline void traceFrame(modbusHandler_t *modH)
+{
+#if ENABLE_MB_TRACE == 1 || ENABLE_MB_STATS == 1 || ENABLE_MB_TURNAROUND == 1 || ENABLE_MB_ARBITRATION == 1 || ENABLE_MB_PACING == 1 || \
+	ENABLE_MB_WIRE_STATS == 1
+	uint32_t u32Now = DWT->CYCCNT;
+#endif
+
+#if ENABLE_MB_MONITOR == 1
+	if (modH->uModbusType == MB_MONITOR) return; // the records of a monitor are its paired transactions
+#endif
+
+#if ENABLE_MB_STATS == 1 || ENABLE_MB_TURNAROUND == 1 || ENABLE_MB_ARBITRATION == 1 || ENABLE_MB_PACING == 1 || ENABLE_MB_WIRE_STATS == 1
+	modH->u32RxEnd = u32Now;
+#endif
+#if ENABLE_MB_ARBITRATION == 1 || ENABLE_MB_TDMA == 1
+	if (modH->uModbusType == MB_MASTER) modH->u16RxFrames++;
+#endif
+#if ENABLE_MB_TRACE == 1
+	uint8_t u8Head = (modH->u8TraceHead + 1) % MB_TRACE_DEPTH;
+
+	memset(&modH->xTrace[u8Head], 0, sizeof(modbusTrace_t));
+	modH->xTrace[u8Head].u32Cyc[MB_TS_RX_END] = u32Now;
+	modH->u8TraceHead = u8Head;
+#endif
+}
+
+#define MB_TRACE_FRAME(modH)       (MB_PROBE(MB_TS_RX_END), traceFrame(modH))
+#else
+#define MB_TRACE_FRAME(modH)       MB_PROBE(MB_TS_RX_END)
+#endif
+
+#if ENABLE_MB_RUNTIME == 1
+/**
+ * @brief
+ * Adds the cycles of a UART callback to its handler, ISR safe
+ *
+ * @ingroup huart UART HAL handler
+ */
+static inline void chargeIsr(modbusHandler_t *modH, uint32_t u32Cycles)
+{
+	if (modH == NULL) return; // a UART of the application
+	modH->u64IsrCycles += u32Cycles;
+	modH->u32IsrCalls++;
+	if (u32Cycles > modH->u32IsrMax) modH->u32IsrMax = u32Cycles;
+}
+
+#define MB_ISR_START()         uint32_t u32IsrStart = DWT->CYCCNT
+#define MB_ISR_CHARGE(modH)    chargeIsr((modH), DWT->CYCCNT - u32IsrStart)
+#else
+#define MB_ISR_START()
+#define MB_ISR_CHARGE(modH)
+#endif
+
+#if ENABLE_MB_TRACE == 1
+#define MB_TRACE(modH, xStage)     (MB_PROBE(xStage), (modH)->xTrace[(modH)->u8TraceHead].u32Cyc[xStage] = DWT->CYCCNT)
+#else
+#define MB_TRACE(modH, xStage)     MB_PROBE(xStage)
+#endif
+
+/**
+ * @brief
+ * Constant time UART to Modbus handler lookup for the HAL callbacks.
+ * The slot is taken from the peripheral base address, collisions go to the next free slot
+ *
+ * @return modbusHandler_t* handler of the port or NULL for UARTs not used by Modbus
+ * @ingroup huart UART HAL handler
+ */
+static inline modbusHandler_t *getModbusHandler(UART_HandleTypeDef *huart)
+{
+	uint32_t u32Slot = ((uintptr_t)huart->Instance >> 10) & (MB_PORT_SLOTS - 1);
+	modbusHandler_t **xPorts = mHandlersByPort; // one map for the whole lookup
+
+	while (xPorts[u32Slot] != NULL)
+	{
+		if (xPorts[u32Slot]->port == huart)
+		{
+			return xPorts[u32Slot];
+		}
+		u32Slot = (u32Slot + 1) & (MB_PORT_SLOTS - 1);
+	}
+	return NULL;
+}
+
+/**
+ * @brief
+ * Address filter of the RX interrupts: a slave only passes the frames
+ * addressed to it to its task, a master and a monitor pass all of them
+ *
+ * @return true if the frame starting with u8id has to be received
+ * @ingroup huart UART HAL handler
+ */
+static inline bool isRxAddress(modbusHandler_t *modH, uint8_t u8id)
+{
+	if (modH->uModbusType != MB_SLAVE || u8id == modH->u8id) return true;
+#if ENABLE_MB_BROADCAST == 1
+	if (u8id == 0) return true; // broadcast writes
+#endif
+
+#if MB_ENABLE_SLAVE == 1
+	for (uint8_t i = 0; i < modH->u8UnitCount; i++)
+	{
+		if (modH->xUnits[i].u8id == u8id) return true;
+	}
+#endif
+	return false;
+}
+
+#if ENABLE_RX_MERGE == 1 && ENABLE_USART_DMA == 1
+bool endRxMerge(modbusHandler_t *modH); // T35 of the fragments of a DMA frame, see UARTCallback.c
+#endif
+#if ENABLE_USART_DMA == 1
+bool rearmRxDMA(modbusHandler_t *modH); // one restart of the DMA reception after an error, see UARTCallback.c
+#endif
+
+/**
+ * @brief
+ * Ends the frame in USART_HW mode at T35, the next byte is an address again.
+ * With ENABLE_RX_MERGE the DMA modes end their merged fragments here, with
+ * ENABLE_RX_PREDICT the frames that already ended at their length are skipped
+ *
+ * @return true if the task has to be notified, false for a dropped frame
+ * @ingroup huart UART HAL handler
+ */
+static inline bool endRxFrame(modbusHandler_t *modH)
+{
+#if ENABLE_RX_MERGE == 1 && ENABLE_USART_DMA == 1
+	if (modH->xTypeHW == USART_HW_DMA || modH->xTypeHW == USART_HW_DMA_CIRC) return endRxMerge(modH);
+#endif
+#if ENABLE_RX_PREDICT == 1
+	if (modH->xRxEarly)
+	{
+		modH->xRxEarly = false; // the frame ended at its predicted length
+		return false;
+	}
+#endif
+	bool xNotify = !modH->xRxDrop;
+
+	modH->xRxDrop = false;
+	modH->xRxStart = true;
+	return xNotify;
+}
+
+#if ENABLE_MB_EVENT_RING == 1
+void postModbusEventFromISR(modbusHandler_t *modH, uint8_t u8Event, BaseType_t *pxHigherPriorityTaskWoken); // lock free, see Modbus.c
+#endif
+
+#if ENABLE_MB_ISR_DEFER == 1
+/**
+ * @brief
+ * True in an interrupt above configMAX_SYSCALL_INTERRUPT_PRIORITY, which must
+ * not call FreeRTOS: its operations wait for ModbusDeferCallback()
+ *
+ * @ingroup huart UART HAL handler
+ */
+static inline bool isDeferredISR(void)
+{
+	uint32_t u32Ipsr = __get_IPSR();
+
+	return u32Ipsr != 0 && NVIC_GetPriority((IRQn_Type)((int32_t)u32Ipsr - 16)) <
+			(configMAX_SYSCALL_INTERRUPT_PRIORITY >> (8U - __NVIC_PRIO_BITS));
+}
+
+/**
+ * @brief
+ * Records MB_EV_ events or MB_DEFER_ operations of the handler for ModbusDeferCallback()
+ * and pends MB_DEFER_IRQn. Lock free with LDREXH/STREXH, u16Clear drops the opposite
+ * operation still waiting: the last one of a timer wins
+ *
+ * @ingroup huart UART HAL handler
+ */
+static inline void deferFromISR(modbusHandler_t *modH, uint16_t u16Set, uint16_t u16Clear)
+{
+	uint16_t u16Old;
+
+	do
+	{
+		u16Old = __LDREXH(&modH->u16DeferOps);
+	} while (__STREXH((uint16_t)((u16Old & ~u16Clear) | u16Set), &modH->u16DeferOps) != 0);
+	NVIC_SetPendingIRQ(MB_DEFER_IRQn);
+}
+
+void ModbusDeferCallback(void); // call it from the handler of MB_DEFER_IRQn
+#endif
+
+/**
+ * @brief
+ * Signals an MB_EV_ event of the handler to its Modbus task from an interrupt
+ *
+ * @ingroup huart UART HAL handler
+ */
+static inline void notifyModbusFromISR(modbusHandler_t *modH, uint8_t u8Event, BaseType_t *pxHigherPriorityTaskWoken)
+{
+#if ENABLE_MB_ISR_DEFER == 1
+	if (isDeferredISR())
+	{
+		deferFromISR(modH, u8Event, 0);
+		return;
+	}
+#endif
+#if ENABLE_MB_EVENT_RING == 1
+	postModbusEventFromISR(modH, u8Event, pxHigherPriorityTaskWoken);
+#elif ENABLE_MB_SHARED_TASK == 1
+	UBaseType_t uxSaved = taskENTER_CRITICAL_FROM_ISR();
+	modH->u8Events |= u8Event;
+	taskEXIT_CRITICAL_FROM_ISR(uxSaved);
+	vTaskNotifyGiveFromISR((TaskHandle_t)modH->myTaskModbusAHandle, pxHigherPriorityTaskWoken);
+#else
+	if (u8Event == MB_EV_TX)
+	{
+		xTaskNotifyFromISR((TaskHandle_t)modH->myTaskModbusAHandle, 0, eNoAction, pxHigherPriorityTaskWoken);
+	}
+	else if (u8Event == MB_EV_RX_ERR)
+	{
+		// a frame signalled meanwhile keeps its value, the task restarts the reception anyway
+		xTaskNotifyFromISR((TaskHandle_t)modH->myTaskModbusAHandle, MB_EV_RX_ERR, eSetValueWithoutOverwrite, pxHigherPriorityTaskWoken);
+	}
+	else
+	{
+		xTaskNotifyFromISR((TaskHandle_t)modH->myTaskModbusAHandle, (u8Event == MB_EV_TIMEOUT) ? ERR_TIME_OUT : 0,
+				eSetValueWithOverwrite, pxHigherPriorityTaskWoken);
+	}
+#endif
+}
+
+#if ENABLE_MB_TIMER_MUX == 1
+void armModbusTimer(modbusHandler_t *modH, uint8_t u8Timer, uint32_t u32us); // any context, O(1)
+void armModbusTimerAt(modbusHandler_t *modH, uint8_t u8Timer, uint32_t u32Due); // any context, O(1)
+void cancelModbusTimer(modbusHandler_t *modH, uint8_t u8Timer); // any context, O(1)
+bool isModbusTimerArmed(modbusHandler_t *modH, uint8_t u8Timer);
+#endif
+
+/**
+ * @brief
+ * Restarts T35 of a USART_HW frame for a received byte, from the RX interrupt
+ *
+ * @ingroup huart UART HAL handler
+ */
+static inline void restartT35FromISR(modbusHandler_t *modH, BaseType_t *pxHigherPriorityTaskWoken)
+{
+#if ENABLE_MB_ISR_DEFER == 1
+	if (isDeferredISR())
+	{
+		deferFromISR(modH, MB_DEFER_T35, MB_DEFER_T35_STOP);
+		return;
+	}
+#endif
+#if ENABLE_MB_TIMER_MUX == 1
+	(void)pxHigherPriorityTaskWoken;
+	armModbusTimer(modH, MB_TIMER_T35, modH->u32T35us);
+#else
+	xTimerResetFromISR(modH->xTimerT35, pxHigherPriorityTaskWoken);
+#endif
+}
+
+#if ENABLE_RX_MERGE == 1
+/**
+ * @brief
+ * Stops T35 from the RX interrupt, the frame ended before it
+ *
+ * @ingroup huart UART HAL handler
+ */
+static inline void stopT35FromISR(modbusHandler_t *modH, BaseType_t *pxHigherPriorityTaskWoken)
+{
+#if ENABLE_MB_ISR_DEFER == 1
+	if (isDeferredISR())
+	{
+		deferFromISR(modH, MB_DEFER_T35_STOP, MB_DEFER_T35);
+		return;
+	}
+#endif
+#if ENABLE_MB_TIMER_MUX == 1
+	(void)pxHigherPriorityTaskWoken;
+	cancelModbusTimer(modH, MB_TIMER_T35);
+#else
+	xTimerStopFromISR(modH->xTimerT35, pxHigherPriorityTaskWoken);
+#endif
+}
+#endif
+
+#if MB_ENABLE_MASTER == 1
+/**
+ * @brief
+ * Starts the answer timeout of a master, u16QueryTimeOut ticks, from an interrupt
+ *
+ * @ingroup huart UART HAL handler
+ */
+static inline void startTimeoutFromISR(modbusHandler_t *modH, BaseType_t *pxHigherPriorityTaskWoken)
+{
+#if ENABLE_MB_ISR_DEFER == 1
+	if (isDeferredISR())
+	{
+		deferFromISR(modH, MB_DEFER_TIMEOUT, MB_DEFER_TIMEOUT_STOP);
+		return;
+	}
+#endif
+#if ENABLE_MB_TIMER_MUX == 1
+	(void)pxHigherPriorityTaskWoken;
+	armModbusTimer(modH, MB_TIMER_TIMEOUT, (uint32_t)(((uint64_t)modH->u16QueryTimeOut * 1000000UL) / configTICK_RATE_HZ));
+#else
+	xTimerChangePeriodFromISR(modH->xTimerTimeout, modH->u16QueryTimeOut, pxHigherPriorityTaskWoken);
+#endif
+}
+
+/**
+ * @brief
+ * Stops the answer timeout of a master from an interrupt, the answer arrived
+ *
+ * @ingroup huart UART HAL handler
+ */
+static inline void stopTimeoutFromISR(modbusHandler_t *modH, BaseType_t *pxHigherPriorityTaskWoken)
+{
+#if ENABLE_MB_ISR_DEFER == 1
+	if (isDeferredISR())
+	{
+		deferFromISR(modH, MB_DEFER_TIMEOUT_STOP, MB_DEFER_TIMEOUT);
+		return;
+	}
+#endif
+#if ENABLE_MB_TDMA == 1
+	if (modH->u8SchedCount != 0) return; // MB_TIMER_TIMEOUT starts the slots of the schedule
+#endif
+#if ENABLE_MB_PACING == 1 && ENABLE_MB_TIMER_MUX == 1
+	if (modH->xPacePending)
+	{
+		// the frame of another station ended, the silence before the query starts again
+		armModbusTimer(modH, MB_TIMER_TIMEOUT, modH->u32PaceUs);
+		return;
+	}
+#endif
+#if ENABLE_MB_TIMER_MUX == 1
+	(void)pxHigherPriorityTaskWoken;
+	cancelModbusTimer(modH, MB_TIMER_TIMEOUT);
+#else
+	xTimerStopFromISR(modH->xTimerTimeout, pxHigherPriorityTaskWoken);
+#endif
+}
+#endif
+
+// Function prototypes
+void ModbusInit(modbusHandler_t * modH);
+void ModbusStart(modbusHandler_t * modH);
+void ModbusStop(modbusHandler_t *modH); // serial lines: no reception, transmission or T35 until ModbusReconfigure()
+bool ModbusReconfigure(modbusHandler_t *modH, uint32_t u32Baud, uint32_t u32Parity, uint8_t u8id); // new line settings and ID, then restarts
+void ModbusDeInit(modbusHandler_t *modH); // serial lines: frees the mHandlers slot, the task, the timers and the semaphores
+#if MB_ENABLE_SLAVE == 1
+bool ModbusRegisterFunction(uint8_t u8fct, mb_fc_validator_t validator, mb_fc_handler_t handler); // adds or replaces a slave function code
+#endif
+
+void setTimeOut( uint16_t u16timeOut); //!<write communication watch-dog timer
+uint16_t getTimeOut(); //!<get communication watch-dog timer value
+bool getTimeOutState(); //!<get communication watch-dog timer state
+#if MB_ENABLE_MASTER == 1
+void ModbusQuery(modbusHandler_t * modH, modbus_t telegram ); // put a query in the queue tail
+void ModbusQueryInject(modbusHandler_t * modH, modbus_t telegram); //put a query in front of the queued ones, as MB_PRIO_URGENT
+bool ModbusQueryPriority(modbusHandler_t * modH, modbus_t telegram, mb_priority_t xPrio, mb_query_cb_t xCallback, void *pvContext); // put a query at the tail of its level, false if the queue is full
+bool ModbusQueryRef(modbusHandler_t * modH, modbus_t *telegram, mb_priority_t xPrio); // queue telegram itself, without copy, false if the queue is full
+bool ModbusQueryAsync(modbusHandler_t * modH, modbus_t telegram, mb_query_cb_t xCallback, void *pvContext); // put a query in the queue tail without blocking the caller, false if the queue is full
+void ModbusSetPollTable(modbusHandler_t * modH, modbusPoll_t *xPolls, uint8_t u8count); // cyclic queries sent by the master task, call it before ModbusStart()
+#if ENABLE_MB_POLL_ADAPT == 1
+uint16_t ModbusGetBusLoad(modbusHandler_t * modH); // bus load of the last window in 0.1 %, see ENABLE_MB_POLL_ADAPT
+#endif
+#if ENABLE_MB_SUBSCRIBE == 1
+bool ModbusSubscribe(modbusHandler_t * modH, modbusSub_t *xSub); // report the changes of a range beyond its deadband, false if the range is invalid
+void ModbusUnsubscribe(modbusHandler_t * modH, modbusSub_t *xSub);
+#endif
+#if ENABLE_MB_TDMA == 1
+bool ModbusSetSchedule(modbusHandler_t *modH, modbus_t *telegrams, uint8_t u8count, uint32_t u32TurnUs, uint32_t u32CycleUs); // time-triggered cycle, call it before ModbusStart()
+#endif
+#if ENABLE_MB_PREBUILT == 1
+uint8_t ModbusBuildFrame(modbus_t *telegram, uint8_t *u8Frame, uint8_t u8Size); // builds the frame and CRC of a fixed telegram once, 0 if it cannot be prebuilt
+#endif
+#if ENABLE_MB_CACHE == 1
+void ModbusSetCache(modbusHandler_t * modH, modbusCache_t *xCache, uint8_t u8count); // ranges answered from the last response while fresh, call it before ModbusStart()
+#endif
+#if ENABLE_MB_PACING == 1
+void ModbusSetGuards(modbusHandler_t * modH, const modbusGuard_t *xGuards, uint8_t u8count); // silences after T3.5 before the queries to slower slaves, call it before ModbusStart()
+#endif
+#endif
+#if ENABLE_MB_REDUNDANT == 1
+void ModbusRedundantInit(modbusRedundant_t *xPair, modbusHandler_t *xPrimary, modbusHandler_t *xSecondary,
+		mb_redundant_mode_t xMode, uint16_t u16FailoverTimeout); // makes two masters one redundant master, call it after ModbusInit()
+bool ModbusRedundantQuery(modbusRedundant_t *xPair, modbus_t telegram); // query notified to the calling task like ModbusQuery(), false if no entry is free
+bool ModbusRedundantQueryAsync(modbusRedundant_t *xPair, modbus_t telegram, mb_query_cb_t xCallback, void *pvContext); // query completed by xCallback, false if no entry is free
+const modbusPath_t *ModbusRedundantPath(modbusRedundant_t *xPair, uint8_t u8id); // health of the paths to u8id, NULL if it is not tracked
+#endif
+#if ENABLE_MB_DISCOVERY == 1
+uint16_t ModbusDiscover(modbusDiscovery_t *xScans, uint8_t u8Count); // probes the IDs of several buses at the same time, blocks until all are scanned
+#endif
+#if ENABLE_MB_STRESS == 1
+void ModbusStress(modbusStress_t *xStress, TickType_t xDuration); // back to back queries of the mix for xDuration ticks, checked against the model
+#endif
+#if ENABLE_MB_BATCH == 1
+bool ModbusBatchSubmit(modbusBatch_t *xBatch, modbusBatchEntry_t *xEntries, uint8_t u8Count, mb_batch_cb_t xCallback, void *pvContext); // telegrams of several buses reported once, false if the batch is in progress
+#endif
+#if ENABLE_MB_TLS == 1
+void ModbusSetTls(modbusHandler_t * modH, const modbusTlsOps_t *xTls); // TLS layer of a TCP slave or master, call it before ModbusStart()
+#endif
+#if ENABLE_MB_GATEWAY == 1
+void ModbusSetGateway(modbusHandler_t * modH, modbusRoute_t *xRoutes, uint8_t u8count); // unit IDs a TCP slave forwards to RTU masters, call it before ModbusStart()
+#endif
+#if MB_SLAVE_FILES
+void ModbusSetFiles(modbusHandler_t * modH, const modbusFile_t *xFiles, uint8_t u8count); // files of FC20 and FC21, call it before ModbusStart()
+#endif
+#if MB_SLAVE_DEVID
+void ModbusSetDeviceId(modbusHandler_t * modH, const modbusDevIdObj_t *xObjects, uint8_t u8count); // objects of FC43/14, call it before ModbusStart()
+#endif
+#if MB_SLAVE_DELTAS
+void ModbusSetDeltas(modbusHandler_t * modH, modbusDeltaBlock_t *xDeltas, uint8_t u8count); // blocks of MB_FC_READ_DELTA, call it before ModbusStart()
+#endif
+#if ENABLE_MB_MAP_LOOKUP == 1
+uint8_t ModbusMapLookup(const modbusSegment_t *xSeg, uint16_t u16Add); // defined by the map of Tools/ModbusMapGen.py, segments of xSeg starting at or before u16Add, 0xFF for another table
+#endif
+#if ENABLE_MB_LISTEN_ONLY == 1
+void ModbusSetListenOnly(modbusHandler_t * modH, bool xListen); // standby slave: apply the requests without answering them
+#endif
+#if MB_SLAVE_FIFOS
+void ModbusSetFifos(modbusHandler_t * modH, modbusFifo_t *xFifos, uint8_t u8count); // FIFO queues of FC24, call it before ModbusStart()
+bool ModbusFifoPush(modbusFifo_t *xFifo, uint16_t u16Value); // adds an entry from the producer task or ISR, false if the queue is full
+#endif
+#if ENABLE_MB_RO_SNAPSHOT == 1
+void ModbusSetROBanks(modbusHandler_t * modH, uint16_t *u16bank0, uint16_t *u16bank1); // two u16regRO_size banks for the input registers, call it before ModbusStart()
+uint16_t *ModbusROBackBank(modbusHandler_t * modH); // bank the producer fills with the next complete snapshot, ISR safe
+void ModbusROPublish(modbusHandler_t * modH); // makes the back bank the one served to the master, ISR safe
+#endif
+#if ENABLE_MB_HR_COMMIT == 1
+void ModbusSetHRBanks(modbusHandler_t * modH, uint16_t *u16bank0, uint16_t *u16bank1); // two u16regHR_size banks for the holding registers, call it before ModbusStart()
+void ModbusHRCommit(modbusHandler_t * modH, uint16_t u16Add, uint16_t u16Count); // publishes the registers the application wrote under ModbusLock()
+void ModbusReadHR(modbusHandler_t * modH, uint16_t u16Add, uint16_t u16Count, uint16_t *u16dst); // copies committed holding registers without lock
+void ModbusHRBankRead(const modbusHRBank_t *xBank, uint16_t u16Add, uint16_t u16Count, uint16_t *u16dst); // the same from the bank itself
+#endif
+#if ENABLE_MB_SHARED_HR == 1
+void ModbusHRBankInit(modbusHRBank_t *xBank, uint16_t *u16bank0, uint16_t *u16bank1, uint16_t u16size); // holding registers shared by slaves, call it before ModbusSetHRBank()
+void ModbusSetHRBank(modbusHandler_t * modH, modbusHRBank_t *xBank); // serves the shared bank instead of u16regsHR, call it before ModbusStart()
+#endif
+#if ENABLE_MB_TIMESTAMP == 1
+void ModbusSetTimeSync(modbusHandler_t * modH, uint16_t u16Add); // the FC16 writes of the MB_TIME_REGS holding registers at u16Add set the time, call it before ModbusStart()
+uint64_t ModbusGetTime(modbusHandler_t * modH); // time of the master in milliseconds, the uptime before the first synchronisation, ISR safe
+void ModbusPutTime(modbusHandler_t * modH, uint16_t *u16dst); // writes ModbusGetTime() to MB_TIME_REGS registers, ISR safe
+void ModbusSegStamp(modbusHandler_t * modH, const modbusSegment_t *xSeg); // writes the sample time to the last MB_TIME_REGS registers of a segment
+#if ENABLE_MB_RO_SNAPSHOT == 1
+void ModbusSetROStamp(modbusHandler_t * modH, uint16_t u16Add); // ModbusROPublish() writes the time to the MB_TIME_REGS input registers at u16Add
+#endif
+#endif
+#if ENABLE_MB_WRITE_NOTIFY == 1
+bool ModbusTakeDirty(modbusHandler_t * modH, uint8_t u8table, uint32_t *u32Dirty, uint16_t u16Words); // moves the dirty bitmap of DB_HOLDING_REGISTER or DB_COILS to u32Dirty
+#endif
+#if ENABLE_MB_RETAIN == 1
+void ModbusRetainSeal(modbusHandler_t * modH); // validates xRetain again after the application changed the tables
+#endif
+#if ENABLE_MB_AUTOBAUD == 1
+uint32_t ModbusAutoBaud(modbusHandler_t *modH, const uint32_t *u32Rates, uint8_t u8Rates, TickType_t xDwell, uint8_t u8Sweeps); // rate of the first good request, 0 if none
+#endif
+#if ENABLE_MB_TRACE == 1
+uint8_t ModbusGetTrace(modbusHandler_t * modH, modbusTrace_t *xTraces, uint8_t u8max); // copies the records of the last transactions, oldest first
+#endif
+#if ENABLE_MB_STATS == 1 || ENABLE_MB_ERR_STATS == 1
+void ModbusResetStats(modbusHandler_t * modH); // clears the histograms and the error counters of the handler
+#endif
+#if ENABLE_MB_BENCH == 1
+void ModbusBenchmark(modbusHandler_t * modH, modbusBench_t *xBench); // cycles of the protocol kernels on this MCU
+#endif
+#if ENABLE_MB_WCET == 1
+bool ModbusWcet(modbusHandler_t * modH, modbusWcet_t *xReport, uint32_t u32Budget); // worst case cycles per function code, false over u32Budget
+#endif
+#if ENABLE_MB_FUZZ == 1
+int16_t ModbusFuzzFrame(modbusHandler_t * modH, const uint8_t *u8Frame, uint16_t u16Size, uint32_t *u32Cost); // parses and processes one frame without sending the answer
+#endif
+#if ENABLE_MB_REPLAY == 1
+bool ModbusReplay(modbusHandler_t * modH, const uint8_t *u8Capture, uint32_t u32Size, bool xTimed, modbusReplay_t *xReport); // serves the requests of a capture, false if it is cut
+#endif
+#if ENABLE_MB_EVENT_LOG == 1
+uint16_t ModbusGetEvents(modbusEvent_t *xEvents, uint16_t u16max); // copies the last bus events, oldest first
+#endif
+#if ENABLE_MB_ERR_STATS == 1
+void ModbusGetErrStats(modbusHandler_t * modH, modbusErrStats_t *xStats); // consistent copy of the error counters
+#endif
+#if ENABLE_MB_MONITOR == 1
+void ModbusGetMonitor(modbusHandler_t * modH, modbusMonitor_t *xMon); // consistent copy of the statistics of a monitor
+#endif
+#if ENABLE_MB_STATS == 1 && MB_ENABLE_MASTER == 1
+const modbusHist_t *ModbusGetRoundTrip(modbusHandler_t * modH, uint8_t u8id); // round trip times of a slave, NULL if not tracked
+#endif
+#if ENABLE_MB_NODE_STATS == 1
+bool ModbusGetNodeStats(modbusHandler_t * modH, uint8_t u8id, modbusNodeStats_t *xStats); // consistent copy of the statistics of a slave, false if not tracked
+uint8_t ModbusGetNodes(modbusHandler_t * modH, modbusNodeStats_t *xNodes, uint8_t u8max); // copies the statistics of the tracked slaves, in the order of their first query
+void ModbusResetNodeStats(modbusHandler_t * modH); // clears the statistics, the slaves stay tracked
+#endif
+uint32_t ModbusGetStackSpace(modbusHandler_t * modH); // bytes of the Modbus task stack never used so far
+#if ENABLE_MB_RUNTIME == 1
+void ModbusGetRuntime(modbusHandler_t * modH, modbusRuntime_t *xRt); // CPU of the task and of the UART callbacks since the previous call, stack space
+#endif
+#if ENABLE_MB_WIRE_STATS == 1
+void ModbusGetWireStats(modbusHandler_t * modH, modbusWireStats_t *xWire); // time on the line, utilisation and efficiency of a serial handler
+void ModbusResetWireStats(modbusHandler_t * modH); // restarts the accounting of the line time
+#endif
+const char *ModbusHookName(uint32_t u32Id); // name of a trace hook section, for the tracer user events
+#if MB_ENABLE_SLAVE == 1
+void StartTaskModbusSlave(void *argument); //slave
+#endif
+#if MB_ENABLE_MASTER == 1
+void StartTaskModbusMaster(void *argument); //master
+#endif
+#if ENABLE_MB_MONITOR == 1
+void StartTaskModbusMonitor(void *argument); //monitor
+#endif
+#if ENABLE_MB_SHARED_TASK == 1
+void StartTaskModbus(void *argument); //all the handlers
+#endif
+uint16_t calcCRC(uint8_t *Buffer, uint16_t u16length);
+uint16_t calcCRCByte(uint16_t u16crc, uint8_t u8byte); // updates a running (not swapped) CRC with one byte, ISR safe
+#if ENABLE_MB_ASCII == 1
+extern const uint8_t u8HexValue[128]; // value of a hex digit of an ASCII frame, MB_ASCII_NONE for the other characters
+#endif
+#if ENABLE_RX_PREDICT == 1
+uint16_t predictFrameLength(const modbusHandler_t *modH, const uint8_t *u8Frame, uint16_t u16Len); // ISR safe, see Modbus.c
+#endif
+#if ENABLE_MB_FAST_READ == 1
+bool answerFastRead(modbusHandler_t *modH, uint16_t u16Size, BaseType_t *pxHigherPriorityTaskWoken); // RX event interrupt, true if the read was answered without the task
+#endif
+void ModbusRegsToValues(void *pvDst, const uint16_t *u16src, uint16_t u16Regs, mb_type_t xType, mb_wordorder_t xOrder); // registers to native values, in bulk
+void ModbusValuesToRegs(uint16_t *u16dst, const void *pvSrc, uint16_t u16Regs, mb_type_t xType, mb_wordorder_t xOrder); // native values to registers, in bulk
+#if ENABLE_TIM_T35 == 1
+void ModbusT35TimerCallback(TIM_HandleTypeDef *htim); // call it from HAL_TIM_PeriodElapsedCallback()
+void ModbusT35CompareCallback(TIM_HandleTypeDef *htim); // call it from HAL_TIM_OC_DelayElapsedCallback(), for the handlers with u8TimT35Channel
+#endif
+#if ENABLE_MB_TIMER_MUX == 1
+void ModbusSetTimer(TIM_HandleTypeDef *htim); // free-running 32-bit timer at 1 MHz for the deadlines of all the handlers, before ModbusInit()
+void ModbusTimerCallback(TIM_HandleTypeDef *htim); // call it from HAL_TIM_OC_DelayElapsedCallback()
+#endif
+#if ENABLE_LPTIM_T35 == 1
+void ModbusLptimCallback(LPTIM_TypeDef *xLptim); // call it from LPTIMx_IRQHandler()
+#endif
+#if ENABLE_LPUART == 1
+bool ModbusLowPowerReady(void); // true when Stop mode may be entered, for the tickless idle of FreeRTOS
+#endif
+#if ENABLE_MB_MPU == 1
+bool ModbusMpuRegion(uint8_t u8Region, const void *pvBase, uint32_t u32Size, uint8_t u8Access); // execute never region, ARM_MPU_AP_xxx access
+int8_t ModbusMpuProtect(modbusHandler_t *modH, uint8_t u8FirstRegion); // regions of the tables of a slave, the number used or -1
+#if portUSING_MPU_WRAPPERS == 1
+uint8_t ModbusMpuTaskRegions(modbusHandler_t *modH, MemoryRegion_t *xRegions, uint8_t u8Max); // tables for xTaskCreateRestricted()
+#endif
+#endif
+#if ENABLE_MB_TICKLESS == 1
+uint8_t ModbusSleepHint(TickType_t *pxIdle); // call it from configPRE_SLEEP_PROCESSING(x), MB_SLEEP_xxx allowed by the handlers
+#endif
+#if ENABLE_USB_CDC == 1
+void ModbusUsbRxCallback(USBD_HandleTypeDef *pdev, uint8_t *Buf, uint32_t u32Len); // call it from CDC_Receive_FS()
+void ModbusUsbTxCallback(USBD_HandleTypeDef *pdev); // call it from CDC_TransmitCplt_FS()
+#endif
+#if ENABLE_MB_BLE == 1
+void ModbusBleRxCallback(modbusHandler_t *modH, const uint8_t *u8Data, uint16_t u16Len); // call it from the write event of the characteristic
+void ModbusBleLink(modbusHandler_t *modH, uint16_t u16Mtu); // call it at the connection, MTU exchange and disconnection events
+#endif
+
+
+//Function prototypes for ModbusRingBuffer
+void RingAdd(modbusRingBuffer_t *xRingBuffer, uint8_t u8Val); // adds a byte to the ring buffer
+uint16_t RingGetAllBytes(modbusRingBuffer_t *xRingBuffer, uint8_t *buffer); // gets all the available bytes into buffer and return the number of bytes read
+uint16_t RingGetNBytes(modbusRingBuffer_t *xRingBuffer, uint8_t *buffer, uint16_t uNumber); // gets uNumber of bytes from ring buffer, returns the actual number of bytes read
+uint16_t RingCountBytes(modbusRingBuffer_t *xRingBuffer); // return the number of available bytes
+void RingClear(modbusRingBuffer_t *xRingBuffer); // flushes the ring buffer from the consumer side
+
+extern uint8_t numberHandlers; //one past the highest slot of mHandlers in use, the slots below may be NULL
+
+
+/*
+ * Register access API for the application tasks. The accessors work on the
+ * contiguous tables of the handler (the ones of u8id when there are xUnits),
+ * after ModbusStart(). Sparse segments are owned by the application and are
+ * not covered. The addresses are not checked, the caller keeps them in the table.
+ *
+ * Locking: a single register is read or written without lock, an aligned
+ * halfword access cannot be torn. Two register values, bulk copies and the
+ * bit read-modify-writes take the semaphore of the table once, the one the
+ * slave task takes to serve that table. The snapshot input registers of
+ * ENABLE_MB_RO_SNAPSHOT are written to the back bank without lock. The
+ * holding registers of a bank shared with ENABLE_MB_SHARED_HR take the semaphore
+ * of the bank, the same for all the slaves serving it.
+ * To update many registers at once, bracket a loop with ModbusLock() and
+ * ModbusUnlock() and use the table of ModbusGetTable() directly.
+ * Not for interrupts, they would block on the semaphore.
+ */
+
+#if ENABLE_MB_HR_COMMIT == 1
+/**
+ * @brief
+ * Bank of ENABLE_MB_HR_COMMIT the next commit publishes, written under its semaphore
+ *
+ * @return bank of u16size registers
+ * @ingroup register
+ */
+static inline uint16_t *ModbusHRStaging(const modbusHRBank_t *xBank)
+{
+	return xBank->u16regs[ (xBank->u32Seq + 1) & 1 ];
+}
+#endif
+
+/**
+ * @brief
+ * Semaphore guarding a DB_ table of the handler from the Modbus task
+ *
+ * @return semaphore handle, NULL when none is needed
+ * @ingroup register
+ */
+static inline osSemaphoreId_t ModbusGetLock(modbusHandler_t *modH, uint8_t u8table)
+{
+#if MB_ENABLE_SLAVE == 1
+	if (modH->uModbusType == MB_SLAVE)
+	{
+		switch (u8table)
+		{
+		case DB_COILS:
+			return modH->ModBusSphrCoilsHandle;
+		case DB_INPUT_COILS:
+			return modH->ModBusSphrCoilsROHandle;
+#if ENABLE_MB_SHARED_HR == 1
+		case DB_HOLDING_REGISTER:
+			if (modH->xHRBank != NULL && modH->xHRBank->xLock != NULL) return modH->xHRBank->xLock; // the writers of all its slaves
+			break;
+#endif
+		case DB_INPUT_REGISTERS:
+#if ENABLE_MB_RO_SNAPSHOT == 1
+			if (modH->u16regsROBank[0] != NULL) return NULL; // the producer owns the back bank
+#endif
+			return modH->ModBusSphrROHandle;
+		default:
+			break;
+		}
+	}
+#endif
+	return modH->ModBusSphrHandle;
+}
+
+/**
+ * @brief
+ * Table of the handler for DB_COILS, DB_INPUT_COILS, DB_HOLDING_REGISTER or DB_INPUT_REGISTERS,
+ * the coils are packed 16 per register
+ *
+ * @return first register of the table, NULL if the handler has none
+ * @ingroup register
+ */
+static inline uint16_t *ModbusGetTable(modbusHandler_t *modH, uint8_t u8table)
+{
+#if MB_ENABLE_SLAVE == 1
+	if (modH->uModbusType == MB_SLAVE)
+	{
+		// the handler fields follow the unit being served, xUnitMain does not
+		const modbusUnit_t *xUnit = &modH->xUnitMain;
+		bool xMain = modH->u8UnitCount > 0;
+
+		switch (u8table)
+		{
+		case DB_COILS:
+			return xMain ? xUnit->u16regsCoils : modH->u16regsCoils;
+		case DB_INPUT_COILS:
+			return xMain ? xUnit->u16regsCoilsRO : modH->u16regsCoilsRO;
+		case DB_HOLDING_REGISTER:
+#if ENABLE_MB_HR_COMMIT == 1
+			if (modH->xHRBank != NULL) return ModbusHRStaging(modH->xHRBank); // u16regsHR may follow another slave late
+#endif
+			return xMain ? xUnit->u16regsHR : modH->u16regsHR;
+		case DB_INPUT_REGISTERS:
+#if ENABLE_MB_RO_SNAPSHOT == 1
+			if (modH->u16regsROBank[0] != NULL) return ModbusROBackBank(modH);
+#endif
+			return xMain ? xUnit->u16regsRO : modH->u16regsRO;
+		default:
+			return NULL;
+		}
+	}
+#endif
+	switch (u8table)
+	{
+	case DB_COILS:
+		return modH->u16regsCoils;
+	case DB_HOLDING_REGISTER:
+		return modH->u16regsHR;
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * @brief
+ * Takes the semaphore of a table, for a batch of accesses to ModbusGetTable()
+ *
+ * @ingroup register
+ */
+static inline void ModbusLock(modbusHandler_t *modH, uint8_t u8table)
+{
+	osSemaphoreId_t xLock = ModbusGetLock(modH, u8table);
+
+	if (xLock != NULL) xSemaphoreTake((SemaphoreHandle_t)xLock, portMAX_DELAY);
+}
+
+/**
+ * @brief
+ * Tells a slave that the application changed a table, the cached answers read from it
+ * are not sent again. The accessors below call it, a task writing the table of
+ * ModbusGetTable() calls it itself. Safe in interrupts
+ *
+ * @ingroup register
+ */
+static inline void ModbusTableChanged(modbusHandler_t *modH, uint8_t u8table)
+{
+#if ENABLE_MB_RESP_CACHE == 1
+	if (modH->uModbusType == MB_SLAVE && u8table >= DB_COILS && u8table <= DB_INPUT_REGISTERS)
+	{
+		modH->u32TableGen[u8table - 1]++;
+	}
+#else
+	(void)modH;
+	(void)u8table;
+#endif
+}
+
+/**
+ * @brief
+ * Gives back the semaphore taken by ModbusLock()
+ *
+ * @ingroup register
+ */
+static inline void ModbusUnlock(modbusHandler_t *modH, uint8_t u8table)
+{
+	osSemaphoreId_t xLock = ModbusGetLock(modH, u8table);
+
+	if (xLock != NULL) xSemaphoreGive(xLock);
+}
+
+/**
+ * @brief
+ * Reads one register, without lock
+ *
+ * @ingroup register
+ */
+static inline uint16_t ModbusGetU16(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add)
+{
+	return ((volatile uint16_t *)ModbusGetTable(modH, u8table))[u16Add];
+}
 
-// Function prototypes
-void ModbusInit(modbusHandler_t * modH);
-void ModbusStart(modbusHandler_t * modH);
+/**
+ * @brief
+ * Writes one register, without lock
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetU16(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Val)
+{
+	((volatile uint16_t *)ModbusGetTable(modH, u8table))[u16Add] = u16Val;
+	ModbusTableChanged(modH, u8table);
+}
 
-void setTimeOut( uint16_t u16timeOut); //!<write communication watch-dog timer
-uint16_t getTimeOut(); //!<get communication watch-dog timer value
-bool getTimeOutState(); //!<get communication watch-dog timer state
-void ModbusQuery(modbusHandler_t * modH, modbus_t telegram ); // put a query in the queue tail
-void ModbusQueryInject(modbusHandler_t * modH, modbus_t telegram); //put a query in the queue head
-void StartTaskModbusSlave(void *argument); //slave
-void StartTaskModbusMaster(void *argument); //master
-uint16_t calcCRC(uint8_t *Buffer, uint8_t u8length);
+#if ENABLE_MB_ATOMIC_COILS == 1
+/**
+ * @brief
+ * Replaces the bits of u16Mask in a coil word with those of u16Bits, with
+ * LDREXH/STREXH: an interrupt or a task switch between the load and the store
+ * makes the store fail and the update is retried
+ *
+ * @ingroup discrete
+ */
+static inline void updateCoilWord(uint16_t *u16Word, uint16_t u16Mask, uint16_t u16Bits)
+{
+	uint16_t u16Old;
 
+	do
+	{
+		u16Old = __LDREXH((volatile uint16_t *)u16Word);
+	} while (__STREXH((uint16_t)((u16Old & ~u16Mask) | (u16Bits & u16Mask)), (volatile uint16_t *)u16Word) != 0);
+}
 
-//Function prototypes for ModbusRingBuffer
-void RingAdd(modbusRingBuffer_t *xRingBuffer, uint8_t u8Val); // adds a byte to the ring buffer
-uint8_t RingGetAllBytes(modbusRingBuffer_t *xRingBuffer, uint8_t *buffer); // gets all the available bytes into buffer and return the number of bytes read
-uint8_t RingGetNBytes(modbusRingBuffer_t *xRingBuffer, uint8_t *buffer, uint8_t uNumber); // gets uNumber of bytes from ring buffer, returns the actual number of bytes read
-uint8_t RingCountBytes(modbusRingBuffer_t *xRingBuffer); // return the number of available bytes
-void RingClear(modbusRingBuffer_t *xRingBuffer); // flushes the ring buffer
+/**
+ * @brief
+ * Reads one coil of DB_COILS or DB_INPUT_COILS, without lock
+ *
+ * @ingroup discrete
+ */
+static inline bool ModbusGetCoil(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Coil)
+{
+	return ((((volatile uint16_t *)ModbusGetTable(modH, u8table))[u16Coil / 16] >> (u16Coil % 16)) & 1) != 0;
+}
+
+/**
+ * @brief
+ * Writes one coil of DB_COILS or DB_INPUT_COILS without lock, safe against FC5,
+ * FC15 and the other tasks and interrupts writing the coils of the same word
+ *
+ * @ingroup discrete
+ */
+static inline void ModbusSetCoil(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Coil, bool xValue)
+{
+	uint16_t *u16Word = &ModbusGetTable(modH, u8table)[u16Coil / 16];
+
+#if MB_COIL_BITBAND == 1
+	uintptr_t u32Byte = (uintptr_t)u16Word + (u16Coil % 16) / 8;
+
+	if (u32Byte >= 0x20000000UL && u32Byte < 0x20100000UL)
+	{
+		// one store to the alias word of the bit, the bus does the read-modify-write
+		*(volatile uint32_t *)(0x22000000UL + ((u32Byte - 0x20000000UL) << 5) + ((u16Coil % 8) << 2)) = xValue;
+		ModbusTableChanged(modH, u8table);
+		return;
+	}
+#endif
+	updateCoilWord(u16Word, (uint16_t)(1U << (u16Coil % 16)), xValue ? 0xFFFF : 0);
+	ModbusTableChanged(modH, u8table);
+}
+#endif
+
+/**
+ * @brief
+ * 32 bit value of two registers of a table or a telegram image, without lock.
+ * The registers are loaded as one word, then __ROR and __REV16 reorder it
+ *
+ * @ingroup register
+ */
+static inline uint32_t ModbusRegsToU32(const uint16_t *u16regs, mb_wordorder_t xOrder)
+{
+	uint32_t u32Val;
+
+	memcpy(&u32Val, u16regs, sizeof(u32Val)); // u16regs[1] in the high half, little endian core
+	if ((xOrder & MB_WORD_LH) == 0) u32Val = __ROR(u32Val, 16);
+	if (xOrder & MB_WORD_HL_SWAP) u32Val = __REV16(u32Val);
+	return u32Val;
+}
+
+/**
+ * @brief
+ * Stores a 32 bit value in two registers, without lock, see ModbusRegsToU32()
+ *
+ * @ingroup register
+ */
+static inline void ModbusU32ToRegs(uint16_t *u16regs, uint32_t u32Val, mb_wordorder_t xOrder)
+{
+	if (xOrder & MB_WORD_HL_SWAP) u32Val = __REV16(u32Val);
+	if ((xOrder & MB_WORD_LH) == 0) u32Val = __ROR(u32Val, 16);
+	memcpy(u16regs, &u32Val, sizeof(u32Val));
+}
+
+/**
+ * @brief
+ * 64 bit value of four registers, without lock. MB_WORD_HL puts the most
+ * significant word first
+ *
+ * @ingroup register
+ */
+static inline uint64_t ModbusRegsToU64(const uint16_t *u16regs, mb_wordorder_t xOrder)
+{
+	uint32_t u32Lo = ModbusRegsToU32(&u16regs[ (xOrder & MB_WORD_LH) ? 0 : 2 ], xOrder);
+	uint32_t u32Hi = ModbusRegsToU32(&u16regs[ (xOrder & MB_WORD_LH) ? 2 : 0 ], xOrder);
+
+	return ((uint64_t)u32Hi << 32) | u32Lo;
+}
+
+/**
+ * @brief
+ * Stores a 64 bit value in four registers, without lock, see ModbusRegsToU64()
+ *
+ * @ingroup register
+ */
+static inline void ModbusU64ToRegs(uint16_t *u16regs, uint64_t u64Val, mb_wordorder_t xOrder)
+{
+	ModbusU32ToRegs(&u16regs[ (xOrder & MB_WORD_LH) ? 0 : 2 ], (uint32_t)u64Val, xOrder);
+	ModbusU32ToRegs(&u16regs[ (xOrder & MB_WORD_LH) ? 2 : 0 ], (uint32_t)(u64Val >> 32), xOrder);
+}
+
+/**
+ * @brief
+ * Reads the 32 bit value of the registers u16Add and u16Add + 1 under one lock
+ *
+ * @ingroup register
+ */
+static inline uint32_t ModbusGetU32(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, mb_wordorder_t xOrder)
+{
+	const uint16_t *u16regs = ModbusGetTable(modH, u8table) + u16Add;
+	uint32_t u32Val;
+
+	ModbusLock(modH, u8table);
+	u32Val = ModbusRegsToU32(u16regs, xOrder);
+	ModbusUnlock(modH, u8table);
+	return u32Val;
+}
+
+/**
+ * @brief
+ * Writes a 32 bit value to the registers u16Add and u16Add + 1 under one lock
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetU32(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint32_t u32Val, mb_wordorder_t xOrder)
+{
+	uint16_t *u16regs = ModbusGetTable(modH, u8table) + u16Add;
+
+	ModbusLock(modH, u8table);
+	ModbusU32ToRegs(u16regs, u32Val, xOrder);
+	ModbusTableChanged(modH, u8table);
+	ModbusUnlock(modH, u8table);
+}
+
+/**
+ * @brief
+ * Reads a signed 32 bit value from the registers u16Add and u16Add + 1
+ *
+ * @ingroup register
+ */
+static inline int32_t ModbusGetI32(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, mb_wordorder_t xOrder)
+{
+	return (int32_t)ModbusGetU32(modH, u8table, u16Add, xOrder);
+}
+
+/**
+ * @brief
+ * Writes a signed 32 bit value to the registers u16Add and u16Add + 1
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetI32(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, int32_t i32Val, mb_wordorder_t xOrder)
+{
+	ModbusSetU32(modH, u8table, u16Add, (uint32_t)i32Val, xOrder);
+}
+
+/**
+ * @brief
+ * Reads an IEEE 754 single precision value from the registers u16Add and u16Add + 1
+ *
+ * @ingroup register
+ */
+static inline float ModbusGetFloat(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, mb_wordorder_t xOrder)
+{
+	union { uint32_t u32; float f; } xVal;
+
+	xVal.u32 = ModbusGetU32(modH, u8table, u16Add, xOrder);
+	return xVal.f;
+}
+
+/**
+ * @brief
+ * Writes an IEEE 754 single precision value to the registers u16Add and u16Add + 1
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetFloat(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, float fVal, mb_wordorder_t xOrder)
+{
+	union { uint32_t u32; float f; } xVal;
+
+	xVal.f = fVal;
+	ModbusSetU32(modH, u8table, u16Add, xVal.u32, xOrder);
+}
 
-extern uint8_t numberHandlers; //global variable to maintain the number of concurrent handlers
+/**
+ * @brief
+ * Reads the 64 bit value of the registers u16Add to u16Add + 3 under one lock
+ *
+ * @ingroup register
+ */
+static inline uint64_t ModbusGetU64(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, mb_wordorder_t xOrder)
+{
+	const uint16_t *u16regs = ModbusGetTable(modH, u8table) + u16Add;
+	uint64_t u64Val;
+
+	ModbusLock(modH, u8table);
+	u64Val = ModbusRegsToU64(u16regs, xOrder);
+	ModbusUnlock(modH, u8table);
+	return u64Val;
+}
+
+/**
+ * @brief
+ * Writes a 64 bit value to the registers u16Add to u16Add + 3 under one lock
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetU64(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint64_t u64Val, mb_wordorder_t xOrder)
+{
+	uint16_t *u16regs = ModbusGetTable(modH, u8table) + u16Add;
+
+	ModbusLock(modH, u8table);
+	ModbusU64ToRegs(u16regs, u64Val, xOrder);
+	ModbusTableChanged(modH, u8table);
+	ModbusUnlock(modH, u8table);
+}
+
+/**
+ * @brief
+ * Reads a signed 64 bit value from the registers u16Add to u16Add + 3
+ *
+ * @ingroup register
+ */
+static inline int64_t ModbusGetI64(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, mb_wordorder_t xOrder)
+{
+	return (int64_t)ModbusGetU64(modH, u8table, u16Add, xOrder);
+}
+
+/**
+ * @brief
+ * Writes a signed 64 bit value to the registers u16Add to u16Add + 3
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetI64(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, int64_t i64Val, mb_wordorder_t xOrder)
+{
+	ModbusSetU64(modH, u8table, u16Add, (uint64_t)i64Val, xOrder);
+}
+
+/**
+ * @brief
+ * Reads an IEEE 754 double precision value from the registers u16Add to u16Add + 3
+ *
+ * @ingroup register
+ */
+static inline double ModbusGetDouble(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, mb_wordorder_t xOrder)
+{
+	union { uint64_t u64; double d; } xVal;
+
+	xVal.u64 = ModbusGetU64(modH, u8table, u16Add, xOrder);
+	return xVal.d;
+}
+
+/**
+ * @brief
+ * Writes an IEEE 754 double precision value to the registers u16Add to u16Add + 3
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetDouble(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, double dVal, mb_wordorder_t xOrder)
+{
+	union { uint64_t u64; double d; } xVal;
+
+	xVal.d = dVal;
+	ModbusSetU64(modH, u8table, u16Add, xVal.u64, xOrder);
+}
+
+/**
+ * @brief
+ * Converts u16Regs registers from u16Add to native values in pvDst under one lock,
+ * a typed view of a table, see ModbusRegsToValues()
+ *
+ * @ingroup register
+ */
+static inline void ModbusGetValues(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, void *pvDst, uint16_t u16Regs,
+		mb_type_t xType, mb_wordorder_t xOrder)
+{
+	ModbusLock(modH, u8table);
+	ModbusRegsToValues(pvDst, ModbusGetTable(modH, u8table) + u16Add, u16Regs, xType, xOrder);
+	ModbusUnlock(modH, u8table);
+}
+
+/**
+ * @brief
+ * Converts native values of pvSrc to u16Regs registers from u16Add under one lock
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetValues(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, const void *pvSrc, uint16_t u16Regs,
+		mb_type_t xType, mb_wordorder_t xOrder)
+{
+	ModbusLock(modH, u8table);
+	ModbusValuesToRegs(ModbusGetTable(modH, u8table) + u16Add, pvSrc, u16Regs, xType, xOrder);
+	ModbusTableChanged(modH, u8table);
+	ModbusUnlock(modH, u8table);
+}
+
+/**
+ * @brief
+ * Reads the string of u16Regs registers from u16Add to cDst, 2 * u16Regs
+ * characters then a terminator. The device pads a shorter string with 0
+ *
+ * @ingroup register
+ */
+static inline void ModbusGetString(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, char *cDst, uint16_t u16Regs)
+{
+	ModbusGetValues(modH, u8table, u16Add, cDst, u16Regs, MB_TYPE_STRING, MB_WORD_HL);
+	cDst[ 2 * u16Regs ] = 0;
+}
+
+/**
+ * @brief
+ * Writes the string cSrc to the u16Regs registers from u16Add, cut at
+ * 2 * u16Regs characters or padded with 0
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetString(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, const char *cSrc, uint16_t u16Regs)
+{
+	uint16_t *u16regs = ModbusGetTable(modH, u8table) + u16Add;
+	uint8_t u8Hi, u8Lo = 1;
+
+	ModbusLock(modH, u8table);
+	for (uint16_t i = 0; i < u16Regs; i++)
+	{
+		u8Hi = (u8Lo != 0) ? (uint8_t)cSrc[ 2 * i ] : 0;
+		u8Lo = (u8Hi != 0) ? (uint8_t)cSrc[ 2 * i + 1 ] : 0;
+		u16regs[i] = ((uint16_t)u8Hi << 8) | u8Lo;
+	}
+	ModbusTableChanged(modH, u8table);
+	ModbusUnlock(modH, u8table);
+}
+
+/**
+ * @brief
+ * Copies u16Count registers from u16Add to u16dst under one lock
+ *
+ * @ingroup register
+ */
+static inline void ModbusReadRegs(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t *u16dst, uint16_t u16Count)
+{
+	ModbusLock(modH, u8table);
+	memcpy(u16dst, ModbusGetTable(modH, u8table) + u16Add, u16Count * sizeof(uint16_t));
+	ModbusUnlock(modH, u8table);
+}
+
+/**
+ * @brief
+ * Copies u16Count registers from u16src to u16Add under one lock
+ *
+ * @ingroup register
+ */
+static inline void ModbusWriteRegs(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, const uint16_t *u16src, uint16_t u16Count)
+{
+	ModbusLock(modH, u8table);
+	memcpy(ModbusGetTable(modH, u8table) + u16Add, u16src, u16Count * sizeof(uint16_t));
+	ModbusTableChanged(modH, u8table);
+	ModbusUnlock(modH, u8table);
+}
+
+/**
+ * @brief
+ * Reads the coil or discrete input u16Bit of DB_COILS or DB_INPUT_COILS, without lock
+ *
+ * @ingroup register
+ */
+static inline bool ModbusGetBit(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Bit)
+{
+	return (ModbusGetU16(modH, u8table, u16Bit / 16) >> (u16Bit % 16)) & 1;
+}
+
+/**
+ * @brief
+ * Sets or clears the bit u16Bit of DB_COILS or DB_INPUT_COILS. The register is
+ * read, modified and written under the lock, a coil written by the master
+ * in the same register is not lost
+ *
+ * @ingroup register
+ */
+static inline void ModbusSetBit(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Bit, bool xVal)
+{
+	uint16_t *u16reg = ModbusGetTable(modH, u8table) + u16Bit / 16;
+
+	ModbusLock(modH, u8table);
+	if (xVal) *u16reg |= (uint16_t)(1u << (u16Bit % 16));
+	else *u16reg &= (uint16_t)~(1u << (u16Bit % 16));
+	ModbusTableChanged(modH, u8table);
+	ModbusUnlock(modH, u8table);
+}
+
+/**
+ * @brief
+ * Inverts the bit u16Bit of DB_COILS or DB_INPUT_COILS under the lock
+ *
+ * @return new state of the bit
+ * @ingroup register
+ */
+static inline bool ModbusToggleBit(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Bit)
+{
+	uint16_t *u16reg = ModbusGetTable(modH, u8table) + u16Bit / 16;
+	bool xVal;
+
+	ModbusLock(modH, u8table);
+	*u16reg ^= (uint16_t)(1u << (u16Bit % 16));
+	xVal = (*u16reg >> (u16Bit % 16)) & 1;
+	ModbusTableChanged(modH, u8table);
+	ModbusUnlock(modH, u8table);
+	return xVal;
+}
+
+/**
+ * @brief
+ * Reads the register of Modbus address u16Add of a segment, without lock.
+ * A segment in wire order keeps it big endian, it is swapped here
+ *
+ * @ingroup register
+ */
+static inline uint16_t ModbusSegGetU16(const modbusSegment_t *xSeg, uint16_t u16Add)
+{
+	uint16_t u16Val = ((volatile uint16_t *)xSeg->u16regs)[u16Add - xSeg->u16Start];
+
+#if ENABLE_MB_WIRE_ORDER == 1
+	if (xSeg->xWireOrder) u16Val = (uint16_t)__REV16(u16Val);
+#endif
+	return u16Val;
+}
+
+/**
+ * @brief
+ * Writes the register of Modbus address u16Add of a segment, without lock, see
+ * ModbusSegGetU16(). With ENABLE_MB_RESP_CACHE call ModbusTableChanged() afterwards
+ *
+ * @ingroup register
+ */
+static inline void ModbusSegSetU16(const modbusSegment_t *xSeg, uint16_t u16Add, uint16_t u16Val)
+{
+#if ENABLE_MB_WIRE_ORDER == 1
+	if (xSeg->xWireOrder) u16Val = (uint16_t)__REV16(u16Val);
+#endif
+	((volatile uint16_t *)xSeg->u16regs)[u16Add - xSeg->u16Start] = u16Val;
+}
 
 
 
@@ -258,10 +4207,12 @@ uint8_t getState();
 uint8_t getLastError(); //!<get last error message
 void setID( uint8_t u8id ); //!<write new ID for the slave
 void setTxendPinOverTime( uint32_t u32overTime );
-void ModbusEnd(); //!<finish any communication and release serial communication port
+void ModbusEnd(); //!<finish any communication and release serial communication port, see ModbusDeInit()
 
 */
 
-
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* THIRD_PARTY_MODBUS_INC_MODBUS_H_ */
@@ -0,0 +1,135 @@
+/*
+ * ModbusFrame.hpp
+ *
+ *  C++17 compile-time frames of fixed master telegrams, header only, with ENABLE_MB_PREBUILT.
+ *
+ *  The CRC table and the complete RTU frame of a telegram are computed by the compiler and
+ *  placed in flash, the master sends the frame from there:
+ *
+ *    using Level = modbus::Read<1, MB_FC_READ_REGISTERS, 100, 10>;
+ *    uint16_t u16Level[10];
+ *    modbusPoll_t xPolls[] = { { Level::telegram(u16Level), 100 } };
+ *
+ *    static_assert(Level::frame[6] == 0x..); // the CRC is a constant
+ *
+ *  Read<> covers FC1 to FC4 and Write<> the single writes FC5 and FC6, the arguments are
+ *  checked at compile time. crc16() and frameOf() build the frame of any other PDU.
+ */
+
+#ifndef THIRD_PARTY_MODBUS_INC_MODBUSFRAME_HPP_
+#define THIRD_PARTY_MODBUS_INC_MODBUSFRAME_HPP_
+
+#include "Modbus.h"
+#include <array>
+#include <cstddef>
+
+#if __cplusplus < 201703L
+#error "ModbusFrame.hpp needs C++17"
+#endif
+
+#if ENABLE_MB_PREBUILT != 1
+#error "ModbusFrame.hpp needs ENABLE_MB_PREBUILT"
+#endif
+
+namespace modbus
+{
+
+// CRC-16 of Modbus, reflected polynomial 0xA001, one entry per byte value
+constexpr std::array<uint16_t, 256> makeCrcTable()
+{
+	std::array<uint16_t, 256> xTable = {};
+
+	for (uint16_t i = 0; i < 256; i++)
+	{
+		uint16_t u16crc = i;
+		for (uint8_t b = 0; b < 8; b++)
+		{
+			u16crc = (u16crc & 1) ? (uint16_t)((u16crc >> 1) ^ 0xA001) : (uint16_t)(u16crc >> 1);
+		}
+		xTable[i] = u16crc;
+	}
+	return xTable;
+}
+
+inline constexpr std::array<uint16_t, 256> crcTable = makeCrcTable();
+
+/**
+ * CRC of u16length bytes, sent low byte first. calcCRC() returns it with its bytes swapped
+ */
+constexpr uint16_t crc16(const uint8_t *u8data, size_t u16length)
+{
+	uint16_t u16crc = 0xFFFF;
+
+	for (size_t i = 0; i < u16length; i++)
+	{
+		u16crc = (uint16_t)((u16crc >> 8) ^ crcTable[(u16crc ^ u8data[i]) & 0xFF]);
+	}
+	return u16crc;
+}
+
+/**
+ * RTU frame of a PDU with its slave address in front: the PDU then its CRC
+ */
+template <size_t N>
+constexpr std::array<uint8_t, N + 2> frameOf(const std::array<uint8_t, N> &u8pdu)
+{
+	std::array<uint8_t, N + 2> u8frame = {};
+	uint16_t u16crc = crc16(u8pdu.data(), N);
+
+	for (size_t i = 0; i < N; i++) u8frame[i] = u8pdu[i];
+	u8frame[N] = (uint8_t)(u16crc & 0xFF);
+	u8frame[N + 1] = (uint8_t)(u16crc >> 8);
+	return u8frame;
+}
+
+template <uint8_t Id, mb_functioncode_t Fct, uint16_t Add, uint16_t Arg>
+struct Fixed
+{
+	static_assert(Id >= 1 && Id <= 247, "a prebuilt telegram addresses one slave, 1 to 247");
+
+	static constexpr std::array<uint8_t, 8> frame = frameOf<6>({{ Id, (uint8_t)Fct, (uint8_t)(Add >> 8), (uint8_t)Add,
+			(uint8_t)(Arg >> 8), (uint8_t)Arg }});
+
+	/**
+	 * Zero-initialized telegram sending frame, u16reg receives the answer
+	 */
+	static modbus_t telegram(uint16_t *u16reg)
+	{
+		modbus_t xTelegram = {};
+
+		xTelegram.u8id = Id;
+		xTelegram.u8fct = Fct;
+		xTelegram.u16RegAdd = Add;
+		xTelegram.u16CoilsNo = (Fct == MB_FC_WRITE_COIL || Fct == MB_FC_WRITE_REGISTER) ? 1 : Arg;
+		xTelegram.u16reg = u16reg;
+		xTelegram.u8Frame = frame.data();
+		xTelegram.u8FrameSize = (uint8_t)frame.size();
+		return xTelegram;
+	}
+};
+
+/**
+ * FC1 to FC4 read of Count coils or registers from Add
+ */
+template <uint8_t Id, mb_functioncode_t Fct, uint16_t Add, uint16_t Count>
+struct Read : Fixed<Id, Fct, Add, Count>
+{
+	static_assert(Fct == MB_FC_READ_COILS || Fct == MB_FC_READ_DISCRETE_INPUT ||
+			Fct == MB_FC_READ_REGISTERS || Fct == MB_FC_READ_INPUT_REGISTER, "Read<> takes FC1 to FC4");
+	static_assert(Count >= 1 && Count <= ((Fct == MB_FC_READ_COILS || Fct == MB_FC_READ_DISCRETE_INPUT) ? 2000 : 125),
+			"a read takes 1 to 2000 coils or 1 to 125 registers");
+	static_assert((uint32_t)Add + Count <= 0x10000UL, "the read ends beyond address 0xFFFF");
+};
+
+/**
+ * FC5 or FC6 write of Value to Add, FC5 sets the coil for any Value but 0
+ */
+template <uint8_t Id, mb_functioncode_t Fct, uint16_t Add, uint16_t Value>
+struct Write : Fixed<Id, Fct, Add, (Fct == MB_FC_WRITE_COIL) ? (Value ? 0xFF00 : 0) : Value>
+{
+	static_assert(Fct == MB_FC_WRITE_COIL || Fct == MB_FC_WRITE_REGISTER, "Write<> takes FC5 or FC6");
+};
+
+}
+
+#endif /* THIRD_PARTY_MODBUS_INC_MODBUSFRAME_HPP_ */
@@ -0,0 +1,132 @@
+/*
+ * ModbusOta.h
+ *
+ *  Firmware update over a Modbus slave, enabled by ENABLE_MB_OTA.
+ *
+ *  The image is written in order, as FC21 file records (MB_OTA_FILE()) or FC16 writes to a
+ *  holding register window (MB_OTA_WINDOW()). The slave copies each chunk to one of two
+ *  MB_OTA_CHUNK buffers and answers at once, the update task programs the other buffer into
+ *  the download slot meanwhile and keeps a CRC-32 of the programmed flash. A commit with the
+ *  size and the CRC-32 of the image ends the transfer, xOnDone is called when the flash matches.
+ *
+ *  Window layout, from its first register:
+ *  - write: offset of the data (2 registers, high word first) and the data, high byte first.
+ *    The offset MB_OTA_COMMIT is followed by the image size and CRC-32 (2 registers each),
+ *    MB_OTA_ABORT drops the transfer
+ *  - read: bytes received (2 registers), mb_ota_state_t, CRC-32 of the programmed bytes (2 registers)
+ */
+
+#ifndef THIRD_PARTY_MODBUS_INC_MODBUSOTA_H_
+#define THIRD_PARTY_MODBUS_INC_MODBUSOTA_H_
+
+#include "Modbus.h"
+
+#if ENABLE_MB_OTA == 1
+
+#ifndef MB_OTA_CHUNK
+#define MB_OTA_CHUNK  256
+#endif
+#ifndef MB_OTA_WAIT
+#define MB_OTA_WAIT  50
+#endif
+#ifndef MB_OTA_TASK_PRIO
+#define MB_OTA_TASK_PRIO  osPriorityBelowNormal
+#endif
+#ifndef MB_OTA_STACK
+#define MB_OTA_STACK  (128 * 4)
+#endif
+#ifndef MB_OTA_FLASH_BEGIN
+#define MB_OTA_FLASH_BEGIN()  HAL_FLASH_Unlock()
+#endif
+#ifndef MB_OTA_FLASH_END
+#define MB_OTA_FLASH_END()  HAL_FLASH_Lock()
+#endif
+
+#if MB_ENABLE_SLAVE != 1
+#error "ENABLE_MB_OTA needs MB_ENABLE_SLAVE"
+#endif
+
+#if MB_OTA_CHUNK < 256 || (MB_OTA_CHUNK % 8) != 0
+#error "MB_OTA_CHUNK must hold the data of one request, 246 bytes, and be a multiple of the 8 bytes programmed at once"
+#endif
+
+#define MB_OTA_COMMIT  0xFFFFFFFFUL // window offset of the commit
+#define MB_OTA_ABORT   0xFFFFFFFEUL // window offset of the abort
+#define MB_OTA_STATUS  5            // registers of the window status
+#define MB_OTA_NONE    0xFF         // no chunk buffer
+
+typedef enum
+{
+	MB_OTA_IDLE = 0,  //!< no transfer, a write at offset 0 starts one
+	MB_OTA_RECEIVING, //!< chunks are received and programmed
+	MB_OTA_VERIFYING, //!< committed, the last chunks are programmed and the CRC-32 compared
+	MB_OTA_DONE,      //!< the image in the slot matches, xOnDone was called
+	MB_OTA_ERROR      //!< erase or program failure, or CRC-32 mismatch
+}mb_ota_state_t;
+
+struct modbusOta_s;
+
+/**
+ * Called by the update task when a committed image matches its CRC-32, for example to
+ * mark the slot for the bootloader or to swap the banks of a dual bank device
+ */
+typedef void (*mb_ota_cb_t)(struct modbusOta_s *xOta);
+
+/**
+ * @struct modbusOta_t
+ * @brief
+ * Firmware update channel, see ModbusOtaInit(). The application sets the first fields,
+ * the others belong to the module
+ */
+typedef struct modbusOta_s
+{
+	uint32_t u32Slot;     //!< flash address of the download slot, page aligned
+	uint32_t u32SlotSize; //!< bytes of the slot, a multiple of FLASH_PAGE_SIZE
+	uint16_t u16File;     //!< FC21: file number of the first MB_FILE_RECORDS * 2 bytes of the image
+	mb_ota_cb_t xOnDone;  //!< optional, called when a committed image matches
+	void *pvContext;      //!< free for xOnDone
+
+	volatile mb_ota_state_t xState;
+	uint32_t u32Received; //bytes of the image received, the next offset
+	uint32_t u32Expected; //CRC-32 of the commit
+	volatile uint32_t u32Crc; //CRC-32 of the programmed bytes, kept by the update task
+	bool xFailed;         //an erase or a program of the transfer failed, kept by the update task
+	uint8_t u8Fill;       //buffer filled by the slave, MB_OTA_NONE when both are with the task
+	uint8_t u8Next;       //buffer filled next
+	uint16_t u16Fill;     //bytes in the filled buffer
+	uint32_t u32Addr[2];  //flash address of each buffer
+	uint16_t u16Len[2];   //bytes of each buffer
+	uint8_t u8Chunk[2][MB_OTA_CHUNK];
+
+	osThreadId_t xTask;
+	osMessageQueueId_t xFull; //buffers to program, then MB_OTA_NONE for the commit
+	osSemaphoreId_t xFree;    //buffers free for the slave
+#if ENABLE_MB_STATIC == 1
+	StaticTask_t xTaskCb;
+	StackType_t xTaskStack[MB_OTA_STACK / sizeof(StackType_t)];
+	StaticQueue_t xFullCb;
+	uint8_t u8FullMem[3 * sizeof(uint8_t)];
+	StaticSemaphore_t xFreeCb;
+#endif
+}modbusOta_t;
+
+#if MB_SLAVE_FILES
+// file entry of the image for ModbusSetFiles(), one per MB_FILE_RECORDS * 2 bytes starting at xOta->u16File
+#define MB_OTA_FILE(file, ota)  { (file), MB_FILE_RECORDS, NULL, NULL, ModbusOtaFileWrite, (ota) }
+#endif
+// holding register segment of the window for xSegHR, the array regs holds 2 + the data registers of a request
+#define MB_OTA_WINDOW(start, regs, ota)  { (start), (uint16_t)(sizeof(regs) / sizeof(uint16_t)), (regs), ModbusOtaWindowRead, ModbusOtaWindowWrite, (ota) }
+
+void ModbusOtaInit(modbusOta_t *xOta);
+uint8_t ModbusOtaWrite(modbusOta_t *xOta, uint32_t u32Offset, const uint8_t *u8data, uint16_t u16Bytes);
+uint8_t ModbusOtaCommit(modbusOta_t *xOta, uint32_t u32Size, uint32_t u32Crc);
+void ModbusOtaAbort(modbusOta_t *xOta);
+#if MB_SLAVE_FILES
+uint8_t ModbusOtaFileWrite(const modbusFile_t *xFile, uint16_t u16Record, uint16_t u16Count, uint8_t *u8data);
+#endif
+uint8_t ModbusOtaWindowWrite(const modbusSegment_t *xSeg, uint16_t u16Add, uint16_t u16Count);
+uint8_t ModbusOtaWindowRead(const modbusSegment_t *xSeg, uint16_t u16Add, uint16_t u16Count);
+
+#endif
+
+#endif /* THIRD_PARTY_MODBUS_INC_MODBUSOTA_H_ */
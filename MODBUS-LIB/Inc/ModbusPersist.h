@@ -0,0 +1,82 @@
+/*
+ * ModbusPersist.h
+ *
+ *  Flash journal of the writable tables of a slave, enabled by ENABLE_MB_PERSIST.
+ *
+ *  Each register written by the master is appended as one 8 byte record (table, address,
+ *  value and CRC) to the active page of a region of u8Pages flash pages, the dirty bitmaps
+ *  of ENABLE_MB_WRITE_NOTIFY tell which ones. When the active page is full the journal task
+ *  erases the next page, writes a snapshot of both tables in it and continues there, so the
+ *  pages wear evenly and a page is only erased once per MB_PERSIST_RECORDS records.
+ *  ModbusPersistInit() replays the newest page into the tables before ModbusStart().
+ *
+ *  Page layout: a header record with the sequence number of the page, programmed last by a
+ *  compaction, then the snapshot and the appended records in the order they were written.
+ */
+
+#ifndef THIRD_PARTY_MODBUS_INC_MODBUSPERSIST_H_
+#define THIRD_PARTY_MODBUS_INC_MODBUSPERSIST_H_
+
+#include "Modbus.h"
+
+#if ENABLE_MB_PERSIST == 1
+
+#ifndef MB_PERSIST_REGS
+#define MB_PERSIST_REGS  256
+#endif
+#ifndef MB_PERSIST_DELAY
+#define MB_PERSIST_DELAY  20
+#endif
+#ifndef MB_PERSIST_TASK_PRIO
+#define MB_PERSIST_TASK_PRIO  osPriorityBelowNormal
+#endif
+#ifndef MB_PERSIST_STACK
+#define MB_PERSIST_STACK  (128 * 4)
+#endif
+#ifndef MB_PERSIST_FLASH_BEGIN
+#define MB_PERSIST_FLASH_BEGIN()  HAL_FLASH_Unlock()
+#endif
+#ifndef MB_PERSIST_FLASH_END
+#define MB_PERSIST_FLASH_END()  HAL_FLASH_Lock()
+#endif
+
+#if ENABLE_MB_WRITE_NOTIFY != 1
+#error "ENABLE_MB_PERSIST needs ENABLE_MB_WRITE_NOTIFY, the dirty bitmaps select the records"
+#endif
+
+#define MB_PERSIST_RECORDS  (FLASH_PAGE_SIZE / 8) // records of a page, the header included
+#define MB_PERSIST_MAGIC    0xA5                  // byte 5 of every record
+#define MB_PERSIST_HEADER   0                     // table of the header record, its address and value hold the sequence
+
+/**
+ * @struct modbusPersist_t
+ * @brief
+ * Flash journal of a slave, see ModbusPersistInit(). The application sets the first fields,
+ * the others belong to the module
+ */
+typedef struct
+{
+	modbusHandler_t *modH; //!< slave whose u16regsHR and u16regsCoils are kept, u32DirtyHR and u32DirtyCoils must be set
+	uint32_t u32Base;      //!< flash address of the journal, page aligned
+	uint8_t u8Pages;       //!< pages of the journal, at least 2, written in turn
+
+	uint32_t u32Seq;         //sequence number of the active page
+	uint8_t u8Page;          //active page
+	uint16_t u16Next;        //next free record of the active page
+	uint32_t u32Records;     //records appended since ModbusPersistInit()
+	uint32_t u32Compactions; //snapshots written since ModbusPersistInit()
+	bool xFailed;            //the last erase or program failed, the next batch compacts into the next page
+	uint32_t u32Dirty[MB_DIRTY_WORDS(MB_PERSIST_REGS)]; //bitmap taken by the journal task
+
+	osThreadId_t xTask;
+#if ENABLE_MB_STATIC == 1
+	StaticTask_t xTaskCb;
+	StackType_t xTaskStack[MB_PERSIST_STACK / sizeof(StackType_t)];
+#endif
+}modbusPersist_t;
+
+void ModbusPersistInit(modbusPersist_t *xPersist);
+
+#endif
+
+#endif /* THIRD_PARTY_MODBUS_INC_MODBUSPERSIST_H_ */
@@ -0,0 +1,64 @@
+/*
+ * ModbusPort.h
+ *
+ *  Port layer of the Modbus library: the only place where the HAL, CMSIS and
+ *  FreeRTOS headers are included.
+ *
+ *  On the target this is the STM32 Cube HAL of main.h with FreeRTOS and CMSIS_RTOS_V2.
+ *  A host build (x86, for benchmarks and regression runs, see MODBUS_HOST) defines MB_PORT_HOST
+ *  to 1 and gets ModbusPortHost.h instead, which declares what the library uses from the target:
+ *  - UART_HandleTypeDef, GPIO_TypeDef and the HAL_UART_xxx / HAL_GPIO_WritePin functions of the
+ *    fake UARTs of ModbusPortHost.c, which send to their peer or to the test
+ *  - __DMB(), __CLZ() and DWT, whose cycle counter is the nanosecond clock of the host
+ *  The FreeRTOS headers then come from the POSIX port of FreeRTOS, with ENABLE_MB_NATIVE_RTOS.
+ *  A Linux build also defines MB_PORT_POSIX to 1, ModbusPortPosix.h then replaces ModbusPortHost.h, with the serial ports
+ *  of termios served by the epoll loops of ModbusPortPosix.c.
+ *
+ *  ENABLE_MB_NATIVE_RTOS drops CMSIS_RTOS_V2: ModbusPortRtos.h maps the few osXxx() calls of the library to FreeRTOS.
+ *
+ *  ENABLE_TCP and ENABLE_UDP add the netconn API of lwIP, its tcpip thread must run before ModbusStart().
+ *  With MB_PORT_POSIX, ModbusPortPosix.h declares the part of that API the library uses, over kernel sockets.
+ *  ENABLE_USB_CDC adds the CDC class of the STM32 USB device library, from the USB_DEVICE middleware of Cube-MX.
+ *  ENABLE_USART_DMA_LL adds the USART LL driver of the STM32WB, a host port declares its LL_USART_xxx functions.
+ */
+
+#ifndef THIRD_PARTY_MODBUS_INC_MODBUSPORT_H_
+#define THIRD_PARTY_MODBUS_INC_MODBUSPORT_H_
+
+#if MB_PORT_HOST == 1 && MB_PORT_POSIX == 1
+#include "ModbusPortPosix.h"
+#elif MB_PORT_HOST == 1
+#include "ModbusPortHost.h"
+#else
+#include "main.h"
+#endif
+
+#include "FreeRTOS.h"
+#if ENABLE_MB_NATIVE_RTOS != 1
+#include "cmsis_os.h"
+#endif
+#include "task.h"
+#include "queue.h"
+#include "timers.h"
+#include "event_groups.h"
+#include "semphr.h"
+#if ENABLE_MB_RX_QUEUE == 1
+#include "message_buffer.h"
+#endif
+#if ENABLE_MB_NATIVE_RTOS == 1
+#include "ModbusPortRtos.h"
+#endif
+
+#if (ENABLE_TCP == 1 || ENABLE_UDP == 1) && MB_PORT_POSIX != 1
+#include "lwip/api.h"
+#endif
+
+#if ENABLE_USB_CDC == 1
+#include "usbd_cdc.h"
+#endif
+
+#if ENABLE_USART_DMA_LL == 1 && MB_PORT_HOST != 1
+#include "stm32wbxx_ll_usart.h"
+#endif
+
+#endif /* THIRD_PARTY_MODBUS_INC_MODBUSPORT_H_ */
@@ -0,0 +1,196 @@
+/*
+ * ModbusPortHost.h
+ *
+ *  Host port of the Modbus library, enabled by MB_PORT_HOST: ModbusPort.h includes it in place of main.h.
+ *  The same Modbus.c and UARTCallback.c as on the target run on a PC over the POSIX port of FreeRTOS
+ *  (FreeRTOS/Source/portable/ThirdParty/GCC/Posix), for benchmarks and regression runs, see MODBUS_HOST.
+ *
+ *  A UART_HandleTypeDef is a fake UART of ModbusPortHost.c. What it sends goes on the line of pxPeer: two
+ *  handles pointing at each other are a master and a slave on one bus, a handle pointing at itself loops its
+ *  frames back to its own reception. Without a peer the frames wait for HostUartRead() of the test, and
+ *  HostUartWrite() puts the bytes of a device on the line of a port. The line task of the port delivers them
+ *  every tick: HAL_UART_RxCpltCallback() with each byte, then HAL_UART_TxCpltCallback() for a frame sent,
+ *  as the UART interrupts do.
+ *
+ *  DWT is the clock of the host, CYCCNT counts nanoseconds with SystemCoreClock at 1 GHz: the cycle counts
+ *  of the library, MB_COST_CLOCK() and ModbusBenchmark() included, read as nanoseconds on a PC.
+ *  The DMA, LL, timer and LPUART modes of the target do not exist here.
+ */
+
+#ifndef THIRD_PARTY_MODBUS_INC_MODBUSPORTHOST_H_
+#define THIRD_PARTY_MODBUS_INC_MODBUSPORTHOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef MB_HOST_LINE
+#define MB_HOST_LINE  1024 // bytes on the way to a port, power of two
+#endif
+#ifndef MB_HOST_PORTS
+#define MB_HOST_PORTS  8 // fake UARTs served by the line task
+#endif
+#ifndef MB_HOST_LINE_PRIO
+#define MB_HOST_LINE_PRIO  osPriorityHigh // above the Modbus tasks, as the UART interrupts are
+#endif
+#ifndef MB_HOST_LINE_STACK
+#define MB_HOST_LINE_STACK  (256 * 4)
+#endif
+
+#if (MB_HOST_LINE & (MB_HOST_LINE - 1)) != 0
+#error "MB_HOST_LINE must be a power of two"
+#endif
+
+#if ENABLE_USART_DMA == 1 || ENABLE_LPUART == 1 || ENABLE_TIM_T35 == 1 || ENABLE_LPTIM_T35 == 1 || ENABLE_USB_CDC == 1 || ENABLE_MB_BLE == 1
+#error "MB_PORT_HOST only has the USART_HW and ASCII_HW transports"
+#endif
+
+#if ENABLE_MB_PROBES == 1 || ENABLE_MB_RX_MUTE == 1 || ENABLE_USART_RTO == 1 || ENABLE_USART_FIFO == 1 || ENABLE_MB_ISR_DEFER == 1 || \
+	ENABLE_MB_ARBITRATION == 1
+#error "MB_PORT_HOST has no GPIO, mute mode, receiver timeout, FIFO, busy flag or spare interrupt of the USART"
+#endif
+
+typedef enum
+{
+	HAL_OK      = 0x00,
+	HAL_ERROR   = 0x01,
+	HAL_BUSY    = 0x02,
+	HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct
+{
+	uint32_t u32Unused; // no GPIO on a PC, EN_Port stays NULL
+} GPIO_TypeDef;
+
+typedef uint32_t HAL_UART_StateTypeDef;
+#define HAL_UART_STATE_RESET    0x00U
+#define HAL_UART_STATE_READY    0x20U
+#define HAL_UART_STATE_BUSY_TX  0x21U
+#define HAL_UART_STATE_BUSY_RX  0x22U
+
+#define HAL_UART_ERROR_NONE  0x00U
+#define HAL_UART_ERROR_PE    0x01U
+#define HAL_UART_ERROR_NE    0x02U
+#define HAL_UART_ERROR_FE    0x04U
+#define HAL_UART_ERROR_ORE   0x08U
+
+/* values of Init, those of the STM32 HAL */
+#define UART_WORDLENGTH_7B   0x10000000U
+#define UART_WORDLENGTH_8B   0x00000000U
+#define UART_WORDLENGTH_9B   0x00001000U
+#define UART_STOPBITS_1      0x00000000U
+#define UART_STOPBITS_2      0x00002000U
+#define UART_PARITY_NONE     0x00000000U
+#define UART_PARITY_EVEN     0x00000400U
+#define UART_PARITY_ODD      0x00000600U
+
+typedef struct
+{
+	uint32_t BaudRate;
+	uint32_t WordLength;
+	uint32_t StopBits;
+	uint32_t Parity;
+} UART_InitTypeDef;
+
+/**
+ * @struct UART_HandleTypeDef
+ * @brief
+ * A fake UART. The test sets pxPeer and Init and calls HAL_UART_Init() before ModbusStart(),
+ * the other fields belong to ModbusPortHost.c
+ */
+typedef struct __UART_HandleTypeDef
+{
+	struct __UART_HandleTypeDef *pxPeer; //!< port receiving the frames sent, the handle itself for a loopback, NULL for HostUartRead()
+	UART_InitTypeDef Init;  //!< line settings, the baud rate sets the T35 of the library
+
+	void *Instance;         //points to the handle, the library keys its port map with it
+	volatile HAL_UART_StateTypeDef gState;  //TX state
+	volatile HAL_UART_StateTypeDef RxState; //RX state, BUSY_RX while a reception is armed
+	volatile uint32_t ErrorCode;
+	uint8_t *pRxBuffPtr;    //reception armed by HAL_UART_Receive_IT()
+	uint16_t RxXferSize;
+	volatile uint16_t RxXferCount;
+	volatile bool xTxDone;  //a frame was put on the line, the line task completes it
+	uint8_t u8Line[MB_HOST_LINE]; //bytes on the way to the port, from pxPeer of another port or HostUartWrite()
+	volatile uint32_t u32LineHead;
+	volatile uint32_t u32LineTail;
+	uint8_t u8Sent[MB_HOST_LINE]; //bytes sent without a peer, for HostUartRead()
+	volatile uint32_t u32SentHead;
+	volatile uint32_t u32SentTail;
+} UART_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart);
+HAL_UART_StateTypeDef HAL_UART_GetState(UART_HandleTypeDef *huart);
+
+uint16_t HostUartWrite(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size); // bytes of a device on the line of huart
+uint16_t HostUartRead(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size); // bytes sent by huart without a peer
+
+/* the frame goes on the line at once, as with the DMA */
+static inline HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+	return HAL_UART_Transmit_IT(huart, pData, Size);
+}
+
+/* a fake line has no direction */
+static inline HAL_StatusTypeDef HAL_HalfDuplex_EnableTransmitter(UART_HandleTypeDef *huart) { (void)huart; return HAL_OK; }
+static inline HAL_StatusTypeDef HAL_HalfDuplex_EnableReceiver(UART_HandleTypeDef *huart) { (void)huart; return HAL_OK; }
+static inline void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+	(void)GPIOx; (void)GPIO_Pin; (void)PinState;
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+/* cycle counter of the Cortex-M, the nanoseconds of CLOCK_MONOTONIC here */
+typedef struct
+{
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct
+{
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+#define DWT_CTRL_CYCCNTENA_Msk        0x00000001U
+#define CoreDebug_DEMCR_TRCENA_Msk    0x01000000U
+
+DWT_Type *hostDwt(void); // CYCCNT brought to the clock of the host at each read
+extern CoreDebug_Type xHostCoreDebug;
+extern uint32_t SystemCoreClock;
+
+#define DWT        hostDwt()
+#define CoreDebug  (&xHostCoreDebug)
+
+/* Cortex-M intrinsics of the library */
+#define __DMB()  __sync_synchronize()
+static inline uint32_t __CLZ(uint32_t u32Val) { return (u32Val == 0) ? 32 : (uint32_t)__builtin_clz(u32Val); }
+static inline uint32_t __RBIT(uint32_t u32Val)
+{
+	uint32_t u32Rev = 0;
+	for (uint8_t i = 0; i < 32; i++, u32Val >>= 1) u32Rev = (u32Rev << 1) | (u32Val & 1);
+	return u32Rev;
+}
+static inline uint32_t __REV16(uint32_t u32Val) { return ((u32Val & 0xFF00FF00U) >> 8) | ((u32Val & 0x00FF00FFU) << 8); }
+static inline uint32_t __ROR(uint32_t u32Val, uint32_t u32Bits)
+{
+	u32Bits %= 32;
+	return (u32Bits == 0) ? u32Val : (u32Val >> u32Bits) | (u32Val << (32 - u32Bits));
+}
+
+#endif /* THIRD_PARTY_MODBUS_INC_MODBUSPORTHOST_H_ */
@@ -0,0 +1,306 @@
+/*
+ * ModbusPortPosix.h
+ *
+ *  Linux port of the Modbus library, enabled by MB_PORT_POSIX with MB_PORT_HOST: ModbusPort.h includes it
+ *  in place of a ModbusPortHost.h. The library is built unchanged, the same Modbus.c and UARTCallback.c
+ *  as on the target, over the POSIX port of FreeRTOS (FreeRTOS/Source/portable/ThirdParty/GCC/Posix).
+ *
+ *  A UART_HandleTypeDef is a tty of termios, opened and configured by HAL_UART_Init() from pcDevice and
+ *  Init. ModbusPortPosix.c implements the HAL_UART_xxx functions the USART_HW handlers use, the epoll event
+ *  loop u8Loop of the port reads the received bytes and calls HAL_UART_RxCpltCallback() with each of them,
+ *  and HAL_UART_TxCpltCallback() once the kernel sent the last byte of a frame, as the UART interrupt does.
+ *  A loop is a FreeRTOS task polling its epoll instance every tick, MB_POSIX_LOOPS of them share the buses.
+ *
+ *  The transceiver of an RS-485 line is driven by the kernel (TIOCSRS485) when xRs485 is set, EN_Port stays
+ *  NULL. The DMA, LL, timer and LPUART modes and the DWT cycle counter do not exist here.
+ *
+ *  ENABLE_TCP and ENABLE_UDP use the sockets of the kernel: ModbusPortPosix.c implements the part of the
+ *  netconn, pbuf and netbuf API of lwIP the TCP_HW and UDP_HW handlers call, so a gateway serves its clients
+ *  through the network stack of Linux. The sockets are non-blocking and edge-triggered in an epoll instance
+ *  of loop 0, which calls the callback of a netconn with NETCONN_EVT_RCVPLUS as the tcpip thread of lwIP
+ *  does. netconn_connect() and netconn_write() wait for the socket with vTaskDelay().
+ */
+
+#ifndef THIRD_PARTY_MODBUS_INC_MODBUSPORTPOSIX_H_
+#define THIRD_PARTY_MODBUS_INC_MODBUSPORTPOSIX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef MB_POSIX_LOOPS
+#define MB_POSIX_LOOPS  1 // event loop tasks, a port is served by its u8Loop
+#endif
+#ifndef MB_POSIX_LOOP_PRIO
+#define MB_POSIX_LOOP_PRIO  osPriorityHigh // above the Modbus tasks, as the UART interrupts are
+#endif
+#ifndef MB_POSIX_LOOP_STACK
+#define MB_POSIX_LOOP_STACK  (256 * 4)
+#endif
+#ifndef MB_POSIX_EVENTS
+#define MB_POSIX_EVENTS  16 // epoll events taken per pass of a loop
+#endif
+#ifndef MB_POSIX_NET_TIMEOUT
+#define MB_POSIX_NET_TIMEOUT  3000 // ticks netconn_connect() waits for the server and netconn_write() for the window
+#endif
+#ifndef MB_POSIX_PBUF
+#define MB_POSIX_PBUF  1460 // bytes read into one pbuf, a datagram longer than this is cut
+#endif
+
+#if ENABLE_USART_DMA == 1 || ENABLE_LPUART == 1 || ENABLE_TIM_T35 == 1 || ENABLE_LPTIM_T35 == 1 || ENABLE_USB_CDC == 1 || ENABLE_MB_BLE == 1
+#error "MB_PORT_POSIX only has the USART_HW, ASCII_HW, TCP_HW and UDP_HW transports"
+#endif
+
+#if ENABLE_MB_PROBES == 1
+#error "MB_PORT_POSIX has no GPIO for the probes of ENABLE_MB_PROBES"
+#endif
+
+#if ENABLE_MB_RX_MUTE == 1
+#error "MB_PORT_POSIX has no mute mode, a tty gets every frame of the line"
+#endif
+
+#if ENABLE_USART_RTO == 1 || ENABLE_USART_FIFO == 1
+#error "MB_PORT_POSIX detects T35 with the timer of FreeRTOS, there is no receiver timeout or FIFO of the USART"
+#endif
+
+#if ENABLE_MB_ARBITRATION == 1
+#error "MB_PORT_POSIX has no busy flag of the USART, a tty does not tell a frame on the line"
+#endif
+
+typedef enum
+{
+	HAL_OK      = 0x00,
+	HAL_ERROR   = 0x01,
+	HAL_BUSY    = 0x02,
+	HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct
+{
+	uint32_t u32Unused; // no GPIO on a PC, EN_Port stays NULL
+} GPIO_TypeDef;
+
+typedef uint32_t HAL_UART_StateTypeDef;
+#define HAL_UART_STATE_RESET    0x00U
+#define HAL_UART_STATE_READY    0x20U
+#define HAL_UART_STATE_BUSY_TX  0x21U
+#define HAL_UART_STATE_BUSY_RX  0x22U
+
+#define HAL_UART_ERROR_NONE  0x00U
+#define HAL_UART_ERROR_PE    0x01U
+#define HAL_UART_ERROR_NE    0x02U
+#define HAL_UART_ERROR_FE    0x04U
+#define HAL_UART_ERROR_ORE   0x08U
+
+/* values of Init, those of the STM32 HAL: 9 bits carry 8 data bits and the parity bit */
+#define UART_WORDLENGTH_7B   0x10000000U
+#define UART_WORDLENGTH_8B   0x00000000U
+#define UART_WORDLENGTH_9B   0x00001000U
+#define UART_STOPBITS_1      0x00000000U
+#define UART_STOPBITS_2      0x00002000U
+#define UART_PARITY_NONE     0x00000000U
+#define UART_PARITY_EVEN     0x00000400U
+#define UART_PARITY_ODD      0x00000600U
+
+typedef struct
+{
+	uint32_t BaudRate;
+	uint32_t WordLength;
+	uint32_t StopBits;
+	uint32_t Parity;
+} UART_InitTypeDef;
+
+/**
+ * @struct UART_HandleTypeDef
+ * @brief
+ * A serial port of a Linux box. The application sets pcDevice, Init, u8Loop and xRs485 and calls
+ * HAL_UART_Init() before ModbusStart(), the other fields belong to ModbusPortPosix.c
+ */
+typedef struct __UART_HandleTypeDef
+{
+	const char *pcDevice;   //!< tty of the port, /dev/ttyUSB0 for instance
+	UART_InitTypeDef Init;  //!< line settings, applied by HAL_UART_Init()
+	uint8_t u8Loop;         //!< event loop serving the port, below MB_POSIX_LOOPS
+	bool xRs485;            //!< the kernel drives RTS as the enable of the RS-485 transceiver
+
+	void *Instance;         //points to the handle, the library keys its port map with it
+	int iFd;                //descriptor of the tty, -1 while closed
+	volatile HAL_UART_StateTypeDef gState;  //TX state
+	volatile HAL_UART_StateTypeDef RxState; //RX state, BUSY_RX while a reception is armed
+	volatile uint32_t ErrorCode;
+	uint8_t *pRxBuffPtr;    //reception armed by HAL_UART_Receive_IT()
+	uint16_t RxXferSize;
+	volatile uint16_t RxXferCount;
+	const uint8_t *pTxBuffPtr; //bytes of the frame not yet taken by the kernel
+	volatile uint16_t TxXferCount;
+	volatile bool xTxDrain; //the kernel has the whole frame, TX completes when its queue is empty
+} UART_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart);
+HAL_UART_StateTypeDef HAL_UART_GetState(UART_HandleTypeDef *huart);
+
+/* the kernel queues the frame as the DMA would */
+static inline HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+	return HAL_UART_Transmit_IT(huart, pData, Size);
+}
+
+/* the direction of an RS-485 line is switched by the kernel */
+static inline HAL_StatusTypeDef HAL_HalfDuplex_EnableTransmitter(UART_HandleTypeDef *huart) { (void)huart; return HAL_OK; }
+static inline HAL_StatusTypeDef HAL_HalfDuplex_EnableReceiver(UART_HandleTypeDef *huart) { (void)huart; return HAL_OK; }
+static inline void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+	(void)GPIOx; (void)GPIO_Pin; (void)PinState;
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+#if ENABLE_TCP == 1 || ENABLE_UDP == 1
+/* the part of the lwIP API the TCP_HW and UDP_HW handlers use, over the sockets of the kernel */
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef int8_t err_t;
+
+#define ERR_OK          0
+#define ERR_MEM        -1
+#define ERR_TIMEOUT    -3
+#define ERR_VAL        -6
+#define ERR_WOULDBLOCK -7
+#define ERR_USE        -8
+#define ERR_CONN      -11
+#define ERR_RST       -14
+#define ERR_CLSD      -15
+#define ERR_ARG       -16
+
+/* an IPv4 address in network order, as lwIP keeps it */
+typedef struct
+{
+	uint32_t addr;
+} ip_addr_t;
+
+extern const ip_addr_t ip_addr_any;
+#define IP_ADDR_ANY  (&ip_addr_any)
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+	((ipaddr)->addr = __builtin_bswap32(((uint32_t)((a) & 0xFF) << 24) | ((uint32_t)((b) & 0xFF) << 16) | \
+			((uint32_t)((c) & 0xFF) << 8) | (uint32_t)((d) & 0xFF)))
+int ipaddr_aton(const char *cp, ip_addr_t *addr); // dotted IPv4 address, 0 if it is not one
+
+/**
+ * @struct pbuf
+ * @brief
+ * Received bytes, one read of a socket per pbuf. As in lwIP, tot_len counts the bytes of the pbuf and of
+ * the ones chained after it, and payload moves forward when pbuf_free_header() takes part of a pbuf
+ */
+struct pbuf
+{
+	struct pbuf *next;
+	void *payload;
+	u16_t tot_len;
+	u16_t len;
+};
+
+u8_t pbuf_free(struct pbuf *p);
+void pbuf_cat(struct pbuf *head, struct pbuf *tail);
+u8_t pbuf_get_at(const struct pbuf *p, u16_t offset);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+struct pbuf *pbuf_free_header(struct pbuf *q, u16_t size);
+
+/**
+ * @struct netbuf
+ * @brief
+ * A datagram and its source
+ */
+struct netbuf
+{
+	struct pbuf *p, *ptr;
+	ip_addr_t addr;
+	u16_t port;
+};
+
+#define netbuf_fromaddr(buf)  (&(buf)->addr)
+#define netbuf_fromport(buf)  ((buf)->port)
+struct netbuf *netbuf_new(void);
+void *netbuf_alloc(struct netbuf *buf, u16_t size);
+void netbuf_delete(struct netbuf *buf);
+
+enum netconn_type
+{
+	NETCONN_TCP = 0x10,
+	NETCONN_UDP = 0x20
+};
+
+enum netconn_evt
+{
+	NETCONN_EVT_RCVPLUS,
+	NETCONN_EVT_RCVMINUS,
+	NETCONN_EVT_SENDPLUS,
+	NETCONN_EVT_SENDMINUS,
+	NETCONN_EVT_ERROR
+};
+
+#define NETCONN_COPY       0x01
+#define NETCONN_MORE       0x02
+#define NETCONN_DONTBLOCK  0x04
+
+struct netconn;
+typedef void (*netconn_callback)(struct netconn *conn, enum netconn_evt evt, u16_t len);
+
+/**
+ * @struct netconn
+ * @brief
+ * A socket of the kernel with the callback of its owner
+ */
+struct netconn
+{
+	int iFd;                   // non-blocking socket
+	enum netconn_type type;
+	netconn_callback callback; // called by loop 0 on every event of the socket
+	bool xNonBlocking;         // netconn_accept() returns ERR_WOULDBLOCK instead of waiting
+};
+
+struct netconn *netconn_new_with_callback(enum netconn_type t, netconn_callback callback);
+err_t netconn_delete(struct netconn *conn);
+err_t netconn_bind(struct netconn *conn, const ip_addr_t *addr, u16_t port);
+err_t netconn_connect(struct netconn *conn, const ip_addr_t *addr, u16_t port);
+err_t netconn_listen(struct netconn *conn);
+err_t netconn_accept(struct netconn *conn, struct netconn **new_conn);
+err_t netconn_close(struct netconn *conn);
+err_t netconn_recv_tcp_pbuf_flags(struct netconn *conn, struct pbuf **new_buf, u8_t apiflags);
+err_t netconn_recv_udp_raw_netbuf_flags(struct netconn *conn, struct netbuf **new_buf, u8_t apiflags);
+err_t netconn_write(struct netconn *conn, const void *dataptr, size_t size, u8_t apiflags);
+err_t netconn_send(struct netconn *conn, struct netbuf *buf);
+err_t netconn_sendto(struct netconn *conn, struct netbuf *buf, const ip_addr_t *addr, u16_t port);
+#define netconn_set_nonblocking(conn, val)  ((conn)->xNonBlocking = ((val) != 0))
+#endif
+
+/* Cortex-M intrinsics of the library */
+#define __DMB()  __sync_synchronize()
+static inline uint32_t __CLZ(uint32_t u32Val) { return (u32Val == 0) ? 32 : (uint32_t)__builtin_clz(u32Val); }
+static inline uint32_t __RBIT(uint32_t u32Val)
+{
+	uint32_t u32Rev = 0;
+	for (uint8_t i = 0; i < 32; i++, u32Val >>= 1) u32Rev = (u32Rev << 1) | (u32Val & 1);
+	return u32Rev;
+}
+static inline uint32_t __REV16(uint32_t u32Val) { return ((u32Val & 0xFF00FF00U) >> 8) | ((u32Val & 0x00FF00FFU) << 8); }
+static inline uint32_t __ROR(uint32_t u32Val, uint32_t u32Bits)
+{
+	u32Bits %= 32;
+	return (u32Bits == 0) ? u32Val : (u32Val >> u32Bits) | (u32Val << (32 - u32Bits));
+}
+
+#endif /* THIRD_PARTY_MODBUS_INC_MODBUSPORTPOSIX_H_ */
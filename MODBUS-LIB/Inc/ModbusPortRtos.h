@@ -0,0 +1,231 @@
+/*
+ * ModbusPortRtos.h
+ *
+ *  CMSIS-RTOS2 subset of the Modbus library over the native FreeRTOS API, enabled by ENABLE_MB_NATIVE_RTOS:
+ *  ModbusPort.h includes it in place of cmsis_os.h, the project then builds without cmsis_os2.c.
+ *
+ *  The library creates its tasks, semaphores, mutexes and queues with the osXxxNew() calls of CMSIS-RTOS2 and
+ *  uses the FreeRTOS API once they exist. Here each of those calls is an inline function over the FreeRTOS one,
+ *  without the interrupt context checks and the indirection of cmsis_os2.c: the attributes keep their CMSIS
+ *  fields, the static allocation of ENABLE_MB_STATIC included, and the same handles are FreeRTOS handles.
+ *  Only the calls, types and values the library uses are declared, from a task: none of them is ISR safe.
+ *
+ *  The CMSIS priorities are those of FreeRTOS with configMAX_PRIORITIES of 56, as in cmsis_os2.c. A smaller
+ *  configMAX_PRIORITIES gets them scaled, in the same order. With FreeRTOS-MPU the tasks are privileged.
+ */
+
+#ifndef THIRD_PARTY_MODBUS_INC_MODBUSPORTRTOS_H_
+#define THIRD_PARTY_MODBUS_INC_MODBUSPORTRTOS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef CMSIS_OS2_H_
+#error "ENABLE_MB_NATIVE_RTOS replaces cmsis_os2.h, the project must not include it"
+#endif
+
+#if INCLUDE_xTaskGetCurrentTaskHandle != 1 || INCLUDE_uxTaskGetStackHighWaterMark != 1 || INCLUDE_vTaskDelete != 1
+#error "ENABLE_MB_NATIVE_RTOS needs INCLUDE_xTaskGetCurrentTaskHandle, INCLUDE_uxTaskGetStackHighWaterMark and INCLUDE_vTaskDelete"
+#endif
+
+#define osWaitForever  portMAX_DELAY
+
+typedef enum
+{
+	osOK = 0,
+	osError = -1,
+	osErrorTimeout = -2,
+	osErrorResource = -3
+} osStatus_t;
+
+typedef enum
+{
+	osPriorityNone = 0,
+	osPriorityIdle = 1,
+	osPriorityLow = 8,
+	osPriorityBelowNormal = 16,
+	osPriorityNormal = 24,
+	osPriorityAboveNormal = 32,
+	osPriorityHigh = 40,
+	osPriorityRealtime = 48,
+	osPriorityISR = 56
+} osPriority_t;
+
+typedef TaskHandle_t osThreadId_t;
+typedef SemaphoreHandle_t osSemaphoreId_t;
+typedef SemaphoreHandle_t osMutexId_t;
+typedef QueueHandle_t osMessageQueueId_t;
+typedef void (*osThreadFunc_t)(void *argument);
+
+typedef struct
+{
+	const char *name;
+	uint32_t attr_bits;   //unused
+	void *cb_mem;         //StaticTask_t of a static task
+	uint32_t cb_size;
+	void *stack_mem;      //stack of a static task
+	uint32_t stack_size;  //bytes of the stack
+	osPriority_t priority;
+} osThreadAttr_t;
+
+typedef struct
+{
+	const char *name;
+	uint32_t attr_bits;   //unused
+	void *cb_mem;         //StaticSemaphore_t of a static semaphore
+	uint32_t cb_size;
+} osSemaphoreAttr_t;
+
+typedef osSemaphoreAttr_t osMutexAttr_t; //attr_bits unused, the mutex is not recursive
+
+typedef struct
+{
+	const char *name;
+	uint32_t attr_bits;   //unused
+	void *cb_mem;         //StaticQueue_t of a static queue
+	uint32_t cb_size;
+	void *mq_mem;         //storage of the messages of a static queue
+	uint32_t mq_size;
+} osMessageQueueAttr_t;
+
+/* FreeRTOS priority of a CMSIS one */
+static inline UBaseType_t mbRtosPriority(osPriority_t xPrio)
+{
+	UBaseType_t uxPrio;
+
+	if (xPrio == osPriorityNone) xPrio = osPriorityNormal;
+#if configMAX_PRIORITIES >= 56
+	uxPrio = (UBaseType_t)xPrio;
+#else
+	uxPrio = (UBaseType_t)(((uint32_t)xPrio * (configMAX_PRIORITIES - 1) + osPriorityISR / 2) / osPriorityISR);
+#endif
+#if portUSING_MPU_WRAPPERS == 1
+	uxPrio |= portPRIVILEGE_BIT; // FreeRTOS-MPU: the tasks of the library reach every handler and buffer
+#endif
+	return uxPrio;
+}
+
+static inline osThreadId_t osThreadNew(osThreadFunc_t func, void *argument, const osThreadAttr_t *attr)
+{
+	TaskHandle_t xTask = NULL;
+	uint32_t u32Words = attr->stack_size / sizeof(StackType_t);
+
+	if (u32Words == 0) u32Words = configMINIMAL_STACK_SIZE;
+#if configSUPPORT_STATIC_ALLOCATION == 1
+	if (attr->cb_mem != NULL && attr->stack_mem != NULL)
+	{
+		return xTaskCreateStatic(func, attr->name, u32Words, argument, mbRtosPriority(attr->priority),
+				(StackType_t *)attr->stack_mem, (StaticTask_t *)attr->cb_mem);
+	}
+#endif
+#if configSUPPORT_DYNAMIC_ALLOCATION == 1
+	if (xTaskCreate(func, attr->name, (configSTACK_DEPTH_TYPE)u32Words, argument, mbRtosPriority(attr->priority), &xTask) != pdPASS) return NULL;
+#endif
+	return xTask;
+}
+
+static inline osThreadId_t osThreadGetId(void)
+{
+	return xTaskGetCurrentTaskHandle();
+}
+
+static inline uint32_t osThreadGetStackSpace(osThreadId_t thread_id)
+{
+	return (uint32_t)uxTaskGetStackHighWaterMark(thread_id) * sizeof(StackType_t);
+}
+
+static inline osStatus_t osThreadTerminate(osThreadId_t thread_id)
+{
+	vTaskDelete(thread_id);
+	return osOK;
+}
+
+static inline osSemaphoreId_t osSemaphoreNew(uint32_t max_count, uint32_t initial_count, const osSemaphoreAttr_t *attr)
+{
+	SemaphoreHandle_t xSem = NULL;
+
+#if configSUPPORT_STATIC_ALLOCATION == 1
+	if (attr != NULL && attr->cb_mem != NULL)
+	{
+		xSem = (max_count == 1) ? xSemaphoreCreateBinaryStatic((StaticSemaphore_t *)attr->cb_mem) :
+				xSemaphoreCreateCountingStatic(max_count, initial_count, (StaticSemaphore_t *)attr->cb_mem);
+	}
+	else
+#endif
+	{
+#if configSUPPORT_DYNAMIC_ALLOCATION == 1
+		xSem = (max_count == 1) ? xSemaphoreCreateBinary() : xSemaphoreCreateCounting(max_count, initial_count);
+#endif
+	}
+	if (xSem != NULL && max_count == 1 && initial_count != 0) xSemaphoreGive(xSem); // a binary semaphore is created taken
+	(void)attr;
+	return xSem;
+}
+
+static inline osStatus_t osSemaphoreAcquire(osSemaphoreId_t semaphore_id, uint32_t timeout)
+{
+	if (xSemaphoreTake(semaphore_id, (TickType_t)timeout) == pdPASS) return osOK;
+	return (timeout == 0) ? osErrorResource : osErrorTimeout;
+}
+
+static inline osStatus_t osSemaphoreRelease(osSemaphoreId_t semaphore_id)
+{
+	return (xSemaphoreGive(semaphore_id) == pdPASS) ? osOK : osErrorResource;
+}
+
+static inline osStatus_t osSemaphoreDelete(osSemaphoreId_t semaphore_id)
+{
+	vSemaphoreDelete(semaphore_id);
+	return osOK;
+}
+
+static inline osMutexId_t osMutexNew(const osMutexAttr_t *attr)
+{
+#if configSUPPORT_STATIC_ALLOCATION == 1
+	if (attr != NULL && attr->cb_mem != NULL) return xSemaphoreCreateMutexStatic((StaticSemaphore_t *)attr->cb_mem);
+#endif
+	(void)attr;
+#if configSUPPORT_DYNAMIC_ALLOCATION == 1
+	return xSemaphoreCreateMutex();
+#else
+	return NULL;
+#endif
+}
+
+static inline osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr)
+{
+#if configSUPPORT_STATIC_ALLOCATION == 1
+	if (attr != NULL && attr->cb_mem != NULL && attr->mq_mem != NULL)
+	{
+		return xQueueCreateStatic(msg_count, msg_size, (uint8_t *)attr->mq_mem, (StaticQueue_t *)attr->cb_mem);
+	}
+#endif
+	(void)attr;
+#if configSUPPORT_DYNAMIC_ALLOCATION == 1
+	return xQueueCreate(msg_count, msg_size);
+#else
+	return NULL;
+#endif
+}
+
+static inline osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout)
+{
+	(void)msg_prio;
+	if (xQueueSendToBack(mq_id, msg_ptr, (TickType_t)timeout) == pdPASS) return osOK;
+	return (timeout == 0) ? osErrorResource : osErrorTimeout;
+}
+
+static inline osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout)
+{
+	if (msg_prio != NULL) *msg_prio = 0;
+	if (xQueueReceive(mq_id, msg_ptr, (TickType_t)timeout) == pdPASS) return osOK;
+	return (timeout == 0) ? osErrorResource : osErrorTimeout;
+}
+
+static inline osStatus_t osDelay(uint32_t ticks)
+{
+	if (ticks != 0) vTaskDelay((TickType_t)ticks);
+	return osOK;
+}
+
+#endif /* THIRD_PARTY_MODBUS_INC_MODBUSPORTRTOS_H_ */
@@ -0,0 +1,362 @@
+/*
+ * ModbusRegisterMap.hpp
+ *
+ *  C++17 front end for the register map of a slave, header only.
+ *
+ *  The map is declared as typed fields at their Modbus addresses:
+ *
+ *    modbus::RegisterMap<
+ *        modbus::U16<0>,                    // status word
+ *        modbus::Bits<1, 0, 4>,             // bits 0..3 of register 1
+ *        modbus::Bits<1, 4>,                // bit 4 of register 1
+ *        modbus::F32<10>,                   // float in registers 10 and 11
+ *        modbus::U32<100, MB_WORD_LH>       // word swapped counter in registers 100 and 101
+ *    > xMap;
+ *    xMap.attach(&ModbusH);                 // before ModbusStart()
+ *    xMap.set<modbus::F32<10>>(21.5f);
+ *
+ *  The segment table of the map, one modbusSegment_t per run of contiguous registers, is
+ *  computed at compile time and served by process_FC3()/process_FC16() through xSegHR (or
+ *  xSegRO), which check the requests against it. Fields sharing register bits fail the
+ *  build, and so does get() or set() of a field missing from the map. covers() tells at
+ *  compile time whether a request range is served, a request must fit in one segment.
+ *  The 32 and 64 bit fields are converted with their word order, under the lock of the table
+ *  as ModbusGetU32() does.
+ */
+
+#ifndef THIRD_PARTY_MODBUS_INC_MODBUSREGISTERMAP_HPP_
+#define THIRD_PARTY_MODBUS_INC_MODBUSREGISTERMAP_HPP_
+
+#include "Modbus.h"
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+#if __cplusplus < 201703L
+#error "ModbusRegisterMap.hpp needs C++17"
+#endif
+
+namespace modbus
+{
+
+/**
+ * Field of the registers Addr to Addr + words - 1 holding a T,
+ * a 32 or 64 bit value is stored in the word and byte order Order
+ */
+template <uint16_t Addr, typename T, mb_wordorder_t Order = MB_WORD_HL>
+struct Reg
+{
+	static_assert(std::is_same_v<T, uint16_t> || std::is_same_v<T, int16_t> || std::is_same_v<T, uint32_t> ||
+			std::is_same_v<T, int32_t> || std::is_same_v<T, float> || std::is_same_v<T, uint64_t> ||
+			std::is_same_v<T, int64_t> || std::is_same_v<T, double>, "a field holds a 16, 32 or 64 bit integer, float or double");
+	static_assert(Addr + sizeof(T) / 2 <= 0x10000UL, "the field ends beyond address 0xFFFF");
+
+	using value_type = T;
+	static constexpr uint16_t address = Addr;
+	static constexpr uint16_t words = sizeof(T) / 2;
+	static constexpr uint16_t mask = 0xFFFF;
+	static constexpr uint8_t shift = 0;
+	static constexpr mb_wordorder_t order = Order;
+};
+
+template <uint16_t Addr> using U16 = Reg<Addr, uint16_t>;
+template <uint16_t Addr> using I16 = Reg<Addr, int16_t>;
+template <uint16_t Addr, mb_wordorder_t Order = MB_WORD_HL> using U32 = Reg<Addr, uint32_t, Order>;
+template <uint16_t Addr, mb_wordorder_t Order = MB_WORD_HL> using I32 = Reg<Addr, int32_t, Order>;
+template <uint16_t Addr, mb_wordorder_t Order = MB_WORD_HL> using F32 = Reg<Addr, float, Order>;
+template <uint16_t Addr, mb_wordorder_t Order = MB_WORD_HL> using U64 = Reg<Addr, uint64_t, Order>;
+template <uint16_t Addr, mb_wordorder_t Order = MB_WORD_HL> using I64 = Reg<Addr, int64_t, Order>;
+template <uint16_t Addr, mb_wordorder_t Order = MB_WORD_HL> using F64 = Reg<Addr, double, Order>;
+
+/**
+ * Bits Bit to Bit + Width - 1 of the register Addr, other Bits fields may use the others
+ */
+template <uint16_t Addr, uint8_t Bit, uint8_t Width = 1>
+struct Bits
+{
+	static_assert(Width >= 1 && Bit + Width <= 16, "the bits must fit in one register");
+
+	using value_type = uint16_t;
+	static constexpr uint16_t address = Addr;
+	static constexpr uint16_t words = 1;
+	static constexpr uint16_t mask = (uint16_t)(((1UL << Width) - 1) << Bit);
+	static constexpr uint8_t shift = Bit;
+	static constexpr mb_wordorder_t order = MB_WORD_HL;
+};
+
+template <typename... Fields>
+class RegisterMap
+{
+	// registers u32Start to u32End - 1 of a field, and its bits
+	struct Span
+	{
+		uint32_t u32Start;
+		uint32_t u32End;
+		uint16_t u16Mask;
+	};
+
+	// segment of the map and its place in u16regs
+	struct Block
+	{
+		uint16_t u16Start;
+		uint16_t u16Length;
+		uint16_t u16Offset;
+	};
+
+	static constexpr size_t N = sizeof...(Fields);
+	static_assert(N > 0, "a register map needs at least one field");
+
+	static constexpr std::array<Span, N> sortFields()
+	{
+		std::array<Span, N> xSpans = {{ { Fields::address, (uint32_t)Fields::address + Fields::words, Fields::mask }... }};
+
+		for (size_t i = 1; i < N; i++)
+		{
+			Span xSpan = xSpans[i];
+			size_t j = i;
+			for (; j > 0 && xSpans[j - 1].u32Start > xSpan.u32Start; j--) xSpans[j] = xSpans[j - 1];
+			xSpans[j] = xSpan;
+		}
+		return xSpans;
+	}
+
+	static constexpr std::array<Span, N> xFields = sortFields();
+
+	// only Bits fields share a register, with different bits
+	static constexpr bool isDisjoint()
+	{
+		for (size_t i = 0; i < N; i++)
+		{
+			for (size_t j = i + 1; j < N && xFields[j].u32Start < xFields[i].u32End; j++)
+			{
+				if ((xFields[i].u16Mask & xFields[j].u16Mask) != 0) return false;
+			}
+		}
+		return true;
+	}
+
+	static_assert(isDisjoint(), "two fields of the register map share register bits");
+
+	static constexpr size_t countBlocks()
+	{
+		size_t xCount = 1;
+		uint32_t u32End = xFields[0].u32End;
+
+		for (size_t i = 1; i < N; i++)
+		{
+			if (xFields[i].u32Start > u32End) xCount++;
+			if (xFields[i].u32End > u32End) u32End = xFields[i].u32End;
+		}
+		return xCount;
+	}
+
+	static constexpr size_t S = countBlocks();
+	static_assert(S <= 255, "a register map has 255 segments at most, u8SegHR_count");
+
+	static constexpr std::array<Block, S> makeBlocks()
+	{
+		std::array<Block, S> xBlocks = {};
+		size_t k = 0;
+		uint32_t u32End = xFields[0].u32End;
+
+		xBlocks[0].u16Start = (uint16_t)xFields[0].u32Start;
+		for (size_t i = 1; i < N; i++)
+		{
+			if (xFields[i].u32Start > u32End)
+			{
+				xBlocks[k].u16Length = (uint16_t)(u32End - xBlocks[k].u16Start);
+				xBlocks[k + 1].u16Offset = xBlocks[k].u16Offset + xBlocks[k].u16Length;
+				xBlocks[++k].u16Start = (uint16_t)xFields[i].u32Start;
+			}
+			if (xFields[i].u32End > u32End) u32End = xFields[i].u32End;
+		}
+		xBlocks[k].u16Length = (uint16_t)(u32End - xBlocks[k].u16Start);
+		return xBlocks;
+	}
+
+	static constexpr std::array<Block, S> xBlocks = makeBlocks();
+
+	static constexpr uint16_t indexOf(uint16_t u16Add)
+	{
+		for (size_t i = 0; i < S; i++)
+		{
+			if (u16Add >= xBlocks[i].u16Start && u16Add - xBlocks[i].u16Start < xBlocks[i].u16Length)
+			{
+				return xBlocks[i].u16Offset + (u16Add - xBlocks[i].u16Start);
+			}
+		}
+		return 0xFFFF;
+	}
+
+	template <typename F>
+	static constexpr bool hasField = (std::is_same_v<F, Fields> || ...);
+
+public:
+	static constexpr uint8_t segmentCount = (uint8_t)S;
+	static constexpr uint16_t registerCount = xBlocks[S - 1].u16Offset + xBlocks[S - 1].u16Length;
+
+	/**
+	 * @brief
+	 * Tells whether the registers u16Add to u16Add + u16Count - 1 are served, they
+	 * must lie in one segment as for a request
+	 */
+	static constexpr bool covers(uint16_t u16Add, uint16_t u16Count)
+	{
+		for (size_t i = 0; i < S; i++)
+		{
+			if (u16Add >= xBlocks[i].u16Start && (uint32_t)u16Add + u16Count <= (uint32_t)xBlocks[i].u16Start + xBlocks[i].u16Length)
+			{
+				return u16Count > 0;
+			}
+		}
+		return false;
+	}
+
+	RegisterMap() : u16regs{}, xSegments{}, modH(nullptr), u8table(DB_HOLDING_REGISTER)
+	{
+		for (size_t i = 0; i < S; i++)
+		{
+			modbusSegment_t &xSeg = xSegments[i];
+
+			// the optional fields of the configuration stay empty
+			xSeg = modbusSegment_t{};
+			xSeg.u16Start = xBlocks[i].u16Start;
+			xSeg.u16Length = xBlocks[i].u16Length;
+			xSeg.u16regs = &u16regs[ xBlocks[i].u16Offset ];
+		}
+	}
+
+	// the segments point into the map
+	RegisterMap(const RegisterMap &) = delete;
+	RegisterMap &operator=(const RegisterMap &) = delete;
+
+	/**
+	 * @brief
+	 * Serves the map as the DB_HOLDING_REGISTER or DB_INPUT_REGISTERS table of a slave,
+	 * call it before ModbusStart(). get() and set() then take the lock of the table
+	 */
+	void attach(modbusHandler_t *modH, uint8_t u8table = DB_HOLDING_REGISTER)
+	{
+		this->modH = modH;
+		this->u8table = u8table;
+		if (u8table == DB_INPUT_REGISTERS)
+		{
+			modH->xSegRO = xSegments.data();
+			modH->u8SegRO_count = segmentCount;
+		}
+		else
+		{
+			modH->xSegHR = xSegments.data();
+			modH->u8SegHR_count = segmentCount;
+		}
+	}
+
+	/**
+	 * @brief
+	 * Sets the on-read and on-write callbacks of every segment, see modbusSegment_t
+	 */
+	void setCallbacks(mb_segment_cb_t xOnRead, mb_segment_cb_t xOnWrite, void *pvContext)
+	{
+		for (modbusSegment_t &xSeg : xSegments)
+		{
+			xSeg.xOnRead = xOnRead;
+			xSeg.xOnWrite = xOnWrite;
+			xSeg.pvContext = pvContext;
+		}
+	}
+
+	const modbusSegment_t *segments() const { return xSegments.data(); }
+
+	template <typename F>
+	typename F::value_type get() const
+	{
+		static_assert(hasField<F>, "the field is not in this register map");
+		constexpr uint16_t i = indexOf(F::address);
+		using T = typename F::value_type;
+
+		if constexpr (F::words == 4)
+		{
+			uint64_t u64Val;
+			T xVal;
+
+			lock();
+			u64Val = ModbusRegsToU64(&u16regs[i], F::order);
+			unlock();
+			std::memcpy(&xVal, &u64Val, sizeof(xVal));
+			return xVal;
+		}
+		else if constexpr (F::words == 2)
+		{
+			uint32_t u32Val;
+			T xVal;
+
+			lock();
+			u32Val = ModbusRegsToU32(&u16regs[i], F::order);
+			unlock();
+			std::memcpy(&xVal, &u32Val, sizeof(xVal));
+			return xVal;
+		}
+		else
+		{
+			return (T)((u16regs[i] & F::mask) >> F::shift);
+		}
+	}
+
+	template <typename F>
+	void set(typename F::value_type xVal)
+	{
+		static_assert(hasField<F>, "the field is not in this register map");
+		constexpr uint16_t i = indexOf(F::address);
+
+		if constexpr (F::words == 4)
+		{
+			uint64_t u64Val;
+
+			std::memcpy(&u64Val, &xVal, sizeof(u64Val));
+			lock();
+			ModbusU64ToRegs(&u16regs[i], u64Val, F::order);
+			unlock();
+		}
+		else if constexpr (F::words == 2)
+		{
+			uint32_t u32Val;
+
+			std::memcpy(&u32Val, &xVal, sizeof(u32Val));
+			lock();
+			ModbusU32ToRegs(&u16regs[i], u32Val, F::order);
+			unlock();
+		}
+		else if constexpr (F::mask != 0xFFFF)
+		{
+			// read-modify-write of the register shared with other Bits fields
+			lock();
+			u16regs[i] = (uint16_t)((u16regs[i] & ~F::mask) | ((xVal << F::shift) & F::mask));
+			unlock();
+		}
+		else
+		{
+			u16regs[i] = (uint16_t)xVal;
+		}
+	}
+
+private:
+	void lock() const
+	{
+		if (modH != nullptr) ModbusLock(modH, u8table);
+	}
+
+	void unlock() const
+	{
+		if (modH != nullptr) ModbusUnlock(modH, u8table);
+	}
+
+	uint16_t u16regs[registerCount];
+	std::array<modbusSegment_t, S> xSegments;
+	modbusHandler_t *modH;
+	uint8_t u8table;
+};
+
+}
+
+#endif /* THIRD_PARTY_MODBUS_INC_MODBUSREGISTERMAP_HPP_ */
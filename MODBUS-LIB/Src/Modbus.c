@@ -6,14 +6,9 @@
  *      Adapted from https://github.com/smarmengol/Modbus-Master-Slave-for-Arduino
  */
 
-#include "FreeRTOS.h"
-#include "cmsis_os.h"
-#include "task.h"
-#include "queue.h"
-#include "main.h"
-#include "Modbus.h"
-#include "timers.h"
-#include "semphr.h"
+#include "Modbus.h" // HAL and FreeRTOS through ModbusPort.h
+#include <string.h>
+#include <stddef.h>
 
 
 
@@ -25,30 +20,187 @@
 #define lowByte(w) ((w) & 0xff)
 #define highByte(w) ((w) >> 8)
 
+/* shortest request served by a slave, counted with the CRC: the FC24 one (ID, function, FIFO pointer address) */
+#define MB_MIN_REQUEST  6
+
+/* slave code shared by several function codes, see MB_ENABLE_FCx */
+#define MB_SLAVE_FC(fc)  (MB_ENABLE_SLAVE == 1 && (fc) == 1)
+#define MB_SLAVE_COIL_RANGE  (MB_SLAVE_FC(MB_ENABLE_FC1) || MB_SLAVE_FC(MB_ENABLE_FC2) || MB_SLAVE_FC(MB_ENABLE_FC15))
+#define MB_SLAVE_REG_RANGE   (MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4) || MB_SLAVE_FC(MB_ENABLE_FC16))
+#define MB_SLAVE_SEG_READ    (MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4) || \
+		MB_SLAVE_FC(MB_ENABLE_FC22) || MB_SLAVE_FC(MB_ENABLE_FC23) || \
+		MB_SLAVE_FC(MB_ENABLE_FC_RANGES) || MB_SLAVE_FC(MB_ENABLE_FC_DELTA))
+#define MB_SLAVE_SEG_WRITE   (MB_SLAVE_FC(MB_ENABLE_FC6) || MB_SLAVE_FC(MB_ENABLE_FC16) || \
+		MB_SLAVE_FC(MB_ENABLE_FC22) || MB_SLAVE_FC(MB_ENABLE_FC23))
+#define MB_SLAVE_REGISTERS   (MB_SLAVE_SEG_READ || MB_SLAVE_SEG_WRITE)
+#define MB_SLAVE_ACCESS      (ENABLE_MB_ACCESS == 1 && MB_SLAVE_SEG_WRITE)
+#define MB_SLAVE_LIMITS      (ENABLE_MB_LIMITS == 1 && MB_SLAVE_SEG_WRITE)
+#define MB_PUT_REGISTERS     (MB_ENABLE_MASTER == 1 || MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4) || \
+		MB_SLAVE_FC(MB_ENABLE_FC20) || MB_SLAVE_FC(MB_ENABLE_FC23) || MB_SLAVE_FC(MB_ENABLE_FC_RANGES) || \
+		MB_SLAVE_FC(MB_ENABLE_FC_DELTA))
+#define MB_GET_REGISTERS     (MB_ENABLE_MASTER == 1 || MB_SLAVE_FC(MB_ENABLE_FC16) || MB_SLAVE_FC(MB_ENABLE_FC21) || \
+		MB_SLAVE_FC(MB_ENABLE_FC23))
+// master cache ranges refreshed with MB_FC_READ_DELTA
+#define MB_MASTER_DELTA      (MB_ENABLE_MASTER == 1 && MB_ENABLE_FC_DELTA == 1 && ENABLE_MB_CACHE == 1)
+#define MB_WRITE_COILS       (MB_ENABLE_MASTER == 1 || MB_SLAVE_FC(MB_ENABLE_FC15))
+#define MB_READ_COILS        (MB_ENABLE_MASTER == 1 || MB_SLAVE_FC(MB_ENABLE_FC1) || MB_SLAVE_FC(MB_ENABLE_FC2) || ENABLE_MB_GATEWAY == 1)
+#define MB_SLAVE_WRITES      (MB_SLAVE_FC(MB_ENABLE_FC5) || MB_SLAVE_FC(MB_ENABLE_FC6) || MB_SLAVE_FC(MB_ENABLE_FC15) || \
+		MB_SLAVE_FC(MB_ENABLE_FC16) || MB_SLAVE_FC(MB_ENABLE_FC22) || MB_SLAVE_FC(MB_ENABLE_FC23))
+
+#if ENABLE_MB_EVENT_LOG == 1
+#define MB_LOG_EVENT(modH, u8Type, u8Frame, u16Length, i8Error, u8Flags)  logEvent(modH, u8Type, u8Frame, u16Length, i8Error, u8Flags)
+#else
+#define MB_LOG_EVENT(modH, u8Type, u8Frame, u16Length, i8Error, u8Flags)  ((void)0)
+#endif
+
+#if ENABLE_MB_ERR_STATS == 1
+#define MB_COUNT_ERR(modH, e)  ((modH)->xErrStats.u32Err[MB_ERR_INDEX(e)]++)
+#define MB_COUNT_EXC(modH, c)  do { if ((c) >= 1 && (c) <= MB_EXC_TYPES) (modH)->xErrStats.u32Exc[(c) - 1]++; } while (0)
+#define MB_COUNT_SLAVE_MSG(modH)    ((modH)->xErrStats.u32SlaveMsg++)
+#define MB_COUNT_NO_RESPONSE(modH)  ((modH)->xErrStats.u32NoResponse++)
+#else
+#define MB_COUNT_ERR(modH, e)  ((void)0)
+#define MB_COUNT_EXC(modH, c)  ((void)0)
+#define MB_COUNT_SLAVE_MSG(modH)    ((void)0)
+#define MB_COUNT_NO_RESPONSE(modH)  ((void)0)
+#endif
+
+// period of a poll, stretched by the bus load with ENABLE_MB_POLL_ADAPT
+#if ENABLE_MB_POLL_ADAPT == 1
+#define MB_POLL_PERIOD(xPoll)  pdMS_TO_TICKS((xPoll)->u32EffPeriodMs)
+#else
+#define MB_POLL_PERIOD(xPoll)  pdMS_TO_TICKS((xPoll)->u32PeriodMs)
+#endif
+
+// TLS sessions of a slave connection and of a master, NULL for plain Modbus TCP
+#if ENABLE_MB_TLS == 1
+#define MB_CONN_TLS(xConn)    ((xConn)->pvTls)
+#define MB_CLIENT_TLS(modH)   ((modH)->pvTlsClient)
+#else
+#define MB_CONN_TLS(xConn)    NULL
+#define MB_CLIENT_TLS(modH)   NULL
+#endif
+
+
+#if ENABLE_USART_RTO == 1 && !defined(USART_CR2_RTOEN)
+#error "ENABLE_USART_RTO requires a USART with receiver timeout, disable it in ModbusConfig.h"
+#endif
+
+#if MAX_BUFFER > 256
+#error "MAX_BUFFER is limited to 256 bytes, the largest Modbus RTU frame"
+#endif
+
+#if (MAX_BUFFER_RX & (MAX_BUFFER_RX - 1)) != 0
+#error "MAX_BUFFER_RX must be a power of two, it is MAX_BUFFER when not defined in ModbusConfig.h"
+#endif
+
+#if MAX_BUFFER_RX < MAX_BUFFER
+#error "MAX_BUFFER_RX must hold a frame of MAX_BUFFER bytes, the USART_HW_DMA reception is MAX_BUFFER long"
+#endif
+
+#if MAX_M_HANDLERS >= MB_PORT_SLOTS
+#error "MAX_M_HANDLERS must be lower than MB_PORT_SLOTS"
+#endif
+
+#if ENABLE_USART_DE == 1 && !defined(USART_CR3_DEM)
+#error "ENABLE_USART_DE requires a USART with driver enable, disable it in ModbusConfig.h"
+#endif
+
+#if ENABLE_USART_FIFO == 1 && (ENABLE_USART_RTO != 1 || !defined(USART_CR1_FIFOEN))
+#error "ENABLE_USART_FIFO requires a USART with RX FIFO and ENABLE_USART_RTO, check ModbusConfig.h"
+#endif
+
+#if ENABLE_TIM_T35 == 1 && !defined(HAL_TIM_MODULE_ENABLED)
+#error "ENABLE_TIM_T35 requires the HAL TIM module, enable it in Cube-MX or disable it in ModbusConfig.h"
+#endif
+
+#if ENABLE_MB_TIMER_MUX == 1 && !defined(HAL_TIM_MODULE_ENABLED)
+#error "ENABLE_MB_TIMER_MUX requires the HAL TIM module, enable it in Cube-MX or disable it in ModbusConfig.h"
+#endif
+
+#if CRC_MODE == CRC_HARDWARE && !defined(CRC_CR_POLYSIZE)
+/* This MCU has no CRC unit with programmable polynomial, use the software table */
+#undef CRC_MODE
+#define CRC_MODE CRC_TABLE
+#endif
 
-modbusHandler_t *mHandlers[MAX_M_HANDLERS];
 
+modbusHandler_t *mHandlers[MAX_M_HANDLERS]; // NULL for a slot freed by ModbusDeInit(), the slots keep their index
+// same handlers indexed by UART, see getModbusHandler(): publishPorts() rebuilds the copy not in use and swaps the pointer
+static modbusHandler_t *mHandlersByPortCopy[2][MB_PORT_SLOTS];
+modbusHandler_t **volatile mHandlersByPort = mHandlersByPortCopy[0];
 
-///Queue Modbus telegrams for master
-const osMessageQueueAttr_t QueueTelegram_attributes = {
+#if ENABLE_MB_TIMER_MUX == 1
+// deadlines of all the handlers on one timer, slot 2 * u8Handler + MB_TIMER_T35 or MB_TIMER_TIMEOUT
+static struct
+{
+	TIM_HandleTypeDef *htim; // set by ModbusSetTimer()
+	uint32_t u32Due[MB_TIMER_SLOTS]; // counter value of each deadline
+	volatile uint32_t u32Armed; // bit of each armed slot
+	uint32_t u32Next; // value of the compare while a slot is armed
+}xTimerMux;
+#endif
+
+#if ENABLE_MB_TIMESTAMP == 1
+// local clock of the time stamps, see getLocalUs()
+static struct
+{
+	uint64_t u64Us; // microseconds at the last read
+	uint32_t u32Cnt; // count of the ENABLE_MB_TIMER_MUX timer at the last read
+	TickType_t xTick; // tick count at the last read
+}xLocalClock;
+#endif
+
+
+#if MB_ENABLE_MASTER == 1
+///Queue Modbus telegrams for master, the semaphore counts the queued telegrams
+const osSemaphoreAttr_t QueueTelegram_attributes = {
        .name = "QueueModbusTelegram"
 };
+#endif
+
+
+#if ENABLE_MB_SHARED_TASK == 1
+//Task serving all the handlers
+const osThreadAttr_t myTaskModbus_attributes = {
+    .name = "TaskModbus",
+    .priority = (osPriority_t) osPriorityNormal,
+    .stack_size = MB_TASK_STACK
+};
 
+static osThreadId_t xModbusTaskHandle = NULL;
+#if ENABLE_MB_STATIC == 1
+static StaticTask_t xModbusTaskCb;
+static StackType_t xModbusTaskStack[MB_TASK_STACK / sizeof(StackType_t)];
+#endif
+#if ENABLE_MB_EVENT_RING == 1
+/* events posted by the interrupts, u8Handler in the high byte and MB_EV_ bits in the low one, 0 while the slot
+ * is reserved but not written. u32EvHead runs free and is masked with MB_EVENT_RING - 1 */
+static volatile uint16_t u16EvRing[MB_EVENT_RING];
+static volatile uint32_t u32EvHead = 0;
+static volatile uint32_t u32EvTail = 0;
+static volatile uint32_t u32EvWake = 0; //the task was notified since it last emptied the ring
+#endif
+#endif
 
+#if MB_ENABLE_SLAVE == 1
 const osThreadAttr_t myTaskModbusA_attributes = {
     .name = "TaskModbusSlave",
     .priority = (osPriority_t) osPriorityNormal,
-    .stack_size = 128 * 4
+    .stack_size = MB_TASK_STACK
 };
+#endif
 
 
+#if MB_ENABLE_MASTER == 1
 //Task Modbus Master
 //osThreadId_t myTaskModbusAHandle;
 const osThreadAttr_t myTaskModbusB_attributes = {
     .name = "TaskModbusMaster",
     .priority = (osPriority_t) osPriorityNormal,
-    .stack_size = 128 * 4
+    .stack_size = MB_TASK_STACK
 };
+#endif
 
 
 //Semaphore to access the Modbus Data
@@ -56,85 +208,657 @@ const osSemaphoreAttr_t ModBusSphr_attributes = {
     .name = "ModBusSphr"
 };
 
+#if MB_ENABLE_SLAVE == 1
+
+//Semaphore to access the Modbus input registers
+const osSemaphoreAttr_t ModBusSphrRO_attributes = {
+    .name = "ModBusSphrRO"
+};
+
+//Semaphore to access the Modbus coils
+const osSemaphoreAttr_t ModBusSphrCoils_attributes = {
+    .name = "ModBusSphrCoils"
+};
+
+//Semaphore to access the Modbus discrete inputs
+const osSemaphoreAttr_t ModBusSphrCoilsRO_attributes = {
+    .name = "ModBusSphrCoilsRO"
+};
+#endif
+
+#if ENABLE_MB_SHARED_HR == 1
+//Semaphore of the writers of a holding register bank shared by slaves
+const osSemaphoreAttr_t ModBusSphrBank_attributes = {
+    .name = "ModBusSphrBank"
+};
+#endif
+
+#if CRC_MODE == CRC_HARDWARE
+//Mutex to share the CRC peripheral among all the Modbus handlers
+#if ENABLE_MB_STATIC == 1
+static StaticSemaphore_t xModbusCRCCb;
+#endif
+const osMutexAttr_t ModbusCRC_attributes = {
+    .name = "ModbusCRC",
+#if ENABLE_MB_STATIC == 1
+    .cb_mem = &xModbusCRCCb,
+    .cb_size = sizeof(xModbusCRCCb)
+#endif
+};
+
+static osMutexId_t ModbusCRCHandle = NULL;
+#endif
+
 
 uint8_t numberHandlers = 0;
 
+#if ENABLE_MB_EVENT_LOG == 1
+/* bus events of all the handlers, u32EventHead runs free and is masked with MB_EVENT_DEPTH - 1 */
+static modbusEvent_t xEventLog[MB_EVENT_DEPTH];
+static volatile uint32_t u32EventHead = 0;
+#endif
+
 
+static const modbusTransport_t *getTransport(mb_hardware_t xTypeHW);
+#if ENABLE_MB_CONST_CONFIG == 1
+static void loadConfig(modbusHandler_t *modH);
+#endif
+static void publishPorts(void);
 static void sendTxBuffer(modbusHandler_t *modH);
-static int16_t getRxBuffer(modbusHandler_t *modH);
-static uint8_t validateAnswer(modbusHandler_t *modH);
+#if ENABLE_MB_SHARED_TASK != 1 || ENABLE_MB_TX_BUFFER == 1
+static void waitTxDone(modbusHandler_t *modH);
+#endif
+static void quiesceLine(modbusHandler_t *modH);
+#if ENABLE_MB_WATCHDOG == 1
+static void recoverLine(modbusHandler_t *modH);
+#endif
+static void waitRequest(modbusHandler_t *modH);
+static bool checkCRC(modbusHandler_t *modH);
+static void startUart(modbusHandler_t *modH);
+static void stopT35(modbusHandler_t *modH);
+static uint32_t getWordLength(UART_HandleTypeDef *port, uint32_t u32Parity);
+static void startUartIT(modbusHandler_t *modH);
+#if ENABLE_MB_RX_MUTE == 1
+static void enableRxMute(modbusHandler_t *modH);
+#endif
+static int16_t getRxRing(modbusHandler_t *modH);
+#if ENABLE_RX_RESYNC == 1
+static int16_t resyncRxRing(modbusHandler_t *modH, uint16_t u16count);
+#endif
+static void sendUart(modbusHandler_t *modH, bool xDMA);
+static void startUartTx(modbusHandler_t *modH, const uint8_t *u8tx, uint16_t u16Size, bool xDMA);
+#if ENABLE_MB_TURNAROUND == 1
+static bool waitTurnaround(modbusHandler_t *modH, const uint8_t *u8tx, bool xDMA);
+#endif
+#if ENABLE_MB_PACING == 1
+static uint32_t getPaceUs(modbusHandler_t *modH, uint8_t u8id);
+static void startPaced(modbusHandler_t *modH, const uint8_t *u8tx, bool xDMA);
+#endif
+static void sendUartIT(modbusHandler_t *modH);
+#if ENABLE_MB_ASCII == 1
+static void startAscii(modbusHandler_t *modH);
+static int16_t getRxAscii(modbusHandler_t *modH);
+static uint8_t calcLRC(const uint8_t *u8Buffer, uint16_t u16length);
+static uint16_t encodeAscii(uint8_t *u8Text, const uint8_t *u8Frame, uint16_t u16length);
+#endif
+#if ENABLE_LPUART == 1
+static void startLpuart(modbusHandler_t *modH);
+#endif
+#if ENABLE_MB_TICKLESS == 1
+static bool needsTicks(modbusHandler_t *modH);
+static void notePoll(modbusHandler_t *modH);
+#endif
+#if ENABLE_USART_DMA == 1
+static void startUartDMA(modbusHandler_t *modH);
+static void startUartCirc(modbusHandler_t *modH);
+static int16_t getRxDMA(modbusHandler_t *modH);
+static int16_t getRxFrame(modbusHandler_t *modH);
+static bool keptRxFrame(modbusHandler_t *modH, const modbusFrame_t *xFrame);
+static void sendUartDMA(modbusHandler_t *modH);
+static void waitRequestDMA(modbusHandler_t *modH);
+static void waitRequestCirc(modbusHandler_t *modH);
+static bool recoverRxDMA(modbusHandler_t *modH);
+static void abortRxCirc(modbusHandler_t *modH);
+#if ENABLE_MB_SHARED_TASK == 1
+static void releaseRxCirc(modbusHandler_t *modH);
+#endif
+#if ENABLE_USART_DMA_LL == 1
+static void setupTxDMA(modbusHandler_t *modH);
+static void txDoneDMA(DMA_HandleTypeDef *hdma);
+static void transmitDMA(modbusHandler_t *modH, const uint8_t *u8tx, uint16_t u16Size);
+#endif
+#endif
+#if ENABLE_USART_DMA_INPLACE == 1
+static void restartRxDMA(modbusHandler_t *modH);
+static void abortRxDMA(modbusHandler_t *modH);
+#endif
+#if ENABLE_MB_RX_QUEUE == 1
+static void waitRequestQueue(modbusHandler_t *modH);
+static void abortRxQueue(modbusHandler_t *modH);
+static void releaseRxQueue(modbusHandler_t *modH);
+#endif
+#if ENABLE_USB_CDC == 1
+static void startUsb(modbusHandler_t *modH);
+static void startUsbRx(modbusHandler_t *modH);
+static int16_t getRxUsb(modbusHandler_t *modH);
+static void sendUsb(modbusHandler_t *modH);
+static void sendUsbFrame(modbusHandler_t *modH);
+#endif
+#if ENABLE_MB_BLE == 1
+static void startBle(modbusHandler_t *modH);
+static void startBleRx(modbusHandler_t *modH);
+static int16_t getRxBle(modbusHandler_t *modH);
+static void sendBle(modbusHandler_t *modH);
+#endif
+#if ENABLE_TCP == 1
+static void startTcp(modbusHandler_t *modH);
+static void stepTcp(modbusHandler_t *modH);
+#endif
+#if ENABLE_UDP == 1
+static void startUdp(modbusHandler_t *modH);
+static void stepUdp(modbusHandler_t *modH);
+#endif
+static uint16_t word(uint8_t H, uint8_t l);
+#if MB_WRITE_COILS
+static void writeCoils(uint16_t *u16regs, uint16_t u16StartCoil, uint16_t u16Coilno, const uint8_t *u8bits);
+#endif
+#if MB_PUT_REGISTERS
+static void putRegisters(uint8_t *u8dst, const uint16_t *u16src, uint16_t u16regsno);
+#endif
+#if MB_GET_REGISTERS
+static void getRegisters(uint16_t *u16dst, const uint8_t *u8src, uint16_t u16regsno);
+#endif
+static void copyRegisters(void *pvDst, const void *pvSrc, uint16_t u16Regs, bool xSwap);
+#if MB_ENABLE_SLAVE == 1
 static void buildException( uint8_t u8exception, modbusHandler_t *modH );
+#if ENABLE_MB_EXC_CACHE == 1
+static uint16_t getExceptionCRC(modbusHandler_t *modH);
+#endif
 static uint8_t validateRequest(modbusHandler_t * modH);
-static uint16_t word(uint8_t H, uint8_t l);
-static void get_FC1(modbusHandler_t *modH);
-static void get_FC3(modbusHandler_t *modH);
-static int8_t process_FC1(modbusHandler_t *modH, uint8_t Database );
-static int8_t process_FC3(modbusHandler_t *modH, uint8_t Database );
-static int8_t process_FC5( modbusHandler_t *modH);
-static int8_t process_FC6(modbusHandler_t *modH);
-static int8_t process_FC15(modbusHandler_t *modH);
-static int8_t process_FC16(modbusHandler_t *modH);
+static bool checkSegments(const modbusSegment_t *xSeg, uint8_t u8count);
+static void saveUnit(modbusHandler_t *modH);
+static bool selectUnit(modbusHandler_t *modH, uint8_t u8id);
+static osSemaphoreId_t getDataLock(modbusHandler_t *modH);
+static void serveRequest(modbusHandler_t *modH);
+static void answerRequest(modbusHandler_t *modH, uint8_t u8id, bool xBroadcast);
+#if ENABLE_MB_TIMESTAMP == 1
+static uint64_t getLocalUs(void);
+static void takeTimeSync(modbusHandler_t *modH);
+#endif
+#if ENABLE_MB_THROTTLE == 1
+static void startThrottle(modbusHandler_t *modH);
+static bool takeThrottle(modbusHandler_t *modH);
+static void chargeThrottle(modbusHandler_t *modH, uint32_t u32Cycles);
+#endif
+#if ENABLE_MB_RESP_CACHE == 1
+static uint8_t getCachedTable(modbusHandler_t *modH);
+static bool sendCachedAnswer(modbusHandler_t *modH);
+static modbusRespCache_t *openCachedAnswer(modbusHandler_t *modH);
+static void touchTables(modbusHandler_t *modH, uint8_t u8fct);
+#endif
+#endif
+#if MB_ENABLE_IP == 1
+static void tcpEventCallback(struct netconn *conn, enum netconn_evt evt, u16_t len);
+static int8_t getTcpAdu(modbusHandler_t *modH, struct pbuf **pxRx, uint16_t u16MinSize);
+static void putMbap(uint8_t *u8Mbap, uint16_t u16TransactionID, uint16_t u16Length);
+static uint16_t getIpPort(const modbusHandler_t *modH);
+#endif
+#if ENABLE_TCP == 1
+static err_t recvTcp(modbusHandler_t *modH, struct netconn *conn, void *pvTls, struct pbuf **pp);
+static err_t writeTcp(modbusHandler_t *modH, struct netconn *conn, void *pvTls, const void *pvData, uint16_t u16Len, uint8_t u8Flags);
+#endif
+#if ENABLE_UDP == 1
+static int8_t getUdpAdu(modbusHandler_t *modH, struct netbuf *xRx, uint16_t u16MinSize);
+static err_t sendUdpAdu(modbusHandler_t *modH, struct netconn *conn, const ip_addr_t *xAddr, uint16_t u16Port,
+		uint16_t u16TransactionID);
+#endif
+#if MB_ENABLE_IP == 1 && MB_ENABLE_MASTER == 1
+static void startTcpClient(modbusHandler_t *modH);
+static bool connectTcpClient(modbusHandler_t *modH);
+static void serveTcpMaster(modbusHandler_t *modH);
+static void sendTcpQuery(modbusHandler_t *modH, modbusTcpQuery_t *xQuery, modbus_t *telegram);
+static void writeTcpQuery(modbusHandler_t *modH, modbusTcpQuery_t *xQuery);
+static void matchTcpAnswer(modbusHandler_t *modH, int8_t i8result);
+static modbusTcpQuery_t *findTcpQuery(modbusHandler_t *modH, bool xUsed, uint16_t u16TransactionID);
+static TickType_t getTcpQueryWait(modbusHandler_t *modH);
+static void expireTcpQueries(modbusHandler_t *modH);
+static void closeTcpClient(modbusHandler_t *modH, int8_t i8result);
+#endif
+#if ENABLE_TCP == 1 && MB_ENABLE_MASTER == 1
+static void receiveTcpAnswers(modbusHandler_t *modH);
+#endif
+#if ENABLE_UDP == 1 && MB_ENABLE_MASTER == 1
+static void receiveUdpAnswers(modbusHandler_t *modH);
+#endif
+#if ENABLE_UDP == 1 && MB_ENABLE_SLAVE == 1
+static void startUdpServer(modbusHandler_t *modH);
+static void serveUdp(modbusHandler_t *modH);
+static void sendUdpAnswer(modbusHandler_t *modH);
+#endif
+#if ENABLE_TCP == 1 && MB_ENABLE_SLAVE == 1
+static void startTcpServer(modbusHandler_t *modH);
+static void serveTcp(modbusHandler_t *modH);
+static void receiveTcp(modbusHandler_t *modH, modbusTcpConn_t *xConn);
+static void sendTcpAnswer(modbusHandler_t *modH);
+static void flushTcp(modbusHandler_t *modH, modbusTcpConn_t *xConn);
+static void touchTcp(modbusHandler_t *modH, uint8_t u8Conn);
+static void unlinkTcp(modbusHandler_t *modH, uint8_t u8Conn);
+static TickType_t getTcpWait(modbusHandler_t *modH);
+static void closeTcp(modbusHandler_t *modH, modbusTcpConn_t *xConn);
+#endif
+#if ENABLE_MB_GATEWAY == 1
+static bool forwardGateway(modbusHandler_t *modH, modbusTcpConn_t *xConn, uint8_t u8id);
+static uint8_t buildGatewayQuery(modbusHandler_t *modH, modbusGwQuery_t *xQuery);
+static void gatewayCallback(modbus_t *telegram, int8_t i8result, void *pvContext);
+static void answerGateway(modbusHandler_t *modH);
+static void buildGatewayAnswer(modbusHandler_t *modH, modbusGwQuery_t *xQuery);
+#endif
+#if ENABLE_MB_REDUNDANT == 1
+static bool queueRedundant(modbusRedundant_t *xPair, modbus_t *telegram);
+static bool isParallel(const modbusRedQuery_t *xQuery);
+static modbusPath_t *getPath(modbusRedundant_t *xPair, uint8_t u8id);
+static bool sendRedundant(modbusRedQuery_t *xQuery, uint8_t u8Bus);
+static void redundantPrimary(modbus_t *telegram, int8_t i8result, void *pvContext);
+static void redundantSecondary(modbus_t *telegram, int8_t i8result, void *pvContext);
+static void redundantResult(modbusRedQuery_t *xQuery, uint8_t u8Bus, int8_t i8result);
+static void reportRedundant(modbusRedQuery_t *xQuery, uint8_t u8Bus, int8_t i8result);
+#endif
+#if ENABLE_MB_DISCOVERY == 1
+static uint16_t getProbeTimeOut(modbusHandler_t *modH, mb_functioncode_t u8fct);
+static void discoverCallback(modbus_t *telegram, int8_t i8result, void *pvContext);
+#endif
+#if ENABLE_MB_STRESS == 1
+static uint32_t stressRandom(modbusStress_t *xStress);
+static void stressCallback(modbus_t *telegram, int8_t i8result, void *pvContext);
+static void stressResult(modbusStress_t *xStress);
+#endif
+#if ENABLE_MB_BATCH == 1
+static void sendBatch(modbusBatch_t *xBatch, uint8_t u8Entry);
+static void batchCallback(modbus_t *telegram, int8_t i8result, void *pvContext);
+static void completeBatch(modbusBatch_t *xBatch, modbusBatchEntry_t *xEntry, int8_t i8result);
+#endif
+#if MB_SLAVE_REGISTERS
+static const modbusSegment_t *findSegment(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count);
+static uint16_t *mapRegisters(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count);
+static bool isWireOrder(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4) || MB_SLAVE_FC(MB_ENABLE_FC23) || \
+	MB_SLAVE_FC(MB_ENABLE_FC_RANGES) || MB_SLAVE_FC(MB_ENABLE_FC_DELTA)
+static void putTable(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count, uint8_t *u8dst);
+#endif
+#if ENABLE_MB_TX_GATHER == 1 && (MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4))
+static bool gatherTable(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count);
+#endif
+#if ENABLE_MB_TX_GATHER == 1
+static uint16_t calcGatherCRC(modbusHandler_t *modH);
+#endif
+#if ENABLE_MB_TX_STREAM == 1 && (MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4))
+static bool canStream(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count);
+static bool streamTable(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count);
+#endif
+#if ENABLE_MB_TX_STREAM == 1
+static void fillTxChunk(modbusHandler_t *modH, uint8_t u8Chunk);
+static const uint8_t *nextTxChunk(modbusHandler_t *modH, uint16_t *pu16Size);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC16) || MB_SLAVE_FC(MB_ENABLE_FC23)
+static void getTable(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count, const uint8_t *u8src);
+#endif
+#if MB_SLAVE_SEG_READ
+static uint8_t readSegment(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count);
+#endif
+#if MB_SLAVE_SEG_WRITE
+static uint8_t writeSegment(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count);
+#endif
+#if MB_SLAVE_ACCESS
+static bool testBits(const uint32_t *u32map, uint16_t u16First, uint16_t u16Count);
+static uint8_t checkWriteAccess(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count);
+#endif
+#if MB_SLAVE_LIMITS
+static bool isAccepted(const modbusLimit_t *xLimit, uint16_t u16Value);
+static uint8_t checkLimits(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count, const uint8_t *u8Values);
+#endif
+#if ENABLE_MB_WRITE_NOTIFY == 1 && MB_SLAVE_WRITES
+static void markDirty(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Start, uint16_t u16Count);
+#endif
+#if ENABLE_MB_RETAIN == 1
+static uint16_t crcRetain(uint16_t u16crc, const void *pvData, uint32_t u32Bytes);
+static uint16_t crcRetainTables(modbusHandler_t *modH);
+static uint32_t getRetainLayout(modbusHandler_t *modH);
+static bool checkRetain(modbusHandler_t *modH);
+static void restoreRetain(modbusHandler_t *modH);
+static void sealRetain(modbusHandler_t *modH, bool xTables);
+#endif
+#if ENABLE_MB_RO_SNAPSHOT == 1
+static void putSnapshot(modbusHandler_t *modH, uint8_t *u8dst, uint16_t u16Add, uint16_t u16Count);
+#endif
+#if ENABLE_MB_HR_COMMIT == 1
+static void stageHR(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count);
+#endif
+#if ENABLE_MB_SHARED_HR == 1
+static bool isSharedHR(const modbusHandler_t *modH);
+static osSemaphoreId_t lockSharedHR(modbusHandler_t *modH, osSemaphoreId_t xLock);
+static void putCommittedHR(const modbusHandler_t *modH, uint8_t *u8dst, uint16_t u16Add, uint16_t u16Count);
+#endif
+#if MB_READ_COILS
+static void readCoils(const uint16_t *u16regs, uint16_t u16StartCoil, uint16_t u16Coilno, uint8_t *u8bits);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC1) || MB_SLAVE_FC(MB_ENABLE_FC2)
+static int16_t process_FC1(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4)
+static int16_t process_FC3(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC5)
+static int16_t process_FC5( modbusHandler_t *modH);
+static uint8_t validate_FC5(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC6)
+static int16_t process_FC6(modbusHandler_t *modH);
+static uint8_t validate_FC6(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC8)
+static int16_t process_FC8(modbusHandler_t *modH);
+static uint8_t validate_FC8(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC15)
+static int16_t process_FC15(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC16)
+static int16_t process_FC16(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC20)
+static int16_t process_FC20(modbusHandler_t *modH);
+static uint8_t validate_FC20(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC21)
+static int16_t process_FC21(modbusHandler_t *modH);
+static uint8_t validate_FC21(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC24)
+static int16_t process_FC24(modbusHandler_t *modH);
+static uint8_t validate_FC24(modbusHandler_t *modH);
+static modbusFifo_t *findFifo(modbusHandler_t *modH, uint16_t u16Address);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC43)
+static int16_t process_FC43(modbusHandler_t *modH);
+static uint8_t validate_FC43(modbusHandler_t *modH);
+static const modbusDevIdObj_t *findDevId(modbusHandler_t *modH, uint8_t u8Id);
+#endif
+#if MB_SLAVE_FILES
+static const modbusFile_t *findFile(modbusHandler_t *modH, const uint8_t *u8sub, bool xWrite);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC22)
+static int16_t process_FC22(modbusHandler_t *modH);
+static uint8_t validate_FC22(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC23)
+static int16_t process_FC23(modbusHandler_t *modH);
+static uint8_t validate_FC23(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC_RANGES)
+static int16_t process_FCRanges(modbusHandler_t *modH);
+static uint8_t validate_FCRanges(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_DELTAS
+static int16_t process_FCDelta(modbusHandler_t *modH);
+static uint8_t validate_FCDelta(modbusHandler_t *modH);
+static modbusDeltaBlock_t *findDelta(modbusHandler_t *modH, const uint8_t *u8req);
+static uint16_t putDeltaRuns(const modbusDeltaBlock_t *xBlock, uint16_t u16Since, uint8_t *u8dst);
+#endif
+#if MB_SLAVE_COIL_RANGE
+static uint8_t validate_FC1(modbusHandler_t *modH);
+#endif
+#if MB_SLAVE_REG_RANGE
+static uint8_t validate_FC3(modbusHandler_t *modH);
+#endif
+#if ENABLE_MB_TIMER_MUX != 1
 static void vTimerCallbackT35(TimerHandle_t *pxTimer);
+#endif
+static void notifyModbus(modbusHandler_t *modH, uint8_t u8Event);
+#if ENABLE_MB_SHARED_TASK == 1
+static uint8_t takeEvents(modbusHandler_t *modH);
+#endif
+#if MB_ENABLE_MASTER == 1
+#if ENABLE_MB_TIMER_MUX != 1
 static void vTimerCallbackTimeout(TimerHandle_t *pxTimer);
+#endif
+#if ENABLE_MB_SHARED_TASK != 1 || ENABLE_USB_CDC == 1
+static void startTimeout(modbusHandler_t *modH);
+#endif
+static void stopTimeout(modbusHandler_t *modH);
+static uint8_t validateAnswer(modbusHandler_t *modH, modbus_t *telegram);
+static bool matchAnswer(modbusHandler_t *modH, const modbus_t *telegram);
+static void dropStrayFrame(modbusHandler_t *modH);
+static void get_FC1(modbusHandler_t *modH, modbusTransaction_t *xTrans);
+static void get_FC3(modbusHandler_t *modH, modbus_t *telegram, modbusTransaction_t *xTrans);
+#if ENABLE_MB_GATHER == 1
+static bool checkGather(const modbus_t *telegram);
+static void gatherRegisters(const modbus_t *telegram, const uint8_t *u8src, uint16_t u16regsno);
+#if ENABLE_MB_REDUNDANT == 1
+static void gatherImage(const modbus_t *telegram, const uint16_t *u16src);
+#endif
+#endif
+static void get_FC20(modbusHandler_t *modH, modbus_t *telegram);
+static void get_FC24(modbusHandler_t *modH, modbus_t *telegram);
+static void get_FC43(modbusHandler_t *modH, modbus_t *telegram);
+static bool checkFileQuery(modbus_t *telegram);
+static bool checkWriteQuery(const modbus_t *telegram);
+static bool checkFileAnswer(modbusHandler_t *modH, modbus_t *telegram);
+static bool checkFifoAnswer(modbusHandler_t *modH);
+static bool checkDevIdAnswer(modbusHandler_t *modH);
+#if MB_ENABLE_FC_RANGES == 1
+static bool checkRangesQuery(const modbus_t *telegram);
+static void get_FCRanges(modbusHandler_t *modH, modbus_t *telegram);
+#endif
+#if MB_MASTER_DELTA
+static modbusCache_t *findDeltaCache(modbusHandler_t *modH, const modbus_t *telegram);
+static uint16_t buildDeltaPdu(uint8_t *u8dst, const modbusCache_t *xRange);
+static bool checkDeltaAnswer(modbusHandler_t *modH, const modbusCache_t *xRange);
+static void get_FCDelta(modbusHandler_t *modH, modbusTransaction_t *xTrans);
+#endif
 //static int16_t getRxBuffer(modbusHandler_t *modH);
-static int8_t SendQuery(modbusHandler_t *modH ,  modbus_t telegram);
+static int8_t SendQuery(modbusHandler_t *modH ,  modbus_t *telegram);
+static void openTransaction(modbusTransaction_t *xTrans, const modbus_t *telegram);
+static void buildQuery(modbusHandler_t *modH, modbus_t *telegram);
+static uint16_t buildPdu(uint8_t *u8dst, const modbus_t *telegram);
+#if ENABLE_MB_TYPED == 1
+static void encodeValues(modbus_t *telegram);
+static void decodeValues(modbus_t *telegram);
+#endif
+#if ENABLE_MB_PREBUILT == 1
+static void sendFrame(modbusHandler_t *modH, const modbus_t *telegram);
+#endif
+static void notifyQueryResult(modbusHandler_t *modH, modbus_t *telegram, int8_t i8result);
+static void closePoll(modbusHandler_t *modH, int8_t i8result);
+static void deliverResult(modbusHandler_t *modH, modbus_t *telegram, int8_t i8result, int8_t i8Slot);
+#if ENABLE_MB_DEFERRED_DECODE == 1
+static void StartTaskModbusDecode(void *argument);
+static bool deferAnswer(modbusHandler_t *modH, modbus_t *telegram);
+static void decodeAnswer(modbusHandler_t *modH, modbusDecode_t *xJob);
+static void waitDecoded(modbusHandler_t *modH);
+#endif
+static bool putTelegram(modbusHandler_t *modH, modbus_t *telegram, mb_priority_t xPrio, bool xFront, bool xRef);
+static modbus_t *takeTelegram(modbusHandler_t *modH, mb_priority_t xLowest, TickType_t xBlock);
+static void freeTelegram(modbusHandler_t *modH, uint8_t u8Slot);
+static int8_t detachTelegram(modbusHandler_t *modH, const modbus_t *telegram);
+#if ENABLE_MB_MERGE == 1 || (MB_ENABLE_IP == 1 && MB_ENABLE_MASTER == 1)
+static void releaseTelegram(modbusHandler_t *modH, const modbus_t *telegram);
+#endif
+static int8_t findTelegramLevel(modbusHandler_t *modH, mb_priority_t xLowest);
+static uint8_t popTelegram(modbusHandler_t *modH, uint8_t u8Level);
+static bool getNextTelegram(modbusHandler_t *modH, modbus_t **telegram, TickType_t *pxWait);
+static bool transmitQuery(modbusHandler_t *modH, modbus_t *telegram);
+#if ENABLE_MB_ARBITRATION == 1
+static void waitBusSlot(modbusHandler_t *modH);
+#endif
+#if ENABLE_MB_TDMA == 1
+static uint16_t getAnswerSize(const modbus_t *telegram);
+static bool compileSchedule(modbusHandler_t *modH);
+static void buildSlotFrame(modbusHandler_t *modH, uint32_t u32Start, modbus_t *telegram);
+static void startSchedule(modbusHandler_t *modH);
+static void serveSchedule(modbusHandler_t *modH);
+static void closeSlot(modbusHandler_t *modH);
+static void takeSlotAnswer(modbusHandler_t *modH);
+static void startSlotFromISR(modbusHandler_t *modH, BaseType_t *pxHigherPriorityTaskWoken);
+#endif
+#if ENABLE_MB_WATCHDOG == 1
+static TickType_t watchdogLeft(modbusHandler_t *modH);
+static void expireQuery(modbusHandler_t *modH);
+#endif
+static bool startQuery(modbusHandler_t *modH, modbus_t *telegram);
+static bool retryQuery(modbusHandler_t *modH, modbus_t *telegram);
+static bool finishQuery(modbusHandler_t *modH, modbus_t *telegram);
+static void processAnswer(modbusHandler_t *modH, modbus_t *telegram, modbusTransaction_t *xTrans);
+#if ENABLE_MB_SHARED_TASK == 1
+static TickType_t stepMaster(modbusHandler_t *modH, uint8_t u8Events);
+#endif
+static uint16_t getQueryTimeOut(modbusHandler_t *modH, modbus_t *telegram);
+#endif
+#if MB_ENABLE_SLAVE == 1 && ENABLE_MB_SHARED_TASK == 1
+static void stepSlave(modbusHandler_t *modH, uint8_t u8Events);
+#endif
+#if MB_SLAVE_TABLE == 1
+static modbusSlave_t *getSlave(modbusHandler_t *modH, uint8_t u8id);
+#endif
+#if ENABLE_MB_ADAPTIVE_TIMEOUT == 1
+static void updateAnswerTime(modbusHandler_t *modH, uint8_t u8id, TickType_t xTime);
+#endif
+#if ENABLE_MB_POLL_ADAPT == 1 || ENABLE_MB_WIRE_STATS == 1
+static uint32_t getWireChars(modbusHandler_t *modH, uint16_t u16Bytes);
+static uint32_t getWireUs(modbusHandler_t *modH, uint32_t u32Chars);
+#endif
+#if ENABLE_MB_WIRE_STATS == 1
+static void countWireTx(modbusHandler_t *modH, uint16_t u16Bytes);
+static void countWireRx(modbusHandler_t *modH, uint16_t u16Bytes, bool xAnswer);
+#endif
+#if ENABLE_MB_POLL_ADAPT == 1
+static void addWireTime(modbusHandler_t *modH, uint16_t u16Chars, uint32_t u32WaitUs);
+static void adaptPolls(modbusHandler_t *modH, TickType_t xNow);
+#endif
+#if ENABLE_MB_NODE_STATS == 1
+static modbusNodeStats_t *getNodeStats(modbusHandler_t *modH, uint8_t u8id);
+static void updateNodeTime(modbusNodeStats_t *xNode, TickType_t xTime);
+#endif
+#if ENABLE_MB_BACKOFF == 1
+static bool isSlaveOnline(modbusHandler_t *modH, modbus_t *telegram);
+static void updateSlaveHealth(modbusHandler_t *modH, uint8_t u8id, bool xTimedOut);
+#endif
+#if ENABLE_MB_MERGE == 1
+static void mergeTelegrams(modbusHandler_t *modH, modbus_t *telegram);
+static bool takeMergeable(modbusHandler_t *modH, modbus_t *next, modbus_t *first, uint16_t u16Start, uint16_t u16End, uint16_t u16Total);
+#endif
+#if ENABLE_MB_RBE == 1
+static void compareRegisters(modbusHandler_t *modH, modbusPoll_t *xPoll, modbusTransaction_t *xTrans);
+#endif
+#if ENABLE_MB_SUBSCRIBE == 1
+static void notifySubscribers(modbusHandler_t *modH, const modbus_t *telegram);
+static void compareSubscription(modbusSub_t *xSub, const uint16_t *u16Image, uint16_t u16Offset);
+#endif
+#if ENABLE_MB_CACHE == 1
+static uint8_t getCacheTable(uint8_t u8fct);
+static void copyCache(uint8_t u8fct, uint16_t *u16dst, uint16_t u16DstOff, const uint16_t *u16src, uint16_t u16SrcOff, uint16_t u16Count);
+static bool lookupCache(modbusHandler_t *modH, modbus_t *telegram);
+static void updateCache(modbusHandler_t *modH, modbus_t *telegram);
+#endif
+#if ENABLE_MB_BROADCAST == 1
+static bool isBroadcastFunction(uint8_t u8fct);
+#endif
+#if ENABLE_MB_STATS == 1 || ENABLE_MB_MONITOR == 1 || ENABLE_MB_REPLAY == 1 || ENABLE_MB_STRESS == 1
+static void updateHist(modbusHist_t *xHist, uint32_t u32Val);
+#endif
+#if ENABLE_MB_MONITOR == 1
+static void serveMonitor(modbusHandler_t *modH);
+static void monitorFrame(modbusHandler_t *modH);
+static modbusMonitorSlave_t *getMonSlave(modbusHandler_t *modH, uint8_t u8id);
+#endif
+#if ENABLE_MB_BENCH == 1
+static uint16_t setBenchRequest(uint8_t *u8req, uint8_t u8id, uint8_t u8fct, uint16_t u16Count);
+static uint32_t benchRequest(modbusHandler_t *modH, const uint8_t *u8req, uint16_t u16size, bool xProcess);
+#endif
+#if ENABLE_MB_EVENT_LOG == 1
+static void logEvent(modbusHandler_t *modH, uint8_t u8Type, const uint8_t *u8Frame, uint16_t u16Length, int8_t i8Error, uint8_t u8Flags);
+#endif
+#if ENABLE_MB_DIAG_REGS == 1
+static bool isDiagRange(uint8_t u8table, uint16_t u16Add, uint16_t u16Count);
+#if ENABLE_MB_NODE_STATS == 1
+static void putNodeDiagnostics(modbusHandler_t *master, uint8_t *u8dst, uint16_t u16Off, uint16_t u16Count);
+#endif
+#if ENABLE_MB_ERR_STATS == 1 || ENABLE_MB_STATS == 1 || ENABLE_MB_NODE_STATS == 1
+static void setDiag32(uint16_t *u16diag, uint8_t u8off, uint32_t u32val);
+#endif
+static void putDiagnostics(modbusHandler_t *modH, uint8_t *u8dst, uint16_t u16Add, uint16_t u16Count);
+#if ENABLE_MB_RUNTIME == 1
+static void sampleRuntime(modbusHandler_t *modH, modbusRuntimeMark_t *xMark, uint16_t *u16Task, uint16_t *u16Isr);
+#endif
+#endif
+static void setCharTiming(modbusHandler_t *modH);
+#if ENABLE_USART_DE == 1
+static void setHardwareDE(modbusHandler_t *modH);
+#endif
+#if ENABLE_USART_RTO == 1
+static uint32_t getT35Bits(UART_HandleTypeDef *port);
+#endif
 
 
 /* Ring Buffer functions */
-// This function must be called only after disabling USART RX interrupt or inside of the RX interrupt
+/* Single producer (RX interrupt) and single consumer (Modbus task) queue without locks:
+ * only the producer writes u16head and only the consumer writes u16tail.
+ * Both indexes run free and are masked with the power of two size on every access */
 void RingAdd(modbusRingBuffer_t *xRingBuffer, uint8_t u8Val)
 {
+	uint16_t u16head = xRingBuffer->u16head;
 
-	xRingBuffer->uxBuffer[xRingBuffer->u8end] = u8Val;
-	xRingBuffer->u8end = (xRingBuffer->u8end + 1) % MAX_BUFFER;
-	if (xRingBuffer->u8available == MAX_BUFFER)
-	{
-		xRingBuffer->overflow = true;
-		xRingBuffer->u8start = (xRingBuffer->u8start + 1) % MAX_BUFFER;
-	}
-	else
+	if ((uint16_t)(u16head - xRingBuffer->u16tail) >= MAX_BUFFER_RX)
 	{
-		xRingBuffer->overflow = false;
-		xRingBuffer->u8available++;
+		xRingBuffer->overflow = true; // the consumer is late, the byte is lost
+		return;
 	}
-
+	xRingBuffer->uxBuffer[u16head & (MAX_BUFFER_RX - 1)] = u8Val;
+	__DMB(); // the byte must be visible before the new head
+	xRingBuffer->u16head = u16head + 1;
 }
 
-// This function must be called only after disabling USART RX interrupt
-uint8_t RingGetAllBytes(modbusRingBuffer_t *xRingBuffer, uint8_t *buffer)
+uint16_t RingGetAllBytes(modbusRingBuffer_t *xRingBuffer, uint8_t *buffer)
 {
-	return RingGetNBytes(xRingBuffer, buffer, xRingBuffer->u8available);
+	return RingGetNBytes(xRingBuffer, buffer, RingCountBytes(xRingBuffer));
 }
 
-// This function must be called only after disabling USART RX interrupt
-uint8_t RingGetNBytes(modbusRingBuffer_t *xRingBuffer, uint8_t *buffer, uint8_t uNumber)
+uint16_t RingGetNBytes(modbusRingBuffer_t *xRingBuffer, uint8_t *buffer, uint16_t uNumber)
 {
-	uint8_t uCounter;
-	if(xRingBuffer->u8available == 0  || uNumber == 0 ) return 0;
-	if(uNumber > MAX_BUFFER) return 0;
+	uint16_t u16tail = xRingBuffer->u16tail;
+	uint16_t u16count = RingCountBytes(xRingBuffer);
+	uint16_t u16first;
+
+	if (u16count > uNumber) u16count = uNumber;
+	if (u16count == 0) return 0;
+	__DMB(); // read the bytes after the head
 
-	for(uCounter = 0; uCounter < uNumber && uCounter< xRingBuffer->u8available ; uCounter++)
+	// at most two block copies, before and after the end of the ring
+	u16first = MAX_BUFFER_RX - (u16tail & (MAX_BUFFER_RX - 1));
+	if (u16first >= u16count)
+	{
+		memcpy(buffer, &xRingBuffer->uxBuffer[u16tail & (MAX_BUFFER_RX - 1)], u16count);
+	}
+	else
 	{
-		buffer[uCounter] = xRingBuffer->uxBuffer[xRingBuffer->u8start];
-		xRingBuffer->u8start = (xRingBuffer->u8start + 1) % MAX_BUFFER;
+		memcpy(buffer, &xRingBuffer->uxBuffer[u16tail & (MAX_BUFFER_RX - 1)], u16first);
+		memcpy(&buffer[u16first], xRingBuffer->uxBuffer, u16count - u16first);
 	}
-	xRingBuffer->u8available = xRingBuffer->u8available - uCounter;
-	xRingBuffer->overflow = false;
-	RingClear(xRingBuffer);
+	__DMB(); // release the bytes to the producer only after the copy
+	xRingBuffer->u16tail = u16tail + u16count;
 
-	return uCounter;
+	return u16count;
 }
 
-uint8_t RingCountBytes(modbusRingBuffer_t *xRingBuffer)
+uint16_t RingCountBytes(modbusRingBuffer_t *xRingBuffer)
 {
-return xRingBuffer->u8available;
+return (uint16_t)(xRingBuffer->u16head - xRingBuffer->u16tail);
 }
 
+// Consumer side flush, the bytes stored so far are dropped
 void RingClear(modbusRingBuffer_t *xRingBuffer)
 {
-xRingBuffer->u8start = 0;
-xRingBuffer->u8end = 0;
-xRingBuffer->u8available = 0;
+xRingBuffer->u16tail = xRingBuffer->u16head;
 xRingBuffer->overflow = false;
 }
 
@@ -142,72 +866,598 @@ xRingBuffer->overflow = false;
 
 
 
-const unsigned char fctsupported[] =
+#if MB_ENABLE_SLAVE == 1
+/* position + 1 of the built-in functions in xFunctions, the disabled ones take no entry */
+#define MB_POS_FC1   (MB_ENABLE_FC1)
+#define MB_POS_FC2   (MB_POS_FC1 + MB_ENABLE_FC2)
+#define MB_POS_FC3   (MB_POS_FC2 + MB_ENABLE_FC3)
+#define MB_POS_FC4   (MB_POS_FC3 + MB_ENABLE_FC4)
+#define MB_POS_FC5   (MB_POS_FC4 + MB_ENABLE_FC5)
+#define MB_POS_FC6   (MB_POS_FC5 + MB_ENABLE_FC6)
+#define MB_POS_FC8   (MB_POS_FC6 + MB_ENABLE_FC8)
+#define MB_POS_FC15  (MB_POS_FC8 + MB_ENABLE_FC15)
+#define MB_POS_FC16  (MB_POS_FC15 + MB_ENABLE_FC16)
+#define MB_POS_FC20  (MB_POS_FC16 + MB_ENABLE_FC20)
+#define MB_POS_FC21  (MB_POS_FC20 + MB_ENABLE_FC21)
+#define MB_POS_FC22  (MB_POS_FC21 + MB_ENABLE_FC22)
+#define MB_POS_FC23  (MB_POS_FC22 + MB_ENABLE_FC23)
+#define MB_POS_FC24  (MB_POS_FC23 + MB_ENABLE_FC24)
+#define MB_POS_FC43  (MB_POS_FC24 + MB_ENABLE_FC43)
+#define MB_POS_FC_RANGES  (MB_POS_FC43 + MB_ENABLE_FC_RANGES)
+#define MB_POS_FC_DELTA   (MB_POS_FC_RANGES + MB_ENABLE_FC_DELTA)
+
+/* Function table: validator and handler of every supported function code.
+ * The built-in functions come first, ModbusRegisterFunction() appends the user functions */
+static modbusFunction_t xFunctions[MB_FUNCTIONS_BUILTIN + MAX_USER_FUNCTIONS] =
+{
+#if MB_ENABLE_FC1 == 1
+    { MB_FC_READ_COILS,               validate_FC1, process_FC1  },
+#endif
+#if MB_ENABLE_FC2 == 1
+    { MB_FC_READ_DISCRETE_INPUT,      validate_FC1, process_FC1  },
+#endif
+#if MB_ENABLE_FC3 == 1
+    { MB_FC_READ_REGISTERS,           validate_FC3, process_FC3  },
+#endif
+#if MB_ENABLE_FC4 == 1
+    { MB_FC_READ_INPUT_REGISTER,      validate_FC3, process_FC3  },
+#endif
+#if MB_ENABLE_FC5 == 1
+    { MB_FC_WRITE_COIL,               validate_FC5, process_FC5  },
+#endif
+#if MB_ENABLE_FC6 == 1
+    { MB_FC_WRITE_REGISTER,           validate_FC6, process_FC6  },
+#endif
+#if MB_ENABLE_FC8 == 1
+    { MB_FC_DIAGNOSTICS,              validate_FC8, process_FC8  },
+#endif
+#if MB_ENABLE_FC15 == 1
+    { MB_FC_WRITE_MULTIPLE_COILS,     validate_FC1, process_FC15 },
+#endif
+#if MB_ENABLE_FC16 == 1
+    { MB_FC_WRITE_MULTIPLE_REGISTERS, validate_FC3, process_FC16 },
+#endif
+#if MB_ENABLE_FC20 == 1
+    { MB_FC_READ_FILE_RECORD,         validate_FC20, process_FC20 },
+#endif
+#if MB_ENABLE_FC21 == 1
+    { MB_FC_WRITE_FILE_RECORD,        validate_FC21, process_FC21 },
+#endif
+#if MB_ENABLE_FC22 == 1
+    { MB_FC_MASK_WRITE_REGISTER,      validate_FC22, process_FC22 },
+#endif
+#if MB_ENABLE_FC23 == 1
+    { MB_FC_READ_WRITE_MULTIPLE_REGISTERS, validate_FC23, process_FC23 },
+#endif
+#if MB_ENABLE_FC24 == 1
+    { MB_FC_READ_FIFO_QUEUE,          validate_FC24, process_FC24 },
+#endif
+#if MB_ENABLE_FC43 == 1
+    { MB_FC_ENCAPSULATED,             validate_FC43, process_FC43 },
+#endif
+#if MB_ENABLE_FC_RANGES == 1
+    { MB_FC_READ_RANGES,              validate_FCRanges, process_FCRanges },
+#endif
+#if MB_ENABLE_FC_DELTA == 1
+    { MB_FC_READ_DELTA,               validate_FCDelta, process_FCDelta },
+#endif
+};
+static uint8_t u8Functions = MB_FUNCTIONS_BUILTIN;
+
+/* function code to xFunctions position + 1, 0 for unsupported codes */
+static uint8_t u8FunctionIndex[128] =
 {
-    MB_FC_READ_COILS,
-    MB_FC_READ_DISCRETE_INPUT,
-    MB_FC_READ_REGISTERS,
-    MB_FC_READ_INPUT_REGISTER,
-    MB_FC_WRITE_COIL,
-    MB_FC_WRITE_REGISTER,
-    MB_FC_WRITE_MULTIPLE_COILS,
-    MB_FC_WRITE_MULTIPLE_REGISTERS
+#if MB_ENABLE_FC1 == 1
+    [MB_FC_READ_COILS]               = MB_POS_FC1,
+#endif
+#if MB_ENABLE_FC2 == 1
+    [MB_FC_READ_DISCRETE_INPUT]      = MB_POS_FC2,
+#endif
+#if MB_ENABLE_FC3 == 1
+    [MB_FC_READ_REGISTERS]           = MB_POS_FC3,
+#endif
+#if MB_ENABLE_FC4 == 1
+    [MB_FC_READ_INPUT_REGISTER]      = MB_POS_FC4,
+#endif
+#if MB_ENABLE_FC5 == 1
+    [MB_FC_WRITE_COIL]               = MB_POS_FC5,
+#endif
+#if MB_ENABLE_FC6 == 1
+    [MB_FC_WRITE_REGISTER]           = MB_POS_FC6,
+#endif
+#if MB_ENABLE_FC8 == 1
+    [MB_FC_DIAGNOSTICS]              = MB_POS_FC8,
+#endif
+#if MB_ENABLE_FC15 == 1
+    [MB_FC_WRITE_MULTIPLE_COILS]     = MB_POS_FC15,
+#endif
+#if MB_ENABLE_FC16 == 1
+    [MB_FC_WRITE_MULTIPLE_REGISTERS] = MB_POS_FC16,
+#endif
+#if MB_ENABLE_FC20 == 1
+    [MB_FC_READ_FILE_RECORD]         = MB_POS_FC20,
+#endif
+#if MB_ENABLE_FC21 == 1
+    [MB_FC_WRITE_FILE_RECORD]        = MB_POS_FC21,
+#endif
+#if MB_ENABLE_FC22 == 1
+    [MB_FC_MASK_WRITE_REGISTER]      = MB_POS_FC22,
+#endif
+#if MB_ENABLE_FC23 == 1
+    [MB_FC_READ_WRITE_MULTIPLE_REGISTERS] = MB_POS_FC23,
+#endif
+#if MB_ENABLE_FC24 == 1
+    [MB_FC_READ_FIFO_QUEUE]          = MB_POS_FC24,
+#endif
+#if MB_ENABLE_FC43 == 1
+    [MB_FC_ENCAPSULATED]             = MB_POS_FC43,
+#endif
+#if MB_ENABLE_FC_RANGES == 1
+    [MB_FC_READ_RANGES]              = MB_POS_FC_RANGES,
+#endif
+#if MB_ENABLE_FC_DELTA == 1
+    [MB_FC_READ_DELTA]               = MB_POS_FC_DELTA,
+#endif
 };
 
 
+static inline const modbusFunction_t *getFunction(uint8_t u8fct)
+{
+	if (u8fct >= 128 || u8FunctionIndex[u8fct] == 0) return NULL;
+	return &xFunctions[u8FunctionIndex[u8fct] - 1];
+}
+
+
 /**
  * @brief
- * Initialization for a Master/Slave.
- * this function will check the configuration parameters
- * of the modbus handler
+ * Registers a slave function code, or replaces the handler of a built-in one.
+ * It must be called before ModbusStart(), the table is shared by all the handlers.
  *
- * @param modH   modbus handler
+ * @param u8fct function code between 1 and 127
+ * @param validator optional check of the request, returns 0 or an exception code
+ * @param handler builds the answer in u8Buffer/u16BufferSize and returns 0,
+ *        an exception code to answer with an exception, or a negative value to not answer
+ * @return true if registered, false if the code is invalid or the table is full
+ * @ingroup setup
  */
-void ModbusInit(modbusHandler_t * modH)
+bool ModbusRegisterFunction(uint8_t u8fct, mb_fc_validator_t validator, mb_fc_handler_t handler)
 {
+	if (u8fct == 0 || u8fct >= 128 || handler == NULL) return false;
 
-  if (numberHandlers < MAX_M_HANDLERS)
-  {
+	if (u8FunctionIndex[u8fct] == 0)
+	{
+		if (u8Functions >= MB_FUNCTIONS_BUILTIN + MAX_USER_FUNCTIONS) return false;
+		u8FunctionIndex[u8fct] = ++u8Functions;
+	}
+	xFunctions[u8FunctionIndex[u8fct] - 1].u8fct = u8fct;
+	xFunctions[u8FunctionIndex[u8fct] - 1].validate = validator;
+	xFunctions[u8FunctionIndex[u8fct] - 1].process = handler;
+	return true;
+}
+#endif
 
-	  //Initialize the ring buffer
 
-	  RingClear(&modH->xBufferRX);
+/* Transport tables, one per physical layer, see modbusTransport_t */
+static const modbusTransport_t xTransportUart =
+{
+	.start = startUartIT, .wait = waitRequest, .recvFrame = getRxRing, .send = sendUartIT,
+#if ENABLE_RX_CRC == 1
+	.u8Flags = MB_TP_UART | MB_TP_RX_CRC
+#else
+	.u8Flags = MB_TP_UART
+#endif
+};
 
-	  if(modH->uModbusType == MB_SLAVE)
-	  {
-		  //Create Modbus task slave
-		  modH->myTaskModbusAHandle = osThreadNew(StartTaskModbusSlave, modH, &myTaskModbusA_attributes);
-	  }
-	  else if (modH->uModbusType == MB_MASTER)
-	  {
-		  //Create Modbus task Master  and Queue for telegrams
-		  modH->myTaskModbusAHandle = osThreadNew(StartTaskModbusMaster, modH, &myTaskModbusB_attributes);
+#if ENABLE_LPUART == 1
+static const modbusTransport_t xTransportLpuart =
+{
+	.start = startLpuart, .wait = waitRequest, .recvFrame = getRxRing, .send = sendUartIT,
+#if ENABLE_RX_CRC == 1
+	.u8Flags = MB_TP_UART | MB_TP_RX_CRC
+#else
+	.u8Flags = MB_TP_UART
+#endif
+};
+#endif
+
+#if ENABLE_MB_ASCII == 1
+static const modbusTransport_t xTransportAscii =
+{
+	.start = startAscii, .wait = waitRequest, .recvFrame = getRxAscii, .send = sendUartIT,
+	.u8Flags = MB_TP_UART | MB_TP_LRC
+};
+#endif
+
+#if ENABLE_USART_DMA == 1
+static const modbusTransport_t xTransportDMA =
+{
+#if ENABLE_MB_RX_QUEUE == 1
+	.start = startUartDMA, .wait = waitRequestQueue, .recvFrame = getRxDMA, .send = sendUartDMA,
+	.abort = abortRxQueue, .release = releaseRxQueue,
+#else
+	.start = startUartDMA, .wait = waitRequestDMA, .recvFrame = getRxDMA, .send = sendUartDMA,
+#endif
+#if ENABLE_USART_DMA_INPLACE == 1
+	.abort = abortRxDMA, .release = restartRxDMA,
+#endif
+	.u8Flags = MB_TP_UART
+};
+
+static const modbusTransport_t xTransportCirc =
+{
+	.start = startUartCirc, .wait = waitRequestCirc, .recvFrame = getRxFrame, .send = sendUartDMA,
+	.abort = abortRxCirc,
+#if ENABLE_MB_SHARED_TASK == 1
+	.release = releaseRxCirc,
+#endif
+	.u8Flags = MB_TP_UART
+};
+#endif
+
+#if ENABLE_USB_CDC == 1
+static const modbusTransport_t xTransportUsb =
+{
+	.start = startUsb, .wait = waitRequest, .recvFrame = getRxUsb, .send = sendUsb,
+	.release = startUsbRx
+};
+#endif
+
+#if ENABLE_MB_BLE == 1
+static const modbusTransport_t xTransportBle =
+{
+	.start = startBle, .wait = waitRequest, .recvFrame = getRxBle, .send = sendBle,
+	.release = startBleRx
+};
+#endif
+
+#if ENABLE_TCP == 1
+static const modbusTransport_t xTransportTcp =
+{
+#if MB_ENABLE_SLAVE == 1
+	.send = sendTcpAnswer,
+#endif
+	.start = startTcp, .serve = stepTcp, .u8Flags = MB_TP_MBAP
+};
+#endif
+
+#if ENABLE_UDP == 1
+static const modbusTransport_t xTransportUdp =
+{
+#if MB_ENABLE_SLAVE == 1
+	.send = sendUdpAnswer,
+#endif
+	.start = startUdp, .serve = stepUdp, .u8Flags = MB_TP_MBAP
+};
+#endif
+
+/* mb_hardware_t to transport, NULL for the types not enabled in ModbusConfig.h */
+static const modbusTransport_t *const xTransports[] =
+{
+	[USART_HW]          = &xTransportUart,
+#if ENABLE_USART_DMA == 1
+	[USART_HW_DMA]      = &xTransportDMA,
+	[USART_HW_DMA_CIRC] = &xTransportCirc,
+#endif
+#if ENABLE_USB_CDC == 1
+	[USB_CDC_HW]        = &xTransportUsb,
+#endif
+#if ENABLE_TCP == 1
+	[TCP_HW]            = &xTransportTcp,
+#endif
+#if ENABLE_UDP == 1
+	[UDP_HW]            = &xTransportUdp,
+#endif
+#if ENABLE_LPUART == 1
+	[LPUART_HW]         = &xTransportLpuart,
+#endif
+#if ENABLE_MB_ASCII == 1
+	[ASCII_HW]          = &xTransportAscii,
+#endif
+#if ENABLE_MB_BLE == 1
+	[BLE_HW]            = &xTransportBle,
+#endif
+};
+
+
+/**
+ * @brief
+ * Publishes the UART to handler map of the HAL callbacks after a handler came or
+ * left: the copy not in use is rebuilt from mHandlers, then one pointer store
+ * swaps the copies. An interrupt reads either map whole, a task cannot run while
+ * it scans one. Called with the scheduler suspended
+ *
+ * @ingroup setup
+ */
+static void publishPorts(void)
+{
+	modbusHandler_t **xPorts = (mHandlersByPort == mHandlersByPortCopy[0]) ? mHandlersByPortCopy[1] : mHandlersByPortCopy[0];
+
+	memset(xPorts, 0, sizeof(mHandlersByPortCopy[0]));
+	for (uint8_t i = 0; i < numberHandlers; i++)
+	{
+		modbusHandler_t *modH = mHandlers[i];
+
+		// TCP, UDP and USB handlers have no UART callbacks
+		if (modH == NULL || (modH->xTransport->u8Flags & MB_TP_UART) == 0) continue;
+
+		// the port must be assigned before ModbusInit() for the HAL callbacks
+		uint32_t u32Slot = ((uintptr_t)modH->port->Instance >> 10) & (MB_PORT_SLOTS - 1);
+		while (xPorts[u32Slot] != NULL)
+		{
+			u32Slot = (u32Slot + 1) & (MB_PORT_SLOTS - 1);
+		}
+		xPorts[u32Slot] = modH;
+	}
+	__DMB(); // the map is complete before it is seen
+	mHandlersByPort = xPorts;
+}
+
+static const modbusTransport_t *getTransport(mb_hardware_t xTypeHW)
+{
+	if ((uint32_t)xTypeHW >= sizeof(xTransports) / sizeof(xTransports[0])) return NULL;
+#if ENABLE_USART_DMA_INPLACE == 1
+	if (xTypeHW != USART_HW_DMA) return NULL; // the RX ring is u8Buffer, only USART_HW_DMA works
+#endif
+	return xTransports[xTypeHW];
+}
+
+#if ENABLE_MB_CONST_CONFIG == 1
+/* copies xConfig into the handler, the hot paths keep reading the fields of the handler */
+static void loadConfig(modbusHandler_t *modH)
+{
+	const modbusConfig_t *xCfg = modH->xConfig;
+
+	modH->uModbusType = xCfg->uModbusType;
+	modH->xTypeHW = xCfg->xTypeHW;
+	modH->port = xCfg->port;
+	modH->EN_Port = xCfg->EN_Port;
+	modH->EN_Pin = xCfg->EN_Pin;
+	modH->u8id = xCfg->u8id;
+	modH->u16timeOut = xCfg->u16timeOut;
+	modH->u16regsHR = xCfg->u16regsHR;
+	modH->u16regHR_size = xCfg->u16regHR_size;
+	modH->u16regsCoils = xCfg->u16regsCoils;
+	modH->u16regCoils_size = xCfg->u16regCoils_size;
+#if MB_ENABLE_SLAVE == 1
+	if (modH->uModbusType == MB_SLAVE)
+	{
+		modH->u16regsRO = xCfg->u16regsRO;
+		modH->u16regRO_size = xCfg->u16regRO_size;
+		modH->u16regsCoilsRO = xCfg->u16regsCoilsRO;
+		modH->u16regCoilsRO_size = xCfg->u16regCoilsRO_size;
+	}
+#endif
+	modH->xTaskPriority = xCfg->xTaskPriority;
+	modH->u32TaskStack = xCfg->u32TaskStack;
+}
+#endif
+
+
+/**
+ * @brief
+ * Initialization for a Master/Slave.
+ * this function will check the configuration parameters
+ * of the modbus handler
+ *
+ * @param modH   modbus handler
+ */
+void ModbusInit(modbusHandler_t * modH)
+{
+  uint8_t u8Handler = 0;
+#if ENABLE_MB_SHARED_TASK == 1
+  osThreadAttr_t xTaskAttr = myTaskModbus_attributes;
+#elif MB_ENABLE_MASTER != 1
+  osThreadAttr_t xTaskAttr = myTaskModbusA_attributes;
+#elif MB_ENABLE_SLAVE != 1
+  osThreadAttr_t xTaskAttr = myTaskModbusB_attributes;
+#else
+  osThreadAttr_t xTaskAttr = (modH->uModbusType == MB_MASTER) ? myTaskModbusB_attributes : myTaskModbusA_attributes;
+#endif
+#if MB_ENABLE_MASTER == 1
+  osSemaphoreAttr_t xQueueAttr = QueueTelegram_attributes;
+#endif
+#if MB_ENABLE_SLAVE == 1
+  osSemaphoreAttr_t xSphrAttr[MB_SEMAPHORES] = { ModBusSphr_attributes, ModBusSphrRO_attributes,
+		  ModBusSphrCoils_attributes, ModBusSphrCoilsRO_attributes };
+#else
+  osSemaphoreAttr_t xSphrAttr[MB_SEMAPHORES] = { ModBusSphr_attributes };
+#endif
+
+  // first slot free, ModbusDeInit() may have left holes
+  while (u8Handler < numberHandlers && mHandlers[u8Handler] != NULL)
+  {
+	  u8Handler++;
+  }
+
+  if (u8Handler < MAX_M_HANDLERS)
+  {
+#if ENABLE_MB_CONST_CONFIG == 1
+	  if (modH->xConfig != NULL)
+	  {
+		  loadConfig(modH);
+	  }
+#endif
+	  modH->xTransport = getTransport(modH->xTypeHW);
+	  if (modH->xTransport == NULL)
+	  {
+		  while(1); //ERROR select the type of hardware, and enable it in the ModbusConfig.h file
+	  }
+
+#if ENABLE_MB_TRACE == 1 || ENABLE_MB_STATS == 1 || ENABLE_MB_EVENT_LOG == 1 || ENABLE_MB_BENCH == 1 || \
+	(ENABLE_RX_MERGE == 1 && ENABLE_MB_ERR_STATS == 1) || ENABLE_MB_TURNAROUND == 1 || ENABLE_MB_MONITOR == 1 || \
+	ENABLE_MB_ARBITRATION == 1 || ENABLE_MB_PACING == 1 || ENABLE_MB_THROTTLE == 1 || ENABLE_MB_WCET == 1 || \
+	ENABLE_MB_RUNTIME == 1 || ((ENABLE_MB_FUZZ == 1 || ENABLE_MB_REPLAY == 1) && defined(DWT))
+	  // the trace stamps, the latencies, the events, the benchmark, the T1.5 gaps, the turnaround, the monitor,
+	  // the arbitration, the pacing, the CPU budget, the worst case runs, the fuzzed and the replayed frames
+	  // and the UART callback cycles read the cycle counter
+	  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
+	  if (modH->xTaskPriority != osPriorityNone)
+	  {
+		  xTaskAttr.priority = modH->xTaskPriority;
+	  }
+	  if (modH->u32TaskStack != 0)
+	  {
+#if ENABLE_MB_STATIC == 1
+		  while(1); //ERROR the static stack is MB_TASK_STACK bytes, set it in ModbusConfig.h
+#endif
+		  xTaskAttr.stack_size = modH->u32TaskStack;
+	  }
+
+#if ENABLE_MB_STATIC == 1
+	  // the control blocks live in the handler, nothing is taken from the heap
+#if ENABLE_MB_SHARED_TASK == 1
+	  xTaskAttr.cb_mem = &xModbusTaskCb;
+	  xTaskAttr.cb_size = sizeof(xModbusTaskCb);
+	  xTaskAttr.stack_mem = xModbusTaskStack;
+	  xTaskAttr.stack_size = sizeof(xModbusTaskStack);
+#else
+	  xTaskAttr.cb_mem = &modH->xTaskCb;
+	  xTaskAttr.cb_size = sizeof(modH->xTaskCb);
+	  xTaskAttr.stack_mem = modH->xTaskStack;
+	  xTaskAttr.stack_size = sizeof(modH->xTaskStack);
+#endif
+#if MB_ENABLE_MASTER == 1
+	  xQueueAttr.cb_mem = &modH->xQueueTelegramCb;
+	  xQueueAttr.cb_size = sizeof(modH->xQueueTelegramCb);
+#endif
+	  for (uint8_t i = 0; i < MB_SEMAPHORES; i++)
+	  {
+		  xSphrAttr[i].cb_mem = &modH->xSphrCb[i];
+		  xSphrAttr[i].cb_size = sizeof(modH->xSphrCb[i]);
+	  }
+#endif
+
+#if CRC_MODE == CRC_HARDWARE
+	  if(ModbusCRCHandle == NULL)
+	  {
+		  __HAL_RCC_CRC_CLK_ENABLE();
+		  ModbusCRCHandle = osMutexNew(&ModbusCRC_attributes);
+		  if(ModbusCRCHandle == NULL)
+		  {
+			  while(1); //Error creating the CRC mutex, check heap and stack size
+		  }
+	  }
+#endif
+
+	  //Initialize the ring buffer
+
+	  RingClear(&modH->xBufferRX);
+	  modH->xRxStart = true;
+	  modH->xRxDrop = false;
+#if ENABLE_RX_CRC == 1
+	  modH->u16RxCRC = 0xFFFF;
+#endif
+#if ENABLE_RX_PREDICT == 1
+	  modH->xRxEarly = false;
+#endif
+
+#if ENABLE_MB_SHARED_TASK == 1
+	  // one task for all the handlers, created with the first one
+	  if (xModbusTaskHandle == NULL)
+	  {
+		  xModbusTaskHandle = osThreadNew(StartTaskModbus, NULL, &xTaskAttr);
+	  }
+	  modH->myTaskModbusAHandle = xModbusTaskHandle;
+	  modH->u8Events = 0;
+#endif
+#if ENABLE_MB_ISR_DEFER == 1
+	  modH->u16DeferOps = 0;
+	  NVIC_SetPriority(MB_DEFER_IRQn, MB_DEFER_PRIO);
+	  NVIC_EnableIRQ(MB_DEFER_IRQn);
+#endif
 
+#if ENABLE_MB_MONITOR == 1
+	  if (modH->uModbusType == MB_MONITOR)
+	  {
+		  if (modH->xTypeHW != USART_HW_DMA_CIRC)
+		  {
+			  while(1); //ERROR a monitor captures the bus with the circular DMA of USART_HW_DMA_CIRC
+		  }
+#if ENABLE_MB_SHARED_TASK != 1
+		  modH->myTaskModbusAHandle = osThreadNew(StartTaskModbusMonitor, modH, &xTaskAttr);
+#endif
+		  memset(&modH->xMonitor, 0, sizeof(modbusMonitor_t));
+		  modH->xMonPending = false;
+		  modH->u8MonNext = 0;
+	  }
+	  else
+#endif
+#if MB_ENABLE_SLAVE == 1
+	  if(modH->uModbusType == MB_SLAVE)
+	  {
+#if ENABLE_MB_SHARED_TASK != 1
+		  //Create Modbus task slave
+		  modH->myTaskModbusAHandle = osThreadNew(StartTaskModbusSlave, modH, &xTaskAttr);
+#endif
+#if ENABLE_MB_RETAIN == 1
+		  modH->xRetained = checkRetain(modH);
+#endif
+	  }
+	  else
+#endif
+#if MB_ENABLE_MASTER == 1
+	  if (modH->uModbusType == MB_MASTER)
+	  {
+		  //Create Modbus task Master  and Queue for telegrams
+#if ENABLE_MB_SHARED_TASK != 1
+		  modH->myTaskModbusAHandle = osThreadNew(StartTaskModbusMaster, modH, &xTaskAttr);
+#endif
 
+#if ENABLE_MB_TIMER_MUX != 1 // else the timeout is a deadline of the shared timer
+#if ENABLE_MB_STATIC == 1
+		  modH->xTimerTimeout=xTimerCreateStatic("xTimerTimeout", modH->u16timeOut, pdFALSE, ( void * )modH->xTimerTimeout,
+						(TimerCallbackFunction_t) vTimerCallbackTimeout, &modH->xTimerTimeoutCb);
+#else
 		  modH->xTimerTimeout=xTimerCreate("xTimerTimeout",  // Just a text name, not used by the kernel.
 				  	  	modH->u16timeOut ,     		// The timer period in ticks.
 						pdFALSE,         // The timers will auto-reload themselves when they expire.
 						( void * )modH->xTimerTimeout,     // Assign each timer a unique id equal to its array index.
 						(TimerCallbackFunction_t) vTimerCallbackTimeout  // Each timer calls the same callback when it expires.
                   	  	);
+#endif
 
 		  if(modH->xTimerTimeout == NULL)
 		  {
 			  while(1); //error creating timer, check heap and stack size
 		  }
+#endif
 
 
-		  modH->QueueTelegramHandle = osMessageQueueNew (MAX_TELEGRAMS, sizeof(modbus_t), &QueueTelegram_attributes);
+		  modH->QueueTelegramHandle = osSemaphoreNew (MB_TELEGRAM_POOL, 0, &xQueueAttr);
+		  modH->u32TelegramFree = (1UL << MB_TELEGRAM_POOL) - 1;
+		  modH->i8TelegramSlot = -1;
+		  memset(modH->u8TelegramHead, 0, sizeof(modH->u8TelegramHead));
+		  memset(modH->u8TelegramCount, 0, sizeof(modH->u8TelegramCount));
 
 		  if(modH->QueueTelegramHandle == NULL)
 		  {
 			  while(1); //error creating queue for telegrams, check heap and stack size
 		  }
 
+#if ENABLE_MB_DEFERRED_DECODE == 1
+		  osThreadAttr_t xDecodeAttr = { .name = "TaskModbusDecode", .priority = (osPriority_t) MB_DECODE_PRIO, .stack_size = MB_DECODE_STACK };
+#if ENABLE_MB_STATIC == 1
+		  xDecodeAttr.cb_mem = &modH->xDecodeTaskCb;
+		  xDecodeAttr.cb_size = sizeof(modH->xDecodeTaskCb);
+		  xDecodeAttr.stack_mem = modH->xDecodeStack;
+		  xDecodeAttr.stack_size = sizeof(modH->xDecodeStack);
+#endif
+		  modH->u8DecodeHead = modH->u8DecodeTail = 0;
+		  modH->xDecodeTask = osThreadNew(StartTaskModbusDecode, modH, &xDecodeAttr);
+		  if (modH->xDecodeTask == NULL)
+		  {
+			  while(1); //error creating the decode task, check heap and stack size
+		  }
+#endif
+
 	  }
 	  else
+#endif
 	  {
-		  while(1); //Error Modbus type not supported choose a valid Type
+		  while(1); //Error Modbus type not supported or disabled in ModbusConfig.h, choose a valid Type
 	  }
 
 	  if  (modH->myTaskModbusAHandle == NULL)
@@ -216,27 +1466,100 @@ void ModbusInit(modbusHandler_t * modH)
 	  }
 
 
+#if ENABLE_MB_TIMER_MUX == 1
+	  if (xTimerMux.htim == NULL)
+	  {
+		  while(1); //Error ModbusSetTimer() must be called before ModbusInit()
+	  }
+#else
+#if ENABLE_MB_STATIC == 1
+	  modH->xTimerT35 = xTimerCreateStatic("TimerT35", T35, pdFALSE, ( void * )modH->xTimerT35,
+                                    (TimerCallbackFunction_t) vTimerCallbackT35, &modH->xTimerT35Cb);
+#else
 	  modH->xTimerT35 = xTimerCreate("TimerT35",         // Just a text name, not used by the kernel.
 		  	  	  	  	  	  	  	T35 ,     // The timer period in ticks.
                                     pdFALSE,         // The timers will auto-reload themselves when they expire.
 									( void * )modH->xTimerT35,     // Assign each timer a unique id equal to its array index.
                                     (TimerCallbackFunction_t) vTimerCallbackT35     // Each timer calls the same callback when it expires.
                                     );
+#endif
 	  if (modH->xTimerT35 == NULL)
 	  {
 		  while(1); //Error creating the timer, check heap and stack size
 	  }
+#endif
+
+#if ENABLE_MB_RX_QUEUE == 1
+	  modH->xRxQueue = NULL;
+	  if (modH->xTypeHW == USART_HW_DMA)
+	  {
+#if ENABLE_MB_STATIC == 1
+		  modH->xRxQueue = xMessageBufferCreateStatic(sizeof(modH->u8RxQueue), modH->u8RxQueue, &modH->xRxQueueCb);
+#else
+		  modH->xRxQueue = xMessageBufferCreate(MB_RX_QUEUE_BYTES + 1);
+#endif
+		  if (modH->xRxQueue == NULL)
+		  {
+			  while(1); //Error creating the message buffer, check heap size
+		  }
+	  }
+#endif
 
 
-	  modH->ModBusSphrHandle = osSemaphoreNew(1, 1, &ModBusSphr_attributes);
+	  modH->ModBusSphrHandle = osSemaphoreNew(1, 1, &xSphrAttr[0]);
 
 	  if(modH->ModBusSphrHandle == NULL)
 	  {
 		  while(1); //Error creating the semaphore, check heap and stack size
 	  }
 
-	  mHandlers[numberHandlers] = modH;
-	  numberHandlers++;
+#if MB_ENABLE_SLAVE == 1
+	  if (modH->uModbusType == MB_SLAVE)
+	  {
+		  // one semaphore per table, see getDataLock()
+		  modH->ModBusSphrROHandle = osSemaphoreNew(1, 1, &xSphrAttr[1]);
+		  modH->ModBusSphrCoilsHandle = osSemaphoreNew(1, 1, &xSphrAttr[2]);
+		  modH->ModBusSphrCoilsROHandle = osSemaphoreNew(1, 1, &xSphrAttr[3]);
+
+		  if(modH->ModBusSphrROHandle == NULL || modH->ModBusSphrCoilsHandle == NULL ||
+			 modH->ModBusSphrCoilsROHandle == NULL)
+		  {
+			  while(1); //Error creating the semaphore, check heap and stack size
+		  }
+	  }
+#endif
+
+#if ENABLE_MB_EVENT_LOG == 1 || ENABLE_MB_TIMER_MUX == 1 || ENABLE_MB_EVENT_RING == 1
+	  modH->u8Handler = u8Handler;
+#endif
+	  modH->xStopped = false;
+#if ENABLE_MB_RESP_CACHE == 1
+	  if (modH->uModbusType == MB_SLAVE)
+	  {
+		  memset(modH->xRespCache, 0, sizeof(modH->xRespCache)); // a handler initialized again has other tables
+		  modH->xRespFill = NULL;
+	  }
+#endif
+#if ENABLE_MB_EXC_CACHE == 1
+	  if (modH->uModbusType == MB_SLAVE)
+	  {
+		  memset(modH->u8ExcAdu, 0, sizeof(modH->u8ExcAdu)); // function code 0 is no exception, the entries are free
+		  modH->u8ExcNext = 0;
+	  }
+#endif
+
+#if ENABLE_MB_WIRE_STATS == 1
+	  memset(&modH->xWire, 0, sizeof(modbusWireStats_t));
+	  modH->xWireSince = xTaskGetTickCount();
+#endif
+
+	  // the callbacks see the handler once its slot is written, then its UART
+	  vTaskSuspendAll();
+	  mHandlers[u8Handler] = modH;
+	  __DMB();
+	  if (u8Handler == numberHandlers) numberHandlers++;
+	  publishPorts();
+	  xTaskResumeAll();
   }
   else
   {
@@ -259,1119 +1582,13716 @@ void ModbusInit(modbusHandler_t * modH)
 void ModbusStart(modbusHandler_t * modH)
 {
 
-	if(modH->xTypeHW != USART_HW && modH->xTypeHW != USART_HW_DMA )
+#if MB_ENABLE_SLAVE == 1
+	if (modH->uModbusType == MB_SLAVE && !checkSegments(modH->xSegHR, modH->u8SegHR_count))
 	{
-
-		while(1); //ERROR select the type of hardware
+		while(1); //ERROR the segments of xSegHR must be sorted by address and not overlap
 	}
 
-	if (modH->xTypeHW == USART_HW_DMA && ENABLE_USART_DMA == 0  )
+	if (modH->uModbusType == MB_SLAVE && !checkSegments(modH->xSegRO, modH->u8SegRO_count))
 	{
-		while(1); //ERROR To use USART_HW_DMA you need to enable it in the ModbusConfig.h file
+		while(1); //ERROR the segments of xSegRO must be sorted by address and not overlap
 	}
 
-
-
-	if (modH->xTypeHW == USART_HW || modH->xTypeHW ==  USART_HW_DMA )
+#if ENABLE_MB_RO_SNAPSHOT == 1
+	if (modH->uModbusType == MB_SLAVE && modH->u16regsROBank[0] != NULL && modH->xSegRO != NULL)
 	{
+		while(1); //ERROR the input registers are either snapshots or a sparse map
+	}
+#endif
 
-	      if (modH->EN_Port != NULL )
-          {
-              // return RS485 transceiver to transmit mode
-          	HAL_GPIO_WritePin(modH->EN_Port, modH->EN_Pin, GPIO_PIN_RESET);
-          }
-
-          if (modH->uModbusType == MB_SLAVE &&  modH->u16regsHR == NULL )
-          {
-          	while(1); //ERROR define the DATA pointer shared through Modbus
-          }
-
-          //check that port is initialized
-          while (HAL_UART_GetState(modH->port) != HAL_UART_STATE_READY)
-          {
+#if ENABLE_MB_HR_COMMIT == 1
+	if (modH->uModbusType == MB_SLAVE && modH->xHRBank != NULL && (modH->xSegHR != NULL || modH->u8UnitCount > 0
+#if ENABLE_MB_RETAIN == 1
+			|| modH->xRetain != NULL
+#endif
+			))
+	{
+		while(1); //ERROR the committed holding registers are one plain table, without sparse map, units or retained image
+	}
+#endif
 
-          }
+#if ENABLE_MB_DIAG_REGS == 1
+	if (modH->uModbusType == MB_SLAVE && modH->xSegRO == NULL && modH->u16regRO_size > MB_DIAG_START)
+	{
+		while(1); //ERROR the input registers reach the diagnostics block at MB_DIAG_START
+	}
+#endif
 
-#if ENABLE_USART_DMA ==1
-          if( modH->xTypeHW == USART_HW_DMA )
-          {
+	if (modH->uModbusType == MB_SLAVE &&  modH->u16regsHR == NULL && modH->xSegHR == NULL )
+	{
+		while(1); //ERROR define the DATA pointer shared through Modbus
+	}
 
+	if (modH->uModbusType == MB_SLAVE && modH->u8UnitCount > 0)
+	{
+		for (uint8_t i = 0; i < modH->u8UnitCount; i++)
+		{
+			if (!checkSegments(modH->xUnits[i].xSegHR, modH->xUnits[i].u8SegHR_count) ||
+				!checkSegments(modH->xUnits[i].xSegRO, modH->xUnits[i].u8SegRO_count))
+			{
+				while(1); //ERROR the segments of xUnits must be sorted by address and not overlap
+			}
+		}
+#if ENABLE_MB_RO_SNAPSHOT == 1
+		if (modH->u16regsROBank[0] != NULL)
+		{
+			while(1); //ERROR the input register snapshots only work with a single unit
+		}
+#endif
+		saveUnit(modH);
+	}
+#endif
 
-        	  if(HAL_UARTEx_ReceiveToIdle_DMA(modH->port, modH->xBufferRX.uxBuffer, MAX_BUFFER ) != HAL_OK)
-        	   {
-        	         while(1)
-        	         {
-        	                    	  //error in your initialization code
-        	         }
-        	   }
-        	  __HAL_DMA_DISABLE_IT(modH->port->hdmarx, DMA_IT_HT); // we don't need half-transfer interrupt
+	if(modH->u8id !=0 && modH->uModbusType == MB_MASTER )
+	{
+		while(1); //error Master ID must be zero
+	}
 
-          }
-          else{
+	if(modH->u8id ==0 && modH->uModbusType == MB_SLAVE )
+	{
+		while(1); //error Slave ID must be between 1 and 247
+	}
 
-        	  // Receive data from serial port for Modbus using interrupt
-        	  if(HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1) != HAL_OK)
-        	  {
-        	           while(1)
-        	           {
-        	                       	  //error in your initialization code
-        	           }
-        	  }
-          }
+	modH->xTransport->start(modH);
 
-#else
-          	  // Receive data from serial port for Modbus using interrupt
-          	  if(HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1) != HAL_OK)
-          	  {
-          		  while(1)
-          		  {
-          			  //error in your initialization code
-          		  }
-          	  }
-#endif
-
-          if(modH->u8id !=0 && modH->uModbusType == MB_MASTER )
-          {
-        	  while(1)
-        	  {
-        	     	  //error Master ID must be zero
-        	  }
-          }
-
-          if(modH->u8id ==0 && modH->uModbusType == MB_SLAVE )
-          {
-             	  while(1)
-               	  {
-                  	     	  //error Master ID must be zero
-               	  }
-           }
-	}
-
-    modH->u8lastRec = modH->u8BufferSize = 0;
+    modH->u8lastRec = modH->u16BufferSize = 0;
     modH->u16InCnt = modH->u16OutCnt = modH->u16errCnt = 0;
+#if ENABLE_MB_THROTTLE == 1
+    if (modH->uModbusType == MB_SLAVE) startThrottle(modH);
+#endif
+#if ENABLE_MB_RETAIN == 1
+    if (modH->uModbusType == MB_SLAVE && modH->xRetain != NULL)
+    {
+    	if (modH->xRetained) restoreRetain(modH); // the counters of before the reset
+    	sealRetain(modH, true); // the tables set by the application are the image from now on
+    }
+#endif
 
 }
 
-void vTimerCallbackT35(TimerHandle_t *pxTimer)
+/**
+ * @brief
+ * Quiesces a serial handler without giving up its mHandlers slot. The call waits
+ * for the query or answer in progress, then aborts the UART reception and the
+ * DMA, stops T35 and drops the received bytes. The handler keeps ModBusSphrHandle,
+ * a master query fails with its timeout, until ModbusReconfigure() restarts it.
+ * Call it from an application task, not from the segment or write callbacks
+ *
+ * @ingroup setup
+ */
+void ModbusStop(modbusHandler_t *modH)
 {
-	//Notify that a stream has just arrived
-	int i;
-	//TimerHandle_t aux;
-	for(i = 0; i < numberHandlers; i++)
+	if ((modH->xTransport->u8Flags & MB_TP_UART) == 0)
 	{
+		while(1); //ERROR only the serial lines can be stopped and reconfigured
+	}
+	if (modH->xStopped) return;
 
-		if( (TimerHandle_t *)mHandlers[i]->xTimerT35 ==  pxTimer ){
-			if(mHandlers[i]->uModbusType == MB_MASTER)
-			{
-				xTimerStop(mHandlers[i]->xTimerTimeout,0);
-			}
-			xTaskNotify(mHandlers[i]->myTaskModbusAHandle, 0, eSetValueWithOverwrite);
-		}
-
+	xSemaphoreTake(modH->ModBusSphrHandle, portMAX_DELAY); // no query from now on
+	modH->xStopped = true; // no answer either, see sendTxBuffer()
+#if ENABLE_MB_TDMA == 1
+	if (modH->uModbusType == MB_MASTER && modH->u8SchedCount != 0)
+	{
+		// no slot starts either, the master task restarts the cycle after ModbusReconfigure()
+		modH->xSchedRun = false;
+		cancelModbusTimer(modH, MB_TIMER_TIMEOUT);
+		xTaskNotifyGive((TaskHandle_t)modH->myTaskModbusAHandle);
+	}
+#endif
+	for (uint8_t i = 0; i < 250 && modH->port->gState != HAL_UART_STATE_READY; i++)
+	{
+		vTaskDelay(1); // the answer in progress ends first
 	}
+
+	quiesceLine(modH);
 }
 
-void vTimerCallbackTimeout(TimerHandle_t *pxTimer)
+/**
+ * @brief
+ * Aborts the UART reception, transmission and DMA of a serial handler, stops T35,
+ * returns the RS485 transceiver to receive mode and drops the received bytes
+ *
+ * @ingroup setup
+ */
+static void quiesceLine(modbusHandler_t *modH)
 {
-	//Notify that a stream has just arrived
-	int i;
-	//TimerHandle_t aux;
-	for(i = 0; i < numberHandlers; i++)
+	HAL_UART_Abort(modH->port);
+	stopT35(modH);
+	if (modH->EN_Port != NULL)
 	{
-
-		if( (TimerHandle_t *)mHandlers[i]->xTimerTimeout ==  pxTimer ){
-				xTaskNotify(mHandlers[i]->myTaskModbusAHandle, ERR_TIME_OUT, eSetValueWithOverwrite);
-		}
-
+		HAL_GPIO_WritePin(modH->EN_Port, modH->EN_Pin, GPIO_PIN_RESET);
 	}
 
+	RingClear(&modH->xBufferRX);
+	modH->xRxStart = true;
+	modH->xRxDrop = false;
+	modH->u16BufferSize = 0;
 }
 
+#if ENABLE_MB_WATCHDOG == 1
+/**
+ * @brief
+ * Resets the serial line of a handler found stuck: quiesceLine(), then the UART is
+ * deinitialised and initialised again with its settings, its MSP (with the DMA
+ * channels) too, and the reception restarts as in ModbusStart(). Other transports
+ * are left as they are. Counted in u32Recoveries
+ *
+ * @ingroup setup
+ */
+static void recoverLine(modbusHandler_t *modH)
+{
+	modH->u32Recoveries++;
+	if ((modH->xTransport->u8Flags & MB_TP_UART) == 0 || modH->xStopped) return;
+
+	quiesceLine(modH);
+	HAL_UART_DeInit(modH->port);
+	if (HAL_UART_Init(modH->port) != HAL_OK) return; // the next expiry tries again
+	modH->xTransport->start(modH);
+}
+#endif
 
-void StartTaskModbusSlave(void *argument)
+/**
+ * @brief
+ * Applies new line settings and a new ID to a serial handler, then restarts it as
+ * ModbusStart() does: T1.5, T3.5 and the turnaround times follow the new baud rate.
+ * The word length keeps the data bits of the port with the new parity bit.
+ * Stops the handler first when ModbusStop() was not called
+ *
+ * @param u32Baud  new baud rate, 0 keeps the current one
+ * @param u32Parity  UART_PARITY_NONE, UART_PARITY_EVEN or UART_PARITY_ODD
+ * @param u8id  slave ID 1 to 247, 0 for a master
+ * @return false if the HAL refused the settings, the handler then stays stopped
+ * @ingroup setup
+ */
+bool ModbusReconfigure(modbusHandler_t *modH, uint32_t u32Baud, uint32_t u32Parity, uint8_t u8id)
 {
+	if ((modH->uModbusType == MB_MASTER) != (u8id == 0) || u8id > 247) return false;
 
-  modbusHandler_t *modH =  (modbusHandler_t *)argument;
-  //uint32_t notification;
-  for(;;)
-  {
+	ModbusStop(modH);
 
-	modH->i8lastError = 0;
+	if (u32Baud != 0) modH->port->Init.BaudRate = u32Baud;
+	modH->port->Init.WordLength = getWordLength(modH->port, u32Parity);
+	modH->port->Init.Parity = u32Parity;
+	if (HAL_UART_Init(modH->port) != HAL_OK) return false;
 
+	modH->u8id = u8id;
+#if MB_ENABLE_SLAVE == 1
+	if (modH->uModbusType == MB_SLAVE && modH->u8UnitCount > 0)
+	{
+		modH->xUnitMain.u8id = u8id;
+	}
+#endif
 
-   if(modH->xTypeHW == USART_HW || modH->xTypeHW == USART_HW_DMA)
-   {
+	modH->xTransport->start(modH);
+	modH->xStopped = false;
+	xSemaphoreGive(modH->ModBusSphrHandle);
+	return true;
+}
 
-	  ulTaskNotifyTake(pdTRUE, portMAX_DELAY); /* Block until a Modbus Frame arrives */
+/**
+ * @brief
+ * Removes a serial handler: ModbusStop(), then its slot of mHandlers and its UART
+ * leave the maps of the callbacks, its task, timers and semaphores are deleted.
+ * The slot is free for the next ModbusInit(), and the handler may be initialized
+ * again with new settings. The application must no longer use its tables
+ * (ModbusLock()) or queue telegrams. Call it from an application task
+ *
+ * @ingroup setup
+ */
+void ModbusDeInit(modbusHandler_t *modH)
+{
+	uint8_t u8Handler = 0;
 
-	  if (getRxBuffer(modH) == ERR_BUFF_OVERFLOW)
-	  {
-	      modH->i8lastError = ERR_BUFF_OVERFLOW;
-	   	  modH->u16errCnt++;
-		  continue;
-	  }
-   }
+	while (u8Handler < numberHandlers && mHandlers[u8Handler] != modH)
+	{
+		u8Handler++;
+	}
+	if (u8Handler == numberHandlers)
+	{
+		while(1); //ERROR the handler was not initialized
+	}
 
-   if (modH->u8BufferSize < 7)
-   {
-      //The size of the frame is invalid
-      modH->i8lastError = ERR_BAD_SIZE;
-      modH->u16errCnt++;
+	ModbusStop(modH);
+#if ENABLE_MB_TIMER_MUX == 1
+	cancelModbusTimer(modH, MB_TIMER_TIMEOUT);
+#endif
 
-	  continue;
-    }
+	// no callback finds the handler from now on, a slot emptied on top shortens the scans
+	vTaskSuspendAll();
+	mHandlers[u8Handler] = NULL;
+	while (numberHandlers > 0 && mHandlers[numberHandlers - 1] == NULL)
+	{
+		numberHandlers--;
+	}
+	publishPorts();
+	xTaskResumeAll();
+
+#if ENABLE_MB_SHARED_TASK != 1
+	osThreadTerminate(modH->myTaskModbusAHandle);
+#endif
+	modH->myTaskModbusAHandle = NULL;
+#if ENABLE_MB_TIMER_MUX != 1
+	xTimerDelete(modH->xTimerT35, portMAX_DELAY);
+#endif
+#if ENABLE_MB_RX_QUEUE == 1 && ENABLE_MB_STATIC != 1
+	if (modH->xRxQueue != NULL) vMessageBufferDelete(modH->xRxQueue);
+#endif
+#if MB_ENABLE_MASTER == 1
+	if (modH->uModbusType == MB_MASTER)
+	{
+#if ENABLE_MB_TIMER_MUX != 1
+		xTimerDelete(modH->xTimerTimeout, portMAX_DELAY);
+#endif
+		osSemaphoreDelete(modH->QueueTelegramHandle);
+#if ENABLE_MB_DEFERRED_DECODE == 1
+		osThreadTerminate(modH->xDecodeTask);
+		modH->xDecodeTask = NULL;
+#endif
+	}
+#endif
+#if MB_ENABLE_SLAVE == 1
+	if (modH->uModbusType == MB_SLAVE)
+	{
+		osSemaphoreDelete(modH->ModBusSphrROHandle);
+		osSemaphoreDelete(modH->ModBusSphrCoilsHandle);
+		osSemaphoreDelete(modH->ModBusSphrCoilsROHandle);
+	}
+#endif
+	osSemaphoreDelete(modH->ModBusSphrHandle); // ModbusStop() kept it
+}
+
+#if ENABLE_MB_AUTOBAUD == 1
+/* rates tried by ModbusAutoBaud() without a table, the most common first */
+static const uint32_t u32AutoBaudRates[] = { 19200, 9600, 38400, 57600, 115200, 4800, 2400, 1200 };
 
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Finds the baud rate of the bus: the slave is reconfigured to each rate of u32Rates
+ * in turn and listens for xDwell ticks, until a request for its ID (or a broadcast)
+ * arrives with a good CRC. The slave answers it as usual and keeps that rate.
+ * The parity of the port is kept. Blocks the calling application task
+ *
+ * @param u32Rates  rates to try, NULL for 19200, 9600, 38400, 57600, 115200, 4800, 2400 and 1200
+ * @param u8Rates  size of u32Rates
+ * @param xDwell  ticks listened at each rate, longer than the poll cycle of the master
+ * @param u8Sweeps  passes over u32Rates, 0 until a rate is found
+ * @return the rate found, 0 if none: the port is then back at its rate of before
+ * @ingroup setup
+ */
+uint32_t ModbusAutoBaud(modbusHandler_t *modH, const uint32_t *u32Rates, uint8_t u8Rates, TickType_t xDwell, uint8_t u8Sweeps)
+{
+	uint32_t u32Before = modH->port->Init.BaudRate;
 
-   // check slave id
-    if ( modH->u8Buffer[ID] !=  modH->u8id)
+	if (modH->uModbusType != MB_SLAVE)
 	{
-    	continue;
+		while(1); //ERROR only a slave detects the rate of the bus
+	}
+	if (u32Rates == NULL)
+	{
+		u32Rates = u32AutoBaudRates;
+		u8Rates = sizeof(u32AutoBaudRates) / sizeof(u32AutoBaudRates[0]);
 	}
 
-	// validate message: CRC, FCT, address and size
-    uint8_t u8exception = validateRequest(modH);
-	if (u8exception > 0)
+	for (uint8_t s = 0; u8Sweeps == 0 || s < u8Sweeps; s++)
 	{
-	    if (u8exception != ERR_TIME_OUT)
+		for (uint8_t i = 0; i < u8Rates; i++)
 		{
-		    buildException( u8exception, modH);
-			sendTxBuffer(modH);
+			if (!ModbusReconfigure(modH, u32Rates[i], modH->port->Init.Parity, modH->u8id)) continue;
+			modH->u16BaudHits = 0;
+
+			for (TickType_t t = 0; t < xDwell; t++)
+			{
+				vTaskDelay(1);
+				if (modH->u16BaudHits != 0) return u32Rates[i];
+			}
 		}
-		modH->i8lastError = u8exception;
-		//return u8exception
+	}
 
-		continue;
-	 }
+	ModbusReconfigure(modH, u32Before, modH->port->Init.Parity, modH->u8id);
+	return 0;
+}
+#endif
 
-	 modH->i8lastError = 0;
-	xSemaphoreTake(modH->ModBusSphrHandle , portMAX_DELAY); //before processing the message get the semaphore
+/**
+ * @brief
+ * Stops T35 of a stopped handler, the received bytes restart it
+ *
+ * @ingroup setup
+ */
+static void stopT35(modbusHandler_t *modH)
+{
+#if ENABLE_MB_TIMER_MUX == 1
+	cancelModbusTimer(modH, MB_TIMER_T35);
+#else
+	xTimerStop(modH->xTimerT35, 0);
+#endif
+#if ENABLE_TIM_T35 == 1
+	if (modH->xTimT35 != NULL && modH->u8TimT35Channel != 0)
+	{
+		taskENTER_CRITICAL();
+		modH->xTimT35->Instance->DIER &= ~(TIM_DIER_CC1IE << (modH->u8TimT35Channel - 1));
+		taskEXIT_CRITICAL();
+	}
+	else if (modH->xTimT35 != NULL)
+	{
+		__HAL_TIM_DISABLE(modH->xTimT35);
+	}
+#endif
+#if ENABLE_LPTIM_T35 == 1
+	if (modH->xLptimT35 != NULL)
+	{
+		modH->xLptimT35->CR = 0;
+		modH->xLpArmed = false;
+	}
+#endif
+}
 
-	 // process message
-	 switch(modH->u8Buffer[ FUNC ] )
-	 {
-			case MB_FC_READ_COILS:
-				modH->i8state = process_FC1(modH,DB_COILS);
-				break;
-			case MB_FC_READ_DISCRETE_INPUT:
-				modH->i8state = process_FC1(modH,DB_INPUT_COILS);
-				break;
-			case MB_FC_READ_REGISTERS:
-				modH->i8state = process_FC3(modH,DB_HOLDING_REGISTER);
-				break;
-			case MB_FC_READ_INPUT_REGISTER:
-				modH->i8state = process_FC3(modH,DB_INPUT_REGISTERS);
-				break;
-			case MB_FC_WRITE_COIL:
-				modH->i8state = process_FC5(modH);
-				break;
-			case MB_FC_WRITE_REGISTER :
-				modH->i8state = process_FC6(modH);
-				break;
-			case MB_FC_WRITE_MULTIPLE_COILS:
-				modH->i8state = process_FC15(modH);
-				break;
-			case MB_FC_WRITE_MULTIPLE_REGISTERS :
-				modH->i8state = process_FC16(modH);
-				break;
-			default:
-				break;
-	 }
+/**
+ * @brief
+ * Word length of the HAL for the data bits of the port followed by u32Parity,
+ * the HAL counts the parity bit in the word length
+ *
+ * @return UART_WORDLENGTH_xB
+ * @ingroup setup
+ */
+static uint32_t getWordLength(UART_HandleTypeDef *port, uint32_t u32Parity)
+{
+	uint32_t u32Bits = (port->Init.WordLength == UART_WORDLENGTH_9B) ? 9 : 8;
+#ifdef UART_WORDLENGTH_7B
+	if (port->Init.WordLength == UART_WORDLENGTH_7B) u32Bits = 7;
+#endif
+	if (port->Init.Parity != UART_PARITY_NONE) u32Bits--; // the data bits
+	if (u32Parity != UART_PARITY_NONE) u32Bits++;
 
+	if (u32Bits >= 9) return UART_WORDLENGTH_9B;
+#ifdef UART_WORDLENGTH_7B
+	if (u32Bits <= 7) return UART_WORDLENGTH_7B;
+#endif
+	return UART_WORDLENGTH_8B;
+}
 
-	 xSemaphoreGive(modH->ModBusSphrHandle); //Release the semaphore
+/**
+ * @brief
+ * Part of ModbusStart() common to the serial lines: returns the RS485 transceiver
+ * to reception, waits for the port and sets up the hardware DE
+ *
+ * @ingroup setup
+ */
+static void startUart(modbusHandler_t *modH)
+{
+	if (modH->EN_Port != NULL )
+	{
+		// return RS485 transceiver to transmit mode
+		HAL_GPIO_WritePin(modH->EN_Port, modH->EN_Pin, GPIO_PIN_RESET);
+	}
 
-	 continue;
+	//check that port is initialized
+	while (HAL_UART_GetState(modH->port) != HAL_UART_STATE_READY)
+	{
 
-   }
+	}
 
+#if ENABLE_USART_DE == 1
+	if (modH->xHwDE)
+	{
+		if (modH->EN_Port != NULL)
+		{
+			while(1); //ERROR hardware DE and the EN_Port/EN_Pin software DE are exclusive
+		}
+		setHardwareDE(modH);
+	}
+#endif
 }
 
-
-
-void ModbusQuery(modbusHandler_t * modH, modbus_t telegram )
+/**
+ * @brief
+ * Starts a USART_HW line: T35 from the port settings, then one RX interrupt
+ * per byte, or per FIFO threshold with the receiver timeout
+ *
+ * @ingroup setup
+ */
+static void startUartIT(modbusHandler_t *modH)
 {
-	//Add the telegram to the TX tail Queue of Modbus
-	if (modH->uModbusType == MB_MASTER)
+	startUart(modH);
+	setCharTiming(modH);
+#if ENABLE_MB_RX_MUTE == 1
+	enableRxMute(modH);
+#endif
+#if ENABLE_USART_RTO == 1
+	// T35 detected by the USART, the software timer is kept for LPUARTs
+	HAL_UART_ReceiverTimeout_Config(modH->port, getT35Bits(modH->port));
+	modH->xRTO = (HAL_UART_EnableReceiverTimeout(modH->port) == HAL_OK);
+	if(modH->xRTO)
 	{
-	telegram.u32CurrentTask = (uint32_t *) osThreadGetId();
-	xQueueSendToBack(modH->QueueTelegramHandle, &telegram, 0);
+		__HAL_UART_ENABLE_IT(modH->port, UART_IT_RTO);
 	}
-	else{
-		while(1);// error a slave cannot send queries as a master
+#endif
+#if ENABLE_USART_FIFO == 1
+	// one interrupt per FIFO threshold, the receiver timeout flushes the rest of the frame
+	modH->xFIFO = modH->xRTO && IS_UART_FIFO_INSTANCE(modH->port->Instance);
+	if(modH->xFIFO)
+	{
+		if(HAL_UARTEx_SetRxFifoThreshold(modH->port, USART_FIFO_THRESHOLD) != HAL_OK ||
+		   HAL_UARTEx_EnableFifoMode(modH->port) != HAL_OK ||
+		   modH->port->NbRxDataToProcess > MB_FIFO_BLOCK ||
+		   HAL_UART_Receive_IT(modH->port, modH->u8FifoRx, modH->port->NbRxDataToProcess) != HAL_OK)
+		{
+			while(1)
+			{
+				//error in your initialization code
+			}
+		}
+	}
+	else
+#endif
+	// Receive data from serial port for Modbus using interrupt
+	if(HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1) != HAL_OK)
+	{
+		while(1)
+		{
+			//error in your initialization code
+		}
 	}
 }
 
+#if ENABLE_MB_RX_MUTE == 1
+/**
+ * @brief
+ * Lets the receiver of a slave be muted by muteRx() up to the next idle line:
+ * idle line wake-up, and the mute mode enabled on the USARTs that have it
+ *
+ * @ingroup setup
+ */
+static void enableRxMute(modbusHandler_t *modH)
+{
+	USART_TypeDef *xUsart = modH->port->Instance;
 
+	if (modH->uModbusType != MB_SLAVE) return;
+#ifdef USART_CR1_MME
+	CLEAR_BIT(xUsart->CR1, USART_CR1_UE); // WAKE is written with the USART disabled
+	CLEAR_BIT(xUsart->CR1, USART_CR1_WAKE);
+	SET_BIT(xUsart->CR1, USART_CR1_MME | USART_CR1_UE);
+#else
+	CLEAR_BIT(xUsart->CR1, USART_CR1_WAKE);
+#endif
+}
+#endif
 
-void ModbusQueryInject(modbusHandler_t * modH, modbus_t telegram )
+#if ENABLE_MB_ASCII == 1
+/**
+ * @brief
+ * Starts an ASCII_HW line: one RX interrupt per character, the frames are
+ * delimited by ':' and CRLF so T35 is not used
+ *
+ * @ingroup setup
+ */
+static void startAscii(modbusHandler_t *modH)
 {
-	//Add the telegram to the TX head Queue of Modbus
-	xQueueReset(modH->QueueTelegramHandle);
-	telegram.u32CurrentTask = (uint32_t *) osThreadGetId();
-	xQueueSendToFront(modH->QueueTelegramHandle, &telegram, 0);
+	startUart(modH);
+	modH->xAsciiFrame = false;
+	if(HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1) != HAL_OK)
+	{
+		while(1)
+		{
+			//error in your initialization code
+		}
+	}
 }
+#endif
 
-
+#if ENABLE_LPUART == 1
 /**
  * @brief
- * *** Only Modbus Master ***
- * Generate a query to an slave with a modbus_t telegram structure
- * The Master must be in COM_IDLE mode. After it, its state would be COM_WAITING.
- * This method has to be called only in loop() section.
+ * Starts an LPUART_HW line: like USART_HW with one RX interrupt per byte, and
+ * the port wakes the MCU from Stop mode on MB_LPUART_WAKEUP. The kernel clock
+ * of the LPUART must run in Stop mode (LSE up to 9600 bps, or HSI)
  *
- * @see modbus_t
- * @param modH  modbus handler
- * @param modbus_t  modbus telegram structure (id, fct, ...)
- * @ingroup loop
+ * @ingroup setup
  */
-int8_t SendQuery(modbusHandler_t *modH ,  modbus_t telegram )
+static void startLpuart(modbusHandler_t *modH)
 {
+	UART_WakeUpTypeDef xWakeUp = {0};
 
-
-	uint8_t u8regsno, u8bytesno;
-	uint8_t  error = 0;
-	xSemaphoreTake(modH->ModBusSphrHandle , portMAX_DELAY); //before processing the message get the semaphore
-
-	if (modH->u8id!=0) error = ERR_NOT_MASTER;
-	if (modH->i8state != COM_IDLE) error = ERR_POLLING ;
-	if ((telegram.u8id==0) || (telegram.u8id>247)) error = ERR_BAD_SLAVE_ID;
-
-
-	if(error)
+#ifdef IS_LPUART_INSTANCE
+	if (!IS_LPUART_INSTANCE(modH->port->Instance))
 	{
-		 modH->i8lastError = error;
-		 xSemaphoreGive(modH->ModBusSphrHandle);
-		 return error;
+		while(1); //ERROR LPUART_HW needs an LPUART port, use USART_HW for the other ones
 	}
+#endif
+	startUart(modH);
+	setCharTiming(modH);
+#if ENABLE_MB_RX_MUTE == 1
+	enableRxMute(modH);
+#endif
 
-
-	if (telegram.u8fct == MB_FC_READ_COILS || telegram.u8fct == MB_FC_READ_DISCRETE_INPUT ||
-		telegram.u8fct == MB_FC_WRITE_COIL || telegram.u8fct == MB_FC_WRITE_MULTIPLE_COILS)
+	xWakeUp.WakeUpEvent = MB_LPUART_WAKEUP;
+	if(HAL_UARTEx_StopModeWakeUpSourceConfig(modH->port, xWakeUp) != HAL_OK ||
+	   HAL_UARTEx_EnableStopMode(modH->port) != HAL_OK)
 	{
-		modH->u16regsCoils = telegram.u16reg;
+		while(1)
+		{
+			//error in your initialization code
+		}
 	}
-	else if (telegram.u8fct == MB_FC_READ_REGISTERS || telegram.u8fct == MB_FC_READ_INPUT_REGISTER ||
-			telegram.u8fct == MB_FC_WRITE_REGISTER || telegram.u8fct == MB_FC_WRITE_MULTIPLE_REGISTERS)
+	__HAL_UART_ENABLE_IT(modH->port, UART_IT_WUF);
+
+	if(HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1) != HAL_OK)
 	{
-		modH->u16regsHR = telegram.u16reg;
+		while(1)
+		{
+			//error in your initialization code
+		}
 	}
+}
 
-	// telegram header
-	modH->u8Buffer[ ID ]         = telegram.u8id;
-	modH->u8Buffer[ FUNC ]       = telegram.u8fct;
-	modH->u8Buffer[ ADD_HI ]     = highByte(telegram.u16RegAdd );
-	modH->u8Buffer[ ADD_LO ]     = lowByte( telegram.u16RegAdd );
+/**
+ * @brief
+ * Tells the tickless idle of FreeRTOS whether Stop mode may be entered: every
+ * Modbus handler is an LPUART_HW port with no frame on the line.
+ * Call it from configPRE_SLEEP_PROCESSING() and keep Sleep mode when it is false
+ *
+ * @return true when Stop mode does not lose a frame
+ * @ingroup setup
+ */
+bool ModbusLowPowerReady(void)
+{
+	modbusHandler_t *modH;
 
-	switch( telegram.u8fct )
+	for (uint8_t i = 0; i < numberHandlers; i++)
 	{
-	case MB_FC_READ_COILS:
-	case MB_FC_READ_DISCRETE_INPUT:
-	case MB_FC_READ_REGISTERS:
-	case MB_FC_READ_INPUT_REGISTER:
-	    modH->u8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
-	    modH->u8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-	    modH->u8BufferSize = 6;
-	    break;
-	case MB_FC_WRITE_COIL:
-	    modH->u8Buffer[ NB_HI ]      = (( telegram.u16reg[0]> 0) ? 0xff : 0);
-	    modH->u8Buffer[ NB_LO ]      = 0;
-	    modH->u8BufferSize = 6;
-	    break;
-	case MB_FC_WRITE_REGISTER:
-	    modH->u8Buffer[ NB_HI ]      = highByte( telegram.u16reg[0]);
-	    modH->u8Buffer[ NB_LO ]      = lowByte( telegram.u16reg[0]);
-	    modH->u8BufferSize = 6;
-	    break;
-	case MB_FC_WRITE_MULTIPLE_COILS: // TODO: implement "sending coils"
-	    u8regsno = telegram.u16CoilsNo / 16;
-	    u8bytesno = u8regsno * 2;
-	    if ((telegram.u16CoilsNo % 16) != 0)
-	    {
-	        u8bytesno++;
-	        u8regsno++;
-	    }
-
-	    modH->u8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
-	    modH->u8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-	    modH->u8Buffer[ BYTE_CNT ]    = u8bytesno;
-	    modH->u8BufferSize = 7;
-
-	    for (uint16_t i = 0; i < u8bytesno; i++)
-	    {
-	        if(i%2)
-	        {
-	        	modH->u8Buffer[ modH->u8BufferSize ] = lowByte( telegram.u16reg[ i/2 ] );
-	        }
-	        else
-	        {
-	        	modH->u8Buffer[  modH->u8BufferSize ] = highByte( telegram.u16reg[ i/2 ] );
+		modH = mHandlers[i];
+		if (modH == NULL) continue; // slot freed by ModbusDeInit()
+		if (modH->xTypeHW != LPUART_HW) return false; // the other ports are not clocked in Stop mode
+		if (modH->port->gState != HAL_UART_STATE_READY) return false; // answer still on the line
+#if ENABLE_LPTIM_T35 == 1
+		if (modH->xLptimT35 != NULL)
+		{
+			if (modH->xLpArmed) return false; // T35 of a frame in progress
+			continue;
+		}
+#endif
+#if ENABLE_MB_TIMER_MUX == 1
+		if (isModbusTimerArmed(modH, MB_TIMER_T35)) return false;
+#else
+		if (xTimerIsTimerActive(modH->xTimerT35) != pdFALSE) return false;
+#endif
+	}
+	return true;
+}
+#endif
 
-	        }
-	        modH->u8BufferSize++;
+#if ENABLE_MB_TICKLESS == 1
+/**
+ * @brief
+ * True when an interrupt of the handler may start a FreeRTOS timer: a USART_HW
+ * or LPUART_HW byte restarting xTimerT35, a USART_HW_DMA fragment merged until
+ * T35, or the end of a transmission starting the answer timeout. Woken from a
+ * sleep with the ticks suppressed, the interrupt runs before the kernel steps
+ * the tick count and the timer would expire as soon as it is started
+ *
+ * @ingroup setup
+ */
+static bool needsTicks(modbusHandler_t *modH)
+{
+	switch (modH->xTypeHW)
+	{
+	case USART_HW:
+	case LPUART_HW:
+		if (modH->port->gState != HAL_UART_STATE_READY) return true;
+#if ENABLE_USART_RTO == 1
+		if (modH->xRTO) return false;
+#endif
+#if ENABLE_TIM_T35 == 1
+		if (modH->xTimT35 != NULL) return false;
+#endif
+#if ENABLE_LPTIM_T35 == 1
+		if (modH->xLptimT35 != NULL) return false;
+#endif
+		break;
+	case USART_HW_DMA:
+	case USART_HW_DMA_CIRC:
+		if (modH->port->gState != HAL_UART_STATE_READY) return true;
+#if ENABLE_RX_MERGE == 1
+		break;
+#else
+		return false; // the IDLE event ends the frame
+#endif
+	case ASCII_HW:
+		return (modH->port->gState != HAL_UART_STATE_READY); // the LF ends the frame
+	default:
+		return false;
+	}
+#if ENABLE_MB_TIMER_MUX == 1
+	return false; // T35 is a compare of the hardware timer
+#else
+	return true;
+#endif
+}
+
+/**
+ * @brief
+ * Keeps the period of the requests a slave receives for its node, the poll
+ * period of its master
+ *
+ * @ingroup loop
+ */
+static void notePoll(modbusHandler_t *modH)
+{
+	TickType_t xNow = xTaskGetTickCount();
+
+	modH->xPollPeriod = (modH->xPollLast != 0) ? xNow - modH->xPollLast : 0;
+	modH->xPollLast = xNow;
+}
+
+/**
+ * @brief
+ * Hook of the tickless idle of FreeRTOS, call it from configPRE_SLEEP_PROCESSING(x)
+ * with its x. The sleep is cancelled (x set to 0) while a handler needs the ticks:
+ * a frame is being sent, or a serial port detects T35 with xTimerT35 instead of the
+ * USART receiver timeout, an LPTIM or a hardware timer. Otherwise x is shortened
+ * to the ticks before the next request a slave expects from the period of its polls,
+ * for the power manager to pick the sleep depth, and the first byte of a frame
+ * wakes the MCU with the ticks suppressed meanwhile
+ *
+ * @param pxIdle expected idle ticks of FreeRTOS, updated for the handlers
+ * @return MB_SLEEP_NONE, MB_SLEEP_IDLE (Sleep mode) or MB_SLEEP_STOP (Stop mode)
+ * @ingroup setup
+ */
+uint8_t ModbusSleepHint(TickType_t *pxIdle)
+{
+	modbusHandler_t *modH;
+	TickType_t xNow = xTaskGetTickCount();
+	TickType_t xGone;
+
+	for (uint8_t i = 0; i < numberHandlers; i++)
+	{
+		modH = mHandlers[i];
+		if (modH == NULL) continue; // slot freed by ModbusDeInit()
+		if (needsTicks(modH))
+		{
+			*pxIdle = 0;
+			return MB_SLEEP_NONE;
+		}
+		if (modH->uModbusType == MB_SLAVE && modH->xPollPeriod != 0)
+		{
+			xGone = xNow - modH->xPollLast;
+			if (xGone < modH->xPollPeriod && modH->xPollPeriod - xGone < *pxIdle) *pxIdle = modH->xPollPeriod - xGone;
+		}
+	}
+#if ENABLE_LPUART == 1
+	return ModbusLowPowerReady() ? MB_SLEEP_STOP : MB_SLEEP_IDLE;
+#else
+	return MB_SLEEP_IDLE;
+#endif
+}
+#endif
+
+#if ENABLE_MB_MPU == 1
+/**
+ * @brief
+ * Programs an ARMv7-M MPU region over memory shared with the library, a table
+ * or the buffers of the handlers in MB_DMA_SECTION, never executable. The region
+ * is u32Size rounded up to a power of two (MB_MPU_SIZE()) and its base must be
+ * aligned to that size (MB_MPU_ALIGN()). The MPU is enabled with the default map
+ * for privileged code if it was off. Call it before the scheduler starts
+ *
+ * @param u8Region MPU region number, a higher number wins where regions overlap
+ * @param u8Access ARM_MPU_AP_FULL, ARM_MPU_AP_URO (read only for unprivileged code) or ARM_MPU_AP_PRIV
+ * @return false when the region does not exist or the base is not aligned
+ * @ingroup setup
+ */
+bool ModbusMpuRegion(uint8_t u8Region, const void *pvBase, uint32_t u32Size, uint8_t u8Access)
+{
+	uint32_t u32Base = (uint32_t)(uintptr_t)pvBase;
+	uint8_t u8Log = 5; // 32 bytes at least
+
+	if (u32Size == 0 || u8Region >= ((MPU->TYPE & MPU_TYPE_DREGION_Msk) >> MPU_TYPE_DREGION_Pos)) return false;
+	while (u8Log < 32 && (1UL << u8Log) < u32Size) u8Log++;
+	if (u8Log < 32 && (u32Base & ((1UL << u8Log) - 1)) != 0) return false;
+
+	__DMB();
+	// normal memory, write-back: the same attributes as the default map of the SRAM
+	ARM_MPU_SetRegionEx(u8Region, ARM_MPU_RBAR(u8Region, u32Base), ARM_MPU_RASR(1, u8Access, 0, 0, 1, 1, 0, u8Log - 1));
+	if ((MPU->CTRL & MPU_CTRL_ENABLE_Msk) == 0)
+	{
+		ARM_MPU_Enable(MPU_CTRL_PRIVDEFENA_Msk);
+	}
+	__DSB();
+	__ISB();
+	return true;
+}
+
+/**
+ * @brief
+ * Protects the tables of a slave with one MPU region each from u8FirstRegion,
+ * every table MB_MPU_ALIGN() aligned. The holding registers and the coils the
+ * master writes are read only for unprivileged code, the input registers and
+ * discrete inputs the application produces are read-write, none is executable
+ *
+ * @return number of regions used, -1 when a table is not aligned or the regions run out
+ * @ingroup setup
+ */
+int8_t ModbusMpuProtect(modbusHandler_t *modH, uint8_t u8FirstRegion)
+{
+	const struct
+	{
+		const uint16_t *u16regs;
+		uint16_t u16size;
+		uint8_t u8Access;
+	} xTables[] =
+	{
+		{ modH->u16regsHR, modH->u16regHR_size, ARM_MPU_AP_URO },
+		{ modH->u16regsCoils, modH->u16regCoils_size, ARM_MPU_AP_URO },
+		{ modH->u16regsRO, modH->u16regRO_size, ARM_MPU_AP_FULL },
+		{ modH->u16regsCoilsRO, modH->u16regCoilsRO_size, ARM_MPU_AP_FULL },
+	};
+	uint8_t u8Region = u8FirstRegion;
+
+	for (uint8_t i = 0; i < sizeof(xTables) / sizeof(xTables[0]); i++)
+	{
+		if (xTables[i].u16regs == NULL || xTables[i].u16size == 0) continue;
+		if (!ModbusMpuRegion(u8Region, xTables[i].u16regs, xTables[i].u16size * sizeof(uint16_t), xTables[i].u8Access)) return -1;
+		u8Region++;
+	}
+	return (int8_t)(u8Region - u8FirstRegion);
+}
+
+#if portUSING_MPU_WRAPPERS == 1
+/**
+ * @brief
+ * FreeRTOS-MPU owns the MPU and loads the regions of each task at the context
+ * switch: fills the regions giving an unprivileged task the tables of a slave,
+ * for xTaskCreateRestricted() or vTaskAllocateMPURegions(). Holding registers
+ * and coils are read only, the input tables read-write, none is executable
+ *
+ * @param u8Max entries of xRegions, portNUM_CONFIGURABLE_REGIONS at most
+ * @return number of regions filled
+ * @ingroup setup
+ */
+uint8_t ModbusMpuTaskRegions(modbusHandler_t *modH, MemoryRegion_t *xRegions, uint8_t u8Max)
+{
+	const struct
+	{
+		uint16_t *u16regs;
+		uint16_t u16size;
+		uint32_t u32Access;
+	} xTables[] =
+	{
+		{ modH->u16regsHR, modH->u16regHR_size, portMPU_REGION_READ_ONLY },
+		{ modH->u16regsCoils, modH->u16regCoils_size, portMPU_REGION_READ_ONLY },
+		{ modH->u16regsRO, modH->u16regRO_size, portMPU_REGION_READ_WRITE },
+		{ modH->u16regsCoilsRO, modH->u16regCoilsRO_size, portMPU_REGION_READ_WRITE },
+	};
+	uint8_t u8Count = 0;
+
+	for (uint8_t i = 0; i < sizeof(xTables) / sizeof(xTables[0]) && u8Count < u8Max; i++)
+	{
+		if (xTables[i].u16regs == NULL || xTables[i].u16size == 0) continue;
+		xRegions[u8Count].pvBaseAddress = xTables[i].u16regs;
+		xRegions[u8Count].ulLengthInBytes = MB_MPU_SIZE(xTables[i].u16size * sizeof(uint16_t));
+		xRegions[u8Count].ulParameters = xTables[i].u32Access | portMPU_REGION_EXECUTE_NEVER;
+		u8Count++;
+	}
+	return u8Count;
+}
+#endif
+#endif
+
+#if ENABLE_USART_DMA == 1
+/**
+ * @brief
+ * Starts a USART_HW_DMA line, every frame is received from the start of uxBuffer
+ * and ends at the IDLE event. With ENABLE_RX_MERGE it ends at the IDLE event
+ * after its CRC, or T35 after the last fragment. With ENABLE_RX_PREDICT the
+ * DMA receives the header first, then up to the length it announces
+ *
+ * @ingroup setup
+ */
+static void startUartDMA(modbusHandler_t *modH)
+{
+	startUart(modH);
+#if ENABLE_USART_DMA_LL == 1
+	setupTxDMA(modH);
+#endif
+#if ENABLE_RX_MERGE == 1
+	setCharTiming(modH);
+	modH->xRxMerging = false;
+#endif
+#if ENABLE_RX_MERGE == 1 || ENABLE_RX_PREDICT == 1
+	modH->u16RxMerged = 0;
+	modH->u16RxMergeCRC = 0xFFFF;
+#endif
+	modH->xRxRestart = false;
+#if ENABLE_MB_RX_QUEUE == 1
+	xMessageBufferReset(modH->xRxQueue); // frames of a previous start
+	modH->xBufferRX.overflow = false;
+#endif
+	flushDCache(modH->xBufferRX.uxBuffer, MAX_BUFFER_RX);
+	if(HAL_UARTEx_ReceiveToIdle_DMA(modH->port, modH->xBufferRX.uxBuffer, MB_RX_DMA_FIRST ) != HAL_OK)
+	{
+		while(1)
+		{
+			//error in your initialization code
+		}
+	}
+	__HAL_DMA_DISABLE_IT(modH->port->hdmarx, DMA_IT_HT); // we don't need half-transfer interrupt
+}
+
+/**
+ * @brief
+ * Starts a USART_HW_DMA_CIRC line, the DMA fills the RX ring forever and the
+ * IDLE events queue the frame descriptors
+ *
+ * @ingroup setup
+ */
+static void startUartCirc(modbusHandler_t *modH)
+{
+	startUart(modH);
+	if(modH->port->hdmarx->Init.Mode != DMA_CIRCULAR)
+	{
+		while(1)
+		{
+			//error the RX DMA channel must be configured in circular mode
+		}
+	}
+
+#if ENABLE_USART_DMA_LL == 1
+	setupTxDMA(modH);
+#endif
+
+	modH->u8RxFrameHead = modH->u8RxFrameTail = 0;
+	modH->u16RxPos = modH->u16RxFrameStart = modH->u16RxFrameLen = 0;
+	modH->u32RxTotal = 0;
+	modH->xRxRestart = false;
+#if ENABLE_RX_MERGE == 1 || ENABLE_MB_MONITOR == 1
+	setCharTiming(modH);
+#endif
+#if ENABLE_RX_MERGE == 1
+	modH->u16RxMerged = 0;
+	modH->u16RxMergeCRC = 0xFFFF;
+	modH->xRxMerging = false;
+#endif
+
+	// the DMA runs forever, half and full transfer events only update the ring position
+	flushDCache(modH->xBufferRX.uxBuffer, MAX_BUFFER_RX);
+	if(HAL_UARTEx_ReceiveToIdle_DMA(modH->port, modH->xBufferRX.uxBuffer, MAX_BUFFER_RX ) != HAL_OK)
+	{
+		while(1)
+		{
+			//error in your initialization code
+		}
+	}
+}
+
+#if ENABLE_USART_DMA_LL == 1
+/**
+ * @brief
+ * Prepares the TX DMA channel of the line once, a frame then only reloads its
+ * memory address and count. The end of the DMA enables the TC interrupt, whose
+ * HAL handler calls HAL_UART_TxCpltCallback() as after HAL_UART_Transmit_DMA()
+ *
+ * @ingroup setup
+ */
+static void setupTxDMA(modbusHandler_t *modH)
+{
+	DMA_HandleTypeDef *hdmatx = modH->port->hdmatx;
+
+	if (hdmatx == NULL || hdmatx->Init.Mode != DMA_NORMAL || hdmatx->Init.Direction != DMA_MEMORY_TO_PERIPH)
+	{
+		while(1);// error the UART needs a TX DMA channel in normal mode, from memory to peripheral
+	}
+
+	hdmatx->Instance->CCR &= ~(DMA_CCR_EN | DMA_CCR_HTIE | DMA_CCR_TEIE);
+	hdmatx->Instance->CPAR = (uint32_t)(uintptr_t)&modH->port->Instance->TDR;
+	hdmatx->XferCpltCallback = txDoneDMA;
+	hdmatx->XferHalfCpltCallback = NULL;
+	hdmatx->XferErrorCallback = NULL;
+	hdmatx->XferAbortCallback = NULL;
+}
+
+/**
+ * @brief
+ * TX DMA transfer complete, the last byte is still in the shift register
+ *
+ * @ingroup huart UART HAL handler
+ */
+static void txDoneDMA(DMA_HandleTypeDef *hdma)
+{
+	UART_HandleTypeDef *huart = (UART_HandleTypeDef *)hdma->Parent;
+#if MB_TX_PARTS
+	modbusHandler_t *modH = getModbusHandler(huart);
+	const uint8_t *u8Part = NULL;
+	uint16_t u16Part = 0;
+
+	if (modH != NULL && modH->uModbusType == MB_SLAVE && modH->u16TxGather != 0)
+	{
+#if ENABLE_MB_TX_STREAM == 1
+		if (modH->xTxStream) u8Part = nextTxChunk(modH, &u16Part);
+		else
+#endif
+		if (modH->u8TxNext < 2)
+		{
+			u16Part = modH->u16TxPart[ modH->u8TxNext ];
+			u8Part = modH->u8TxPart[ modH->u8TxNext++ ];
+		}
+	}
+	if (u8Part != NULL)
+	{
+		// the next part of the answer, the TX request stays on and the bytes still
+		// in the USART cover the reload, so the frame has no gap
+		hdma->State = HAL_DMA_STATE_BUSY;
+		hdma->Instance->CCR &= ~DMA_CCR_EN;
+		hdma->Instance->CMAR = (uint32_t)(uintptr_t)u8Part;
+		hdma->Instance->CNDTR = u16Part;
+		hdma->Instance->CCR |= DMA_CCR_TCIE | DMA_CCR_EN;
+		return;
+	}
+#endif
+
+	LL_USART_DisableDMAReq_TX(huart->Instance);
+	LL_USART_EnableIT_TC(huart->Instance);
+}
+#endif
+
+/**
+ * @brief
+ * Restarts the DMA reception that HAL_UART_ErrorCallback() could not restart,
+ * one attempt per call. The task calls it before it waits for a frame and a
+ * master before each query
+ *
+ * @return true if a restart was due
+ * @ingroup loop
+ */
+static bool recoverRxDMA(modbusHandler_t *modH)
+{
+	if (!modH->xRxRestart) return false;
+
+	taskENTER_CRITICAL(); // the error callback may rearm it meanwhile
+	if (modH->xRxRestart)
+	{
+		modH->xRxRestart = !rearmRxDMA(modH);
+	}
+	taskEXIT_CRITICAL();
+	return true;
+}
+
+/**
+ * @brief
+ * wait operation of USART_HW_DMA, a wake-up for a reception to restart is not
+ * a frame. While the HAL refuses the restart it is retried every tick
+ *
+ * @ingroup loop
+ */
+static void waitRequestDMA(modbusHandler_t *modH)
+{
+	uint32_t u32Value;
+
+	do
+	{
+		recoverRxDMA(modH);
+	} while (xTaskNotifyWait(0, UINT32_MAX, &u32Value, modH->xRxRestart ? 1 : portMAX_DELAY) != pdTRUE ||
+			u32Value == MB_EV_RX_ERR);
+}
+
+#if ENABLE_MB_RX_QUEUE == 1
+/**
+ * @brief
+ * wait operation of USART_HW_DMA with ENABLE_MB_RX_QUEUE, the frames of a burst
+ * wait in xRxQueue, the task blocks only when all of them were served
+ *
+ * @ingroup loop
+ */
+static void waitRequestQueue(modbusHandler_t *modH)
+{
+	uint32_t u32Value;
+
+	while (xMessageBufferIsEmpty(modH->xRxQueue) == pdTRUE && !modH->xBufferRX.overflow)
+	{
+		recoverRxDMA(modH);
+		xTaskNotifyWait(0, UINT32_MAX, &u32Value, modH->xRxRestart ? 1 : portMAX_DELAY);
+	}
+}
+
+/**
+ * @brief
+ * abort operation of USART_HW_DMA with ENABLE_MB_RX_QUEUE, drops the late
+ * answers of previous queries still waiting in xRxQueue
+ *
+ * @ingroup loop
+ */
+static void abortRxQueue(modbusHandler_t *modH)
+{
+	// one at a time, the RX event callback may queue meanwhile; u8Buffer gets the query next
+	while (xMessageBufferReceive(modH->xRxQueue, modH->u8Buffer, MAX_BUFFER, 0) != 0)
+	{
+	}
+	modH->xBufferRX.overflow = false;
+}
+
+/**
+ * @brief
+ * release operation of USART_HW_DMA with ENABLE_MB_RX_QUEUE, the next queued
+ * frame wakes the task again: one notification may stand for several frames
+ *
+ * @ingroup loop
+ */
+static void releaseRxQueue(modbusHandler_t *modH)
+{
+	if (xMessageBufferIsEmpty(modH->xRxQueue) != pdTRUE)
+	{
+		notifyModbus(modH, MB_EV_RX);
+	}
+}
+#endif
+
+/**
+ * @brief
+ * wait operation of USART_HW_DMA_CIRC, several frames may be queued in the
+ * RX ring, the task blocks only when all of them were served
+ *
+ * @ingroup loop
+ */
+static void waitRequestCirc(modbusHandler_t *modH)
+{
+	if(modH->u8RxFrameHead == modH->u8RxFrameTail)
+	{
+		recoverRxDMA(modH);
+		ulTaskNotifyTake(pdTRUE, modH->xRxRestart ? 1 : portMAX_DELAY);
+	}
+}
+
+/**
+ * @brief
+ * abort operation of USART_HW_DMA_CIRC, drops the late answers of previous
+ * queries still waiting in the RX ring
+ *
+ * @ingroup loop
+ */
+static void abortRxCirc(modbusHandler_t *modH)
+{
+	modH->u8RxFrameTail = modH->u8RxFrameHead;
+}
+
+#if ENABLE_MB_SHARED_TASK == 1
+/**
+ * @brief
+ * release operation of USART_HW_DMA_CIRC in the shared task, one frame is
+ * served per step and the others stay queued in the ring
+ *
+ * @ingroup loop
+ */
+static void releaseRxCirc(modbusHandler_t *modH)
+{
+	if (modH->u8RxFrameHead != modH->u8RxFrameTail)
+	{
+		notifyModbus(modH, MB_EV_RX);
+	}
+}
+#endif
+#endif
+
+#if ENABLE_USART_DMA_INPLACE == 1
+/**
+ * @brief
+ * abort operation of USART_HW_DMA with ENABLE_USART_DMA_INPLACE, a late answer
+ * must not land in the query, the reception restarts once it is sent
+ *
+ * @ingroup loop
+ */
+static void abortRxDMA(modbusHandler_t *modH)
+{
+	HAL_UART_AbortReceive(modH->port);
+}
+#endif
+
+/**
+ * @brief
+ * wait operation of the transports signalling one frame at a time
+ *
+ * @ingroup loop
+ */
+static void waitRequest(modbusHandler_t *modH)
+{
+	(void)modH;
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+#if ENABLE_TCP == 1
+/**
+ * @brief
+ * start operation of TCP_HW, a slave listens on u16TcpPort and a master
+ * connects to its server
+ *
+ * @ingroup setup
+ */
+static void startTcp(modbusHandler_t *modH)
+{
+#if MB_ENABLE_MASTER == 1
+	if (modH->uModbusType == MB_MASTER)
+	{
+		startTcpClient(modH);
+		return;
+	}
+#endif
+#if MB_ENABLE_SLAVE == 1
+	startTcpServer(modH);
+#endif
+}
+
+/**
+ * @brief
+ * serve operation of TCP_HW, one pass of the master or slave task
+ *
+ * @ingroup loop
+ */
+static void stepTcp(modbusHandler_t *modH)
+{
+#if MB_ENABLE_MASTER == 1
+	if (modH->uModbusType == MB_MASTER)
+	{
+		serveTcpMaster(modH);
+		return;
+	}
+#endif
+#if MB_ENABLE_SLAVE == 1
+	/* woken by the netconn callback, or at the idle deadline of the oldest connection */
+	ulTaskNotifyTake(pdTRUE, getTcpWait(modH));
+	serveTcp(modH);
+#endif
+}
+#endif
+
+#if ENABLE_UDP == 1
+/**
+ * @brief
+ * start operation of UDP_HW, a slave binds u16TcpPort and a master
+ * opens its netconn
+ *
+ * @ingroup setup
+ */
+static void startUdp(modbusHandler_t *modH)
+{
+#if MB_ENABLE_MASTER == 1
+	if (modH->uModbusType == MB_MASTER)
+	{
+		startTcpClient(modH);
+		return;
+	}
+#endif
+#if MB_ENABLE_SLAVE == 1
+	startUdpServer(modH);
+#endif
+}
+
+/**
+ * @brief
+ * serve operation of UDP_HW, one pass of the master or slave task
+ *
+ * @ingroup loop
+ */
+static void stepUdp(modbusHandler_t *modH)
+{
+#if MB_ENABLE_MASTER == 1
+	if (modH->uModbusType == MB_MASTER)
+	{
+		serveTcpMaster(modH);
+		return;
+	}
+#endif
+#if MB_ENABLE_SLAVE == 1
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY); /* woken by the netconn callback for the datagrams */
+	serveUdp(modH);
+#endif
+}
+#endif
+
+/**
+ * @brief
+ * This method returns the length of one character on the line in bits
+ * HAL word length includes the parity bit
+ *
+ * @return uint32_t bits per character
+ * @ingroup port HAL Serial Port handler
+ */
+static uint32_t getCharBits(UART_HandleTypeDef *port)
+{
+	uint32_t u32CharBits = 1 + 8 + 1; // start, data and parity, stop
+	if (port->Init.WordLength == UART_WORDLENGTH_9B) u32CharBits++;
+#ifdef UART_WORDLENGTH_7B
+	if (port->Init.WordLength == UART_WORDLENGTH_7B) u32CharBits--;
+#endif
+	if (port->Init.StopBits == UART_STOPBITS_2) u32CharBits++;
+
+	return u32CharBits;
+}
+
+#if ENABLE_MB_POLL_ADAPT == 1 || ENABLE_MB_WIRE_STATS == 1
+/**
+ * @brief
+ * Characters of a frame of u16Bytes on the line: ASCII sends each byte as a hex
+ * pair between the colon and CR LF
+ *
+ * @ingroup loop
+ */
+static uint32_t getWireChars(modbusHandler_t *modH, uint16_t u16Bytes)
+{
+	if (modH->xTransport->u8Flags & MB_TP_LRC) return (uint32_t)u16Bytes * 2 + 3;
+	return u16Bytes;
+}
+
+/**
+ * @brief
+ * Time of u32Chars characters on the line, at the baud rate, word length and
+ * stop bits of the port
+ *
+ * @return microseconds
+ * @ingroup loop
+ */
+static uint32_t getWireUs(modbusHandler_t *modH, uint32_t u32Chars)
+{
+	return (uint32_t)(((uint64_t)u32Chars * getCharBits(modH->port) * 1000000UL) / modH->port->Init.BaudRate);
+}
+#endif
+
+/**
+ * @brief
+ * This method computes T1.5 and T3.5 from the baud rate, word length and stop bits of the port
+ * and programs the T35 timer of the handler with them.
+ * Modbus RTU fixes them to 750 us and 1750 us above 19200 bps
+ *
+ * @ingroup modH Modbus handler
+ */
+static void setCharTiming(modbusHandler_t *modH)
+{
+	uint32_t u32Baud = modH->port->Init.BaudRate;
+	uint32_t u32CharBits = getCharBits(modH->port);
+#if ENABLE_MB_TIMER_MUX != 1
+	TickType_t xT35Ticks;
+#endif
+
+	if (u32Baud > 19200)
+	{
+		modH->u32T15us = 750;
+		modH->u32T35us = 1750;
+	}
+	else
+	{
+		modH->u32T15us = (u32CharBits * 1500000UL + u32Baud - 1) / u32Baud;
+		modH->u32T35us = (u32CharBits * 3500000UL + u32Baud - 1) / u32Baud;
+	}
+#if ENABLE_RX_MERGE == 1 && ENABLE_MB_ERR_STATS == 1
+	// one character time from byte to byte, plus the silence of T1.5
+	modH->u32RxGap = (uint32_t)(((uint64_t)(u32CharBits * 1000000UL / u32Baud + modH->u32T15us) * SystemCoreClock) / 1000000UL);
+#endif
+#if ENABLE_MB_MONITOR == 1
+	modH->u32MonChar = (uint32_t)(((uint64_t)u32CharBits * SystemCoreClock) / u32Baud);
+#endif
+
+#if ENABLE_TIM_T35 == 1
+	if (modH->xTimT35 != NULL && modH->u8TimT35Channel != 0)
+	{
+		// shared free-running timer: each received byte moves the compare of the channel T35 ahead
+		uint32_t u32Bit = TIM_DIER_CC1IE << (modH->u8TimT35Channel - 1);
+
+		if (modH->u8TimT35Channel > 4 || modH->u32T35us >= __HAL_TIM_GET_AUTORELOAD(modH->xTimT35))
+		{
+			while(1); // error the channel is 1 to 4 and T35 must be shorter than a period of the timer
+		}
+		taskENTER_CRITICAL();
+		modH->xTimT35->Instance->DIER &= ~u32Bit;
+		taskEXIT_CRITICAL();
+		__HAL_TIM_ENABLE(modH->xTimT35);
+		return;
+	}
+	if (modH->xTimT35 != NULL)
+	{
+		// one-pulse mode: every received byte restarts the counter and the update event marks T35
+		__HAL_TIM_DISABLE(modH->xTimT35);
+		modH->xTimT35->Instance->CR1 &= ~TIM_CR1_ARPE;
+		modH->xTimT35->Instance->CR1 |= TIM_CR1_OPM | TIM_CR1_URS;
+		__HAL_TIM_SET_AUTORELOAD(modH->xTimT35, (modH->u32T35us > 0xFFFF ? 0xFFFF : modH->u32T35us) - 1);
+		__HAL_TIM_SET_COUNTER(modH->xTimT35, 0);
+		__HAL_TIM_CLEAR_IT(modH->xTimT35, TIM_IT_UPDATE);
+		__HAL_TIM_ENABLE_IT(modH->xTimT35, TIM_IT_UPDATE);
+		return;
+	}
+#endif
+#if ENABLE_LPTIM_T35 == 1
+	if (modH->xLptimT35 != NULL)
+	{
+		// the LPTIM only runs during a frame, the first byte starts it from 0 with the compare at T35
+		modH->u16LpT35 = (uint16_t)(((uint64_t)modH->u32T35us * MB_LPTIM_HZ + 999999UL) / 1000000UL) + 1;
+		modH->xLpArmed = false;
+		modH->xLptimT35->CR = 0;
+		modH->xLptimT35->IER = LPTIM_IER_CMPMIE; // only written with the LPTIM disabled
+		modH->xLptimT35->CR = LPTIM_CR_ENABLE;
+		modH->xLptimT35->ARR = 0xFFFF;
+		while ((modH->xLptimT35->ISR & LPTIM_ISR_ARROK) == 0)
+		{
+
+		}
+		modH->xLptimT35->ICR = LPTIM_ICR_ARROKCF | LPTIM_ICR_CMPMCF;
+		modH->xLptimT35->CR = 0; // ARR is kept while disabled
+		return;
+	}
+#endif
+
+#if ENABLE_MB_TIMER_MUX == 1
+	cancelModbusTimer(modH, MB_TIMER_T35); // the received bytes arm u32T35us on the shared timer
+#else
+	// one tick more because the first tick after a timer reset may come at any moment
+	xT35Ticks = (TickType_t)((modH->u32T35us * configTICK_RATE_HZ + 999999UL) / 1000000UL) + 1;
+	xTimerChangePeriod(modH->xTimerT35, xT35Ticks, 0);
+	xTimerStop(modH->xTimerT35, 0); // changing the period starts the timer, wait for the first byte
+#endif
+}
+
+#if ENABLE_USART_DE == 1
+/**
+ * @brief
+ * This method configures the USART to drive the RS485 DE pin.
+ * The turnaround times of the handler are converted from bit times to sample times
+ *
+ * @ingroup modH Modbus handler
+ */
+static void setHardwareDE(modbusHandler_t *modH)
+{
+	uint32_t u32Samples = (modH->port->Init.OverSampling == UART_OVERSAMPLING_8) ? 8 : 16;
+	uint32_t u32Assert = modH->u8DEAssertBits * u32Samples;
+	uint32_t u32Deassert = modH->u8DEDeassertBits * u32Samples;
+
+	if (u32Assert > 0x1F) u32Assert = 0x1F; // DEAT and DEDT are 5 bits wide
+	if (u32Deassert > 0x1F) u32Deassert = 0x1F;
+
+	if (HAL_RS485Ex_Init(modH->port, UART_DE_POLARITY_HIGH, u32Assert, u32Deassert) != HAL_OK)
+	{
+		while(1)
+		{
+			//error the USART does not support driver enable
+		}
+	}
+}
+#endif
+
+#if ENABLE_USART_RTO == 1
+/**
+ * @brief
+ * This method computes T35 in bit times for the USART receiver timeout.
+ * Modbus RTU defines 3.5 characters, fixed to 1750 us above 19200 bps
+ *
+ * @return uint32_t receiver timeout in bits
+ * @ingroup port HAL Serial Port handler
+ */
+static uint32_t getT35Bits(UART_HandleTypeDef *port)
+{
+	if (port->Init.BaudRate > 19200)
+	{
+		return (uint32_t)((1750ULL * port->Init.BaudRate + 999999UL) / 1000000UL);
+	}
+	return (getCharBits(port) * 7 + 1) / 2;
+}
+#endif
+
+/**
+ * @brief
+ * Signals an MB_EV_ event of the handler to its Modbus task. A dedicated master
+ * task waits on its telegram queue by itself, MB_EV_QUERY only wakes the shared task
+ * and a TCP or UDP master, which waits for its answers and its queries at the same time.
+ * The task of a TCP or UDP handler (MB_TP_MBAP) scans all its sources after each wake up,
+ * its events are counted so the ones signalled during a pass are not lost
+ *
+ * @ingroup loop
+ */
+static void notifyModbus(modbusHandler_t *modH, uint8_t u8Event)
+{
+#if ENABLE_MB_SHARED_TASK == 1
+	taskENTER_CRITICAL();
+	modH->u8Events |= u8Event;
+	taskEXIT_CRITICAL();
+	xTaskNotifyGive(modH->myTaskModbusAHandle);
+#else
+	if (modH->xTransport->u8Flags & MB_TP_MBAP)
+	{
+		xTaskNotifyGive(modH->myTaskModbusAHandle);
+		return;
+	}
+	if (u8Event == MB_EV_QUERY) return;
+	xTaskNotify(modH->myTaskModbusAHandle, (u8Event == MB_EV_TIMEOUT) ? ERR_TIME_OUT : 0, eSetValueWithOverwrite);
+#endif
+}
+
+#if ENABLE_MB_TIMER_MUX != 1
+void vTimerCallbackT35(TimerHandle_t *pxTimer)
+{
+	//Notify that a stream has just arrived
+	int i;
+	//TimerHandle_t aux;
+	MB_HOOK_ENTER(MB_HOOK_T35);
+	for(i = 0; i < numberHandlers; i++)
+	{
+		if (mHandlers[i] == NULL) continue; // slot freed by ModbusDeInit()
+
+		if( (TimerHandle_t *)mHandlers[i]->xTimerT35 ==  pxTimer ){
+			MB_LOG_EVENT(mHandlers[i], MB_EVT_T35, NULL, 0, 0, 0);
+			if (endRxFrame(mHandlers[i]))
+			{
+#if MB_ENABLE_MASTER == 1
+				if(mHandlers[i]->uModbusType == MB_MASTER)
+				{
+					xTimerStop(mHandlers[i]->xTimerTimeout,0);
+				}
+#endif
+				MB_TRACE_FRAME(mHandlers[i]);
+				notifyModbus(mHandlers[i], MB_EV_RX);
+			}
+		}
+
+	}
+	MB_HOOK_EXIT(MB_HOOK_T35);
+}
+
+#if MB_ENABLE_MASTER == 1
+void vTimerCallbackTimeout(TimerHandle_t *pxTimer)
+{
+	//Notify that a stream has just arrived
+	int i;
+	//TimerHandle_t aux;
+	MB_HOOK_ENTER(MB_HOOK_TIMEOUT);
+	for(i = 0; i < numberHandlers; i++)
+	{
+		if (mHandlers[i] == NULL) continue; // slot freed by ModbusDeInit()
+
+		// the slaves have no timeout timer, their state shares the storage of the master
+		if(mHandlers[i]->uModbusType == MB_MASTER && (TimerHandle_t *)mHandlers[i]->xTimerTimeout ==  pxTimer ){
+				MB_LOG_EVENT(mHandlers[i], MB_EVT_TIMEOUT, mHandlers[i]->u8Buffer, 0, ERR_TIME_OUT, 0);
+				notifyModbus(mHandlers[i], MB_EV_TIMEOUT);
+		}
+
+	}
+	MB_HOOK_EXIT(MB_HOOK_TIMEOUT);
+}
+#endif
+#endif
+
+#if ENABLE_MB_TIMER_MUX == 1
+/**
+ * @brief
+ * Sets the compare of the shared timer to u32Due, in a critical section. A deadline
+ * already passed while it was written raises the compare event by software
+ *
+ * @ingroup htim TIM HAL handler
+ */
+static void setTimerCompare(uint32_t u32Due)
+{
+	TIM_TypeDef *xTim = xTimerMux.htim->Instance;
+
+	xTimerMux.u32Next = u32Due;
+	xTim->CCR1 = u32Due;
+	xTim->SR = ~TIM_SR_CC1IF;
+	xTim->DIER |= TIM_DIER_CC1IE;
+	if ((int32_t)(xTim->CNT - u32Due) >= 0) xTim->EGR = TIM_EGR_CC1G;
+}
+
+
+/**
+ * @brief
+ * Installs the timer serving the T35 and answer timeout deadlines of all the
+ * handlers instead of xTimerT35 and xTimerTimeout. It must count at 1 MHz over
+ * 32 bits (TIM2), free-running, with its capture compare interrupt enabled.
+ * HAL_TIM_OC_DelayElapsedCallback() must call ModbusTimerCallback(). Channel 1
+ * is used by the library
+ *
+ * @ingroup setup
+ */
+void ModbusSetTimer(TIM_HandleTypeDef *htim)
+{
+	if (htim->Instance->ARR != 0xFFFFFFFFUL)
+	{
+		while(1); // error the timer must count over 32 bits
+	}
+
+	xTimerMux.htim = htim;
+	xTimerMux.u32Armed = 0;
+	htim->Instance->DIER &= ~TIM_DIER_CC1IE;
+	htim->Instance->SR = ~TIM_SR_CC1IF;
+	__HAL_TIM_ENABLE(htim);
+}
+
+
+/**
+ * @brief
+ * Arms deadline u8Timer of the handler u32us microseconds from now, replacing the
+ * previous one. The compare only moves when the new deadline comes first, a later
+ * one is found by ModbusTimerCallback() at the compare in place. Safe in interrupts
+ *
+ * @param u8Timer MB_TIMER_T35 or MB_TIMER_TIMEOUT
+ * @ingroup htim TIM HAL handler
+ */
+void armModbusTimer(modbusHandler_t *modH, uint8_t u8Timer, uint32_t u32us)
+{
+	armModbusTimerAt(modH, u8Timer, xTimerMux.htim->Instance->CNT + u32us);
+}
+
+
+/**
+ * @brief
+ * Arms deadline u8Timer of the handler at the timer count u32Due, as armModbusTimer()
+ * does. A deadline already passed expires at once. Safe in interrupts
+ *
+ * @param u8Timer MB_TIMER_T35 or MB_TIMER_TIMEOUT
+ * @ingroup htim TIM HAL handler
+ */
+void armModbusTimerAt(modbusHandler_t *modH, uint8_t u8Timer, uint32_t u32Due)
+{
+	uint8_t u8Slot = modH->u8Handler * 2 + u8Timer;
+	UBaseType_t uxSaved = taskENTER_CRITICAL_FROM_ISR();
+	bool xIdle = (xTimerMux.u32Armed == 0);
+
+	xTimerMux.u32Due[u8Slot] = u32Due;
+	xTimerMux.u32Armed |= 1UL << u8Slot;
+	if (xIdle || (int32_t)(u32Due - xTimerMux.u32Next) < 0) setTimerCompare(u32Due);
+	taskEXIT_CRITICAL_FROM_ISR(uxSaved);
+}
+
+
+/**
+ * @brief
+ * Cancels deadline u8Timer of the handler, the compare is left in place. Safe in interrupts
+ *
+ * @ingroup htim TIM HAL handler
+ */
+void cancelModbusTimer(modbusHandler_t *modH, uint8_t u8Timer)
+{
+	UBaseType_t uxSaved = taskENTER_CRITICAL_FROM_ISR();
+
+	xTimerMux.u32Armed &= ~(1UL << (modH->u8Handler * 2 + u8Timer));
+	taskEXIT_CRITICAL_FROM_ISR(uxSaved);
+}
+
+
+/**
+ * @brief
+ * Tells if deadline u8Timer of the handler is armed
+ *
+ * @ingroup htim TIM HAL handler
+ */
+bool isModbusTimerArmed(modbusHandler_t *modH, uint8_t u8Timer)
+{
+	return (xTimerMux.u32Armed & (1UL << (modH->u8Handler * 2 + u8Timer))) != 0;
+}
+
+
+/**
+ * @brief
+ * This is the compare callback of the timer installed by ModbusSetTimer(), the
+ * application calls it from HAL_TIM_OC_DelayElapsedCallback(). It takes the
+ * deadlines that passed and sets the compare to the first one left: a T35 ends
+ * the frame of its handler, a timeout is reported to its master task
+ *
+ * @ingroup htim TIM HAL handler
+ */
+MB_HOT_CODE void ModbusTimerCallback(TIM_HandleTypeDef *htim)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	UBaseType_t uxSaved;
+	uint32_t u32Expired = 0, u32Armed, u32Now, u32Wait = 0xFFFFFFFFUL;
+	modbusHandler_t *modH;
+	uint8_t u8Slot;
+
+	if (htim != xTimerMux.htim || htim->Channel != HAL_TIM_ACTIVE_CHANNEL_1) return;
+
+	uxSaved = taskENTER_CRITICAL_FROM_ISR();
+	u32Now = htim->Instance->CNT;
+	u32Armed = xTimerMux.u32Armed;
+	for (u8Slot = 0; u32Armed != 0; u8Slot++, u32Armed >>= 1)
+	{
+		if ((u32Armed & 1) == 0) continue;
+		int32_t i32Left = (int32_t)(xTimerMux.u32Due[u8Slot] - u32Now);
+		if (i32Left <= 0) u32Expired |= 1UL << u8Slot;
+		else if ((uint32_t)i32Left < u32Wait) u32Wait = (uint32_t)i32Left;
+	}
+	xTimerMux.u32Armed &= ~u32Expired;
+	if (xTimerMux.u32Armed != 0)
+	{
+		setTimerCompare(u32Now + u32Wait);
+	}
+	else
+	{
+		htim->Instance->DIER &= ~TIM_DIER_CC1IE;
+	}
+	taskEXIT_CRITICAL_FROM_ISR(uxSaved);
+
+	while (u32Expired != 0)
+	{
+		u8Slot = (uint8_t)__CLZ(__RBIT(u32Expired));
+		u32Expired &= ~(1UL << u8Slot);
+		modH = mHandlers[u8Slot / 2];
+		if (modH == NULL) continue; // ModbusDeInit() cancelled its deadlines
+
+		if ((u8Slot & 1) == MB_TIMER_T35)
+		{
+			MB_HOOK_ISR_ENTER(MB_HOOK_T35);
+			MB_LOG_EVENT(modH, MB_EVT_T35, NULL, 0, 0, 0);
+			if (endRxFrame(modH))
+			{
+#if MB_ENABLE_MASTER == 1
+				if (modH->uModbusType == MB_MASTER)
+				{
+					stopTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+				}
+#endif
+				MB_TRACE_FRAME(modH);
+				notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+			}
+			MB_HOOK_ISR_EXIT(MB_HOOK_T35);
+		}
+#if ENABLE_MB_PACING == 1
+		else if (modH->uModbusType == MB_MASTER && modH->xPacePending)
+		{
+			// the line was silent long enough before the query, the HAL is busy before the task sees it
+			startUartTx(modH, modH->u8PaceTx, modH->u16PaceSize, modH->xPaceDMA);
+			modH->xPacePending = false;
+		}
+#endif
+#if ENABLE_MB_TDMA == 1
+		else if (modH->uModbusType == MB_MASTER && modH->u8SchedCount != 0)
+		{
+			startSlotFromISR(modH, &xHigherPriorityTaskWoken);
+		}
+#endif
+#if MB_ENABLE_MASTER == 1
+		else if (modH->uModbusType == MB_MASTER)
+		{
+			MB_HOOK_ISR_ENTER(MB_HOOK_TIMEOUT);
+			MB_LOG_EVENT(modH, MB_EVT_TIMEOUT, modH->u8Buffer, 0, ERR_TIME_OUT, 0);
+			notifyModbusFromISR(modH, MB_EV_TIMEOUT, &xHigherPriorityTaskWoken);
+			MB_HOOK_ISR_EXIT(MB_HOOK_TIMEOUT);
+		}
+#endif
+#if ENABLE_MB_TURNAROUND == 1
+		else if (modH->xTurnPending)
+		{
+			// the minimum turnaround of the slave elapsed, the HAL is busy before the task sees it
+			startUartTx(modH, modH->u8TurnTx, modH->u16TurnSize, modH->xTurnDMA);
+			modH->xTurnPending = false;
+		}
+#endif
+	}
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
+#endif
+
+#if MB_ENABLE_MASTER == 1
+#if ENABLE_MB_SHARED_TASK != 1 || ENABLE_USB_CDC == 1
+/**
+ * @brief
+ * Starts the answer timeout of u16QueryTimeOut ticks, the query is on the line.
+ * The shared task does not wait for the end of TX, its TX callback starts the timeout
+ *
+ * @ingroup loop
+ */
+static void startTimeout(modbusHandler_t *modH)
+{
+#if ENABLE_MB_TIMER_MUX == 1
+	armModbusTimer(modH, MB_TIMER_TIMEOUT, (uint32_t)(((uint64_t)modH->u16QueryTimeOut * 1000000UL) / configTICK_RATE_HZ));
+#else
+	xTimerChangePeriod(modH->xTimerTimeout, modH->u16QueryTimeOut, 0);
+#endif
+}
+#endif
+
+
+/**
+ * @brief
+ * Stops the answer timeout, the answer arrived
+ *
+ * @ingroup loop
+ */
+static void stopTimeout(modbusHandler_t *modH)
+{
+#if ENABLE_MB_TIMER_MUX == 1
+	cancelModbusTimer(modH, MB_TIMER_TIMEOUT);
+#else
+	xTimerStop(modH->xTimerTimeout,0);
+#endif
+}
+#endif
+
+
+#if MB_ENABLE_SLAVE == 1
+/**
+ * @brief
+ * Selects the semaphore of the table used by the request, so a request only
+ * waits for the application updating that table. Registered functions take
+ * the holding register semaphore.
+ * The task releases it once the answer is built, before the transmission
+ *
+ * @return ModBusSphrCoilsHandle, ModBusSphrCoilsROHandle, ModBusSphrROHandle or ModBusSphrHandle
+ * @ingroup loop
+ */
+static osSemaphoreId_t getDataLock(modbusHandler_t *modH)
+{
+	switch (modH->u8Buffer[ FUNC ])
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_WRITE_COIL:
+	case MB_FC_WRITE_MULTIPLE_COILS:
+		return modH->ModBusSphrCoilsHandle;
+	case MB_FC_READ_DISCRETE_INPUT:
+		return modH->ModBusSphrCoilsROHandle;
+#if ENABLE_MB_SHARED_HR == 1
+	case MB_FC_READ_REGISTERS:
+		if (isSharedHR(modH)) return NULL; // the committed bank is read without lock
+		return modH->ModBusSphrHandle;
+#endif
+#if MB_ENABLE_FC_RANGES == 1 || MB_ENABLE_FC_DELTA == 1
+#if MB_ENABLE_FC_RANGES == 1
+	case MB_FC_READ_RANGES:
+#endif
+#if MB_ENABLE_FC_DELTA == 1
+	case MB_FC_READ_DELTA:
+#endif
+		// RNG_TABLE and DLT_TABLE are the same byte
+		if (modH->u8Buffer[ RNG_TABLE ] != MB_FC_READ_INPUT_REGISTER) return modH->ModBusSphrHandle;
+#endif
+		/* fall through */
+	case MB_FC_READ_INPUT_REGISTER:
+#if ENABLE_MB_RO_SNAPSHOT == 1
+		if (modH->u16regsROBank[0] != NULL) return NULL; // snapshots are read without lock
+#endif
+		return modH->ModBusSphrROHandle;
+	default:
+		return modH->ModBusSphrHandle;
+	}
+}
+
+
+/**
+ * @brief
+ * Receives the frame signalled to the slave task and answers it
+ *
+ * @ingroup loop
+ */
+static void serveRequest(modbusHandler_t *modH)
+{
+  int16_t i16result;
+  bool xBroadcast = false;
+
+	modH->i8lastError = 0;
+
+	i16result = modH->xTransport->recvFrame(modH);
+	if (i16result == ERR_BUFF_OVERFLOW)
+	{
+	    modH->i8lastError = ERR_BUFF_OVERFLOW;
+	    modH->u16errCnt++;
+	    MB_COUNT_ERR(modH, ERR_BUFF_OVERFLOW);
+	    return;
+	}
+	if (i16result == 0)
+	{
+	    return; // nothing queued or frame for other slave already dropped
+	}
+#if ENABLE_MB_WIRE_STATS == 1
+	countWireRx(modH, modH->u16BufferSize, false);
+#endif
+
+   if (modH->u16BufferSize < MB_MIN_REQUEST)
+   {
+      //The size of the frame is invalid
+      modH->i8lastError = ERR_BAD_SIZE;
+      modH->u16errCnt++;
+      MB_COUNT_ERR(modH, ERR_BAD_SIZE);
+
+	  return;
+    }
+
+
+#if ENABLE_MB_BROADCAST == 1
+   // a broadcast write is applied to the tables of u8id and never answered
+   xBroadcast = (modH->u8Buffer[ID] == 0);
+   if (xBroadcast && !isBroadcastFunction(modH->u8Buffer[FUNC]))
+   {
+	   MB_COUNT_NO_RESPONSE(modH);
+	   return;
+   }
+#endif
+
+#if ENABLE_MB_TICKLESS == 1
+   notePoll(modH);
+#endif
+#if ENABLE_MB_LISTEN_ONLY == 1
+   if (modH->xListenOnly)
+   {
+	   // a standby node serves the requests for its ID as broadcasts, its tables follow the writes of the master
+	   answerRequest(modH, modH->u8Buffer[ID], true);
+	   return;
+   }
+#endif
+   answerRequest(modH, xBroadcast ? modH->u8id : modH->u8Buffer[ID], xBroadcast);
+}
+
+
+/**
+ * @brief
+ * Validates and processes the request in u8Buffer for the unit u8id and sends
+ * the answer, the part of the slave loop shared by the RTU and TCP transports
+ *
+ * @ingroup loop
+ */
+static void answerRequest(modbusHandler_t *modH, uint8_t u8id, bool xBroadcast)
+{
+  int16_t i16result;
+  osSemaphoreId_t xLock;
+#if ENABLE_MB_SHARED_HR == 1
+  osSemaphoreId_t xBankLock;
+#endif
+#if ENABLE_MB_RESP_CACHE == 1
+  modbusRespCache_t *xEntry;
+  uint8_t u8fct;
+#endif
+#if MB_TX_PARTS
+  bool xHeld;
+#endif
+#if ENABLE_MB_THROTTLE == 1
+  uint32_t u32Start;
+#endif
+
+   // check slave id and load the tables of the unit
+    if ( !selectUnit(modH, u8id) )
+	{
+    	return;
+	}
+#if ENABLE_MB_RESP_CACHE == 1
+    if (!xBroadcast && sendCachedAnswer(modH)) return; // the same request, nothing written since
+#endif
+
+	// validate message: CRC, FCT, address and size
+    uint8_t u8exception = validateRequest(modH);
+    MB_TRACE(modH, MB_TS_VALIDATED);
+    if (u8exception != (uint8_t)ERR_BAD_CRC) MB_COUNT_SLAVE_MSG(modH);
+#if ENABLE_MB_AUTOBAUD == 1
+    if (u8exception != (uint8_t)ERR_BAD_CRC) modH->u16BaudHits++; // the line runs at the right rate
+#endif
+	if (u8exception > 0)
+	{
+	    // an exception is answered, a frame with a bad CRC is dropped as serveFrame() does
+	    if ((int8_t)u8exception > 0 && !xBroadcast)
+		{
+		    buildException( u8exception, modH);
+			sendTxBuffer(modH);
+		}
+		modH->i8lastError = (mb_errot_t)(int8_t)u8exception;
+		//return u8exception
+
+		return;
+	 }
+
+	 modH->i8lastError = 0;
+#if ENABLE_MB_THROTTLE == 1
+	 if (!takeThrottle(modH))
+	 {
+		 // over the budget of the handler, refused without processing
+#if ENABLE_MB_ERR_STATS == 1
+		 modH->xErrStats.u32Throttled++;
+#endif
+		 if (!xBroadcast)
+		 {
+			 buildException(EXC_BUSY, modH);
+			 sendTxBuffer(modH);
+		 }
+		 modH->i8lastError = (mb_errot_t)EXC_BUSY;
+		 return;
+	 }
+#endif
+#if ENABLE_MB_RESP_CACHE == 1
+	 xEntry = xBroadcast ? NULL : openCachedAnswer(modH);
+	 u8fct = modH->u8Buffer[ FUNC ];
+#endif
+	 xLock = getDataLock(modH);
+	 if (xLock != NULL) xSemaphoreTake(xLock , portMAX_DELAY); //before processing the message get the semaphore
+#if ENABLE_MB_SHARED_HR == 1
+	 xBankLock = lockSharedHR(modH, xLock); // then the one of the slaves sharing the holding registers
+#endif
+#if ENABLE_MB_RESP_CACHE == 1
+	 if (xEntry != NULL) xEntry->u32Gen = modH->u32TableGen[xEntry->u8Table - 1]; // a later write makes the answer stale
+#endif
+
+	 // process message, validateRequest() already checked that the function is in the table
+#if MB_TX_PARTS
+	 modH->u16TxGather = 0;
+#endif
+#if ENABLE_MB_TX_STREAM == 1
+	 modH->xTxStream = false;
+#endif
+	 MB_HOOK_ENTER(MB_HOOK_FC(modH->u8Buffer[ FUNC ]));
+#if ENABLE_MB_THROTTLE == 1
+	 u32Start = DWT->CYCCNT;
+#endif
+	 i16result = getFunction(modH->u8Buffer[ FUNC ])->process(modH);
+#if ENABLE_MB_THROTTLE == 1
+	 chargeThrottle(modH, DWT->CYCCNT - u32Start);
+#endif
+	 MB_HOOK_EXIT(MB_HOOK_FC(modH->u8Buffer[ FUNC ]));
+	 MB_TRACE(modH, MB_TS_PROCESSED);
+#if ENABLE_MB_TIMESTAMP == 1
+	 if (i16result == 0 && modH->xTimeSync && modH->u8Buffer[ FUNC ] == MB_FC_WRITE_MULTIPLE_REGISTERS) takeTimeSync(modH);
+#endif
+#if ENABLE_MB_RESP_CACHE == 1
+	 touchTables(modH, u8fct);
+#endif
+#if ENABLE_MB_RETAIN == 1
+	 if (modH->xRetain != NULL && (modH->u8UnitCount == 0 || modH->xUnitActive == &modH->xUnitMain))
+	 {
+		 uint8_t u8fct = modH->u8Buffer[ FUNC ];
+
+		 // the written tables are sealed before the semaphore is released, the counters after every request
+		 sealRetain(modH, u8fct == MB_FC_WRITE_COIL || u8fct == MB_FC_WRITE_REGISTER || u8fct == MB_FC_WRITE_MULTIPLE_COILS ||
+				 u8fct == MB_FC_WRITE_MULTIPLE_REGISTERS || u8fct == MB_FC_MASK_WRITE_REGISTER ||
+				 u8fct == MB_FC_READ_WRITE_MULTIPLE_REGISTERS);
+	 }
+#endif
+
+#if ENABLE_MB_HR_COMMIT == 1
+	 if (modH->u16HRStageEnd != 0)
+	 {
+		 // the registers of the whole request become visible at once, still under the semaphore
+		 ModbusHRCommit(modH, modH->u16HRStageAdd, modH->u16HRStageEnd - modH->u16HRStageAdd);
+		 modH->u16HRStageEnd = 0;
+	 }
+#endif
+#if ENABLE_MB_SHARED_HR == 1
+	 if (xBankLock != NULL) xSemaphoreGive(xBankLock); // committed, the answer never comes from the staging bank
+#endif
+
+#if MB_TX_PARTS
+	 // an answer sent from the table keeps it locked until the end of TX
+	 if (xBroadcast || i16result != 0) modH->u16TxGather = 0;
+	 xHeld = xLock != NULL && modH->u16TxGather != 0;
+	 if (xLock != NULL && !xHeld) xSemaphoreGive(xLock); //Release the semaphore
+#else
+	 if (xLock != NULL) xSemaphoreGive(xLock); //Release the semaphore
+#endif
+
+	 if (xBroadcast)
+	 {
+		 MB_COUNT_NO_RESPONSE(modH);
+		 modH->u16BufferSize = 0; // the slaves keep quiet
+		 return;
+	 }
+	 if (i16result > 0)
+	 {
+		 buildException( (uint8_t)i16result, modH);
+	 }
+#if ENABLE_MB_RESP_CACHE == 1
+	 if (i16result == 0) modH->xRespFill = xEntry;
+#endif
+	 if (i16result >= 0)
+	 {
+		 sendTxBuffer(modH);
+	 }
+#if ENABLE_MB_RESP_CACHE == 1
+	 modH->xRespFill = NULL;
+#endif
+#if MB_TX_PARTS
+	 modH->u16TxGather = 0;
+	 if (xHeld) xSemaphoreGive(xLock);
+#endif
+}
+
+#if ENABLE_MB_THROTTLE == 1
+/**
+ * @brief
+ * Fills the request and CPU buckets of a slave, its budget starts full
+ *
+ * @ingroup loop
+ */
+static void startThrottle(modbusHandler_t *modH)
+{
+	uint16_t u16Burst = (modH->u16ReqBurst != 0) ? modH->u16ReqBurst : modH->u16ReqRate;
+
+	modH->i32ReqCredit = (int32_t)u16Burst * configTICK_RATE_HZ;
+	modH->i64CpuCredit = (int64_t)modH->u32CpuUs * configTICK_RATE_HZ;
+	modH->xThrottleTick = xTaskGetTickCount();
+}
+
+/**
+ * @brief
+ * Token buckets of ENABLE_MB_THROTTLE: refills the buckets of the slave for the
+ * ticks since the last request and takes the request from them. u16ReqRate requests
+ * and u32CpuUs microseconds come in per second, up to u16ReqBurst requests and
+ * one second of processing. A request is refused once the request bucket is empty
+ * or the processing of the previous ones used up the CPU bucket
+ *
+ * @return false if the request is over the budget
+ * @ingroup loop
+ */
+static bool takeThrottle(modbusHandler_t *modH)
+{
+	TickType_t xNow = xTaskGetTickCount();
+	uint32_t u32Ticks = xNow - modH->xThrottleTick;
+
+	modH->xThrottleTick = xNow;
+	if (modH->u32CpuUs != 0)
+	{
+		int64_t i64CpuMax = (int64_t)modH->u32CpuUs * configTICK_RATE_HZ;
+
+		modH->i64CpuCredit += (int64_t)u32Ticks * modH->u32CpuUs;
+		if (modH->i64CpuCredit > i64CpuMax) modH->i64CpuCredit = i64CpuMax;
+	}
+	if (modH->u16ReqRate != 0)
+	{
+		uint16_t u16Burst = (modH->u16ReqBurst != 0) ? modH->u16ReqBurst : modH->u16ReqRate;
+		int64_t i64ReqMax = (int64_t)u16Burst * configTICK_RATE_HZ;
+		int64_t i64Req = (int64_t)modH->i32ReqCredit + (int64_t)u32Ticks * modH->u16ReqRate;
+
+		modH->i32ReqCredit = (int32_t)((i64Req > i64ReqMax) ? i64ReqMax : i64Req);
+		if (modH->i32ReqCredit < (int32_t)configTICK_RATE_HZ) return false;
+	}
+	if (modH->u32CpuUs != 0 && modH->i64CpuCredit <= 0) return false;
+
+	if (modH->u16ReqRate != 0) modH->i32ReqCredit -= (int32_t)configTICK_RATE_HZ;
+	return true;
+}
+
+/**
+ * @brief
+ * Takes the u32Cycles of the cycle counter spent processing a request from the
+ * CPU bucket of the slave
+ *
+ * @ingroup loop
+ */
+static void chargeThrottle(modbusHandler_t *modH, uint32_t u32Cycles)
+{
+	if (modH->u32CpuUs == 0) return;
+	modH->i64CpuCredit -= ((int64_t)u32Cycles * configTICK_RATE_HZ) / (SystemCoreClock / 1000000);
+}
+#endif
+
+#if ENABLE_MB_RESP_CACHE == 1
+/**
+ * @brief
+ * Table read by the FC3 or FC4 request in u8Buffer when its answer only changes
+ * with the table: an RTU frame served by process_FC3() from memory, no read
+ * callback of a segment and no diagnostics block
+ *
+ * @return DB_HOLDING_REGISTER or DB_INPUT_REGISTERS, 0 if the answer cannot be cached
+ * @ingroup loop
+ */
+static uint8_t getCachedTable(modbusHandler_t *modH)
+{
+#if MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4)
+	const modbusFunction_t *xFunction;
+	const modbusSegment_t *xSeg;
+	uint16_t u16Add, u16Count;
+	uint8_t u8table;
+
+	if (modH->u16BufferSize != 8 || (modH->xTransport->u8Flags & (MB_TP_MBAP | MB_TP_LRC)) != 0) return 0;
+
+	switch (modH->u8Buffer[ FUNC ])
+	{
+	case MB_FC_READ_REGISTERS:
+#if ENABLE_MB_SHARED_HR == 1
+		if (isSharedHR(modH)) return 0; // the other slaves commit without aging the answers of this one
+#endif
+		u8table = DB_HOLDING_REGISTER;
+		break;
+	case MB_FC_READ_INPUT_REGISTER:
+		u8table = DB_INPUT_REGISTERS;
+		break;
+	default:
+		return 0;
+	}
+	xFunction = getFunction(modH->u8Buffer[ FUNC ]);
+	if (xFunction == NULL || xFunction->process != process_FC3) return 0;
+
+	u16Add = word(modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]);
+	u16Count = word(modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]);
+#if ENABLE_MB_DIAG_REGS == 1
+	if (isDiagRange(u8table, u16Add, u16Count)) return 0;
+#endif
+	xSeg = findSegment(modH, u8table, u16Add, u16Count);
+	if (xSeg != NULL && xSeg->xOnRead != NULL) return 0;
+	return u8table;
+#else
+	(void)modH;
+	return 0;
+#endif
+}
+
+/**
+ * @brief
+ * Sends the cached answer of the request in u8Buffer when the same ADU was answered
+ * before and its table was not written since. The answer goes out with its CRC,
+ * without validateRequest(), process_FC3() and calcCRC()
+ *
+ * @return true if it was answered
+ * @ingroup loop
+ */
+static bool sendCachedAnswer(modbusHandler_t *modH)
+{
+	modbusRespCache_t *xEntry;
+
+	if (modH->u16BufferSize != sizeof(xEntry->u8Request)) return false;
+
+	for (uint8_t i = 0; i < MB_RESP_CACHE; i++)
+	{
+		xEntry = &modH->xRespCache[i];
+		if (xEntry->u16Size == 0 || memcmp(xEntry->u8Request, modH->u8Buffer, sizeof(xEntry->u8Request)) != 0) continue;
+		if (xEntry->u32Gen != modH->u32TableGen[xEntry->u8Table - 1]) return false; // written since, answered again
+
+		MB_COUNT_SLAVE_MSG(modH);
+#if ENABLE_MB_AUTOBAUD == 1
+		modH->u16BaudHits++;
+#endif
+		modH->i8lastError = 0;
+		if (modH->xStopped)
+		{
+			modH->u16BufferSize = 0; // ModbusStop(), the line is being reconfigured
+			return true;
+		}
+		memcpy(modH->u8Buffer, xEntry->u8Answer, xEntry->u16Size);
+		modH->u16BufferSize = xEntry->u16Size;
+		modH->xTransport->send(modH);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief
+ * Entry that takes the answer to the cacheable request in u8Buffer: the one of the same
+ * request when its answer is out of date, otherwise the oldest one. Its u32Gen is set
+ * under the lock of the table, before the answer is read
+ *
+ * @return entry with the request as key, NULL if the answer cannot be cached
+ * @ingroup loop
+ */
+static modbusRespCache_t *openCachedAnswer(modbusHandler_t *modH)
+{
+	uint8_t u8table = getCachedTable(modH);
+	modbusRespCache_t *xEntry = NULL;
+
+	if (u8table == 0) return NULL;
+
+	for (uint8_t i = 0; i < MB_RESP_CACHE; i++)
+	{
+		if (memcmp(modH->xRespCache[i].u8Request, modH->u8Buffer, sizeof(xEntry->u8Request)) == 0)
+		{
+			xEntry = &modH->xRespCache[i];
+			break;
+		}
+	}
+	if (xEntry == NULL)
+	{
+		xEntry = &modH->xRespCache[modH->u8RespNext];
+		modH->u8RespNext = (modH->u8RespNext + 1) % MB_RESP_CACHE;
+	}
+
+	xEntry->u16Size = 0; // free until sendTxBuffer() stores the answer
+	xEntry->u8Table = u8table;
+	memcpy(xEntry->u8Request, modH->u8Buffer, sizeof(xEntry->u8Request));
+	return xEntry;
+}
+
+/**
+ * @brief
+ * Raises the generation of the tables a request of function u8fct may have written.
+ * The functions added by ModbusRegisterFunction() may write any of them
+ *
+ * @ingroup loop
+ */
+static void touchTables(modbusHandler_t *modH, uint8_t u8fct)
+{
+	switch (u8fct)
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+	case MB_FC_ENCAPSULATED:
+#if MB_ENABLE_FC_RANGES == 1
+	case MB_FC_READ_RANGES:
+#endif
+#if MB_ENABLE_FC_DELTA == 1
+	case MB_FC_READ_DELTA:
+#endif
+		break;
+	case MB_FC_WRITE_COIL:
+	case MB_FC_WRITE_MULTIPLE_COILS:
+		ModbusTableChanged(modH, DB_COILS);
+		break;
+	case MB_FC_WRITE_REGISTER:
+	case MB_FC_WRITE_MULTIPLE_REGISTERS:
+	case MB_FC_MASK_WRITE_REGISTER:
+	case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+		ModbusTableChanged(modH, DB_HOLDING_REGISTER);
+		break;
+	default:
+		for (uint8_t u8table = DB_COILS; u8table <= DB_INPUT_REGISTERS; u8table++)
+		{
+			ModbusTableChanged(modH, u8table);
+		}
+		break;
+	}
+}
+#endif
+
+
+#if ENABLE_RX_PREDICT == 1
+/* frame length from the byte count at u8Pos, u16Fixed bytes besides the counted ones */
+static inline uint16_t countedLength(const uint8_t *u8Frame, uint16_t u16Len, uint8_t u8Pos, uint16_t u16Fixed)
+{
+	return (u16Len <= u8Pos) ? (uint16_t)(u8Pos + 1) : (uint16_t)(u16Fixed + u8Frame[u8Pos]);
+}
+
+/**
+ * @brief
+ * Predicts the length of an RTU frame from its first u16Len bytes: a request for
+ * a slave, an answer for a master. Function codes added by ModbusRegisterFunction(),
+ * FC43 answers and the other variable frames have no predictable length.
+ * ISR safe, only the header is read
+ *
+ * @return u16Len when the frame is complete, more to receive up to that length
+ * (the header is not complete yet or the rest of the frame), 0 if unpredictable
+ * @ingroup buffer
+ */
+uint16_t predictFrameLength(const modbusHandler_t *modH, const uint8_t *u8Frame, uint16_t u16Len)
+{
+	uint16_t u16Need;
+
+	if (u16Len < 2) return 2;
+
+	if (modH->uModbusType == MB_MASTER)
+	{
+		switch (u8Frame[ FUNC ])
+		{
+		case MB_FC_READ_COILS:
+		case MB_FC_READ_DISCRETE_INPUT:
+		case MB_FC_READ_REGISTERS:
+		case MB_FC_READ_INPUT_REGISTER:
+		case MB_FC_READ_FILE_RECORD:
+		case MB_FC_WRITE_FILE_RECORD:
+		case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+#if MB_ENABLE_FC_RANGES == 1
+		case MB_FC_READ_RANGES:
+#endif
+			u16Need = countedLength(u8Frame, u16Len, 2, 5); // address, function, byte count, data, CRC
+			break;
+#if MB_ENABLE_FC_DELTA == 1
+		case MB_FC_READ_DELTA:
+			u16Need = countedLength(u8Frame, u16Len, DLT_BYTE_CNT, DLT_DATA + 2);
+			break;
+#endif
+		case MB_FC_WRITE_COIL:
+		case MB_FC_WRITE_REGISTER:
+		case MB_FC_DIAGNOSTICS:
+		case MB_FC_WRITE_MULTIPLE_COILS:
+		case MB_FC_WRITE_MULTIPLE_REGISTERS:
+			u16Need = 8;
+			break;
+		case MB_FC_MASK_WRITE_REGISTER:
+			u16Need = 10;
+			break;
+		case MB_FC_READ_FIFO_QUEUE:
+			u16Need = (u16Len < 4) ? 4 : (uint16_t)(6 + word(u8Frame[2], u8Frame[3])); // 16-bit byte count
+			break;
+		default:
+			u16Need = (u8Frame[ FUNC ] & 0x80) ? 5 : 0; // exception code and CRC
+			break;
+		}
+	}
+	else
+	{
+		switch (u8Frame[ FUNC ])
+		{
+		case MB_FC_READ_COILS:
+		case MB_FC_READ_DISCRETE_INPUT:
+		case MB_FC_READ_REGISTERS:
+		case MB_FC_READ_INPUT_REGISTER:
+		case MB_FC_WRITE_COIL:
+		case MB_FC_WRITE_REGISTER:
+		case MB_FC_DIAGNOSTICS:
+			u16Need = 8;
+			break;
+		case MB_FC_WRITE_MULTIPLE_COILS:
+		case MB_FC_WRITE_MULTIPLE_REGISTERS:
+			u16Need = countedLength(u8Frame, u16Len, 6, 9);
+			break;
+		case MB_FC_READ_FILE_RECORD:
+		case MB_FC_WRITE_FILE_RECORD:
+			u16Need = countedLength(u8Frame, u16Len, 2, 5);
+			break;
+		case MB_FC_MASK_WRITE_REGISTER:
+			u16Need = 10;
+			break;
+		case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+			u16Need = countedLength(u8Frame, u16Len, 10, 13);
+			break;
+		case MB_FC_READ_FIFO_QUEUE:
+			u16Need = 6;
+			break;
+		case MB_FC_ENCAPSULATED:
+			u16Need = 7; // MEI type, read code and object ID
+			break;
+#if MB_ENABLE_FC_RANGES == 1
+		case MB_FC_READ_RANGES:
+			u16Need = countedLength(u8Frame, u16Len, RNG_BYTE_CNT, RNG_FIRST + 2);
+			break;
+#endif
+#if MB_ENABLE_FC_DELTA == 1
+		case MB_FC_READ_DELTA:
+			u16Need = DLT_REQUEST + 2;
+			break;
+#endif
+		default:
+			u16Need = 0;
+			break;
+		}
+	}
+	// a length below the bytes already received is a corrupted header
+	return (u16Need < u16Len || u16Need > MAX_BUFFER) ? 0 : u16Need;
+}
+#endif
+
+#if ENABLE_MB_FAST_READ == 1
+/**
+ * @brief
+ * Answers the FC1 to FC4 read of the USART_HW_DMA frame of u16Size bytes in
+ * xBufferRX from the RX event interrupt, the slave task is not woken. The answer
+ * is built in u8BufferTX, u8Buffer stays with the task. Only valid reads of the
+ * plain tables are answered here, the task serves the others with their
+ * exceptions: functions replaced by ModbusRegisterFunction(), units, the diagnostics
+ * block, segments with an on-read callback, a table whose semaphore is taken,
+ * a previous answer still on the line, a slave in listen only mode and a slave
+ * held to a budget by ENABLE_MB_THROTTLE
+ *
+ * @return true if the answer is being sent, false if the task has to serve the frame
+ * @ingroup huart UART HAL handler
+ */
+MB_HOT_CODE bool answerFastRead(modbusHandler_t *modH, uint16_t u16Size, BaseType_t *pxHigherPriorityTaskWoken)
+{
+	const uint8_t *u8rx = modH->xBufferRX.uxBuffer;
+	uint8_t *u8tx = modH->u8BufferTX;
+	const modbusFunction_t *xFunction;
+	osSemaphoreId_t xLock = NULL;
+	uint16_t u16crc = 0xFFFF;
+	uint16_t u16Add, u16Count, u16Bytes;
+	const uint16_t *u16src = NULL;
+	bool xWire = false;
+
+	if (!modH->xFastRead || modH->uModbusType != MB_SLAVE || u16Size != 8) return false;
+#if ENABLE_MB_LISTEN_ONLY == 1
+	if (modH->xListenOnly) return false; // a standby node never transmits, the task applies the request
+#endif
+#if ENABLE_MB_THROTTLE == 1
+	if (modH->u16ReqRate != 0 || modH->u32CpuUs != 0) return false; // the task charges every request to the budget
+#endif
+	if (u8rx[ ID ] != modH->u8id || modH->u8UnitCount != 0) return false;
+	if (modH->port->gState != HAL_UART_STATE_READY) return false;
+
+	for (uint8_t i = 0; i < 8; i++) u16crc = calcCRCByte(u16crc, u8rx[ i ]);
+	if (u16crc != 0) return false; // the task counts the CRC error
+
+	u16Add = word(u8rx[ ADD_HI ], u8rx[ ADD_LO ]);
+	u16Count = word(u8rx[ NB_HI ], u8rx[ NB_LO ]);
+	if (u16Count == 0) return false;
+	xFunction = getFunction(u8rx[ FUNC ]);
+	if (xFunction == NULL) return false;
+
+	switch (u8rx[ FUNC ])
+	{
+#if MB_SLAVE_FC(MB_ENABLE_FC1) || MB_SLAVE_FC(MB_ENABLE_FC2)
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+		if (xFunction->process != process_FC1) return false;
+		if (u8rx[ FUNC ] == MB_FC_READ_COILS)
+		{
+			if ((uint32_t)u16Add + u16Count > (uint32_t)modH->u16regCoils_size * 16) return false;
+			u16src = modH->u16regsCoils;
+			xLock = modH->ModBusSphrCoilsHandle;
+		}
+		else
+		{
+			if ((uint32_t)u16Add + u16Count > (uint32_t)modH->u16regCoilsRO_size * 16) return false;
+			u16src = modH->u16regsCoilsRO;
+			xLock = modH->ModBusSphrCoilsROHandle;
+		}
+		u16Bytes = (u16Count + 7) / 8;
+		break;
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4)
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+	{
+		uint8_t u8table = (u8rx[ FUNC ] == MB_FC_READ_REGISTERS) ? DB_HOLDING_REGISTER : DB_INPUT_REGISTERS;
+		const modbusSegment_t *xSeg = findSegment(modH, u8table, u16Add, u16Count);
+
+		if (xFunction->process != process_FC3) return false;
+#if ENABLE_MB_DIAG_REGS == 1
+		if (isDiagRange(u8table, u16Add, u16Count)) return false;
+#endif
+		if (xSeg != NULL && xSeg->xOnRead != NULL) return false;
+#if ENABLE_MB_RO_SNAPSHOT == 1
+		if (u8table == DB_INPUT_REGISTERS && modH->u16regsROBank[0] != NULL)
+		{
+			if ((uint32_t)u16Add + u16Count > modH->u16regRO_size) return false;
+			u16Bytes = u16Count * 2; // the snapshot is read without lock
+			break;
+		}
+#endif
+#if ENABLE_MB_SHARED_HR == 1
+		if (u8table == DB_HOLDING_REGISTER && isSharedHR(modH))
+		{
+			if ((uint32_t)u16Add + u16Count > modH->u16regHR_size) return false;
+			u16Bytes = u16Count * 2; // the committed bank is read without lock
+			break;
+		}
+#endif
+		u16src = mapRegisters(modH, u8table, u16Add, u16Count);
+		if (u16src == NULL) return false;
+		xWire = isWireOrder(modH, u8table, u16Add, u16Count);
+		xLock = (u8table == DB_INPUT_REGISTERS) ? modH->ModBusSphrROHandle : modH->ModBusSphrHandle;
+		u16Bytes = u16Count * 2;
+		break;
+	}
+#endif
+	default:
+		return false;
+	}
+	if (u16Bytes + 5 > MAX_BUFFER) return false;
+
+	// an application task updating the table keeps the request for the slave task
+	if (xLock != NULL && xSemaphoreTakeFromISR(xLock, pxHigherPriorityTaskWoken) != pdTRUE) return false;
+
+	u8tx[ ID ] = u8rx[ ID ];
+	u8tx[ FUNC ] = u8rx[ FUNC ];
+	u8tx[ 2 ] = (uint8_t)u16Bytes;
+	switch (u8rx[ FUNC ])
+	{
+#if MB_SLAVE_FC(MB_ENABLE_FC1) || MB_SLAVE_FC(MB_ENABLE_FC2)
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+		readCoils(u16src, u16Add, u16Count, &u8tx[ 3 ]);
+		break;
+#endif
+	default:
+#if ENABLE_MB_SHARED_HR == 1
+		if (u16src == NULL && u8rx[ FUNC ] == MB_FC_READ_REGISTERS)
+		{
+			putCommittedHR(modH, &u8tx[ 3 ], u16Add, u16Count);
+			break;
+		}
+#endif
+#if ENABLE_MB_RO_SNAPSHOT == 1
+		if (u16src == NULL)
+		{
+			putSnapshot(modH, &u8tx[ 3 ], u16Add, u16Count);
+			break;
+		}
+#endif
+		if (xWire) memcpy(&u8tx[ 3 ], u16src, u16Count * 2);
+		else putRegisters(&u8tx[ 3 ], u16src, u16Count);
+		break;
+	}
+
+	if (xLock != NULL) xSemaphoreGiveFromISR(xLock, pxHigherPriorityTaskWoken);
+
+	u16Bytes += 3;
+	u16crc = 0xFFFF;
+	for (uint16_t i = 0; i < u16Bytes; i++) u16crc = calcCRCByte(u16crc, u8tx[ i ]);
+	u8tx[ u16Bytes++ ] = u16crc & 0x00ff;
+	u8tx[ u16Bytes++ ] = u16crc >> 8;
+
+	if (modH->EN_Port != NULL)
+	{
+#if ENABLE_USART_DMA_LL == 1
+		LL_USART_SetTransferDirection(modH->port->Instance, LL_USART_DIRECTION_TX);
+#else
+		HAL_HalfDuplex_EnableTransmitter(modH->port);
+#endif
+		HAL_GPIO_WritePin(modH->EN_Port, modH->EN_Pin, GPIO_PIN_SET);
+	}
+	cleanDCache(u8tx, u16Bytes);
+#if ENABLE_USART_DMA_LL == 1
+	transmitDMA(modH, u8tx, u16Bytes);
+#else
+	HAL_UART_Transmit_DMA(modH->port, u8tx, u16Bytes);
+#endif
+#if ENABLE_MB_WIRE_STATS == 1
+	countWireRx(modH, 8, false);
+	countWireTx(modH, u16Bytes);
+#endif
+
+	modH->u16InCnt++;
+	modH->u16OutCnt++;
+	MB_COUNT_SLAVE_MSG(modH);
+	return true;
+}
+#endif
+
+
+void StartTaskModbusSlave(void *argument)
+{
+
+  modbusHandler_t *modH =  (modbusHandler_t *)argument;
+  //uint32_t notification;
+  for(;;)
+  {
+   if(modH->xTransport->serve != NULL)
+   {
+	  modH->xTransport->serve(modH); /* the transport parses its own ADUs */
+	  continue;
+   }
+
+   modH->xTransport->wait(modH); /* Block until a Modbus Frame arrives */
+
+   MB_TRACE(modH, MB_TS_WAKE);
+   serveRequest(modH);
+   if(modH->xTransport->release != NULL)
+   {
+	  modH->xTransport->release(modH); /* u8Buffer is free again, the answer was sent */
+   }
+  }
+
+}
+#endif
+
+#if MB_ENABLE_IP == 1
+/**
+ * @brief
+ * Callback of the netconns of the TCP and UDP handlers, it runs in the tcpip thread of lwIP.
+ * A new connection, received data and a close are all NETCONN_EVT_RCVPLUS: the callback
+ * marks the netconn ready in u32TcpReady and wakes the slave task owning it. A client
+ * not accepted yet marks every connection of every TCP slave. The netconn of a
+ * master or of a UDP slave only wakes its task
+ *
+ * @ingroup tcp
+ */
+static void tcpEventCallback(struct netconn *conn, enum netconn_evt evt, u16_t len)
+{
+	modbusHandler_t *modH;
+	uint32_t u32Bits = 0;
+	(void)len;
+
+	if (evt != NETCONN_EVT_RCVPLUS) return;
+
+	for (uint8_t i = 0; i < numberHandlers && u32Bits == 0; i++)
+	{
+		modH = mHandlers[i];
+		if (modH == NULL || (modH->xTransport->u8Flags & MB_TP_MBAP) == 0) continue;
+#if MB_ENABLE_MASTER == 1
+		if (modH->uModbusType == MB_MASTER)
+		{
+			if (modH->xTcpClient == conn)
+			{
+				notifyModbus(modH, MB_EV_RX);
+				return;
+			}
+			continue;
+		}
+#endif
+#if ENABLE_UDP == 1 && MB_ENABLE_SLAVE == 1
+		if (modH->xTypeHW == UDP_HW)
+		{
+			if (modH->xUdpConn == conn)
+			{
+				notifyModbus(modH, MB_EV_RX);
+				return;
+			}
+			continue;
+		}
+#endif
+#if ENABLE_TCP == 1 && MB_ENABLE_SLAVE == 1
+
+		if (modH->xTcpListen == conn) u32Bits = MB_TCP_ACCEPT;
+		for (uint8_t j = 0; j < NUMBERTCPCONN && u32Bits == 0; j++)
+		{
+			if (modH->xTcpConn[j].conn == conn) u32Bits = 1UL << j;
+		}
+		if (u32Bits != 0)
+		{
+			taskENTER_CRITICAL();
+			modH->u32TcpReady |= u32Bits;
+			taskEXIT_CRITICAL();
+			notifyModbus(modH, MB_EV_RX);
+		}
+#endif
+	}
+
+#if ENABLE_TCP == 1 && MB_ENABLE_SLAVE == 1
+	for (uint8_t i = 0; i < numberHandlers && u32Bits == 0; i++)
+	{
+		modH = mHandlers[i];
+		if (modH != NULL && modH->uModbusType == MB_SLAVE && modH->xTypeHW == TCP_HW)
+		{
+			taskENTER_CRITICAL();
+			modH->u32TcpReady |= MB_TCP_ACCEPT | ((1UL << NUMBERTCPCONN) - 1);
+			taskEXIT_CRITICAL();
+			notifyModbus(modH, MB_EV_RX);
+		}
+	}
+#endif
+}
+
+/**
+ * @brief
+ * Parses the first MBAP header of the bytes received on a connection or in a datagram
+ * in the pbufs and copies its unit ID and PDU to u8Buffer, the only copy of the ADU.
+ * u16BufferSize counts two more bytes, the CRC of an RTU frame, so the validation
+ * and the processing work on it unchanged
+ *
+ * @return 1 with an ADU in u8Buffer, 0 while the ADU is incomplete, ERR_BAD_SIZE
+ * for a dropped ADU shorter than u16MinSize, ERR_BAD_TCP_ID for another protocol or
+ * ERR_BUFF_OVERFLOW for an ADU longer than u8Buffer
+ * @ingroup tcp
+ */
+static int8_t getTcpAdu(modbusHandler_t *modH, struct pbuf **pxRx, uint16_t u16MinSize)
+{
+	struct pbuf *q = *pxRx;
+	uint16_t u16Length;
+
+	if (q == NULL || q->tot_len < MB_MBAP_SIZE) return 0;
+
+	if (pbuf_get_at(q, 2) != 0 || pbuf_get_at(q, 3) != 0) return ERR_BAD_TCP_ID;
+
+	u16Length = word(pbuf_get_at(q, 4), pbuf_get_at(q, 5));
+	if (u16Length + 2 > MAX_BUFFER) return ERR_BUFF_OVERFLOW;
+	if (q->tot_len < MB_MBAP_SIZE + u16Length) return 0; // the rest is still on the way
+
+	modH->u16TransactionID = word(pbuf_get_at(q, 0), pbuf_get_at(q, 1));
+	pbuf_copy_partial(q, modH->u8Buffer, u16Length, MB_MBAP_SIZE);
+	modH->u16BufferSize = u16Length + 2;
+	*pxRx = pbuf_free_header(q, MB_MBAP_SIZE + u16Length);
+	modH->u16InCnt++;
+#if ENABLE_MB_STATS == 1
+	updateHist(&modH->xStatFrame, u16Length + MB_MBAP_SIZE);
+#endif
+
+	return (modH->u16BufferSize < u16MinSize) ? ERR_BAD_SIZE : 1;
+}
+
+/**
+ * @brief
+ * Writes the MBAP header of an ADU of u16Length bytes, the unit ID included
+ *
+ * @ingroup tcp
+ */
+static void putMbap(uint8_t *u8Mbap, uint16_t u16TransactionID, uint16_t u16Length)
+{
+	u8Mbap[ 0 ] = highByte(u16TransactionID);
+	u8Mbap[ 1 ] = lowByte(u16TransactionID);
+	u8Mbap[ 2 ] = 0; // protocol ID
+	u8Mbap[ 3 ] = 0;
+	u8Mbap[ 4 ] = highByte(u16Length);
+	u8Mbap[ 5 ] = lowByte(u16Length);
+}
+
+/**
+ * @brief
+ * Port of the server: u16TcpPort, by default MB_TCP_PORT or MB_TLS_PORT for a
+ * handler with a TLS layer
+ *
+ * @ingroup tcp
+ */
+static uint16_t getIpPort(const modbusHandler_t *modH)
+{
+	if (modH->u16TcpPort != 0) return modH->u16TcpPort;
+#if ENABLE_MB_TLS == 1
+	if (modH->xTls != NULL) return MB_TLS_PORT;
+#endif
+	return MB_TCP_PORT;
+}
+
+#if ENABLE_UDP == 1
+/**
+ * @brief
+ * Takes the ADU of a datagram out of its netbuf with getTcpAdu(). A datagram carries
+ * exactly one ADU: one cut short is dropped, bytes after it are ignored
+ *
+ * @return 1 with an ADU in u8Buffer, ERR_BAD_SIZE, ERR_BAD_TCP_ID or ERR_BUFF_OVERFLOW
+ * @ingroup tcp
+ */
+static int8_t getUdpAdu(modbusHandler_t *modH, struct netbuf *xRx, uint16_t u16MinSize)
+{
+	struct pbuf *p = xRx->p;
+	int8_t i8result;
+
+	// the pbufs go to getTcpAdu(), which frees the ones it consumed
+	xRx->p = xRx->ptr = NULL;
+	i8result = getTcpAdu(modH, &p, u16MinSize);
+	if (p != NULL) pbuf_free(p);
+
+	return (i8result == 0) ? ERR_BAD_SIZE : i8result;
+}
+
+/**
+ * @brief
+ * Sends the ADU in u8Buffer behind its MBAP header in one datagram, to xAddr:u16Port
+ * or to the remote address of a connected netconn when xAddr is NULL. The datagram
+ * is built in a single pbuf of lwIP, the only copy of the ADU
+ *
+ * @return the error of lwIP, ERR_MEM without pbuf
+ * @ingroup tcp
+ */
+static err_t sendUdpAdu(modbusHandler_t *modH, struct netconn *conn, const ip_addr_t *xAddr, uint16_t u16Port,
+		uint16_t u16TransactionID)
+{
+	struct netbuf *xTx = netbuf_new();
+	uint8_t *u8Tx;
+	err_t xErr = ERR_MEM;
+
+	if (xTx == NULL) return ERR_MEM;
+
+	u8Tx = netbuf_alloc(xTx, MB_MBAP_SIZE + modH->u16BufferSize);
+	if (u8Tx != NULL)
+	{
+		putMbap(u8Tx, u16TransactionID, modH->u16BufferSize);
+		memcpy(&u8Tx[ MB_MBAP_SIZE ], modH->u8Buffer, modH->u16BufferSize);
+		xErr = (xAddr != NULL) ? netconn_sendto(conn, xTx, xAddr, u16Port) : netconn_send(conn, xTx);
+	}
+	netbuf_delete(xTx);
+	return xErr;
+}
+#endif
+#endif
+
+#if ENABLE_TCP == 1
+#if ENABLE_MB_TLS == 1
+/**
+ * @brief
+ * Secures the connections of a TCP slave or master with Modbus/TCP Security, the
+ * default port becomes MB_TLS_PORT. Each connection gets a session of xTls, which
+ * decrypts the received records in the pbufs of lwIP: the MBAP parser then reads
+ * the plaintext in place as it reads plain Modbus TCP. The layer must stay valid
+ * while the handler runs
+ *
+ * @param xTls TLS layer of the application, NULL for plain Modbus TCP
+ * @ingroup setup
+ */
+void ModbusSetTls(modbusHandler_t * modH, const modbusTlsOps_t *xTls)
+{
+	if (modH->xTypeHW != TCP_HW)
+	{
+		while(1);// error only the TCP connections are secured
+	}
+	if (xTls != NULL && (xTls->open == NULL || xTls->input == NULL || xTls->output == NULL || xTls->close == NULL))
+	{
+		while(1);// error a TLS layer needs its four operations
+	}
+
+	modH->xTls = xTls;
+}
+#endif
+
+/**
+ * @brief
+ * Takes one pbuf received on a TCP netconn without blocking. On a TLS session it
+ * is the application data of the records completed by the pbuf, *pp is NULL while
+ * a record or the handshake is incomplete
+ *
+ * @return ERR_OK, ERR_WOULDBLOCK when nothing more was received, or the error of the connection
+ * @ingroup tcp
+ */
+static err_t recvTcp(modbusHandler_t *modH, struct netconn *conn, void *pvTls, struct pbuf **pp)
+{
+	err_t xErr = netconn_recv_tcp_pbuf_flags(conn, pp, NETCONN_DONTBLOCK);
+
+#if ENABLE_MB_TLS == 1
+	if (xErr == ERR_OK && pvTls != NULL) xErr = modH->xTls->input(pvTls, *pp, pp);
+#else
+	(void)modH;
+	(void)pvTls;
+#endif
+	return xErr;
+}
+
+/**
+ * @brief
+ * Writes data to a TCP netconn, as records of its TLS session if it has one
+ *
+ * @param u8Flags NETCONN_MORE if more data follows at once
+ * @ingroup tcp
+ */
+static err_t writeTcp(modbusHandler_t *modH, struct netconn *conn, void *pvTls, const void *pvData, uint16_t u16Len, uint8_t u8Flags)
+{
+#if ENABLE_MB_TLS == 1
+	if (pvTls != NULL) return modH->xTls->output(pvTls, pvData, u16Len, u8Flags);
+#else
+	(void)modH;
+	(void)pvTls;
+#endif
+	return netconn_write(conn, pvData, u16Len, NETCONN_COPY | u8Flags);
+}
+
+#if MB_ENABLE_SLAVE == 1
+
+/**
+ * @brief
+ * Opens the listening netconn of a TCP slave on u16TcpPort. The connections are
+ * accepted and read without blocking, the callback tells the task which ones to look at
+ *
+ * @ingroup tcp
+ */
+static void startTcpServer(modbusHandler_t *modH)
+{
+	for (uint8_t i = 0; i < NUMBERTCPCONN; i++)
+	{
+		modH->xTcpConn[i].conn = NULL;
+		modH->xTcpConn[i].xRx = NULL;
+#if ENABLE_MB_TLS == 1
+		modH->xTcpConn[i].pvTls = NULL;
+#endif
+	}
+	modH->xTcpActive = NULL;
+	modH->u8TcpOldest = modH->u8TcpNewest = MB_TCP_NONE;
+	modH->u32TcpReady = 0;
+	modH->u16TcpTxLen = 0;
+
+	if (modH->xTcpListen != NULL) return; // already listening, ModbusStart() called again
+
+	modH->xTcpListen = netconn_new_with_callback(NETCONN_TCP, tcpEventCallback);
+	if (modH->xTcpListen == NULL)
+	{
+		while(1); //ERROR creating the netconn, start lwIP before ModbusStart() and check its memory pools
+	}
+
+	if (netconn_bind(modH->xTcpListen, IP_ADDR_ANY, getIpPort(modH)) != ERR_OK ||
+		netconn_listen(modH->xTcpListen) != ERR_OK)
+	{
+		while(1); //ERROR the port is in use or lwIP is out of TCP PCBs
+	}
+	netconn_set_nonblocking(modH->xTcpListen, 1);
+}
+
+/**
+ * @brief
+ * Moves a connection to the newest end of the LRU list, with a new one it
+ * is added there. All the connections have the same idle timeout, so the list is
+ * also sorted by deadline and only its oldest entry needs to be checked
+ *
+ * @ingroup tcp
+ */
+static void touchTcp(modbusHandler_t *modH, uint8_t u8Conn)
+{
+	modbusTcpConn_t *xConn = &modH->xTcpConn[ u8Conn ];
+
+	xConn->xLastRx = xTaskGetTickCount();
+	if (modH->u8TcpNewest == u8Conn) return;
+
+	unlinkTcp(modH, u8Conn);
+	xConn->u8Prev = modH->u8TcpNewest;
+	xConn->u8Next = MB_TCP_NONE;
+	if (modH->u8TcpNewest != MB_TCP_NONE) modH->xTcpConn[ modH->u8TcpNewest ].u8Next = u8Conn;
+	else modH->u8TcpOldest = u8Conn;
+	modH->u8TcpNewest = u8Conn;
+}
+
+/**
+ * @brief
+ * Takes a connection out of the LRU list, a connection not in the list has both
+ * links at MB_TCP_NONE and is not the oldest one
+ *
+ * @ingroup tcp
+ */
+static void unlinkTcp(modbusHandler_t *modH, uint8_t u8Conn)
+{
+	modbusTcpConn_t *xConn = &modH->xTcpConn[ u8Conn ];
+
+	if (xConn->u8Prev != MB_TCP_NONE) modH->xTcpConn[ xConn->u8Prev ].u8Next = xConn->u8Next;
+	else if (modH->u8TcpOldest == u8Conn) modH->u8TcpOldest = xConn->u8Next;
+	if (xConn->u8Next != MB_TCP_NONE) modH->xTcpConn[ xConn->u8Next ].u8Prev = xConn->u8Prev;
+	else if (modH->u8TcpNewest == u8Conn) modH->u8TcpNewest = xConn->u8Prev;
+	xConn->u8Prev = xConn->u8Next = MB_TCP_NONE;
+}
+
+/**
+ * @brief
+ * Ticks the slave task may sleep: until the idle deadline of the least recently
+ * used connection, forever without connections or idle timeout
+ *
+ * @ingroup tcp
+ */
+static TickType_t getTcpWait(modbusHandler_t *modH)
+{
+	TickType_t xIdle;
+
+	if (TCPIDLETIMEOUT == 0 || modH->u8TcpOldest == MB_TCP_NONE) return portMAX_DELAY;
+
+	xIdle = xTaskGetTickCount() - modH->xTcpConn[ modH->u8TcpOldest ].xLastRx;
+	return (xIdle >= TCPIDLETIMEOUT) ? 0 : TCPIDLETIMEOUT - xIdle;
+}
+
+/**
+ * @brief
+ * Serves the lwIP events marked by the callback: answers the requests completed by
+ * the buses of a gateway, accepts the new clients, replacing the least recently used
+ * connection when all are in use, and reads the connections with data. Then closes
+ * the connections past their idle deadline
+ *
+ * @ingroup tcp
+ */
+static void serveTcp(modbusHandler_t *modH)
+{
+	struct netconn *xNew;
+	modbusTcpConn_t *xConn;
+	uint32_t u32Ready;
+	uint8_t i;
+
+	taskENTER_CRITICAL();
+	u32Ready = modH->u32TcpReady;
+	modH->u32TcpReady = 0;
+	taskEXIT_CRITICAL();
+
+#if ENABLE_MB_GATEWAY == 1
+	answerGateway(modH);
+#endif
+
+	if (u32Ready & MB_TCP_ACCEPT)
+	{
+		while (netconn_accept(modH->xTcpListen, &xNew) == ERR_OK)
+		{
+#if ENABLE_MB_TLS == 1
+			void *pvTls = NULL;
+
+			if (modH->xTls != NULL && (pvTls = modH->xTls->open(modH->xTls->pvCtx, xNew, true)) == NULL)
+			{
+				netconn_close(xNew); // no session for the client, the layer is out of memory
+				netconn_delete(xNew);
+				continue;
+			}
+#endif
+			for (i = 0; i < NUMBERTCPCONN && modH->xTcpConn[i].conn != NULL; i++);
+			if (i == NUMBERTCPCONN)
+			{
+				i = modH->u8TcpOldest; // evict the least recently used client
+				closeTcp(modH, &modH->xTcpConn[i]);
+			}
+			xConn = &modH->xTcpConn[i];
+			xConn->conn = xNew;
+			xConn->xRx = NULL;
+#if ENABLE_MB_TLS == 1
+			xConn->pvTls = pvTls;
+#endif
+			xConn->u8Prev = xConn->u8Next = MB_TCP_NONE;
+			touchTcp(modH, i);
+			u32Ready |= 1UL << i; // data may have come before the accept
+		}
+	}
+
+	for (i = 0; i < NUMBERTCPCONN; i++)
+	{
+		if ((u32Ready & (1UL << i)) && modH->xTcpConn[i].conn != NULL)
+		{
+			receiveTcp(modH, &modH->xTcpConn[i]);
+		}
+	}
+
+	while (getTcpWait(modH) == 0)
+	{
+		closeTcp(modH, &modH->xTcpConn[ modH->u8TcpOldest ]);
+	}
+}
+
+/**
+ * @brief
+ * Takes the pbufs received on a connection without copying them and answers each
+ * complete ADU, so the requests a client pipelines are served in one pass and
+ * their answers leave in one write. The connection is closed by the client, on a
+ * network error or on an MBAP header that breaks the framing of the stream
+ *
+ * @ingroup tcp
+ */
+static void receiveTcp(modbusHandler_t *modH, modbusTcpConn_t *xConn)
+{
+	struct pbuf *p;
+	err_t xErr;
+	int8_t i8result;
+	uint8_t u8id;
+
+	while ((xErr = recvTcp(modH, xConn->conn, MB_CONN_TLS(xConn), &p)) == ERR_OK)
+	{
+		touchTcp(modH, (uint8_t)(xConn - modH->xTcpConn));
+		if (p == NULL) continue; // TLS handshake or part of a record
+		if (xConn->xRx == NULL) xConn->xRx = p;
+		else pbuf_cat(xConn->xRx, p);
+	}
+
+	modH->xTcpActive = xConn;
+	while (xConn->conn != NULL && (i8result = getTcpAdu(modH, &xConn->xRx, MB_MIN_REQUEST)) != 0)
+	{
+		if (i8result < 0)
+		{
+			modH->i8lastError = i8result;
+			modH->u16errCnt++;
+			MB_COUNT_ERR(modH, i8result);
+			if (i8result != ERR_BAD_SIZE)
+			{
+				flushTcp(modH, xConn); // answer the requests before it
+				if (xConn->conn != NULL) closeTcp(modH, xConn); // the next ADU cannot be found
+			}
+			continue;
+		}
+
+		modH->i8lastError = 0;
+		MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, 0, 0);
+		// unit ID 0 and 0xFF address the server itself, there is no broadcast over TCP
+		u8id = modH->u8Buffer[ ID ];
+		if (u8id == 0 || u8id == 0xFF) u8id = modH->u8id;
+#if ENABLE_MB_GATEWAY == 1
+		if (forwardGateway(modH, xConn, u8id)) continue;
+#endif
+		answerRequest(modH, u8id, false);
+	}
+	if (xConn->conn != NULL) flushTcp(modH, xConn);
+	modH->xTcpActive = NULL;
+
+	if (xErr != ERR_WOULDBLOCK && xConn->conn != NULL)
+	{
+		closeTcp(modH, xConn); // closed by the client or reset
+	}
+}
+
+/**
+ * @brief
+ * Queues the answer in u8Buffer behind its MBAP header, which carries the transaction
+ * ID of the request, in u8TcpTx. The answers of a pass on the connection are sent
+ * together by flushTcp(), earlier only when u8TcpTx is full
+ *
+ * @ingroup tcp
+ */
+static void sendTcpAnswer(modbusHandler_t *modH)
+{
+	modbusTcpConn_t *xConn = modH->xTcpActive;
+	uint8_t *u8Mbap;
+
+	if (modH->u16TcpTxLen + MB_MBAP_SIZE + modH->u16BufferSize > TCPTXBUFFER)
+	{
+		flushTcp(modH, xConn);
+	}
+
+	MB_LOG_EVENT(modH, MB_EVT_TX, modH->u8Buffer, modH->u16BufferSize,
+			(modH->u8Buffer[ FUNC ] & 0x80) ? (int8_t)modH->u8Buffer[ 2 ] : 0, 0);
+
+	if (xConn->conn != NULL)
+	{
+		u8Mbap = &modH->u8TcpTx[ modH->u16TcpTxLen ];
+		putMbap(u8Mbap, modH->u16TransactionID, modH->u16BufferSize);
+		memcpy(&u8Mbap[ MB_MBAP_SIZE ], modH->u8Buffer, modH->u16BufferSize);
+		modH->u16TcpTxLen += MB_MBAP_SIZE + modH->u16BufferSize;
+	}
+
+	modH->u16BufferSize = 0;
+	modH->u16OutCnt++;
+}
+
+/**
+ * @brief
+ * Writes the queued answers to the connection in one netconn_write(), one call to
+ * the tcpip thread and as few segments as the window allows
+ *
+ * @ingroup tcp
+ */
+static void flushTcp(modbusHandler_t *modH, modbusTcpConn_t *xConn)
+{
+	if (modH->u16TcpTxLen == 0) return;
+
+	if (writeTcp(modH, xConn->conn, MB_CONN_TLS(xConn), modH->u8TcpTx, modH->u16TcpTxLen, 0) != ERR_OK)
+	{
+		closeTcp(modH, xConn);
+	}
+	modH->u16TcpTxLen = 0;
+}
+
+/**
+ * @brief
+ * Closes a client connection, frees the bytes it left unserved and takes it out of the LRU list
+ *
+ * @ingroup tcp
+ */
+static void closeTcp(modbusHandler_t *modH, modbusTcpConn_t *xConn)
+{
+	unlinkTcp(modH, (uint8_t)(xConn - modH->xTcpConn));
+#if ENABLE_MB_TLS == 1
+	if (xConn->pvTls != NULL) modH->xTls->close(xConn->pvTls);
+	xConn->pvTls = NULL;
+#endif
+	netconn_close(xConn->conn);
+	netconn_delete(xConn->conn);
+	if (xConn->xRx != NULL) pbuf_free(xConn->xRx);
+	xConn->conn = NULL;
+	xConn->xRx = NULL;
+}
+
+#if ENABLE_MB_GATEWAY == 1
+/**
+ * @brief
+ * *** Only Modbus TCP slave ***
+ * Makes the slave a gateway: the requests to the unit IDs of a route are sent by
+ * the RTU master xBus of the route instead of being answered from the tables of the
+ * slave. Each bus has its own master task and telegram queue, a slow bus does not
+ * delay the others. The routes must not overlap u8id and xUnits, and must stay
+ * valid while the slave runs
+ *
+ * @param xRoutes routes, u8Pending counts the requests waiting on each bus
+ * @param u8count number of routes
+ * @ingroup setup
+ */
+void ModbusSetGateway(modbusHandler_t * modH, modbusRoute_t *xRoutes, uint8_t u8count)
+{
+	if (modH->uModbusType != MB_SLAVE || modH->xTypeHW != TCP_HW)
+	{
+		while(1);// error only a TCP slave can be a gateway
+	}
+
+	for (uint8_t i = 0; i < u8count; i++)
+	{
+		if (xRoutes[i].xBus == NULL || xRoutes[i].xBus->uModbusType != MB_MASTER ||
+			xRoutes[i].u8First == 0 || xRoutes[i].u8First > xRoutes[i].u8Last)
+		{
+			while(1);// error a route needs a master and unit IDs from u8First to u8Last
+		}
+		xRoutes[i].u8Pending = 0;
+	}
+
+	modH->u8RouteCount = u8count;
+	modH->xRoutes = xRoutes;
+}
+
+/**
+ * @brief
+ * Forwards the request in u8Buffer to the bus of unit u8id. The request goes to the
+ * telegram queue of the bus master, the answer is sent by answerGateway() when the
+ * bus completes it. A bus without room gets exception 0x0A at once
+ *
+ * @return false if no route has u8id, the slave answers the request itself
+ * @ingroup gateway
+ */
+static bool forwardGateway(modbusHandler_t *modH, modbusTcpConn_t *xConn, uint8_t u8id)
+{
+	modbusRoute_t *xRoute = NULL;
+	modbusGwQuery_t *xQuery = NULL;
+	uint8_t u8exception;
+	uint8_t i;
+
+	for (i = 0; i < modH->u8RouteCount && xRoute == NULL; i++)
+	{
+		if (u8id >= modH->xRoutes[i].u8First && u8id <= modH->xRoutes[i].u8Last) xRoute = &modH->xRoutes[i];
+	}
+	if (xRoute == NULL) return false;
+
+	for (i = 0; i < MB_GW_QUERIES && xQuery == NULL; i++)
+	{
+		if (!modH->xGwQueries[i].xUsed) xQuery = &modH->xGwQueries[i];
+	}
+
+	u8exception = (xQuery == NULL) ? EXC_GW_PATH : buildGatewayQuery(modH, xQuery);
+	if (u8exception == 0 && xRoute->u8Pending >= MB_GW_BUS_QUERIES) u8exception = EXC_GW_PATH;
+
+	if (u8exception == 0)
+	{
+		xQuery->telegram.u8id = u8id;
+		xQuery->telegram.u8retries = xRoute->u8retries;
+		xQuery->xGateway = modH;
+		xQuery->xRoute = xRoute;
+		xQuery->conn = xConn->conn;
+		xQuery->u16TransactionID = modH->u16TransactionID;
+		// taken before the bus may complete it
+		xQuery->xUsed = true;
+		xRoute->u8Pending++;
+		if (ModbusQueryAsync(xRoute->xBus, xQuery->telegram, gatewayCallback, xQuery)) return true;
+
+		xQuery->xUsed = false;
+		xRoute->u8Pending--;
+		u8exception = EXC_GW_PATH; // the telegram queue of the bus is full
+	}
+
+	buildException(u8exception, modH);
+	sendTxBuffer(modH);
+	return true;
+}
+
+/**
+ * @brief
+ * Translates the request in u8Buffer to the telegram of xQuery, the data written
+ * by FC5, FC6, FC15 and FC16 are copied to u16Data
+ *
+ * @return 0 or the exception code of a request the gateway cannot forward
+ * @ingroup gateway
+ */
+static uint8_t buildGatewayQuery(modbusHandler_t *modH, modbusGwQuery_t *xQuery)
+{
+	modbus_t *telegram = &xQuery->telegram;
+	uint16_t u16Count = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
+	uint8_t u8bytes = modH->u8Buffer[ BYTE_CNT ];
+
+	memset(telegram, 0, sizeof(modbus_t));
+	telegram->u8fct = (mb_functioncode_t) modH->u8Buffer[ FUNC ];
+	telegram->u16RegAdd = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
+	telegram->u16CoilsNo = u16Count;
+	telegram->u16reg = xQuery->u16Data;
+
+	switch( telegram->u8fct )
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+		if (u16Count == 0 || u16Count > MB_GW_REGS * 16) return EXC_REGS_QUANT;
+		break;
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+		if (u16Count == 0 || u16Count > MB_GW_REGS) return EXC_REGS_QUANT;
+		break;
+	case MB_FC_WRITE_COIL:
+		if (u16Count != 0xFF00 && u16Count != 0) return EXC_REGS_QUANT;
+		xQuery->u16Data[ 0 ] = (u16Count == 0xFF00);
+		telegram->u16CoilsNo = 1;
+		break;
+	case MB_FC_WRITE_REGISTER:
+		xQuery->u16Data[ 0 ] = u16Count;
+		telegram->u16CoilsNo = 1;
+		break;
+	case MB_FC_WRITE_MULTIPLE_COILS:
+		if (u16Count == 0 || u16Count > 1968 || u8bytes != (u16Count + 7) / 8 ||
+			modH->u16BufferSize < BYTE_CNT + 1 + u8bytes + 2) return EXC_REGS_QUANT;
+		// the image of the forwarded FC15, buildQuery() packs it again
+		writeCoils(xQuery->u16Data, 0, u16Count, &modH->u8Buffer[ BYTE_CNT + 1 ]);
+		break;
+	case MB_FC_WRITE_MULTIPLE_REGISTERS:
+		if (u16Count == 0 || u16Count > 123 || u8bytes != u16Count * 2 ||
+			modH->u16BufferSize < BYTE_CNT + 1 + u8bytes + 2) return EXC_REGS_QUANT;
+		getRegisters(xQuery->u16Data, &modH->u8Buffer[ BYTE_CNT + 1 ], u16Count);
+		break;
+	default:
+		return EXC_FUNC_CODE;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief
+ * Completion callback of the forwarded queries, it runs in the task of the bus master.
+ * The result is left in the query and the gateway task is woken to send the answer
+ *
+ * @ingroup gateway
+ */
+static void gatewayCallback(modbus_t *telegram, int8_t i8result, void *pvContext)
+{
+	modbusGwQuery_t *xQuery = (modbusGwQuery_t *) pvContext;
+	modbusHandler_t *modH = xQuery->xGateway;
+
+	xQuery->i8result = i8result;
+	// the answer of the RTU slave is still in u8Buffer of the bus
+	xQuery->u8Exception = (i8result == ERR_EXCEPTION) ? xQuery->xRoute->xBus->u8Buffer[ 2 ] : 0;
+
+	taskENTER_CRITICAL();
+	modH->u32GwDone |= 1UL << (xQuery - modH->xGwQueries);
+	taskEXIT_CRITICAL();
+	notifyModbus(modH, MB_EV_RX);
+}
+
+/**
+ * @brief
+ * Sends the answers of the queries completed by the buses to their clients, a client
+ * that closed its connection meanwhile gets nothing
+ *
+ * @ingroup gateway
+ */
+static void answerGateway(modbusHandler_t *modH)
+{
+	modbusGwQuery_t *xQuery;
+	uint32_t u32Done;
+	uint8_t i, j;
+
+	taskENTER_CRITICAL();
+	u32Done = modH->u32GwDone;
+	modH->u32GwDone = 0;
+	taskEXIT_CRITICAL();
+
+	for (i = 0; u32Done != 0; i++, u32Done >>= 1)
+	{
+		xQuery = &modH->xGwQueries[i];
+		if (!(u32Done & 1) || !xQuery->xUsed) continue;
+
+		xQuery->xUsed = false;
+		xQuery->xRoute->u8Pending--;
+
+		for (j = 0; j < NUMBERTCPCONN && modH->xTcpConn[j].conn != xQuery->conn; j++);
+		if (j == NUMBERTCPCONN || xQuery->conn == NULL) continue;
+
+		modH->xTcpActive = &modH->xTcpConn[j];
+		modH->u16TransactionID = xQuery->u16TransactionID;
+		buildGatewayAnswer(modH, xQuery);
+		sendTxBuffer(modH);
+		flushTcp(modH, modH->xTcpActive);
+		modH->xTcpActive = NULL;
+	}
+}
+
+/**
+ * @brief
+ * Writes to u8Buffer the answer to the request of xQuery: the data read from the
+ * bus, the echo of a write, the exception of the RTU slave or 0x0B when the slave
+ * did not answer
+ *
+ * @ingroup gateway
+ */
+static void buildGatewayAnswer(modbusHandler_t *modH, modbusGwQuery_t *xQuery)
+{
+	modbus_t *telegram = &xQuery->telegram;
+	uint8_t u8bytes;
+
+	modH->u8Buffer[ ID ] = telegram->u8id;
+	modH->u8Buffer[ FUNC ] = telegram->u8fct;
+
+	if (xQuery->i8result != ERR_OK_QUERY)
+	{
+		buildException((xQuery->i8result == ERR_EXCEPTION) ? xQuery->u8Exception : EXC_GW_TARGET, modH);
+		return;
+	}
+
+	switch( telegram->u8fct )
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+		u8bytes = (telegram->u16CoilsNo + 7) / 8;
+		modH->u8Buffer[ 2 ] = u8bytes;
+		readCoils(xQuery->u16Data, 0, telegram->u16CoilsNo, &modH->u8Buffer[ 3 ]);
+		modH->u16BufferSize = 3 + u8bytes;
+		break;
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+		modH->u8Buffer[ 2 ] = telegram->u16CoilsNo * 2;
+		putRegisters(&modH->u8Buffer[ 3 ], xQuery->u16Data, telegram->u16CoilsNo);
+		modH->u16BufferSize = 3 + telegram->u16CoilsNo * 2;
+		break;
+	default:
+		// the writes echo the address and the value or the quantity of the request
+		modH->u8Buffer[ ADD_HI ] = highByte( telegram->u16RegAdd );
+		modH->u8Buffer[ ADD_LO ] = lowByte( telegram->u16RegAdd );
+		modH->u8Buffer[ NB_HI ] = highByte( telegram->u16CoilsNo );
+		modH->u8Buffer[ NB_LO ] = lowByte( telegram->u16CoilsNo );
+		if (telegram->u8fct == MB_FC_WRITE_COIL)
+		{
+			modH->u8Buffer[ NB_HI ] = xQuery->u16Data[ 0 ] ? 0xFF : 0;
+			modH->u8Buffer[ NB_LO ] = 0;
+		}
+		else if (telegram->u8fct == MB_FC_WRITE_REGISTER)
+		{
+			modH->u8Buffer[ NB_HI ] = highByte( xQuery->u16Data[ 0 ] );
+			modH->u8Buffer[ NB_LO ] = lowByte( xQuery->u16Data[ 0 ] );
+		}
+		modH->u16BufferSize = 6;
+		break;
+	}
+}
+#endif
+#endif
+#endif
+
+#if MB_ENABLE_IP == 1 && MB_ENABLE_MASTER == 1
+/**
+ * @brief
+ * Resets a TCP or UDP master, the netconn to xTcpServer is opened by the master task
+ * for the first query. Queries still in flight when ModbusStart() is called again fail
+ *
+ * @ingroup tcp
+ */
+static void startTcpClient(modbusHandler_t *modH)
+{
+	if (modH->xTcpClient != NULL) closeTcpClient(modH, ERR_SLAVE_OFFLINE);
+
+	for (uint8_t i = 0; i < TCPINFLIGHT; i++)
+	{
+		modH->xTcpQueries[i].xUsed = false;
+	}
+	modH->xTcpRx = NULL;
+	modH->xPollCurrent = NULL;
+}
+
+/**
+ * @brief
+ * Connects the master to xTcpServer:u16TcpPort, the call blocks until the slave
+ * accepts or lwIP gives up. Answers are read without blocking, the callback wakes
+ * the master task when they arrive. A UDP netconn only records the address of the
+ * slave, it then receives the datagrams of the slave alone
+ *
+ * @return true if connected
+ * @ingroup tcp
+ */
+static bool connectTcpClient(modbusHandler_t *modH)
+{
+	modH->xTcpClient = netconn_new_with_callback((modH->xTypeHW == UDP_HW) ? NETCONN_UDP : NETCONN_TCP, tcpEventCallback);
+	if (modH->xTcpClient == NULL) return false; // out of netconns, the next query tries again
+
+	if (netconn_connect(modH->xTcpClient, &modH->xTcpServer, getIpPort(modH)) != ERR_OK)
+	{
+		netconn_delete(modH->xTcpClient);
+		modH->xTcpClient = NULL;
+		return false;
+	}
+#if ENABLE_MB_TLS == 1
+	modH->pvTlsClient = NULL;
+	if (modH->xTls != NULL && (modH->pvTlsClient = modH->xTls->open(modH->xTls->pvCtx, modH->xTcpClient, false)) == NULL)
+	{
+		netconn_close(modH->xTcpClient);
+		netconn_delete(modH->xTcpClient);
+		modH->xTcpClient = NULL;
+		return false;
+	}
+#endif
+	return true;
+}
+
+/**
+ * @brief
+ * One pass of a TCP or UDP master: sends the queued telegrams while there is a free entry
+ * in xTcpQueries, without waiting for the answers of the previous ones, then sleeps
+ * until lwIP, a new query or the first deadline wakes it, matches the answers to
+ * their queries by transaction ID and times out the late ones
+ *
+ * @ingroup tcp
+ */
+static void serveTcpMaster(modbusHandler_t *modH)
+{
+	modbusTcpQuery_t *xQuery;
+	modbus_t *telegram;
+
+	if (modH->xTcpClient == NULL)
+	{
+		// connect for the first query, a slave out of reach fails the queued ones
+		xSemaphoreTake(modH->QueueTelegramHandle, portMAX_DELAY);
+		xSemaphoreGive(modH->QueueTelegramHandle); // the telegram stays queued
+		if (!connectTcpClient(modH))
+		{
+			while ((telegram = takeTelegram(modH, MB_PRIO_BACKGROUND, 0)) != NULL)
+			{
+				modH->i8lastError = ERR_SLAVE_OFFLINE;
+				modH->u16errCnt++;
+				MB_COUNT_ERR(modH, ERR_SLAVE_OFFLINE);
+				notifyQueryResult(modH, telegram, ERR_SLAVE_OFFLINE);
+			}
+			return;
+		}
+	}
+
+	while ((xQuery = findTcpQuery(modH, false, 0)) != NULL &&
+			(telegram = takeTelegram(modH, MB_PRIO_BACKGROUND, 0)) != NULL)
+	{
+		sendTcpQuery(modH, xQuery, telegram);
+		releaseTelegram(modH, telegram); // xQuery keeps its own copy while it is in flight
+		if (modH->xTcpClient == NULL) return; // connection lost, the queue waits for the next one
+	}
+
+	ulTaskNotifyTake(pdTRUE, getTcpQueryWait(modH));
+#if ENABLE_TCP == 1
+	if (modH->xTypeHW == TCP_HW && modH->xTcpClient != NULL) receiveTcpAnswers(modH);
+#endif
+#if ENABLE_UDP == 1
+	if (modH->xTypeHW == UDP_HW && modH->xTcpClient != NULL) receiveUdpAnswers(modH);
+#endif
+	expireTcpQueries(modH);
+}
+
+/**
+ * @brief
+ * Sends telegram behind an MBAP header with the next transaction ID and keeps it in
+ * xQuery until its answer or its deadline. There is no retry over TCP, it already
+ * delivers the query or loses the connection. Over UDP expireTcpQueries() sends the
+ * query again u8retries times
+ *
+ * @ingroup tcp
+ */
+static void sendTcpQuery(modbusHandler_t *modH, modbusTcpQuery_t *xQuery, modbus_t *telegram)
+{
+	xQuery->telegram = *telegram;
+	openTransaction(&xQuery->xTransaction, telegram);
+	xQuery->u16TransactionID = modH->u16TcpNextID++;
+	xQuery->u8Retries = 0;
+	xQuery->xUsed = true;
+
+	writeTcpQuery(modH, xQuery);
+}
+
+/**
+ * @brief
+ * Writes the query of xQuery to the slave and starts its timeout, in one datagram
+ * over UDP. A failed write fails it with the other queries in flight
+ *
+ * @ingroup tcp
+ */
+static void writeTcpQuery(modbusHandler_t *modH, modbusTcpQuery_t *xQuery)
+{
+	modbus_t *telegram = &xQuery->telegram;
+	err_t xErr = ERR_OK;
+
+	xQuery->xDeadline = xTaskGetTickCount() + (telegram->u16timeOut ? telegram->u16timeOut : modH->u16timeOut);
+
+	buildQuery(modH, telegram);
+	MB_LOG_EVENT(modH, MB_EVT_TX, modH->u8Buffer, modH->u16BufferSize, 0, 0);
+
+#if ENABLE_UDP == 1
+	if (modH->xTypeHW == UDP_HW)
+	{
+		xErr = sendUdpAdu(modH, modH->xTcpClient, NULL, 0, xQuery->u16TransactionID);
+	}
+#endif
+#if ENABLE_TCP == 1
+	if (modH->xTypeHW == TCP_HW)
+	{
+		uint8_t u8Mbap[ MB_MBAP_SIZE ];
+
+		putMbap(u8Mbap, xQuery->u16TransactionID, modH->u16BufferSize);
+		xErr = writeTcp(modH, modH->xTcpClient, MB_CLIENT_TLS(modH), u8Mbap, MB_MBAP_SIZE, NETCONN_MORE);
+		if (xErr == ERR_OK) xErr = writeTcp(modH, modH->xTcpClient, MB_CLIENT_TLS(modH), modH->u8Buffer, modH->u16BufferSize, 0);
+	}
+#endif
+
+	if (xErr != ERR_OK)
+	{
+		modH->u16errCnt++;
+		MB_COUNT_ERR(modH, ERR_SLAVE_OFFLINE);
+		closeTcpClient(modH, ERR_SLAVE_OFFLINE); // fails xQuery with the others in flight
+		return;
+	}
+	modH->u16OutCnt++;
+}
+
+#if ENABLE_TCP == 1
+/**
+ * @brief
+ * Takes the pbufs received from the slave and hands each complete answer to the
+ * query with its transaction ID, in whatever order the slave answers. An answer
+ * without query, late after its timeout, is dropped. The connection is closed by
+ * the slave, on a network error or on an MBAP header that breaks the framing
+ *
+ * @ingroup tcp
+ */
+static void receiveTcpAnswers(modbusHandler_t *modH)
+{
+	struct pbuf *p;
+	err_t xErr;
+	int8_t i8result;
+
+	while ((xErr = recvTcp(modH, modH->xTcpClient, MB_CLIENT_TLS(modH), &p)) == ERR_OK)
+	{
+		if (p == NULL) continue; // TLS handshake or part of a record
+		if (modH->xTcpRx == NULL) modH->xTcpRx = p;
+		else pbuf_cat(modH->xTcpRx, p);
+	}
+
+	// an exception answer is the unit ID, the function code and the exception code
+	while (modH->xTcpClient != NULL && (i8result = getTcpAdu(modH, &modH->xTcpRx, 5)) != 0)
+	{
+		if (i8result != 1 && i8result != ERR_BAD_SIZE)
+		{
+			modH->u16errCnt++;
+			MB_COUNT_ERR(modH, i8result);
+			closeTcpClient(modH, i8result); // the next ADU cannot be found
+			break;
+		}
+		matchTcpAnswer(modH, i8result);
+	}
+
+	if (xErr != ERR_WOULDBLOCK && modH->xTcpClient != NULL)
+	{
+		closeTcpClient(modH, ERR_SLAVE_OFFLINE); // closed by the slave or reset
+	}
+}
+#endif
+
+#if ENABLE_UDP == 1
+/**
+ * @brief
+ * Hands the answers received in datagrams to their queries. A datagram that is not
+ * an ADU is dropped, the queries keep waiting for their answer
+ *
+ * @ingroup tcp
+ */
+static void receiveUdpAnswers(modbusHandler_t *modH)
+{
+	struct netbuf *xRx;
+	int8_t i8result;
+
+	while (netconn_recv_udp_raw_netbuf_flags(modH->xTcpClient, &xRx, NETCONN_DONTBLOCK) == ERR_OK)
+	{
+		i8result = getUdpAdu(modH, xRx, 5);
+		netbuf_delete(xRx);
+
+		if (i8result != 1 && i8result != ERR_BAD_SIZE)
+		{
+			modH->u16errCnt++;
+			MB_COUNT_ERR(modH, i8result);
+			continue;
+		}
+		matchTcpAnswer(modH, i8result);
+	}
+}
+#endif
+
+/**
+ * @brief
+ * Completes the query with the transaction ID of the answer in u8Buffer, i8result
+ * is ERR_BAD_SIZE for an answer too short to be processed
+ *
+ * @ingroup tcp
+ */
+static void matchTcpAnswer(modbusHandler_t *modH, int8_t i8result)
+{
+	modbusTcpQuery_t *xQuery = findTcpQuery(modH, true, modH->u16TransactionID);
+
+	if (xQuery == NULL)
+	{
+		modH->u16errCnt++;
+		MB_COUNT_ERR(modH, ERR_BAD_TCP_ID);
+		return;
+	}
+	xQuery->xUsed = false; // the telegram stays valid until the next pass
+
+	if (i8result == ERR_BAD_SIZE)
+	{
+		modH->i8lastError = ERR_BAD_SIZE;
+		modH->u16errCnt++;
+		MB_COUNT_ERR(modH, ERR_BAD_SIZE);
+		notifyQueryResult(modH, &xQuery->telegram, ERR_BAD_SIZE);
+		return;
+	}
+
+	MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, 0, 0);
+	processAnswer(modH, &xQuery->telegram, &xQuery->xTransaction);
+}
+
+/**
+ * @brief
+ * Looks up xTcpQueries, a free entry with xUsed false or the query in flight with
+ * transaction ID u16TransactionID
+ *
+ * @return the entry, NULL if there is none
+ * @ingroup tcp
+ */
+static modbusTcpQuery_t *findTcpQuery(modbusHandler_t *modH, bool xUsed, uint16_t u16TransactionID)
+{
+	for (uint8_t i = 0; i < TCPINFLIGHT; i++)
+	{
+		modbusTcpQuery_t *xQuery = &modH->xTcpQueries[i];
+		if (xQuery->xUsed == xUsed && (!xUsed || xQuery->u16TransactionID == u16TransactionID)) return xQuery;
+	}
+	return NULL;
+}
+
+/**
+ * @brief
+ * Ticks the master task may sleep: until the first deadline of the queries in
+ * flight, forever without any
+ *
+ * @ingroup tcp
+ */
+static TickType_t getTcpQueryWait(modbusHandler_t *modH)
+{
+	TickType_t xNow = xTaskGetTickCount();
+	TickType_t xWait = portMAX_DELAY;
+	int32_t i32Left;
+
+	for (uint8_t i = 0; i < TCPINFLIGHT; i++)
+	{
+		if (!modH->xTcpQueries[i].xUsed) continue;
+		i32Left = (int32_t)(modH->xTcpQueries[i].xDeadline - xNow);
+		if (i32Left <= 0) return 0;
+		if ((TickType_t)i32Left < xWait) xWait = (TickType_t)i32Left;
+	}
+	return xWait;
+}
+
+/**
+ * @brief
+ * Reports ERR_TIME_OUT for the queries past their deadline, the connection stays
+ * open and a late answer is dropped by its transaction ID. Over UDP the datagram
+ * may be lost, the query is sent again with the same transaction ID u8retries
+ * times before, an answer to any of the copies completes it
+ *
+ * @ingroup tcp
+ */
+static void expireTcpQueries(modbusHandler_t *modH)
+{
+	TickType_t xNow = xTaskGetTickCount();
+
+	for (uint8_t i = 0; i < TCPINFLIGHT; i++)
+	{
+		modbusTcpQuery_t *xQuery = &modH->xTcpQueries[i];
+		if (!xQuery->xUsed || (int32_t)(xQuery->xDeadline - xNow) > 0) continue;
+
+#if ENABLE_UDP == 1
+		if (modH->xTypeHW == UDP_HW && xQuery->u8Retries < xQuery->telegram.u8retries)
+		{
+			xQuery->u8Retries++;
+			writeTcpQuery(modH, xQuery);
+			if (modH->xTcpClient == NULL) return; // the write failed all the queries
+			continue;
+		}
+#endif
+
+		xQuery->xUsed = false;
+		modH->i8lastError = ERR_TIME_OUT;
+		modH->u16errCnt++;
+		MB_COUNT_ERR(modH, ERR_TIME_OUT);
+		notifyQueryResult(modH, &xQuery->telegram, ERR_TIME_OUT);
+	}
+}
+
+/**
+ * @brief
+ * Closes the netconn of a TCP or UDP master and reports i8result for the queries in
+ * flight, the next query opens a new connection
+ *
+ * @ingroup tcp
+ */
+static void closeTcpClient(modbusHandler_t *modH, int8_t i8result)
+{
+#if ENABLE_MB_TLS == 1
+	if (modH->pvTlsClient != NULL) modH->xTls->close(modH->pvTlsClient);
+	modH->pvTlsClient = NULL;
+#endif
+#if ENABLE_TCP == 1
+	if (modH->xTypeHW == TCP_HW) netconn_close(modH->xTcpClient); // a UDP netconn has no connection
+#endif
+	netconn_delete(modH->xTcpClient);
+	if (modH->xTcpRx != NULL) pbuf_free(modH->xTcpRx);
+	modH->xTcpClient = NULL;
+	modH->xTcpRx = NULL;
+
+	for (uint8_t i = 0; i < TCPINFLIGHT; i++)
+	{
+		if (!modH->xTcpQueries[i].xUsed) continue;
+		modH->xTcpQueries[i].xUsed = false;
+		modH->i8lastError = i8result;
+		notifyQueryResult(modH, &modH->xTcpQueries[i].telegram, i8result);
+	}
+}
+#endif
+
+#if ENABLE_UDP == 1 && MB_ENABLE_SLAVE == 1
+/**
+ * @brief
+ * Binds the netconn of a UDP slave to u16TcpPort. There is no connection state, every
+ * datagram is a request answered to its source
+ *
+ * @ingroup tcp
+ */
+static void startUdpServer(modbusHandler_t *modH)
+{
+	modH->xUdpRx = NULL;
+
+	if (modH->xUdpConn != NULL) return; // already bound, ModbusStart() called again
+
+	modH->xUdpConn = netconn_new_with_callback(NETCONN_UDP, tcpEventCallback);
+	if (modH->xUdpConn == NULL)
+	{
+		while(1); //ERROR creating the netconn, start lwIP before ModbusStart() and check its memory pools
+	}
+
+	if (netconn_bind(modH->xUdpConn, IP_ADDR_ANY, getIpPort(modH)) != ERR_OK)
+	{
+		while(1); //ERROR the port is in use or lwIP is out of UDP PCBs
+	}
+}
+
+/**
+ * @brief
+ * Answers the datagrams received since the last pass, each one carries one request.
+ * A datagram that is not an ADU is counted and dropped without answer
+ *
+ * @ingroup tcp
+ */
+static void serveUdp(modbusHandler_t *modH)
+{
+	struct netbuf *xRx;
+	int8_t i8result;
+	uint8_t u8id;
+
+	while (netconn_recv_udp_raw_netbuf_flags(modH->xUdpConn, &xRx, NETCONN_DONTBLOCK) == ERR_OK)
+	{
+		i8result = getUdpAdu(modH, xRx, MB_MIN_REQUEST);
+		if (i8result < 0)
+		{
+			modH->i8lastError = i8result;
+			modH->u16errCnt++;
+			MB_COUNT_ERR(modH, i8result);
+			netbuf_delete(xRx);
+			continue;
+		}
+
+		modH->i8lastError = 0;
+		MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, 0, 0);
+		// unit ID 0 and 0xFF address the server itself, as over TCP
+		u8id = modH->u8Buffer[ ID ];
+		if (u8id == 0 || u8id == 0xFF) u8id = modH->u8id;
+		modH->xUdpRx = xRx;
+		answerRequest(modH, u8id, false);
+		modH->xUdpRx = NULL;
+		netbuf_delete(xRx);
+	}
+}
+
+/**
+ * @brief
+ * Sends the answer in u8Buffer to the source of the request with netconn_sendto(),
+ * one datagram per answer. An answer lwIP cannot send is lost like a datagram on
+ * the network, the client repeats its request
+ *
+ * @ingroup tcp
+ */
+static void sendUdpAnswer(modbusHandler_t *modH)
+{
+	MB_LOG_EVENT(modH, MB_EVT_TX, modH->u8Buffer, modH->u16BufferSize,
+			(modH->u8Buffer[ FUNC ] & 0x80) ? (int8_t)modH->u8Buffer[ 2 ] : 0, 0);
+
+	sendUdpAdu(modH, modH->xUdpConn, netbuf_fromaddr(modH->xUdpRx), netbuf_fromport(modH->xUdpRx),
+			modH->u16TransactionID);
+
+	modH->u16BufferSize = 0;
+	modH->u16OutCnt++;
+}
+#endif
+
+
+
+/**
+ * @brief
+ * Stack high-water mark of the Modbus task of the handler, to size u32TaskStack
+ * or MB_TASK_STACK once the application ran through its worst case
+ *
+ * @return bytes of the stack never used so far
+ * @ingroup setup
+ */
+uint32_t ModbusGetStackSpace(modbusHandler_t * modH)
+{
+	return osThreadGetStackSpace(modH->myTaskModbusAHandle);
+}
+
+#if ENABLE_MB_RUNTIME == 1
+/**
+ * @brief
+ * Loads of the task and of the UART callbacks of the handler since xMark, in 0.01 %,
+ * then moves xMark to now. The task share is taken from the run-time stats of FreeRTOS,
+ * the callbacks from their DWT cycles over the ticks elapsed
+ *
+ * @ingroup setup
+ */
+static void sampleRuntime(modbusHandler_t *modH, modbusRuntimeMark_t *xMark, uint16_t *u16Task, uint16_t *u16Isr)
+{
+	TaskStatus_t xStatus;
+	uint32_t u32Total, u32Cycles;
+	uint64_t u64Isr;
+	TickType_t xTick;
+
+	vTaskGetInfo((TaskHandle_t)modH->myTaskModbusAHandle, &xStatus, pdFALSE, eRunning);
+	taskENTER_CRITICAL();
+	u32Total = portGET_RUN_TIME_COUNTER_VALUE();
+	u64Isr = modH->u64IsrCycles;
+	xTick = xTaskGetTickCount();
+	taskEXIT_CRITICAL();
+
+	u32Total -= xMark->u32Total;
+	*u16Task = (u32Total == 0) ? 0 : (uint16_t)((uint64_t)(xStatus.ulRunTimeCounter - xMark->u32Task) * 10000U / u32Total);
+	u32Cycles = (SystemCoreClock / configTICK_RATE_HZ) * (uint32_t)(xTick - xMark->xTick);
+	*u16Isr = (u32Cycles == 0) ? 0 : (uint16_t)((u64Isr - xMark->u64Isr) * 10000U / u32Cycles);
+
+	xMark->u32Task = xStatus.ulRunTimeCounter;
+	xMark->u32Total += u32Total;
+	xMark->u64Isr = u64Isr;
+	xMark->xTick = xTick;
+}
+
+/**
+ * @brief
+ * CPU use of the handler: the loads of its Modbus task and of its UART callbacks
+ * since the previous call, their totals and the stack watermark of the task. The
+ * first call gives the loads since the start of FreeRTOS. With ENABLE_MB_SHARED_TASK
+ * the task load is the one of the task shared by the handlers
+ *
+ * @ingroup setup
+ */
+void ModbusGetRuntime(modbusHandler_t * modH, modbusRuntime_t *xRt)
+{
+	TaskStatus_t xStatus;
+
+	sampleRuntime(modH, &modH->xRtApp, &xRt->u16TaskLoad, &xRt->u16IsrLoad);
+	vTaskGetInfo((TaskHandle_t)modH->myTaskModbusAHandle, &xStatus, pdFALSE, eRunning);
+	xRt->u32TaskTime = xStatus.ulRunTimeCounter;
+	taskENTER_CRITICAL();
+	xRt->u64IsrCycles = modH->u64IsrCycles;
+	xRt->u32IsrCalls = modH->u32IsrCalls;
+	xRt->u32IsrMax = modH->u32IsrMax;
+	taskEXIT_CRITICAL();
+	xRt->u32StackFree = ModbusGetStackSpace(modH);
+}
+#endif
+
+/**
+ * @brief
+ * Name of a section reported to MB_HOOK_ENTER() or MB_HOOK_ISR_ENTER(), to
+ * register the user events of a tracer
+ *
+ * @return name, "FC" for the function codes
+ * @ingroup setup
+ */
+const char *ModbusHookName(uint32_t u32Id)
+{
+	switch (u32Id)
+	{
+	case MB_HOOK_TX_CPLT:  return "MB TX cplt";
+	case MB_HOOK_RX_CPLT:  return "MB RX cplt";
+	case MB_HOOK_RX_EVENT: return "MB RX event";
+	case MB_HOOK_T35:      return "MB T35";
+	case MB_HOOK_TIMEOUT:  return "MB timeout";
+	default:               return "MB FC";
+	}
+}
+
+#if ENABLE_MB_TRACE == 1
+/**
+ * @brief
+ * Copies the trace records of the last MB_TRACE_DEPTH - 1 transactions, oldest
+ * first, the record of the transaction in progress is left out.
+ * Divide the cycle differences by SystemCoreClock for seconds
+ *
+ * @return number of records copied to xTraces, at most u8max
+ * @ingroup setup
+ */
+uint8_t ModbusGetTrace(modbusHandler_t * modH, modbusTrace_t *xTraces, uint8_t u8max)
+{
+	uint8_t u8count = 0;
+	uint8_t u8First = (u8max < MB_TRACE_DEPTH - 1) ? MB_TRACE_DEPTH - u8max : 1;
+
+	taskENTER_CRITICAL();
+	for (uint8_t i = u8First; i < MB_TRACE_DEPTH; i++)
+	{
+		const modbusTrace_t *xTrace = &modH->xTrace[ (modH->u8TraceHead + i) % MB_TRACE_DEPTH ];
+
+		if (xTrace->u32Cyc[MB_TS_RX_END] == 0) continue; // not used yet
+		xTraces[u8count++] = *xTrace;
+	}
+	taskEXIT_CRITICAL();
+
+	return u8count;
+}
+#endif
+
+#if ENABLE_MB_STATS == 1 || ENABLE_MB_ERR_STATS == 1
+/**
+ * @brief
+ * Clears the histograms and the error counters of the handler.
+ * The Modbus task updates them without lock, a copy taken meanwhile may mix two samples
+ *
+ * @ingroup setup
+ */
+void ModbusResetStats(modbusHandler_t * modH)
+{
+	taskENTER_CRITICAL();
+#if ENABLE_MB_ERR_STATS == 1
+	memset(&modH->xErrStats, 0, sizeof(modbusErrStats_t));
+#endif
+#if ENABLE_MB_STATS == 1
+	memset(&modH->xStatFrame, 0, sizeof(modbusHist_t));
+#if MB_ENABLE_SLAVE == 1
+	if (modH->uModbusType == MB_SLAVE)
+	{
+		memset(&modH->xStatLatency, 0, sizeof(modbusHist_t));
+	}
+#endif
+#if MB_ENABLE_MASTER == 1
+	if (modH->uModbusType == MB_MASTER)
+	{
+		for (uint8_t i = 0; i < MAX_SLAVES; i++)
+		{
+			memset(&modH->xSlaves[i].xRoundTrip, 0, sizeof(modbusHist_t));
+		}
+	}
+#endif
+#endif
+	taskEXIT_CRITICAL();
+}
+#endif
+
+#if ENABLE_MB_WIRE_STATS == 1
+/**
+ * @brief
+ * Accounts a frame of u16Bytes sent by the handler, from the task or an interrupt.
+ * The answer of a slave adds its turnaround, from the end of the request, which
+ * was detected T3.5 after its last byte. The start of a query is kept for the
+ * turnaround of its answer
+ *
+ * @ingroup huart UART HAL handler
+ */
+static void countWireTx(modbusHandler_t *modH, uint16_t u16Bytes)
+{
+	uint32_t u32Now = DWT->CYCCNT;
+	uint32_t u32Chars, u32Us, u32Gap = 0;
+	UBaseType_t uxMask;
+
+	if ((modH->xTransport->u8Flags & MB_TP_UART) == 0 || u16Bytes == 0) return;
+#if MB_TX_PARTS
+	if (modH->uModbusType == MB_SLAVE) u16Bytes += modH->u16TxGather; // the payload sent from the table
+#endif
+	u32Chars = getWireChars(modH, u16Bytes);
+	u32Us = getWireUs(modH, u32Chars);
+	if (modH->uModbusType == MB_SLAVE) u32Gap = (u32Now - modH->u32RxEnd) / (SystemCoreClock / 1000000) + modH->u32T35us;
+
+	uxMask = taskENTER_CRITICAL_FROM_ISR();
+	modH->xWire.u32TxFrames++;
+	modH->xWire.u32WireBytes += u32Chars;
+	modH->xWire.u32Payload += (u16Bytes > 3) ? u16Bytes - 3 : 0; // address and CRC, or LRC and its end
+	modH->xWire.u64WireUs += u32Us;
+	modH->xWire.u64GapUs += u32Gap;
+	modH->u32WireTxStart = u32Now;
+	modH->u32WireTxUs = u32Us;
+	taskEXIT_CRITICAL_FROM_ISR(uxMask);
+}
+
+/**
+ * @brief
+ * Accounts a frame of u16Bytes taken by the handler. xAnswer is set for the answer
+ * to the query of a master, which adds the turnaround of the slave: from the end
+ * of the query to the first byte of the answer, back from the detected end of it
+ *
+ * @ingroup huart UART HAL handler
+ */
+static void countWireRx(modbusHandler_t *modH, uint16_t u16Bytes, bool xAnswer)
+{
+	uint32_t u32Chars, u32Us, u32Gap = 0;
+	UBaseType_t uxMask;
+
+	if ((modH->xTransport->u8Flags & MB_TP_UART) == 0 || u16Bytes == 0) return;
+	u32Chars = getWireChars(modH, u16Bytes);
+	u32Us = getWireUs(modH, u32Chars);
+	if (xAnswer)
+	{
+		int32_t i32Gap = (int32_t)((modH->u32RxEnd - modH->u32WireTxStart) / (SystemCoreClock / 1000000));
+
+		i32Gap -= (int32_t)(modH->u32WireTxUs + u32Us + modH->u32T35us);
+		if (i32Gap > 0) u32Gap = (uint32_t)i32Gap;
+	}
+
+	uxMask = taskENTER_CRITICAL_FROM_ISR();
+	modH->xWire.u32RxFrames++;
+	modH->xWire.u32WireBytes += u32Chars;
+	modH->xWire.u32Payload += (u16Bytes > 3) ? u16Bytes - 3 : 0;
+	modH->xWire.u64WireUs += u32Us;
+	modH->xWire.u64GapUs += u32Gap;
+	taskEXIT_CRITICAL_FROM_ISR(uxMask);
+}
+
+/**
+ * @brief
+ * Copies the line time of a serial handler with its utilisation, idle time and
+ * efficiency over the time elapsed since ModbusInit() or ModbusResetWireStats()
+ *
+ * @ingroup setup
+ */
+void ModbusGetWireStats(modbusHandler_t * modH, modbusWireStats_t *xWire)
+{
+	uint64_t u64Busy, u64Payload;
+
+	taskENTER_CRITICAL();
+	*xWire = modH->xWire;
+	xWire->u64ElapsedUs = ((uint64_t)(xTaskGetTickCount() - modH->xWireSince) * 1000000UL) / configTICK_RATE_HZ;
+	taskEXIT_CRITICAL();
+
+	u64Busy = xWire->u64WireUs + xWire->u64GapUs;
+	xWire->u64IdleUs = (xWire->u64ElapsedUs > u64Busy) ? xWire->u64ElapsedUs - u64Busy : 0;
+	xWire->u16Utilisation = (xWire->u64ElapsedUs == 0) ? 0 :
+			(uint16_t)(((u64Busy < xWire->u64ElapsedUs ? u64Busy : xWire->u64ElapsedUs) * 1000) / xWire->u64ElapsedUs);
+	xWire->u16Efficiency = 0;
+	if (xWire->u32WireBytes != 0 && u64Busy != 0)
+	{
+		u64Payload = ((uint64_t)xWire->u32Payload * 1000) / xWire->u32WireBytes; // share of the PDU in the frames
+		xWire->u16Efficiency = (uint16_t)((u64Payload * xWire->u64WireUs) / u64Busy);
+	}
+}
+
+/**
+ * @brief
+ * Clears the line time of the handler, the accounting starts again now
+ *
+ * @ingroup setup
+ */
+void ModbusResetWireStats(modbusHandler_t * modH)
+{
+	taskENTER_CRITICAL();
+	memset(&modH->xWire, 0, sizeof(modbusWireStats_t));
+	modH->xWireSince = xTaskGetTickCount();
+	taskEXIT_CRITICAL();
+}
+#endif
+
+#if ENABLE_MB_ERR_STATS == 1
+/**
+ * @brief
+ * Copies the error counters of the handler, the UART ones are updated by interrupts
+ *
+ * @ingroup setup
+ */
+void ModbusGetErrStats(modbusHandler_t * modH, modbusErrStats_t *xStats)
+{
+	taskENTER_CRITICAL();
+	memcpy(xStats, &modH->xErrStats, sizeof(modbusErrStats_t));
+	taskEXIT_CRITICAL();
+}
+#endif
+
+#if ENABLE_MB_EVENT_LOG == 1
+/**
+ * @brief
+ * Records a bus event in the ring shared by the handlers. Lock free: the slot is
+ * reserved with LDREX/STREX, tasks, timers and interrupts may log at the same time
+ *
+ * @param u8Frame frame for the slave ID and function code, NULL if there is none
+ * @ingroup setup
+ */
+static void logEvent(modbusHandler_t *modH, uint8_t u8Type, const uint8_t *u8Frame, uint16_t u16Length, int8_t i8Error, uint8_t u8Flags)
+{
+	uint32_t u32Slot;
+
+	do
+	{
+		u32Slot = __LDREXW((volatile uint32_t *)&u32EventHead);
+	} while (__STREXW(u32Slot + 1, (volatile uint32_t *)&u32EventHead) != 0);
+
+	modbusEvent_t *xEvent = &xEventLog[ u32Slot & (MB_EVENT_DEPTH - 1) ];
+	xEvent->u32Time = DWT->CYCCNT;
+	xEvent->u8Handler = modH->u8Handler;
+	xEvent->u8Type = u8Type;
+	xEvent->u8id = (u8Frame != NULL) ? u8Frame[ ID ] : 0;
+	xEvent->u8fct = (u8Frame != NULL) ? u8Frame[ FUNC ] : 0;
+	xEvent->u16Length = u16Length;
+	xEvent->i8Error = i8Error;
+	xEvent->u8Flags = u8Flags;
+}
+
+/**
+ * @brief
+ * Copies the last bus events of all the handlers, oldest first
+ *
+ * @return number of events copied to xEvents, at most u16max and MB_EVENT_DEPTH
+ * @ingroup setup
+ */
+uint16_t ModbusGetEvents(modbusEvent_t *xEvents, uint16_t u16max)
+{
+	uint32_t u32Head;
+	uint32_t u32Count;
+
+	taskENTER_CRITICAL();
+	u32Head = u32EventHead;
+	u32Count = (u32Head < MB_EVENT_DEPTH) ? u32Head : MB_EVENT_DEPTH;
+	if (u32Count > u16max) u32Count = u16max;
+	for (uint32_t i = 0; i < u32Count; i++)
+	{
+		xEvents[ i ] = xEventLog[ (u32Head - u32Count + i) & (MB_EVENT_DEPTH - 1) ];
+	}
+	taskEXIT_CRITICAL();
+
+	return (uint16_t)u32Count;
+}
+#endif
+
+#if ENABLE_MB_BENCH == 1
+/**
+ * @brief
+ * Builds a read request from address 0 with its CRC
+ *
+ * @return size of the request
+ * @ingroup setup
+ */
+static uint16_t setBenchRequest(uint8_t *u8req, uint8_t u8id, uint8_t u8fct, uint16_t u16Count)
+{
+	uint16_t u16crc;
+
+	u8req[ ID ] = u8id;
+	u8req[ FUNC ] = u8fct;
+	u8req[ ADD_HI ] = 0;
+	u8req[ ADD_LO ] = 0;
+	u8req[ NB_HI ] = highByte(u16Count);
+	u8req[ NB_LO ] = lowByte(u16Count);
+	u16crc = calcCRC(u8req, 6);
+	u8req[ 6 ] = u16crc >> 8;
+	u8req[ 7 ] = u16crc & 0x00ff;
+
+	return 8;
+}
+
+/**
+ * @brief
+ * Fastest of MB_BENCH_RUNS runs of validateRequest() or of the process function
+ * of a request, copied to u8Buffer before each run
+ *
+ * @return cycles, 0 if validateRequest() rejects the request
+ * @ingroup setup
+ */
+static uint32_t benchRequest(modbusHandler_t *modH, const uint8_t *u8req, uint16_t u16size, bool xProcess)
+{
+	const modbusFunction_t *xFunction = getFunction(u8req[ FUNC ]);
+	uint32_t u32Best = UINT32_MAX;
+
+	for (uint8_t i = 0; i < MB_BENCH_RUNS; i++)
+	{
+		memcpy(modH->u8Buffer, u8req, u16size);
+		modH->u16BufferSize = u16size;
+		if (xProcess && validateRequest(modH) != 0) return 0;
+
+		uint32_t u32Start = DWT->CYCCNT;
+		if (xProcess)
+		{
+			xFunction->process(modH);
+		}
+		else if (validateRequest(modH) != 0)
+		{
+			return 0;
+		}
+		uint32_t u32Cycles = DWT->CYCCNT - u32Start;
+
+		if (u32Cycles < u32Best) u32Best = u32Cycles;
+	}
+	return u32Best;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Measures the CPU cycles of the protocol kernels with the DWT counter: CRC of the
+ * compiled backend, FC3 and FC1 answers from the tables of the handler and the
+ * validation of a request. Rebuild with another CRC_MODE to compare the backends.
+ * It uses u8Buffer, call it before ModbusStart() or on an idle handler
+ *
+ * @ingroup setup
+ */
+void ModbusBenchmark(modbusHandler_t * modH, modbusBench_t *xBench)
+{
+	static const uint16_t u16CrcBytes[MB_BENCH_SIZES] = { 8, 64, 128, 256 };
+	static const uint16_t u16Regs[MB_BENCH_SIZES] = { 1, 16, 64, 125 };
+	static const uint16_t u16Coils[MB_BENCH_SIZES] = { 1, 16, 256, 2000 };
+	uint8_t u8req[ 8 ];
+	uint16_t u16size;
+
+	memset(xBench, 0, sizeof(modbusBench_t));
+	memcpy(xBench->u16CrcBytes, u16CrcBytes, sizeof(u16CrcBytes));
+	memcpy(xBench->u16Regs, u16Regs, sizeof(u16Regs));
+	memcpy(xBench->u16Coils, u16Coils, sizeof(u16Coils));
+
+	for (uint8_t s = 0; s < MB_BENCH_SIZES; s++)
+	{
+		if (u16CrcBytes[ s ] > MAX_BUFFER) continue;
+
+		xBench->u32Crc[ s ] = UINT32_MAX;
+		xBench->u32CrcByte[ s ] = UINT32_MAX;
+		for (uint8_t i = 0; i < MB_BENCH_RUNS; i++)
+		{
+			volatile uint16_t u16crc = 0xFFFF; // keeps the loops from being optimized out
+			uint32_t u32Start = DWT->CYCCNT;
+			u16crc = calcCRC(modH->u8Buffer, u16CrcBytes[ s ]);
+			uint32_t u32Cycles = DWT->CYCCNT - u32Start;
+			if (u32Cycles < xBench->u32Crc[ s ]) xBench->u32Crc[ s ] = u32Cycles;
+
+			u32Start = DWT->CYCCNT;
+			for (uint16_t j = 0; j < u16CrcBytes[ s ]; j++)
+			{
+				u16crc = calcCRCByte(u16crc, modH->u8Buffer[ j ]);
+			}
+			u32Cycles = DWT->CYCCNT - u32Start;
+			if (u32Cycles < xBench->u32CrcByte[ s ]) xBench->u32CrcByte[ s ] = u32Cycles;
+		}
+	}
+
+	for (uint8_t s = 0; s < MB_BENCH_SIZES; s++)
+	{
+#if MB_SLAVE_FC(MB_ENABLE_FC3)
+		u16size = setBenchRequest(u8req, modH->u8id, MB_FC_READ_REGISTERS, u16Regs[ s ]);
+		xBench->u32FC3[ s ] = benchRequest(modH, u8req, u16size, true);
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC1)
+		u16size = setBenchRequest(u8req, modH->u8id, MB_FC_READ_COILS, u16Coils[ s ]);
+		xBench->u32FC1[ s ] = benchRequest(modH, u8req, u16size, true);
+#endif
+	}
+
+	u16size = setBenchRequest(u8req, modH->u8id, MB_FC_READ_REGISTERS, 16);
+	xBench->u32Validate = benchRequest(modH, u8req, u16size, false);
+
+	modH->u16BufferSize = 0;
+}
+#endif
+
+#if ENABLE_MB_WCET == 1
+/**
+ * @brief
+ * Builds the request of a worst case run with its CRC. The writes carry the values
+ * the tables already hold, FC22 keeps every bit, so a run leaves the tables as they were
+ *
+ * @return size of the request, 0 if the range cannot be written back unchanged
+ * @ingroup setup
+ */
+static uint16_t setWcetRequest(modbusHandler_t *modH, uint8_t *u8req, uint8_t u8fct, uint16_t u16Add, uint16_t u16Count)
+{
+	const uint16_t *u16src = NULL;
+	uint16_t u16size = 6, u16Write = 0, u16crc;
+
+	u8req[ ID ] = modH->u8id;
+	u8req[ FUNC ] = u8fct;
+	u8req[ ADD_HI ] = highByte(u16Add);
+	u8req[ ADD_LO ] = lowByte(u16Add);
+	u8req[ NB_HI ] = highByte(u16Count);
+	u8req[ NB_LO ] = lowByte(u16Count);
+
+	switch (u8fct)
+	{
+	case MB_FC_WRITE_COIL:
+		u8req[ NB_HI ] = bitRead(modH->u16regsCoils[ u16Add / 16 ], u16Add % 16) ? 0xFF : 0;
+		u8req[ NB_LO ] = 0;
+		break;
+	case MB_FC_WRITE_MULTIPLE_COILS:
+		u8req[ BYTE_CNT ] = (uint8_t)((u16Count + 7) / 8);
+		memset(&u8req[ BYTE_CNT + 1 ], 0, u8req[ BYTE_CNT ]);
+		for (uint16_t i = 0; i < u16Count; i++)
+		{
+			if (bitRead(modH->u16regsCoils[ (u16Add + i) / 16 ], (u16Add + i) % 16)) bitSet(u8req[ BYTE_CNT + 1 + i / 8 ], i % 8);
+		}
+		u16size = BYTE_CNT + 1 + u8req[ BYTE_CNT ];
+		break;
+	case MB_FC_WRITE_REGISTER:
+		u16Write = 1;
+		u16size = NB_HI;
+		break;
+	case MB_FC_WRITE_MULTIPLE_REGISTERS:
+		u16Write = u16Count;
+		u8req[ BYTE_CNT ] = (uint8_t)(u16Count * 2);
+		u16size = BYTE_CNT + 1;
+		break;
+	case MB_FC_MASK_WRITE_REGISTER:
+		u8req[ 4 ] = 0xFF; // AND mask
+		u8req[ 5 ] = 0xFF;
+		u8req[ 6 ] = 0; // OR mask
+		u8req[ 7 ] = 0;
+		u16size = 8;
+		break;
+	case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+		// the read block, then a write of the longest block from the same address
+		u16Write = u16Count;
+		if (u16Write > 121) u16Write = 121;
+		if (u16Write > (MAX_BUFFER - 13) / 2) u16Write = (MAX_BUFFER - 13) / 2;
+		u8req[ WR_ADD_HI ] = highByte(u16Add);
+		u8req[ WR_ADD_LO ] = lowByte(u16Add);
+		u8req[ WR_NB_HI ] = highByte(u16Write);
+		u8req[ WR_NB_LO ] = lowByte(u16Write);
+		u8req[ WR_BYTE_CNT ] = (uint8_t)(u16Write * 2);
+		u16size = WR_BYTE_CNT + 1;
+		break;
+	default:
+		break;
+	}
+
+	if (u16Write != 0)
+	{
+		u16src = mapRegisters(modH, DB_HOLDING_REGISTER, u16Add, u16Write);
+		if (u16src == NULL) return 0;
+		for (uint16_t i = 0; i < u16Write; i++)
+		{
+			u8req[ u16size++ ] = highByte(u16src[ i ]);
+			u8req[ u16size++ ] = lowByte(u16src[ i ]);
+		}
+	}
+
+	u16crc = calcCRC(u8req, u16size);
+	u8req[ u16size++ ] = u16crc >> 8;
+	u8req[ u16size++ ] = u16crc & 0x00ff;
+	return u16size;
+}
+
+/**
+ * @brief
+ * Runs a request MB_WCET_RUNS times, validateRequest() then the process function,
+ * and keeps the slowest runs in xFc. A request refused by validateRequest() is
+ * not a case the slave answers with data and is not counted
+ *
+ * @ingroup setup
+ */
+static void wcetRequest(modbusHandler_t *modH, const uint8_t *u8req, uint16_t u16size, modbusWcetFc_t *xFc)
+{
+	const modbusFunction_t *xFunction = getFunction(u8req[ FUNC ]);
+	uint32_t u32Start, u32Validate, u32Process;
+
+	for (uint8_t i = 0; i < MB_WCET_RUNS; i++)
+	{
+		memcpy(modH->u8Buffer, u8req, u16size);
+		modH->u16BufferSize = u16size;
+
+		u32Start = DWT->CYCCNT;
+		if (validateRequest(modH) != 0) return;
+		u32Validate = DWT->CYCCNT - u32Start;
+
+		u32Start = DWT->CYCCNT;
+		xFunction->process(modH);
+		u32Process = DWT->CYCCNT - u32Start;
+
+		if (u32Validate > xFc->u32Validate) xFc->u32Validate = u32Validate;
+		if (u32Process > xFc->u32Process)
+		{
+			xFc->u32Process = u32Process;
+			xFc->u16Add = word( u8req[ ADD_HI ], u8req[ ADD_LO ] );
+			xFc->u16Count = word( u8req[ NB_HI ], u8req[ NB_LO ] );
+		}
+		if (u16size > xFc->u16Size) xFc->u16Size = u16size;
+	}
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Measures the worst case CPU cycles of the slave path with the DWT counter, for
+ * each enabled function code of FC1 to FC6, FC15, FC16, FC22 and FC23: the longest
+ * requests the tables and MAX_BUFFER allow at the first address, ending at the last
+ * one and at an unaligned address, validateRequest() and the process function each
+ * kept at their slowest run. The writes store the values the tables hold, the on-write
+ * callbacks of the application still run. Call it on an idle handler from a task that
+ * is not preempted, before ModbusStart() for instance, and compare the reports of each
+ * build to catch the regressions of a change
+ *
+ * @param u32Budget cycles of validateRequest() and a process function together, 0 for no bound
+ * @return false if a function code exceeds u32Budget
+ * @ingroup setup
+ */
+bool ModbusWcet(modbusHandler_t * modH, modbusWcet_t *xReport, uint32_t u32Budget)
+{
+	static const uint8_t u8Fcts[] = {
+#if MB_SLAVE_FC(MB_ENABLE_FC1)
+		MB_FC_READ_COILS,
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC2)
+		MB_FC_READ_DISCRETE_INPUT,
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC3)
+		MB_FC_READ_REGISTERS,
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC4)
+		MB_FC_READ_INPUT_REGISTER,
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC5)
+		MB_FC_WRITE_COIL,
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC6)
+		MB_FC_WRITE_REGISTER,
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC15)
+		MB_FC_WRITE_MULTIPLE_COILS,
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC16)
+		MB_FC_WRITE_MULTIPLE_REGISTERS,
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC22)
+		MB_FC_MASK_WRITE_REGISTER,
+#endif
+#if MB_SLAVE_FC(MB_ENABLE_FC23)
+		MB_FC_READ_WRITE_MULTIPLE_REGISTERS,
+#endif
+		0 };
+	uint8_t u8req[ MAX_BUFFER ];
+	uint16_t u16Items, u16Max, u16size;
+	uint16_t u16Add[ 3 ], u16Count[ 3 ];
+	bool xInBudget = true;
+
+	memset(xReport, 0, sizeof(modbusWcet_t));
+	xReport->u8CrcMode = CRC_MODE;
+	xReport->u16MaxBuffer = MAX_BUFFER;
+	xReport->u16Coils = modH->u16regCoils_size * 16;
+	xReport->u16Inputs = modH->u16regCoilsRO_size * 16;
+	xReport->u16Holding = modH->u16regHR_size;
+	xReport->u16Input = modH->u16regRO_size;
+
+	for (uint8_t f = 0; u8Fcts[ f ] != 0; f++)
+	{
+		modbusWcetFc_t *xFc = &xReport->xFc[ f ];
+
+		xFc->u8fct = u8Fcts[ f ];
+		switch (xFc->u8fct)
+		{
+		case MB_FC_READ_COILS:
+			u16Items = xReport->u16Coils;
+			u16Max = ((MAX_BUFFER - 5) * 8 < 2000) ? (MAX_BUFFER - 5) * 8 : 2000;
+			break;
+		case MB_FC_READ_DISCRETE_INPUT:
+			u16Items = xReport->u16Inputs;
+			u16Max = ((MAX_BUFFER - 5) * 8 < 2000) ? (MAX_BUFFER - 5) * 8 : 2000;
+			break;
+		case MB_FC_WRITE_MULTIPLE_COILS:
+			u16Items = xReport->u16Coils;
+			u16Max = ((MAX_BUFFER - 9) * 8 < 1968) ? (MAX_BUFFER - 9) * 8 : 1968;
+			break;
+		case MB_FC_WRITE_COIL:
+			u16Items = xReport->u16Coils;
+			u16Max = 1;
+			break;
+		case MB_FC_READ_INPUT_REGISTER:
+			u16Items = xReport->u16Input;
+			u16Max = ((MAX_BUFFER - 5) / 2 < 125) ? (MAX_BUFFER - 5) / 2 : 125;
+			break;
+		case MB_FC_WRITE_MULTIPLE_REGISTERS:
+			u16Items = xReport->u16Holding;
+			u16Max = ((MAX_BUFFER - 9) / 2 < 123) ? (MAX_BUFFER - 9) / 2 : 123;
+			break;
+		case MB_FC_WRITE_REGISTER:
+		case MB_FC_MASK_WRITE_REGISTER:
+			u16Items = xReport->u16Holding;
+			u16Max = 1;
+			break;
+		default: // FC3 and the read block of FC23
+			u16Items = xReport->u16Holding;
+			u16Max = ((MAX_BUFFER - 5) / 2 < 125) ? (MAX_BUFFER - 5) / 2 : 125;
+			break;
+		}
+		if (u16Items == 0) continue;
+		if (u16Max > u16Items) u16Max = u16Items;
+
+		// the first address, the range ending at the last one, an unaligned address
+		u16Add[ 0 ] = 0;
+		u16Count[ 0 ] = u16Max;
+		u16Add[ 1 ] = u16Items - u16Max;
+		u16Count[ 1 ] = u16Max;
+		u16Add[ 2 ] = (u16Items > 1) ? 1 : 0;
+		u16Count[ 2 ] = (u16Max < u16Items - u16Add[ 2 ]) ? u16Max : u16Items - u16Add[ 2 ];
+
+		for (uint8_t v = 0; v < 3; v++)
+		{
+			u16size = setWcetRequest(modH, u8req, xFc->u8fct, u16Add[ v ], u16Count[ v ]);
+			if (u16size != 0) wcetRequest(modH, u8req, u16size, xFc);
+		}
+
+		if (xFc->u32Validate + xFc->u32Process > xReport->u32Worst) xReport->u32Worst = xFc->u32Validate + xFc->u32Process;
+		if (u32Budget != 0 && xFc->u32Validate + xFc->u32Process > u32Budget) xInBudget = false;
+	}
+
+	modH->u16BufferSize = 0;
+	return xInBudget;
+}
+#endif
+
+#if ENABLE_MB_FUZZ == 1 || ENABLE_MB_REPLAY == 1
+/**
+ * @brief
+ * Serves one frame as the slave loop does once recvFrame() returned it, with the CRC
+ * or the unit ID of its transport: the size checks of serveRequest(), the unit of the
+ * ID, validateRequest() and the process function, under the data semaphore. The answer
+ * or the exception is left in u8Buffer and u16BufferSize and is not sent, a broadcast
+ * or a refused frame leaves u16BufferSize at 0
+ *
+ * @return 0 for an answer, the exception sent back, or the mb_errot_t of a frame the slave drops
+ * @ingroup setup
+ */
+static int16_t serveFrame(modbusHandler_t *modH, const uint8_t *u8Frame, uint16_t u16Size)
+{
+	int16_t i16result;
+	uint8_t u8id, u8exception;
+	bool xBroadcast = false;
+	osSemaphoreId_t xLock;
+
+	modH->u16BufferSize = 0;
+	if (u16Size > MAX_BUFFER) return ERR_BUFF_OVERFLOW;
+	if (u16Size < MB_MIN_REQUEST) return ERR_BAD_SIZE;
+
+	memcpy(modH->u8Buffer, u8Frame, u16Size);
+	modH->u16BufferSize = u16Size;
+	u8id = modH->u8Buffer[ ID ];
+#if ENABLE_MB_BROADCAST == 1
+	xBroadcast = (u8id == 0) && isBroadcastFunction(modH->u8Buffer[ FUNC ]);
+	if (xBroadcast) u8id = modH->u8id;
+#endif
+	if (!selectUnit(modH, u8id))
+	{
+		i16result = ERR_BAD_SLAVE_ID;
+	}
+	else if ((u8exception = validateRequest(modH)) != 0)
+	{
+		i16result = (int8_t)u8exception;
+		if (i16result > 0 && !xBroadcast) buildException(u8exception, modH);
+	}
+	else
+	{
+		xLock = getDataLock(modH);
+		if (xLock != NULL) xSemaphoreTake(xLock, portMAX_DELAY);
+		i16result = getFunction(modH->u8Buffer[ FUNC ])->process(modH);
+		if (xLock != NULL) xSemaphoreGive(xLock);
+		if (i16result > 0 && !xBroadcast) buildException((uint8_t)i16result, modH);
+	}
+	if (xBroadcast || i16result < 0) modH->u16BufferSize = 0;
+
+	return i16result;
+}
+#endif
+
+#if ENABLE_MB_FUZZ == 1
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Serves one frame like the slave loop without sending the answer, see serveFrame().
+ * This is the entry point of a fuzzing harness of the host build: call it on an idle
+ * handler, from the task of the harness and not beside ModbusStart(), with the tables
+ * of the application
+ *
+ * @param u32Cost MB_COST_CLOCK() ticks from the size checks to the end of the answer, NULL if not needed
+ * @return 0 for an answer, the exception sent back, or the mb_errot_t of a frame the slave drops
+ * @ingroup setup
+ */
+int16_t ModbusFuzzFrame(modbusHandler_t * modH, const uint8_t *u8Frame, uint16_t u16Size, uint32_t *u32Cost)
+{
+	uint32_t u32Start = MB_COST_CLOCK();
+	int16_t i16result = serveFrame(modH, u8Frame, u16Size);
+
+	if (u32Cost != NULL) *u32Cost = MB_COST_CLOCK() - u32Start;
+	return i16result;
+}
+#endif
+
+#if ENABLE_MB_REPLAY == 1
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Replays a capture of requests through the slave path, see serveFrame(): each record
+ * is MB_REPLAY_HEADER bytes, the microseconds since the previous frame then the length
+ * of the frame, both little endian, followed by the frame as it was on the line, CRC
+ * included on RTU. With xTimed the frames keep the gaps of the capture to the tick,
+ * otherwise they follow each other at the rate of the CPU. The answers are not sent,
+ * xReport counts the results and the cost of each frame in MB_COST_CLOCK() ticks.
+ * Call it on an idle handler, from a task and not beside ModbusStart()
+ *
+ * @param u8Capture records of the capture, a file read by the host build or a table in flash
+ * @param u32Size bytes of the capture
+ * @return false if the capture ends in the middle of a record, the records before it are replayed
+ * @ingroup setup
+ */
+bool ModbusReplay(modbusHandler_t * modH, const uint8_t *u8Capture, uint32_t u32Size, bool xTimed, modbusReplay_t *xReport)
+{
+	uint32_t u32Pos = 0, u32Start, u32Cost;
+	uint64_t u64Us = 0;
+	uint16_t u16Length;
+	int16_t i16result;
+	TickType_t xFirst = xTaskGetTickCount(), xDue, xNow;
+
+	memset(xReport, 0, sizeof(modbusReplay_t));
+	while (u32Size - u32Pos >= MB_REPLAY_HEADER)
+	{
+		u16Length = (uint16_t)(u8Capture[ u32Pos + 4 ] | (u8Capture[ u32Pos + 5 ] << 8));
+		if (u32Size - u32Pos - MB_REPLAY_HEADER < u16Length) break;
+
+		if (xTimed)
+		{
+			// the gaps add up from the first frame, the rounding of one does not drift the next ones
+			u64Us += (uint32_t)(u8Capture[ u32Pos ] | (u8Capture[ u32Pos + 1 ] << 8) |
+					(u8Capture[ u32Pos + 2 ] << 16) | ((uint32_t)u8Capture[ u32Pos + 3 ] << 24));
+			xDue = xFirst + (TickType_t)(u64Us * configTICK_RATE_HZ / 1000000U);
+			xNow = xTaskGetTickCount();
+			if ((int32_t)(xDue - xNow) > 0) vTaskDelay(xDue - xNow);
+		}
+
+		u32Start = MB_COST_CLOCK();
+		i16result = serveFrame(modH, &u8Capture[ u32Pos + MB_REPLAY_HEADER ], u16Length);
+		u32Cost = MB_COST_CLOCK() - u32Start;
+
+		xReport->u32Frames++;
+		xReport->u32Bytes += u16Length;
+		xReport->u64Cost += u32Cost;
+		updateHist(&xReport->xCost, u32Cost);
+		if (i16result == 0)
+		{
+			xReport->u32Answers++;
+		}
+		else if (i16result > 0)
+		{
+			xReport->u32Exceptions++;
+		}
+		else if (i16result == ERR_BAD_SLAVE_ID)
+		{
+			xReport->u32OtherUnit++; // traffic of the other slaves of the capture
+		}
+		else
+		{
+			xReport->u32Dropped++;
+		}
+		u32Pos += MB_REPLAY_HEADER + u16Length;
+	}
+
+	xReport->u32Ticks = xTaskGetTickCount() - xFirst;
+	modH->u16BufferSize = 0;
+	return u32Pos == u32Size;
+}
+#endif
+
+#if ENABLE_MB_STATS == 1 || ENABLE_MB_MONITOR == 1 || ENABLE_MB_REPLAY == 1 || ENABLE_MB_STRESS == 1
+/**
+ * @brief
+ * Adds a sample to a histogram, one CLZ selects its log2 bucket
+ *
+ * @ingroup setup
+ */
+static void updateHist(modbusHist_t *xHist, uint32_t u32Val)
+{
+	uint32_t u32Bucket = 32 - __CLZ(u32Val); // __CLZ(0) is 32, 0 goes to the first bucket
+
+	if (u32Bucket >= MB_HIST_BUCKETS) u32Bucket = MB_HIST_BUCKETS - 1;
+	xHist->u32Bucket[u32Bucket]++;
+
+	if (xHist->u32Count == 0 || u32Val < xHist->u32Min) xHist->u32Min = u32Val;
+	if (u32Val > xHist->u32Max) xHist->u32Max = u32Val;
+	xHist->u64Sum += u32Val;
+	xHist->u32Count++;
+}
+#endif
+
+#if ENABLE_MB_STATS == 1 && MB_ENABLE_MASTER == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Round trip times in ticks of the queries to a slave, from the last transmission
+ * to the answer. The last MAX_SLAVES slaves queried are tracked
+ *
+ * @return histogram of u8id, NULL if it is not in the slave table
+ * @ingroup setup
+ */
+const modbusHist_t *ModbusGetRoundTrip(modbusHandler_t * modH, uint8_t u8id)
+{
+	for (uint8_t i = 0; i < MAX_SLAVES; i++)
+	{
+		if (modH->xSlaves[i].u8id == u8id && u8id != 0) return &modH->xSlaves[i].xRoundTrip;
+	}
+	return NULL;
+}
+#endif
+
+
+#if ENABLE_MB_NODE_STATS == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Copies the statistics of slave u8id, in a critical section as the master task
+ * updates them
+ *
+ * @return false if u8id is not tracked
+ * @ingroup setup
+ */
+bool ModbusGetNodeStats(modbusHandler_t * modH, uint8_t u8id, modbusNodeStats_t *xStats)
+{
+	bool xFound;
+
+	taskENTER_CRITICAL();
+	xFound = modH->u8NodeIndex[ u8id ] != 0;
+	if (xFound) memcpy(xStats, &modH->xNodes[ modH->u8NodeIndex[ u8id ] - 1 ], sizeof(modbusNodeStats_t));
+	taskEXIT_CRITICAL();
+	return xFound;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Copies the statistics of up to u8max tracked slaves, in the order of their first query
+ *
+ * @return number of entries copied
+ * @ingroup setup
+ */
+uint8_t ModbusGetNodes(modbusHandler_t * modH, modbusNodeStats_t *xNodes, uint8_t u8max)
+{
+	uint8_t u8count;
+
+	taskENTER_CRITICAL();
+	u8count = (modH->u8NodeCount < u8max) ? modH->u8NodeCount : u8max;
+	memcpy(xNodes, modH->xNodes, u8count * sizeof(modbusNodeStats_t));
+	taskEXIT_CRITICAL();
+	return u8count;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Clears the statistics of the tracked slaves, which keep their entries
+ *
+ * @ingroup setup
+ */
+void ModbusResetNodeStats(modbusHandler_t * modH)
+{
+	taskENTER_CRITICAL();
+	for (uint8_t i = 0; i < modH->u8NodeCount; i++)
+	{
+		uint8_t u8id = modH->xNodes[ i ].u8id;
+
+		memset(&modH->xNodes[ i ], 0, sizeof(modbusNodeStats_t));
+		modH->xNodes[ i ].u8id = u8id;
+	}
+	taskEXIT_CRITICAL();
+}
+#endif
+
+#if MB_ENABLE_MASTER == 1
+/**
+ * @brief
+ * Queues telegram in a free entry of the pool, at the tail of its level or at the head
+ * with xFront. The entry holds a copy of telegram, or with xRef telegram itself, whose
+ * u8Refs counts it until the master releases it. Only MB_PRIO_URGENT queues a telegram
+ * beyond MAX_TELEGRAMS, so an urgent query finds room without dropping the queued ones
+ *
+ * @return true if queued, false if the queue is full
+ * @ingroup loop
+ */
+static bool putTelegram(modbusHandler_t *modH, modbus_t *telegram, mb_priority_t xPrio, bool xFront, bool xRef)
+{
+	uint8_t u8Level = (xPrio < MB_PRIO_LEVELS) ? (uint8_t)xPrio : MB_PRIO_BACKGROUND;
+	uint8_t u8Queued = 0;
+	uint8_t u8Slot, u8Pos;
+
+	taskENTER_CRITICAL();
+	for (uint8_t i = 0; i < MB_PRIO_LEVELS; i++) u8Queued += modH->u8TelegramCount[i];
+	if (u8Queued >= ((u8Level == MB_PRIO_URGENT) ? MAX_TELEGRAMS + 1 : MAX_TELEGRAMS) || modH->u32TelegramFree == 0)
+	{
+		taskEXIT_CRITICAL();
+		return false;
+	}
+	u8Slot = (uint8_t)__CLZ(__RBIT(modH->u32TelegramFree)); // lowest free entry
+	modH->u32TelegramFree &= ~(1UL << u8Slot);
+	if (xRef) telegram->u8Refs++;
+	taskEXIT_CRITICAL();
+
+	if (xRef)
+	{
+		modH->xTelegramRef[u8Slot] = telegram;
+	}
+	else
+	{
+		modH->xTelegramPool[u8Slot] = *telegram; // the entry is ours until it is queued
+		modH->xTelegramRef[u8Slot] = &modH->xTelegramPool[u8Slot];
+	}
+
+	taskENTER_CRITICAL();
+	if (xFront)
+	{
+		modH->u8TelegramHead[u8Level] = (modH->u8TelegramHead[u8Level] + MB_TELEGRAM_POOL - 1) % MB_TELEGRAM_POOL;
+		u8Pos = modH->u8TelegramHead[u8Level];
+	}
+	else
+	{
+		u8Pos = (modH->u8TelegramHead[u8Level] + modH->u8TelegramCount[u8Level]) % MB_TELEGRAM_POOL;
+	}
+	modH->u8TelegramQueue[u8Level][u8Pos] = u8Slot;
+	modH->u8TelegramCount[u8Level]++;
+	taskEXIT_CRITICAL();
+
+	xSemaphoreGive(modH->QueueTelegramHandle);
+	return true;
+}
+
+
+/**
+ * @brief
+ * Highest level holding a queued telegram, called in a critical section
+ *
+ * @return level, -1 if the levels up to xLowest are empty
+ * @ingroup loop
+ */
+static int8_t findTelegramLevel(modbusHandler_t *modH, mb_priority_t xLowest)
+{
+	for (uint8_t i = 0; i <= (uint8_t)xLowest && i < MB_PRIO_LEVELS; i++)
+	{
+		if (modH->u8TelegramCount[i] != 0) return (int8_t)i;
+	}
+	return -1;
+}
+
+
+/**
+ * @brief
+ * Unlinks the head of u8Level, called in a critical section. The entry of the pool
+ * stays taken until freeTelegram()
+ *
+ * @return entry of the pool
+ * @ingroup loop
+ */
+static uint8_t popTelegram(modbusHandler_t *modH, uint8_t u8Level)
+{
+	uint8_t u8Slot = modH->u8TelegramQueue[u8Level][modH->u8TelegramHead[u8Level]];
+
+	modH->u8TelegramHead[u8Level] = (modH->u8TelegramHead[u8Level] + 1) % MB_TELEGRAM_POOL;
+	modH->u8TelegramCount[u8Level]--;
+	return u8Slot;
+}
+
+
+/**
+ * @brief
+ * Takes the oldest telegram of the highest level up to xLowest, waiting up to
+ * xBlock ticks for one to be queued. It becomes the query in progress, its entry
+ * of the pool stays taken until releaseTelegram()
+ *
+ * @return telegram, NULL if none was taken
+ * @ingroup loop
+ */
+static modbus_t *takeTelegram(modbusHandler_t *modH, mb_priority_t xLowest, TickType_t xBlock)
+{
+	int8_t i8Level;
+	uint8_t u8Slot;
+
+	if (xSemaphoreTake(modH->QueueTelegramHandle, xBlock) != pdTRUE) return NULL;
+
+	taskENTER_CRITICAL();
+	i8Level = findTelegramLevel(modH, xLowest);
+	if (i8Level < 0)
+	{
+		// only lower levels are queued, leave them for later
+		taskEXIT_CRITICAL();
+		xSemaphoreGive(modH->QueueTelegramHandle);
+		return NULL;
+	}
+	u8Slot = popTelegram(modH, (uint8_t)i8Level);
+	taskEXIT_CRITICAL();
+
+	modH->i8TelegramSlot = (int8_t)u8Slot;
+	return modH->xTelegramRef[u8Slot];
+}
+
+
+/**
+ * @brief
+ * Frees an entry of the pool taken off the queue, a telegram of ModbusQueryRef()
+ * loses one reference
+ *
+ * @ingroup loop
+ */
+static void freeTelegram(modbusHandler_t *modH, uint8_t u8Slot)
+{
+	modbus_t *telegram = modH->xTelegramRef[u8Slot];
+
+	taskENTER_CRITICAL();
+	if (telegram != &modH->xTelegramPool[u8Slot]) telegram->u8Refs--;
+	modH->u32TelegramFree |= 1UL << u8Slot;
+	taskEXIT_CRITICAL();
+}
+
+
+/**
+ * @brief
+ * Takes the entry of the query in progress off the handler when it is the one of
+ * telegram, it stays taken until freeTelegram()
+ *
+ * @return entry of the pool, -1 for a poll of the table or a copy of a telegram
+ * @ingroup loop
+ */
+static int8_t detachTelegram(modbusHandler_t *modH, const modbus_t *telegram)
+{
+	int8_t i8Slot = modH->i8TelegramSlot;
+
+	if (i8Slot < 0 || modH->xTelegramRef[i8Slot] != telegram) return -1;
+	modH->i8TelegramSlot = -1;
+	return i8Slot;
+}
+
+
+#if ENABLE_MB_MERGE == 1 || (MB_ENABLE_IP == 1 && MB_ENABLE_MASTER == 1)
+/**
+ * @brief
+ * Frees the entry of the query in progress once telegram, its result reported,
+ * is no longer used. Polls of the table and copies of telegrams have no entry
+ *
+ * @ingroup loop
+ */
+static void releaseTelegram(modbusHandler_t *modH, const modbus_t *telegram)
+{
+	int8_t i8Slot = detachTelegram(modH, telegram);
+
+	if (i8Slot >= 0) freeTelegram(modH, (uint8_t)i8Slot);
+}
+#endif
+
+
+void ModbusQuery(modbusHandler_t * modH, modbus_t telegram )
+{
+	//Add the telegram to the tail of the cyclic level of the queue
+	if (modH->uModbusType == MB_MASTER)
+	{
+	telegram.u32CurrentTask = (uint32_t *) xTaskGetCurrentTaskHandle();
+	telegram.xCallback = NULL;
+	putTelegram(modH, &telegram, MB_PRIO_CYCLIC, false, false);
+	notifyModbus(modH, MB_EV_QUERY);
+	}
+	else{
+		while(1);// error a slave cannot send queries as a master
+	}
+}
+
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Adds a query to the tail of the queue without tying it to the calling task.
+ * The master task calls xCallback(telegram, result, pvContext) when the query
+ * completes, so one task can keep up to MAX_TELEGRAMS queries outstanding
+ *
+ * @return true if queued, false if the queue is full
+ * @ingroup loop
+ */
+bool ModbusQueryAsync(modbusHandler_t * modH, modbus_t telegram, mb_query_cb_t xCallback, void *pvContext)
+{
+	if (xCallback == NULL)
+	{
+		while(1);// error the callback reports the result
+	}
+	return ModbusQueryPriority(modH, telegram, MB_PRIO_CYCLIC, xCallback, pvContext);
+}
+
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Adds a query to the tail of level xPrio: MB_PRIO_URGENT queries are sent before
+ * the others, MB_PRIO_BACKGROUND ones when no poll of the table is due. xCallback
+ * reports the result like for ModbusQueryAsync(), without it the calling task is
+ * notified like for ModbusQuery()
+ *
+ * @return true if queued, false if the queue is full
+ * @ingroup loop
+ */
+bool ModbusQueryPriority(modbusHandler_t * modH, modbus_t telegram, mb_priority_t xPrio, mb_query_cb_t xCallback, void *pvContext)
+{
+	if (modH->uModbusType != MB_MASTER)
+	{
+		while(1);// error a slave cannot send queries as a master
+	}
+
+	telegram.u32CurrentTask = (xCallback == NULL) ? (uint32_t *) xTaskGetCurrentTaskHandle() : NULL;
+	telegram.xCallback = xCallback;
+	telegram.pvContext = pvContext;
+	if (!putTelegram(modH, &telegram, xPrio, false, false)) return false;
+	notifyModbus(modH, MB_EV_QUERY);
+	return true;
+}
+
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Adds telegram itself to the tail of level xPrio, the master works on it in place
+ * instead of on a copy. Its xCallback and pvContext report the result, without
+ * xCallback the calling task is notified like for ModbusQuery(). A cyclic telegram
+ * may be queued again before its previous query completes: u8Refs counts the
+ * queued and running queries, the telegram must stay valid and unchanged until
+ * it drops to 0. During xCallback the query being reported still counts
+ *
+ * @return true if queued, false if the queue is full
+ * @ingroup loop
+ */
+bool ModbusQueryRef(modbusHandler_t * modH, modbus_t *telegram, mb_priority_t xPrio)
+{
+	if (modH->uModbusType != MB_MASTER)
+	{
+		while(1);// error a slave cannot send queries as a master
+	}
+
+	if (telegram->xCallback == NULL) telegram->u32CurrentTask = (uint32_t *) xTaskGetCurrentTaskHandle();
+	if (!putTelegram(modH, telegram, xPrio, false, true)) return false;
+	notifyModbus(modH, MB_EV_QUERY);
+	return true;
+}
+
+
+
+void ModbusQueryInject(modbusHandler_t * modH, modbus_t telegram )
+{
+	//Add the telegram to the head of the urgent level, the queued telegrams are kept
+	telegram.u32CurrentTask = (uint32_t *) xTaskGetCurrentTaskHandle();
+	telegram.xCallback = NULL;
+	putTelegram(modH, &telegram, MB_PRIO_URGENT, true, false);
+	notifyModbus(modH, MB_EV_QUERY);
+}
+
+#if ENABLE_MB_REDUNDANT == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Makes two RTU masters on redundant buses one logical master. Both keep their own
+ * task and telegram queue, the queries of the pair go through ModbusRedundantQuery().
+ * In MB_RED_FAILOVER mode a query goes to the bus that answered the slave last, with
+ * u16FailoverTimeout and no retries, and to the other bus when it fails. In
+ * MB_RED_PARALLEL mode it goes to both buses and the first answer completes it
+ *
+ * @param xPair pair allocated by the application, it must stay valid while the masters run
+ * @param u16FailoverTimeout answer timeout in ticks of the first bus tried, 0 keeps the one of the telegram
+ * @ingroup setup
+ */
+void ModbusRedundantInit(modbusRedundant_t *xPair, modbusHandler_t *xPrimary, modbusHandler_t *xSecondary,
+		mb_redundant_mode_t xMode, uint16_t u16FailoverTimeout)
+{
+	if (xPrimary == NULL || xSecondary == NULL || xPrimary == xSecondary ||
+		xPrimary->uModbusType != MB_MASTER || xSecondary->uModbusType != MB_MASTER)
+	{
+		while(1);// error a redundant pair needs two different masters
+	}
+
+	memset(xPair, 0, sizeof(modbusRedundant_t));
+	xPair->xBus[0] = xPrimary;
+	xPair->xBus[1] = xSecondary;
+	xPair->xMode = xMode;
+	xPair->u16FailoverTimeout = u16FailoverTimeout;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Sends a query on the redundant pair, the calling task is notified with the
+ * result like for ModbusQuery(). One answer is reported, whichever bus gave it
+ *
+ * @return true if sent, false if the MB_RED_QUERIES entries or the queues of both buses are full
+ * @ingroup loop
+ */
+bool ModbusRedundantQuery(modbusRedundant_t *xPair, modbus_t telegram)
+{
+	telegram.u32CurrentTask = (uint32_t *) xTaskGetCurrentTaskHandle();
+	telegram.xCallback = NULL;
+	return queueRedundant(xPair, &telegram);
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Sends a query on the redundant pair without tying it to the calling task,
+ * xCallback runs once in the task of the bus that completes the query
+ *
+ * @return true if sent, false if the MB_RED_QUERIES entries or the queues of both buses are full
+ * @ingroup loop
+ */
+bool ModbusRedundantQueryAsync(modbusRedundant_t *xPair, modbus_t telegram, mb_query_cb_t xCallback, void *pvContext)
+{
+	if (xCallback == NULL)
+	{
+		while(1);// error an asynchronous query needs a callback
+	}
+
+	telegram.u32CurrentTask = NULL;
+	telegram.xCallback = xCallback;
+	telegram.pvContext = pvContext;
+	return queueRedundant(xPair, &telegram);
+}
+
+/**
+ * @brief
+ * Health of the two paths to a slave of the pair, the last MB_RED_SLAVES slaves
+ * queried are tracked
+ *
+ * @return paths of u8id, NULL if it is not tracked
+ * @ingroup setup
+ */
+const modbusPath_t *ModbusRedundantPath(modbusRedundant_t *xPair, uint8_t u8id)
+{
+	for (uint8_t i = 0; i < MB_RED_SLAVES; i++)
+	{
+		if (xPair->xPaths[i].u8id == u8id && u8id != 0) return &xPair->xPaths[i];
+	}
+	return NULL;
+}
+
+/**
+ * @brief
+ * Takes a free entry for the query and sends its first leg, or both legs in
+ * parallel mode. A bus with a full queue is skipped for the other one
+ *
+ * @ingroup redundant
+ */
+static bool queueRedundant(modbusRedundant_t *xPair, modbus_t *telegram)
+{
+	modbusRedQuery_t *xQuery = NULL;
+	bool xSent, xReport;
+	uint8_t u8Bus;
+
+	// the entries are freed by the bus tasks
+	taskENTER_CRITICAL();
+	for (uint8_t i = 0; i < MB_RED_QUERIES && xQuery == NULL; i++)
+	{
+		if (!xPair->xQueries[i].xUsed)
+		{
+			xQuery = &xPair->xQueries[i];
+			xQuery->xUsed = true;
+		}
+	}
+	taskEXIT_CRITICAL();
+	if (xQuery == NULL) return false;
+
+	xQuery->telegram = *telegram;
+	xQuery->xPair = xPair;
+	xQuery->u8Tried = 0;
+	xQuery->u8Pending = 0;
+	xQuery->xDone = false;
+	xQuery->i8result = ERR_TIME_OUT;
+	xQuery->xPath = getPath(xPair, telegram->u8id);
+
+	if (isParallel(xQuery))
+	{
+		// the first leg may complete before the second one is queued, hold the entry meanwhile
+		xQuery->u8Pending = 1;
+		xSent = sendRedundant(xQuery, 0);
+		xSent = sendRedundant(xQuery, 1) || xSent;
+
+		taskENTER_CRITICAL();
+		xQuery->u8Pending--;
+		// the only leg sent failed before the entry was released
+		xReport = xSent && xQuery->u8Pending == 0 && !xQuery->xDone;
+		if (xQuery->u8Pending == 0 && xQuery->xDone) xQuery->xUsed = false;
+		xQuery->xDone = xQuery->xDone || xReport;
+		taskEXIT_CRITICAL();
+
+		if (xReport)
+		{
+			reportRedundant(xQuery, 0, xQuery->i8result);
+			xQuery->xUsed = false;
+		}
+	}
+	else
+	{
+		u8Bus = xQuery->xPath->u8Path;
+		xSent = sendRedundant(xQuery, u8Bus) || sendRedundant(xQuery, u8Bus ^ 1);
+	}
+
+	if (!xSent) xQuery->xUsed = false;
+	return xSent;
+}
+
+/**
+ * @brief
+ * Parallel mode applies to the queries whose data fit the scratch buffers, the
+ * records of FC20 are read into the sub-requests directly and go to one bus at a time
+ *
+ * @ingroup redundant
+ */
+static bool isParallel(const modbusRedQuery_t *xQuery)
+{
+#if MB_ENABLE_FC_RANGES == 1
+	if (xQuery->telegram.u8fct == MB_FC_READ_RANGES) return false; // read into its ranges, as FC20
+#endif
+	return xQuery->xPair->xMode == MB_RED_PARALLEL && xQuery->telegram.u8fct != MB_FC_READ_FILE_RECORD;
+}
+
+/**
+ * @brief
+ * Path entry of a slave, a new slave replaces the entries round robin
+ *
+ * @ingroup redundant
+ */
+static modbusPath_t *getPath(modbusRedundant_t *xPair, uint8_t u8id)
+{
+	modbusPath_t *xPath;
+
+	for (uint8_t i = 0; i < MB_RED_SLAVES; i++)
+	{
+		if (xPair->xPaths[i].u8id == u8id) return &xPair->xPaths[i];
+	}
+
+	taskENTER_CRITICAL();
+	xPath = &xPair->xPaths[xPair->u8PathNext];
+	xPair->u8PathNext = (xPair->u8PathNext + 1) % MB_RED_SLAVES;
+	memset(xPath, 0, sizeof(modbusPath_t));
+	xPath->u8id = u8id;
+	taskEXIT_CRITICAL();
+	return xPath;
+}
+
+/**
+ * @brief
+ * Queues one leg of the query on bus u8Bus. In parallel mode the data read go to
+ * the scratch buffer of the bus, in failover mode the first bus tried waits
+ * u16FailoverTimeout without retries so that the other bus gets the query soon
+ *
+ * @return false if the queue of the bus is full
+ * @ingroup redundant
+ */
+static bool sendRedundant(modbusRedQuery_t *xQuery, uint8_t u8Bus)
+{
+	modbusRedundant_t *xPair = xQuery->xPair;
+	modbus_t telegram = xQuery->telegram;
+
+#if ENABLE_MB_TYPED == 1
+	// the legs send and read the register images, reportRedundant() converts the answer once
+	encodeValues(&telegram);
+	telegram.pvValues = NULL;
+#endif
+	if (isParallel(xQuery))
+	{
+#if ENABLE_MB_GATHER == 1
+		telegram.xGather = NULL; // reportRedundant() scatters the image of the winning bus
+#endif
+		if (telegram.u8fct == MB_FC_READ_COILS || telegram.u8fct == MB_FC_READ_DISCRETE_INPUT ||
+			telegram.u8fct == MB_FC_READ_REGISTERS || telegram.u8fct == MB_FC_READ_INPUT_REGISTER)
+		{
+			telegram.u16reg = xQuery->u16Data[u8Bus];
+		}
+		else if (telegram.u8fct == MB_FC_READ_WRITE_MULTIPLE_REGISTERS)
+		{
+			telegram.u16ReadReg = xQuery->u16Data[u8Bus];
+		}
+	}
+	else if (xQuery->u8Tried == 0)
+	{
+		if (xPair->u16FailoverTimeout != 0) telegram.u16timeOut = xPair->u16FailoverTimeout;
+		telegram.u8retries = 0;
+	}
+
+	taskENTER_CRITICAL();
+	xQuery->u8Tried |= 1 << u8Bus;
+	xQuery->u8Pending++;
+	taskEXIT_CRITICAL();
+
+	if (ModbusQueryAsync(xPair->xBus[u8Bus], telegram, u8Bus ? redundantSecondary : redundantPrimary, xQuery)) return true;
+
+	taskENTER_CRITICAL();
+	xQuery->u8Pending--;
+	taskEXIT_CRITICAL();
+	return false;
+}
+
+/**
+ * @brief
+ * Completion callbacks of the legs, they run in the task of their bus
+ *
+ * @ingroup redundant
+ */
+static void redundantPrimary(modbus_t *telegram, int8_t i8result, void *pvContext)
+{
+	(void)telegram;
+	redundantResult((modbusRedQuery_t *) pvContext, 0, i8result);
+}
+
+static void redundantSecondary(modbus_t *telegram, int8_t i8result, void *pvContext)
+{
+	(void)telegram;
+	redundantResult((modbusRedQuery_t *) pvContext, 1, i8result);
+}
+
+/**
+ * @brief
+ * Result of one leg. An exception is an answer of the slave, the path works.
+ * The first answer completes the query, a failure in failover mode sends the
+ * query on the other bus, and the last leg to fail reports its error. The
+ * entry is freed when no leg is left
+ *
+ * @ingroup redundant
+ */
+static void redundantResult(modbusRedQuery_t *xQuery, uint8_t u8Bus, int8_t i8result)
+{
+	modbusPath_t *xPath = xQuery->xPath;
+	bool xAnswered = (i8result == ERR_OK_QUERY || i8result == ERR_EXCEPTION);
+	bool xReport;
+
+	if (!xAnswered && !isParallel(xQuery) && (xQuery->u8Tried & (2 >> u8Bus)) == 0)
+	{
+		// counted in u8Pending before this leg is released below
+		sendRedundant(xQuery, u8Bus ^ 1);
+	}
+
+	taskENTER_CRITICAL();
+	if (xAnswered)
+	{
+		xPath->u8Fails[u8Bus] = 0;
+		xPath->u32Answers[u8Bus]++;
+	}
+	else
+	{
+		if (xPath->u8Fails[u8Bus] < 0xFF) xPath->u8Fails[u8Bus]++;
+		xQuery->i8result = i8result;
+	}
+	xReport = !xQuery->xDone && (xAnswered || xQuery->u8Pending == 1);
+	if (xReport)
+	{
+		xQuery->xDone = true;
+		if (xAnswered)
+		{
+			if (xQuery->u8Tried == 3 && !isParallel(xQuery)) xPath->u32Failovers++;
+			xPath->u8Path = u8Bus;
+		}
+	}
+	taskEXIT_CRITICAL();
+
+	if (xReport) reportRedundant(xQuery, u8Bus, i8result);
+
+	taskENTER_CRITICAL();
+	xQuery->u8Pending--;
+	if (xQuery->u8Pending == 0 && xQuery->xDone) xQuery->xUsed = false;
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief
+ * Reports the result of the query to the application. In parallel mode the data
+ * read by the winning bus are copied from its scratch buffer first, the coils
+ * beyond u16CoilsNo in the last word keep their value
+ *
+ * @ingroup redundant
+ */
+static void reportRedundant(modbusRedQuery_t *xQuery, uint8_t u8Bus, int8_t i8result)
+{
+	modbus_t *telegram = &xQuery->telegram;
+	uint16_t *u16src = xQuery->u16Data[u8Bus];
+	uint16_t u16Words, u16Mask;
+
+	if (i8result == ERR_OK_QUERY && isParallel(xQuery))
+	{
+		switch (telegram->u8fct)
+		{
+		case MB_FC_READ_COILS:
+		case MB_FC_READ_DISCRETE_INPUT:
+			u16Words = telegram->u16CoilsNo / 16;
+			memcpy(telegram->u16reg, u16src, u16Words * sizeof(uint16_t));
+			if (telegram->u16CoilsNo % 16)
+			{
+				u16Mask = (1U << (telegram->u16CoilsNo % 16)) - 1;
+				telegram->u16reg[u16Words] = (telegram->u16reg[u16Words] & ~u16Mask) | (u16src[u16Words] & u16Mask);
+			}
+			break;
+		case MB_FC_READ_REGISTERS:
+		case MB_FC_READ_INPUT_REGISTER:
+#if ENABLE_MB_GATHER == 1
+			if (telegram->xGather != NULL)
+			{
+				gatherImage(telegram, u16src);
+				break;
+			}
+#endif
+			memcpy(telegram->u16reg, u16src, telegram->u16CoilsNo * sizeof(uint16_t));
+			break;
+		case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+#if ENABLE_MB_GATHER == 1
+			if (telegram->xGather != NULL)
+			{
+				gatherImage(telegram, u16src);
+				break;
+			}
+#endif
+			memcpy(telegram->u16ReadReg, u16src, telegram->u16ReadNo * sizeof(uint16_t));
+			break;
+		default:
+			break;
+		}
+	}
+#if ENABLE_MB_TYPED == 1
+	if (i8result == ERR_OK_QUERY) decodeValues(telegram);
+#endif
+
+	if (telegram->xCallback != NULL)
+	{
+		telegram->xCallback(telegram, i8result, telegram->pvContext);
+	}
+	else if (telegram->u32CurrentTask != NULL)
+	{
+		xTaskNotify((TaskHandle_t)telegram->u32CurrentTask, i8result, eSetValueWithOverwrite);
+	}
+}
+#endif
+
+#if ENABLE_MB_DISCOVERY == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Probes the slave IDs u8First to u8Last of each bus of xScans, all the buses at the
+ * same time: each master has one probe in flight, without retries, with a timeout taken
+ * from the baud rate unless u16timeOut is set. An answer or an exception marks the ID in
+ * u32Found with its latency. The calling task blocks until every bus is scanned, the
+ * buses should carry no other queries meanwhile for the latencies to be meaningful
+ *
+ * @return number of IDs found on all the buses
+ * @ingroup loop
+ */
+uint16_t ModbusDiscover(modbusDiscovery_t *xScans, uint8_t u8Count)
+{
+	uint16_t u16Found = 0;
+	bool xRunning;
+
+	for (uint8_t i = 0; i < u8Count; i++)
+	{
+		modbusDiscovery_t *xScan = &xScans[ i ];
+
+		if (xScan->modH->uModbusType != MB_MASTER || xScan->u8First == 0 || xScan->u8First > xScan->u8Last || xScan->u8Last > 247)
+		{
+			while(1);// error a scan probes IDs 1 to 247 with a master
+		}
+		memset(xScan->u32Found, 0, sizeof(xScan->u32Found));
+		memset(xScan->u16Latency, 0, sizeof(xScan->u16Latency));
+		xScan->u16Found = 0;
+		xScan->u8Next = xScan->u8First;
+		xScan->xBusy = false;
+		xScan->xCaller = xTaskGetCurrentTaskHandle();
+	}
+
+	do
+	{
+		xRunning = false;
+		for (uint8_t i = 0; i < u8Count; i++)
+		{
+			modbusDiscovery_t *xScan = &xScans[ i ];
+
+			if (!xScan->xBusy && xScan->u8Next <= xScan->u8Last)
+			{
+				modbus_t telegram = { 0 };
+
+				telegram.u8id = xScan->u8Next;
+				telegram.u8fct = xScan->u8fct;
+				if (xScan->u8fct == MB_FC_ENCAPSULATED)
+				{
+					telegram.u16RegAdd = 0x0100; // basic identification from the vendor name
+					telegram.u16CoilsNo = 2;     // only the header of the answer is kept
+				}
+				else
+				{
+					telegram.u8fct = MB_FC_READ_REGISTERS;
+					telegram.u16RegAdd = xScan->u16RegAdd;
+					telegram.u16CoilsNo = 1;
+				}
+				telegram.u16reg = xScan->u16Probe;
+				telegram.u16timeOut = xScan->u16timeOut ? xScan->u16timeOut : getProbeTimeOut(xScan->modH, telegram.u8fct);
+
+				xScan->xBusy = true;
+				xScan->xSent = xTaskGetTickCount();
+				if (ModbusQueryAsync(xScan->modH, telegram, discoverCallback, xScan))
+				{
+					xScan->u8Next++;
+				}
+				else
+				{
+					xScan->xBusy = false; // queue full, tried again at the next tick
+				}
+			}
+			if (xScan->xBusy || xScan->u8Next <= xScan->u8Last) xRunning = true;
+		}
+		if (xRunning) ulTaskNotifyTake(pdTRUE, 1);
+	} while (xRunning);
+
+	for (uint8_t i = 0; i < u8Count; i++)
+	{
+		u16Found += xScans[ i ].u16Found;
+	}
+	return u16Found;
+}
+
+/**
+ * @brief
+ * Answer timeout of a probe: the query and the longest answer on the line, T3.5 and
+ * MB_DISCOVER_REPLY_US for the slave, in ticks. A handler without baud rate keeps its own
+ *
+ * @ingroup loop
+ */
+static uint16_t getProbeTimeOut(modbusHandler_t *modH, mb_functioncode_t u8fct)
+{
+	uint32_t u32Chars = (u8fct == MB_FC_ENCAPSULATED) ? 7 + MAX_BUFFER : 8 + 7;
+	uint32_t u32Us;
+
+	if ((modH->xTransport->u8Flags & MB_TP_UART) == 0) return modH->u16timeOut;
+	if (modH->xTransport->u8Flags & MB_TP_LRC) u32Chars = u32Chars * 2 + 6; // hex pairs, colons and CR LF
+
+	u32Us = (uint32_t)(((uint64_t)u32Chars * getCharBits(modH->port) * 1000000UL) / modH->port->Init.BaudRate);
+	u32Us += modH->u32T35us + MB_DISCOVER_REPLY_US;
+	return (uint16_t)((u32Us * (uint64_t)configTICK_RATE_HZ + 999999UL) / 1000000UL) + 1; // the tick in progress does not count
+}
+
+/* completion of a probe, in the master task of the bus */
+static void discoverCallback(modbus_t *telegram, int8_t i8result, void *pvContext)
+{
+	modbusDiscovery_t *xScan = (modbusDiscovery_t *) pvContext;
+
+	if (i8result == ERR_OK_QUERY || i8result == ERR_EXCEPTION)
+	{
+		xScan->u32Found[ telegram->u8id / 32 ] |= 1UL << (telegram->u8id % 32);
+		xScan->u16Latency[ telegram->u8id ] = (uint16_t)(xTaskGetTickCount() - xScan->xSent);
+		xScan->u16Found++;
+	}
+	xScan->xBusy = false;
+	xTaskNotifyGive(xScan->xCaller);
+}
+#endif
+
+#if ENABLE_MB_STRESS == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Loads a bus with the mix of xStress for xDuration ticks: one query at a time, the
+ * next one queued as soon as the last one completes so the master keeps the line as
+ * busy as its timeouts and T3.5 allow. Each op is picked at random with its weight,
+ * FC6 and FC16 write random values and store them in the model of their op, FC3 and
+ * FC4 answers are compared to theirs. A write without an answer is sent again first,
+ * a model stays what the slave holds. The results add to those of the previous calls.
+ * The calling task blocks, the bus should carry no other queries meanwhile
+ *
+ * @ingroup loop
+ */
+void ModbusStress(modbusStress_t *xStress, TickType_t xDuration)
+{
+	TickType_t xStart = xTaskGetTickCount(), xSent;
+	uint32_t u32Weights = 0, u32Pick;
+	const modbusStressOp_t *xOp;
+
+	if (xStress->modH->uModbusType != MB_MASTER || xStress->u8Ops == 0 || xStress->u32Seed == 0)
+	{
+		while(1);// error a stress run needs a master, a mix and a seed
+	}
+	for (uint8_t i = 0; i < xStress->u8Ops; i++)
+	{
+		xOp = &xStress->xOps[ i ];
+		switch (xOp->u8fct)
+		{
+		case MB_FC_READ_COILS:
+		case MB_FC_READ_DISCRETE_INPUT:
+			if (xOp->u16CoilsNo == 0 || xOp->u16CoilsNo > 2000 || xOp->u16Model != NULL) while(1);// error 1 to 2000 coils, no model
+			break;
+		case MB_FC_READ_REGISTERS:
+		case MB_FC_READ_INPUT_REGISTER:
+			if (xOp->u16CoilsNo == 0 || xOp->u16CoilsNo > 125) while(1);// error 1 to 125 registers
+			break;
+		case MB_FC_WRITE_REGISTER:
+			if (xOp->u16CoilsNo != 1) while(1);// error FC6 writes one register
+			break;
+		case MB_FC_WRITE_MULTIPLE_REGISTERS:
+			if (xOp->u16CoilsNo == 0 || xOp->u16CoilsNo > 123) while(1);// error 1 to 123 registers
+			break;
+		default:
+			while(1);// error function code not supported by a stress run
+		}
+		u32Weights += xOp->u8Weight;
+	}
+	if (u32Weights == 0)
+	{
+		while(1);// error every op of the mix has a weight of 0
+	}
+	xStress->xCaller = xTaskGetCurrentTaskHandle();
+	xStress->xBusy = false;
+
+	while ((TickType_t)(xTaskGetTickCount() - xStart) < xDuration)
+	{
+		if (!xStress->xRetry)
+		{
+			u32Pick = stressRandom(xStress) % u32Weights;
+			for (xStress->u8Op = 0; u32Pick >= xStress->xOps[ xStress->u8Op ].u8Weight; xStress->u8Op++)
+			{
+				u32Pick -= xStress->xOps[ xStress->u8Op ].u8Weight;
+			}
+			xOp = &xStress->xOps[ xStress->u8Op ];
+			if (xOp->u8fct == MB_FC_WRITE_REGISTER || xOp->u8fct == MB_FC_WRITE_MULTIPLE_REGISTERS)
+			{
+				for (uint16_t i = 0; i < xOp->u16CoilsNo; i++) xStress->u16Regs[ i ] = (uint16_t)stressRandom(xStress);
+			}
+		}
+		xOp = &xStress->xOps[ xStress->u8Op ];
+
+		modbus_t telegram = { 0 };
+		telegram.u8id = xOp->u8id;
+		telegram.u8fct = xOp->u8fct;
+		telegram.u16RegAdd = xOp->u16RegAdd;
+		telegram.u16CoilsNo = xOp->u16CoilsNo;
+		telegram.u16reg = xStress->u16Regs;
+
+		xStress->xBusy = true;
+		xSent = xTaskGetTickCount();
+		if (!ModbusQueryAsync(xStress->modH, telegram, stressCallback, xStress))
+		{
+			xStress->xBusy = false;
+			xStress->xRetry = true; // queue full, the same op at the next tick
+			vTaskDelay(1);
+			continue;
+		}
+		while (xStress->xBusy) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		updateHist(&xStress->xLatency, xTaskGetTickCount() - xSent);
+		stressResult(xStress);
+	}
+	xStress->u32Ticks += xTaskGetTickCount() - xStart;
+}
+
+/* xorshift32 of the picks and of the written values */
+static uint32_t stressRandom(modbusStress_t *xStress)
+{
+	uint32_t u32x = xStress->u32Seed;
+
+	u32x ^= u32x << 13;
+	u32x ^= u32x >> 17;
+	u32x ^= u32x << 5;
+	xStress->u32Seed = u32x;
+	return u32x;
+}
+
+/* completion of a stress query, in the master task of the bus */
+static void stressCallback(modbus_t *telegram, int8_t i8result, void *pvContext)
+{
+	modbusStress_t *xStress = (modbusStress_t *) pvContext;
+
+	(void)telegram;
+	xStress->i8Result = i8result;
+	xStress->xBusy = false;
+	xTaskNotifyGive(xStress->xCaller);
+}
+
+/**
+ * @brief
+ * Counts the result of the query in progress and checks its data against the model
+ *
+ * @ingroup loop
+ */
+static void stressResult(modbusStress_t *xStress)
+{
+	const modbusStressOp_t *xOp = &xStress->xOps[ xStress->u8Op ];
+	bool xWrite = (xOp->u8fct == MB_FC_WRITE_REGISTER || xOp->u8fct == MB_FC_WRITE_MULTIPLE_REGISTERS);
+
+	xStress->u32Queries++;
+	// an exception leaves the registers as they were, a timeout may not
+	xStress->xRetry = xWrite && xOp->u16Model != NULL && xStress->i8Result != ERR_OK_QUERY && xStress->i8Result != ERR_EXCEPTION;
+	switch (xStress->i8Result)
+	{
+	case ERR_OK_QUERY:
+		if (xOp->u16Model == NULL)
+		{
+			xStress->u32Ok++;
+		}
+		else if (xWrite)
+		{
+			memcpy(xOp->u16Model, xStress->u16Regs, xOp->u16CoilsNo * sizeof(uint16_t));
+			xStress->u32Ok++;
+		}
+		else if (memcmp(xOp->u16Model, xStress->u16Regs, xOp->u16CoilsNo * sizeof(uint16_t)) == 0)
+		{
+			xStress->u32Ok++;
+		}
+		else
+		{
+			xStress->u32Mismatch++;
+		}
+		break;
+	case ERR_EXCEPTION:
+		xStress->u32Exceptions++;
+		break;
+	case ERR_TIME_OUT:
+		xStress->u32TimeOuts++;
+		break;
+	default:
+		xStress->u32Errors++;
+		break;
+	}
+}
+#endif
+
+#if ENABLE_MB_BATCH == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Sends the u8Count telegrams of xEntries, each one to the master of its entry, and
+ * reports the batch once when the last one completes: xCallback(xBatch, u8Failed,
+ * pvContext) from the task of the last master, or without it a notification of the
+ * calling task with ERR_OK_QUERY or the result of the first entry that failed, as
+ * ModbusQuery() does. Each entry keeps its own i8result.
+ * A bus has one telegram of the batch in its queue at a time, in the order of the
+ * list, so the buses work at the same time and the queue keeps room for the other
+ * queries. An entry that finds the queue of its bus full fails with ERR_POLLING,
+ * with the entries of that bus after it
+ *
+ * @return false if the batch is empty or still in progress
+ * @ingroup loop
+ */
+bool ModbusBatchSubmit(modbusBatch_t *xBatch, modbusBatchEntry_t *xEntries, uint8_t u8Count, mb_batch_cb_t xCallback, void *pvContext)
+{
+	if (u8Count == 0 || xBatch->u8Pending != 0) return false;
+
+	xBatch->xEntries = xEntries;
+	xBatch->u8Count = u8Count;
+	xBatch->xCallback = xCallback;
+	xBatch->pvContext = pvContext;
+	xBatch->xTask = xTaskGetCurrentTaskHandle();
+	xBatch->u8Failed = 0;
+	for (uint8_t i = 0; i < u8Count; i++)
+	{
+		xEntries[ i ].xBatch = xBatch;
+		xEntries[ i ].i8result = ERR_POLLING;
+		xEntries[ i ].xSent = false;
+	}
+	xBatch->u8Pending = u8Count; // before the first answer can arrive
+
+	for (uint8_t i = 0; i < u8Count; i++)
+	{
+		bool xFirst = true;
+
+		for (uint8_t j = 0; j < i && xFirst; j++)
+		{
+			if (xEntries[ j ].modH == xEntries[ i ].modH) xFirst = false;
+		}
+		if (xFirst) sendBatch(xBatch, i);
+	}
+	return true;
+}
+
+/**
+ * @brief
+ * Queues entry u8Entry, or fails it and the next entries of its bus with ERR_POLLING
+ * when the queue of the bus is full
+ *
+ * @ingroup loop
+ */
+static void sendBatch(modbusBatch_t *xBatch, uint8_t u8Entry)
+{
+	modbusBatchEntry_t *xEntry = &xBatch->xEntries[ u8Entry ];
+
+	xEntry->xSent = true;
+	if (ModbusQueryAsync(xEntry->modH, xEntry->telegram, batchCallback, xEntry)) return;
+
+	for (uint8_t i = u8Entry; i < xBatch->u8Count; i++)
+	{
+		if (xBatch->xEntries[ i ].modH == xEntry->modH)
+		{
+			xBatch->xEntries[ i ].xSent = true;
+			completeBatch(xBatch, &xBatch->xEntries[ i ], ERR_POLLING);
+		}
+	}
+}
+
+/* completion of an entry, in the master task of its bus: the next entry of the bus follows */
+static void batchCallback(modbus_t *telegram, int8_t i8result, void *pvContext)
+{
+	modbusBatchEntry_t *xEntry = (modbusBatchEntry_t *) pvContext;
+	modbusBatch_t *xBatch = xEntry->xBatch;
+	uint8_t u8Next = (uint8_t)(xEntry - xBatch->xEntries) + 1;
+
+	(void)telegram;
+	while (u8Next < xBatch->u8Count && (xBatch->xEntries[ u8Next ].modH != xEntry->modH || xBatch->xEntries[ u8Next ].xSent))
+	{
+		u8Next++;
+	}
+	if (u8Next < xBatch->u8Count) sendBatch(xBatch, u8Next); // queued before the batch may complete
+	completeBatch(xBatch, xEntry, i8result);
+}
+
+/**
+ * @brief
+ * Stores the result of an entry and reports the batch after its last entry. The
+ * entries of different buses complete in their own master tasks
+ *
+ * @ingroup loop
+ */
+static void completeBatch(modbusBatch_t *xBatch, modbusBatchEntry_t *xEntry, int8_t i8result)
+{
+	bool xLast;
+
+	xEntry->i8result = i8result;
+	taskENTER_CRITICAL();
+	if (i8result != ERR_OK_QUERY) xBatch->u8Failed++;
+	xLast = (--xBatch->u8Pending == 0);
+	taskEXIT_CRITICAL();
+	if (!xLast) return;
+
+	if (xBatch->xCallback != NULL)
+	{
+		xBatch->xCallback(xBatch, xBatch->u8Failed, xBatch->pvContext);
+		return;
+	}
+	for (uint8_t i = 0; i < xBatch->u8Count; i++)
+	{
+		if (xBatch->xEntries[ i ].i8result != ERR_OK_QUERY)
+		{
+			xTaskNotify(xBatch->xTask, (uint32_t)xBatch->xEntries[ i ].i8result, eSetValueWithOverwrite);
+			return;
+		}
+	}
+	xTaskNotify(xBatch->xTask, (uint32_t)ERR_OK_QUERY, eSetValueWithOverwrite);
+}
+#endif
+
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Generate a query to an slave with a modbus_t telegram structure
+ * The Master must be in COM_IDLE mode. After it, its state would be COM_WAITING.
+ * This method has to be called only in loop() section.
+ *
+ * @see modbus_t
+ * @param modH  modbus handler
+ * @param modbus_t  modbus telegram structure (id, fct, ...)
+ * @ingroup loop
+ */
+int8_t SendQuery(modbusHandler_t *modH ,  modbus_t *telegram )
+{
+
+
+	uint8_t  error = 0;
+	xSemaphoreTake(modH->ModBusSphrHandle , portMAX_DELAY); //before processing the message get the semaphore
+
+	if (modH->u8id!=0) error = ERR_NOT_MASTER;
+	if (modH->i8state != COM_IDLE) error = ERR_POLLING ;
+#if ENABLE_MB_BROADCAST == 1
+	if ((telegram->u8id==0 && !isBroadcastFunction(telegram->u8fct)) || (telegram->u8id>247)) error = ERR_BAD_SLAVE_ID;
+#else
+	if ((telegram->u8id==0) || (telegram->u8id>247)) error = ERR_BAD_SLAVE_ID;
+#endif
+	if ((telegram->u8fct == MB_FC_READ_FILE_RECORD || telegram->u8fct == MB_FC_WRITE_FILE_RECORD) &&
+		!checkFileQuery(telegram)) error = ERR_BAD_SIZE;
+	if (!checkWriteQuery(telegram)) error = ERR_BAD_SIZE;
+#if MB_ENABLE_FC_RANGES == 1
+	if (telegram->u8fct == MB_FC_READ_RANGES && !checkRangesQuery(telegram)) error = ERR_BAD_SIZE;
+#endif
+#if MB_ENABLE_FC_DELTA == 1
+	if (telegram->u8fct == MB_FC_READ_DELTA) error = ERR_BAD_SIZE; // a FC3 or FC4 read of a cached range is sent as it
+#endif
+#if ENABLE_MB_GATHER == 1
+	if (telegram->xGather != NULL && !checkGather(telegram)) error = ERR_BAD_SIZE;
+#endif
+
+
+	if(error)
+	{
+		 MB_COUNT_ERR(modH, (int8_t)error);
+		 modH->i8lastError = error;
+		 xSemaphoreGive(modH->ModBusSphrHandle);
+		 return error;
+	}
+
+	if(modH->xTransport->abort != NULL)
+	{
+		modH->xTransport->abort(modH); // drop the late answers of previous queries
+	}
+
+
+	openTransaction(&modH->xTransaction, telegram);
+#if MB_MASTER_DELTA
+	modH->xDeltaCache = findDeltaCache(modH, telegram);
+#endif
+#if ENABLE_MB_PREBUILT == 1
+	modH->u8TxFrame = NULL;
+	if (telegram->u8Frame != NULL && (modH->xTransport->u8Flags & MB_TP_LRC) == 0) // a prebuilt frame has a CRC
+	{
+		sendFrame(modH, telegram);
+	}
+	else
+#endif
+	{
+		buildQuery(modH, telegram);
+		sendTxBuffer(modH);
+	}
+
+	xSemaphoreGive(modH->ModBusSphrHandle);
+
+	modH->i8state = COM_WAITING;
+	modH->i8lastError = 0;
+	return 0;
+
+
+}
+
+
+#if ENABLE_MB_PREBUILT == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Builds the frame of a fixed telegram once, with its CRC, into u8Frame and points
+ * telegram->u8Frame at it. SendQuery() then sends the frame as it is, a UART straight
+ * from u8Frame, without building the query and its CRC at every cycle.
+ * Reads (FC1 to FC4, FC24, FC43) and the single writes FC5 and FC6 can be prebuilt,
+ * FC5 and FC6 take u16reg[0] now. Call it after ModbusInit(), calcCRC() may use the
+ * CRC unit, and again when a field of the telegram changes
+ *
+ * @param telegram  telegram keeping u8Frame, its fields still describe the answer
+ * @param u8Frame  frame storage, it must stay valid as long as the telegram is sent
+ * @param u8Size  bytes of u8Frame, 8 hold any prebuilt frame
+ * @return bytes of the frame, 0 if the telegram cannot be prebuilt
+ * @ingroup loop
+ */
+uint8_t ModbusBuildFrame(modbus_t *telegram, uint8_t *u8Frame, uint8_t u8Size)
+{
+	uint16_t u16size, u16crc;
+
+	telegram->u8Frame = NULL;
+	telegram->u8FrameSize = 0;
+
+	switch (telegram->u8fct)
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+	case MB_FC_WRITE_COIL:
+	case MB_FC_WRITE_REGISTER:
+	case MB_FC_READ_FIFO_QUEUE:
+	case MB_FC_ENCAPSULATED:
+		break;
+	default:
+		return 0; // the other queries carry data, or records, of variable size
+	}
+	if (u8Size < 8) return 0;
+
+	u16size = buildPdu(u8Frame, telegram);
+	u16crc = calcCRC(u8Frame, u16size);
+	u8Frame[ u16size++ ] = u16crc >> 8;
+	u8Frame[ u16size++ ] = u16crc & 0x00ff;
+
+	telegram->u8Frame = u8Frame;
+	telegram->u8FrameSize = (uint8_t)u16size;
+	return telegram->u8FrameSize;
+}
+
+/**
+ * @brief
+ * Sends the prebuilt frame of telegram, a UART transmits it in place and
+ * the other transports from a copy in u8Buffer
+ *
+ * @ingroup loop
+ */
+static void sendFrame(modbusHandler_t *modH, const modbus_t *telegram)
+{
+	if (modH->xTransport->u8Flags & MB_TP_UART)
+	{
+		modH->u8TxFrame = telegram->u8Frame;
+	}
+	else
+	{
+		memcpy(modH->u8Buffer, telegram->u8Frame, telegram->u8FrameSize);
+	}
+	modH->u16BufferSize = telegram->u8FrameSize;
+	modH->xTransport->send(modH);
+}
+#endif
+
+/**
+ * @brief
+ * Takes the destinations of the answer from telegram when its query is sent, where
+ * get_FC1() and get_FC3() store it. The handler tables are left alone
+ *
+ * @ingroup loop
+ */
+static void openTransaction(modbusTransaction_t *xTrans, const modbus_t *telegram)
+{
+	xTrans->u16Bits = NULL;
+	xTrans->u16Regs = NULL;
+
+	switch (telegram->u8fct)
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+		xTrans->u16Bits = telegram->u16reg;
+		break;
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+	case MB_FC_DIAGNOSTICS:
+		xTrans->u16Regs = telegram->u16reg;
+		break;
+	case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+		xTrans->u16Regs = telegram->u16ReadReg; // the answer carries the read block
+		break;
+	default:
+		break; // the answer has no data for the telegram, or the telegram stores it itself
+	}
+}
+
+/**
+ * @brief
+ * Writes the query of telegram to u8Buffer, without CRC
+ *
+ * @ingroup loop
+ */
+static void buildQuery(modbusHandler_t *modH, modbus_t *telegram)
+{
+#if MB_MASTER_DELTA
+	if (modH->xDeltaCache != NULL)
+	{
+		modH->u16BufferSize = buildDeltaPdu(modH->u8Buffer, modH->xDeltaCache);
+		return;
+	}
+#endif
+#if ENABLE_MB_TYPED == 1
+	encodeValues(telegram);
+#endif
+	modH->u16BufferSize = buildPdu(modH->u8Buffer, telegram);
+}
+
+#if ENABLE_MB_TYPED == 1
+/**
+ * @brief
+ * Converts the native values of a typed FC16 telegram to u16reg, once per transmission
+ *
+ * @ingroup loop
+ */
+static void encodeValues(modbus_t *telegram)
+{
+	if (telegram->pvValues != NULL && telegram->u8fct == MB_FC_WRITE_MULTIPLE_REGISTERS)
+	{
+		ModbusValuesToRegs(telegram->u16reg, telegram->pvValues, telegram->u16CoilsNo,
+				(mb_type_t)telegram->u8Type, (mb_wordorder_t)telegram->u8Order);
+	}
+}
+
+/**
+ * @brief
+ * Converts the answer of a typed FC3, FC4 or FC23 telegram to its native values,
+ * once before the result is reported
+ *
+ * @ingroup loop
+ */
+static void decodeValues(modbus_t *telegram)
+{
+	if (telegram->pvValues == NULL) return;
+#if ENABLE_MB_GATHER == 1
+	if (telegram->xGather != NULL) return; // the gather list has the types
+#endif
+
+	if (telegram->u8fct == MB_FC_READ_REGISTERS || telegram->u8fct == MB_FC_READ_INPUT_REGISTER)
+	{
+		ModbusRegsToValues(telegram->pvValues, telegram->u16reg, telegram->u16CoilsNo,
+				(mb_type_t)telegram->u8Type, (mb_wordorder_t)telegram->u8Order);
+	}
+	else if (telegram->u8fct == MB_FC_READ_WRITE_MULTIPLE_REGISTERS)
+	{
+		ModbusRegsToValues(telegram->pvValues, telegram->u16ReadReg, telegram->u16ReadNo,
+				(mb_type_t)telegram->u8Type, (mb_wordorder_t)telegram->u8Order);
+	}
+}
+#endif
+
+/**
+ * @brief
+ * Writes the query of telegram to u8dst, without CRC
+ *
+ * @return bytes written
+ * @ingroup loop
+ */
+static uint16_t buildPdu(uint8_t *u8dst, const modbus_t *telegram)
+{
+	uint8_t u8bytesno;
+	uint16_t u16size = 0;
+
+	// telegram header
+	u8dst[ ID ]         = telegram->u8id;
+	u8dst[ FUNC ]       = telegram->u8fct;
+	u8dst[ ADD_HI ]     = highByte(telegram->u16RegAdd );
+	u8dst[ ADD_LO ]     = lowByte( telegram->u16RegAdd );
+	if (telegram->u8fct == MB_FC_READ_WRITE_MULTIPLE_REGISTERS)
+	{
+		// FC23 starts with the read block
+		u8dst[ ADD_HI ]     = highByte(telegram->u16ReadAdd );
+		u8dst[ ADD_LO ]     = lowByte( telegram->u16ReadAdd );
+	}
+
+	switch( telegram->u8fct )
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+	    u8dst[ NB_HI ]      = highByte(telegram->u16CoilsNo );
+	    u8dst[ NB_LO ]      = lowByte( telegram->u16CoilsNo );
+	    u16size = 6;
+	    break;
+	case MB_FC_WRITE_COIL:
+	    u8dst[ NB_HI ]      = (( telegram->u16reg[0]> 0) ? 0xff : 0);
+	    u8dst[ NB_LO ]      = 0;
+	    u16size = 6;
+	    break;
+	case MB_FC_WRITE_REGISTER:
+	case MB_FC_DIAGNOSTICS: // u16RegAdd is the sub-function, u16reg[0] its data field
+	    u8dst[ NB_HI ]      = highByte( telegram->u16reg[0]);
+	    u8dst[ NB_LO ]      = lowByte( telegram->u16reg[0]);
+	    u16size = 6;
+	    break;
+	case MB_FC_WRITE_MULTIPLE_COILS:
+	    // coil i is bit i%16 of u16reg[i/16], as FC1 stores it, the frame packs it LSB first
+	    u8bytesno = (uint8_t)((telegram->u16CoilsNo + 7) / 8);
+
+	    u8dst[ NB_HI ]      = highByte(telegram->u16CoilsNo );
+	    u8dst[ NB_LO ]      = lowByte( telegram->u16CoilsNo );
+	    u8dst[ BYTE_CNT ]    = u8bytesno;
+	    u16size = 7;
+
+	    readCoils(telegram->u16reg, 0, telegram->u16CoilsNo, &u8dst[ u16size ]);
+	    u16size += u8bytesno;
+	    break;
+
+	case MB_FC_WRITE_MULTIPLE_REGISTERS:
+	    u8dst[ NB_HI ]      = highByte(telegram->u16CoilsNo );
+	    u8dst[ NB_LO ]      = lowByte( telegram->u16CoilsNo );
+	    u8dst[ BYTE_CNT ]    = (uint8_t) ( telegram->u16CoilsNo * 2 );
+	    u16size = 7;
+
+	    putRegisters(&u8dst[ u16size ], telegram->u16reg, telegram->u16CoilsNo);
+	    u16size += telegram->u16CoilsNo * 2;
+	    break;
+
+	case MB_FC_MASK_WRITE_REGISTER:
+	    u8dst[ AND_HI ]     = highByte( telegram->u16reg[0]);
+	    u8dst[ AND_LO ]     = lowByte( telegram->u16reg[0]);
+	    u8dst[ OR_HI ]      = highByte( telegram->u16reg[1]);
+	    u8dst[ OR_LO ]      = lowByte( telegram->u16reg[1]);
+	    u16size = 8;
+	    break;
+
+	case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+	    u8dst[ NB_HI ]       = highByte(telegram->u16ReadNo );
+	    u8dst[ NB_LO ]       = lowByte( telegram->u16ReadNo );
+	    u8dst[ WR_ADD_HI ]   = highByte(telegram->u16RegAdd );
+	    u8dst[ WR_ADD_LO ]   = lowByte( telegram->u16RegAdd );
+	    u8dst[ WR_NB_HI ]    = highByte(telegram->u16CoilsNo );
+	    u8dst[ WR_NB_LO ]    = lowByte( telegram->u16CoilsNo );
+	    u8dst[ WR_BYTE_CNT ] = (uint8_t) ( telegram->u16CoilsNo * 2 );
+	    u16size = WR_BYTE_CNT + 1;
+
+	    putRegisters(&u8dst[ u16size ], telegram->u16reg, telegram->u16CoilsNo);
+	    u16size += telegram->u16CoilsNo * 2;
+	    break;
+
+	case MB_FC_READ_FILE_RECORD:
+	case MB_FC_WRITE_FILE_RECORD:
+	    u16size = 3;
+	    for (uint16_t i = 0; i < telegram->u16CoilsNo; i++)
+	    {
+	        const modbusFileRec_t *xRec = &telegram->xRecords[ i ];
+	        uint8_t *u8sub = &u8dst[ u16size ];
+
+	        u8sub[ REC_REF ]    = MB_FILE_REF_TYPE;
+	        u8sub[ REC_FILE_HI ] = highByte( xRec->u16File );
+	        u8sub[ REC_FILE_LO ] = lowByte( xRec->u16File );
+	        u8sub[ REC_NO_HI ]  = highByte( xRec->u16Record );
+	        u8sub[ REC_NO_LO ]  = lowByte( xRec->u16Record );
+	        u8sub[ REC_LEN_HI ] = highByte( xRec->u16Length );
+	        u8sub[ REC_LEN_LO ] = lowByte( xRec->u16Length );
+	        u16size += REC_DATA;
+	        if (telegram->u8fct == MB_FC_WRITE_FILE_RECORD)
+	        {
+	            putRegisters(&u8sub[ REC_DATA ], xRec->u16regs, xRec->u16Length);
+	            u16size += xRec->u16Length * 2;
+	        }
+	    }
+	    u8dst[ 2 ] = (uint8_t)(u16size - 3);
+	    break;
+
+	case MB_FC_READ_FIFO_QUEUE:
+	    u16size = 4; // the FIFO pointer address only
+	    break;
+
+	case MB_FC_ENCAPSULATED: // u16RegAdd is the read device id code and the object id
+	    u8dst[ 2 ]          = MB_MEI_DEVICE_ID;
+	    u8dst[ 3 ]          = highByte( telegram->u16RegAdd );
+	    u8dst[ 4 ]          = lowByte( telegram->u16RegAdd );
+	    u16size = 5;
+	    break;
+
+#if MB_ENABLE_FC_RANGES == 1
+	case MB_FC_READ_RANGES: // u16RegAdd is the function code of the table
+	    u8dst[ RNG_TABLE ]    = lowByte( telegram->u16RegAdd );
+	    u8dst[ RNG_BYTE_CNT ] = (uint8_t)(telegram->u16CoilsNo * MB_RANGE_SIZE);
+	    u16size = RNG_FIRST;
+	    for (uint16_t i = 0; i < telegram->u16CoilsNo; i++)
+	    {
+	        const modbusRange_t *xRange = &telegram->xRanges[ i ];
+
+	        u8dst[ u16size++ ] = highByte( xRange->u16Add );
+	        u8dst[ u16size++ ] = lowByte( xRange->u16Add );
+	        u8dst[ u16size++ ] = highByte( xRange->u16Count );
+	        u8dst[ u16size++ ] = lowByte( xRange->u16Count );
+	    }
+	    break;
+#endif
+#if MB_ENABLE_FC_DELTA == 1
+	case MB_FC_READ_DELTA:
+	    break; // only built by buildDeltaPdu() for a cached range, SendQuery() refuses the telegram
+#endif
+	}
+	return u16size;
+}
+
+/**
+ * @brief
+ * Checks the quantity of a FC15, FC16 or FC23 telegram against the limits of the
+ * specification, whose byte counts fit their 8 bit field, and against MAX_BUFFER
+ *
+ * @return false if the query cannot be sent
+ * @ingroup loop
+ */
+static bool checkWriteQuery(const modbus_t *telegram)
+{
+	switch (telegram->u8fct)
+	{
+	case MB_FC_WRITE_MULTIPLE_COILS:
+		return telegram->u16CoilsNo >= 1 && telegram->u16CoilsNo <= 0x7B0 &&
+				7 + (telegram->u16CoilsNo + 7) / 8 + 2 <= MAX_BUFFER;
+	case MB_FC_WRITE_MULTIPLE_REGISTERS:
+		return telegram->u16CoilsNo >= 1 && telegram->u16CoilsNo <= 0x7B &&
+				7 + 2 * telegram->u16CoilsNo + 2 <= MAX_BUFFER;
+	case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+		return telegram->u16CoilsNo >= 1 && telegram->u16CoilsNo <= 0x79 &&
+				telegram->u16ReadNo >= 1 && telegram->u16ReadNo <= 0x7D &&
+				WR_BYTE_CNT + 1 + 2 * telegram->u16CoilsNo + 2 <= MAX_BUFFER &&
+				3 + 2 * telegram->u16ReadNo + 2 <= MAX_BUFFER;
+	default:
+		return true;
+	}
+}
+
+#if MB_ENABLE_FC_RANGES == 1
+/**
+ * @brief
+ * Checks the table and the ranges of a MB_FC_READ_RANGES telegram: the request and
+ * the answer, of 125 registers at most as an FC3 one, fit MAX_BUFFER and the
+ * slave builds the answer in a buffer of the same size
+ *
+ * @return false if the query cannot be sent
+ * @ingroup loop
+ */
+static bool checkRangesQuery(const modbus_t *telegram)
+{
+	uint32_t u32Regs = 0;
+
+	if (telegram->u16RegAdd != MB_FC_READ_REGISTERS && telegram->u16RegAdd != MB_FC_READ_INPUT_REGISTER) return false;
+	if (telegram->u16CoilsNo == 0 || telegram->xRanges == NULL) return false;
+	if (telegram->u16CoilsNo * MB_RANGE_SIZE > 0xFF) return false;
+
+	for (uint16_t i = 0; i < telegram->u16CoilsNo; i++)
+	{
+		if (telegram->xRanges[ i ].u16Count == 0) return false;
+		u32Regs += telegram->xRanges[ i ].u16Count;
+	}
+
+	return u32Regs <= MB_MERGE_REGS && 3 + u32Regs * 2 + 2 + telegram->u16CoilsNo * MB_RANGE_SIZE <= MAX_BUFFER;
+}
+#endif
+
+/**
+ * @brief
+ * Checks that the sub-requests of a FC20 or FC21 telegram, and the answer of
+ * FC20, fit MAX_BUFFER and the limits of the specification
+ *
+ * @return false if the query cannot be sent
+ * @ingroup loop
+ */
+static bool checkFileQuery(modbus_t *telegram)
+{
+	uint32_t u32Query = 0, u32Answer = 0;
+
+	if (telegram->u16CoilsNo == 0 || telegram->xRecords == NULL) return false;
+
+	for (uint16_t i = 0; i < telegram->u16CoilsNo; i++)
+	{
+		const modbusFileRec_t *xRec = &telegram->xRecords[ i ];
+
+		if (xRec->u16File == 0 || xRec->u16Length == 0 ||
+			(uint32_t)xRec->u16Record + xRec->u16Length > MB_FILE_RECORDS) return false;
+		u32Query += REC_DATA;
+		if (telegram->u8fct == MB_FC_WRITE_FILE_RECORD) u32Query += xRec->u16Length * 2UL;
+		u32Answer += 2 + xRec->u16Length * 2UL;
+	}
+
+	// byte counts of the specification, then ID, function, byte count and CRC of the frames
+	if (telegram->u8fct == MB_FC_READ_FILE_RECORD)
+	{
+		return u32Query <= 0xF5 && u32Answer <= 0xF5 && u32Answer + 5 <= MAX_BUFFER;
+	}
+	return u32Query <= 0xFB && u32Query + 5 <= MAX_BUFFER;
+}
+
+
+/**
+ * @brief
+ * Sends the query of telegram
+ *
+ * @return true if it is on the line, false if SendQuery() refused it (i8lastError)
+ * @ingroup loop
+ */
+static bool transmitQuery(modbusHandler_t *modH, modbus_t *telegram)
+{
+#if ENABLE_MB_ARBITRATION == 1
+	waitBusSlot(modH);
+#endif
+	if (SendQuery(modH, telegram) != 0) return false;
+#if ENABLE_MB_ARBITRATION == 1
+	modH->u16ArbMark = modH->u16RxFrames;
+#endif
+#if ENABLE_MB_WATCHDOG == 1
+	modH->xWatchStart = xTaskGetTickCount();
+#endif
+#if ENABLE_MB_ADAPTIVE_TIMEOUT == 1 || ENABLE_MB_STATS == 1 || ENABLE_MB_NODE_STATS == 1
+	modH->xQuerySent = xTaskGetTickCount();
+#endif
+#if ENABLE_MB_NODE_STATS == 1
+	modbusNodeStats_t *xNode = getNodeStats(modH, telegram->u8id);
+	if (xNode != NULL) xNode->u32Queries++;
+#endif
+#if ENABLE_MB_POLL_ADAPT == 1
+	addWireTime(modH, modH->u16BufferSize, 0);
+#endif
+	return true;
+}
+
+#if ENABLE_MB_ARBITRATION == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Waits for the window of the master on a bus shared with other masters. A master may
+ * send once the line was idle for u32ArbIdleUs plus u8ArbSlot slots since the last frame,
+ * so the masters never start together, the one with the lowest slot goes first. A master
+ * whose own transaction was the last one on the bus waits u8ArbSlots more slots, which
+ * hands the bus to the others in turn. The USART BUSY flag tells a frame in progress,
+ * the end of each frame is stamped by traceFrame() from the T35 or receiver timeout
+ *
+ * @ingroup loop
+ */
+static void waitBusSlot(modbusHandler_t *modH)
+{
+	uint32_t u32Cycles = SystemCoreClock / 1000000;
+	uint32_t u32TickUs = 1000000 / configTICK_RATE_HZ;
+	uint32_t u32Need, u32Idle;
+
+	if (modH->u8ArbSlots == 0 || (modH->xTransport->u8Flags & MB_TP_UART) == 0) return;
+
+	for (;;)
+	{
+		u32Need = modH->u32ArbIdleUs + modH->u8ArbSlot * modH->u32ArbSlotUs;
+		if ((uint16_t)(modH->u16RxFrames - modH->u16ArbMark) <= 1)
+		{
+			u32Need += modH->u8ArbSlots * modH->u32ArbSlotUs; // only the answer to this master was heard since its query
+		}
+		u32Idle = (DWT->CYCCNT - modH->u32RxEnd) / u32Cycles;
+
+		if (__HAL_UART_GET_FLAG(modH->port, UART_FLAG_BUSY))
+		{
+			vTaskDelay(1); // a frame is on the line, its end restarts the idle time
+			continue;
+		}
+		if (u32Idle >= u32Need) return;
+		if (u32Need - u32Idle > u32TickUs) vTaskDelay(1); // the last tick is spun for the exact start
+	}
+}
+#endif
+
+#if ENABLE_MB_WATCHDOG == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Ticks left before the query in progress is stuck: its timer should have expired
+ * u16QueryTimeOut ticks after the transmission, MB_WATCHDOG_TICKS later it is lost
+ *
+ * @return 0 once the watchdog expired
+ * @ingroup loop
+ */
+static TickType_t watchdogLeft(modbusHandler_t *modH)
+{
+	TickType_t xSpent = xTaskGetTickCount() - modH->xWatchStart;
+	TickType_t xLimit = (TickType_t)modH->u16QueryTimeOut + MB_WATCHDOG_TICKS;
+
+	return (xSpent >= xLimit) ? 0 : xLimit - xSpent;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * The query in progress got neither its answer nor its timeout: the timer is
+ * stopped and the line reset, the caller then handles the query as timed out
+ *
+ * @ingroup loop
+ */
+static void expireQuery(modbusHandler_t *modH)
+{
+	stopTimeout(modH);
+	recoverLine(modH);
+}
+#endif
+
+/**
+ * @brief
+ * Starts a new telegram of the master: merges it, skips offline slaves and sends it
+ *
+ * @return true if the master waits for its answer, false if its result was already reported
+ * @ingroup loop
+ */
+static bool startQuery(modbusHandler_t *modH, modbus_t *telegram)
+{
+#if ENABLE_MB_CACHE == 1
+	// a fresh cached range costs no bus time
+	if (lookupCache(modH, telegram))
+	{
+		modH->i8lastError = 0;
+		notifyQueryResult(modH, telegram, ERR_OK_QUERY);
+		return false;
+	}
+#endif
+
+#if ENABLE_MB_MERGE == 1
+	// merging rewrites telegram, only a pooled copy may be merged
+	if (modH->i8TelegramSlot >= 0 && telegram == &modH->xTelegramPool[modH->i8TelegramSlot]) mergeTelegrams(modH, telegram);
+#endif
+
+	modH->u8Attempts = 0;
+#if ENABLE_MB_BACKOFF == 1
+	// an offline slave costs no bus time until its next probe
+	if (telegram->u8id != 0 && !isSlaveOnline(modH, telegram))
+	{
+		modH->i8lastError = ERR_SLAVE_OFFLINE;
+		MB_COUNT_ERR(modH, ERR_SLAVE_OFFLINE);
+		notifyQueryResult(modH, telegram, modH->i8lastError);
+		return false;
+	}
+#endif
+
+	modH->u16QueryTimeOut = getQueryTimeOut(modH, telegram);
+
+	if (transmitQuery(modH, telegram)) return true;
+
+	notifyQueryResult(modH, telegram, modH->i8lastError); // nothing was sent, no answer to wait for
+	return false;
+}
+
+/**
+ * @brief
+ * Handles the timeout of the query in progress.
+ * This is the case for implementations with only USART support:
+ * the query is sent again while the telegram has retries left
+ *
+ * @return true if it was sent again, false if its result was reported
+ * @ingroup loop
+ */
+static bool retryQuery(modbusHandler_t *modH, modbus_t *telegram)
+{
+	modH->i8state = COM_IDLE;
+
+#if ENABLE_MB_BROADCAST == 1
+	if (telegram->u8id == 0)
+	{
+		// no answer to a broadcast, the turnaround delay is over
+		modH->i8lastError = 0;
+		notifyQueryResult(modH, telegram, ERR_OK_QUERY);
+		return false;
+	}
+#endif
+	modH->u16errCnt++;
+	MB_COUNT_ERR(modH, ERR_TIME_OUT); // every attempt without answer
+#if ENABLE_MB_POLL_ADAPT == 1
+	addWireTime(modH, 0, (uint32_t)(((uint64_t)modH->u16QueryTimeOut * 1000000UL) / configTICK_RATE_HZ)); // the line waited for it
+#endif
+#if ENABLE_MB_NODE_STATS == 1
+	modbusNodeStats_t *xNode = getNodeStats(modH, telegram->u8id);
+	if (xNode != NULL)
+	{
+		xNode->u32Timeouts++;
+		if (xNode->u8Lost < 0xFF) xNode->u8Lost++;
+	}
+#endif
+
+	if (modH->u8Attempts++ < telegram->u8retries)
+	{
+		if (transmitQuery(modH, telegram)) return true;
+
+		notifyQueryResult(modH, telegram, modH->i8lastError); // nothing was sent, no answer to wait for
+		return false;
+	}
+
+	// notify the task the request timeout
+#if ENABLE_MB_BACKOFF == 1
+	updateSlaveHealth(modH, telegram->u8id, true);
+#endif
+	modH->i8lastError = ERR_TIME_OUT;
+	notifyQueryResult(modH, telegram, modH->i8lastError);
+	return false;
+}
+
+/**
+ * @brief
+ * Receives and checks the answer of the query in progress and reports its result.
+ * A frame that does not match the query is dropped, the query keeps waiting
+ *
+ * @return true if the answer is still awaited, its timeout running
+ * @ingroup loop
+ */
+static bool finishQuery(modbusHandler_t *modH, modbus_t *telegram)
+{
+      modH->xTransport->recvFrame(modH);
+
+      if (!matchAnswer(modH, telegram))
+      {
+#if ENABLE_MB_WIRE_STATS == 1
+    	  countWireRx(modH, modH->u16BufferSize, false);
+#endif
+    	  dropStrayFrame(modH);
+    	  return true;
+      }
+#if ENABLE_MB_WIRE_STATS == 1
+      countWireRx(modH, modH->u16BufferSize, true);
+#endif
+
+      modH->i8lastError = 0;
+#if ENABLE_MB_BACKOFF == 1
+      updateSlaveHealth(modH, telegram->u8id, false);
+#endif
+#if ENABLE_MB_POLL_ADAPT == 1
+      addWireTime(modH, modH->u16BufferSize, 0);
+#endif
+
+#if ENABLE_MB_ADAPTIVE_TIMEOUT == 1
+      updateAnswerTime(modH, telegram->u8id, xTaskGetTickCount() - modH->xQuerySent);
+#endif
+#if ENABLE_MB_STATS == 1
+      updateHist(&getSlave(modH, telegram->u8id)->xRoundTrip, xTaskGetTickCount() - modH->xQuerySent);
+#endif
+#if ENABLE_MB_NODE_STATS == 1
+      modbusNodeStats_t *xNode = getNodeStats(modH, telegram->u8id);
+      if (xNode != NULL) updateNodeTime(xNode, xTaskGetTickCount() - modH->xQuerySent);
+#endif
+
+	  stopTimeout(modH); // cancel timeout timer
+
+	  processAnswer(modH, telegram, &modH->xTransaction);
+	  return false;
+}
+
+/**
+ * @brief
+ * Checks the answer in u8Buffer, stores it in the memory image of telegram and
+ * reports its result
+ *
+ * @ingroup loop
+ */
+static void processAnswer(modbusHandler_t *modH, modbus_t *telegram, modbusTransaction_t *xTrans)
+{
+	  // validate message: id, CRC, FCT, exception
+	  int8_t u8exception = validateAnswer(modH, telegram);
+#if ENABLE_MB_NODE_STATS == 1
+	  if (xTrans == &modH->xTransaction && (u8exception == ERR_BAD_CRC || u8exception == ERR_EXCEPTION))
+	  {
+		  modbusNodeStats_t *xNode = getNodeStats(modH, telegram->u8id);
+		  if (xNode != NULL && u8exception == ERR_BAD_CRC) xNode->u32CrcErrors++;
+		  else if (xNode != NULL) xNode->u32Exceptions++;
+	  }
+#endif
+	  if (u8exception != 0)
+	  {
+		 modH->i8state = COM_IDLE;
+         modH->i8lastError = u8exception;
+		 notifyQueryResult(modH, telegram, modH->i8lastError);
+	     return;
+	  }
+
+	  modH->i8lastError = u8exception;
+
+#if ENABLE_MB_DEFERRED_DECODE == 1
+	  // the answers of the serial query in progress may be decoded while the next query is sent
+	  if (xTrans == &modH->xTransaction && deferAnswer(modH, telegram)) return;
+#endif
+
+	  xSemaphoreTake(modH->ModBusSphrHandle , portMAX_DELAY); //before processing the message get the semaphore
+	  // process answer
+	  switch( modH->u8Buffer[ FUNC ] )
+	  {
+	  case MB_FC_READ_COILS:
+	  case MB_FC_READ_DISCRETE_INPUT:
+	      //call get_FC1 to transfer the incoming message to u16regs buffer
+	      get_FC1(modH, xTrans);
+	      break;
+	  case MB_FC_READ_INPUT_REGISTER:
+	  case MB_FC_READ_REGISTERS :
+	  case MB_FC_READ_WRITE_MULTIPLE_REGISTERS :
+	      // call get_FC3 to transfer the incoming message to u16regs buffer
+	      get_FC3(modH, telegram, xTrans);
+	      break;
+	  case MB_FC_WRITE_COIL:
+	  case MB_FC_WRITE_REGISTER :
+	  case MB_FC_WRITE_MULTIPLE_COILS:
+	  case MB_FC_WRITE_MULTIPLE_REGISTERS :
+	  case MB_FC_MASK_WRITE_REGISTER :
+	      // nothing to do
+	      break;
+	  case MB_FC_DIAGNOSTICS:
+	      // the echoed data or the counter of the sub-function
+	      if (xTrans->u16Regs != NULL) xTrans->u16Regs[ 0 ] = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]);
+	      break;
+	  case MB_FC_READ_FILE_RECORD:
+	      get_FC20(modH, telegram);
+	      break;
+	  case MB_FC_READ_FIFO_QUEUE:
+	      get_FC24(modH, telegram);
+	      break;
+	  case MB_FC_ENCAPSULATED:
+	      get_FC43(modH, telegram);
+	      break;
+#if MB_ENABLE_FC_RANGES == 1
+	  case MB_FC_READ_RANGES:
+	      get_FCRanges(modH, telegram);
+	      break;
+#endif
+#if MB_MASTER_DELTA
+	  case MB_FC_READ_DELTA:
+	      get_FCDelta(modH, xTrans);
+	      break;
+#endif
+	  case MB_FC_WRITE_FILE_RECORD:
+	      // the answer echoes the request
+	      break;
+	  default:
+	      break;
+	  }
+#if ENABLE_MB_CACHE == 1
+	  updateCache(modH, telegram);
+#endif
+	  modH->i8state = COM_IDLE;
+
+	  if (modH->i8lastError ==0) // no error the error_OK, we need to use a different value than 0 to detect the timeout
+	  {
+		  xSemaphoreGive(modH->ModBusSphrHandle); //Release the semaphore
+		  notifyQueryResult(modH, telegram, ERR_OK_QUERY);
+	  }
+}
+
+#if ENABLE_MB_DEFERRED_DECODE == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Hands the checked answer in u8Buffer over to the decode task: its data is copied
+ * to the next slot of xDecode and the query is over, the master task may send the
+ * next one. The answers whose decoding uses the state of the handler, a merged,
+ * report by exception or cached query or the other function codes, are declined,
+ * and so are all of them while the ring is full
+ *
+ * @return true if the decode task reports the result
+ * @ingroup loop
+ */
+static bool deferAnswer(modbusHandler_t *modH, modbus_t *telegram)
+{
+	modbusDecode_t *xJob;
+	uint8_t u8fct = modH->u8Buffer[ FUNC ];
+	uint8_t u8Bytes = 0;
+
+	switch (u8fct)
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+	case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+		u8Bytes = modH->u8Buffer[ 2 ];
+		if (u8Bytes > MB_DECODE_BYTES) return false;
+		break;
+	case MB_FC_WRITE_COIL:
+	case MB_FC_WRITE_REGISTER:
+	case MB_FC_WRITE_MULTIPLE_COILS:
+	case MB_FC_WRITE_MULTIPLE_REGISTERS:
+	case MB_FC_MASK_WRITE_REGISTER:
+		break; // nothing to decode, the result keeps its place after the reads handed over
+	default:
+		return false;
+	}
+#if ENABLE_MB_MERGE == 1
+	if (modH->u8Merged > 0) return false;
+#endif
+#if ENABLE_MB_RBE == 1
+	if (modH->xPollCurrent != NULL && modH->xPollCurrent->xOnChange != NULL) return false;
+#endif
+#if ENABLE_MB_CACHE == 1
+	if (modH->u8CacheCount > 0) return false; // updateCache() shares the ranges with lookupCache()
+#endif
+	if ((uint8_t)(modH->u8DecodeHead - modH->u8DecodeTail) >= MB_DECODE_DEPTH) return false;
+
+	xJob = &modH->xDecode[ modH->u8DecodeHead % MB_DECODE_DEPTH ];
+	xJob->telegram = telegram;
+	xJob->xTrans = modH->xTransaction;
+	xJob->u8fct = u8fct;
+	xJob->u8Bytes = u8Bytes;
+	memcpy(xJob->u8Data, &modH->u8Buffer[ 3 ], u8Bytes);
+	xJob->i8Slot = detachTelegram(modH, telegram); // the entry stays taken until the result is reported
+
+	// the answer came in time, the poll is over
+	closePoll(modH, ERR_OK_QUERY);
+	modH->i8state = COM_IDLE;
+
+	taskENTER_CRITICAL();
+	modH->u8DecodeHead++;
+	taskEXIT_CRITICAL();
+	xTaskNotifyGive((TaskHandle_t)modH->xDecodeTask);
+	return true;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Stores the data of an answer handed over by deferAnswer() as processAnswer()
+ * does and reports its result
+ *
+ * @ingroup loop
+ */
+static void decodeAnswer(modbusHandler_t *modH, modbusDecode_t *xJob)
+{
+	modbus_t *telegram = xJob->telegram;
+
+	xSemaphoreTake(modH->ModBusSphrHandle, portMAX_DELAY);
+	switch (xJob->u8fct)
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+		writeCoils(xJob->xTrans.u16Bits, 0, xJob->u8Bytes * 8, xJob->u8Data);
+		break;
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+	case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+#if ENABLE_MB_GATHER == 1
+		if (telegram->xGather != NULL)
+		{
+			gatherRegisters(telegram, xJob->u8Data, xJob->u8Bytes / 2);
+			break;
+		}
+#endif
+		getRegisters(xJob->xTrans.u16Regs, xJob->u8Data, xJob->u8Bytes / 2);
+		break;
+	default:
+		break;
+	}
+	xSemaphoreGive(modH->ModBusSphrHandle);
+
+	deliverResult(modH, telegram, ERR_OK_QUERY, xJob->i8Slot);
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Task decoding the answers handed over by the master task, in their order. An
+ * answer leaves the ring once its result is reported
+ *
+ * @ingroup loop
+ */
+static void StartTaskModbusDecode(void *argument)
+{
+	modbusHandler_t *modH = (modbusHandler_t *)argument;
+
+	for(;;)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		while (modH->u8DecodeTail != modH->u8DecodeHead)
+		{
+			decodeAnswer(modH, &modH->xDecode[ modH->u8DecodeTail % MB_DECODE_DEPTH ]);
+			taskENTER_CRITICAL();
+			modH->u8DecodeTail++;
+			taskEXIT_CRITICAL();
+		}
+	}
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Waits until the decode task reported the answers handed over to it, before the
+ * master task reports a result itself. The decode task runs below the master task
+ *
+ * @ingroup loop
+ */
+static void waitDecoded(modbusHandler_t *modH)
+{
+	while (modH->u8DecodeTail != modH->u8DecodeHead)
+	{
+		vTaskDelay(1);
+	}
+}
+#endif
+
+
+void StartTaskModbusMaster(void *argument)
+{
+
+  modbusHandler_t *modH =  (modbusHandler_t *)argument;
+  uint32_t ulNotificationValue;
+  modbus_t *telegram;
+  TickType_t xWait;
+
+
+  for(;;)
+  {
+	  if (modH->xTransport->serve != NULL)
+	  {
+		  modH->xTransport->serve(modH);
+		  continue;
+	  }
+#if ENABLE_MB_TDMA == 1
+	  if (modH->u8SchedCount != 0)
+	  {
+		  serveSchedule(modH); // the timer sends the queries, the queue waits
+		  continue;
+	  }
+#endif
+
+	  /*Wait for a queued telegram or for the next poll of the table */
+	  xWait = portMAX_DELAY;
+	  if (!getNextTelegram(modH, &telegram, &xWait)) continue;
+	  if (!startQuery(modH, telegram)) continue;
+
+	  /* Block indefinitely until the answer arrives or the query timeouts, stray frames are dropped */
+	  do
+	  {
+#if ENABLE_MB_WATCHDOG == 1
+		  // the RX callbacks notify 0, the timeout ERR_TIME_OUT; no notification in time is a lost event
+		  if (xTaskNotifyWait(0, UINT32_MAX, &ulNotificationValue, watchdogLeft(modH)) != pdTRUE)
+		  {
+			  expireQuery(modH);
+			  ulNotificationValue = (uint32_t)ERR_TIME_OUT;
+		  }
+#else
+		  ulNotificationValue = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+	  } while (ulNotificationValue ? retryQuery(modH, telegram) : finishQuery(modH, telegram));
+	 }
+
+}
+#endif
+
+#if ENABLE_MB_MONITOR == 1
+/**
+ * @brief
+ * *** Only Modbus Monitor ***
+ * Task of an MB_MONITOR handler, it never transmits
+ *
+ * @ingroup loop
+ */
+void StartTaskModbusMonitor(void *argument)
+{
+  modbusHandler_t *modH =  (modbusHandler_t *)argument;
+
+  for(;;)
+  {
+	  modH->xTransport->wait(modH); /* Block until a frame was captured */
+	  serveMonitor(modH);
+  }
+}
+
+/**
+ * @brief
+ * Takes all the frames captured by the circular DMA of a monitor
+ *
+ * @ingroup loop
+ */
+static void serveMonitor(modbusHandler_t *modH)
+{
+	int16_t i16Size;
+
+	while ((i16Size = modH->xTransport->recvFrame(modH)) != 0)
+	{
+		if (i16Size < 0)
+		{
+			taskENTER_CRITICAL();
+			modH->xMonitor.u32Lost++; // full descriptor queue or frame longer than u8Buffer
+			taskEXIT_CRITICAL();
+			continue;
+		}
+		monitorFrame(modH);
+	}
+}
+
+/**
+ * @brief
+ * *** Only Modbus Monitor ***
+ * Entry of a slave in the statistics of a monitor, the oldest one is reused for a new slave
+ *
+ * @ingroup loop
+ */
+static modbusMonitorSlave_t *getMonSlave(modbusHandler_t *modH, uint8_t u8id)
+{
+	modbusMonitorSlave_t *xSlave;
+
+	for (uint8_t i = 0; i < MB_MONITOR_SLAVES; i++)
+	{
+		if (modH->xMonitor.xSlaves[i].u8id == u8id) return &modH->xMonitor.xSlaves[i];
+	}
+	for (uint8_t i = 0; i < MB_MONITOR_SLAVES; i++)
+	{
+		if (modH->xMonitor.xSlaves[i].u8id == 0)
+		{
+			xSlave = &modH->xMonitor.xSlaves[i];
+			xSlave->u8id = u8id;
+			return xSlave;
+		}
+	}
+	xSlave = &modH->xMonitor.xSlaves[modH->u8MonNext];
+	modH->u8MonNext = (modH->u8MonNext + 1) % MB_MONITOR_SLAVES;
+	memset(xSlave, 0, sizeof(modbusMonitorSlave_t));
+	xSlave->u8id = u8id;
+	return xSlave;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Monitor ***
+ * Accounts the frame in u8Buffer. Its first and last byte are placed in time from the
+ * idle event ending it, one character time per byte. A valid frame answers the pending
+ * request when it has the same slave ID and function code, with or without the exception
+ * bit, and starts within u16timeOut of the handler, 0 for no limit. Any other frame is a new request
+ *
+ * @ingroup loop
+ */
+static void monitorFrame(modbusHandler_t *modH)
+{
+	modbusMonitor_t *xMon = &modH->xMonitor;
+	modbusMonitorSlave_t *xSlave;
+	uint32_t u32Cycles = SystemCoreClock / 1000000UL;
+	uint32_t u32End = modH->u32MonEnd;
+	uint32_t u32Start = u32End - modH->u16BufferSize * modH->u32MonChar;
+	uint32_t u32TimeOut = modH->u16timeOut ? (uint32_t)modH->u16timeOut * (1000000UL / configTICK_RATE_HZ) : UINT32_MAX;
+	uint8_t u8id = modH->u8Buffer[ ID ];
+	uint8_t u8fct = modH->u8Buffer[ FUNC ];
+	bool xValid = modH->u16BufferSize >= 4 && checkCRC(modH);
+
+	taskENTER_CRITICAL(); // ModbusGetMonitor() copies consistent statistics
+	if (xMon->u32Frames > 0)
+	{
+		uint32_t u32Gap = (u32Start - modH->u32MonLast) / u32Cycles;
+
+		updateHist(&xMon->xGap, u32Gap);
+		if (u32Gap < modH->u32T35us) xMon->u32ShortGaps++;
+	}
+	xMon->u32Frames++;
+	modH->u32MonLast = u32End;
+
+	if (!xValid)
+	{
+		xMon->u32BadCRC++;
+		if (modH->u16BufferSize > 0 && u8id != 0) getMonSlave(modH, u8id)->u32BadCRC++;
+		if (modH->xMonPending && u8id == modH->u8MonReqId)
+		{
+			modH->xMonPending = false; // the answer was corrupted
+		}
+		taskEXIT_CRITICAL();
+		return;
+	}
+
+	if (modH->xMonPending && u8id == modH->u8MonReqId && (u8fct & 0x7F) == modH->u8MonReqFct &&
+			(u32Start - modH->u32MonReq) / u32Cycles <= u32TimeOut)
+	{
+		xSlave = getMonSlave(modH, u8id);
+		xSlave->u32Answers++;
+		if (u8fct & 0x80) xSlave->u32Exceptions++;
+		updateHist(&xSlave->xLatency, (u32Start - modH->u32MonReq) / u32Cycles);
+		modH->xMonPending = false;
+#if ENABLE_MB_TRACE == 1
+		// the request ends at MB_TS_RX_END, the answer spans MB_TS_TX_START to MB_TS_TX_DONE
+		uint8_t u8Head = (modH->u8TraceHead + 1) % MB_TRACE_DEPTH;
+
+		memset(&modH->xTrace[u8Head], 0, sizeof(modbusTrace_t));
+		modH->xTrace[u8Head].u32Cyc[MB_TS_RX_END] = modH->u32MonReq;
+		modH->xTrace[u8Head].u32Cyc[MB_TS_TX_START] = u32Start;
+		modH->xTrace[u8Head].u32Cyc[MB_TS_TX_DONE] = u32End;
+		modH->u8TraceHead = u8Head;
+#endif
+		taskEXIT_CRITICAL();
+		return;
+	}
+
+	if (modH->xMonPending)
+	{
+		getMonSlave(modH, modH->u8MonReqId)->u32NoAnswer++;
+		modH->xMonPending = false;
+	}
+	if (u8fct & 0x80)
+	{
+		xMon->u32Unpaired++; // an exception is never a request
+	}
+	else if (u8id == 0)
+	{
+		xMon->u32Broadcast++;
+	}
+	else
+	{
+		getMonSlave(modH, u8id)->u32Requests++;
+		modH->xMonPending = true;
+		modH->u8MonReqId = u8id;
+		modH->u8MonReqFct = u8fct;
+		modH->u32MonReq = u32End;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief
+ * *** Only Modbus Monitor ***
+ * Copies the statistics of a monitor at once, the task updates them frame by frame
+ *
+ * @ingroup setup
+ */
+void ModbusGetMonitor(modbusHandler_t * modH, modbusMonitor_t *xMon)
+{
+	taskENTER_CRITICAL();
+	memcpy(xMon, &modH->xMonitor, sizeof(modbusMonitor_t));
+	taskEXIT_CRITICAL();
+}
+#endif
+
+/* an answer of ENABLE_MB_TURNAROUND or a query of ENABLE_MB_PACING waits for its timer slot */
+static inline bool isTurnPending(modbusHandler_t *modH)
+{
+#if ENABLE_MB_TURNAROUND == 1 && ENABLE_MB_TIMER_MUX == 1
+	if (modH->uModbusType == MB_SLAVE) return modH->xTurnPending;
+#endif
+#if ENABLE_MB_PACING == 1 && ENABLE_MB_TIMER_MUX == 1
+	if (modH->uModbusType == MB_MASTER) return modH->xPacePending;
+#endif
+	(void)modH;
+	return false;
+}
+
+#if ENABLE_MB_SHARED_TASK == 1
+/**
+ * @brief
+ * Takes the MB_EV_ events signalled to the handler since the last step
+ *
+ * @ingroup loop
+ */
+static uint8_t takeEvents(modbusHandler_t *modH)
+{
+	uint8_t u8Events;
+
+	taskENTER_CRITICAL();
+	u8Events = modH->u8Events;
+	modH->u8Events = 0;
+	taskEXIT_CRITICAL();
+	return u8Events;
+}
+
+#if ENABLE_MB_EVENT_RING == 1
+/**
+ * @brief
+ * Posts an MB_EV_ event of the handler to the ring of the shared task from an
+ * interrupt or a timer callback. Lock free: the slot is reserved with LDREX/STREX,
+ * and only the first event since the task emptied the ring notifies it, the next
+ * ones of the burst leave *pxHigherPriorityTaskWoken as it is. A full ring falls
+ * back to u8Events of the handler
+ *
+ * @ingroup loop
+ */
+void postModbusEventFromISR(modbusHandler_t *modH, uint8_t u8Event, BaseType_t *pxHigherPriorityTaskWoken)
+{
+	uint32_t u32Slot;
+	uint32_t u32Woken;
+
+	do
+	{
+		u32Slot = __LDREXW((volatile uint32_t *)&u32EvHead);
+		if (u32Slot - u32EvTail >= MB_EVENT_RING)
+		{
+			__CLREX();
+			UBaseType_t uxSaved = taskENTER_CRITICAL_FROM_ISR();
+			modH->u8Events |= u8Event;
+			taskEXIT_CRITICAL_FROM_ISR(uxSaved);
+			vTaskNotifyGiveFromISR((TaskHandle_t)modH->myTaskModbusAHandle, pxHigherPriorityTaskWoken);
+			return;
+		}
+	} while (__STREXW(u32Slot + 1, (volatile uint32_t *)&u32EvHead) != 0);
+
+	u16EvRing[ u32Slot & (MB_EVENT_RING - 1) ] = (uint16_t)((modH->u8Handler << 8) | u8Event);
+
+	do
+	{
+		u32Woken = __LDREXW((volatile uint32_t *)&u32EvWake);
+	} while (__STREXW(1, (volatile uint32_t *)&u32EvWake) != 0);
+	if (u32Woken == 0)
+	{
+		vTaskNotifyGiveFromISR((TaskHandle_t)modH->myTaskModbusAHandle, pxHigherPriorityTaskWoken);
+	}
+}
+
+/**
+ * @brief
+ * Moves the events of the ring to u8Pending, per position in mHandlers. u32EvWake
+ * is cleared first: an event posted from then on notifies the task again, the one
+ * of a slot still reserved included, the drain stops there and takes it next time
+ *
+ * @ingroup loop
+ */
+static void drainEvents(uint8_t *u8Pending)
+{
+	uint32_t u32Tail = u32EvTail;
+
+	u32EvWake = 0;
+	__DMB();
+	while (u32Tail != u32EvHead)
+	{
+		uint16_t u16Entry = u16EvRing[ u32Tail & (MB_EVENT_RING - 1) ];
+
+		if (u16Entry == 0) break; // reserved by an interrupt not yet written
+		u16EvRing[ u32Tail & (MB_EVENT_RING - 1) ] = 0;
+		if ((u16Entry >> 8) < MAX_M_HANDLERS) u8Pending[ u16Entry >> 8 ] |= (uint8_t)u16Entry;
+		u32Tail++;
+	}
+	__DMB();
+	u32EvTail = u32Tail; // the slots are free for the interrupts again
+}
+#endif
+
+#if MB_ENABLE_SLAVE == 1
+/**
+ * @brief
+ * Slave step of the shared task: serves a received request. The answer is sent
+ * from u8Buffer, so a request received during the transmission waits for MB_EV_TX
+ *
+ * @ingroup loop
+ */
+static void stepSlave(modbusHandler_t *modH, uint8_t u8Events)
+{
+	if ((u8Events & MB_EV_RX) == 0) return;
+
+	if (modH->port->gState != HAL_UART_STATE_READY || isTurnPending(modH))
+	{
+		taskENTER_CRITICAL();
+		modH->u8Events |= MB_EV_RX; // the TX callback wakes the task again
+		taskEXIT_CRITICAL();
+		return;
+	}
+
+	MB_TRACE(modH, MB_TS_WAKE);
+	serveRequest(modH);
+	if (modH->xTransport->release != NULL)
+	{
+		modH->xTransport->release(modH);
+	}
+}
+#endif
+
+#if MB_ENABLE_MASTER == 1
+/**
+ * @brief
+ * Master step of the shared task: completes the query in progress on its answer
+ * or timeout, then starts the next telegram without blocking
+ *
+ * @return ticks until the next poll release, portMAX_DELAY if it only waits for events
+ * @ingroup loop
+ */
+static TickType_t stepMaster(modbusHandler_t *modH, uint8_t u8Events)
+{
+	TickType_t xWait = 0;
+
+	if (modH->i8state == COM_WAITING)
+	{
+		bool xWaiting = true;
+
+#if ENABLE_MB_WATCHDOG == 1
+		if ((u8Events & (MB_EV_RX | MB_EV_TIMEOUT)) == 0 && watchdogLeft(modH) == 0)
+		{
+			expireQuery(modH);
+			u8Events |= MB_EV_TIMEOUT;
+		}
+#endif
+		if (u8Events & MB_EV_RX)
+		{
+			xWaiting = finishQuery(modH, modH->xTelegram); // a stray frame leaves the query waiting
+		}
+		if (xWaiting && ((u8Events & MB_EV_TIMEOUT) == 0 || retryQuery(modH, modH->xTelegram)))
+		{
+#if ENABLE_MB_WATCHDOG == 1
+			return watchdogLeft(modH); // the answer or the timeout are still to come
+#else
+			return portMAX_DELAY; // the answer or the timeout are still to come
+#endif
+		}
+	}
+
+	while (getNextTelegram(modH, &modH->xTelegram, &xWait))
+	{
+#if ENABLE_MB_WATCHDOG == 1
+		if (startQuery(modH, modH->xTelegram)) return watchdogLeft(modH);
+#else
+		if (startQuery(modH, modH->xTelegram)) return portMAX_DELAY;
+#endif
+		xWait = 0;
+	}
+	return xWait;
+}
+#endif
+
+/**
+ * @brief
+ * Modbus task of all the handlers in ENABLE_MB_SHARED_TASK mode. The interrupts
+ * and timers signal MB_EV_ events to the handlers and wake it, every wake-up
+ * steps all the handlers once. With ENABLE_MB_EVENT_RING it first takes the
+ * events of the ring, all the ones posted since the previous pass
+ *
+ * @ingroup loop
+ */
+void StartTaskModbus(void *argument)
+{
+  TickType_t xWait;
+#if MB_ENABLE_MASTER == 1
+  TickType_t xNext;
+#endif
+#if ENABLE_MB_EVENT_RING == 1
+  uint8_t u8Pending[MAX_M_HANDLERS];
+#endif
+
+  (void)argument; // one task for all the handlers of mHandlers
+
+  for(;;)
+  {
+	  xWait = portMAX_DELAY;
+#if ENABLE_MB_EVENT_RING == 1
+	  memset(u8Pending, 0, sizeof(u8Pending));
+	  drainEvents(u8Pending);
+#endif
+	  for (uint8_t i = 0; i < numberHandlers; i++)
+	  {
+		  modbusHandler_t *modH = mHandlers[i];
+		  if (modH == NULL) continue; // slot freed by ModbusDeInit()
+#if ENABLE_MB_EVENT_RING == 1
+		  // the tasks and a full ring still signal through u8Events
+		  uint8_t u8Events = u8Pending[i] | ((modH->u8Events != 0) ? takeEvents(modH) : 0);
+#else
+		  uint8_t u8Events = takeEvents(modH);
+#endif
+
+#if ENABLE_USART_DMA == 1
+		  if (recoverRxDMA(modH) && modH->xRxRestart)
+		  {
+			  xWait = 1; // the HAL refused the restart again, retry at the next tick
+		  }
+#endif
+
+#if MB_ENABLE_SLAVE == 1
+		  if (modH->uModbusType == MB_SLAVE)
+		  {
+			  stepSlave(modH, u8Events);
+		  }
+#endif
+#if MB_ENABLE_MASTER == 1
+		  if (modH->uModbusType == MB_MASTER)
+		  {
+			  xNext = stepMaster(modH, u8Events);
+			  if (xNext < xWait) xWait = xNext;
+		  }
+#endif
+#if ENABLE_MB_MONITOR == 1
+		  if (modH->uModbusType == MB_MONITOR && (u8Events & MB_EV_RX))
+		  {
+			  serveMonitor(modH);
+		  }
+#endif
+	  }
+
+	  /* Block until an event of any handler or the next poll release */
+	  ulTaskNotifyTake(pdTRUE, xWait);
+  }
+}
+#endif
+
+
+
+#if MB_SLAVE_FILES
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Files served by FC20 and FC21. A request reads or writes several record blocks
+ * at once, each one within a single file. The files must have different numbers
+ * and stay valid while the slave runs
+ *
+ * @param xFiles files, backed by memory or by their callbacks
+ * @param u8count number of files
+ * @ingroup setup
+ */
+void ModbusSetFiles(modbusHandler_t * modH, const modbusFile_t *xFiles, uint8_t u8count)
+{
+	if (modH->uModbusType != MB_SLAVE)
+	{
+		while(1);// error only a slave serves files
+	}
+
+	for (uint8_t i = 0; i < u8count; i++)
+	{
+		if (xFiles[i].u16File == 0 || xFiles[i].u16Records == 0 || xFiles[i].u16Records > MB_FILE_RECORDS)
+		{
+			while(1);// error a file needs a number and 1 to MB_FILE_RECORDS records
+		}
+	}
+
+	modH->u8FileCount = u8count;
+	modH->xFiles = xFiles;
+}
+
+/**
+ * @brief
+ * File of a sub-request of FC20 or FC21, when its records exist and can be
+ * read (xWrite false) or written (xWrite true)
+ *
+ * @return the file, NULL for an illegal address
+ * @ingroup register
+ */
+static const modbusFile_t *findFile(modbusHandler_t *modH, const uint8_t *u8sub, bool xWrite)
+{
+	uint16_t u16File = word( u8sub[ REC_FILE_HI ], u8sub[ REC_FILE_LO ] );
+	uint32_t u32End = (uint32_t)word( u8sub[ REC_NO_HI ], u8sub[ REC_NO_LO ] ) +
+			word( u8sub[ REC_LEN_HI ], u8sub[ REC_LEN_LO ] );
+
+	if (u8sub[ REC_REF ] != MB_FILE_REF_TYPE) return NULL;
+
+	for (uint8_t i = 0; i < modH->u8FileCount; i++)
+	{
+		const modbusFile_t *xFile = &modH->xFiles[i];
+
+		if (xFile->u16File != u16File) continue;
+		if (u32End > xFile->u16Records) return NULL;
+		if (xFile->u16regs == NULL && (xWrite ? xFile->xWrite : xFile->xRead) == NULL) return NULL;
+		return xFile;
+	}
+	return NULL;
+}
+#endif
+
+#if MB_SLAVE_DEVID
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Identification objects served by FC43/14. The table is usually a static const
+ * one in flash built with MB_DEVID_OBJ(), the answers are copied from it. The
+ * conformity level of the answers follows from the object ids, individual
+ * access is always supported
+ *
+ * @param xObjects objects sorted by u8Id, each one of MB_DEVID_MAX_LEN bytes at most
+ * @param u8count number of objects
+ * @ingroup setup
+ */
+void ModbusSetDeviceId(modbusHandler_t * modH, const modbusDevIdObj_t *xObjects, uint8_t u8count)
+{
+	uint8_t u8Level = MB_DEVID_BASIC;
+
+	if (modH->uModbusType != MB_SLAVE)
+	{
+		while(1);// error only a slave answers the device identification
+	}
+
+	for (uint8_t i = 0; i < u8count; i++)
+	{
+		if (xObjects[i].u8Length > MB_DEVID_MAX_LEN || (i > 0 && xObjects[i].u8Id <= xObjects[i - 1].u8Id))
+		{
+			while(1);// error the objects must be sorted and fit one answer
+		}
+		if (xObjects[i].u8Id > MB_DEVID_REVISION && u8Level < MB_DEVID_REGULAR) u8Level = MB_DEVID_REGULAR;
+		if (xObjects[i].u8Id >= 0x80) u8Level = MB_DEVID_EXTENDED;
+	}
+
+	modH->u8DevIdCount = u8count;
+	modH->u8DevIdConformity = 0x80 | u8Level;
+	modH->xDevId = xObjects;
+}
+#endif
+
+#if ENABLE_MB_LISTEN_ONLY == 1
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Switches the listen only mode of a serial slave, the standby node of a redundant
+ * pair. While listening the slave validates and processes the requests for its ID,
+ * the writes update its tables, but it never transmits, not even an exception.
+ * Switched off, it answers from the next request with its tables up to date.
+ * FC8 sub-function 0x04 also enters the mode and 0x01 leaves it
+ *
+ * @ingroup setup
+ */
+void ModbusSetListenOnly(modbusHandler_t * modH, bool xListen)
+{
+	if (modH->uModbusType != MB_SLAVE)
+	{
+		while(1);// error only a slave listens
+	}
+
+	modH->xListenOnly = xListen;
+}
+#endif
+
+#if MB_SLAVE_FIFOS
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * FIFO queues served by FC24, each one at its own FIFO pointer address. The
+ * queues start empty and must stay valid while the slave runs
+ *
+ * @param xFifos queues with u16Address, u16Data and u16Size set
+ * @param u8count number of queues
+ * @ingroup setup
+ */
+void ModbusSetFifos(modbusHandler_t * modH, modbusFifo_t *xFifos, uint8_t u8count)
+{
+	if (modH->uModbusType != MB_SLAVE)
+	{
+		while(1);// error only a slave serves FIFO queues
+	}
+
+	for (uint8_t i = 0; i < u8count; i++)
+	{
+		if (xFifos[i].u16Data == NULL || xFifos[i].u16Size == 0 || (xFifos[i].u16Size & (xFifos[i].u16Size - 1)) != 0)
+		{
+			while(1);// error a queue needs storage of a power of two entries
+		}
+		xFifos[i].u16Head = xFifos[i].u16Tail = 0;
+		xFifos[i].u32Dropped = 0;
+	}
+
+	modH->u8FifoCount = u8count;
+	modH->xFifos = xFifos;
+}
+
+/**
+ * @brief
+ * Adds an entry to a FIFO queue of FC24. It takes no lock, the entry is written
+ * before the head that publishes it, so the slave task only reads complete
+ * entries. It must be the only producer of the queue
+ *
+ * @return false if the queue is full, the entry is counted in u32Dropped
+ * @ingroup loop
+ */
+bool ModbusFifoPush(modbusFifo_t *xFifo, uint16_t u16Value)
+{
+	uint16_t u16Head = xFifo->u16Head;
+
+	if ((uint16_t)(u16Head - xFifo->u16Tail) >= xFifo->u16Size)
+	{
+		xFifo->u32Dropped++;
+		return false;
+	}
+
+	xFifo->u16Data[ u16Head & (xFifo->u16Size - 1) ] = u16Value;
+	__DMB();
+	xFifo->u16Head = u16Head + 1;
+	return true;
+}
+#endif
+
+#if MB_SLAVE_DELTAS
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Register blocks served by MB_FC_READ_DELTA, a request must name one of them
+ * exactly. The blocks start at generation 1 with a zero shadow, the first read
+ * stamps every non zero register, and must stay valid while the slave runs
+ *
+ * @param xDeltas blocks with u8table, u16Add, u16Count, u16Shadow, u16Stamp and u16Epoch set
+ * @param u8count number of blocks
+ * @ingroup setup
+ */
+void ModbusSetDeltas(modbusHandler_t * modH, modbusDeltaBlock_t *xDeltas, uint8_t u8count)
+{
+	if (modH->uModbusType != MB_SLAVE)
+	{
+		while(1);// error only a slave serves delta reads
+	}
+
+	for (uint8_t i = 0; i < u8count; i++)
+	{
+		if (xDeltas[i].u16Shadow == NULL || xDeltas[i].u16Stamp == NULL ||
+			xDeltas[i].u16Count == 0 || xDeltas[i].u16Count > MB_DELTA_REGS ||
+			(xDeltas[i].u8table != DB_HOLDING_REGISTER && xDeltas[i].u8table != DB_INPUT_REGISTERS))
+		{
+			while(1);// error a block needs a register table, 1 to MB_DELTA_REGS registers, a shadow and stamps
+		}
+		xDeltas[i].u16Gen = 1;
+		for (uint16_t j = 0; j < xDeltas[i].u16Count; j++)
+		{
+			xDeltas[i].u16Shadow[j] = 0;
+			xDeltas[i].u16Stamp[j] = 1;
+		}
+	}
+
+	modH->u8DeltaCount = u8count;
+	modH->xDeltas = xDeltas;
+}
+#endif
+
+#if ENABLE_MB_RO_SNAPSHOT == 1
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Serves the input registers from two banks of u16regRO_size registers instead
+ * of u16regsRO. u16bank0 is served first, the producer fills the other one
+ *
+ * @ingroup setup
+ */
+void ModbusSetROBanks(modbusHandler_t * modH, uint16_t *u16bank0, uint16_t *u16bank1)
+{
+	if (modH->uModbusType != MB_SLAVE || u16bank0 == NULL || u16bank1 == NULL)
+	{
+		while(1);// error the snapshots need two banks in a slave
+	}
+
+	modH->u32ROSeq = 0;
+	modH->u16regsROBank[0] = u16bank0;
+	modH->u16regsROBank[1] = u16bank1;
+}
+
+/**
+ * @brief
+ * Bank not served to the master. It still holds the snapshot before the last one,
+ * so the producer must write all its registers before ModbusROPublish().
+ * There must be only one producer
+ *
+ * @return bank of u16regRO_size registers
+ * @ingroup setup
+ */
+uint16_t *ModbusROBackBank(modbusHandler_t * modH)
+{
+	return modH->u16regsROBank[ (modH->u32ROSeq + 1) & 1 ];
+}
+
+/**
+ * @brief
+ * Publishes the back bank as a complete snapshot, the previous one becomes the back bank
+ *
+ * @ingroup setup
+ */
+void ModbusROPublish(modbusHandler_t * modH)
+{
+#if ENABLE_MB_TIMESTAMP == 1
+	if (modH->xROStamp) ModbusPutTime(modH, &ModbusROBackBank(modH)[ modH->u16ROStamp ]);
+#endif
+	__DMB(); // the snapshot is written before it is published
+	modH->u32ROSeq++;
+	ModbusTableChanged(modH, DB_INPUT_REGISTERS);
+}
+
+/**
+ * @brief
+ * Copies registers of the published snapshot to the answer. The copy is repeated
+ * when a producer publishes meanwhile, since it then starts to fill the bank being
+ * copied, so the answer never mixes two snapshots
+ *
+ * @ingroup register
+ */
+static void putSnapshot(modbusHandler_t *modH, uint8_t *u8dst, uint16_t u16Add, uint16_t u16Count)
+{
+	uint32_t u32Seq;
+
+	do
+	{
+		u32Seq = modH->u32ROSeq;
+		__DMB();
+		putRegisters(u8dst, &modH->u16regsROBank[ u32Seq & 1 ][ u16Add ], u16Count);
+		__DMB();
+	} while (u32Seq != modH->u32ROSeq);
+}
+#endif
+
+#if ENABLE_MB_HR_COMMIT == 1
+/**
+ * @brief
+ * Sets the two banks of xBank, u16bank0 holds the initial values and is committed
+ * first, they are copied to u16bank1, the staging bank
+ *
+ * @ingroup setup
+ */
+static void initHRBank(modbusHRBank_t *xBank, uint16_t *u16bank0, uint16_t *u16bank1, uint16_t u16size)
+{
+	memcpy(u16bank1, u16bank0, u16size * sizeof(uint16_t));
+	xBank->u16regs[0] = u16bank0;
+	xBank->u16regs[1] = u16bank1;
+	xBank->u16size = u16size;
+	xBank->u32Seq = 0;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Serves the holding registers from two banks of u16regHR_size registers instead
+ * of u16regsHR. u16bank0 holds the initial values and is committed first, they are
+ * copied to u16bank1, which becomes u16regsHR, the bank the writes are staged in
+ *
+ * @ingroup setup
+ */
+void ModbusSetHRBanks(modbusHandler_t * modH, uint16_t *u16bank0, uint16_t *u16bank1)
+{
+	if (modH->uModbusType != MB_SLAVE || u16bank0 == NULL || u16bank1 == NULL)
+	{
+		while(1);// error the commit mode needs two banks in a slave
+	}
+
+	initHRBank(&modH->xHROwn, u16bank0, u16bank1, modH->u16regHR_size);
+#if ENABLE_MB_SHARED_HR == 1
+	modH->xHROwn.xLock = NULL; // the holding register semaphore of the slave guards it
+#endif
+	modH->u16HRStageEnd = 0;
+	modH->xHRBank = &modH->xHROwn;
+	modH->u16regsHR = ModbusHRStaging(modH->xHRBank);
+}
+
+/**
+ * @brief
+ * Widens the range of holding registers written by the request in progress,
+ * answerRequest() commits it once the request is applied
+ *
+ * @ingroup register
+ */
+static void stageHR(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count)
+{
+	uint16_t u16End = u16Add + u16Count;
+
+	if (modH->xHRBank == NULL || u16Count == 0) return;
+	if (modH->u16HRStageEnd == 0)
+	{
+		modH->u16HRStageAdd = u16Add;
+		modH->u16HRStageEnd = u16End;
+		return;
+	}
+	if (u16Add < modH->u16HRStageAdd) modH->u16HRStageAdd = u16Add;
+	if (u16End > modH->u16HRStageEnd) modH->u16HRStageEnd = u16End;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Publishes the staging bank with one increment of the commit counter, then brings
+ * the registers u16Add to u16Add + u16Count - 1 of the previous committed bank, the
+ * new staging one, up to date. The caller holds the holding register semaphore,
+ * the slave task or the application between ModbusLock() and ModbusUnlock()
+ *
+ * @ingroup setup
+ */
+void ModbusHRCommit(modbusHandler_t * modH, uint16_t u16Add, uint16_t u16Count)
+{
+	modbusHRBank_t *xBank = modH->xHRBank;
+	uint16_t *u16staged;
+
+	if (xBank == NULL) return;
+	u16staged = ModbusHRStaging(xBank);
+	__DMB(); // the writes are complete before they are published
+	xBank->u32Seq++;
+	memcpy(&ModbusHRStaging(xBank)[ u16Add ], &u16staged[ u16Add ], u16Count * sizeof(uint16_t));
+	modH->u16regsHR = ModbusHRStaging(xBank);
+	ModbusTableChanged(modH, DB_HOLDING_REGISTER);
+}
+
+/**
+ * @brief
+ * Copies committed holding registers without semaphore. The copy is repeated when
+ * a commit comes meanwhile, since the bank being copied is then updated, so the
+ * registers always come from one commit
+ *
+ * @ingroup register
+ */
+void ModbusHRBankRead(const modbusHRBank_t *xBank, uint16_t u16Add, uint16_t u16Count, uint16_t *u16dst)
+{
+	uint32_t u32Seq;
+
+	do
+	{
+		u32Seq = xBank->u32Seq;
+		__DMB();
+		memcpy(u16dst, &xBank->u16regs[ u32Seq & 1 ][ u16Add ], u16Count * sizeof(uint16_t));
+		__DMB();
+	} while (u32Seq != xBank->u32Seq);
+}
+
+/**
+ * @brief
+ * Copies committed holding registers of the slave without semaphore, see ModbusHRBankRead()
+ *
+ * @ingroup register
+ */
+void ModbusReadHR(modbusHandler_t * modH, uint16_t u16Add, uint16_t u16Count, uint16_t *u16dst)
+{
+	ModbusHRBankRead(modH->xHRBank, u16Add, u16Count, u16dst);
+}
+#endif
+
+#if ENABLE_MB_SHARED_HR == 1
+/**
+ * @brief
+ * Sets up a holding register bank several slaves serve, their RTU and TCP ports for
+ * instance. The writes of all of them are serialised by the semaphore of the bank
+ * and committed as with ModbusSetHRBanks(), their FC3 reads copy the committed
+ * bank without lock, so the ports answer them in parallel. u16bank0 holds the
+ * initial values, the banks are two u16size register arrays
+ *
+ * @ingroup setup
+ */
+void ModbusHRBankInit(modbusHRBank_t *xBank, uint16_t *u16bank0, uint16_t *u16bank1, uint16_t u16size)
+{
+	osSemaphoreAttr_t xAttr = ModBusSphrBank_attributes;
+
+	if (u16bank0 == NULL || u16bank1 == NULL || u16size == 0)
+	{
+		while(1);// error a shared bank needs two banks of registers
+	}
+
+#if ENABLE_MB_STATIC == 1
+	xAttr.cb_mem = &xBank->xLockCb;
+	xAttr.cb_size = sizeof(xBank->xLockCb);
+#endif
+	xBank->xLock = osSemaphoreNew(1, 1, &xAttr);
+	if (xBank->xLock == NULL)
+	{
+		while(1); //Error creating the semaphore, check heap and stack size
+	}
+	initHRBank(xBank, u16bank0, u16bank1, u16size);
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Serves the holding registers of a bank of ModbusHRBankInit(), shared with other
+ * slaves, instead of u16regsHR and u16regHR_size
+ *
+ * @ingroup setup
+ */
+void ModbusSetHRBank(modbusHandler_t * modH, modbusHRBank_t *xBank)
+{
+	if (modH->uModbusType != MB_SLAVE || xBank == NULL || xBank->xLock == NULL)
+	{
+		while(1);// error a slave serves a bank of ModbusHRBankInit()
+	}
+
+	modH->u16HRStageEnd = 0;
+	modH->xHRBank = xBank;
+	modH->u16regsHR = ModbusHRStaging(xBank);
+	modH->u16regHR_size = xBank->u16size;
+}
+
+/**
+ * @brief
+ * Tells if the slave serves a holding register bank shared with other slaves
+ *
+ * @ingroup register
+ */
+static bool isSharedHR(const modbusHandler_t *modH)
+{
+	return modH->xHRBank != NULL && modH->xHRBank->xLock != NULL;
+}
+
+/**
+ * @brief
+ * Takes the semaphore of the shared bank after xLock, the holding register semaphore
+ * of the slave, and points u16regsHR to the staging bank, another slave may have
+ * committed since the last request
+ *
+ * @return semaphore of the bank, NULL if the request does not take it
+ * @ingroup loop
+ */
+static osSemaphoreId_t lockSharedHR(modbusHandler_t *modH, osSemaphoreId_t xLock)
+{
+	if (xLock == NULL || xLock != modH->ModBusSphrHandle || !isSharedHR(modH)) return NULL;
+
+	xSemaphoreTake(modH->xHRBank->xLock, portMAX_DELAY);
+	modH->u16regsHR = ModbusHRStaging(modH->xHRBank);
+	return modH->xHRBank->xLock;
+}
+
+/**
+ * @brief
+ * Copies registers of the committed shared bank to the answer, in wire order. The
+ * copy is repeated when another slave commits meanwhile, as in putSnapshot()
+ *
+ * @ingroup register
+ */
+static void putCommittedHR(const modbusHandler_t *modH, uint8_t *u8dst, uint16_t u16Add, uint16_t u16Count)
+{
+	const modbusHRBank_t *xBank = modH->xHRBank;
+	uint32_t u32Seq;
+
+	do
+	{
+		u32Seq = xBank->u32Seq;
+		__DMB();
+		putRegisters(u8dst, &xBank->u16regs[ u32Seq & 1 ][ u16Add ], u16Count);
+		__DMB();
+	} while (u32Seq != xBank->u32Seq);
+}
+#endif
+
+#if ENABLE_MB_TIMESTAMP == 1
+/**
+ * @brief
+ * Local clock of the time stamps in microseconds, over 64 bits. It counts the 1 MHz
+ * timer of ENABLE_MB_TIMER_MUX, the wraps of the timer between two reads are found
+ * from the tick count, otherwise the ticks. Safe in interrupts
+ *
+ * @ingroup register
+ */
+static uint64_t getLocalUs(void)
+{
+	UBaseType_t uxSaved = taskENTER_CRITICAL_FROM_ISR();
+	TickType_t xNow = xTaskGetTickCountFromISR();
+	uint64_t u64TickUs = (uint64_t)(TickType_t)(xNow - xLocalClock.xTick) * (1000000UL / configTICK_RATE_HZ);
+	uint64_t u64Us;
+
+#if ENABLE_MB_TIMER_MUX == 1
+	uint32_t u32Cnt = xTimerMux.htim->Instance->CNT;
+	uint32_t u32Gone = u32Cnt - xLocalClock.u32Cnt;
+
+	// the counter wrapped every 2^32 us the ticks saw beyond u32Gone, rounded to the nearest
+	xLocalClock.u64Us += u32Gone + ((uint64_t)((int64_t)(u64TickUs - u32Gone + 0x80000000ULL) >> 32) << 32);
+	xLocalClock.u32Cnt = u32Cnt;
+#else
+	xLocalClock.u64Us += u64TickUs;
+#endif
+	xLocalClock.xTick = xNow;
+	u64Us = xLocalClock.u64Us;
+	taskEXIT_CRITICAL_FROM_ISR(uxSaved);
+	return u64Us;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Sets the MB_TIME_REGS holding registers at u16Add as the time of the master:
+ * an FC16 write of all of them, usually a broadcast, synchronises ModbusGetTime()
+ * to its value, in milliseconds, most significant register first. The rate of
+ * the local clock is corrected from the error seen at each synchronisation
+ *
+ * @ingroup setup
+ */
+void ModbusSetTimeSync(modbusHandler_t * modH, uint16_t u16Add)
+{
+	if (modH->uModbusType != MB_SLAVE)
+	{
+		while(1);// error only a slave is synchronised by its master
+	}
+
+	modH->u16TimeAdd = u16Add;
+	modH->xTimeSync = true;
+	modH->u64TimeSynced = 0;
+	modH->i64TimeOffset = 0;
+	modH->i32TimePpm = 0;
+}
+
+/**
+ * @brief
+ * Time of the master in milliseconds: the local clock plus the offset of the last
+ * synchronisation, corrected by the rate measured between the synchronisations.
+ * Before the first one it is the time since the first call of the local clock
+ *
+ * @ingroup register
+ */
+uint64_t ModbusGetTime(modbusHandler_t * modH)
+{
+	uint64_t u64Local = getLocalUs();
+	int64_t i64Us = (int64_t)u64Local + modH->i64TimeOffset;
+
+	if (modH->u64TimeSynced != 0)
+	{
+		i64Us += ((int64_t)(u64Local - modH->u64TimeSynced) * modH->i32TimePpm) / 1000000;
+	}
+	return (uint64_t)i64Us / 1000;
+}
+
+/**
+ * @brief
+ * Writes ModbusGetTime() to the MB_TIME_REGS registers of u16dst, most significant
+ * first: the sample time of values in a table, read with them by FC3, FC4 or FC23
+ *
+ * @ingroup register
+ */
+void ModbusPutTime(modbusHandler_t * modH, uint16_t *u16dst)
+{
+	uint64_t u64Ms = ModbusGetTime(modH);
+
+	for (uint8_t i = MB_TIME_REGS; i > 0; i--, u64Ms >>= 16)
+	{
+		u16dst[ i - 1 ] = (uint16_t)u64Ms;
+	}
+}
+
+/**
+ * @brief
+ * Stamps a segment with the current time: its last MB_TIME_REGS registers get
+ * ModbusGetTime(), call it once its values are written. With ENABLE_MB_RESP_CACHE
+ * call ModbusTableChanged() afterwards, as for ModbusSegSetU16()
+ *
+ * @ingroup register
+ */
+void ModbusSegStamp(modbusHandler_t * modH, const modbusSegment_t *xSeg)
+{
+	uint16_t u16Stamp[ MB_TIME_REGS ];
+	uint16_t u16Add = xSeg->u16Start + xSeg->u16Length - MB_TIME_REGS;
+
+	if (xSeg->u16Length < MB_TIME_REGS)
+	{
+		while(1);// error the segment has no room for its time stamp
+	}
+
+	ModbusPutTime(modH, u16Stamp);
+	for (uint8_t i = 0; i < MB_TIME_REGS; i++)
+	{
+		ModbusSegSetU16(xSeg, u16Add + i, u16Stamp[ i ]);
+	}
+}
+
+#if ENABLE_MB_RO_SNAPSHOT == 1
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Stamps the snapshots of ModbusROPublish(): the MB_TIME_REGS input registers
+ * at u16Add get the time the snapshot is published
+ *
+ * @ingroup setup
+ */
+void ModbusSetROStamp(modbusHandler_t * modH, uint16_t u16Add)
+{
+	if (modH->u16regsROBank[0] == NULL || u16Add + MB_TIME_REGS > modH->u16regRO_size)
+	{
+		while(1);// error the stamp is a part of the banks of ModbusSetROBanks()
+	}
+
+	modH->u16ROStamp = u16Add;
+	modH->xROStamp = true;
+}
+#endif
+
+/**
+ * @brief
+ * Synchronises the time of the slave to the FC16 request just processed when it
+ * wrote all the time registers, its count is in NB_LO. The error against the time
+ * expected corrects the rate, clamped to MB_TIME_PPM_MAX, from the second
+ * synchronisation on
+ *
+ * @ingroup register
+ */
+static void takeTimeSync(modbusHandler_t *modH)
+{
+	uint16_t u16Add = word(modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]);
+	uint16_t u16Count = modH->u8Buffer[ NB_LO ];
+	const uint8_t *u8Time;
+	uint64_t u64Local, u64Ms = 0;
+	int64_t i64Error;
+
+	if (u16Add > modH->u16TimeAdd || (uint32_t)u16Add + u16Count < (uint32_t)modH->u16TimeAdd + MB_TIME_REGS) return;
+
+	u8Time = &modH->u8Buffer[ BYTE_CNT + 1 + (modH->u16TimeAdd - u16Add) * 2 ];
+	for (uint8_t i = 0; i < MB_TIME_REGS * 2; i++)
+	{
+		u64Ms = (u64Ms << 8) | u8Time[ i ];
+	}
+
+	u64Local = getLocalUs();
+	if (modH->u64TimeSynced != 0 && u64Local - modH->u64TimeSynced >= 1000000)
+	{
+		int64_t i64Ppm;
+
+		i64Error = (int64_t)(u64Ms * 1000) - (int64_t)ModbusGetTime(modH) * 1000;
+		i64Ppm = modH->i32TimePpm + (i64Error * 1000000) / (int64_t)(u64Local - modH->u64TimeSynced);
+		if (i64Ppm > MB_TIME_PPM_MAX) i64Ppm = MB_TIME_PPM_MAX;
+		if (i64Ppm < -MB_TIME_PPM_MAX) i64Ppm = -MB_TIME_PPM_MAX;
+		modH->i32TimePpm = (int32_t)i64Ppm;
+	}
+	taskENTER_CRITICAL(); // ModbusGetTime() may run in an interrupt
+	modH->i64TimeOffset = (int64_t)(u64Ms * 1000) - (int64_t)u64Local;
+	modH->u64TimeSynced = u64Local;
+	taskEXIT_CRITICAL();
+}
+#endif
+
+#if MB_ENABLE_MASTER == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Installs a table of cyclic queries. The master task releases each entry every
+ * u32PeriodMs, starting u32PhaseMs after this call, and sends the released
+ * entries earliest deadline first. Queries queued by ModbusQuery() are sent
+ * before the table. The table must stay valid while the master runs.
+ *
+ * @param xPolls  poll table, u16Overruns and i8lastResult report each entry
+ * @param u8count number of entries
+ * @ingroup setup
+ */
+void ModbusSetPollTable(modbusHandler_t * modH, modbusPoll_t *xPolls, uint8_t u8count)
+{
+	if (modH->uModbusType != MB_MASTER)
+	{
+		while(1);// error a slave cannot send queries as a master
+	}
+
+	TickType_t xNow = xTaskGetTickCount();
+	for (uint8_t i = 0; i < u8count; i++)
+	{
+		if (xPolls[i].u32PeriodMs == 0)
+		{
+			while(1);// error a poll needs a period
+		}
+		xPolls[i].telegram.u32CurrentTask = NULL;
+		xPolls[i].xRelease = xNow + pdMS_TO_TICKS(xPolls[i].u32PhaseMs);
+		xPolls[i].xDeadline = xPolls[i].xRelease;
+		xPolls[i].u16Overruns = 0;
+		xPolls[i].i8lastResult = 0;
+#if ENABLE_MB_POLL_ADAPT == 1
+		xPolls[i].u32EffPeriodMs = xPolls[i].u32PeriodMs;
+		xPolls[i].u32AchievedMs = 0;
+		xPolls[i].u16Released = 0;
+#endif
+	}
+
+#if ENABLE_MB_POLL_ADAPT == 1
+	modH->xAdaptStart = xNow;
+	modH->u32AdaptBusyUs = 0;
+	modH->u16AdaptScale = 1000;
+	modH->u16BusLoad = 0;
+#endif
+	modH->xPollCurrent = NULL;
+	modH->u8PollCount = u8count;
+	modH->xPollTable = xPolls;
+}
+
+#if ENABLE_MB_POLL_ADAPT == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Bus load measured over the last window of MB_ADAPT_WINDOW_MS: wire time of the
+ * queries and answers and waits of the queries without answer
+ *
+ * @return load in 0.1 %, 1000 for a line busy the whole window
+ * @ingroup setup
+ */
+uint16_t ModbusGetBusLoad(modbusHandler_t * modH)
+{
+	return modH->u16BusLoad;
+}
+
+/**
+ * @brief
+ * Adds a frame of u16Chars characters and its T3.5, or a wait of u32WaitUs, to the
+ * wire time of the load window. Only the serial lines have a wire time
+ *
+ * @ingroup loop
+ */
+static void addWireTime(modbusHandler_t *modH, uint16_t u16Chars, uint32_t u32WaitUs)
+{
+	if ((modH->xTransport->u8Flags & MB_TP_UART) == 0) return;
+	if (u16Chars != 0) u32WaitUs += getWireUs(modH, getWireChars(modH, u16Chars)) + modH->u32T35us;
+	modH->u32AdaptBusyUs += u32WaitUs;
+}
+
+/**
+ * @brief
+ * Closes the load window: the load against MB_ADAPT_TARGET moves the stretch of the
+ * polls from MB_ADAPT_PRIO halfway to the one that would meet the target, as the load
+ * follows their periods only a window later. The polls of higher priority keep theirs
+ *
+ * @ingroup loop
+ */
+static void adaptPolls(modbusHandler_t *modH, TickType_t xNow)
+{
+	uint32_t u32WindowMs = (uint32_t)(((uint64_t)(xNow - modH->xAdaptStart) * 1000UL) / configTICK_RATE_HZ);
+	uint32_t u32Load = modH->u32AdaptBusyUs / u32WindowMs; // us per ms is 0.1 %
+	uint32_t u32Scale;
+
+	u32Scale = (modH->u16AdaptScale * u32Load / MB_ADAPT_TARGET + modH->u16AdaptScale) / 2;
+	if (u32Scale < 1000) u32Scale = 1000;
+	if (u32Scale > MB_ADAPT_SCALE_MAX) u32Scale = MB_ADAPT_SCALE_MAX;
+	modH->u16AdaptScale = (uint16_t)u32Scale;
+	modH->u16BusLoad = (u32Load > 1000) ? 1000 : (uint16_t)u32Load;
+
+	for (uint8_t i = 0; i < modH->u8PollCount; i++)
+	{
+		modbusPoll_t *xPoll = &modH->xPollTable[i];
+		uint32_t u32Period = xPoll->u32PeriodMs;
+
+		if (xPoll->u8Priority >= MB_ADAPT_PRIO)
+		{
+			u32Period = (uint32_t)(((uint64_t)u32Period * u32Scale) / 1000);
+			if (xPoll->u32MaxPeriodMs != 0 && u32Period > xPoll->u32MaxPeriodMs) u32Period = xPoll->u32MaxPeriodMs;
+			if (u32Period < xPoll->u32PeriodMs) u32Period = xPoll->u32PeriodMs;
+		}
+		xPoll->u32EffPeriodMs = u32Period;
+		xPoll->u32AchievedMs = (xPoll->u16Released == 0) ? 0 : u32WindowMs / xPoll->u16Released;
+		xPoll->u16Released = 0;
+	}
+
+	modH->xAdaptStart = xNow;
+	modH->u32AdaptBusyUs = 0;
+}
+#endif
+
+#if ENABLE_MB_SUBSCRIBE == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Subscribes a consumer to a range of slave data. Every answer of the master
+ * covering the range, a poll of the table, a cyclic or a queued query, is
+ * compared with u16Last: the values beyond u16Deadband are stored there and
+ * reported to xCallback and xQueue, unchanged answers report nothing. The
+ * first answer reports the whole range. The entry stays owned by the consumer
+ * and valid while subscribed. Callable from any task at any time
+ *
+ * @return false if the range, the table or u16Last is invalid
+ * @ingroup setup
+ */
+bool ModbusSubscribe(modbusHandler_t * modH, modbusSub_t *xSub)
+{
+	if (modH->uModbusType != MB_MASTER)
+	{
+		while(1);// error a slave cannot send queries as a master
+	}
+	if (xSub->u8id == 0 || xSub->u8id > 247 || xSub->u8fct < MB_FC_READ_COILS || xSub->u8fct > MB_FC_READ_INPUT_REGISTER ||
+			xSub->u16Count == 0 || (uint32_t)xSub->u16Add + xSub->u16Count > 0x10000UL || xSub->u16Last == NULL)
+	{
+		return false;
+	}
+
+	xSub->xPrimed = false;
+	xSub->u16Dropped = 0;
+	taskENTER_CRITICAL(); // the master task reads the list while it is linked
+	xSub->xNext = modH->xSubs;
+	modH->xSubs = xSub;
+	taskEXIT_CRITICAL();
+	return true;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Removes a subscription. A report in progress in the master task may still
+ * complete, the entry can be reused once the next answer was served
+ *
+ * @ingroup setup
+ */
+void ModbusUnsubscribe(modbusHandler_t * modH, modbusSub_t *xSub)
+{
+	vTaskSuspendAll(); // xNext of the entry stays valid for a pass of the master task in progress
+	for (modbusSub_t **pxLink = &modH->xSubs; *pxLink != NULL; pxLink = &(*pxLink)->xNext)
+	{
+		if (*pxLink == xSub)
+		{
+			*pxLink = xSub->xNext;
+			break;
+		}
+	}
+	xTaskResumeAll();
+}
+#endif
+
+#if ENABLE_MB_TDMA == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Installs a time-triggered cycle instead of the telegram queue. The telegrams
+ * get one slot each, in the order of the table, long enough for the query, T3.5,
+ * u32TurnUs, the answer and T3.5 at the line settings. The compare of the timer of
+ * ModbusSetTimer() sends each query at the start of its slot from the interrupt,
+ * the master task builds the frame of the next slot and reports the results as
+ * for the queue, a missing answer when the next slot starts. Reads, FC5, FC6,
+ * FC15, FC16, FC22 and FC23 have an answer of known size and can be scheduled.
+ * The table must stay valid while the master runs, its images are accessed under
+ * ModbusLock() as the queued telegrams
+ *
+ * @param telegrams  telegrams of the slots, sent every cycle
+ * @param u8count  number of slots, 1 to MB_TDMA_SLOTS
+ * @param u32TurnUs  turnaround allowed to the slaves in microseconds
+ * @param u32CycleUs  length of the cycle in microseconds, 0 for the sum of the slots
+ * @return false if a telegram cannot be scheduled or the line is not a serial RTU one
+ * @ingroup setup
+ */
+bool ModbusSetSchedule(modbusHandler_t *modH, modbus_t *telegrams, uint8_t u8count, uint32_t u32TurnUs, uint32_t u32CycleUs)
+{
+	if (modH->uModbusType != MB_MASTER)
+	{
+		while(1);// error a slave cannot send queries as a master
+	}
+
+	modH->u8SchedCount = 0;
+	if (u8count == 0 || u8count > MB_TDMA_SLOTS) return false;
+	if ((modH->xTransport->u8Flags & MB_TP_UART) == 0 || (modH->xTransport->u8Flags & MB_TP_LRC) != 0) return false;
+
+	modH->xSchedDMA = false;
+#if ENABLE_USART_DMA == 1
+	modH->xSchedDMA = (modH->xTransport->send == sendUartDMA);
+#if ENABLE_USART_DMA_INPLACE == 1
+	if (modH->xSchedDMA) return false; // the answer would be received over the frames
+#endif
+#endif
+
+	for (uint8_t i = 0; i < u8count; i++)
+	{
+		if (telegrams[i].u8id > 247) return false;
+		if (telegrams[i].u8id != 0 && getAnswerSize(&telegrams[i]) == 0) return false;
+		telegrams[i].u32CurrentTask = NULL;
+	}
+
+	modH->xSchedule = telegrams;
+	modH->u32SchedTurnUs = u32TurnUs;
+	modH->u32SchedCycleMin = u32CycleUs;
+	modH->xSchedRun = false;
+	modH->u32SchedLate = 0;
+	modH->u8SchedCount = u8count;
+	return true;
+}
+
+/**
+ * @brief
+ * Size of the answer to telegram with its CRC, an exception answer is shorter
+ *
+ * @return bytes, 0 if the function has an answer of variable size
+ * @ingroup loop
+ */
+static uint16_t getAnswerSize(const modbus_t *telegram)
+{
+	switch (telegram->u8fct)
+	{
+	case MB_FC_READ_COILS:
+	case MB_FC_READ_DISCRETE_INPUT:
+		return 5 + (telegram->u16CoilsNo + 7) / 8;
+	case MB_FC_READ_REGISTERS:
+	case MB_FC_READ_INPUT_REGISTER:
+		return 5 + 2 * telegram->u16CoilsNo;
+	case MB_FC_WRITE_COIL:
+	case MB_FC_WRITE_REGISTER:
+	case MB_FC_WRITE_MULTIPLE_COILS:
+	case MB_FC_WRITE_MULTIPLE_REGISTERS:
+		return 8;
+	case MB_FC_MASK_WRITE_REGISTER:
+		return 10;
+	case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+		return 5 + 2 * telegram->u16ReadNo;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief
+ * Computes the start of each slot from the wire time of its query and answer at
+ * the baud rate, word length and stop bits of the port, T3.5 and the turnaround
+ *
+ * @return false if the slots do not fit in the cycle asked by ModbusSetSchedule()
+ * @ingroup loop
+ */
+static bool compileSchedule(modbusHandler_t *modH)
+{
+	uint32_t u32Baud = modH->port->Init.BaudRate;
+	uint32_t u32CharUs = (getCharBits(modH->port) * 1000000UL + u32Baud - 1) / u32Baud;
+	uint32_t u32At = 0;
+	uint16_t u16Query, u16Answer;
+
+	for (uint8_t i = 0; i < modH->u8SchedCount; i++)
+	{
+		modbus_t *telegram = &modH->xSchedule[i];
+
+		u16Query = buildPdu(modH->u8SchedTx[0], telegram) + 2;
+		u16Answer = (telegram->u8id == 0) ? 0 : getAnswerSize(telegram);
+		if (u16Query > MAX_BUFFER || u16Answer > MAX_BUFFER) return false;
+
+		modH->u32SchedOffset[i] = u32At;
+		// each frame is followed by its T3.5, the slave answers within the turnaround
+		u32At += (u16Query + u16Answer) * u32CharUs + 2 * modH->u32T35us + modH->u32SchedTurnUs;
+	}
+
+	if (modH->u32SchedCycleMin != 0)
+	{
+		if (modH->u32SchedCycleMin < u32At) return false;
+		u32At = modH->u32SchedCycleMin; // the line stays idle for the rest of the cycle
+	}
+	modH->u32SchedCycle = u32At;
+	return true;
+}
+
+/**
+ * @brief
+ * Builds the frame of telegram, with its CRC, for slot start u32Start. The timer
+ * interrupt only sends a frame built for its own start
+ *
+ * @ingroup loop
+ */
+static void buildSlotFrame(modbusHandler_t *modH, uint32_t u32Start, modbus_t *telegram)
+{
+	uint8_t u8Buf = u32Start & 1;
+	uint8_t *u8Frame = modH->u8SchedTx[u8Buf];
+	uint16_t u16Size, u16crc;
+
+	xSemaphoreTake(modH->ModBusSphrHandle, portMAX_DELAY); // the image of a write is read as SendQuery() does
+#if ENABLE_MB_TYPED == 1
+	encodeValues(telegram);
+#endif
+	u16Size = buildPdu(u8Frame, telegram);
+	xSemaphoreGive(modH->ModBusSphrHandle);
+
+	u16crc = calcCRC(u8Frame, u16Size);
+	u8Frame[ u16Size++ ] = u16crc >> 8;
+	u8Frame[ u16Size++ ] = u16crc & 0x00ff;
+	modH->u16SchedTxSize[u8Buf] = u16Size;
+	__DMB(); // the frame is complete before the interrupt may take it
+	modH->u32SchedTxFor[u8Buf] = u32Start;
+}
+
+/**
+ * @brief
+ * Starts the cycle one cycle length from now, with the timings of the current line
+ * settings. A schedule that no longer fits is dropped and the queue serves the master again
+ *
+ * @ingroup loop
+ */
+static void startSchedule(modbusHandler_t *modH)
+{
+	if (xTimerMux.htim == NULL || !compileSchedule(modH))
+	{
+		modH->u8SchedCount = 0;
+		modH->i8lastError = ERR_BAD_SIZE;
+		return;
+	}
+
+	modH->u8SchedOpen = MB_TDMA_NONE;
+	modH->xSchedAnswered = false;
+	modH->u8SchedNext = 0;
+	modH->u32SchedStarts = 0;
+	modH->u32SchedDone = 0;
+	modH->u16SchedFrames = modH->u16RxFrames;
+	modH->u32SchedTxFor[0] = UINT32_MAX;
+	modH->u32SchedTxFor[1] = UINT32_MAX;
+	buildSlotFrame(modH, 0, &modH->xSchedule[0]);
+
+	modH->u32SchedBase = xTimerMux.htim->Instance->CNT + modH->u32SchedCycle;
+	modH->xSchedRun = true;
+	armModbusTimerAt(modH, MB_TIMER_TIMEOUT, modH->u32SchedBase);
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Master task with a schedule: takes the answers and the slot starts signalled
+ * since its last run in their order on the line. The frames ended before a slot
+ * started answer the slot before it
+ *
+ * @ingroup loop
+ */
+static void serveSchedule(modbusHandler_t *modH)
+{
+	uint32_t u32Start;
+
+	if (!modH->xSchedRun)
+	{
+		if (modH->xStopped)
+		{
+			vTaskDelay(1); // ModbusReconfigure() restarts the line, the schedule follows
+			return;
+		}
+		startSchedule(modH);
+		return;
+	}
+
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // an answer, the end of a query or a slot start
+
+	for (;;)
+	{
+		u32Start = modH->u32SchedDone;
+		if (u32Start != modH->u32SchedStarts &&
+				(modH->u16SchedFrames == modH->u16RxFrames || modH->u16SchedFrames == modH->u16SchedMark[u32Start & 1]))
+		{
+			closeSlot(modH);
+		}
+		else if (modH->u16SchedFrames != modH->u16RxFrames)
+		{
+			modH->u16SchedFrames++;
+			takeSlotAnswer(modH);
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+/**
+ * @brief
+ * Handles a slot start: the open slot without answer timed out, the started one
+ * is opened and the frame of the slot after it is built
+ *
+ * @ingroup loop
+ */
+static void closeSlot(modbusHandler_t *modH)
+{
+	modbus_t *telegram;
+	uint8_t u8Next;
+
+	if (modH->u8SchedOpen != MB_TDMA_NONE && !modH->xSchedAnswered)
+	{
+		telegram = &modH->xSchedule[modH->u8SchedOpen];
+		if (telegram->u8id == 0)
+		{
+			modH->i8lastError = 0; // no answer to a broadcast
+			notifyQueryResult(modH, telegram, ERR_OK_QUERY);
+		}
+		else
+		{
+			modH->u16errCnt++;
+			MB_COUNT_ERR(modH, ERR_TIME_OUT);
+			modH->i8lastError = ERR_TIME_OUT;
+			notifyQueryResult(modH, telegram, modH->i8lastError);
+		}
+	}
+
+	modH->u8SchedOpen = (modH->u8SchedOpen == MB_TDMA_NONE) ? 0 : (modH->u8SchedOpen + 1) % modH->u8SchedCount;
+	modH->xSchedAnswered = false;
+	openTransaction(&modH->xTransaction, &modH->xSchedule[modH->u8SchedOpen]);
+	modH->u32SchedDone++;
+
+	if (modH->u32SchedStarts == modH->u32SchedDone) // not late, the next start is still ahead
+	{
+		u8Next = (modH->u8SchedOpen + 1) % modH->u8SchedCount;
+		buildSlotFrame(modH, modH->u32SchedDone, &modH->xSchedule[u8Next]);
+	}
+}
+
+/**
+ * @brief
+ * Takes a received frame as the answer of the open slot, a second frame in the
+ * same slot or a frame not matching its query is dropped
+ *
+ * @ingroup loop
+ */
+static void takeSlotAnswer(modbusHandler_t *modH)
+{
+	modbus_t *telegram;
+	int16_t i16Size = modH->xTransport->recvFrame(modH);
+
+	if (modH->u8SchedOpen == MB_TDMA_NONE || modH->xSchedAnswered) return;
+
+	telegram = &modH->xSchedule[modH->u8SchedOpen];
+	if (i16Size <= 0 || !matchAnswer(modH, telegram))
+	{
+		dropStrayFrame(modH); // the slot waits on for its answer
+		return;
+	}
+	modH->xSchedAnswered = true;
+	processAnswer(modH, telegram, &modH->xTransaction);
+}
+
+/**
+ * @brief
+ * Compare of the MB_TIMER_TIMEOUT deadline of a master with a schedule: sends the
+ * frame built for this slot start and arms the start of the next slot, counted from
+ * the start of the cycle so the error of the interrupt latency does not add up.
+ * A slot whose frame is not ready stays silent
+ *
+ * @ingroup htim TIM HAL handler
+ */
+static void startSlotFromISR(modbusHandler_t *modH, BaseType_t *pxHigherPriorityTaskWoken)
+{
+	uint32_t u32Start = modH->u32SchedStarts;
+	uint8_t u8Buf = u32Start & 1;
+
+	if (!modH->xSchedRun) return; // ModbusStop()
+
+	if (modH->u32SchedTxFor[u8Buf] == u32Start && modH->port->gState == HAL_UART_STATE_READY)
+	{
+		startUartTx(modH, modH->u8SchedTx[u8Buf], modH->u16SchedTxSize[u8Buf], modH->xSchedDMA);
+		modH->u16OutCnt++;
+	}
+	else
+	{
+		modH->u32SchedLate++;
+	}
+	modH->u16SchedMark[u8Buf] = modH->u16RxFrames;
+	modH->u32SchedStarts = u32Start + 1;
+
+	if (++modH->u8SchedNext == modH->u8SchedCount)
+	{
+		modH->u8SchedNext = 0;
+		modH->u32SchedBase += modH->u32SchedCycle;
+	}
+	armModbusTimerAt(modH, MB_TIMER_TIMEOUT, modH->u32SchedBase + modH->u32SchedOffset[modH->u8SchedNext]);
+	notifyModbusFromISR(modH, MB_EV_TIMEOUT, pxHigherPriorityTaskWoken);
+}
+#endif
+
+
+/**
+ * @brief
+ * Gets the next telegram of the master: an urgent or cyclic queued query, otherwise the
+ * released poll with the earliest deadline, otherwise a background query. Without
+ * poll table it waits for the queue only. telegram points to the queued telegram
+ * or to the one of the poll, nothing is copied
+ *
+ * @param pxWait longest wait for a telegram, it returns the ticks until the next poll release
+ * @return true if telegram is ready to send, false if the wait ended without one
+ * @ingroup loop
+ */
+static bool getNextTelegram(modbusHandler_t *modH, modbus_t **telegram, TickType_t *pxWait)
+{
+	TickType_t xBlock = *pxWait;
+
+	modH->xPollCurrent = NULL;
+	*pxWait = portMAX_DELAY;
+
+	if (modH->xPollTable == NULL)
+	{
+		return (*telegram = takeTelegram(modH, MB_PRIO_BACKGROUND, xBlock)) != NULL;
+	}
+
+	// queries of the application tasks go first, but the background ones
+	if ((*telegram = takeTelegram(modH, MB_PRIO_CYCLIC, 0)) != NULL)
+	{
+		return true;
+	}
+
+	TickType_t xNow = xTaskGetTickCount();
+	TickType_t xWait = portMAX_DELAY;
+	TickType_t xNextDeadline = 0;
+	modbusPoll_t *xNext = NULL;
+
+#if ENABLE_MB_POLL_ADAPT == 1
+	if (xNow - modH->xAdaptStart >= pdMS_TO_TICKS(MB_ADAPT_WINDOW_MS)) adaptPolls(modH, xNow);
+#endif
+
+	for (uint8_t i = 0; i < modH->u8PollCount; i++)
+	{
+		modbusPoll_t *xPoll = &modH->xPollTable[i];
+
+		if ((int32_t)(xNow - xPoll->xRelease) < 0)
+		{
+			// not released yet, wake up for its release
+			if (xPoll->xRelease - xNow < xWait) xWait = xPoll->xRelease - xNow;
+			continue;
+		}
+
+		TickType_t xDeadline = xPoll->xRelease + MB_POLL_PERIOD(xPoll);
+		if (xNext == NULL || (int32_t)(xDeadline - xNextDeadline) < 0 ||
+			(xDeadline == xNextDeadline && xPoll->u8Priority < xNext->u8Priority))
+		{
+			xNext = xPoll;
+			xNextDeadline = xDeadline;
+		}
+	}
+
+	if (xNext == NULL)
+	{
+		// nothing released, a queued query may arrive first
+		*pxWait = xWait;
+		return (*telegram = takeTelegram(modH, MB_PRIO_BACKGROUND, (xWait < xBlock) ? xWait : xBlock)) != NULL;
+	}
+
+	xNext->xDeadline = xNextDeadline;
+	xNext->xRelease = xNextDeadline;
+	if ((int32_t)(xNow - xNextDeadline) >= 0)
+	{
+		// a whole period late: count it and restart the period from now
+		xNext->u16Overruns++;
+		xNext->xDeadline = xNow + MB_POLL_PERIOD(xNext);
+		xNext->xRelease = xNext->xDeadline;
+	}
+#if ENABLE_MB_POLL_ADAPT == 1
+	xNext->u16Released++;
+#endif
+
+	*telegram = &xNext->telegram;
+	modH->xPollCurrent = xNext;
+	return true;
+}
+
+
+/**
+ * @brief
+ * Selects the answer timeout of a query: the one of the telegram, otherwise the
+ * adaptive timeout of the slave once it is known, otherwise the handler u16timeOut
+ *
+ * @return timeout in ticks
+ * @ingroup loop
+ */
+static uint16_t getQueryTimeOut(modbusHandler_t *modH, modbus_t *telegram)
+{
+	if (telegram->u16timeOut != 0) return telegram->u16timeOut;
+
+#if ENABLE_MB_BROADCAST == 1
+	if (telegram->u8id == 0) return MB_TURNAROUND; // the broadcast completes when this delay is over
+#endif
+
+#if ENABLE_MB_ADAPTIVE_TIMEOUT == 1
+	modbusSlave_t *xSlave = getSlave(modH, telegram->u8id);
+	if (xSlave->u8samples >= MB_TIMEOUT_SAMPLES)
+	{
+		uint32_t u32TimeOut = (xSlave->u32Mean >> 3) + MB_TIMEOUT_K * ((xSlave->u32Dev + 3) >> 2) + 1;
+		if (u32TimeOut < MB_TIMEOUT_MIN) u32TimeOut = MB_TIMEOUT_MIN;
+		if (u32TimeOut < modH->u16timeOut) return (uint16_t)u32TimeOut;
+	}
+#endif
+
+	return modH->u16timeOut;
+}
+#endif
+
+#if ENABLE_MB_BROADCAST == 1
+/**
+ * @brief
+ * Function codes that can be broadcast to unit ID 0
+ *
+ * @return true for FC5, FC6, FC15 and FC16
+ * @ingroup loop
+ */
+static bool isBroadcastFunction(uint8_t u8fct)
+{
+	return u8fct == MB_FC_WRITE_COIL || u8fct == MB_FC_WRITE_REGISTER ||
+		   u8fct == MB_FC_WRITE_MULTIPLE_COILS || u8fct == MB_FC_WRITE_MULTIPLE_REGISTERS;
+}
+#endif
+
+#if MB_ENABLE_MASTER == 1
+#if MB_SLAVE_TABLE == 1
+/**
+ * @brief
+ * Gets the statistics entry of a slave, the oldest entry is reused for a new slave
+ *
+ * @return entry of u8id
+ * @ingroup loop
+ */
+static modbusSlave_t *getSlave(modbusHandler_t *modH, uint8_t u8id)
+{
+	for (uint8_t i = 0; i < MAX_SLAVES; i++)
+	{
+		if (modH->xSlaves[i].u8id == u8id) return &modH->xSlaves[i];
+	}
+
+	modbusSlave_t *xSlave = &modH->xSlaves[modH->u8SlaveNext];
+	modH->u8SlaveNext = (modH->u8SlaveNext + 1) % MAX_SLAVES;
+	memset(xSlave, 0, sizeof(modbusSlave_t));
+	xSlave->u8id = u8id;
+	return xSlave;
+}
+
+#endif
+
+#if ENABLE_MB_BACKOFF == 1
+/**
+ * @brief
+ * Checks the health of the addressed slave before its query is sent. An offline
+ * slave is only queried once per backoff period, that probe is sent without retries
+ *
+ * @return true if the query must be sent
+ * @ingroup loop
+ */
+static bool isSlaveOnline(modbusHandler_t *modH, modbus_t *telegram)
+{
+	modbusSlave_t *xSlave = getSlave(modH, telegram->u8id);
+
+	if (xSlave->u8Timeouts < MB_DEAD_TIMEOUTS) return true;
+	if ((int32_t)(xTaskGetTickCount() - xSlave->xProbe) < 0) return false;
+
+	modH->u8Attempts = telegram->u8retries; // the probe is sent once, telegram is not changed
+	return true;
+}
+
+/**
+ * @brief
+ * Updates the health of a slave with the result of a query: any answer brings
+ * it back online, MB_DEAD_TIMEOUTS consecutive timeouts take it offline and
+ * every failed probe doubles the backoff up to MB_BACKOFF_MAX
+ *
+ * @ingroup loop
+ */
+static void updateSlaveHealth(modbusHandler_t *modH, uint8_t u8id, bool xTimedOut)
+{
+	modbusSlave_t *xSlave = getSlave(modH, u8id);
+
+	if (!xTimedOut)
+	{
+		xSlave->u8Timeouts = 0;
+		xSlave->u32Backoff = 0;
+		return;
+	}
+
+	if (xSlave->u8Timeouts < MB_DEAD_TIMEOUTS) xSlave->u8Timeouts++;
+	if (xSlave->u8Timeouts < MB_DEAD_TIMEOUTS) return;
+
+	if (xSlave->u32Backoff == 0) xSlave->u32Backoff = MB_BACKOFF_MIN;
+	else if (xSlave->u32Backoff < MB_BACKOFF_MAX / 2) xSlave->u32Backoff *= 2;
+	else xSlave->u32Backoff = MB_BACKOFF_MAX;
+	xSlave->xProbe = xTaskGetTickCount() + xSlave->u32Backoff;
+}
+#endif
+
+#if ENABLE_MB_ADAPTIVE_TIMEOUT == 1
+/**
+ * @brief
+ * Adds an answer time to the slave statistics. Mean and mean deviation are
+ * smoothed with gains 1/8 and 1/4 in fixed point, as for TCP retransmission timers.
+ * Timed out queries are not sampled
+ *
+ * @ingroup loop
+ */
+static void updateAnswerTime(modbusHandler_t *modH, uint8_t u8id, TickType_t xTime)
+{
+	modbusSlave_t *xSlave = getSlave(modH, u8id);
+
+	if (xSlave->u8samples == 0)
+	{
+		xSlave->u32Mean = xTime << 3;
+		xSlave->u32Dev = xTime << 1; // half the first sample
+	}
+	else
+	{
+		int32_t i32Err = (int32_t)xTime - (int32_t)(xSlave->u32Mean >> 3);
+		xSlave->u32Mean += i32Err;
+		if (i32Err < 0) i32Err = -i32Err;
+		xSlave->u32Dev += i32Err - (xSlave->u32Dev >> 2);
+	}
+
+	if (xSlave->u8samples < MB_TIMEOUT_SAMPLES) xSlave->u8samples++;
+}
+#endif
+
+#if ENABLE_MB_NODE_STATS == 1
+/**
+ * @brief
+ * Gets the node statistics of a slave in O(1) through u8NodeIndex, a new slave takes
+ * the next free entry. Broadcasts and the slaves beyond MB_NODE_STATS are not tracked
+ *
+ * @return entry of u8id, NULL if it is not tracked
+ * @ingroup loop
+ */
+static modbusNodeStats_t *getNodeStats(modbusHandler_t *modH, uint8_t u8id)
+{
+	uint8_t u8Entry = modH->u8NodeIndex[ u8id ];
+
+	if (u8Entry == 0)
+	{
+		if (u8id == 0 || modH->u8NodeCount == MB_NODE_STATS) return NULL;
+		u8Entry = ++modH->u8NodeCount;
+		modH->xNodes[ u8Entry - 1 ].u8id = u8id;
+		modH->u8NodeIndex[ u8id ] = u8Entry;
+	}
+	return &modH->xNodes[ u8Entry - 1 ];
+}
+
+/**
+ * @brief
+ * Adds an answer time to the node statistics, smoothed as by updateAnswerTime()
+ *
+ * @ingroup loop
+ */
+static void updateNodeTime(modbusNodeStats_t *xNode, TickType_t xTime)
+{
+	xNode->u8Lost = 0;
+	if (xNode->u32Answers++ == 0)
+	{
+		xNode->u32Mean = xTime << 3;
+		xNode->u32Jitter = 0;
+		return;
+	}
+
+	int32_t i32Err = (int32_t)xTime - (int32_t)(xNode->u32Mean >> 3);
+	xNode->u32Mean += i32Err;
+	if (i32Err < 0) i32Err = -i32Err;
+	xNode->u32Jitter += i32Err - (xNode->u32Jitter >> 2);
+}
+#endif
+
+#if ENABLE_MB_MERGE == 1
+/**
+ * @brief
+ * Checks that the range of telegram fits in one read together with u16Start..u16End
+ *
+ * @return true if one FC3/FC4 read covers both
+ * @ingroup loop
+ */
+static bool isNearRange(const modbus_t *telegram, uint16_t u16Start, uint16_t u16End)
+{
+	uint32_t u32Start = telegram->u16RegAdd;
+	uint32_t u32End = u32Start + telegram->u16CoilsNo;
+
+	// overlapping or at most MB_MERGE_GAP registers apart
+	if (u32Start > (uint32_t)u16End + MB_MERGE_GAP || u32End + MB_MERGE_GAP < u16Start) return false;
+
+	if (u32Start > u16Start) u32Start = u16Start;
+	if (u32End < u16End) u32End = u16End;
+	return (u32End - u32Start) <= MB_MERGE_REGS;
+}
+
+/**
+ * @brief
+ * Checks that telegram reads the same kind of registers of the same slave
+ * and that its range fits in one read together with u16Start..u16End. With
+ * u16Total, the registers of the telegrams already merged when the query may
+ * become a MB_FC_READ_RANGES one, any range fits while the total stays an FC3 read
+ *
+ * @return true if it can be merged
+ * @ingroup loop
+ */
+static bool isMergeable(modbus_t *telegram, modbus_t *first, uint16_t u16Start, uint16_t u16End, uint16_t u16Total)
+{
+	if (telegram->u8id != first->u8id || telegram->u8fct != first->u8fct) return false;
+	if (telegram->u16CoilsNo == 0) return false;
+#if ENABLE_MB_PREBUILT == 1
+	if (telegram->u8Frame != NULL) return false;
+#endif
+#if ENABLE_MB_GATHER == 1
+	if (telegram->xGather != NULL) return false;
+#endif
+
+	if (u16Total != 0) return (uint32_t)u16Total + telegram->u16CoilsNo <= MB_MERGE_REGS;
+	return isNearRange(telegram, u16Start, u16End);
+}
+
+
+/**
+ * @brief
+ * Takes the head of the queue into next if it can be merged with first,
+ * in the same critical section as the check. A telegram of ModbusQueryRef()
+ * keeps its reference until its own query, it is not merged
+ *
+ * @return true if next was taken
+ * @ingroup loop
+ */
+static bool takeMergeable(modbusHandler_t *modH, modbus_t *next, modbus_t *first, uint16_t u16Start, uint16_t u16End, uint16_t u16Total)
+{
+	int8_t i8Level;
+	uint8_t u8Slot;
+
+	if (xSemaphoreTake(modH->QueueTelegramHandle, 0) != pdTRUE) return false;
+
+	taskENTER_CRITICAL();
+	i8Level = findTelegramLevel(modH, MB_PRIO_BACKGROUND);
+	if (i8Level >= 0) u8Slot = modH->u8TelegramQueue[i8Level][modH->u8TelegramHead[i8Level]];
+	if (i8Level < 0 || modH->xTelegramRef[u8Slot] != &modH->xTelegramPool[u8Slot] ||
+		!isMergeable(modH->xTelegramRef[u8Slot], first, u16Start, u16End, u16Total))
+	{
+		taskEXIT_CRITICAL();
+		xSemaphoreGive(modH->QueueTelegramHandle);
+		return false;
+	}
+	u8Slot = popTelegram(modH, (uint8_t)i8Level);
+	taskEXIT_CRITICAL();
+
+	*next = modH->xTelegramPool[u8Slot]; // its result is reported with the answer of the merged query
+	freeTelegram(modH, u8Slot);
+	return true;
+}
+
+/**
+ * @brief
+ * Takes from the head of the queue the FC3/FC4 reads that can be sent
+ * in the same query as telegram and turns telegram into that query.
+ * The order of the queue is kept, merging stops at the first other telegram.
+ * With xMergeRanges, reads too far apart for one FC3/FC4 read make a
+ * MB_FC_READ_RANGES query of one range per telegram
+ *
+ * @ingroup loop
+ */
+static void mergeTelegrams(modbusHandler_t *modH, modbus_t *telegram)
+{
+	modbus_t next;
+	uint16_t u16Start, u16End;
+	uint16_t u16Total = 0; // registers of the members, 0 without ranges
+	bool xSpread = false; // a member is too far for one FC3/FC4 read
+
+	modH->u8Merged = 0;
+#if ENABLE_MB_PREBUILT == 1
+	if (telegram->u8Frame != NULL) return; // its frame is sent as it is
+#endif
+#if ENABLE_MB_GATHER == 1
+	if (telegram->xGather != NULL) return; // its answer has no image to scatter
+#endif
+	if (telegram->u8fct != MB_FC_READ_REGISTERS && telegram->u8fct != MB_FC_READ_INPUT_REGISTER) return;
+	if (telegram->u16CoilsNo == 0 || telegram->u16CoilsNo > MB_MERGE_REGS) return;
+
+	u16Start = telegram->u16RegAdd;
+	u16End = telegram->u16RegAdd + telegram->u16CoilsNo;
+	modH->xMerged[0] = *telegram;
+	modH->u8Merged = 1;
+#if MB_ENABLE_FC_RANGES == 1
+	if (modH->xMergeRanges) u16Total = telegram->u16CoilsNo;
+#endif
+
+	while (modH->u8Merged < MB_MERGE_MAX && takeMergeable(modH, &next, telegram, u16Start, u16End, u16Total))
+	{
+		if (u16Total != 0)
+		{
+			if (!xSpread && !isNearRange(&next, u16Start, u16End)) xSpread = true;
+			u16Total += next.u16CoilsNo;
+		}
+		if (next.u16RegAdd < u16Start) u16Start = next.u16RegAdd;
+		if (next.u16RegAdd + next.u16CoilsNo > u16End) u16End = next.u16RegAdd + next.u16CoilsNo;
+		modH->xMerged[modH->u8Merged++] = next;
+	}
+
+	if (modH->u8Merged == 1)
+	{
+		modH->u8Merged = 0; // nothing to merge, send it as it is
+		return;
+	}
+
+#if MB_ENABLE_FC_RANGES == 1
+	if (xSpread)
+	{
+		// the answer goes to the image of every telegram directly
+		for (uint8_t i = 0; i < modH->u8Merged; i++)
+		{
+			modH->xMergedRanges[i].u16Add = modH->xMerged[i].u16RegAdd;
+			modH->xMergedRanges[i].u16Count = modH->xMerged[i].u16CoilsNo;
+			modH->xMergedRanges[i].u16regs = modH->xMerged[i].u16reg;
+		}
+		telegram->u16RegAdd = telegram->u8fct;
+		telegram->u8fct = MB_FC_READ_RANGES;
+		telegram->u16CoilsNo = modH->u8Merged;
+		telegram->xRanges = modH->xMergedRanges;
+		return;
+	}
+#else
+	(void)xSpread;
+#endif
+
+	telegram->u16RegAdd = u16Start;
+	telegram->u16CoilsNo = u16End - u16Start;
+	telegram->u16reg = modH->u16MergeRegs;
+}
+#endif
+
+#if ENABLE_MB_CACHE == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Sets the ranges cached by the master task. A read of a slave inside a range
+ * answered less than xMaxAge ticks ago is served from the range without a query,
+ * the answers of FC1 to FC4 reads covering a whole range refresh it and the
+ * writes to a range drop it
+ *
+ * @ingroup setup
+ */
+void ModbusSetCache(modbusHandler_t * modH, modbusCache_t *xCache, uint8_t u8count)
+{
+	if (modH->uModbusType != MB_MASTER)
+	{
+		while(1);// error a slave cannot send queries as a master
+	}
+
+	for (uint8_t i = 0; i < u8count; i++)
+	{
+		if (xCache[i].u8fct < MB_FC_READ_COILS || xCache[i].u8fct > MB_FC_READ_INPUT_REGISTER)
+		{
+			while(1);// error only the reads can be cached
+		}
+#if MB_ENABLE_FC_DELTA == 1
+		if (xCache[i].xDelta && (xCache[i].u8fct < MB_FC_READ_REGISTERS || xCache[i].u16CoilsNo == 0 || xCache[i].u16CoilsNo > MB_DELTA_REGS))
+		{
+			while(1);// error a delta range is a block of 1 to MB_DELTA_REGS holding or input registers
+		}
+		xCache[i].u32Gen = 0;
+#endif
+		xCache[i].xValid = false;
+	}
+
+	modH->u8CacheCount = u8count;
+	modH->xCache = xCache;
+}
+
+/**
+ * @brief
+ * Read function code of the data accessed by a telegram, writes go to
+ * the coils or holding registers
+ *
+ * @return MB_FC_READ_COILS to MB_FC_READ_INPUT_REGISTER
+ * @ingroup loop
+ */
+static uint8_t getCacheTable(uint8_t u8fct)
+{
+	switch (u8fct)
+	{
+	case MB_FC_WRITE_COIL:
+	case MB_FC_WRITE_MULTIPLE_COILS:
+		return MB_FC_READ_COILS;
+	case MB_FC_WRITE_REGISTER:
+	case MB_FC_WRITE_MULTIPLE_REGISTERS:
+	case MB_FC_MASK_WRITE_REGISTER:
+	case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+		return MB_FC_READ_REGISTERS;
+	default:
+		return u8fct;
+	}
+}
+
+/**
+ * @brief
+ * Copies u16Count registers, or coils for FC1/FC2, between two images
+ * starting at the offsets u16DstOff and u16SrcOff
+ *
+ * @ingroup loop
+ */
+static void copyCache(uint8_t u8fct, uint16_t *u16dst, uint16_t u16DstOff, const uint16_t *u16src, uint16_t u16SrcOff, uint16_t u16Count)
+{
+	if (u8fct == MB_FC_READ_REGISTERS || u8fct == MB_FC_READ_INPUT_REGISTER)
+	{
+		memcpy(&u16dst[u16DstOff], &u16src[u16SrcOff], u16Count * sizeof(uint16_t));
+		return;
+	}
+
+	for (uint16_t i = 0; i < u16Count; i++)
+	{
+		uint16_t u16Src = u16SrcOff + i;
+		uint16_t u16Dst = u16DstOff + i;
+		bitWrite(u16dst[ u16Dst / 16 ], u16Dst % 16, bitRead(u16src[ u16Src / 16 ], u16Src % 16));
+	}
+}
+
+/**
+ * @brief
+ * Answers a read from a fresh range of the cache into the telegram image.
+ * A write drops the ranges it overlaps, it is sent in any case
+ *
+ * @return true if the read was answered, no query is needed
+ * @ingroup loop
+ */
+static bool lookupCache(modbusHandler_t *modH, modbus_t *telegram)
+{
+	uint8_t u8table = getCacheTable(telegram->u8fct);
+	uint32_t u32Start = telegram->u16RegAdd;
+	uint32_t u32End;
+	TickType_t xNow = xTaskGetTickCount();
+
+#if ENABLE_MB_RBE == 1
+	// a report by exception poll compares the answers of the slave itself
+	if (modH->xPollCurrent != NULL && modH->xPollCurrent->xOnChange != NULL) return false;
+#endif
+#if ENABLE_MB_GATHER == 1
+	if (telegram->xGather != NULL) return false; // no image to copy the range to
+#endif
+
+	switch (telegram->u8fct)
+	{
+	case MB_FC_WRITE_COIL:
+	case MB_FC_WRITE_REGISTER:
+	case MB_FC_MASK_WRITE_REGISTER:
+		u32End = u32Start + 1;
+		break;
+	default:
+		u32End = u32Start + telegram->u16CoilsNo;
+		break;
+	}
+
+	for (uint8_t i = 0; i < modH->u8CacheCount; i++)
+	{
+		modbusCache_t *xRange = &modH->xCache[i];
+		uint32_t u32RangeEnd = (uint32_t)xRange->u16RegAdd + xRange->u16CoilsNo;
+
+		if (!xRange->xValid || xRange->u8fct != u8table) continue;
+
+		if (u8table != telegram->u8fct)
+		{
+			// a write makes the cached values stale, a broadcast the ones of every slave
+			if ((telegram->u8id == 0 || xRange->u8id == telegram->u8id) &&
+				u32Start < u32RangeEnd && u32End > xRange->u16RegAdd) xRange->xValid = false;
+			continue;
+		}
+		if (xRange->u8id != telegram->u8id) continue;
+
+		if (u32Start < xRange->u16RegAdd || u32End > u32RangeEnd || telegram->u16CoilsNo == 0) continue;
+		if ((xNow - xRange->xUpdated) >= xRange->xMaxAge)
+		{
+			xRange->xValid = false;
+			continue;
+		}
+
+		xSemaphoreTake(modH->ModBusSphrHandle, portMAX_DELAY);
+		copyCache(u8table, telegram->u16reg, 0, xRange->u16reg, u32Start - xRange->u16RegAdd, telegram->u16CoilsNo);
+		xSemaphoreGive(modH->ModBusSphrHandle);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief
+ * Refreshes the ranges of the cache inside the range read by the answered
+ * telegram, called by finishQuery() under the semaphore
+ *
+ * @ingroup loop
+ */
+static void updateCache(modbusHandler_t *modH, modbus_t *telegram)
+{
+	uint32_t u32End = (uint32_t)telegram->u16RegAdd + telegram->u16CoilsNo;
+
+	if (telegram->u8fct < MB_FC_READ_COILS || telegram->u8fct > MB_FC_READ_INPUT_REGISTER) return;
+#if ENABLE_MB_GATHER == 1
+	if (telegram->xGather != NULL) return;
+#endif
+
+	for (uint8_t i = 0; i < modH->u8CacheCount; i++)
+	{
+		modbusCache_t *xRange = &modH->xCache[i];
+
+		if (xRange->u8id != telegram->u8id || xRange->u8fct != telegram->u8fct) continue;
+		if (xRange->u16RegAdd < telegram->u16RegAdd || (uint32_t)xRange->u16RegAdd + xRange->u16CoilsNo > u32End) continue;
+
+		copyCache(xRange->u8fct, xRange->u16reg, 0, telegram->u16reg, xRange->u16RegAdd - telegram->u16RegAdd, xRange->u16CoilsNo);
+		xRange->xUpdated = xTaskGetTickCount();
+		xRange->xValid = true;
+	}
+}
+#endif
+
+#if ENABLE_MB_PACING == 1
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Sets the silences kept after T3.5 before the queries to the slaves of xGuards,
+ * the other slaves get u32PaceGuardUs. The table stays owned by the application
+ *
+ * @ingroup setup
+ */
+void ModbusSetGuards(modbusHandler_t * modH, const modbusGuard_t *xGuards, uint8_t u8count)
+{
+	if (modH->uModbusType != MB_MASTER)
+	{
+		while(1);// error a slave cannot send queries as a master
+	}
+
+	modH->u8PaceGuardCount = u8count;
+	modH->xPaceGuards = xGuards;
+}
+#endif
+
+#if ENABLE_MB_SUBSCRIBE == 1
+/**
+ * @brief
+ * Compares the answer of a read with the subscriptions whose range it covers,
+ * FC23 with those of the holding registers it read
+ *
+ * @ingroup loop
+ */
+static void notifySubscribers(modbusHandler_t *modH, const modbus_t *telegram)
+{
+	uint8_t u8fct = telegram->u8fct;
+	uint16_t u16Start = telegram->u16RegAdd;
+	uint16_t u16Count = telegram->u16CoilsNo;
+	const uint16_t *u16Image = telegram->u16reg;
+
+	if (u8fct == MB_FC_READ_WRITE_MULTIPLE_REGISTERS)
+	{
+		u8fct = MB_FC_READ_REGISTERS;
+		u16Start = telegram->u16ReadAdd;
+		u16Count = telegram->u16ReadNo;
+		u16Image = telegram->u16ReadReg;
+	}
+	else if (u8fct < MB_FC_READ_COILS || u8fct > MB_FC_READ_INPUT_REGISTER)
+	{
+		return; // not a read of a table
+	}
+#if ENABLE_MB_GATHER == 1
+	if (telegram->xGather != NULL) return; // the answer went to the destinations of the gather list
+#endif
+	if (u16Image == NULL) return;
+
+	for (modbusSub_t *xSub = modH->xSubs; xSub != NULL; xSub = xSub->xNext)
+	{
+		if (xSub->u8id != telegram->u8id || xSub->u8fct != u8fct) continue;
+		if (xSub->u16Add < u16Start || (uint32_t)xSub->u16Add + xSub->u16Count > (uint32_t)u16Start + u16Count) continue;
+		compareSubscription(xSub, u16Image, xSub->u16Add - u16Start);
+	}
+}
+
+/**
+ * @brief
+ * Stores in u16Last the values of the answer image beyond the deadband of a
+ * subscription, from u16Offset of the image, and reports them
+ *
+ * @ingroup loop
+ */
+static void compareSubscription(modbusSub_t *xSub, const uint16_t *u16Image, uint16_t u16Offset)
+{
+	uint16_t u16First = 0;
+	uint16_t u16Crossed = 0;
+	bool xMoved;
+
+	for (uint16_t i = 0; i < xSub->u16Count; i++)
+	{
+		if (xSub->u8fct <= MB_FC_READ_DISCRETE_INPUT)
+		{
+			uint32_t u32Bit = (uint32_t)u16Offset + i;
+			bool xNew = bitRead(u16Image[ u32Bit / 16 ], u32Bit % 16);
+
+			xMoved = !xSub->xPrimed || xNew != bitRead(xSub->u16Last[ i / 16 ], i % 16);
+			if (xMoved) bitWrite(xSub->u16Last[ i / 16 ], i % 16, xNew);
+		}
+		else
+		{
+			uint16_t u16New = u16Image[ u16Offset + i ];
+			int32_t i32Diff = xSub->xSigned ? (int32_t)(int16_t)u16New - (int16_t)xSub->u16Last[ i ] :
+					(int32_t)u16New - (int32_t)xSub->u16Last[ i ];
+
+			if (i32Diff < 0) i32Diff = -i32Diff;
+			xMoved = !xSub->xPrimed || (i32Diff != 0 && (uint32_t)i32Diff > xSub->u16Deadband);
+			if (xMoved) xSub->u16Last[ i ] = u16New;
+		}
+		if (!xMoved) continue;
+		if (u16Crossed == 0) u16First = i;
+		u16Crossed++;
+	}
+	xSub->xPrimed = true;
+	if (u16Crossed == 0) return;
+
+	if (xSub->xCallback != NULL) xSub->xCallback(xSub, u16First, u16Crossed);
+	if (xSub->xQueue != NULL)
+	{
+		modbusSubEvent_t xEvent = { .xSub = xSub, .u16First = u16First, .u16Crossed = u16Crossed };
+
+		if (xQueueSend(xSub->xQueue, &xEvent, 0) != pdPASS) xSub->u16Dropped++;
+	}
+}
+#endif
+
+/**
+ * @brief
+ * Reports the result of a query to its completion callback or, for
+ * ModbusQuery(), to the task that queued it, and frees its entry of the
+ * pool. Polls of the table also record the result and count a missed deadline
+ *
+ * @ingroup loop
+ */
+static void notifyQueryResult(modbusHandler_t *modH, modbus_t *telegram, int8_t i8result)
+{
+#if ENABLE_MB_DEFERRED_DECODE == 1
+	waitDecoded(modH); // the answers handed over before are reported first
+#endif
+	closePoll(modH, i8result);
+
+#if ENABLE_MB_MERGE == 1
+	if (modH->u8Merged > 0)
+	{
+		// scatter the answer of a merged query and report it to every telegram
+		uint8_t u8Merged = modH->u8Merged;
+		modH->u8Merged = 0;
+		for (uint8_t i = 0; i < u8Merged; i++)
+		{
+			modbus_t *member = &modH->xMerged[i];
+#if MB_ENABLE_FC_RANGES == 1
+			if (i8result == ERR_OK_QUERY && telegram->u8fct != MB_FC_READ_RANGES)
+#else
+			if (i8result == ERR_OK_QUERY)
+#endif
+			{
+				memcpy(member->u16reg, &modH->u16MergeRegs[member->u16RegAdd - telegram->u16RegAdd],
+						member->u16CoilsNo * sizeof(uint16_t));
+			}
+			notifyQueryResult(modH, member, i8result);
+		}
+		releaseTelegram(modH, telegram);
+		return;
+	}
+#endif
+	deliverResult(modH, telegram, i8result, detachTelegram(modH, telegram));
+}
+
+/**
+ * @brief
+ * Records the result of the poll of the table in progress and counts a missed deadline
+ *
+ * @ingroup loop
+ */
+static void closePoll(modbusHandler_t *modH, int8_t i8result)
+{
+	modbusPoll_t *xPoll = modH->xPollCurrent;
+	if (xPoll != NULL)
+	{
+		modH->xPollCurrent = NULL;
+		xPoll->i8lastResult = i8result;
+		if ((int32_t)(xTaskGetTickCount() - xPoll->xDeadline) > 0) xPoll->u16Overruns++;
+#if ENABLE_MB_RBE == 1
+		if (xPoll->xOnChange != NULL && i8result == ERR_OK_QUERY && modH->u16Changed > 0)
+		{
+			xPoll->xOnChange(xPoll, modH->xChanges, modH->u16Changed);
+		}
+		modH->u16Changed = 0;
+#endif
+	}
+}
+
+/**
+ * @brief
+ * Reports the result of telegram to its callback or to the task waiting in
+ * ModbusQuery(), then frees its entry i8Slot of the pool, -1 for none
+ *
+ * @ingroup loop
+ */
+static void deliverResult(modbusHandler_t *modH, modbus_t *telegram, int8_t i8result, int8_t i8Slot)
+{
+#if ENABLE_MB_SUBSCRIBE == 1
+	if (i8result == ERR_OK_QUERY) notifySubscribers(modH, telegram);
+#endif
+#if ENABLE_MB_TYPED == 1
+	if (i8result == ERR_OK_QUERY) decodeValues(telegram);
+#endif
+
+	if (telegram->xCallback != NULL)
+	{
+		telegram->xCallback(telegram, i8result, telegram->pvContext);
+		if (i8Slot >= 0) freeTelegram(modH, (uint8_t)i8Slot);
+	}
+	else
+	{
+		// the entry may be queued again as soon as it is free
+		TaskHandle_t xTask = (TaskHandle_t)telegram->u32CurrentTask;
+
+		if (i8Slot >= 0) freeTelegram(modH, (uint8_t)i8Slot);
+		if (xTask != NULL) xTaskNotify(xTask, i8result, eSetValueWithOverwrite);
+	}
+}
+
+/**
+ * This method processes functions 1 & 2 (for master)
+ * This method puts the slave answer into master data buffer
+ *
+ * @ingroup register
+ */
+void get_FC1(modbusHandler_t *modH, modbusTransaction_t *xTrans)
+{
+    // whole bytes of the answer, starting at the first coil of the memory image
+    writeCoils(xTrans->u16Bits, 0, modH->u8Buffer[2] * 8, &modH->u8Buffer[3]);
+}
+
+/**
+ * This method processes functions 3 & 4 (for master)
+ * This method puts the slave answer into master data buffer
+ *
+ * @ingroup register
+ */
+void get_FC3(modbusHandler_t *modH, modbus_t *telegram, modbusTransaction_t *xTrans)
+{
+    (void)telegram; // used by the gather only
+#if ENABLE_MB_GATHER == 1
+    if (telegram->xGather != NULL)
+    {
+        gatherRegisters(telegram, &modH->u8Buffer[ 3 ], modH->u8Buffer[ 2 ] / 2);
+        return;
+    }
+#endif
+#if ENABLE_MB_RBE == 1
+    modbusPoll_t *xPoll = modH->xPollCurrent;
+
+    if (xPoll != NULL && xPoll->xOnChange != NULL)
+    {
+        compareRegisters(modH, xPoll, xTrans);
+        return;
+    }
+#endif
+    getRegisters(xTrans->u16Regs, &modH->u8Buffer[ 3 ], modH->u8Buffer[ 2 ] / 2);
+}
+
+#if ENABLE_MB_GATHER == 1
+/**
+ * @brief
+ * Checks that the gather list of a FC3, FC4 or FC23 telegram stays within the
+ * registers it reads
+ *
+ * @return false if the query cannot be sent
+ * @ingroup register
+ */
+static bool checkGather(const modbus_t *telegram)
+{
+	uint16_t u16regsno = (telegram->u8fct == MB_FC_READ_WRITE_MULTIPLE_REGISTERS) ? telegram->u16ReadNo : telegram->u16CoilsNo;
+
+	if (telegram->u8fct != MB_FC_READ_REGISTERS && telegram->u8fct != MB_FC_READ_INPUT_REGISTER &&
+		telegram->u8fct != MB_FC_READ_WRITE_MULTIPLE_REGISTERS) return false;
+
+	for (uint8_t i = 0; i < telegram->u8GatherCount; i++)
+	{
+		const modbusGather_t *xPart = &telegram->xGather[ i ];
+
+		if (xPart->pvDst == NULL || (uint32_t)xPart->u16Offset + xPart->u16Count > u16regsno) return false;
+	}
+	return true;
+}
+
+/**
+ * @brief
+ * Writes each sub-range of the gather list from the answer straight to its
+ * destination, then converts it in place to its type. A string already is in
+ * frame order and is copied as it is
+ *
+ * @ingroup register
+ */
+static void gatherRegisters(const modbus_t *telegram, const uint8_t *u8src, uint16_t u16regsno)
+{
+	for (uint8_t i = 0; i < telegram->u8GatherCount; i++)
+	{
+		const modbusGather_t *xPart = &telegram->xGather[ i ];
+		const uint8_t *u8part = &u8src[ 2 * xPart->u16Offset ];
+
+		if ((uint32_t)xPart->u16Offset + xPart->u16Count > u16regsno) continue;
+
+		if (xPart->u8Type == MB_TYPE_STRING && (xPart->u8Order & MB_WORD_HL_SWAP) == 0)
+		{
+			memcpy(xPart->pvDst, u8part, xPart->u16Count * 2);
+		}
+		else
+		{
+			getRegisters((uint16_t *)xPart->pvDst, u8part, xPart->u16Count);
+			ModbusRegsToValues(xPart->pvDst, (const uint16_t *)xPart->pvDst, xPart->u16Count,
+					(mb_type_t)xPart->u8Type, (mb_wordorder_t)xPart->u8Order);
+		}
+	}
+}
+
+#if ENABLE_MB_REDUNDANT == 1
+/**
+ * @brief
+ * Writes each sub-range of the gather list from a register image of the
+ * answer, for the answers of a redundant pair read into a scratch buffer
+ *
+ * @ingroup register
+ */
+static void gatherImage(const modbus_t *telegram, const uint16_t *u16src)
+{
+	for (uint8_t i = 0; i < telegram->u8GatherCount; i++)
+	{
+		const modbusGather_t *xPart = &telegram->xGather[ i ];
+
+		ModbusRegsToValues(xPart->pvDst, &u16src[ xPart->u16Offset ], xPart->u16Count,
+				(mb_type_t)xPart->u8Type, (mb_wordorder_t)xPart->u8Order);
+	}
+}
+#endif
+#endif
+
+/**
+ * This method processes function 20 (for master)
+ * This method puts the records of every sub-request into its memory image,
+ * checkFileAnswer() already matched the answer with the telegram
+ *
+ * @ingroup register
+ */
+static void get_FC20(modbusHandler_t *modH, modbus_t *telegram)
+{
+    uint16_t u16Pos = 3;
+
+    for (uint16_t i = 0; i < telegram->u16CoilsNo; i++)
+    {
+        const modbusFileRec_t *xRec = &telegram->xRecords[ i ];
+
+        getRegisters(xRec->u16regs, &modH->u8Buffer[ u16Pos + 2 ], xRec->u16Length);
+        u16Pos += 2 + xRec->u16Length * 2;
+    }
+}
+
+#if MB_ENABLE_FC_RANGES == 1
+/**
+ * This method processes MB_FC_READ_RANGES (for master)
+ * This method puts the registers of every range into its memory image,
+ * matchAnswer() already checked the byte count against the ranges
+ *
+ * @ingroup register
+ */
+static void get_FCRanges(modbusHandler_t *modH, modbus_t *telegram)
+{
+    uint16_t u16Pos = 3;
+
+    for (uint16_t i = 0; i < telegram->u16CoilsNo; i++)
+    {
+        const modbusRange_t *xRange = &telegram->xRanges[ i ];
+
+        getRegisters(xRange->u16regs, &modH->u8Buffer[ u16Pos ], xRange->u16Count);
+        u16Pos += xRange->u16Count * 2;
+    }
+}
+#endif
+
+#if MB_MASTER_DELTA
+/**
+ * This method processes MB_FC_READ_DELTA (for master)
+ * This method applies the whole block or its runs to the image of the cached
+ * range, keeps the generation of the slave and copies the range to the
+ * telegram image, checkDeltaAnswer() already checked the runs
+ *
+ * @ingroup register
+ */
+static void get_FCDelta(modbusHandler_t *modH, modbusTransaction_t *xTrans)
+{
+    modbusCache_t *xRange = modH->xDeltaCache;
+    const uint8_t *u8data = &modH->u8Buffer[ DLT_DATA ];
+    uint16_t u16Bytes = modH->u8Buffer[ DLT_BYTE_CNT ];
+    uint16_t u16Pos, u16Off;
+    uint8_t u8Regs;
+
+    if (modH->u8Buffer[ DLT_MODE ] == MB_DELTA_FULL)
+    {
+        getRegisters(xRange->u16reg, u8data, xRange->u16CoilsNo);
+    }
+    else
+    {
+        for (u16Pos = 0; u16Pos < u16Bytes; u16Pos += 3 + u8Regs * 2)
+        {
+            u16Off = word( u8data[ u16Pos ], u8data[ u16Pos + 1 ] );
+            u8Regs = u8data[ u16Pos + 2 ];
+            getRegisters(&xRange->u16reg[ u16Off ], &u8data[ u16Pos + 3 ], u8Regs);
+        }
+    }
+    xRange->u32Gen = ((uint32_t)word( modH->u8Buffer[ DLT_ANS_GEN ], modH->u8Buffer[ DLT_ANS_GEN + 1 ] ) << 16) |
+    		word( modH->u8Buffer[ DLT_ANS_GEN + 2 ], modH->u8Buffer[ DLT_ANS_GEN + 3 ] );
+
+    if (xTrans->u16Regs != NULL) copyCache(xRange->u8fct, xTrans->u16Regs, 0, xRange->u16reg, 0, xRange->u16CoilsNo);
+}
+#endif
+
+/**
+ * This method processes function 24 (for master)
+ * This method puts the FIFO count in u16reg[0] and the entries after it
+ *
+ * @ingroup register
+ */
+static void get_FC24(modbusHandler_t *modH, modbus_t *telegram)
+{
+    uint16_t u16Count = word( modH->u8Buffer[ 4 ], modH->u8Buffer[ 5 ] );
+
+    telegram->u16reg[ 0 ] = u16Count;
+    getRegisters(&telegram->u16reg[ 1 ], &modH->u8Buffer[ 6 ], u16Count);
+}
+
+/**
+ * This method processes function 43, MEI type 14 (for master)
+ * This method puts the more follows and next object id bytes in u16reg[0], the
+ * conformity level and the number of objects in u16reg[1], then the objects as
+ * they came, {id, length, value}, two bytes per register with the first one in
+ * the high byte. u16CoilsNo is the size of u16reg, longer answers are cut
+ *
+ * @ingroup register
+ */
+static void get_FC43(modbusHandler_t *modH, modbus_t *telegram)
+{
+    uint16_t u16Bytes = modH->u16BufferSize - 8 - (((modH->xTransport->u8Flags & MB_TP_MBAP) != 0) ? 0 : 2);
+
+    if (telegram->u16CoilsNo < 2) return;
+    if (u16Bytes > (telegram->u16CoilsNo - 2) * 2) u16Bytes = (telegram->u16CoilsNo - 2) * 2;
+
+    telegram->u16reg[ 0 ] = word( modH->u8Buffer[ 5 ], modH->u8Buffer[ 6 ] );
+    telegram->u16reg[ 1 ] = word( modH->u8Buffer[ 4 ], modH->u8Buffer[ 7 ] );
+    for (uint16_t i = 0; i < u16Bytes; i++)
+    {
+        uint8_t u8Byte = modH->u8Buffer[ 8 + i ];
+        uint16_t *u16dst = &telegram->u16reg[ 2 + i / 2 ];
+
+        *u16dst = (i % 2) ? word( highByte( *u16dst ), u8Byte ) : word( u8Byte, 0 );
+    }
+}
+
+/**
+ * @brief
+ * Checks that a FC43/14 answer holds the number of objects it announces
+ *
+ * @return false for a malformed answer
+ * @ingroup buffer
+ */
+static bool checkDevIdAnswer(modbusHandler_t *modH)
+{
+    uint16_t u16Pos = 8;
+    uint16_t u16Crc = ((modH->xTransport->u8Flags & MB_TP_MBAP) != 0) ? 0 : 2;
+    uint16_t u16End = modH->u16BufferSize - u16Crc;
+
+    if (modH->u16BufferSize < 8 + u16Crc || modH->u8Buffer[ 2 ] != MB_MEI_DEVICE_ID) return false;
+    for (uint8_t i = 0; i < modH->u8Buffer[ 7 ]; i++)
+    {
+        if (u16Pos + 2 > u16End) return false;
+        u16Pos += 2 + modH->u8Buffer[ u16Pos + 1 ];
+    }
+    return u16Pos == u16End;
+}
+
+/**
+ * @brief
+ * Checks that a FC20 answer carries the records of every sub-request of the
+ * telegram, in its order
+ *
+ * @return false for a malformed answer
+ * @ingroup buffer
+ */
+static bool checkFileAnswer(modbusHandler_t *modH, modbus_t *telegram)
+{
+    uint16_t u16Pos = 3;
+    uint16_t u16End = 3 + modH->u8Buffer[ 2 ];
+
+    if (u16End > modH->u16BufferSize) return false;
+
+    for (uint16_t i = 0; i < telegram->u16CoilsNo; i++)
+    {
+        uint16_t u16Length = telegram->xRecords[ i ].u16Length;
+
+        if (u16Pos + 2 + u16Length * 2 > u16End) return false;
+        if (modH->u8Buffer[ u16Pos ] != 1 + u16Length * 2 || modH->u8Buffer[ u16Pos + 1 ] != MB_FILE_REF_TYPE) return false;
+        u16Pos += 2 + u16Length * 2;
+    }
+    return u16Pos == u16End;
+}
+
+/**
+ * @brief
+ * Checks that the byte count of a FC24 answer matches its FIFO count, of
+ * MB_FIFO_MAX entries at most
+ *
+ * @return false for a malformed answer
+ * @ingroup buffer
+ */
+static bool checkFifoAnswer(modbusHandler_t *modH)
+{
+    uint16_t u16Bytes = word( modH->u8Buffer[ 2 ], modH->u8Buffer[ 3 ] );
+    uint16_t u16Count = word( modH->u8Buffer[ 4 ], modH->u8Buffer[ 5 ] );
+
+    return modH->u16BufferSize >= 6 && u16Count <= MB_FIFO_MAX && u16Bytes == 2 + u16Count * 2 &&
+    		4 + u16Bytes <= modH->u16BufferSize;
+}
+
+#if MB_MASTER_DELTA
+/**
+ * @brief
+ * Checks the data of a MB_FC_READ_DELTA answer against the cached range: the
+ * whole block, or runs inside it filling the byte count exactly. matchAnswer()
+ * already checked the byte count against the frame size
+ *
+ * @return false for a malformed answer
+ * @ingroup buffer
+ */
+static bool checkDeltaAnswer(modbusHandler_t *modH, const modbusCache_t *xRange)
+{
+    const uint8_t *u8data = &modH->u8Buffer[ DLT_DATA ];
+    uint16_t u16Bytes = modH->u8Buffer[ DLT_BYTE_CNT ];
+    uint16_t u16Pos = 0, u16Off;
+    uint8_t u8Regs;
+
+    if (modH->u8Buffer[ DLT_MODE ] == MB_DELTA_FULL) return u16Bytes == xRange->u16CoilsNo * 2;
+    if (modH->u8Buffer[ DLT_MODE ] != MB_DELTA_RUNS) return false;
+
+    while (u16Pos < u16Bytes)
+    {
+        if (u16Pos + 3 > u16Bytes) return false;
+        u16Off = word( u8data[ u16Pos ], u8data[ u16Pos + 1 ] );
+        u8Regs = u8data[ u16Pos + 2 ];
+        if (u8Regs == 0 || (uint32_t)u16Off + u8Regs > xRange->u16CoilsNo) return false;
+        u16Pos += 3 + u8Regs * 2;
+    }
+    return u16Pos == u16Bytes;
+}
+
+/**
+ * @brief
+ * Cached range read by telegram as MB_FC_READ_DELTA: a serial FC3 or FC4 read
+ * of exactly a range with xDelta set. Prebuilt frames, gathered reads and report
+ * by exception polls are sent as they are
+ *
+ * @return the range, NULL to send the telegram itself
+ * @ingroup loop
+ */
+static modbusCache_t *findDeltaCache(modbusHandler_t *modH, const modbus_t *telegram)
+{
+    if (modH->xTransport->u8Flags & MB_TP_MBAP) return NULL;
+    if (telegram->u8fct != MB_FC_READ_REGISTERS && telegram->u8fct != MB_FC_READ_INPUT_REGISTER) return NULL;
+#if ENABLE_MB_PREBUILT == 1
+    if (telegram->u8Frame != NULL) return NULL;
+#endif
+#if ENABLE_MB_GATHER == 1
+    if (telegram->xGather != NULL) return NULL;
+#endif
+#if ENABLE_MB_RBE == 1
+    if (modH->xPollCurrent != NULL && modH->xPollCurrent->xOnChange != NULL) return NULL;
+#endif
+
+    for (uint8_t i = 0; i < modH->u8CacheCount; i++)
+    {
+        modbusCache_t *xRange = &modH->xCache[i];
+
+        if (xRange->xDelta && xRange->u8id == telegram->u8id && xRange->u8fct == telegram->u8fct &&
+            xRange->u16RegAdd == telegram->u16RegAdd && xRange->u16CoilsNo == telegram->u16CoilsNo) return xRange;
+    }
+    return NULL;
+}
+
+/**
+ * @brief
+ * Writes the MB_FC_READ_DELTA query of a cached range to u8dst, without CRC
+ *
+ * @return bytes written
+ * @ingroup loop
+ */
+static uint16_t buildDeltaPdu(uint8_t *u8dst, const modbusCache_t *xRange)
+{
+    u8dst[ ID ]        = xRange->u8id;
+    u8dst[ FUNC ]      = MB_FC_READ_DELTA;
+    u8dst[ DLT_TABLE ] = xRange->u8fct;
+    u8dst[ DLT_ADD_HI ] = highByte(xRange->u16RegAdd );
+    u8dst[ DLT_ADD_LO ] = lowByte( xRange->u16RegAdd );
+    u8dst[ DLT_NB_HI ] = highByte(xRange->u16CoilsNo );
+    u8dst[ DLT_NB_LO ] = lowByte( xRange->u16CoilsNo );
+    u8dst[ DLT_GEN ]     = (uint8_t)(xRange->u32Gen >> 24);
+    u8dst[ DLT_GEN + 1 ] = (uint8_t)(xRange->u32Gen >> 16);
+    u8dst[ DLT_GEN + 2 ] = (uint8_t)(xRange->u32Gen >> 8);
+    u8dst[ DLT_GEN + 3 ] = (uint8_t)xRange->u32Gen;
+    return DLT_REQUEST;
+}
+#endif
+
+#if ENABLE_MB_RBE == 1
+/**
+ * This method processes functions 3, 4 & 23 of a report by exception poll (for master)
+ * This method compares each register of the answer with the telegram image while it
+ * stores it and lists the ones that changed
+ *
+ * @ingroup register
+ */
+static void compareRegisters(modbusHandler_t *modH, modbusPoll_t *xPoll, modbusTransaction_t *xTrans)
+{
+    uint16_t u16regsno = modH->u8Buffer[ 2 ] / 2;
+    uint16_t u16Add = (xPoll->telegram.u8fct == MB_FC_READ_WRITE_MULTIPLE_REGISTERS) ?
+    		xPoll->telegram.u16ReadAdd : xPoll->telegram.u16RegAdd;
+    const uint8_t *u8src = &modH->u8Buffer[ 3 ];
+
+    modH->u16Changed = 0;
+    for (uint16_t i = 0; i < u16regsno; i++)
+    {
+        uint16_t u16New = word(u8src[ 2 * i ], u8src[ 2 * i + 1 ]);
+        uint16_t u16Old = xTrans->u16Regs[ i ];
+
+        if (u16New == u16Old) continue;
+
+        xTrans->u16Regs[ i ] = u16New;
+        if (modH->u16Changed < MB_RBE_CHANGES)
+        {
+            modbusChange_t *xChange = &modH->xChanges[ modH->u16Changed ];
+            xChange->u16Add = u16Add + i;
+            xChange->u16Old = u16Old;
+            xChange->u16New = u16New;
+        }
+        modH->u16Changed++;
+    }
+}
+#endif
+
+
+
+/**
+ * @brief
+ * Compares the header of the frame in u8Buffer with the query in progress, before
+ * its CRC is computed: the unit ID, the function code and the length that follows
+ * from the byte count or the function code, the echoed address of a write. The late
+ * answer of a timed out query or the traffic of another master does not match
+ *
+ * @return true if the frame can be the answer of telegram
+ * @ingroup buffer
+ */
+static bool matchAnswer(modbusHandler_t *modH, const modbus_t *telegram)
+{
+    const uint8_t *u8Buf = modH->u8Buffer;
+    uint16_t u16Size = modH->u16BufferSize; // with the CRC, or the LRC and its pad byte
+    uint16_t u16Bytes;
+    uint8_t u8fct = telegram->u8fct;
+
+#if MB_MASTER_DELTA
+    if (modH->xDeltaCache != NULL) u8fct = MB_FC_READ_DELTA; // the read went out as the delta of its range
+#endif
+    if (u16Size < 5 || u8Buf[ ID ] != telegram->u8id || (u8Buf[ FUNC ] & 0x7F) != u8fct) return false;
+    if (u8Buf[ FUNC ] & 0x80) return u16Size == 5; // exception code and CRC
+#if MB_MASTER_DELTA
+    if (u8fct == MB_FC_READ_DELTA) return u16Size > DLT_BYTE_CNT && u16Size == DLT_DATA + u8Buf[ DLT_BYTE_CNT ] + 2;
+#endif
+
+    switch (telegram->u8fct)
+    {
+    case MB_FC_READ_COILS:
+    case MB_FC_READ_DISCRETE_INPUT:
+        u16Bytes = (telegram->u16CoilsNo + 7) / 8;
+        break;
+    case MB_FC_READ_REGISTERS:
+    case MB_FC_READ_INPUT_REGISTER:
+        u16Bytes = telegram->u16CoilsNo * 2;
+        break;
+    case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+        u16Bytes = telegram->u16ReadNo * 2;
+        break;
+#if MB_ENABLE_FC_RANGES == 1
+    case MB_FC_READ_RANGES:
+        u16Bytes = 0;
+        for (uint16_t i = 0; i < telegram->u16CoilsNo; i++) u16Bytes += telegram->xRanges[ i ].u16Count * 2;
+        break;
+#endif
+    case MB_FC_WRITE_MULTIPLE_COILS:
+    case MB_FC_WRITE_MULTIPLE_REGISTERS:
+        if (u16Size == 8 && word( u8Buf[ NB_HI ], u8Buf[ NB_LO ] ) != telegram->u16CoilsNo) return false;
+        /* fall through */
+    case MB_FC_WRITE_COIL:
+    case MB_FC_WRITE_REGISTER:
+    case MB_FC_DIAGNOSTICS:
+        return u16Size == 8 && word( u8Buf[ ADD_HI ], u8Buf[ ADD_LO ] ) == telegram->u16RegAdd;
+    case MB_FC_MASK_WRITE_REGISTER:
+        return u16Size == 10 && word( u8Buf[ ADD_HI ], u8Buf[ ADD_LO ] ) == telegram->u16RegAdd;
+    default:
+        return true; // FC20, FC24 and FC43 are checked after the CRC
+    }
+    return u8Buf[ 2 ] == u16Bytes && u16Size == 5 + u16Bytes;
+}
+
+/**
+ * @brief
+ * Drops the frame in u8Buffer that was not the answer of the query in progress,
+ * the reception goes on and the timeout keeps running
+ *
+ * @ingroup buffer
+ */
+static void dropStrayFrame(modbusHandler_t *modH)
+{
+#if ENABLE_MB_ERR_STATS == 1
+	modH->xErrStats.u32Stray++;
+#endif
+	modH->u16BufferSize = 0;
+	if (modH->xTransport->release != NULL)
+	{
+		modH->xTransport->release(modH);
+	}
+}
+
+/**
+ * @brief
+ * This method validates master incoming messages
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup buffer
+ */
+uint8_t validateAnswer(modbusHandler_t *modH, modbus_t *telegram)
+{
+    // check message crc vs calculated crc, TCP and UDP have none
+    if ( (modH->xTransport->u8Flags & MB_TP_MBAP) == 0 && !checkCRC(modH) )
+    {
+    	modH->u16errCnt ++;
+    	MB_COUNT_ERR(modH, ERR_BAD_CRC);
+        return ERR_BAD_CRC;
+    }
+
+    // check exception
+    if ((modH->u8Buffer[ FUNC ] & 0x80) != 0)
+    {
+    	modH->u16errCnt ++;
+    	MB_COUNT_ERR(modH, ERR_EXCEPTION);
+    	MB_COUNT_EXC(modH, modH->u8Buffer[ 2 ]);
+        return ERR_EXCEPTION;
+    }
+
+    // check fct code, the answer carries the one of the query
+#if MB_MASTER_DELTA
+    if (modH->xDeltaCache != NULL)
+    {
+        if (modH->u8Buffer[FUNC] != MB_FC_READ_DELTA)
+        {
+            modH->u16errCnt ++;
+            MB_COUNT_EXC(modH, EXC_FUNC_CODE);
+            return EXC_FUNC_CODE;
+        }
+        if (!checkDeltaAnswer(modH, modH->xDeltaCache))
+        {
+            modH->u16errCnt ++;
+            MB_COUNT_ERR(modH, ERR_BAD_SIZE);
+            return ERR_BAD_SIZE;
+        }
+        return 0;
+    }
+#endif
+    if (modH->u8Buffer[FUNC] != telegram->u8fct)
+    {
+    	modH->u16errCnt ++;
+    	MB_COUNT_EXC(modH, EXC_FUNC_CODE);
+        return EXC_FUNC_CODE;
+    }
+
+    if ((telegram->u8fct == MB_FC_READ_FILE_RECORD && !checkFileAnswer(modH, telegram)) ||
+    	(telegram->u8fct == MB_FC_READ_FIFO_QUEUE && !checkFifoAnswer(modH)) ||
+    	(telegram->u8fct == MB_FC_ENCAPSULATED && !checkDevIdAnswer(modH)))
+    {
+    	modH->u16errCnt ++;
+    	MB_COUNT_ERR(modH, ERR_BAD_SIZE);
+        return ERR_BAD_SIZE;
+    }
+
+    return 0; // OK, no exception code thrown
+}
+#endif
+
+
+#if ENABLE_RX_RESYNC == 1
+/**
+ * @brief
+ * Looks for complete frames in the bytes of an overflowed RX ring: a unit ID
+ * received by the handler, a function code and a matching CRC. The last one
+ * is moved to u8Buffer, the bytes around it are dropped
+ *
+ * @return frame size, 0 if the bytes hold no complete frame
+ * @ingroup buffer
+ */
+static int16_t resyncRxRing(modbusHandler_t *modH, uint16_t u16count)
+{
+	modbusRingBuffer_t *xRing = &modH->xBufferRX;
+	uint16_t u16tail = xRing->u16tail;
+	uint16_t u16Start = 0, u16Size = 0;
+	uint16_t u16crc, s, e;
+
+	__DMB(); // read the bytes after the head
+	for (s = 0; s + 4 <= u16count; s++)
+	{
+		uint8_t u8id = xRing->uxBuffer[(u16tail + s) & (MAX_BUFFER_RX - 1)];
+		uint8_t u8fct = xRing->uxBuffer[(u16tail + s + 1) & (MAX_BUFFER_RX - 1)];
+
+		if (!isRxAddress(modH, u8id) || (u8fct & 0x7F) == 0) continue;
+
+		u16crc = calcCRCByte(calcCRCByte(0xFFFF, u8id), u8fct);
+		for (e = s + 2; e < u16count && e - s < MAX_BUFFER; e++)
+		{
+			u16crc = calcCRCByte(u16crc, xRing->uxBuffer[(u16tail + e) & (MAX_BUFFER_RX - 1)]);
+			if (u16crc == 0 && e - s >= 3) break;
+		}
+		if (e < u16count && e - s < MAX_BUFFER)
+		{
+			// a frame, the next one starts after it
+			u16Start = s;
+			u16Size = e - s + 1;
+			s = e;
+		}
+	}
+	if (u16Size == 0) return 0;
+
+	xRing->u16tail = u16tail + u16Start;
+	modH->u16BufferSize = RingGetNBytes(xRing, modH->u8Buffer, u16Size);
+	RingClear(xRing);
+#if ENABLE_RX_CRC == 1
+	modH->u16FrameCRC = 0;
+#endif
+	modH->u16InCnt++;
+	MB_COUNT_ERR(modH, ERR_BUFF_OVERFLOW); // bytes were still lost
+#if ENABLE_MB_ERR_STATS == 1
+	modH->xErrStats.u32Resync++;
+#endif
+#if ENABLE_MB_STATS == 1
+	updateHist(&modH->xStatFrame, modH->u16BufferSize);
+#endif
+	MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, ERR_BUFF_OVERFLOW, MB_EVF_CRC_OK);
+	return modH->u16BufferSize;
+}
+#endif
+
+/**
+ * @brief
+ * This method moves Serial buffer data to the Modbus u8Buffer, the
+ * recvFrame operation of USART_HW. With ENABLE_RX_RESYNC an overflowed
+ * ring still yields its last complete frame
+ *
+ * @return buffer size if OK, ERR_BUFF_OVERFLOW if u16BufferSize >= MAX_BUFFER
+ * @ingroup buffer
+ */
+static int16_t getRxRing(modbusHandler_t *modH)
+{
+
+    int16_t i16result;
+    uint16_t u16count;
+
+#if ENABLE_RX_CRC == 1
+    // take the CRC with the byte count, the RX interrupt may be storing the next frame already
+    taskENTER_CRITICAL();
+    u16count = RingCountBytes(&modH->xBufferRX);
+    modH->u16FrameCRC = modH->u16RxCRC;
+    modH->u16RxCRC = 0xFFFF;
+    taskEXIT_CRITICAL();
+#else
+    u16count = RingCountBytes(&modH->xBufferRX);
+#endif
+
+	if (modH->xBufferRX.overflow || u16count > MAX_BUFFER)
+    {
+#if ENABLE_RX_RESYNC == 1
+		i16result = resyncRxRing(modH, u16count);
+		if (i16result > 0) return i16result;
+#endif
+       	RingClear(&modH->xBufferRX); // clean up the overflowed buffer
+       	i16result =  ERR_BUFF_OVERFLOW;
+       	MB_LOG_EVENT(modH, MB_EVT_RX, NULL, u16count, ERR_BUFF_OVERFLOW, 0);
+    }
+	else
+	{
+		modH->u16BufferSize = RingGetNBytes(&modH->xBufferRX, modH->u8Buffer, u16count);
+		modH->u16InCnt++;
+#if ENABLE_MB_STATS == 1
+		updateHist(&modH->xStatFrame, modH->u16BufferSize);
+#endif
+#if ENABLE_RX_CRC == 1
+		MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, 0,
+				(modH->u16FrameCRC == 0) ? MB_EVF_CRC_OK : MB_EVF_CRC_BAD);
+#else
+		MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, 0, 0);
+#endif
+		i16result = modH->u16BufferSize;
+	}
+
+    return i16result;
+}
+
+#if ENABLE_MB_ASCII == 1
+/**
+ * @brief
+ * recvFrame operation of ASCII_HW. The RX interrupt already decoded the hex
+ * pairs into the ring, the frame ends with its LRC and gets a pad byte, so
+ * the core finds its two byte check field at the usual place
+ *
+ * @return buffer size if OK, ERR_BUFF_OVERFLOW if the frame does not fit
+ * @ingroup buffer
+ */
+static int16_t getRxAscii(modbusHandler_t *modH)
+{
+	int16_t i16result = getRxRing(modH);
+
+	if (i16result <= 0) return i16result;
+	if (modH->u16BufferSize >= MAX_BUFFER) return ERR_BUFF_OVERFLOW;
+
+	modH->u8Buffer[ modH->u16BufferSize++ ] = 0;
+	return modH->u16BufferSize;
+}
+#endif
+
+#if ENABLE_USART_DMA == 1
+/**
+ * @brief
+ * recvFrame operation of USART_HW_DMA, the DMA restarts at the beginning of
+ * uxBuffer for every frame and u16head holds the frame length
+ *
+ * @return buffer size
+ * @ingroup buffer
+ */
+static int16_t getRxDMA(modbusHandler_t *modH)
+{
+#if ENABLE_MB_RX_QUEUE == 1
+	if (modH->xBufferRX.overflow)
+	{
+		modH->xBufferRX.overflow = false; // at least one frame did not fit in xRxQueue
+		modH->u16BufferSize = 0;
+		MB_LOG_EVENT(modH, MB_EVT_RX, NULL, 0, ERR_BUFF_OVERFLOW, 0);
+		return ERR_BUFF_OVERFLOW;
+	}
+	modH->u16BufferSize = (uint16_t)xMessageBufferReceive(modH->xRxQueue, modH->u8Buffer, MAX_BUFFER, 0);
+	if (modH->u16BufferSize == 0) return 0;
+#else
+	modH->u16BufferSize = modH->xBufferRX.u16head;
+	invalidateDCache(modH->xBufferRX.uxBuffer, MAX_BUFFER_RX);
+#if ENABLE_USART_DMA_INPLACE != 1
+	memcpy(modH->u8Buffer, modH->xBufferRX.uxBuffer, modH->u16BufferSize);
+#endif
+#endif
+	modH->u16InCnt++;
+#if ENABLE_MB_STATS == 1
+	updateHist(&modH->xStatFrame, modH->u16BufferSize);
+#endif
+	MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, 0, 0);
+	return modH->u16BufferSize;
+}
+#endif
+
+#if ENABLE_USB_CDC == 1
+/**
+ * @brief
+ * recvFrame operation of USB_CDC_HW, the packets were received in place in u8Buffer.
+ * A frame filling the buffer without a valid CRC overflowed
+ *
+ * @return buffer size if OK, ERR_BUFF_OVERFLOW if the frame does not fit in u8Buffer
+ * @ingroup buffer
+ */
+static int16_t getRxUsb(modbusHandler_t *modH)
+{
+	if (modH->u16UsbRxLen > MAX_BUFFER - MB_USB_PACKET && modH->u16UsbRxCRC != 0)
+	{
+		modH->u16BufferSize = 0;
+		return ERR_BUFF_OVERFLOW;
+	}
+	modH->u16BufferSize = modH->u16UsbRxLen;
+	modH->u16InCnt++;
+#if ENABLE_MB_STATS == 1
+	updateHist(&modH->xStatFrame, modH->u16BufferSize);
+#endif
+	MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, 0, 0);
+	return modH->u16BufferSize;
+}
+#endif
+
+#if ENABLE_MB_BLE == 1
+/**
+ * @brief
+ * recvFrame operation of BLE_HW. The PDU was written behind u8Buffer[ ID ], the ID of
+ * the handler and the CRC make an RTU frame of it for the engine
+ *
+ * @return buffer size if OK, ERR_BUFF_OVERFLOW if the PDU does not fit in u8Buffer
+ * @ingroup buffer
+ */
+static int16_t getRxBle(modbusHandler_t *modH)
+{
+	uint16_t u16crc;
+
+	if (modH->xBleRxOver)
+	{
+		modH->u16BufferSize = 0;
+		return ERR_BUFF_OVERFLOW;
+	}
+	modH->u8Buffer[ ID ] = modH->u8id;
+	modH->u16BufferSize = modH->u16BleRxLen + 1;
+	u16crc = calcCRC(modH->u8Buffer, modH->u16BufferSize);
+	modH->u8Buffer[ modH->u16BufferSize++ ] = u16crc >> 8;
+	modH->u8Buffer[ modH->u16BufferSize++ ] = u16crc & 0x00ff;
+	modH->u16InCnt++;
+#if ENABLE_MB_STATS == 1
+	updateHist(&modH->xStatFrame, modH->u16BufferSize);
+#endif
+	MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, 0, 0);
+	return modH->u16BufferSize;
+}
+#endif
+
+
+
+
+
+#if ENABLE_USART_DMA == 1
+/**
+ * @brief
+ * Tells if the DMA has not written over a frame of the circular RX ring yet: less
+ * than MAX_BUFFER_RX bytes came after its first one. The position of the DMA is
+ * read from its counter, the RX events only come every half ring. Checked once the
+ * frame is copied, a frame overwritten during the copy is dropped as well
+ *
+ * @return true if the frame copied from the ring is complete
+ * @ingroup buffer
+ */
+static bool keptRxFrame(modbusHandler_t *modH, const modbusFrame_t *xFrame)
+{
+	uint32_t u32Total;
+	uint16_t u16Dma;
+
+	taskENTER_CRITICAL(); // u32RxTotal and u16RxPos of the same RX event
+	u16Dma = (MAX_BUFFER_RX - __HAL_DMA_GET_COUNTER(modH->port->hdmarx)) % MAX_BUFFER_RX;
+	u32Total = modH->u32RxTotal + (u16Dma + MAX_BUFFER_RX - modH->u16RxPos) % MAX_BUFFER_RX;
+	taskEXIT_CRITICAL();
+
+	return u32Total - xFrame->u32Start <= MAX_BUFFER_RX;
+}
+
+/**
+ * @brief
+ * This method takes the oldest frame descriptor queued by the circular DMA.
+ * Frames addressed to other slaves are dropped directly in the RX ring,
+ * the rest is moved to u8Buffer with at most two block copies. The request
+ * is not parsed in the ring: its answer is built over it in u8Buffer, and an
+ * answer longer than the request would overwrite the next frames of the ring
+ *
+ * @return frame size, 0 if there was no frame for us, ERR_BUFF_OVERFLOW if it does not fit in u8Buffer
+ * @ingroup buffer
+ */
+static int16_t getRxFrame(modbusHandler_t *modH)
+{
+	uint8_t u8tail = modH->u8RxFrameTail;
+	uint16_t u16First;
+
+	modH->u16BufferSize = 0;
+	if(modH->xBufferRX.overflow)
+	{
+		modH->xBufferRX.overflow = false; // at least one frame was lost because all the descriptors were in use
+		MB_LOG_EVENT(modH, MB_EVT_RX, NULL, 0, ERR_BUFF_OVERFLOW, 0);
+		return ERR_BUFF_OVERFLOW;
+	}
+
+	if(u8tail == modH->u8RxFrameHead)
+	{
+		return 0;
+	}
+
+	modbusFrame_t xFrame = modH->xRxFrames[u8tail];
+	modH->u8RxFrameTail = (u8tail + 1) % MAX_RX_FRAMES; // release the descriptor
+	modH->u16InCnt++;
+#if ENABLE_MB_MONITOR == 1
+	modH->u32MonEnd = xFrame.u32End - modH->u32MonChar; // the idle event comes one character after the last stop bit
+#endif
+#if ENABLE_MB_STATS == 1
+	updateHist(&modH->xStatFrame, xFrame.u16Length);
+#endif
+
+	if(xFrame.u16Length > MAX_BUFFER)
+	{
+		MB_LOG_EVENT(modH, MB_EVT_RX, NULL, xFrame.u16Length, ERR_BUFF_OVERFLOW, 0);
+		return ERR_BUFF_OVERFLOW;
+	}
+
+	invalidateDCache(modH->xBufferRX.uxBuffer, MAX_BUFFER_RX);
+	if(modH->uModbusType == MB_SLAVE && modH->xBufferRX.uxBuffer[xFrame.u16Offset] != modH->u8id)
+	{
+		return 0; // not for us, no need to copy it
+	}
+
+	u16First = MAX_BUFFER_RX - xFrame.u16Offset;
+	if(u16First >= xFrame.u16Length)
+	{
+		memcpy(modH->u8Buffer, &modH->xBufferRX.uxBuffer[xFrame.u16Offset], xFrame.u16Length);
+	}
+	else
+	{
+		// the frame wraps around the end of the ring
+		memcpy(modH->u8Buffer, &modH->xBufferRX.uxBuffer[xFrame.u16Offset], u16First);
+		memcpy(&modH->u8Buffer[u16First], modH->xBufferRX.uxBuffer, xFrame.u16Length - u16First);
+	}
+	if(!keptRxFrame(modH, &xFrame))
+	{
+		// the DMA wrapped over the frame while it waited for the task
+		MB_LOG_EVENT(modH, MB_EVT_RX, NULL, xFrame.u16Length, ERR_BUFF_OVERFLOW, 0);
+		return ERR_BUFF_OVERFLOW;
+	}
+	modH->u16BufferSize = xFrame.u16Length;
+	MB_LOG_EVENT(modH, MB_EVT_RX, modH->u8Buffer, modH->u16BufferSize, 0, 0);
+
+	return modH->u16BufferSize;
+}
+#endif
+
+#if ENABLE_USART_DMA_INPLACE == 1
+/**
+ * @brief
+ * Restarts the reception of the next frame into u8Buffer. The RX event
+ * callback leaves the DMA stopped after a frame for the handler, the task
+ * calls this once it does not need u8Buffer anymore
+ *
+ * @ingroup buffer
+ */
+static void restartRxDMA(modbusHandler_t *modH)
+{
+	flushDCache(modH->u8Buffer, MAX_BUFFER); // the answer built in it
+	while(HAL_UARTEx_ReceiveToIdle_DMA(modH->port, modH->u8Buffer, MB_RX_DMA_FIRST) != HAL_OK)
+	{
+		HAL_UART_AbortReceive(modH->port);
+	}
+	__HAL_DMA_DISABLE_IT(modH->port->hdmarx, DMA_IT_HT); // we don't need half-transfer interrupt
+}
+#endif
+
+
+/**
+ * @brief
+ * This method checks the CRC of the frame in u8Buffer
+ * If the CRC was already computed in the RX interrupt only the result is checked,
+ * an ASCII frame has an LRC instead
+ *
+ * @return true if the CRC is correct
+ * @ingroup modH Modbus handler
+ */
+bool checkCRC(modbusHandler_t *modH)
+{
+#if ENABLE_RX_CRC == 1
+	if (modH->xTransport->u8Flags & MB_TP_RX_CRC)
+	{
+		// the CRC of a frame including its own CRC field is always zero
+		return modH->u16FrameCRC == 0;
+	}
+#endif
+#if ENABLE_MB_ASCII == 1
+	if (modH->xTransport->u8Flags & MB_TP_LRC)
+	{
+		// LRC then the pad byte of getRxAscii()
+		return modH->u16BufferSize >= 3 &&
+				calcLRC(modH->u8Buffer, modH->u16BufferSize - 2) == modH->u8Buffer[modH->u16BufferSize - 2];
+	}
+#endif
+
+	if (modH->u16BufferSize < 3) return false; // no room for a CRC after the ID
+	uint16_t u16MsgCRC = ((modH->u8Buffer[modH->u16BufferSize - 2] << 8)
+			| modH->u8Buffer[modH->u16BufferSize - 1]); // combine the crc Low & High bytes
+
+	return calcCRC( modH->u8Buffer,  modH->u16BufferSize-2 ) == u16MsgCRC;
+}
+
+
+#if MB_ENABLE_SLAVE == 1
+/**
+ * @brief
+ * This method validates slave incoming messages
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup modH Modbus handler
+ */
+uint8_t validateRequest(modbusHandler_t *modH)
+{
+	// check message crc vs calculated crc, TCP and UDP have none
+	    if ( (modH->xTransport->u8Flags & MB_TP_MBAP) == 0 && !checkCRC(modH) )
+	    {
+	       		modH->u16errCnt ++;
+	       		MB_COUNT_ERR(modH, ERR_BAD_CRC);
+	       		return ERR_BAD_CRC;
 	    }
-	    break;
 
-	case MB_FC_WRITE_MULTIPLE_REGISTERS:
-	    modH->u8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
-	    modH->u8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-	    modH->u8Buffer[ BYTE_CNT ]    = (uint8_t) ( telegram.u16CoilsNo * 2 );
-	    modH->u8BufferSize = 7;
 
-	    for (uint16_t i=0; i< telegram.u16CoilsNo; i++)
-	    {
 
-	        modH->u8Buffer[  modH->u8BufferSize ] = highByte(  telegram.u16reg[ i ] );
-	        modH->u8BufferSize++;
-	        modH->u8Buffer[  modH->u8BufferSize ] = lowByte( telegram.u16reg[ i ] );
-	        modH->u8BufferSize++;
-	    }
-	    break;
-	}
+	    // check fct code, one lookup in the function table
+	    const modbusFunction_t *xFunction = getFunction(modH->u8Buffer[FUNC]);
+	    if (xFunction == NULL)
+	    {
+	    	modH->u16errCnt ++;
+	        return EXC_FUNC_CODE;
+	    }
+
+	    // check start address & nb range
+	    if (xFunction->validate != NULL)
+	    {
+	    	return xFunction->validate(modH);
+	    }
+	    return 0; // OK, no exception code thrown
+
+}
+#endif
+
+#if MB_SLAVE_COIL_RANGE
+
+/**
+ * @brief
+ * This method validates the coil range of functions 1, 2 & 15
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup discrete
+ */
+static uint8_t validate_FC1(modbusHandler_t *modH)
+{
+	uint16_t u16size = (modH->u8Buffer[ FUNC ] == MB_FC_READ_DISCRETE_INPUT) ? modH->u16regCoilsRO_size : modH->u16regCoils_size;
+	uint16_t u16Add = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]);
+	uint16_t u16Coils = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]);
+	uint16_t u16NRegs;
+
+	if (u16Coils == 0) return EXC_REGS_QUANT;
+	// verify address range, the word of the last coil must be in the table
+	if ((uint32_t)u16Add + u16Coils - 1 >= (uint32_t)u16size * 16) return EXC_ADDR_RANGE;
+
+	//verify answer frame size in bytes
+
+	u16NRegs = u16Coils / 8;
+	if(u16Coils % 8) u16NRegs++;
+	// the coils of function 15 must all be in the frame before writeCoils() reads them
+	if (modH->u8Buffer[ FUNC ] == MB_FC_WRITE_MULTIPLE_COILS && modH->u16BufferSize < (BYTE_CNT + 1) + u16NRegs + 2) return EXC_REGS_QUANT;
+	u16NRegs = u16NRegs + 5; // adding the header  and CRC ( Slave address + Function code  + number of data bytes to follow + 2-byte CRC )
+	if(u16NRegs > MAX_BUFFER) return EXC_REGS_QUANT;
+
+	return 0;
+}
+#endif
+
+#if ENABLE_MB_DIAG_REGS == 1
+
+/**
+ * @brief
+ * Tells if an FC4 request falls in the diagnostics block, which hides the input
+ * registers of its range in every unit
+ *
+ * @ingroup register
+ */
+static bool isDiagRange(uint8_t u8table, uint16_t u16Add, uint16_t u16Count)
+{
+	return u8table == DB_INPUT_REGISTERS && u16Add >= MB_DIAG_START &&
+			(uint32_t)u16Add + u16Count <= (uint32_t)MB_DIAG_START + MB_DIAG_SIZE;
+}
+
+#if ENABLE_MB_ERR_STATS == 1 || ENABLE_MB_STATS == 1 || ENABLE_MB_NODE_STATS == 1
+static void setDiag32(uint16_t *u16diag, uint8_t u8off, uint32_t u32val)
+{
+	u16diag[ u8off ] = (uint16_t)(u32val >> 16);
+	u16diag[ u8off + 1 ] = (uint16_t)u32val;
+}
+#endif
+
+/**
+ * @brief
+ * Fills the answer with u16Count registers of the diagnostics block from
+ * address u16Add, the values are sampled at the request
+ *
+ * @ingroup register
+ */
+static void putDiagnostics(modbusHandler_t *modH, uint8_t *u8dst, uint16_t u16Add, uint16_t u16Count)
+{
+	uint16_t u16diag[ MB_DIAG_REGS ] = { 0 };
+	uint32_t u32stack = ModbusGetStackSpace(modH);
+
+	u16diag[ MB_DIAG_IN_CNT ] = modH->u16InCnt;
+	u16diag[ MB_DIAG_OUT_CNT ] = modH->u16OutCnt;
+	u16diag[ MB_DIAG_ERR_CNT ] = modH->u16errCnt;
+	u16diag[ MB_DIAG_STACK ] = (u32stack > 0xFFFF) ? 0xFFFF : (uint16_t)u32stack;
+#if ENABLE_MB_ERR_STATS == 1
+	const modbusErrStats_t *xErr = &modH->xErrStats;
+	uint32_t u32exc = 0;
+
+	for (uint8_t i = 0; i < MB_EXC_TYPES; i++) u32exc += xErr->u32Exc[ i ];
+	setDiag32(u16diag, MB_DIAG_RX_OVERFLOW, xErr->u32Err[ MB_ERR_INDEX(ERR_BUFF_OVERFLOW) ]);
+	setDiag32(u16diag, MB_DIAG_CRC_ERR, xErr->u32Err[ MB_ERR_INDEX(ERR_BAD_CRC) ]);
+	setDiag32(u16diag, MB_DIAG_SIZE_ERR, xErr->u32Err[ MB_ERR_INDEX(ERR_BAD_SIZE) ]);
+	setDiag32(u16diag, MB_DIAG_EXCEPTIONS, u32exc);
+	setDiag32(u16diag, MB_DIAG_UART_ERR, xErr->u32Overrun + xErr->u32Framing + xErr->u32Noise + xErr->u32Parity);
+#endif
+#if ENABLE_MB_STATS == 1
+	setDiag32(u16diag, MB_DIAG_LAT_COUNT, modH->xStatLatency.u32Count);
+	setDiag32(u16diag, MB_DIAG_LAT_MIN, modH->xStatLatency.u32Min);
+	setDiag32(u16diag, MB_DIAG_LAT_MAX, modH->xStatLatency.u32Max);
+	setDiag32(u16diag, MB_DIAG_LAT_MEAN, ModbusHistMean(&modH->xStatLatency));
+#endif
+#if ENABLE_MB_RUNTIME == 1
+	sampleRuntime(modH, &modH->xRtDiag, &u16diag[ MB_DIAG_TASK_LOAD ], &u16diag[ MB_DIAG_ISR_LOAD ]);
+#endif
+
+#if ENABLE_MB_NODE_STATS == 1
+	uint16_t u16Off = u16Add - MB_DIAG_START;
+
+	if (u16Off < MB_DIAG_REGS)
+	{
+		uint16_t u16Base = (u16Off + u16Count > MB_DIAG_REGS) ? MB_DIAG_REGS - u16Off : u16Count;
+
+		putRegisters(u8dst, &u16diag[ u16Off ], u16Base);
+		u8dst += u16Base * 2;
+		u16Off += u16Base;
+		u16Count -= u16Base;
+	}
+	if (u16Count > 0) putNodeDiagnostics(modH->xNodeMaster, u8dst, u16Off - MB_DIAG_NODES, u16Count);
+#else
+	putRegisters(u8dst, &u16diag[ u16Add - MB_DIAG_START ], u16Count);
+#endif
+}
+
+#if ENABLE_MB_NODE_STATS == 1
+/**
+ * @brief
+ * Fills the answer with u16Count registers of the node table of master from
+ * offset u16Off, each entry copied once in a critical section
+ *
+ * @ingroup register
+ */
+static void putNodeDiagnostics(modbusHandler_t *master, uint8_t *u8dst, uint16_t u16Off, uint16_t u16Count)
+{
+	uint16_t u16diag[ MB_DIAG_NODE_REGS ];
+	modbusNodeStats_t xNode;
+
+	for (uint16_t u16Entry = u16Off / MB_DIAG_NODE_REGS; u16Count > 0; u16Entry++)
+	{
+		uint16_t u16First = u16Off % MB_DIAG_NODE_REGS;
+		uint16_t u16Regs = (u16Count < MB_DIAG_NODE_REGS - u16First) ? u16Count : MB_DIAG_NODE_REGS - u16First;
+
+		memset(&xNode, 0, sizeof(xNode));
+		if (master != NULL)
+		{
+			taskENTER_CRITICAL();
+			if (u16Entry < master->u8NodeCount) xNode = master->xNodes[ u16Entry ];
+			taskEXIT_CRITICAL();
+		}
+		u16diag[ MB_DIAG_NODE_ID ] = xNode.u8id;
+		setDiag32(u16diag, MB_DIAG_NODE_QUERIES, xNode.u32Queries);
+		setDiag32(u16diag, MB_DIAG_NODE_TIMEOUTS, xNode.u32Timeouts);
+		setDiag32(u16diag, MB_DIAG_NODE_CRC_ERR, xNode.u32CrcErrors);
+		setDiag32(u16diag, MB_DIAG_NODE_EXCEPTIONS, xNode.u32Exceptions);
+		u16diag[ MB_DIAG_NODE_MEAN ] = (xNode.u32Mean > 0xFFFF) ? 0xFFFF : (uint16_t)xNode.u32Mean;
+		u16diag[ MB_DIAG_NODE_JITTER ] = (xNode.u32Jitter > 0xFFFF) ? 0xFFFF : (uint16_t)xNode.u32Jitter;
+		u16diag[ MB_DIAG_NODE_LOST ] = xNode.u8Lost;
+
+		putRegisters(u8dst, &u16diag[ u16First ], u16Regs);
+		u8dst += u16Regs * 2;
+		u16Off += u16Regs;
+		u16Count -= u16Regs;
+	}
+}
+#endif
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC8)
+
+/**
+ * @brief
+ * This method validates the sub-function of function 8, the counters take a 0 data field
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FC8(modbusHandler_t *modH)
+{
+	uint16_t u16sub = word( modH->u8Buffer[ 2 ], modH->u8Buffer[ 3 ]);
+
+	if (u16sub == MB_FC8_ECHO) return 0; // any data, serveRequest() checked the minimum size
+#if ENABLE_MB_LISTEN_ONLY == 1
+	if (u16sub == MB_FC8_RESTART || u16sub == MB_FC8_LISTEN)
+	{
+		uint16_t u16data = word( modH->u8Buffer[ 4 ], modH->u8Buffer[ 5 ]);
+
+		// a restart takes 0x0000 or 0xFF00, the listen only mode 0x0000
+		if (modH->u16BufferSize != 8 || (u16data != 0 && (u16sub != MB_FC8_RESTART || u16data != 0xFF00))) return EXC_REGS_QUANT;
+		return 0;
+	}
+#endif
+	if (u16sub < MB_FC8_CLEAR || u16sub > MB_FC8_OVERRUN) return EXC_FUNC_CODE;
+	if (modH->u16BufferSize != 8 || modH->u8Buffer[ 4 ] != 0 || modH->u8Buffer[ 5 ] != 0) return EXC_REGS_QUANT;
+
+	return 0;
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC5)
+
+/**
+ * @brief
+ * This method validates the coil address of function 5
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup discrete
+ */
+static uint8_t validate_FC5(modbusHandler_t *modH)
+{
+	uint16_t u16AdRegs = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]) / 16;
+	if (u16AdRegs >= modH->u16regCoils_size) return EXC_ADDR_RANGE; // word of the coil
+
+	return 0;
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC6)
+
+/**
+ * @brief
+ * This method validates the register address of function 6
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FC6(modbusHandler_t *modH)
+{
+	uint16_t u16AdRegs = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]);
+	if (mapRegisters(modH, DB_HOLDING_REGISTER, u16AdRegs, 1) == NULL) return EXC_ADDR_RANGE;
+#if MB_SLAVE_ACCESS
+	uint8_t u8exception = checkWriteAccess(modH, u16AdRegs, 1);
+	if (u8exception != 0) return u8exception;
+#endif
+#if MB_SLAVE_LIMITS
+	return checkLimits(modH, u16AdRegs, 1, &modH->u8Buffer[ NB_HI ]);
+#else
+	return 0;
+#endif
+}
+#endif
+
+#if MB_SLAVE_REG_RANGE
+
+/**
+ * @brief
+ * This method validates the register range of functions 3, 4 & 16
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FC3(modbusHandler_t *modH)
+{
+	uint8_t u8table = (modH->u8Buffer[ FUNC ] == MB_FC_READ_INPUT_REGISTER) ? DB_INPUT_REGISTERS : DB_HOLDING_REGISTER;
+	uint16_t u16AdRegs = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]);
+	uint16_t u16NRegs = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]);
+	if (u16NRegs == 0) return EXC_REGS_QUANT;
+	// the registers of function 16 must all be in the frame before getTable() reads them
+	if (modH->u8Buffer[ FUNC ] == MB_FC_WRITE_MULTIPLE_REGISTERS &&
+			modH->u16BufferSize < (BYTE_CNT + 1) + (uint32_t)u16NRegs * 2 + 2) return EXC_REGS_QUANT;
+#if ENABLE_MB_DIAG_REGS == 1
+	if (!isDiagRange(u8table, u16AdRegs, u16NRegs))
+#endif
+	if (mapRegisters(modH, u8table, u16AdRegs, u16NRegs) == NULL) return EXC_ADDR_RANGE;
+#if MB_SLAVE_ACCESS
+	if (modH->u8Buffer[ FUNC ] == MB_FC_WRITE_MULTIPLE_REGISTERS)
+	{
+		uint8_t u8exception = checkWriteAccess(modH, u16AdRegs, u16NRegs);
+		if (u8exception != 0) return u8exception;
+	}
+#endif
+#if MB_SLAVE_LIMITS
+	// the whole payload is checked before process_FC16() stores the first register
+	if (modH->u8Buffer[ FUNC ] == MB_FC_WRITE_MULTIPLE_REGISTERS)
+	{
+		uint8_t u8exception = checkLimits(modH, u16AdRegs, u16NRegs, &modH->u8Buffer[ BYTE_CNT + 1 ]);
+		if (u8exception != 0) return u8exception;
+	}
+#endif
+
+#if ENABLE_MB_TX_STREAM == 1
+	// a streamed answer is never whole in u8Buffer
+	if (modH->u8Buffer[ FUNC ] != MB_FC_WRITE_MULTIPLE_REGISTERS && u16NRegs <= 125 &&
+			canStream(modH, u8table, u16AdRegs, u16NRegs)) return 0;
+#endif
+
+	//verify answer frame size in bytes
+	u16NRegs = u16NRegs*2 + 5; // adding the header  and CRC
+	if ( u16NRegs > MAX_BUFFER ) return EXC_REGS_QUANT;
+
+	return 0;
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC20)
+
+/**
+ * @brief
+ * This method validates the sub-requests of function 20. The answer is built in
+ * u8Buffer while the sub-requests are still read, both must fit it together
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FC20(modbusHandler_t *modH)
+{
+	uint8_t u8bytes = modH->u8Buffer[ 2 ];
+	uint16_t u16Answer = 3 + 2; // ID, function, byte count and CRC
+	uint16_t u16Count;
+	const uint8_t *u8sub;
+
+	if (u8bytes < REC_DATA || u8bytes > 0xF5 || (u8bytes % REC_DATA) != 0) return EXC_REGS_QUANT;
+	if (modH->u16BufferSize < 3 + u8bytes + 2) return EXC_REGS_QUANT;
+
+	for (u8sub = &modH->u8Buffer[ 3 ]; u8sub < &modH->u8Buffer[ 3 + u8bytes ]; u8sub += REC_DATA)
+	{
+		u16Count = word( u8sub[ REC_LEN_HI ], u8sub[ REC_LEN_LO ] );
+		u16Answer += 2 + u16Count * 2;
+		if (u16Count == 0 || u16Answer - 5 > 0xF5 || u16Answer + u8bytes > MAX_BUFFER) return EXC_REGS_QUANT;
+		if (findFile(modH, u8sub, false) == NULL) return EXC_ADDR_RANGE;
+	}
+
+	return 0;
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC21)
+
+/**
+ * @brief
+ * This method validates the sub-requests of function 21, they must fill the
+ * byte count exactly
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FC21(modbusHandler_t *modH)
+{
+	uint8_t u8bytes = modH->u8Buffer[ 2 ];
+	uint16_t u16Count;
+	uint16_t i;
+
+	if (u8bytes < REC_DATA + 2 || u8bytes > 0xFB) return EXC_REGS_QUANT;
+	if (modH->u16BufferSize < 3 + u8bytes + 2) return EXC_REGS_QUANT;
+
+	for (i = 3; i < 3 + u8bytes; i += REC_DATA + u16Count * 2)
+	{
+		if (i + REC_DATA > 3 + u8bytes) return EXC_REGS_QUANT;
+		u16Count = word( modH->u8Buffer[ i + REC_LEN_HI ], modH->u8Buffer[ i + REC_LEN_LO ] );
+		if (u16Count == 0 || i + REC_DATA + u16Count * 2 > 3 + u8bytes) return EXC_REGS_QUANT;
+		if (findFile(modH, &modH->u8Buffer[ i ], true) == NULL) return EXC_ADDR_RANGE;
+	}
+
+	return 0;
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC24)
+
+/**
+ * @brief
+ * Queue of a FC24 FIFO pointer address
+ *
+ * @return the queue, NULL for an illegal address
+ * @ingroup register
+ */
+static modbusFifo_t *findFifo(modbusHandler_t *modH, uint16_t u16Address)
+{
+	for (uint8_t i = 0; i < modH->u8FifoCount; i++)
+	{
+		if (modH->xFifos[i].u16Address == u16Address) return &modH->xFifos[i];
+	}
+	return NULL;
+}
+
+/**
+ * @brief
+ * This method validates the FIFO pointer address of function 24
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FC24(modbusHandler_t *modH)
+{
+	if (modH->u16BufferSize < (ADD_LO + 1) + 2) return EXC_REGS_QUANT; // the address and the CRC
+
+	if (findFifo(modH, word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] )) == NULL) return EXC_ADDR_RANGE;
+
+	return 0;
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC43)
+
+/**
+ * @brief
+ * Identification object u8Id
+ *
+ * @return the object, NULL if the slave has none with this id
+ * @ingroup register
+ */
+static const modbusDevIdObj_t *findDevId(modbusHandler_t *modH, uint8_t u8Id)
+{
+	for (uint8_t i = 0; i < modH->u8DevIdCount; i++)
+	{
+		if (modH->xDevId[i].u8Id == u8Id) return &modH->xDevId[i];
+	}
+	return NULL;
+}
+
+/**
+ * @brief
+ * This method validates the MEI type and the read device id code of function 43
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FC43(modbusHandler_t *modH)
+{
+	if (modH->u16BufferSize < 5 + 2) return EXC_REGS_QUANT; // MEI type, code, object id and the CRC
+	if (modH->u8Buffer[ 2 ] != MB_MEI_DEVICE_ID) return EXC_FUNC_CODE;
+	if (modH->u8Buffer[ 3 ] < MB_DEVID_BASIC || modH->u8Buffer[ 3 ] > MB_DEVID_SPECIFIC) return EXC_REGS_QUANT;
+	if (modH->u8DevIdCount == 0) return EXC_ADDR_RANGE;
+	if (modH->u8Buffer[ 3 ] == MB_DEVID_SPECIFIC && findDevId(modH, modH->u8Buffer[ 4 ]) == NULL) return EXC_ADDR_RANGE;
+
+	return 0;
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC22)
+
+/**
+ * @brief
+ * This method validates the register address of function 22
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FC22(modbusHandler_t *modH)
+{
+	if (modH->u16BufferSize < (OR_LO + 1) + 2) return EXC_REGS_QUANT; // both masks and the CRC
+
+	uint16_t u16AdRegs = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]);
+	if (mapRegisters(modH, DB_HOLDING_REGISTER, u16AdRegs, 1) == NULL) return EXC_ADDR_RANGE;
+#if MB_SLAVE_ACCESS
+	return checkWriteAccess(modH, u16AdRegs, 1);
+#else
+	return 0;
+#endif
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC23)
+
+/**
+ * @brief
+ * This method validates the read and write blocks of function 23
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FC23(modbusHandler_t *modH)
+{
+	uint16_t u16ReadAdd = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]);
+	uint16_t u16ReadNo = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]);
+	uint16_t u16WriteAdd = word( modH->u8Buffer[ WR_ADD_HI ], modH->u8Buffer[ WR_ADD_LO ]);
+	uint16_t u16WriteNo = word( modH->u8Buffer[ WR_NB_HI ], modH->u8Buffer[ WR_NB_LO ]);
+
+	// quantities allowed by the specification, and a write block matching the frame
+	if (u16ReadNo == 0 || u16ReadNo > 125 || u16WriteNo == 0 || u16WriteNo > 121) return EXC_REGS_QUANT;
+	if (modH->u8Buffer[ WR_BYTE_CNT ] != u16WriteNo * 2) return EXC_REGS_QUANT;
+	if (modH->u16BufferSize < (WR_BYTE_CNT + 1) + u16WriteNo * 2 + 2) return EXC_REGS_QUANT;
+
+	if (mapRegisters(modH, DB_HOLDING_REGISTER, u16ReadAdd, u16ReadNo) == NULL) return EXC_ADDR_RANGE;
+	if (mapRegisters(modH, DB_HOLDING_REGISTER, u16WriteAdd, u16WriteNo) == NULL) return EXC_ADDR_RANGE;
+#if MB_SLAVE_ACCESS
+	uint8_t u8exception = checkWriteAccess(modH, u16WriteAdd, u16WriteNo);
+	if (u8exception != 0) return u8exception;
+#endif
+#if MB_SLAVE_LIMITS
+	return checkLimits(modH, u16WriteAdd, u16WriteNo, &modH->u8Buffer[ WR_BYTE_CNT + 1 ]);
+#else
+	return 0;
+#endif
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC_RANGES)
+
+/**
+ * @brief
+ * This method validates the table and the ranges of MB_FC_READ_RANGES. The answer
+ * is built in u8Buffer while the ranges are still read, both must fit it together,
+ * and the registers of all the ranges make an FC3 answer of 125 registers at most
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FCRanges(modbusHandler_t *modH)
+{
+	uint8_t u8table = (modH->u8Buffer[ RNG_TABLE ] == MB_FC_READ_INPUT_REGISTER) ? DB_INPUT_REGISTERS : DB_HOLDING_REGISTER;
+	uint8_t u8bytes = modH->u8Buffer[ RNG_BYTE_CNT ];
+	uint16_t u16Regs = 0;
+	uint16_t u16Add, u16Count;
+
+	if (modH->u16BufferSize < RNG_FIRST + 2) return EXC_REGS_QUANT;
+	if (modH->u8Buffer[ RNG_TABLE ] != MB_FC_READ_REGISTERS && modH->u8Buffer[ RNG_TABLE ] != MB_FC_READ_INPUT_REGISTER) return EXC_REGS_QUANT;
+	if (u8bytes == 0 || (u8bytes % MB_RANGE_SIZE) != 0) return EXC_REGS_QUANT;
+	if (modH->u16BufferSize < RNG_FIRST + u8bytes + 2) return EXC_REGS_QUANT;
+
+	for (const uint8_t *u8rng = &modH->u8Buffer[ RNG_FIRST ]; u8rng < &modH->u8Buffer[ RNG_FIRST + u8bytes ]; u8rng += MB_RANGE_SIZE)
+	{
+		u16Add = word( u8rng[ 0 ], u8rng[ 1 ] );
+		u16Count = word( u8rng[ 2 ], u8rng[ 3 ] );
+		if (u16Count == 0 || u16Count > MB_MERGE_REGS) return EXC_REGS_QUANT;
+		u16Regs += u16Count;
+		if (u16Regs > MB_MERGE_REGS || 3 + u16Regs * 2 + 2 + u8bytes > MAX_BUFFER) return EXC_REGS_QUANT;
+#if ENABLE_MB_DIAG_REGS == 1
+		if (!isDiagRange(u8table, u16Add, u16Count))
+#endif
+		if (mapRegisters(modH, u8table, u16Add, u16Count) == NULL) return EXC_ADDR_RANGE;
+	}
+
+	return 0;
+}
+#endif
+
+#if MB_SLAVE_DELTAS
+
+/* true if the generation u16Stamp is after u16Since, both within half the 16 bit range */
+static inline bool isNewerGen(uint16_t u16Stamp, uint16_t u16Since)
+{
+	return (int16_t)(u16Stamp - u16Since) > 0;
+}
+
+/**
+ * @brief
+ * Block of ModbusSetDeltas() named by the table, address and count of a
+ * MB_FC_READ_DELTA request
+ *
+ * @return the block, NULL if the slave has none matching exactly
+ * @ingroup register
+ */
+static modbusDeltaBlock_t *findDelta(modbusHandler_t *modH, const uint8_t *u8req)
+{
+	uint8_t u8table = (u8req[ DLT_TABLE ] == MB_FC_READ_INPUT_REGISTER) ? DB_INPUT_REGISTERS : DB_HOLDING_REGISTER;
+	uint16_t u16Add = word( u8req[ DLT_ADD_HI ], u8req[ DLT_ADD_LO ] );
+	uint16_t u16Count = word( u8req[ DLT_NB_HI ], u8req[ DLT_NB_LO ] );
+
+	for (uint8_t i = 0; i < modH->u8DeltaCount; i++)
+	{
+		modbusDeltaBlock_t *xBlock = &modH->xDeltas[i];
+
+		if (xBlock->u8table == u8table && xBlock->u16Add == u16Add && xBlock->u16Count == u16Count) return xBlock;
+	}
+	return NULL;
+}
+
+/**
+ * @brief
+ * This method validates the table and the block of MB_FC_READ_DELTA
+ *
+ * @return 0 if OK, EXCEPTION if anything fails
+ * @ingroup register
+ */
+static uint8_t validate_FCDelta(modbusHandler_t *modH)
+{
+	const modbusDeltaBlock_t *xBlock;
+
+	if (modH->u16BufferSize < DLT_REQUEST + 2) return EXC_REGS_QUANT;
+	if (modH->u8Buffer[ DLT_TABLE ] != MB_FC_READ_REGISTERS && modH->u8Buffer[ DLT_TABLE ] != MB_FC_READ_INPUT_REGISTER) return EXC_REGS_QUANT;
+
+	xBlock = findDelta(modH, modH->u8Buffer);
+	if (xBlock == NULL || mapRegisters(modH, xBlock->u8table, xBlock->u16Add, xBlock->u16Count) == NULL) return EXC_ADDR_RANGE;
+
+	return 0;
+}
+#endif
+
+#if MB_ENABLE_SLAVE == 1
+
+/**
+ * @brief
+ * Keeps the tables of the handler as the unit of u8id, they are loaded back
+ * when the handler switches from another unit
+ *
+ * @ingroup register
+ */
+static void saveUnit(modbusHandler_t *modH)
+{
+	modbusUnit_t *xUnit = &modH->xUnitMain;
+
+	xUnit->u8id = modH->u8id;
+	xUnit->u16regsHR = modH->u16regsHR;
+	xUnit->u16regHR_size = modH->u16regHR_size;
+	xUnit->u16regsRO = modH->u16regsRO;
+	xUnit->u16regRO_size = modH->u16regRO_size;
+	xUnit->u16regsCoils = modH->u16regsCoils;
+	xUnit->u16regCoils_size = modH->u16regCoils_size;
+	xUnit->u16regsCoilsRO = modH->u16regsCoilsRO;
+	xUnit->u16regCoilsRO_size = modH->u16regCoilsRO_size;
+	xUnit->xSegHR = modH->xSegHR;
+	xUnit->u8SegHR_count = modH->u8SegHR_count;
+	xUnit->xSegRO = modH->xSegRO;
+	xUnit->u8SegRO_count = modH->u8SegRO_count;
+	modH->xUnitActive = xUnit;
+}
+
+/**
+ * @brief
+ * Loads the tables of the unit addressed by a request into the handler,
+ * the processing of the request then works on them unchanged
+ *
+ * @return true if the slave answers for u8id
+ * @ingroup register
+ */
+static bool selectUnit(modbusHandler_t *modH, uint8_t u8id)
+{
+	const modbusUnit_t *xUnit = NULL;
+
+	if (modH->u8UnitCount == 0) return u8id == modH->u8id;
+
+	if (u8id == modH->u8id)
+	{
+		xUnit = &modH->xUnitMain;
+	}
+	for (uint8_t i = 0; xUnit == NULL && i < modH->u8UnitCount; i++)
+	{
+		if (modH->xUnits[i].u8id == u8id) xUnit = &modH->xUnits[i];
+	}
+	if (xUnit == NULL) return false;
+
+	if (xUnit != modH->xUnitActive)
+	{
+		modH->u16regsHR = xUnit->u16regsHR;
+		modH->u16regHR_size = xUnit->u16regHR_size;
+		modH->u16regsRO = xUnit->u16regsRO;
+		modH->u16regRO_size = xUnit->u16regRO_size;
+		modH->u16regsCoils = xUnit->u16regsCoils;
+		modH->u16regCoils_size = xUnit->u16regCoils_size;
+		modH->u16regsCoilsRO = xUnit->u16regsCoilsRO;
+		modH->u16regCoilsRO_size = xUnit->u16regCoilsRO_size;
+		modH->xSegHR = xUnit->xSegHR;
+		modH->u8SegHR_count = xUnit->u8SegHR_count;
+		modH->xSegRO = xUnit->xSegRO;
+		modH->u8SegRO_count = xUnit->u8SegRO_count;
+		modH->xUnitActive = xUnit;
+	}
+	return true;
+}
+
+/**
+ * @brief
+ * Checks that the segments of a sparse map are sorted by address and do not overlap
+ *
+ * @return true if the map is valid or not used
+ * @ingroup register
+ */
+static bool checkSegments(const modbusSegment_t *xSeg, uint8_t u8count)
+{
+	if (xSeg == NULL) return true;
+
+	for (uint8_t i = 0; i < u8count; i++)
+	{
+		if (xSeg[i].u16regs == NULL || xSeg[i].u16Length == 0) return false;
+		if ((uint32_t)xSeg[i].u16Start + xSeg[i].u16Length > 0x10000) return false;
+		if (i > 0 && (uint32_t)xSeg[i - 1].u16Start + xSeg[i - 1].u16Length > xSeg[i].u16Start) return false;
+	}
+	return true;
+}
+#endif
+
+#if MB_SLAVE_REGISTERS
+
+/**
+ * @brief
+ * Binary searches the sparse map of the holding or input register table for
+ * the segment holding u16Count registers from Modbus address u16Add
+ *
+ * @param u8table DB_HOLDING_REGISTER or DB_INPUT_REGISTERS
+ * @return segment, NULL if the table has no sparse map or the range is not in one segment
+ * @ingroup register
+ */
+static const modbusSegment_t *findSegment(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count)
+{
+	const modbusSegment_t *xSeg = (u8table == DB_INPUT_REGISTERS) ? modH->xSegRO : modH->xSegHR;
+	uint32_t u32End = (uint32_t)u16Add + u16Count;
+
+	if (xSeg == NULL) return NULL;
+
+	// last segment starting at or before u16Add
+	uint8_t u8lo = 0;
+#if ENABLE_MB_MAP_LOOKUP == 1
+	// the generated map computes it from constants, the others are searched
+	u8lo = ModbusMapLookup(xSeg, u16Add);
+	if (u8lo == 0xFF)
+#endif
+	{
+		uint8_t u8hi = (u8table == DB_INPUT_REGISTERS) ? modH->u8SegRO_count : modH->u8SegHR_count;
+		u8lo = 0;
+		while (u8lo < u8hi)
+		{
+			uint8_t u8mid = (u8lo + u8hi) / 2;
+			if (xSeg[ u8mid ].u16Start <= u16Add) u8lo = u8mid + 1;
+			else u8hi = u8mid;
+		}
+	}
+	if (u8lo == 0) return NULL;
+
+	xSeg = &xSeg[ u8lo - 1 ];
+	if (u32End > (uint32_t)xSeg->u16Start + xSeg->u16Length) return NULL; // a hole or the next segment
+
+	return xSeg;
+}
+
+/**
+ * @brief
+ * Finds the memory of u16Count registers from Modbus address u16Add in the
+ * holding or input register table, in its sparse map when there is one
+ *
+ * @param u8table DB_HOLDING_REGISTER or DB_INPUT_REGISTERS
+ * @return pointer to the first register, NULL if the range is not mapped
+ * @ingroup register
+ */
+static uint16_t *mapRegisters(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count)
+{
+	uint32_t u32End = (uint32_t)u16Add + u16Count;
+
+	if ((u8table == DB_INPUT_REGISTERS ? modH->xSegRO : modH->xSegHR) == NULL)
+	{
+		// contiguous table from address 0
+		if (u8table == DB_INPUT_REGISTERS)
+		{
+			return (u32End <= modH->u16regRO_size) ? &modH->u16regsRO[ u16Add ] : NULL;
+		}
+		return (u32End <= modH->u16regHR_size) ? &modH->u16regsHR[ u16Add ] : NULL;
+	}
+
+	const modbusSegment_t *xSeg = findSegment(modH, u8table, u16Add, u16Count);
+	if (xSeg == NULL) return NULL;
+
+	return &xSeg->u16regs[ u16Add - xSeg->u16Start ];
+}
+
+/**
+ * @brief
+ * Tells if the registers from u16Add are kept big endian, in a segment with xWireOrder
+ *
+ * @return true if mapRegisters() points to frame ordered registers
+ * @ingroup register
+ */
+static bool isWireOrder(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count)
+{
+#if ENABLE_MB_WIRE_ORDER == 1
+	const modbusSegment_t *xSeg = findSegment(modH, u8table, u16Add, u16Count);
+
+	return xSeg != NULL && xSeg->xWireOrder;
+#else
+	(void)modH;
+	(void)u8table;
+	(void)u16Add;
+	(void)u16Count;
+	return false;
+#endif
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4) || MB_SLAVE_FC(MB_ENABLE_FC23) || \
+	MB_SLAVE_FC(MB_ENABLE_FC_RANGES) || MB_SLAVE_FC(MB_ENABLE_FC_DELTA)
+
+/**
+ * @brief
+ * Copies u16Count registers of the table from u16Add to the answer, a segment
+ * in wire order with a single memcpy
+ *
+ * @ingroup register
+ */
+static void putTable(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count, uint8_t *u8dst)
+{
+	const uint16_t *u16src = mapRegisters(modH, u8table, u16Add, u16Count);
+
+	if (isWireOrder(modH, u8table, u16Add, u16Count)) memcpy(u8dst, u16src, u16Count * 2);
+	else putRegisters(u8dst, u16src, u16Count);
+}
+#endif
+
+#if ENABLE_MB_TX_GATHER == 1 && (MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4))
+
+/**
+ * @brief
+ * Leaves the registers of an FC3 or FC4 answer in their wire order segment, the DMA
+ * sends them from there between the header in u8Buffer and the CRC. Only for
+ * USART_HW_DMA lines and at least MB_TX_GATHER_MIN registers, a short answer is
+ * copied faster than two more DMA transfers are started
+ *
+ * @return true if the answer is sent from the segment
+ * @ingroup register
+ */
+static bool gatherTable(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count)
+{
+	if (modH->xTypeHW != USART_HW_DMA && modH->xTypeHW != USART_HW_DMA_CIRC) return false;
+	if (u16Count < MB_TX_GATHER_MIN || !isWireOrder(modH, u8table, u16Add, u16Count)) return false;
+
+	modH->u8TxGather = (const uint8_t *)mapRegisters(modH, u8table, u16Add, u16Count);
+	modH->u16TxGather = u16Count * 2;
+	return true;
+}
+#endif
+
+#if ENABLE_MB_TX_STREAM == 1 && (MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4))
+
+/**
+ * @brief
+ * Tells if an FC3 or FC4 answer may be streamed: a USART_HW_DMA line, registers
+ * of the table itself, not the diagnostics block or a snapshot
+ *
+ * @ingroup register
+ */
+static bool canStream(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count)
+{
+	if (modH->xTypeHW != USART_HW_DMA && modH->xTypeHW != USART_HW_DMA_CIRC) return false;
+#if ENABLE_MB_DIAG_REGS == 1
+	if (isDiagRange(u8table, u16Add, u16Count)) return false;
+#endif
+#if ENABLE_MB_RO_SNAPSHOT == 1
+	if (u8table == DB_INPUT_REGISTERS && modH->u16regsROBank[0] != NULL) return false;
+#endif
+	return mapRegisters(modH, u8table, u16Add, u16Count) != NULL;
+}
+
+/**
+ * @brief
+ * Streams the registers of an FC3 or FC4 answer through u8TxChunk, the DMA sends
+ * them after the header in u8Buffer. Only for the answers that do not fit MAX_BUFFER
+ * or have at least MB_TX_STREAM_MIN registers, a short one is sent whole
+ *
+ * @return true if the answer is streamed
+ * @ingroup register
+ */
+static bool streamTable(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count)
+{
+	if (u16Count < MB_TX_STREAM_MIN && 5 + u16Count * 2 <= MAX_BUFFER) return false;
+	if (!canStream(modH, u8table, u16Add, u16Count)) return false;
+
+	modH->u16TxStream = mapRegisters(modH, u8table, u16Add, u16Count);
+	modH->xTxStreamWire = isWireOrder(modH, u8table, u16Add, u16Count);
+	modH->u16TxStreamLeft = modH->u16TxGather = u16Count * 2;
+	modH->xTxStream = true;
+	return true;
+}
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC16) || MB_SLAVE_FC(MB_ENABLE_FC23)
+
+/**
+ * @brief
+ * Copies u16Count registers of a request to the holding registers from u16Add,
+ * a segment in wire order with a single memcpy
+ *
+ * @ingroup register
+ */
+static void getTable(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count, const uint8_t *u8src)
+{
+	uint16_t *u16dst = mapRegisters(modH, DB_HOLDING_REGISTER, u16Add, u16Count);
+
+	if (isWireOrder(modH, DB_HOLDING_REGISTER, u16Add, u16Count)) memcpy(u16dst, u8src, u16Count * 2);
+	else getRegisters(u16dst, u8src, u16Count);
+}
+#endif
+
+#if MB_SLAVE_SEG_READ
+
+/**
+ * @brief
+ * Runs the on-read callback of the segment before its registers are sent
+ *
+ * @return 0 or the exception code of the callback
+ * @ingroup register
+ */
+static uint8_t readSegment(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Add, uint16_t u16Count)
+{
+	const modbusSegment_t *xSeg = findSegment(modH, u8table, u16Add, u16Count);
+
+	if (xSeg == NULL || xSeg->xOnRead == NULL) return 0;
+	return xSeg->xOnRead(xSeg, u16Add, u16Count);
+}
+#endif
+
+#if MB_SLAVE_SEG_WRITE
+
+/**
+ * @brief
+ * Runs the on-write callback of the holding register segment once the
+ * registers of the request are stored
+ *
+ * @return 0 or the exception code of the callback
+ * @ingroup register
+ */
+static uint8_t writeSegment(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count)
+{
+	const modbusSegment_t *xSeg = findSegment(modH, DB_HOLDING_REGISTER, u16Add, u16Count);
+
+	if (xSeg == NULL || xSeg->xOnWrite == NULL) return 0;
+	return xSeg->xOnWrite(xSeg, u16Add, u16Count);
+}
+#endif
+
+#if MB_SLAVE_ACCESS
+
+/**
+ * @brief
+ * Tests the bits u16First to u16First + u16Count - 1 of a bitmap a word at a time:
+ * the first and the last word through a mask, the words in between against 0
+ *
+ * @return true if one of them is set
+ * @ingroup register
+ */
+static bool testBits(const uint32_t *u32map, uint16_t u16First, uint16_t u16Count)
+{
+	uint32_t u32Last = (uint32_t)u16First + u16Count - 1;
+	uint32_t u32Head = 0xFFFFFFFFUL << (u16First % 32);
+	uint32_t u32Tail = 0xFFFFFFFFUL >> (31 - u32Last % 32);
+	uint32_t i = u16First / 32;
+
+	if (i == u32Last / 32) return (u32map[ i ] & u32Head & u32Tail) != 0;
+	if (u32map[ i ] & u32Head) return true;
+	for (i++; i < u32Last / 32; i++)
+	{
+		if (u32map[ i ] != 0) return true;
+	}
+	return (u32map[ i ] & u32Tail) != 0;
+}
+
+/**
+ * @brief
+ * Checks the permissions of the holding register segment written by a request,
+ * the flat table has none
+ *
+ * @return 0, EXC_ADDR_RANGE for a read-only register, EXC_EXECUTE for a locked one
+ * @ingroup register
+ */
+static uint8_t checkWriteAccess(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count)
+{
+	const modbusSegment_t *xSeg = findSegment(modH, DB_HOLDING_REGISTER, u16Add, u16Count);
+
+	if (xSeg == NULL || u16Count == 0) return 0;
+
+	if (xSeg->u32ReadOnly != NULL && testBits(xSeg->u32ReadOnly, u16Add - xSeg->u16Start, u16Count)) return EXC_ADDR_RANGE;
+	if (xSeg->u32Locked != NULL && !modH->xWriteUnlocked &&
+			testBits(xSeg->u32Locked, u16Add - xSeg->u16Start, u16Count)) return EXC_EXECUTE;
+	return 0;
+}
+#endif
+
+#if MB_SLAVE_LIMITS
+
+/**
+ * @brief
+ * Checks one value against a limit, the enumeration with a binary search
+ *
+ * @return true if the limit accepts u16Value
+ * @ingroup register
+ */
+static bool isAccepted(const modbusLimit_t *xLimit, uint16_t u16Value)
+{
+	if (xLimit->u16Enum != NULL)
+	{
+		uint8_t u8low = 0, u8high = xLimit->u8Enum;
+
+		while (u8low < u8high)
+		{
+			uint8_t u8mid = (uint8_t)((u8low + u8high) / 2);
+			if (xLimit->u16Enum[ u8mid ] == u16Value) return true;
+			if (xLimit->u16Enum[ u8mid ] < u16Value) u8low = u8mid + 1;
+			else u8high = u8mid;
+		}
+		return false;
+	}
+	if (xLimit->xSigned)
+	{
+		return (int16_t)u16Value >= (int16_t)xLimit->u16Min && (int16_t)u16Value <= (int16_t)xLimit->u16Max;
+	}
+	return u16Value >= xLimit->u16Min && u16Value <= xLimit->u16Max;
+}
+
+/**
+ * @brief
+ * Checks the values a request writes to a holding register segment, u8Values holds them
+ * big endian as in the frame. The sorted limits and the registers are walked together in
+ * one pass, so the write is accepted or refused as a whole before anything is stored
+ *
+ * @return 0, or EXC_REGS_QUANT (illegal data value) for a value out of its limit
+ * @ingroup register
+ */
+static uint8_t checkLimits(modbusHandler_t *modH, uint16_t u16Add, uint16_t u16Count, const uint8_t *u8Values)
+{
+	const modbusSegment_t *xSeg = findSegment(modH, DB_HOLDING_REGISTER, u16Add, u16Count);
+
+	if (xSeg == NULL || xSeg->xLimits == NULL) return 0;
+
+	uint32_t u32First = (uint32_t)(u16Add - xSeg->u16Start);
+	uint32_t u32End = u32First + u16Count;
+
+	for (uint8_t i = 0; i < xSeg->u8Limits; i++)
+	{
+		const modbusLimit_t *xLimit = &xSeg->xLimits[ i ];
+		uint32_t u32From = xLimit->u16First;
+		uint32_t u32To = (uint32_t)xLimit->u16First + xLimit->u16Count;
+
+		if (u32From >= u32End) break;
+		if (u32To <= u32First) continue;
+		if (u32From < u32First) u32From = u32First;
+		if (u32To > u32End) u32To = u32End;
+
+		for (uint32_t j = u32From; j < u32To; j++)
+		{
+			const uint8_t *u8value = &u8Values[ (j - u32First) * 2 ];
+			if (!isAccepted(xLimit, word(u8value[0], u8value[1]))) return EXC_REGS_QUANT;
+		}
+	}
+	return 0;
+}
+#endif
+
+#if ENABLE_MB_WRITE_NOTIFY == 1
+#if MB_SLAVE_WRITES
+
+/**
+ * @brief
+ * Records the registers u16Start to u16Start + u16Count - 1 of DB_HOLDING_REGISTER
+ * or DB_COILS (registers of 16 coils) written by the master and signals the table.
+ * Called under the table semaphore, only the tables of u8id are tracked.
+ * A sparse holding register map is only signalled, its segments have xOnWrite
+ *
+ * @ingroup register
+ */
+static void markDirty(modbusHandler_t *modH, uint8_t u8table, uint16_t u16Start, uint16_t u16Count)
+{
+	uint32_t *u32Dirty = modH->u32DirtyHR;
+	uint32_t u32End = (uint32_t)u16Start + u16Count;
+	uint32_t u32Bits = MB_DIRTY_HR;
+
+	if (modH->u8UnitCount > 0 && modH->xUnitActive != &modH->xUnitMain) return; // another unit ID
+
+	if (u8table == DB_COILS)
+	{
+		u32Dirty = modH->u32DirtyCoils;
+		u32Bits = MB_DIRTY_COILS;
+	}
+	else if (modH->xSegHR != NULL)
+	{
+		u32Dirty = NULL;
+	}
+
+	if (u32Dirty != NULL)
+	{
+		for (uint32_t i = u16Start; i < u32End; i++)
+		{
+			u32Dirty[ i / 32 ] |= 1UL << (i % 32);
+		}
+	}
+
+	if (modH->xWriteEvents != NULL) xEventGroupSetBits(modH->xWriteEvents, u32Bits);
+	if (modH->xWriteTask != NULL) xTaskNotify(modH->xWriteTask, u32Bits, eSetBits);
+}
+#endif
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Moves the dirty bitmap of DB_HOLDING_REGISTER or DB_COILS to u32Dirty and clears it,
+ * under the table semaphore. A consumer woken by the MB_DIRTY_ bits then only scans the
+ * registers of the set bits instead of the whole table
+ *
+ * @param u16Words uint32_t words moved, MB_DIRTY_WORDS() of the table size
+ * @return true if the master wrote a register since the last call
+ * @ingroup register
+ */
+bool ModbusTakeDirty(modbusHandler_t * modH, uint8_t u8table, uint32_t *u32Dirty, uint16_t u16Words)
+{
+	uint32_t *u32Src = (u8table == DB_COILS) ? modH->u32DirtyCoils : modH->u32DirtyHR;
+	uint32_t u32Any = 0;
+
+	if (u32Src == NULL) return false;
+
+	ModbusLock(modH, u8table);
+	for (uint16_t i = 0; i < u16Words; i++)
+	{
+		u32Dirty[ i ] = u32Src[ i ];
+		u32Src[ i ] = 0;
+		u32Any |= u32Dirty[ i ];
+	}
+	ModbusUnlock(modH, u8table);
+
+	return u32Any != 0;
+}
+#endif
+
+#if ENABLE_MB_RETAIN == 1
+/* continues a running CRC over u32Bytes, the image is checked in RAM so any CRC_MODE fits */
+static uint16_t crcRetain(uint16_t u16crc, const void *pvData, uint32_t u32Bytes)
+{
+	const uint8_t *u8data = (const uint8_t *) pvData;
+
+	for (uint32_t i = 0; i < u32Bytes; i++) u16crc = calcCRCByte(u16crc, u8data[ i ]);
+	return u16crc;
+}
+
+/* CRC of the holding registers then of the coils */
+static uint16_t crcRetainTables(modbusHandler_t *modH)
+{
+	uint16_t u16crc = 0xFFFF;
+
+	if (modH->u16regsHR != NULL) u16crc = crcRetain(u16crc, modH->u16regsHR, modH->u16regHR_size * sizeof(uint16_t));
+	if (modH->u16regsCoils != NULL) u16crc = crcRetain(u16crc, modH->u16regsCoils, modH->u16regCoils_size * sizeof(uint16_t));
+	return u16crc;
+}
+
+/* sizes of the tables and of the image, a firmware changing one of them discards the image */
+static uint32_t getRetainLayout(modbusHandler_t *modH)
+{
+	return (((uint32_t)modH->u16regHR_size << 16) | modH->u16regCoils_size) ^ ((uint32_t)sizeof(modbusRetain_t) << 24);
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Checks the tables against the xRetain image sealed before the reset. An image left
+ * invalid, by a power-up or by a reset during a write, is discarded
+ *
+ * @return true if the tables are valid, the application then keeps them
+ * @ingroup register
+ */
+static bool checkRetain(modbusHandler_t *modH)
+{
+	modbusRetain_t *xRetain = modH->xRetain;
+
+	if (xRetain == NULL) return false;
+	if (xRetain->u32Magic != MB_RETAIN_MAGIC || xRetain->u32Layout != getRetainLayout(modH) ||
+		xRetain->u16TableCRC != crcRetainTables(modH))
+	{
+		xRetain->u32Magic = 0;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Takes the counters back from a valid image, they are left cleared when their own CRC fails
+ *
+ * @ingroup register
+ */
+static void restoreRetain(modbusHandler_t *modH)
+{
+	modbusRetain_t *xRetain = modH->xRetain;
+
+	if (xRetain->u16StatCRC != crcRetain(0xFFFF, &xRetain->u16InCnt,
+			sizeof(modbusRetain_t) - offsetof(modbusRetain_t, u16InCnt))) return;
+
+	modH->u16InCnt = xRetain->u16InCnt;
+	modH->u16OutCnt = xRetain->u16OutCnt;
+	modH->u16errCnt = xRetain->u16errCnt;
+#if ENABLE_MB_ERR_STATS == 1
+	memcpy(&modH->xErrStats, &xRetain->xErrStats, sizeof(modbusErrStats_t));
+#endif
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Copies the counters to the image, and with xTables the CRC of the tables. The image is
+ * invalid while it changes, so a reset in between discards it
+ *
+ * @ingroup register
+ */
+static void sealRetain(modbusHandler_t *modH, bool xTables)
+{
+	modbusRetain_t *xRetain = modH->xRetain;
+	uint16_t u16TableCRC = xTables ? crcRetainTables(modH) : 0;
+
+	taskENTER_CRITICAL(); // the slave task and ModbusRetainSeal() may seal at once
+	if (xTables)
+	{
+		xRetain->u32Magic = 0;
+		__DMB();
+		xRetain->u32Layout = getRetainLayout(modH);
+		xRetain->u16TableCRC = u16TableCRC;
+	}
+	xRetain->u16InCnt = modH->u16InCnt;
+	xRetain->u16OutCnt = modH->u16OutCnt;
+	xRetain->u16errCnt = modH->u16errCnt;
+#if ENABLE_MB_ERR_STATS == 1
+	memcpy(&xRetain->xErrStats, &modH->xErrStats, sizeof(modbusErrStats_t));
+#endif
+	xRetain->u16StatCRC = crcRetain(0xFFFF, &xRetain->u16InCnt, sizeof(modbusRetain_t) - offsetof(modbusRetain_t, u16InCnt));
+	if (xTables)
+	{
+		__DMB();
+		xRetain->u32Magic = MB_RETAIN_MAGIC;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief
+ * *** Only Modbus Slave ***
+ * Seals xRetain again after the application changed u16regsHR or u16regsCoils, the
+ * writes of the master are sealed by the slave task. Until then a reset discards the tables
+ *
+ * @ingroup register
+ */
+void ModbusRetainSeal(modbusHandler_t * modH)
+{
+	if (modH->uModbusType != MB_SLAVE || modH->xRetain == NULL) return;
+
+	ModbusLock(modH, DB_HOLDING_REGISTER);
+	ModbusLock(modH, DB_COILS);
+	sealRetain(modH, true);
+	ModbusUnlock(modH, DB_COILS);
+	ModbusUnlock(modH, DB_HOLDING_REGISTER);
+}
+#endif
+
+/**
+ * @brief
+ * This method creates a word from 2 bytes
+ *
+ * @return uint16_t (word)
+ * @ingroup H  Most significant byte
+ * @ingroup L  Less significant byte
+ */
+uint16_t word(uint8_t H, uint8_t L)
+{
+	bytesFields W;
+	W.u8[0] = L;
+	W.u8[1] = H;
+
+	return W.u16[0];
+}
+
+
+#if CRC_MODE == CRC_TABLE
+/* CRC16 (poly 0xA001 reflected) of every possible byte value */
+static const uint16_t u16CRCTable[256] MB_HOT_DATA =
+{
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040,
+};
+#elif CRC_MODE == CRC_NIBBLE
+/* CRC16 (poly 0xA001 reflected) of every possible nibble value */
+static const uint16_t u16CRCTable[16] MB_HOT_DATA =
+{
+    0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+    0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400,
+};
+#endif
+
+
+/**
+ * @brief
+ * This method calculates CRC
+ * The algorithm is selected at compile time with CRC_MODE in ModbusConfig.h
+ *
+ * @return uint16_t calculated CRC value for the message
+ * @ingroup Buffer
+ * @ingroup u16length
+ */
+MB_HOT_CODE uint16_t calcCRC(uint8_t *Buffer, uint16_t u16length)
+{
+    unsigned int temp, temp2;
+    temp = 0xFFFF;
+#if CRC_MODE == CRC_HARDWARE
+    xSemaphoreTake(ModbusCRCHandle, portMAX_DELAY);
+    // the unit may be shared with the application, program CRC-16/MODBUS on every call
+    CRC->POL  = 0x8005;
+    CRC->INIT = 0xFFFF;
+    CRC->CR   = CRC_CR_POLYSIZE_0 | CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET;
+    for (uint16_t i = 0; i < u16length; i++)
+    {
+        *(__IO uint8_t *)&CRC->DR = Buffer[i]; // 8-bit access, one byte fed per write
+    }
+    temp = CRC->DR & 0xFFFF;
+    xSemaphoreGive(ModbusCRCHandle);
+#elif CRC_MODE == CRC_TABLE
+    for (uint16_t i = 0; i < u16length; i++)
+    {
+        temp = (temp >> 8) ^ u16CRCTable[(temp ^ Buffer[i]) & 0xFF];
+    }
+#elif CRC_MODE == CRC_NIBBLE
+    for (uint16_t i = 0; i < u16length; i++)
+    {
+        temp = temp ^ Buffer[i];
+        temp = (temp >> 4) ^ u16CRCTable[temp & 0x0F];
+        temp = (temp >> 4) ^ u16CRCTable[temp & 0x0F];
+    }
+#else
+    unsigned int flag;
+    for (uint16_t i = 0; i < u16length; i++)
+    {
+        temp = temp ^ Buffer[i];
+        for (unsigned char j = 1; j <= 8; j++)
+        {
+            flag = temp & 0x0001;
+            temp >>=1;
+            if (flag)
+                temp ^= 0xA001;
+        }
+    }
+#endif
+    // Reverse byte order.
+    temp2 = temp >> 8;
+    temp = (temp << 8) | temp2;
+    temp &= 0xFFFF;
+    // the returned value is already swapped
+    // crcLo byte is first & crcHi byte is last
+    return temp;
+
+}
+
+
+/**
+ * @brief
+ * This method updates a running CRC with one byte.
+ * The value is not byte swapped, a frame followed by its own CRC gives 0.
+ * It never uses the CRC peripheral so it can be called from interrupts.
+ *
+ * @return uint16_t updated CRC value
+ * @ingroup u16crc running CRC, start with 0xFFFF
+ * @ingroup u8byte new byte
+ */
+MB_HOT_CODE uint16_t calcCRCByte(uint16_t u16crc, uint8_t u8byte)
+{
+#if CRC_MODE == CRC_TABLE
+    return (u16crc >> 8) ^ u16CRCTable[(u16crc ^ u8byte) & 0xFF];
+#elif CRC_MODE == CRC_NIBBLE
+    u16crc = u16crc ^ u8byte;
+    u16crc = (u16crc >> 4) ^ u16CRCTable[u16crc & 0x0F];
+    return (u16crc >> 4) ^ u16CRCTable[u16crc & 0x0F];
+#else
+    u16crc = u16crc ^ u8byte;
+    for (unsigned char j = 1; j <= 8; j++)
+    {
+        u16crc = (u16crc & 0x0001) ? ((u16crc >> 1) ^ 0xA001) : (u16crc >> 1);
+    }
+    return u16crc;
+#endif
+}
+
+#if ENABLE_MB_TX_GATHER == 1
+/**
+ * @brief
+ * CRC of an answer sent in parts, the header in u8Buffer and the payload at
+ * u8TxGather, walked in the order the DMA sends them
+ *
+ * @return CRC swapped as by calcCRC()
+ * @ingroup modH Modbus handler
+ */
+static uint16_t calcGatherCRC(modbusHandler_t *modH)
+{
+	uint16_t u16crc = 0xFFFF;
+
+	for (uint16_t i = 0; i < modH->u16BufferSize; i++) u16crc = calcCRCByte(u16crc, modH->u8Buffer[ i ]);
+	for (uint16_t i = 0; i < modH->u16TxGather; i++) u16crc = calcCRCByte(u16crc, modH->u8TxGather[ i ]);
+	return (uint16_t)((u16crc << 8) | (u16crc >> 8));
+}
+#endif
+
+#if ENABLE_MB_TX_STREAM == 1
+/**
+ * @brief
+ * Puts the next registers of a streamed answer in chunk u8Chunk, off the line,
+ * and adds them to the CRC, which is ready in u8TxStreamCRC after the last ones.
+ * From the task for the first chunk, then from the TX DMA interrupt
+ *
+ * @ingroup modH Modbus handler
+ */
+static void fillTxChunk(modbusHandler_t *modH, uint8_t u8Chunk)
+{
+	uint8_t *u8dst = modH->u8TxChunk[ u8Chunk ];
+	uint16_t u16Size = (modH->u16TxStreamLeft < MB_TX_CHUNK) ? modH->u16TxStreamLeft : MB_TX_CHUNK;
+	uint16_t u16crc = modH->u16TxStreamCRC;
+
+	if (modH->xTxStreamWire) memcpy(u8dst, modH->u16TxStream, u16Size);
+	else putRegisters(u8dst, modH->u16TxStream, u16Size / 2);
+	for (uint16_t i = 0; i < u16Size; i++) u16crc = calcCRCByte(u16crc, u8dst[ i ]);
+	cleanDCache(u8dst, u16Size);
+
+	modH->u16TxStream += u16Size / 2;
+	modH->u16TxStreamLeft -= u16Size;
+	modH->u16TxChunk[ u8Chunk ] = u16Size;
+	modH->u16TxStreamCRC = u16crc;
+	modH->u8TxStreamCRC[0] = u16crc & 0x00ff;
+	modH->u8TxStreamCRC[1] = u16crc >> 8;
+}
+
+/**
+ * @brief
+ * Next DMA part of a streamed answer at the end of the previous one: the chunk
+ * filled meanwhile, then the CRC. The chunk that just went out takes the
+ * registers after it
+ *
+ * @return part to send, NULL once the CRC was sent
+ * @ingroup modH Modbus handler
+ */
+static const uint8_t *nextTxChunk(modbusHandler_t *modH, uint16_t *pu16Size)
+{
+	uint8_t u8Chunk = modH->u8TxChunkNext;
+
+	if (modH->u8TxNext == 2) return NULL; // the CRC is out, the answer is complete
+	if (modH->u16TxChunk[ u8Chunk ] == 0)
+	{
+		modH->u8TxNext = 2;
+		cleanDCache(modH->u8TxStreamCRC, 2);
+		*pu16Size = 2;
+		return modH->u8TxStreamCRC;
+	}
+	*pu16Size = modH->u16TxChunk[ u8Chunk ];
+	modH->u8TxChunkNext = u8Chunk ^ 1;
+	fillTxChunk(modH, u8Chunk ^ 1);
+	return modH->u8TxChunk[ u8Chunk ];
+}
+#endif
+
+#if ENABLE_MB_ASCII == 1
+#define X MB_ASCII_NONE
+/* value of the hex digits '0'-'9', 'A'-'F' and 'a'-'f' of an ASCII frame, read by the RX interrupt */
+const uint8_t u8HexValue[128] =
+{
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+	X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X
+};
+#undef X
+
+static const char cHexDigit[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+
+/**
+ * @brief
+ * This method calculates the LRC of an ASCII frame, the two's complement
+ * of the sum of its bytes
+ *
+ * @return LRC of the u16length bytes of u8Buffer
+ * @ingroup buffer
+ */
+static uint8_t calcLRC(const uint8_t *u8Buffer, uint16_t u16length)
+{
+	uint8_t u8sum = 0;
+
+	for (uint16_t i = 0; i < u16length; i++)
+	{
+		u8sum += u8Buffer[ i ];
+	}
+	return (uint8_t)(-u8sum);
+}
+
+/**
+ * @brief
+ * Encodes a binary frame ending with its LRC as the text of an ASCII frame:
+ * ':', two upper case hex digits per byte, CR and LF
+ *
+ * @return characters of u8Text
+ * @ingroup buffer
+ */
+static uint16_t encodeAscii(uint8_t *u8Text, const uint8_t *u8Frame, uint16_t u16length)
+{
+	uint16_t u16size = 0;
+
+	u8Text[ u16size++ ] = ':';
+	for (uint16_t i = 0; i < u16length; i++)
+	{
+		u8Text[ u16size++ ] = cHexDigit[ u8Frame[ i ] >> 4 ];
+		u8Text[ u16size++ ] = cHexDigit[ u8Frame[ i ] & 0x0F ];
+	}
+	u8Text[ u16size++ ] = '\r';
+	u8Text[ u16size++ ] = '\n';
+	return u16size;
+}
+#endif
+
+
+#if MB_ENABLE_SLAVE == 1
+/**
+ * @brief
+ * This method builds an exception message
+ *
+ * @ingroup u8exception exception number
+ * @ingroup modH modbus handler
+ */
+void buildException( uint8_t u8exception, modbusHandler_t *modH )
+{
+    uint8_t u8func = modH->u8Buffer[ FUNC ];  // get the original FUNC code
+
+    // ID is kept from the request, it may be one of xUnits
+    modH->u8Buffer[ FUNC ]    = u8func + 0x80;
+    modH->u8Buffer[ 2 ]       = u8exception;
+    modH->u16BufferSize         = EXCEPTION_SIZE;
+    MB_COUNT_EXC(modH, u8exception);
+}
+
+#if ENABLE_MB_EXC_CACHE == 1
+/**
+ * @brief
+ * CRC of the exception answer in u8Buffer, taken from the exception ADUs the
+ * slave sent before. An answer not among them is added in place of the oldest
+ *
+ * @return CRC of the EXCEPTION_SIZE bytes of the answer
+ * @ingroup modH Modbus handler
+ */
+static uint16_t getExceptionCRC(modbusHandler_t *modH)
+{
+	uint8_t *u8Adu;
+	uint16_t u16crc;
+
+	for (uint8_t i = 0; i < MB_EXC_CACHE; i++)
+	{
+		u8Adu = modH->u8ExcAdu[i];
+		if (memcmp(u8Adu, modH->u8Buffer, EXCEPTION_SIZE) == 0) return word(u8Adu[ EXCEPTION_SIZE ], u8Adu[ EXCEPTION_SIZE + 1 ]);
+	}
+
+	u8Adu = modH->u8ExcAdu[modH->u8ExcNext];
+	modH->u8ExcNext = (modH->u8ExcNext + 1) % MB_EXC_CACHE;
+	u16crc = calcCRC(modH->u8Buffer, EXCEPTION_SIZE);
+	memcpy(u8Adu, modH->u8Buffer, EXCEPTION_SIZE);
+	u8Adu[ EXCEPTION_SIZE ] = u16crc >> 8;
+	u8Adu[ EXCEPTION_SIZE + 1 ] = u16crc & 0x00ff;
+	return u16crc;
+}
+#endif
+#endif
+
+
+/**
+ * @brief
+ * This method transmits u8Buffer through the transport of the handler.
+ * The CRC is appended to the buffer before starting to send it, a TCP or UDP
+ * slave sends an MBAP header instead and an ASCII line an LRC.
+ *
+ * @return nothing
+ * @ingroup modH Modbus handler
+ */
+static void sendTxBuffer(modbusHandler_t *modH)
+{
+	if (modH->xStopped)
+	{
+		modH->u16BufferSize = 0; // ModbusStop(), the line is being reconfigured
+		return;
+	}
+
+#if ENABLE_MB_ASCII == 1
+	if (modH->xTransport->u8Flags & MB_TP_LRC)
+	{
+		// LRC and a pad byte, sendUart() encodes the frame without the pad
+		modH->u8Buffer[ modH->u16BufferSize ] = calcLRC(modH->u8Buffer, modH->u16BufferSize);
+		modH->u16BufferSize++;
+		modH->u8Buffer[ modH->u16BufferSize ] = 0;
+		modH->u16BufferSize++;
+	}
+	else
+#endif
+#if ENABLE_MB_TX_STREAM == 1
+	if (modH->uModbusType == MB_SLAVE && modH->u16TxGather != 0 && modH->xTxStream)
+	{
+		// the CRC goes on with the chunks and follows the last one, see fillTxChunk()
+		modH->u16TxStreamCRC = 0xFFFF;
+		for (uint16_t i = 0; i < modH->u16BufferSize; i++) modH->u16TxStreamCRC = calcCRCByte(modH->u16TxStreamCRC, modH->u8Buffer[ i ]);
+	}
+	else
+#endif
+	if ((modH->xTransport->u8Flags & MB_TP_MBAP) == 0)
+	{
+		// append CRC to message
+		uint16_t u16crc;
+#if ENABLE_MB_EXC_CACHE == 1
+		if (modH->uModbusType == MB_SLAVE && modH->u16BufferSize == EXCEPTION_SIZE && (modH->u8Buffer[ FUNC ] & 0x80) != 0)
+		{
+			u16crc = getExceptionCRC(modH); // the burst of a misconfigured master or a scan repeats the same few
+		}
+		else
+#endif
+#if ENABLE_MB_TX_GATHER == 1
+		if (modH->uModbusType == MB_SLAVE && modH->u16TxGather != 0)
+		{
+			u16crc = calcGatherCRC(modH); // the CRC follows the header in u8Buffer, the DMA puts the payload between
+		}
+		else
+#endif
+		u16crc = calcCRC(modH->u8Buffer, modH->u16BufferSize);
+		modH->u8Buffer[ modH->u16BufferSize ] = u16crc >> 8;
+		modH->u16BufferSize++;
+		modH->u8Buffer[ modH->u16BufferSize ] = u16crc & 0x00ff;
+		modH->u16BufferSize++;
+	}
+
+#if ENABLE_MB_RESP_CACHE == 1
+	if (modH->uModbusType == MB_SLAVE && modH->xRespFill != NULL)
+	{
+		// the answer with its CRC, sent again by sendCachedAnswer()
+#if ENABLE_MB_TX_GATHER == 1
+		if (modH->u16TxGather != 0)
+		{
+			uint8_t *u8Answer = modH->xRespFill->u8Answer;
+
+			memcpy(u8Answer, modH->u8Buffer, 3);
+			memcpy(&u8Answer[ 3 ], modH->u8TxGather, modH->u16TxGather);
+			memcpy(&u8Answer[ 3 + modH->u16TxGather ], &modH->u8Buffer[ 3 ], 2);
+			modH->xRespFill->u16Size = modH->u16BufferSize + modH->u16TxGather;
+		}
+		else
+#endif
+		{
+			memcpy(modH->xRespFill->u8Answer, modH->u8Buffer, modH->u16BufferSize);
+			modH->xRespFill->u16Size = modH->u16BufferSize;
+		}
+		modH->xRespFill = NULL;
+	}
+#endif
+	modH->xTransport->send(modH);
+}
+
+
+/**
+ * @brief
+ * This method transmits u8Buffer to Serial line.
+ * Only if EN_Port != NULL, there is a flow handling in order to keep
+ * the RS485 transceiver in output state as long as the message is being sent.
+ * The HAL reports the end of TX at the TC interrupt, where the transceiver is released.
+ * With ENABLE_MB_TX_BUFFER a slave sends from u8BufferTX and returns without
+ * waiting for the end of TX, the next answer waits for it instead.
+ *
+ * @ingroup modH Modbus handler
+ */
+static void sendUart(modbusHandler_t *modH, bool xDMA)
+{
+	uint8_t *u8tx = modH->u8Buffer;
+
+#if ENABLE_USART_DMA == 1
+    if (xDMA)
+    {
+    	recoverRxDMA(modH); // an error stopped the reception, the answer of a query needs it
+    }
+#endif
+
+#if ENABLE_MB_TX_BUFFER == 1
+    if (modH->uModbusType == MB_SLAVE)
+    {
+    	// the previous answer may still be on the line
+    	waitTxDone(modH);
+    	memcpy(modH->u8BufferTX, modH->u8Buffer, modH->u16BufferSize);
+    	u8tx = modH->u8BufferTX;
+    }
+#endif
+#if ENABLE_MB_PREBUILT == 1
+    if (modH->uModbusType == MB_MASTER && modH->u8TxFrame != NULL)
+    {
+    	u8tx = (uint8_t *)modH->u8TxFrame; // prebuilt query, the HAL only reads it
+    }
+#endif
+#if ENABLE_MB_ASCII == 1
+    if (modH->xTypeHW == ASCII_HW)
+    {
+    	// the same frame as text, its pad byte dropped
+    	modH->u16BufferSize = encodeAscii(modH->u8AsciiTx, u8tx, modH->u16BufferSize - 1);
+    	u8tx = modH->u8AsciiTx;
+    }
+#endif
+
+#if ENABLE_MB_PACING == 1
+    	if (modH->uModbusType == MB_MASTER && modH->xTypeHW != ASCII_HW)
+    	{
+    		startPaced(modH, u8tx, xDMA);
+    	}
+    	else
+#endif
+#if ENABLE_MB_TURNAROUND == 1
+    	if (modH->uModbusType == MB_SLAVE)
+    	{
+    		if (!waitTurnaround(modH, u8tx, xDMA))
+    		{
+    			modH->u16BufferSize = 0; // too late, the master gave up on this answer
+    			return;
+    		}
+    	}
+    	else
+#endif
+    	startUartTx(modH, u8tx, modH->u16BufferSize, xDMA);
+
+#if ENABLE_MB_SHARED_TASK == 1
+        // the shared task does not wait, the TX callback starts the timeout of a master
+        // and a slave serves the next request after MB_EV_TX
+#else
+#if ENABLE_MB_TX_BUFFER == 1
+        if (modH->uModbusType == MB_MASTER)
+#endif
+        waitTxDone(modH);
+
+#if MB_ENABLE_MASTER == 1
+         // set timeout for master query, it starts when the query is on the line
+         if(modH->uModbusType == MB_MASTER )
+         {
+#if ENABLE_USART_DMA_INPLACE == 1
+        	 restartRxDMA(modH); // receive the answer over the query
+#endif
+        	 startTimeout(modH);
+         }
+#endif
+#endif
+
+     modH->u16BufferSize = 0;
+     // increase message counter
+     modH->u16OutCnt++;
+
+
+}
+
+/**
+ * @brief
+ * Drives the line and starts the transmission of the u16Size bytes of u8tx.
+ * Called by the task, and with ENABLE_MB_TURNAROUND by the timer interrupt
+ *
+ * @ingroup modH Modbus handler
+ */
+static void startUartTx(modbusHandler_t *modH, const uint8_t *u8tx, uint16_t u16Size, bool xDMA)
+{
+	if (modH->EN_Port != NULL)
+	{
+		//enable transmitter, disable receiver to avoid echo on RS485 transceivers
+#if ENABLE_USART_DMA_LL == 1
+		if (xDMA) LL_USART_SetTransferDirection(modH->port->Instance, LL_USART_DIRECTION_TX);
+		else
+#endif
+		HAL_HalfDuplex_EnableTransmitter(modH->port);
+		HAL_GPIO_WritePin(modH->EN_Port, modH->EN_Pin, GPIO_PIN_SET);
+	}
+
+	MB_TRACE(modH, MB_TS_TX_START);
+	MB_LOG_EVENT(modH, MB_EVT_TX, u8tx, u16Size, (u8tx[ FUNC ] & 0x80) ? (int8_t)u8tx[ 2 ] : 0, 0);
+#if ENABLE_MB_WIRE_STATS == 1
+	countWireTx(modH, u16Size);
+#endif
+#if ENABLE_MB_STATS == 1 && MB_ENABLE_SLAVE == 1
+	if (modH->uModbusType == MB_SLAVE)
+	{
+		updateHist(&modH->xStatLatency, (DWT->CYCCNT - modH->u32RxEnd) / (SystemCoreClock / 1000000));
+	}
+#endif
+	if (xDMA)
+	{
+		//transfer buffer to serial line DMA
+		cleanDCache(u8tx, u16Size);
+#if ENABLE_USART_DMA_LL == 1
+#if ENABLE_MB_TX_STREAM == 1
+		if (modH->uModbusType == MB_SLAVE && modH->u16TxGather != 0 && modH->xTxStream)
+		{
+			// the header first, txDoneDMA() sends the chunks and the CRC after it
+			modH->u8TxChunkNext = 0;
+			modH->u8TxNext = 0;
+			fillTxChunk(modH, 0);
+			u16Size = 3;
+		}
+#if ENABLE_MB_TX_GATHER == 1
+		else
+#endif
+#endif
+#if ENABLE_MB_TX_GATHER == 1
+		if (modH->uModbusType == MB_SLAVE && modH->u16TxGather != 0)
+		{
+			// the header first, txDoneDMA() chains the payload from the segment and the CRC
+			modH->u8TxPart[0] = modH->u8TxGather;
+			modH->u16TxPart[0] = modH->u16TxGather;
+			cleanDCache(modH->u8TxGather, modH->u16TxGather);
+			modH->u8TxPart[1] = &u8tx[ 3 ];
+			modH->u16TxPart[1] = 2;
+			modH->u8TxNext = 0;
+			u16Size = 3;
+		}
+#endif
+		transmitDMA(modH, u8tx, u16Size);
+#else
+		HAL_UART_Transmit_DMA(modH->port, u8tx, u16Size);
+#endif
+	}
+	else
+	{
+		// transfer buffer to serial line IT
+		HAL_UART_Transmit_IT(modH->port, u8tx, u16Size);
+	}
+}
+
+#if ENABLE_USART_DMA_LL == 1
+/**
+ * @brief
+ * Starts the TX DMA prepared by setupTxDMA() with a few register writes, in place
+ * of HAL_UART_Transmit_DMA(). The HAL states are kept for waitTxDone() and
+ * HAL_UART_AbortTransmit()
+ *
+ * @ingroup modH Modbus handler
+ */
+static void transmitDMA(modbusHandler_t *modH, const uint8_t *u8tx, uint16_t u16Size)
+{
+	UART_HandleTypeDef *huart = modH->port;
+	DMA_HandleTypeDef *hdmatx = huart->hdmatx;
+
+	huart->gState = HAL_UART_STATE_BUSY_TX;
+	hdmatx->State = HAL_DMA_STATE_BUSY;
+	hdmatx->Instance->CCR &= ~DMA_CCR_EN;
+	hdmatx->DmaBaseAddress->IFCR = (DMA_ISR_GIF1 << (hdmatx->ChannelIndex & 0x1CU));
+	hdmatx->Instance->CMAR = (uint32_t)(uintptr_t)u8tx;
+	hdmatx->Instance->CNDTR = u16Size;
+	hdmatx->Instance->CCR |= DMA_CCR_TCIE | DMA_CCR_EN;
+	LL_USART_ClearFlag_TC(huart->Instance);
+	LL_USART_EnableDMAReq_TX(huart->Instance);
+}
+#endif
+
+#if ENABLE_MB_TURNAROUND == 1
+/**
+ * @brief
+ * Sends the answer of a slave within its turnaround window, counted from the end
+ * of the request. An answer ready before u32TurnMinUs is started by the timer of
+ * ENABLE_MB_TIMER_MUX when it elapses, or after a wait on the cycle counter without
+ * it. An answer later than u32TurnMaxUs is not sent
+ *
+ * @return false if the answer was dropped
+ * @ingroup modH Modbus handler
+ */
+static bool waitTurnaround(modbusHandler_t *modH, const uint8_t *u8tx, bool xDMA)
+{
+	uint32_t u32Cycles = SystemCoreClock / 1000000;
+	uint32_t u32Gone = (DWT->CYCCNT - modH->u32RxEnd) / u32Cycles;
+
+	if (modH->u32TurnMaxUs != 0 && u32Gone > modH->u32TurnMaxUs)
+	{
+		MB_COUNT_NO_RESPONSE(modH);
+		return false;
+	}
+	if (u32Gone < modH->u32TurnMinUs)
+	{
+#if ENABLE_MB_TIMER_MUX == 1
+		// ModbusTimerCallback() starts it, waitTxDone() covers the wait
+		modH->u8TurnTx = u8tx;
+		modH->u16TurnSize = modH->u16BufferSize;
+		modH->xTurnDMA = xDMA;
+		modH->xTurnPending = true;
+		armModbusTimer(modH, MB_TIMER_TIMEOUT, modH->u32TurnMinUs - u32Gone);
+		return true;
+#else
+		while ((DWT->CYCCNT - modH->u32RxEnd) / u32Cycles < modH->u32TurnMinUs)
+		{
+
+		}
+#endif
+	}
+	startUartTx(modH, u8tx, modH->u16BufferSize, xDMA);
+	return true;
+}
+#endif
+
+#if ENABLE_MB_PACING == 1
+/**
+ * @brief
+ * Silence before a query to u8id: T3.5 plus the guard of the slave in xPaceGuards,
+ * or u32PaceGuardUs for a slave without one
+ *
+ * @ingroup modH Modbus handler
+ */
+static uint32_t getPaceUs(modbusHandler_t *modH, uint8_t u8id)
+{
+	for (uint8_t i = 0; i < modH->u8PaceGuardCount; i++)
+	{
+		if (modH->xPaceGuards[i].u8id == u8id) return modH->u32T35us + modH->xPaceGuards[i].u32GuardUs;
+	}
+	return modH->u32T35us + modH->u32PaceGuardUs;
+}
+
+/**
+ * @brief
+ * Sends a query of the master once the line was silent for getPaceUs() after the end
+ * of the last frame. That end is stamped when T35 elapsed after it, or one character
+ * after it at the IDLE event of the DMA modes, or at its last byte with ENABLE_RX_PREDICT,
+ * and only the rest of the silence is waited for. A later frame restarts the silence.
+ * With ENABLE_MB_TIMER_MUX the multiplexer starts the query when it elapses, otherwise
+ * the task waits on the cycle counter
+ *
+ * @ingroup modH Modbus handler
+ */
+static void startPaced(modbusHandler_t *modH, const uint8_t *u8tx, bool xDMA)
+{
+	uint32_t u32Cycles = SystemCoreClock / 1000000;
+	uint32_t u32Pace = getPaceUs(modH, u8tx[ ID ]);
+	uint32_t u32Gone = (DWT->CYCCNT - modH->u32RxEnd) / u32Cycles;
+
+#if ENABLE_RX_PREDICT != 1
+	if (modH->xTypeHW == USART_HW_DMA || modH->xTypeHW == USART_HW_DMA_CIRC)
+	{
+		u32Pace -= (getCharBits(modH->port) * 1000000UL) / modH->port->Init.BaudRate;
+	}
+	else
+	{
+		u32Pace -= modH->u32T35us;
+	}
+#endif
+	if (u32Gone < u32Pace)
+	{
+#if ENABLE_MB_TIMER_MUX == 1
+		// ModbusTimerCallback() starts it, waitTxDone() covers the wait
+		modH->u8PaceTx = u8tx;
+		modH->u16PaceSize = modH->u16BufferSize;
+		modH->xPaceDMA = xDMA;
+		modH->u32PaceUs = u32Pace;
+		modH->xPacePending = true;
+		armModbusTimer(modH, MB_TIMER_TIMEOUT, u32Pace - u32Gone);
+		return;
+#else
+		while ((DWT->CYCCNT - modH->u32RxEnd) / u32Cycles < u32Pace)
+		{
+
+		}
+#endif
+	}
+	startUartTx(modH, u8tx, modH->u16BufferSize, xDMA);
+}
+#endif
+
+/**
+ * @brief
+ * send operation of USART_HW
+ *
+ * @ingroup modH Modbus handler
+ */
+static void sendUartIT(modbusHandler_t *modH)
+{
+	sendUart(modH, false);
+}
+
+#if ENABLE_USART_DMA == 1
+/**
+ * @brief
+ * send operation of USART_HW_DMA and USART_HW_DMA_CIRC
+ *
+ * @ingroup modH Modbus handler
+ */
+static void sendUartDMA(modbusHandler_t *modH)
+{
+	sendUart(modH, true);
+}
+#endif
+
+#if ENABLE_USB_CDC == 1
+/**
+ * @brief
+ * send operation of USB_CDC_HW, a master starts its timeout in sendUsbFrame()
+ *
+ * @ingroup modH Modbus handler
+ */
+static void sendUsb(modbusHandler_t *modH)
+{
+	MB_TRACE(modH, MB_TS_TX_START);
+	MB_LOG_EVENT(modH, MB_EVT_TX, modH->u8Buffer, modH->u16BufferSize,
+			(modH->u8Buffer[ FUNC ] & 0x80) ? (int8_t)modH->u8Buffer[ 2 ] : 0, 0);
+	sendUsbFrame(modH);
+	modH->u16BufferSize = 0;
+	modH->u16OutCnt++;
+}
+#endif
+
+#if ENABLE_MB_BLE == 1
+/**
+ * @brief
+ * send operation of BLE_HW. The PDU of the answer, without ID and CRC, goes out in
+ * notifications of MTU - 3 bytes: a shorter one ends it, so a PDU filling its last
+ * notification is followed by an empty one, unless it has the MB_BLE_PDU bytes of the
+ * longest PDU. While xBleNotify() finds no buffer in the stack the notification is
+ * tried again every tick, for 250 ticks. An answer to a central that left is lost,
+ * as on an unplugged serial line
+ *
+ * @ingroup ble
+ */
+static void sendBle(modbusHandler_t *modH)
+{
+	TickType_t xTxStart = xTaskGetTickCount();
+	uint16_t u16Pdu = modH->u16BufferSize - 3;
+	uint16_t u16Sent = 0;
+
+	MB_TRACE(modH, MB_TS_TX_START);
+	MB_LOG_EVENT(modH, MB_EVT_TX, modH->u8Buffer, modH->u16BufferSize,
+			(modH->u8Buffer[ FUNC ] & 0x80) ? (int8_t)modH->u8Buffer[ 2 ] : 0, 0);
+	for (;;)
+	{
+		uint16_t u16Mtu = modH->u16BleMtu;
+		uint16_t u16Part = u16Pdu - u16Sent;
+
+		if (u16Mtu == 0) break;
+		if (u16Part > u16Mtu - 3) u16Part = u16Mtu - 3;
+		if (!modH->xBleNotify(modH, &modH->u8Buffer[ 1 + u16Sent ], u16Part))
+		{
+			// the stack frees its buffers as the central acknowledges the packets
+			if ((xTaskGetTickCount() - xTxStart) >= 250) break;
+			vTaskDelay(1);
+			continue;
+		}
+		u16Sent += u16Part;
+		if (u16Part < u16Mtu - 3 || u16Sent == MB_BLE_PDU) break;
+	}
+	MB_TRACE(modH, MB_TS_TX_DONE);
+	modH->u16BufferSize = 0;
+	modH->u16OutCnt++;
+}
+#endif
+
+
+#if ENABLE_MB_SHARED_TASK != 1 || ENABLE_MB_TX_BUFFER == 1
+/**
+ * @brief
+ * Waits for the end of the transmission in progress, the TC callback releases
+ * the RS485 transceiver. A transmission not completed in 250 ticks is aborted
+ *
+ * @ingroup modH Modbus handler
+ */
+static void waitTxDone(modbusHandler_t *modH)
+{
+	TickType_t xTxStart = xTaskGetTickCount();
+
+	while ((modH->port->gState != HAL_UART_STATE_READY || isTurnPending(modH)) && (xTaskGetTickCount() - xTxStart) < 250)
+	{
+#if ENABLE_MB_TX_BUFFER == 1
+		if (modH->uModbusType == MB_SLAVE)
+		{
+			// a slave is not notified at the end of TX, the notifications are for the received frames
+			vTaskDelay(1);
+			continue;
+		}
+#endif
+		//wait notification from TC interrupt
+		ulTaskNotifyTake(pdTRUE, 250 - (xTaskGetTickCount() - xTxStart));
+	}
+
+#if (ENABLE_MB_TURNAROUND == 1 || ENABLE_MB_PACING == 1) && ENABLE_MB_TIMER_MUX == 1
+	if (isTurnPending(modH))
+	{
+		cancelModbusTimer(modH, MB_TIMER_TIMEOUT);
+#if ENABLE_MB_TURNAROUND == 1
+		if (modH->uModbusType == MB_SLAVE) modH->xTurnPending = false;
+#endif
+#if ENABLE_MB_PACING == 1
+		if (modH->uModbusType == MB_MASTER) modH->xPacePending = false;
+#endif
+	}
+#endif
+	if (modH->port->gState != HAL_UART_STATE_READY)
+	{
+#if ENABLE_MB_WATCHDOG == 1
+		recoverLine(modH); // TX did not complete, the UART or its DMA is stuck
+		if (modH->port->gState == HAL_UART_STATE_READY) return;
+#endif
+		// TX did not complete, abort it and return RS485 transceiver to receive mode
+		HAL_UART_AbortTransmit(modH->port);
+		if (modH->EN_Port != NULL)
+		{
+			HAL_GPIO_WritePin(modH->EN_Port, modH->EN_Pin, GPIO_PIN_RESET);
+			HAL_HalfDuplex_EnableReceiver(modH->port);
+		}
+	}
+}
+#endif
+
+
+#if ENABLE_USB_CDC == 1
+/**
+ * @brief
+ * Starts a USB_CDC_HW handler. The CDC class arms the OUT endpoint on its own buffer
+ * when the host configures the device, ModbusUsbRxCallback() moves the first packet
+ * to u8Buffer and receives the next ones in place
+ *
+ * @ingroup usb
+ */
+static void startUsb(modbusHandler_t *modH)
+{
+	if (modH->xUsbDevice == NULL)
+	{
+		while(1); //ERROR a USB_CDC_HW handler needs the xUsbDevice of its CDC device
+	}
+
+	taskENTER_CRITICAL();
+	modH->u16UsbRxLen = 0;
+	modH->u16UsbRxCRC = 0xFFFF;
+	modH->xUsbRxArmed = true;
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief
+ * Restarts the reception of a frame at the beginning of u8Buffer. The endpoint is
+ * only armed again if the last frame stopped it, a packet already on its way to the
+ * old position of the buffer is moved by ModbusUsbRxCallback()
+ *
+ * @ingroup usb
+ */
+static void startUsbRx(modbusHandler_t *modH)
+{
+	taskENTER_CRITICAL();
+	modH->u16UsbRxLen = 0;
+	modH->u16UsbRxCRC = 0xFFFF;
+	if (!modH->xUsbRxArmed)
+	{
+		modH->xUsbRxArmed = true;
+		USBD_CDC_SetRxBuffer(modH->xUsbDevice, modH->u8Buffer);
+		USBD_CDC_ReceivePacket(modH->xUsbDevice);
+	}
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief
+ * Sends the frame of u8Buffer on the IN endpoint and waits until the host took its
+ * last packet, ModbusUsbTxCallback() wakes the task. Without it the state of the class
+ * is polled every tick. A master then receives its answer in u8Buffer and starts the
+ * timeout of the query. A frame sent while the device is not configured is lost, as
+ * on an unplugged serial line
+ *
+ * @ingroup usb
+ */
+static void sendUsbFrame(modbusHandler_t *modH)
+{
+	USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *) modH->xUsbDevice->pClassData;
+	TickType_t xTxStart = xTaskGetTickCount();
+
+	if (hcdc != NULL)
+	{
+		USBD_CDC_SetTxBuffer(modH->xUsbDevice, modH->u8Buffer, modH->u16BufferSize);
+		if (USBD_CDC_TransmitPacket(modH->xUsbDevice) == USBD_OK)
+		{
+			while (hcdc->TxState != 0 && (xTaskGetTickCount() - xTxStart) < 250)
+			{
+				ulTaskNotifyTake(pdTRUE, 1);
+			}
+		}
+	}
+
+#if MB_ENABLE_MASTER == 1
+	if (modH->uModbusType == MB_MASTER)
+	{
+		startUsbRx(modH);
+		startTimeout(modH);
+	}
+#endif
+}
+#endif
+
+
+#if ENABLE_MB_BLE == 1
+/**
+ * @brief
+ * Starts a BLE_HW slave. The application owns the GATT server on the radio core:
+ * it writes the requests of the Modbus characteristic to ModbusBleRxCallback() and
+ * sends the answers in xBleNotify(). The link state comes from ModbusBleLink()
+ *
+ * @ingroup ble
+ */
+static void startBle(modbusHandler_t *modH)
+{
+	if (modH->uModbusType != MB_SLAVE || modH->xBleNotify == NULL)
+	{
+		while(1); //ERROR a BLE_HW handler is a slave and needs the xBleNotify of its characteristic
+	}
+
+	startBleRx(modH);
+}
+
+/**
+ * @brief
+ * Restarts the reception of a PDU behind u8Buffer[ ID ], the writes received
+ * while the task served the last request were dropped
+ *
+ * @ingroup ble
+ */
+static void startBleRx(modbusHandler_t *modH)
+{
+	taskENTER_CRITICAL();
+	modH->u16BleRxLen = 0;
+	modH->xBleRxOver = false;
+	modH->xBleRxArmed = true;
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief
+ * This is the receive function of the BLE_HW handlers, the GATT event handler of the
+ * application calls it with the value of each write of the Modbus characteristic, in
+ * task context. A request PDU spans writes of MTU - 3 bytes: a shorter write ends it,
+ * an empty one included, and so does the MB_BLE_PDU byte of the longest PDU. The
+ * central sends its next request after the notification of the answer, writes received
+ * before are dropped as GATT has no flow control for them
+ *
+ * @ingroup ble
+ */
+void ModbusBleRxCallback(modbusHandler_t *modH, const uint8_t *u8Data, uint16_t u16Len)
+{
+	uint16_t u16Seg;
 
+	if (modH == NULL || modH->xTypeHW != BLE_HW || !modH->xBleRxArmed || modH->u16BleMtu == 0) return;
 
-	sendTxBuffer(modH);
+	u16Seg = modH->u16BleMtu - 3;
+	if (modH->xBleRxOver || u16Len > MB_BLE_PDU - modH->u16BleRxLen)
+	{
+		modH->xBleRxOver = true; // dropped up to its end, getRxBle() answers nothing
+	}
+	else
+	{
+		memcpy(&modH->u8Buffer[ 1 + modH->u16BleRxLen ], u8Data, u16Len);
+		modH->u16BleRxLen += u16Len;
+	}
 
-	xSemaphoreGive(modH->ModBusSphrHandle);
+	if (u16Len >= u16Seg && (modH->xBleRxOver || modH->u16BleRxLen < MB_BLE_PDU)) return; // the PDU goes on
+	if (modH->u16BleRxLen == 0 && !modH->xBleRxOver) return; // empty write between two PDUs
 
-	modH->i8state = COM_WAITING;
-	modH->i8lastError = 0;
-	return 0;
+	modH->xBleRxArmed = false;
+	MB_TRACE_FRAME(modH);
+	notifyModbus(modH, MB_EV_RX);
+}
 
+/**
+ * @brief
+ * Reports the link of a BLE_HW handler: MB_BLE_MTU at the connection, the ATT MTU of the
+ * exchange once the central negotiated it, 0 at the disconnection. A PDU in reception is
+ * dropped when the link changes. CFG_BLE_MAX_ATT_MTU of app_conf.h at 256 lets a central
+ * exchange an MTU that carries the 252 byte answer of a 125 registers read in one notification
+ *
+ * @ingroup ble
+ */
+void ModbusBleLink(modbusHandler_t *modH, uint16_t u16Mtu)
+{
+	if (modH == NULL || modH->xTypeHW != BLE_HW) return;
 
+	taskENTER_CRITICAL();
+	modH->u16BleMtu = (u16Mtu != 0 && u16Mtu < 23) ? 23 : u16Mtu;
+	modH->u16BleRxLen = 0;
+	modH->xBleRxOver = false;
+	taskEXIT_CRITICAL();
 }
+#endif
 
 
-void StartTaskModbusMaster(void *argument)
+#if MB_READ_COILS
+/**
+ * @brief
+ * Packs u16Coilno coils starting at u16StartCoil into frame bytes, LSB first.
+ * Each byte is a shift of a two register window, the unused bits of the last byte are 0
+ *
+ * @ingroup discrete
+ */
+static void readCoils(const uint16_t *u16regs, uint16_t u16StartCoil, uint16_t u16Coilno, uint8_t *u8bits)
 {
+    uint32_t u32bit = u16StartCoil;
+    uint32_t u32left = u16Coilno;
 
-  modbusHandler_t *modH =  (modbusHandler_t *)argument;
-  uint32_t ulNotificationValue;
-  modbus_t telegram;
+    while (u32left > 0)
+    {
+        uint32_t u32n = (u32left < 8) ? u32left : 8;
+        uint32_t u32shift = u32bit & 15;
+        uint32_t u32window = u16regs[ u32bit >> 4 ];
 
+        // the next register only when the byte crosses it, never past the last coil
+        if (u32shift + u32n > 16) u32window |= (uint32_t)u16regs[ (u32bit >> 4) + 1 ] << 16;
 
+        *u8bits++ = (uint8_t)((u32window >> u32shift) & (0xFFu >> (8 - u32n)));
+        u32bit += u32n;
+        u32left -= u32n;
+    }
+}
+#endif
 
-  for(;;)
-  {
-	  /*Wait indefinitely for a telegram to send */
-	  xQueueReceive(modH->QueueTelegramHandle, &telegram, portMAX_DELAY);
+#if MB_WRITE_COILS
 
-     // This is the case for implementations with only USART support
-     SendQuery(modH, telegram);
-     /* Block indefinitely until a Modbus Frame arrives or query timeouts*/
-     ulNotificationValue = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+/**
+ * @brief
+ * Unpacks u16Coilno coils from frame bytes, LSB first, into the registers from u16StartCoil.
+ * Each register is updated once with a mask, the coils around the range are kept
+ *
+ * @ingroup discrete
+ */
+static void writeCoils(uint16_t *u16regs, uint16_t u16StartCoil, uint16_t u16Coilno, const uint8_t *u8bits)
+{
+    uint32_t u32coil = u16StartCoil;
+    uint32_t u32end = (uint32_t)u16StartCoil + u16Coilno;
 
-	  // notify the task the request timeout
-      modH->i8lastError = 0;
-      if(ulNotificationValue)
-      {
-    	  modH->i8state = COM_IDLE;
-    	  modH->i8lastError = ERR_TIME_OUT;
-    	  modH->u16errCnt++;
-    	  xTaskNotify((TaskHandle_t)telegram.u32CurrentTask, modH->i8lastError, eSetValueWithOverwrite);
-    	  continue;
-      }
+    while (u32coil < u32end)
+    {
+        uint32_t u32shift = u32coil & 15;
+        uint32_t u32n = 16 - u32shift;
+        if (u32n > u32end - u32coil) u32n = u32end - u32coil;
+
+        // 16 frame bits from the bit offset of this coil
+        uint32_t u32src = u32coil - u16StartCoil;
+        const uint8_t *p = &u8bits[ u32src >> 3 ];
+        uint32_t u32val = (p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16)) >> (u32src & 7);
+
+        uint16_t u16mask = (uint16_t)(((1UL << u32n) - 1) << u32shift);
+        uint16_t *u16reg = &u16regs[ u32coil >> 4 ];
+#if ENABLE_MB_ATOMIC_COILS == 1
+        updateCoilWord(u16reg, u16mask, (uint16_t)(u32val << u32shift)); // single coils are set without lock
+#else
+        *u16reg = (*u16reg & ~u16mask) | ((uint16_t)(u32val << u32shift) & u16mask);
+#endif
 
-      getRxBuffer(modH);
+        u32coil += u32n;
+    }
+}
+#endif
 
-	  if ( modH->u8BufferSize < 6){
+#if MB_PUT_REGISTERS
 
-		  modH->i8state = COM_IDLE;
-		  modH->i8lastError = ERR_BAD_SIZE;
-		  modH->u16errCnt++;
-		  xTaskNotify((TaskHandle_t)telegram.u32CurrentTask, modH->i8lastError, eSetValueWithOverwrite);
-		  continue;
-	  }
+/**
+ * @brief
+ * Copies registers to a frame in Modbus (big endian) order, two registers per
+ * __REV16. The frame side is unaligned after the 3 byte answer header, the
+ * memcpy of 4 bytes becomes a single LDR/STR on cores with unaligned access
+ *
+ * @ingroup register
+ */
+MB_HOT_CODE static void putRegisters(uint8_t *u8dst, const uint16_t *u16src, uint16_t u16regsno)
+{
+    uint32_t u32pair;
+
+    while (u16regsno >= 2)
+    {
+        memcpy(&u32pair, u16src, sizeof(u32pair));
+        u32pair = __REV16(u32pair);
+        memcpy(u8dst, &u32pair, sizeof(u32pair));
+        u16src += 2;
+        u8dst += 4;
+        u16regsno -= 2;
+    }
 
-	  xTimerStop(modH->xTimerTimeout,0); // cancel timeout timer
+    if (u16regsno)
+    {
+        u8dst[0] = highByte(*u16src);
+        u8dst[1] = lowByte(*u16src);
+    }
+}
+#endif
 
+#if MB_GET_REGISTERS
 
-	  // validate message: id, CRC, FCT, exception
-	  int8_t u8exception = validateAnswer(modH);
-	  if (u8exception != 0)
-	  {
-		 modH->i8state = COM_IDLE;
-         modH->i8lastError = u8exception;
-		 xTaskNotify((TaskHandle_t)telegram.u32CurrentTask, modH->i8lastError, eSetValueWithOverwrite);
-	     continue;
-	  }
+/**
+ * @brief
+ * Copies registers from a frame in Modbus (big endian) order, two registers
+ * per __REV16, see putRegisters()
+ *
+ * @ingroup register
+ */
+MB_HOT_CODE static void getRegisters(uint16_t *u16dst, const uint8_t *u8src, uint16_t u16regsno)
+{
+    uint32_t u32pair;
 
-	  modH->i8lastError = u8exception;
+    while (u16regsno >= 2)
+    {
+        memcpy(&u32pair, u8src, sizeof(u32pair));
+        u32pair = __REV16(u32pair);
+        memcpy(u16dst, &u32pair, sizeof(u32pair));
+        u8src += 4;
+        u16dst += 2;
+        u16regsno -= 2;
+    }
 
-	  xSemaphoreTake(modH->ModBusSphrHandle , portMAX_DELAY); //before processing the message get the semaphore
-	  // process answer
-	  switch( modH->u8Buffer[ FUNC ] )
-	  {
-	  case MB_FC_READ_COILS:
-	  case MB_FC_READ_DISCRETE_INPUT:
-	      //call get_FC1 to transfer the incoming message to u16regs buffer
-	      get_FC1(modH);
-	      break;
-	  case MB_FC_READ_INPUT_REGISTER:
-	  case MB_FC_READ_REGISTERS :
-	      // call get_FC3 to transfer the incoming message to u16regs buffer
-	      get_FC3(modH);
-	      break;
-	  case MB_FC_WRITE_COIL:
-	  case MB_FC_WRITE_REGISTER :
-	  case MB_FC_WRITE_MULTIPLE_COILS:
-	  case MB_FC_WRITE_MULTIPLE_REGISTERS :
-	      // nothing to do
-	      break;
-	  default:
-	      break;
-	  }
-	  modH->i8state = COM_IDLE;
+    if (u16regsno)
+    {
+        *u16dst = word(u8src[0], u8src[1]);
+    }
+}
+#endif
 
-	  if (modH->i8lastError ==0) // no error the error_OK, we need to use a different value than 0 to detect the timeout
-	  {
-		  xSemaphoreGive(modH->ModBusSphrHandle); //Release the semaphore
-		  xTaskNotify((TaskHandle_t)telegram.u32CurrentTask, ERR_OK_QUERY, eSetValueWithOverwrite);
-	  }
+/**
+ * @brief
+ * Copies u16Regs registers, with the two bytes of each one swapped when xSwap,
+ * two registers per __REV16
+ *
+ * @ingroup register
+ */
+static void copyRegisters(void *pvDst, const void *pvSrc, uint16_t u16Regs, bool xSwap)
+{
+    uint8_t *u8dst = (uint8_t *)pvDst;
+    const uint8_t *u8src = (const uint8_t *)pvSrc;
+    uint32_t u32pair;
 
+    if (!xSwap)
+    {
+        memmove(u8dst, u8src, u16Regs * sizeof(uint16_t));
+        return;
+    }
 
-	  continue;
-	 }
+    while (u16Regs >= 2)
+    {
+        memcpy(&u32pair, u8src, sizeof(u32pair));
+        u32pair = __REV16(u32pair);
+        memcpy(u8dst, &u32pair, sizeof(u32pair));
+        u8src += 4;
+        u8dst += 4;
+        u16Regs -= 2;
+    }
+
+    if (u16Regs)
+    {
+        uint8_t u8Hi = u8src[0];
 
+        u8dst[0] = u8src[1];
+        u8dst[1] = u8Hi;
+    }
 }
 
 /**
- * This method processes functions 1 & 2 (for master)
- * This method puts the slave answer into master data buffer
+ * @brief
+ * Converts u16Regs registers of a table or a telegram image to native values of
+ * xType in pvDst, which needs no alignment. The registers of a last incomplete
+ * value are left out. Strings keep their byte order, only MB_WORD_HL_SWAP applies
  *
  * @ingroup register
  */
-void get_FC1(modbusHandler_t *modH)
+void ModbusRegsToValues(void *pvDst, const uint16_t *u16src, uint16_t u16Regs, mb_type_t xType, mb_wordorder_t xOrder)
 {
-    uint8_t u8byte, i;
-    u8byte = 3;
-     for (i=0; i< modH->u8Buffer[2]; i++) {
+    uint8_t *u8dst = (uint8_t *)pvDst;
+    uint32_t u32Val;
+    uint64_t u64Val;
 
-        if(i%2)
+    switch (xType)
+    {
+    case MB_TYPE_U32:
+    case MB_TYPE_I32:
+    case MB_TYPE_F32:
+        for (; u16Regs >= 2; u16Regs -= 2, u16src += 2, u8dst += sizeof(u32Val))
         {
-        	modH->u16regsCoils[i/2]= word(modH->u8Buffer[i+u8byte], lowByte(modH->u16regsCoils[i/2]));
+            u32Val = ModbusRegsToU32(u16src, xOrder);
+            memcpy(u8dst, &u32Val, sizeof(u32Val));
         }
-        else
+        break;
+    case MB_TYPE_U64:
+    case MB_TYPE_I64:
+    case MB_TYPE_F64:
+        for (; u16Regs >= 4; u16Regs -= 4, u16src += 4, u8dst += sizeof(u64Val))
         {
-
-        	modH->u16regsCoils[i/2]= word(highByte(modH->u16regsCoils[i/2]), modH->u8Buffer[i+u8byte]);
+            u64Val = ModbusRegsToU64(u16src, xOrder);
+            memcpy(u8dst, &u64Val, sizeof(u64Val));
         }
-
-     }
+        break;
+    default:
+        // the characters are in frame order, high byte first, the 16 bit values in core order
+        copyRegisters(u8dst, u16src, u16Regs, (xType == MB_TYPE_STRING) != ((xOrder & MB_WORD_HL_SWAP) != 0));
+        break;
+    }
 }
 
 /**
- * This method processes functions 3 & 4 (for master)
- * This method puts the slave answer into master data buffer
+ * @brief
+ * Converts native values of xType in pvSrc to u16Regs registers, see ModbusRegsToValues()
  *
  * @ingroup register
  */
-void get_FC3(modbusHandler_t *modH)
+void ModbusValuesToRegs(uint16_t *u16dst, const void *pvSrc, uint16_t u16Regs, mb_type_t xType, mb_wordorder_t xOrder)
 {
-    uint8_t u8byte, i;
-    u8byte = 3;
+    const uint8_t *u8src = (const uint8_t *)pvSrc;
+    uint32_t u32Val;
+    uint64_t u64Val;
 
-    for (i=0; i< modH->u8Buffer[ 2 ] /2; i++)
+    switch (xType)
     {
-    	modH->u16regsHR[ i ] = word(modH->u8Buffer[ u8byte ], modH->u8Buffer[ u8byte +1 ]);
-        u8byte += 2;
+    case MB_TYPE_U32:
+    case MB_TYPE_I32:
+    case MB_TYPE_F32:
+        for (; u16Regs >= 2; u16Regs -= 2, u16dst += 2, u8src += sizeof(u32Val))
+        {
+            memcpy(&u32Val, u8src, sizeof(u32Val));
+            ModbusU32ToRegs(u16dst, u32Val, xOrder);
+        }
+        break;
+    case MB_TYPE_U64:
+    case MB_TYPE_I64:
+    case MB_TYPE_F64:
+        for (; u16Regs >= 4; u16Regs -= 4, u16dst += 4, u8src += sizeof(u64Val))
+        {
+            memcpy(&u64Val, u8src, sizeof(u64Val));
+            ModbusU64ToRegs(u16dst, u64Val, xOrder);
+        }
+        break;
+    default:
+        copyRegisters(u16dst, u8src, u16Regs, (xType == MB_TYPE_STRING) != ((xOrder & MB_WORD_HL_SWAP) != 0));
+        break;
     }
 }
 
-
+#if MB_SLAVE_FC(MB_ENABLE_FC1) || MB_SLAVE_FC(MB_ENABLE_FC2)
 
 /**
  * @brief
- * This method validates master incoming messages
+ * This method processes functions 1 & 2
+ * This method reads a bit array and transfers it to the master
  *
- * @return 0 if OK, EXCEPTION if anything fails
- * @ingroup buffer
+ * @return 0, the answer is left in u8Buffer
+ * @ingroup discrete
  */
-uint8_t validateAnswer(modbusHandler_t *modH)
+int16_t process_FC1(modbusHandler_t *modH)
 {
-    // check message crc vs calculated crc
+    uint8_t u8bytesno;
 
-	uint16_t u16MsgCRC =
-        ((modH->u8Buffer[modH->u8BufferSize - 2] << 8)
-         | modH->u8Buffer[modH->u8BufferSize - 1]); // combine the crc Low & High bytes
-    if ( calcCRC(modH->u8Buffer,  modH->u8BufferSize-2) != u16MsgCRC )
-    {
-    	modH->u16errCnt ++;
-        return ERR_BAD_CRC;
-    }
+    uint16_t *u16regs;
 
-    // check exception
-    if ((modH->u8Buffer[ FUNC ] & 0x80) != 0)
-    {
-    	modH->u16errCnt ++;
-        return ERR_EXCEPTION;
-    }
+    // get the first and last coil from the message
+    uint16_t u16StartCoil = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
+    uint16_t u16Coilno = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
 
-    // check fct code
-    bool isSupported = false;
-    for (uint8_t i = 0; i< sizeof( fctsupported ); i++)
-    {
-        if (fctsupported[i] == modH->u8Buffer[FUNC])
-        {
-            isSupported = 1;
-            break;
-        }
+    // put the number of bytes in the outcoming message
+    u8bytesno = (uint8_t) (u16Coilno / 8);
+    if (u16Coilno % 8 != 0) u8bytesno ++;
+    modH->u8Buffer[ ADD_HI ]  = u8bytesno;
+    modH->u16BufferSize         = ADD_LO;
+
+    if (modH->u8Buffer[ FUNC ] == MB_FC_READ_COILS){
+    	u16regs = modH->u16regsCoils;
     }
-    if (!isSupported)
-    {
-    	modH->u16errCnt ++;
-        return EXC_FUNC_CODE;
+    else{
+    	u16regs = modH->u16regsCoilsRO;
     }
 
-    return 0; // OK, no exception code thrown
+
+    // read the coils from the register map and put them inside the outcoming message
+    readCoils(u16regs, u16StartCoil, u16Coilno, &modH->u8Buffer[ modH->u16BufferSize ]);
+
+    // outcoming message
+    modH->u16BufferSize += u8bytesno;
+    return 0;
 }
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC3) || MB_SLAVE_FC(MB_ENABLE_FC4)
 
 
 /**
  * @brief
- * This method moves Serial buffer data to the Modbus u8Buffer.
+ * This method processes functions 3 & 4
+ * This method reads a word array and transfers it to the master
  *
- * @return buffer size if OK, ERR_BUFF_OVERFLOW if u8BufferSize >= MAX_BUFFER
- * @ingroup buffer
+ * @return 0, the answer is left in u8Buffer, or the exception of the on-read callback
+ * @ingroup register
  */
-int16_t getRxBuffer(modbusHandler_t *modH)
+MB_HOT_CODE int16_t process_FC3(modbusHandler_t *modH)
 {
 
-    int16_t i16result;
+    uint16_t u16StartAdd = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
+    uint16_t u16regsno = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
+    uint8_t u8table = (modH->u8Buffer[ FUNC ] == MB_FC_READ_REGISTERS) ? DB_HOLDING_REGISTER : DB_INPUT_REGISTERS;
+    uint8_t u8exception;
 
-    if(modH->xTypeHW == USART_HW)
+#if ENABLE_MB_DIAG_REGS == 1
+    if (isDiagRange(u8table, u16StartAdd, u16regsno))
     {
-    	HAL_UART_AbortReceive_IT(modH->port); // disable interrupts to avoid race conditions on serial port
+    	modH->u8Buffer[ 2 ] = (uint8_t)(u16regsno * 2);
+    	putDiagnostics(modH, &modH->u8Buffer[ 3 ], u16StartAdd, u16regsno);
+    	modH->u16BufferSize = 3 + u16regsno * 2;
+    	return 0;
     }
+#endif
 
-	if (modH->xBufferRX.overflow)
+    // let the application compute the requested registers
+    u8exception = readSegment(modH, u8table, u16StartAdd, u16regsno);
+    if (u8exception != 0) return u8exception;
+
+    modH->u8Buffer[ 2 ]       = (uint8_t)(u16regsno * 2);
+    modH->u16BufferSize         = 3;
+
+#if ENABLE_MB_RO_SNAPSHOT == 1
+    if (u8table == DB_INPUT_REGISTERS && modH->u16regsROBank[0] != NULL)
     {
-       	RingClear(&modH->xBufferRX); // clean up the overflowed buffer
-       	i16result =  ERR_BUFF_OVERFLOW;
+    	putSnapshot(modH, &modH->u8Buffer[ modH->u16BufferSize ], u16StartAdd, u16regsno);
+    	modH->u16BufferSize += u16regsno * 2;
+    	return 0;
     }
-	else
-	{
-		modH->u8BufferSize = RingGetAllBytes(&modH->xBufferRX, modH->u8Buffer);
-		modH->u16InCnt++;
-		i16result = modH->u8BufferSize;
-	}
+#endif
+#if ENABLE_MB_SHARED_HR == 1
+    if (u8table == DB_HOLDING_REGISTER && isSharedHR(modH))
+    {
+    	// copied, the staging bank the DMA would send from is written by the other slaves
+    	putCommittedHR(modH, &modH->u8Buffer[ modH->u16BufferSize ], u16StartAdd, u16regsno);
+    	modH->u16BufferSize += u16regsno * 2;
+    	return 0;
+    }
+#endif
 
-	if(modH->xTypeHW == USART_HW)
-	{
-		HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1);
-	}
+#if ENABLE_MB_TX_GATHER == 1
+    if (gatherTable(modH, u8table, u16StartAdd, u16regsno)) return 0; // u8Buffer keeps the header only
+#endif
+#if ENABLE_MB_TX_STREAM == 1
+    if (streamTable(modH, u8table, u16StartAdd, u16regsno)) return 0; // u8Buffer keeps the header only
+#endif
+    putTable(modH, u8table, u16StartAdd, u16regsno, &modH->u8Buffer[ modH->u16BufferSize ]);
+    modH->u16BufferSize += u16regsno * 2;
 
-    return i16result;
+    return 0;
 }
+#endif
 
-
-
-
+#if MB_SLAVE_FC(MB_ENABLE_FC8)
 
 /**
  * @brief
- * This method validates slave incoming messages
+ * This method processes function 8
+ * The echo and the clear return the query, the counters answer their low 16 bits
+ * in the data field
  *
- * @return 0 if OK, EXCEPTION if anything fails
- * @ingroup modH Modbus handler
+ * @return 0, the answer is left in u8Buffer
+ * @ingroup register
  */
-uint8_t validateRequest(modbusHandler_t *modH)
+int16_t process_FC8(modbusHandler_t *modH)
 {
-	// check message crc vs calculated crc
-
-	    uint16_t u16MsgCRC;
-	    u16MsgCRC= ((modH->u8Buffer[modH->u8BufferSize - 2] << 8)
-	    		   	         | modH->u8Buffer[modH->u8BufferSize - 1]); // combine the crc Low & High bytes
+	const modbusErrStats_t *xErr = &modH->xErrStats;
+	uint16_t u16sub = word( modH->u8Buffer[ 2 ], modH->u8Buffer[ 3 ]);
+	uint32_t u32count = 0;
 
+	switch (u16sub)
+	{
+	case MB_FC8_ECHO:
+		modH->u16BufferSize -= 2; // the query without its CRC
+		return 0;
+	case MB_FC8_CLEAR:
+		ModbusResetStats(modH);
+		modH->u16InCnt = modH->u16OutCnt = modH->u16errCnt = 0;
+		modH->u16BufferSize = RESPONSE_SIZE;
+		return 0;
+#if ENABLE_MB_LISTEN_ONLY == 1
+	case MB_FC8_RESTART:
+		// the echo is not sent when the request was heard in listen only mode
+		modH->xListenOnly = false;
+		ModbusResetStats(modH);
+		modH->u16InCnt = modH->u16OutCnt = modH->u16errCnt = 0;
+		modH->u16BufferSize = RESPONSE_SIZE;
+		return 0;
+	case MB_FC8_LISTEN:
+		modH->xListenOnly = true;
+		return -1; // never answered
+#endif
+	case MB_FC8_BUS_MSG:
+		u32count = modH->u16InCnt;
+		break;
+	case MB_FC8_BUS_ERR:
+		u32count = xErr->u32Err[ MB_ERR_INDEX(ERR_BAD_CRC) ];
+		break;
+	case MB_FC8_EXC_ERR:
+		for (uint8_t i = 0; i < MB_EXC_TYPES; i++) u32count += xErr->u32Exc[ i ];
+		break;
+	case MB_FC8_SLAVE_MSG:
+		u32count = xErr->u32SlaveMsg;
+		break;
+	case MB_FC8_NO_RESP:
+		u32count = xErr->u32NoResponse;
+		break;
+	case MB_FC8_NAK:
+		u32count = xErr->u32Exc[ 7 - 1 ];
+		break;
+	case MB_FC8_BUSY:
+		u32count = xErr->u32Exc[ 6 - 1 ];
+		break;
+	default: // MB_FC8_OVERRUN, characters lost by the UART or frames by the RX buffer
+		u32count = xErr->u32Overrun + xErr->u32Err[ MB_ERR_INDEX(ERR_BUFF_OVERFLOW) ];
+		break;
+	}
 
-	    if ( calcCRC( modH->u8Buffer,  modH->u8BufferSize-2 ) != u16MsgCRC )
-	    {
-	       		modH->u16errCnt ++;
-	       		return ERR_BAD_CRC;
-	    }
+	modH->u8Buffer[ 4 ] = highByte((uint16_t)u32count);
+	modH->u8Buffer[ 5 ] = lowByte((uint16_t)u32count);
+	modH->u16BufferSize = RESPONSE_SIZE;
+	return 0;
+}
+#endif
 
+#if MB_SLAVE_FC(MB_ENABLE_FC5)
 
+/**
+ * @brief
+ * This method processes function 5
+ * This method writes a value assigned by the master to a single bit
+ *
+ * @return 0, the answer is left in u8Buffer
+ * @ingroup discrete
+ */
+int16_t process_FC5( modbusHandler_t *modH )
+{
+    uint8_t u8currentBit;
+    uint16_t u16currentRegister;
+    uint16_t u16coil = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
 
-	    // check fct code
-	    bool isSupported = false;
-	    for (uint8_t i = 0; i< sizeof( fctsupported ); i++)
-	    {
-	        if (fctsupported[i] == modH->u8Buffer[FUNC])
-	        {
-	            isSupported = 1;
-	            break;
-	        }
-	    }
-	    if (!isSupported)
-	    {
-	    	modH->u16errCnt ++;
-	        return EXC_FUNC_CODE;
-	    }
+    // point to the register and its bit
+    u16currentRegister = (u16coil / 16);
+    u8currentBit = (uint8_t) (u16coil % 16);
 
-	    // check start address & nb range
-	    uint16_t u16AdRegs = 0;
-	    uint16_t u16NRegs = 0;
+    // write to coil
+#if ENABLE_MB_ATOMIC_COILS == 1
+    updateCoilWord(&modH->u16regsCoils[ u16currentRegister ], (uint16_t)(1U << u8currentBit),
+    		(modH->u8Buffer[ NB_HI ] == 0xff) ? 0xFFFF : 0);
+#else
+    bitWrite(
+    	modH->u16regsCoils[ u16currentRegister ],
+        u8currentBit,
+		modH->u8Buffer[ NB_HI ] == 0xff );
+#endif
+#if ENABLE_MB_WRITE_NOTIFY == 1
+    markDirty(modH, DB_COILS, u16currentRegister, 1);
+#endif
 
-	    //uint8_t u8regs;
-	    switch ( modH->u8Buffer[ FUNC ] )
-	    {
-	    case MB_FC_READ_COILS:
-	    case MB_FC_READ_DISCRETE_INPUT:
-	    case MB_FC_WRITE_MULTIPLE_COILS:
-	    	u16AdRegs = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]) / 16;
-	    	u16NRegs = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]) /16;
-	    	if(word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]) % 16) u16NRegs++; // check for incomplete words
-	    	// verify address range
-	    	if((u16AdRegs + u16NRegs) > modH->u16regCoils_size) return EXC_ADDR_RANGE;
-
-	    	//verify answer frame size in bytes
-
-	    	u16NRegs = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]) / 8;
-	    	if(word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]) % 8) u16NRegs++;
-	    	u16NRegs = u16NRegs + 5; // adding the header  and CRC ( Slave address + Function code  + number of data bytes to follow + 2-byte CRC )
-	        if(u16NRegs > 256) return EXC_REGS_QUANT;
-
-	        break;
-	    case MB_FC_WRITE_COIL:
-	    	u16AdRegs = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]) / 16;
-	    	if(word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]) % 16) u16AdRegs++;	// check for incomplete words
-	        if (u16AdRegs > modH->u16regCoils_size) return EXC_ADDR_RANGE;
-	        break;
-	    case MB_FC_WRITE_REGISTER :
-	    	u16AdRegs = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]);
-	        if (u16AdRegs > modH-> u16regHR_size) return EXC_ADDR_RANGE;
-	        break;
-	    case MB_FC_READ_REGISTERS :
-	    case MB_FC_READ_INPUT_REGISTER :
-	    case MB_FC_WRITE_MULTIPLE_REGISTERS :
-	    	u16AdRegs = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ]);
-	        u16NRegs = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ]);
-	        if (( u16AdRegs + u16NRegs ) > modH->u16regHR_size) return EXC_ADDR_RANGE;
-
-	        //verify answer frame size in bytes
-	        u16NRegs = u16NRegs*2 + 5; // adding the header  and CRC
-	        if ( u16NRegs > 256 ) return EXC_REGS_QUANT;
-	        break;
-	    }
-	    return 0; // OK, no exception code thrown
+    // answer to master
+    modH->u16BufferSize = 6;
 
+    return 0;
 }
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC6)
 
 /**
  * @brief
- * This method creates a word from 2 bytes
+ * This method processes function 6
+ * This method writes a value assigned by the master to a single word
  *
- * @return uint16_t (word)
- * @ingroup H  Most significant byte
- * @ingroup L  Less significant byte
+ * @return 0, the answer is left in u8Buffer, or the exception of the on-write callback
+ * @ingroup register
  */
-uint16_t word(uint8_t H, uint8_t L)
+int16_t process_FC6(modbusHandler_t *modH)
 {
-	bytesFields W;
-	W.u8[0] = L;
-	W.u8[1] = H;
 
-	return W.u16[0];
+    uint16_t u16add = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
+    uint16_t u16val = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
+
+    if (isWireOrder(modH, DB_HOLDING_REGISTER, u16add, 1)) u16val = (uint16_t)__REV16(u16val);
+    *mapRegisters(modH, DB_HOLDING_REGISTER, u16add, 1) = u16val;
+#if ENABLE_MB_WRITE_NOTIFY == 1
+    markDirty(modH, DB_HOLDING_REGISTER, u16add, 1);
+#endif
+#if ENABLE_MB_HR_COMMIT == 1
+    stageHR(modH, u16add, 1);
+#endif
+
+    // keep the same header
+    modH->u16BufferSize = RESPONSE_SIZE;
+
+    return writeSegment(modH, u16add, 1);
 }
+#endif
 
+#if MB_SLAVE_FC(MB_ENABLE_FC15)
 
 /**
  * @brief
- * This method calculates CRC
+ * This method processes function 15
+ * This method writes a bit array assigned by the master
  *
- * @return uint16_t calculated CRC value for the message
- * @ingroup Buffer
- * @ingroup u8length
+ * @return 0, the answer is left in u8Buffer
+ * @ingroup discrete
  */
-uint16_t calcCRC(uint8_t *Buffer, uint8_t u8length)
+int16_t process_FC15( modbusHandler_t *modH )
 {
-    unsigned int temp, temp2, flag;
-    temp = 0xFFFF;
-    for (unsigned char i = 0; i < u8length; i++)
-    {
-        temp = temp ^ Buffer[i];
-        for (unsigned char j = 1; j <= 8; j++)
-        {
-            flag = temp & 0x0001;
-            temp >>=1;
-            if (flag)
-                temp ^= 0xA001;
-        }
-    }
-    // Reverse byte order.
-    temp2 = temp >> 8;
-    temp = (temp << 8) | temp2;
-    temp &= 0xFFFF;
-    // the returned value is already swapped
-    // crcLo byte is first & crcHi byte is last
-    return temp;
+    // get the first and last coil from the message
+    uint16_t u16StartCoil = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
+    uint16_t u16Coilno = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
+
+    // write the coils of the frame into the register map
+    writeCoils(modH->u16regsCoils, u16StartCoil, u16Coilno, &modH->u8Buffer[ BYTE_CNT + 1 ]);
+#if ENABLE_MB_WRITE_NOTIFY == 1
+    markDirty(modH, DB_COILS, u16StartCoil / 16, (u16StartCoil + u16Coilno - 1) / 16 - u16StartCoil / 16 + 1);
+#endif
 
+    // outcoming message
+    // it's just a copy of the incomping frame until 6th byte
+    modH->u16BufferSize         = 6;
+    return 0;
 }
+#endif
 
+#if MB_SLAVE_FC(MB_ENABLE_FC16)
 
 /**
  * @brief
- * This method builds an exception message
+ * This method processes function 16
+ * This method writes a word array assigned by the master
  *
- * @ingroup u8exception exception number
- * @ingroup modH modbus handler
+ * @return 0, the answer is left in u8Buffer, or the exception of the on-write callback
+ * @ingroup register
  */
-void buildException( uint8_t u8exception, modbusHandler_t *modH )
+int16_t process_FC16(modbusHandler_t *modH )
 {
-    uint8_t u8func = modH->u8Buffer[ FUNC ];  // get the original FUNC code
+    uint16_t u16StartAdd = modH->u8Buffer[ ADD_HI ] << 8 | modH->u8Buffer[ ADD_LO ];
+    uint16_t u16regsno = modH->u8Buffer[ NB_HI ] << 8 | modH->u8Buffer[ NB_LO ];
 
-    modH->u8Buffer[ ID ]      = modH->u8id;
-    modH->u8Buffer[ FUNC ]    = u8func + 0x80;
-    modH->u8Buffer[ 2 ]       = u8exception;
-    modH->u8BufferSize         = EXCEPTION_SIZE;
+    // build header
+    modH->u8Buffer[ NB_HI ]   = 0;
+    modH->u8Buffer[ NB_LO ]   = (uint8_t) u16regsno; // answer is always 256 or less bytes
+    modH->u16BufferSize         = RESPONSE_SIZE;
+
+    // write registers
+    getTable(modH, u16StartAdd, u16regsno, &modH->u8Buffer[ BYTE_CNT + 1 ]);
+#if ENABLE_MB_WRITE_NOTIFY == 1
+    markDirty(modH, DB_HOLDING_REGISTER, u16StartAdd, u16regsno);
+#endif
+#if ENABLE_MB_HR_COMMIT == 1
+    stageHR(modH, u16StartAdd, u16regsno);
+#endif
+
+    // one notification for the whole block
+    return writeSegment(modH, u16StartAdd, u16regsno);
 }
+#endif
 
+#if MB_SLAVE_FC(MB_ENABLE_FC20)
 
 /**
  * @brief
- * This method transmits u8Buffer to Serial line.
- * Only if u8txenpin != 0, there is a flow handling in order to keep
- * the RS485 transceiver in output state as long as the message is being sent.
- * This is done with TC bit.
- * The CRC is appended to the buffer before starting to send it.
+ * This method processes function 20
+ * This method answers the records of every sub-request in one frame. The
+ * sub-requests move to the end of u8Buffer first, the answer grows from its
+ * start without reaching them, see validate_FC20()
  *
- * @return nothing
- * @ingroup modH Modbus handler
+ * @return 0, the answer is left in u8Buffer, or the exception of a file callback
+ * @ingroup register
  */
-static void sendTxBuffer(modbusHandler_t *modH)
+int16_t process_FC20(modbusHandler_t *modH )
 {
-    // append CRC to message
-	uint16_t u16crc = calcCRC(modH->u8Buffer, modH->u8BufferSize);
-    modH->u8Buffer[ modH->u8BufferSize ] = u16crc >> 8;
-    modH->u8BufferSize++;
-    modH->u8Buffer[ modH->u8BufferSize ] = u16crc & 0x00ff;
-    modH->u8BufferSize++;
+    uint8_t u8bytes = modH->u8Buffer[ 2 ];
+    uint8_t *u8sub = &modH->u8Buffer[ MAX_BUFFER - u8bytes ];
+    uint8_t *u8end = &modH->u8Buffer[ MAX_BUFFER ];
+    const modbusFile_t *xFile;
+    uint16_t u16Record, u16Count;
+    uint8_t u8exception;
 
+    memmove(u8sub, &modH->u8Buffer[ 3 ], u8bytes);
+    modH->u16BufferSize = 3;
 
-    	if (modH->EN_Port != NULL)
+    for (; u8sub < u8end; u8sub += REC_DATA)
+    {
+        xFile = findFile(modH, u8sub, false);
+        u16Record = word( u8sub[ REC_NO_HI ], u8sub[ REC_NO_LO ] );
+        u16Count = word( u8sub[ REC_LEN_HI ], u8sub[ REC_LEN_LO ] );
+
+        modH->u8Buffer[ modH->u16BufferSize++ ] = (uint8_t)(1 + u16Count * 2);
+        modH->u8Buffer[ modH->u16BufferSize++ ] = MB_FILE_REF_TYPE;
+        if (xFile->u16regs != NULL)
         {
-    		//enable transmitter, disable receiver to avoid echo on RS485 transceivers
-    		HAL_HalfDuplex_EnableTransmitter(modH->port);
-    		HAL_GPIO_WritePin(modH->EN_Port, modH->EN_Pin, GPIO_PIN_SET);
+            putRegisters(&modH->u8Buffer[ modH->u16BufferSize ], &xFile->u16regs[ u16Record ], u16Count);
         }
-
-#if ENABLE_USART_DMA ==1
-    	if(modH->xTypeHW == USART_HW)
-    	{
-#endif
-    		// transfer buffer to serial line IT
-    		HAL_UART_Transmit_IT(modH->port, modH->u8Buffer,  modH->u8BufferSize);
-
-#if ENABLE_USART_DMA ==1
-    	}
         else
         {
-        	//transfer buffer to serial line DMA
-        	HAL_UART_Transmit_DMA(modH->port, modH->u8Buffer, modH->u8BufferSize);
-
+            u8exception = xFile->xRead(xFile, u16Record, u16Count, &modH->u8Buffer[ modH->u16BufferSize ]);
+            if (u8exception != 0) return u8exception;
         }
-#endif
+        modH->u16BufferSize += u16Count * 2;
+    }
 
-        ulTaskNotifyTake(pdTRUE, 250); //wait notification from TXE interrupt
-/*
-* If you are porting the library to a different MCU check the 
-* USART datasheet and add the corresponding family in the following
-* preprocessor conditions
-*/
-#if defined(STM32H7)  || defined(STM32F3) || defined(STM32L4) || defined(STM32L082xx) || defined(STM32F7) || defined(STM32WB)
-          while((modH->port->Instance->ISR & USART_ISR_TC) ==0 )
-#else
-          // F429, F103, L152 ...
-	  while((modH->port->Instance->SR & USART_SR_TC) ==0 )
+    modH->u8Buffer[ 2 ] = (uint8_t)(modH->u16BufferSize - 3);
+    return 0;
+}
 #endif
-         {
- 	        //block the task until the the last byte is send out of the shifting buffer in USART
-         }
-
 
-         if (modH->EN_Port != NULL)
-         {
-
-             //return RS485 transceiver to receive mode
-        	 HAL_GPIO_WritePin(modH->EN_Port, modH->EN_Pin, GPIO_PIN_RESET);
-        	 //enable receiver, disable transmitter
-        	 HAL_HalfDuplex_EnableReceiver(modH->port);
-
-         }
+#if MB_SLAVE_FC(MB_ENABLE_FC21)
 
-         // set timeout for master query
-         if(modH->uModbusType == MB_MASTER )
-         {
-        	 xTimerReset(modH->xTimerTimeout,0);
-         }
+/**
+ * @brief
+ * This method processes function 21
+ * This method stores the records of every sub-request, the answer is the echo
+ * of the request
+ *
+ * @return 0, the answer is left in u8Buffer, or the exception of a file callback
+ * @ingroup register
+ */
+int16_t process_FC21(modbusHandler_t *modH )
+{
+    uint8_t u8bytes = modH->u8Buffer[ 2 ];
+    const modbusFile_t *xFile;
+    uint16_t u16Record, u16Count;
+    uint8_t *u8sub;
+    uint8_t u8exception;
+    uint16_t i;
 
-     modH->u8BufferSize = 0;
-     // increase message counter
-     modH->u16OutCnt++;
+    for (i = 3; i < 3 + u8bytes; i += REC_DATA + u16Count * 2)
+    {
+        u8sub = &modH->u8Buffer[ i ];
+        xFile = findFile(modH, u8sub, true);
+        u16Record = word( u8sub[ REC_NO_HI ], u8sub[ REC_NO_LO ] );
+        u16Count = word( u8sub[ REC_LEN_HI ], u8sub[ REC_LEN_LO ] );
 
+        if (xFile->u16regs != NULL)
+        {
+            getRegisters(&xFile->u16regs[ u16Record ], &u8sub[ REC_DATA ], u16Count);
+        }
+        else
+        {
+            u8exception = xFile->xWrite(xFile, u16Record, u16Count, &u8sub[ REC_DATA ]);
+            if (u8exception != 0) return u8exception;
+        }
+    }
 
+    modH->u16BufferSize = 3 + u8bytes;
+    return 0;
 }
+#endif
 
+#if MB_SLAVE_FC(MB_ENABLE_FC24)
 
 /**
  * @brief
- * This method processes functions 1 & 2
- * This method reads a bit array and transfers it to the master
+ * This method processes function 24
+ * This method moves up to MB_FIFO_MAX entries of the queue to the answer, after
+ * the byte count and the FIFO count, and removes them from the queue. Entries
+ * pushed meanwhile wait for the next request
  *
- * @return u8BufferSize Response to master length
- * @ingroup discrete
+ * @return 0, the answer is left in u8Buffer
+ * @ingroup register
  */
-int8_t process_FC1(modbusHandler_t *modH, uint8_t Database)
+int16_t process_FC24(modbusHandler_t *modH )
 {
-    uint16_t u16currentRegister;
-    uint8_t u8currentBit, u8bytesno, u8bitsno;
-    uint8_t u8CopyBufferSize;
-    uint16_t u16currentCoil, u16coil;
-
-    uint16_t *u16regs;
+    modbusFifo_t *xFifo = findFifo(modH, word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] ));
+    uint16_t u16Tail = xFifo->u16Tail;
+    uint16_t u16Count = xFifo->u16Head - u16Tail;
+    uint16_t u16Value;
 
-    // get the first and last coil from the message
-    uint16_t u16StartCoil = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
-    uint16_t u16Coilno = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
+    if (u16Count > MB_FIFO_MAX) u16Count = MB_FIFO_MAX;
+    if (u16Count > (MAX_BUFFER - 8) / 2) u16Count = (MAX_BUFFER - 8) / 2;
+    __DMB(); // the entries are read after the head that published them
 
-    // put the number of bytes in the outcoming message
-    u8bytesno = (uint8_t) (u16Coilno / 8);
-    if (u16Coilno % 8 != 0) u8bytesno ++;
-    modH->u8Buffer[ ADD_HI ]  = u8bytesno;
-    modH->u8BufferSize         = ADD_LO;
-    modH->u8Buffer[modH->u8BufferSize + u8bytesno - 1 ] = 0;
+    for (uint16_t i = 0; i < u16Count; i++)
+    {
+        u16Value = xFifo->u16Data[ (u16Tail + i) & (xFifo->u16Size - 1) ];
+        modH->u8Buffer[ 6 + 2 * i ] = highByte( u16Value );
+        modH->u8Buffer[ 7 + 2 * i ] = lowByte( u16Value );
+    }
+    __DMB(); // and before the producer may overwrite them
+    xFifo->u16Tail = u16Tail + u16Count;
 
-    // read each coil from the register map and put its value inside the outcoming message
-    u8bitsno = 0;
+    modH->u8Buffer[ 2 ] = highByte( 2 + u16Count * 2 );
+    modH->u8Buffer[ 3 ] = lowByte( 2 + u16Count * 2 );
+    modH->u8Buffer[ 4 ] = highByte( u16Count );
+    modH->u8Buffer[ 5 ] = lowByte( u16Count );
+    modH->u16BufferSize = 6 + u16Count * 2;
 
-    if (Database == 1){
-    	u16regs = modH->u16regsCoils;
-    }
+    return 0;
+}
+#endif
 
+#if MB_SLAVE_FC(MB_ENABLE_FC43)
 
-    for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++)
+/**
+ * @brief
+ * This method processes function 43, MEI type 14
+ * This method copies the objects of the requested category from the table to
+ * the answer, from the requested object id or from the first one of the category
+ * when the slave has no such object. When the next object does not fit, the
+ * answer says more follows with its id, and the master asks again from there
+ *
+ * @return 0, the answer is left in u8Buffer
+ * @ingroup register
+ */
+int16_t process_FC43(modbusHandler_t *modH )
+{
+    uint8_t u8Code = modH->u8Buffer[ 3 ];
+    uint8_t u8Start = modH->u8Buffer[ 4 ];
+    uint8_t u8Last = (u8Code == MB_DEVID_BASIC) ? MB_DEVID_REVISION : (u8Code == MB_DEVID_REGULAR) ? 0x7F : 0xFF;
+    const modbusDevIdObj_t *xObj = modH->xDevId;
+    const modbusDevIdObj_t *xEnd = modH->xDevId + modH->u8DevIdCount;
+    uint8_t u8Objects = 0;
+
+    if (u8Code == MB_DEVID_SPECIFIC)
+    {
+        xObj = findDevId(modH, u8Start);
+        xEnd = xObj + 1;
+    }
+    else if (u8Start <= u8Last && findDevId(modH, u8Start) != NULL)
     {
-        u16coil = u16StartCoil + u16currentCoil;
-        u16currentRegister =  (u16coil / 16);
-        u8currentBit = (uint8_t) (u16coil % 16);
+        xObj = findDevId(modH, u8Start);
+    }
 
-        bitWrite(
-        	modH->u8Buffer[ modH->u8BufferSize ],
-            u8bitsno,
-		    bitRead( u16regs[ u16currentRegister ], u8currentBit ) );
-        u8bitsno ++;
+    modH->u8Buffer[ 4 ] = modH->u8DevIdConformity;
+    modH->u8Buffer[ 5 ] = 0;  // more follows
+    modH->u8Buffer[ 6 ] = 0;  // next object id
+    modH->u16BufferSize = 8;
 
-        if (u8bitsno > 7)
+    for (; xObj < xEnd && xObj->u8Id <= u8Last; xObj++)
+    {
+        if (modH->u16BufferSize + 2 + xObj->u8Length > MB_DEVID_ROOM)
         {
-            u8bitsno = 0;
-            modH->u8BufferSize++;
+            modH->u8Buffer[ 5 ] = 0xFF;
+            modH->u8Buffer[ 6 ] = xObj->u8Id;
+            break;
         }
+        modH->u8Buffer[ modH->u16BufferSize++ ] = xObj->u8Id;
+        modH->u8Buffer[ modH->u16BufferSize++ ] = xObj->u8Length;
+        memcpy(&modH->u8Buffer[ modH->u16BufferSize ], xObj->pcValue, xObj->u8Length);
+        modH->u16BufferSize += xObj->u8Length;
+        u8Objects++;
     }
 
-    // send outcoming message
-    if (u16Coilno % 8 != 0) modH->u8BufferSize ++;
-    u8CopyBufferSize = modH->u8BufferSize +2;
-    sendTxBuffer(modH);
-    return u8CopyBufferSize;
+    modH->u8Buffer[ 7 ] = u8Objects;
+    return 0;
 }
+#endif
 
+#if MB_SLAVE_FC(MB_ENABLE_FC22)
 
 /**
  * @brief
- * This method processes functions 3 & 4
- * This method reads a word array and transfers it to the master
+ * This method processes function 22
+ * This method applies the AND and OR masks assigned by the master to a single word:
+ * result = (current AND and_mask) OR (or_mask AND NOT and_mask).
+ * The task holds the handler semaphore, so the update is atomic for the application
  *
- * @return u8BufferSize Response to master length
+ * @return 0, the answer is left in u8Buffer, or the exception of a segment callback
  * @ingroup register
  */
-int8_t process_FC3(modbusHandler_t *modH, uint8_t Database)
+int16_t process_FC22(modbusHandler_t *modH )
 {
+    uint16_t u16add = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
+    uint16_t u16and = word( modH->u8Buffer[ AND_HI ], modH->u8Buffer[ AND_LO ] );
+    uint16_t u16or = word( modH->u8Buffer[ OR_HI ], modH->u8Buffer[ OR_LO ] );
 
-    uint16_t u16StartAdd = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
-    uint8_t u8regsno = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
-    uint8_t u8CopyBufferSize;
-    uint16_t i;
-
-    uint16_t *u16regs;
+    uint16_t *u16reg = mapRegisters(modH, DB_HOLDING_REGISTER, u16add, 1);
+    uint8_t u8exception = readSegment(modH, DB_HOLDING_REGISTER, u16add, 1);
 
-    modH->u8Buffer[ 2 ]       = u8regsno * 2;
-    modH->u8BufferSize         = 3;
+    if (u8exception != 0) return u8exception;
 
-    if (Database == DB_HOLDING_REGISTER)
-    {
-    	u16regs = modH->u16regsHR;
-    }
-    else if (Database == DB_INPUT_REGISTERS)
+    // a register kept in wire order is masked as it is, with the masks swapped
+    if (isWireOrder(modH, DB_HOLDING_REGISTER, u16add, 1))
     {
-    	u16regs = modH->u16regsRO;
+    	u16and = (uint16_t)__REV16(u16and);
+    	u16or = (uint16_t)__REV16(u16or);
     }
 
-    for (i = u16StartAdd; i < u16StartAdd + u8regsno; i++)
-    {
-    	modH->u8Buffer[ modH->u8BufferSize ] = highByte(u16regs[i]);
-    	modH->u8BufferSize++;
-    	modH->u8Buffer[ modH->u8BufferSize ] = lowByte(u16regs[i]);
-    	modH->u8BufferSize++;
-    }
-    u8CopyBufferSize = modH->u8BufferSize +2;
-    sendTxBuffer(modH);
+#if MB_SLAVE_LIMITS
+    // the result depends on the current value, it is checked here rather than by validate_FC22()
+    uint16_t u16value = (*u16reg & u16and) | (u16or & (uint16_t)~u16and);
+    uint8_t u8value[2] = { highByte(u16value), lowByte(u16value) };
+
+    if (isWireOrder(modH, DB_HOLDING_REGISTER, u16add, 1)) memcpy(u8value, &u16value, 2);
+    u8exception = checkLimits(modH, u16add, 1, u8value);
+    if (u8exception != 0) return u8exception;
+#endif
+    *u16reg = (*u16reg & u16and) | (u16or & (uint16_t)~u16and);
+#if ENABLE_MB_WRITE_NOTIFY == 1
+    markDirty(modH, DB_HOLDING_REGISTER, u16add, 1);
+#endif
+#if ENABLE_MB_HR_COMMIT == 1
+    stageHR(modH, u16add, 1);
+#endif
+
+    // the answer is an echo of the request
+    modH->u16BufferSize = OR_LO + 1;
 
-    return u8CopyBufferSize;
+    return writeSegment(modH, u16add, 1);
 }
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC23)
 
 /**
  * @brief
- * This method processes function 5
- * This method writes a value assigned by the master to a single bit
+ * This method processes function 23
+ * This method writes a word array assigned by the master and then reads a
+ * word array back. Both run under the handler semaphore, so the master never
+ * sees a partially written block
  *
- * @return u8BufferSize Response to master length
- * @ingroup discrete
+ * @return 0, the answer is left in u8Buffer, or the exception of a segment callback
+ * @ingroup register
  */
-int8_t process_FC5( modbusHandler_t *modH )
+int16_t process_FC23(modbusHandler_t *modH )
 {
-    uint8_t u8currentBit;
-    uint16_t u16currentRegister;
-    uint8_t u8CopyBufferSize;
-    uint16_t u16coil = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
-
-    // point to the register and its bit
-    u16currentRegister = (u16coil / 16);
-    u8currentBit = (uint8_t) (u16coil % 16);
+    uint16_t u16ReadAdd = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
+    uint16_t u16ReadNo = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
+    uint16_t u16WriteAdd = word( modH->u8Buffer[ WR_ADD_HI ], modH->u8Buffer[ WR_ADD_LO ] );
+    uint16_t u16WriteNo = word( modH->u8Buffer[ WR_NB_HI ], modH->u8Buffer[ WR_NB_LO ] );
+    uint8_t u8exception;
+
+    // write registers first, the answer overwrites the request
+    getTable(modH, u16WriteAdd, u16WriteNo, &modH->u8Buffer[ WR_BYTE_CNT + 1 ]);
+#if ENABLE_MB_WRITE_NOTIFY == 1
+    markDirty(modH, DB_HOLDING_REGISTER, u16WriteAdd, u16WriteNo);
+#endif
+#if ENABLE_MB_HR_COMMIT == 1
+    stageHR(modH, u16WriteAdd, u16WriteNo);
+#endif
+    u8exception = writeSegment(modH, u16WriteAdd, u16WriteNo);
+    if (u8exception != 0) return u8exception;
 
-    // write to coil
-    bitWrite(
-    	modH->u16regsCoils[ u16currentRegister ],
-        u8currentBit,
-		modH->u8Buffer[ NB_HI ] == 0xff );
+    u8exception = readSegment(modH, DB_HOLDING_REGISTER, u16ReadAdd, u16ReadNo);
+    if (u8exception != 0) return u8exception;
 
+    // then read them back
+    modH->u8Buffer[ 2 ]       = (uint8_t)(u16ReadNo * 2);
+    modH->u16BufferSize         = 3;
 
-    // send answer to master
-    modH->u8BufferSize = 6;
-    u8CopyBufferSize =  modH->u8BufferSize +2;
-    sendTxBuffer(modH);
+    putTable(modH, DB_HOLDING_REGISTER, u16ReadAdd, u16ReadNo, &modH->u8Buffer[ modH->u16BufferSize ]);
+    modH->u16BufferSize += u16ReadNo * 2;
 
-    return u8CopyBufferSize;
+    return 0;
 }
+#endif
+
+#if MB_SLAVE_FC(MB_ENABLE_FC_RANGES)
 
 /**
  * @brief
- * This method processes function 6
- * This method writes a value assigned by the master to a single word
+ * This method processes MB_FC_READ_RANGES
+ * This method answers the registers of every range in one FC3 like frame. The
+ * ranges move to the end of u8Buffer first, the answer grows from its start
+ * without reaching them, see validate_FCRanges()
  *
- * @return u8BufferSize Response to master length
+ * @return 0, the answer is left in u8Buffer, or the exception of an on-read callback
  * @ingroup register
  */
-int8_t process_FC6(modbusHandler_t *modH)
+int16_t process_FCRanges(modbusHandler_t *modH )
 {
+    uint8_t u8table = (modH->u8Buffer[ RNG_TABLE ] == MB_FC_READ_INPUT_REGISTER) ? DB_INPUT_REGISTERS : DB_HOLDING_REGISTER;
+    uint8_t u8bytes = modH->u8Buffer[ RNG_BYTE_CNT ];
+    const uint8_t *u8rng = &modH->u8Buffer[ MAX_BUFFER - u8bytes ];
+    const uint8_t *u8end = &modH->u8Buffer[ MAX_BUFFER ];
+    uint16_t u16Add, u16Count;
+    uint8_t u8exception;
 
-    uint16_t u16add = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
-    uint8_t u8CopyBufferSize;
-    uint16_t u16val = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
+    memmove(&modH->u8Buffer[ MAX_BUFFER - u8bytes ], &modH->u8Buffer[ RNG_FIRST ], u8bytes);
+    modH->u16BufferSize = 3;
 
-    modH->u16regsHR[ u16add ] = u16val;
+    for (; u8rng < u8end; u8rng += MB_RANGE_SIZE)
+    {
+        u16Add = word( u8rng[ 0 ], u8rng[ 1 ] );
+        u16Count = word( u8rng[ 2 ], u8rng[ 3 ] );
 
-    // keep the same header
-    modH->u8BufferSize = RESPONSE_SIZE;
+#if ENABLE_MB_DIAG_REGS == 1
+        if (isDiagRange(u8table, u16Add, u16Count))
+        {
+            putDiagnostics(modH, &modH->u8Buffer[ modH->u16BufferSize ], u16Add, u16Count);
+            modH->u16BufferSize += u16Count * 2;
+            continue;
+        }
+#endif
+        u8exception = readSegment(modH, u8table, u16Add, u16Count);
+        if (u8exception != 0) return u8exception;
 
-    u8CopyBufferSize = modH->u8BufferSize + 2;
-    sendTxBuffer(modH);
+#if ENABLE_MB_RO_SNAPSHOT == 1
+        if (u8table == DB_INPUT_REGISTERS && modH->u16regsROBank[0] != NULL)
+        {
+            putSnapshot(modH, &modH->u8Buffer[ modH->u16BufferSize ], u16Add, u16Count);
+            modH->u16BufferSize += u16Count * 2;
+            continue;
+        }
+#endif
+        putTable(modH, u8table, u16Add, u16Count, &modH->u8Buffer[ modH->u16BufferSize ]);
+        modH->u16BufferSize += u16Count * 2;
+    }
 
-    return u8CopyBufferSize;
+    modH->u8Buffer[ 2 ] = (uint8_t)(modH->u16BufferSize - 3);
+    return 0;
 }
+#endif
+
+#if MB_SLAVE_DELTAS
 
 /**
  * @brief
- * This method processes function 15
- * This method writes a bit array assigned by the master
+ * Runs of the registers of a block changed after the generation u16Since,
+ * [offset hi][offset lo][registers][values], from the shadow copy. A single
+ * unchanged register between two changed ones joins the run, it costs less
+ * than the 3 bytes of a new run
  *
- * @return u8BufferSize Response to master length
- * @ingroup discrete
+ * @param u8dst where to put the runs, NULL only counts
+ * @return size of the runs in bytes
+ * @ingroup register
  */
-int8_t process_FC15( modbusHandler_t *modH )
+static uint16_t putDeltaRuns(const modbusDeltaBlock_t *xBlock, uint16_t u16Since, uint8_t *u8dst)
 {
-    uint8_t u8currentBit, u8frameByte, u8bitsno;
-    uint16_t u16currentRegister;
-    uint8_t u8CopyBufferSize;
-    uint16_t u16currentCoil, u16coil;
-    bool bTemp;
-
-    // get the first and last coil from the message
-    uint16_t u16StartCoil = word( modH->u8Buffer[ ADD_HI ], modH->u8Buffer[ ADD_LO ] );
-    uint16_t u16Coilno = word( modH->u8Buffer[ NB_HI ], modH->u8Buffer[ NB_LO ] );
+    uint16_t u16Size = 0;
+    uint16_t i = 0, u16End;
 
-
-    // read each coil from the register map and put its value inside the outcoming message
-    u8bitsno = 0;
-    u8frameByte = 7;
-    for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++)
+    while (i < xBlock->u16Count)
     {
+        if (!isNewerGen(xBlock->u16Stamp[ i ], u16Since))
+        {
+            i++;
+            continue;
+        }
 
-        u16coil = u16StartCoil + u16currentCoil;
-        u16currentRegister = (u16coil / 16);
-        u8currentBit = (uint8_t) (u16coil % 16);
-
-        bTemp = bitRead(
-        			modH->u8Buffer[ u8frameByte ],
-                    u8bitsno );
-
-        bitWrite(
-            modH->u16regsCoils[ u16currentRegister ],
-            u8currentBit,
-            bTemp );
-
-        u8bitsno ++;
+        u16End = i + 1;
+        while (u16End < xBlock->u16Count && u16End - i < 255)
+        {
+            if (isNewerGen(xBlock->u16Stamp[ u16End ], u16Since)) u16End++;
+            else if (u16End + 1 < xBlock->u16Count && u16End + 2 - i <= 255 &&
+                     isNewerGen(xBlock->u16Stamp[ u16End + 1 ], u16Since)) u16End += 2;
+            else break;
+        }
 
-        if (u8bitsno > 7)
+        if (u8dst != NULL)
         {
-            u8bitsno = 0;
-            u8frameByte++;
+            u8dst[ u16Size ] = highByte(i);
+            u8dst[ u16Size + 1 ] = lowByte(i);
+            u8dst[ u16Size + 2 ] = (uint8_t)(u16End - i);
+            putRegisters(&u8dst[ u16Size + 3 ], &xBlock->u16Shadow[ i ], u16End - i);
         }
+        u16Size += 3 + 2 * (u16End - i);
+        i = u16End;
     }
-
-    // send outcoming message
-    // it's just a copy of the incomping frame until 6th byte
-    modH->u8BufferSize         = 6;
-    u8CopyBufferSize = modH->u8BufferSize +2;
-    sendTxBuffer(modH);
-    return u8CopyBufferSize;
+    return u16Size;
 }
 
 /**
  * @brief
- * This method processes function 16
- * This method writes a word array assigned by the master
+ * This method processes MB_FC_READ_DELTA
+ * This method reads the block as FC3 or FC4 would, stamps the registers that
+ * changed since the previous read with a new generation, and answers the runs
+ * changed after the generation of the master if it is of the same epoch, not
+ * older than half the generations and the runs are shorter than the block.
+ * Otherwise the whole block is answered
  *
- * @return u8BufferSize Response to master length
+ * @return 0, the answer is left in u8Buffer, or the exception of an on-read callback
  * @ingroup register
  */
-int8_t process_FC16(modbusHandler_t *modH )
+int16_t process_FCDelta(modbusHandler_t *modH )
 {
-    uint16_t u16StartAdd = modH->u8Buffer[ ADD_HI ] << 8 | modH->u8Buffer[ ADD_LO ];
-    uint16_t u16regsno = modH->u8Buffer[ NB_HI ] << 8 | modH->u8Buffer[ NB_LO ];
-    uint8_t u8CopyBufferSize;
-    uint16_t i;
-    uint16_t temp;
-
-    // build header
-    modH->u8Buffer[ NB_HI ]   = 0;
-    modH->u8Buffer[ NB_LO ]   = (uint8_t) u16regsno; // answer is always 256 or less bytes
-    modH->u8BufferSize         = RESPONSE_SIZE;
+    modbusDeltaBlock_t *xBlock = findDelta(modH, modH->u8Buffer);
+    uint8_t *u8data = &modH->u8Buffer[ DLT_DATA ];
+    uint16_t u16Epoch = word( modH->u8Buffer[ DLT_GEN ], modH->u8Buffer[ DLT_GEN + 1 ] );
+    uint16_t u16Since = word( modH->u8Buffer[ DLT_GEN + 2 ], modH->u8Buffer[ DLT_GEN + 3 ] );
+    uint16_t u16Bytes = xBlock->u16Count * 2;
+    uint16_t u16Runs, u16Val;
+    bool xChanged = false;
+    uint8_t u8exception;
+
+    u8exception = readSegment(modH, xBlock->u8table, xBlock->u16Add, xBlock->u16Count);
+    if (u8exception != 0) return u8exception;
+
+#if ENABLE_MB_RO_SNAPSHOT == 1
+    if (xBlock->u8table == DB_INPUT_REGISTERS && modH->u16regsROBank[0] != NULL)
+        putSnapshot(modH, u8data, xBlock->u16Add, xBlock->u16Count);
+    else
+#endif
+    putTable(modH, xBlock->u8table, xBlock->u16Add, xBlock->u16Count, u8data);
 
-    // write registers
-    for (i = 0; i < u16regsno; i++)
+    for (uint16_t i = 0; i < xBlock->u16Count; i++)
     {
-        temp = word(
-        		modH->u8Buffer[ (BYTE_CNT + 1) + i * 2 ],
-				modH->u8Buffer[ (BYTE_CNT + 2) + i * 2 ]);
+        u16Val = word( u8data[ 2 * i ], u8data[ 2 * i + 1 ] );
+        if (u16Val == xBlock->u16Shadow[ i ]) continue;
 
-        modH->u16regsHR[ u16StartAdd + i ] = temp;
+        if (!xChanged)
+        {
+            xBlock->u16Gen++;
+            if (xBlock->u16Gen == 0) xBlock->u16Gen = 1; // 0 is the generation of a master without copy
+            xChanged = true;
+        }
+        xBlock->u16Shadow[ i ] = u16Val;
+        xBlock->u16Stamp[ i ] = xBlock->u16Gen;
     }
-    u8CopyBufferSize = modH->u8BufferSize +2;
-    sendTxBuffer(modH);
-
-    return u8CopyBufferSize;
-}
-
-
-
 
+    modH->u8Buffer[ DLT_MODE ] = MB_DELTA_FULL;
+    if (u16Since != 0 && u16Epoch == xBlock->u16Epoch && (int16_t)(xBlock->u16Gen - u16Since) >= 0)
+    {
+        u16Runs = putDeltaRuns(xBlock, u16Since, NULL);
+        if (u16Runs < u16Bytes)
+        {
+            putDeltaRuns(xBlock, u16Since, u8data);
+            modH->u8Buffer[ DLT_MODE ] = MB_DELTA_RUNS;
+            u16Bytes = u16Runs;
+        }
+    }
 
+    modH->u8Buffer[ DLT_ANS_GEN ] = highByte(xBlock->u16Epoch);
+    modH->u8Buffer[ DLT_ANS_GEN + 1 ] = lowByte(xBlock->u16Epoch);
+    modH->u8Buffer[ DLT_ANS_GEN + 2 ] = highByte(xBlock->u16Gen);
+    modH->u8Buffer[ DLT_ANS_GEN + 3 ] = lowByte(xBlock->u16Gen);
+    modH->u8Buffer[ DLT_BYTE_CNT ] = (uint8_t)u16Bytes;
+    modH->u16BufferSize = DLT_DATA + u16Bytes;
+    return 0;
+}
+#endif
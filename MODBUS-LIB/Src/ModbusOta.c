@@ -0,0 +1,351 @@
+/*
+ * ModbusOta.c
+ *
+ *  Firmware update over a Modbus slave, see ModbusOta.h
+ *
+ *  The slave task fills one chunk buffer while the update task erases and programs the
+ *  other one, so a flash write overlaps the reception of the next requests. Each chunk is
+ *  programmed at its place in the download slot as soon as it is full, the CRC-32 is taken
+ *  from the flash after programming and checks the written image as well as the transfer.
+ */
+
+#include "ModbusOta.h"
+
+#if ENABLE_MB_OTA == 1
+
+static void StartTaskModbusOta(void *argument);
+static void submitChunk(modbusOta_t *xOta);
+static bool programChunk(modbusOta_t *xOta, uint8_t u8Buf);
+static uint32_t updateCrc32(uint32_t u32Crc, const uint8_t *u8data, uint32_t u32Bytes);
+
+/* CRC-32 of IEEE 802.3, reflected, half a byte per step from a 16 entry table */
+static const uint32_t u32Crc32Table[16] = {
+	0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL, 0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+	0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL, 0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL
+};
+
+/**
+ * @brief
+ * Creates the update task and its queue and semaphore. The fields u32Slot, u32SlotSize,
+ * u16File, xOnDone and pvContext must be set, the slot is only erased by a transfer
+ *
+ * @ingroup setup
+ */
+void ModbusOtaInit(modbusOta_t *xOta)
+{
+	osThreadAttr_t xTaskAttr = { .name = "ModbusOta", .priority = (osPriority_t) MB_OTA_TASK_PRIO, .stack_size = MB_OTA_STACK };
+	osMessageQueueAttr_t xQueueAttr = { .name = "ModbusOtaQueue" };
+	osSemaphoreAttr_t xSphrAttr = { .name = "ModbusOtaSphr" };
+
+	if ((xOta->u32Slot % FLASH_PAGE_SIZE) != 0 || (xOta->u32SlotSize % FLASH_PAGE_SIZE) != 0 ||
+		(FLASH_PAGE_SIZE % MB_OTA_CHUNK) != 0)
+	{
+		while(1);// error the slot must be made of whole pages, and the pages of whole chunks
+	}
+
+	xOta->xState = MB_OTA_IDLE;
+	xOta->u32Received = 0;
+	xOta->u32Crc = 0;
+	xOta->u8Fill = MB_OTA_NONE;
+	xOta->u8Next = 0;
+	xOta->u16Fill = 0;
+
+#if ENABLE_MB_STATIC == 1
+	xTaskAttr.cb_mem = &xOta->xTaskCb;
+	xTaskAttr.cb_size = sizeof(xOta->xTaskCb);
+	xTaskAttr.stack_mem = xOta->xTaskStack;
+	xTaskAttr.stack_size = sizeof(xOta->xTaskStack);
+	xQueueAttr.cb_mem = &xOta->xFullCb;
+	xQueueAttr.cb_size = sizeof(xOta->xFullCb);
+	xQueueAttr.mq_mem = xOta->u8FullMem;
+	xQueueAttr.mq_size = sizeof(xOta->u8FullMem);
+	xSphrAttr.cb_mem = &xOta->xFreeCb;
+	xSphrAttr.cb_size = sizeof(xOta->xFreeCb);
+#endif
+
+	// both buffers and the commit can be queued at the same time
+	xOta->xFull = osMessageQueueNew(3, sizeof(uint8_t), &xQueueAttr);
+	xOta->xFree = osSemaphoreNew(2, 2, &xSphrAttr);
+	xOta->xTask = osThreadNew(StartTaskModbusOta, xOta, &xTaskAttr);
+	if (xOta->xFull == NULL || xOta->xFree == NULL || xOta->xTask == NULL)
+	{
+		while(1);// error creating the update task, check heap and stack size
+	}
+}
+
+/**
+ * @brief
+ * Stores u16Bytes of the image at u32Offset. The image is written in order: a write at
+ * offset 0 starts a new transfer, the bytes already received are skipped, so a request
+ * sent again after a lost answer is accepted. Called by the slave task
+ *
+ * @return 0, EXC_ADDR_RANGE for an offset out of order or out of the slot, EXC_BUSY
+ * when the update task does not free a buffer within MB_OTA_WAIT
+ * @ingroup setup
+ */
+uint8_t ModbusOtaWrite(modbusOta_t *xOta, uint32_t u32Offset, const uint8_t *u8data, uint16_t u16Bytes)
+{
+	uint16_t u16Skip, u16Copy;
+
+	if (xOta->xState == MB_OTA_VERIFYING) return EXC_BUSY;
+	if (u32Offset == 0 && xOta->xState != MB_OTA_RECEIVING)
+	{
+		ModbusOtaAbort(xOta);
+		xOta->xState = MB_OTA_RECEIVING;
+	}
+	if (xOta->xState != MB_OTA_RECEIVING) return EXC_EXECUTE;
+	if (u32Offset > xOta->u32Received || u32Offset + u16Bytes > xOta->u32SlotSize) return EXC_ADDR_RANGE;
+	if (u32Offset + u16Bytes <= xOta->u32Received) return 0;
+
+	for (u16Skip = xOta->u32Received - u32Offset; u16Skip < u16Bytes; u16Skip += u16Copy)
+	{
+		if (xOta->u8Fill == MB_OTA_NONE)
+		{
+			if (osSemaphoreAcquire(xOta->xFree, MB_OTA_WAIT) != osOK) return EXC_BUSY; // the received part is kept
+			xOta->u8Fill = xOta->u8Next;
+			xOta->u8Next ^= 1;
+			xOta->u16Fill = 0;
+			xOta->u32Addr[ xOta->u8Fill ] = xOta->u32Slot + xOta->u32Received;
+		}
+
+		u16Copy = MB_OTA_CHUNK - xOta->u16Fill;
+		if (u16Copy > u16Bytes - u16Skip) u16Copy = u16Bytes - u16Skip;
+		memcpy(&xOta->u8Chunk[ xOta->u8Fill ][ xOta->u16Fill ], &u8data[ u16Skip ], u16Copy);
+		xOta->u16Fill += u16Copy;
+		xOta->u32Received += u16Copy;
+
+		if (xOta->u16Fill == MB_OTA_CHUNK) submitChunk(xOta);
+	}
+	return 0;
+}
+
+/**
+ * @brief
+ * Ends a transfer of u32Size bytes: the last chunk is programmed and the CRC-32 of
+ * the slot compared with u32Crc by the update task, xState tells the result
+ *
+ * @return 0, EXC_EXECUTE when no transfer of u32Size bytes is in progress
+ * @ingroup setup
+ */
+uint8_t ModbusOtaCommit(modbusOta_t *xOta, uint32_t u32Size, uint32_t u32Crc)
+{
+	uint8_t u8Commit = MB_OTA_NONE;
+
+	if (xOta->xState != MB_OTA_RECEIVING || u32Size != xOta->u32Received) return EXC_EXECUTE;
+
+	if (xOta->u8Fill != MB_OTA_NONE && xOta->u16Fill > 0) submitChunk(xOta);
+	xOta->u32Expected = u32Crc;
+	xOta->xState = MB_OTA_VERIFYING;
+	osMessageQueuePut(xOta->xFull, &u8Commit, 0, 0);
+	return 0;
+}
+
+/**
+ * @brief
+ * Drops the transfer in progress, the chunks already queued are still programmed
+ *
+ * @ingroup setup
+ */
+void ModbusOtaAbort(modbusOta_t *xOta)
+{
+	if (xOta->xState == MB_OTA_VERIFYING) return; // the commit completes
+	xOta->xState = MB_OTA_IDLE;
+	xOta->u32Received = 0;
+	if (xOta->u8Fill != MB_OTA_NONE)
+	{
+		// the buffer being filled starts the next transfer
+		xOta->u16Fill = 0;
+		xOta->u32Addr[ xOta->u8Fill ] = xOta->u32Slot;
+	}
+}
+
+#if MB_SLAVE_FILES
+/**
+ * @brief
+ * mb_file_cb_t of the MB_OTA_FILE() entries: file xOta->u16File + n holds the bytes
+ * n * MB_FILE_RECORDS * 2 onwards of the image, two per record
+ *
+ * @ingroup setup
+ */
+uint8_t ModbusOtaFileWrite(const modbusFile_t *xFile, uint16_t u16Record, uint16_t u16Count, uint8_t *u8data)
+{
+	modbusOta_t *xOta = (modbusOta_t *) xFile->pvContext;
+	uint32_t u32Offset = ((uint32_t)(xFile->u16File - xOta->u16File) * MB_FILE_RECORDS + u16Record) * 2;
+
+	return ModbusOtaWrite(xOta, u32Offset, u8data, u16Count * 2);
+}
+#endif
+
+/**
+ * @brief
+ * On-write callback of the MB_OTA_WINDOW() segment, the request starts at the first
+ * register of the window with the offset, see ModbusOta.h
+ *
+ * @ingroup setup
+ */
+uint8_t ModbusOtaWindowWrite(const modbusSegment_t *xSeg, uint16_t u16Add, uint16_t u16Count)
+{
+	modbusOta_t *xOta = (modbusOta_t *) xSeg->pvContext;
+	const uint16_t *u16regs = xSeg->u16regs;
+	uint32_t u32Offset = ((uint32_t)u16regs[ 0 ] << 16) | u16regs[ 1 ];
+	uint8_t u8data[ 32 ]; // the registers are converted to bytes 16 at a time, on the stack of the slave task
+	uint8_t u8exception;
+	uint16_t i, j, u16Regs;
+
+	if (u16Add != xSeg->u16Start || u16Count < 2) return EXC_ADDR_RANGE;
+
+	if (u32Offset == MB_OTA_ABORT)
+	{
+		ModbusOtaAbort(xOta);
+		return 0;
+	}
+	if (u32Offset == MB_OTA_COMMIT)
+	{
+		if (u16Count < 6) return EXC_REGS_QUANT;
+		return ModbusOtaCommit(xOta, ((uint32_t)u16regs[ 2 ] << 16) | u16regs[ 3 ], ((uint32_t)u16regs[ 4 ] << 16) | u16regs[ 5 ]);
+	}
+
+	for (i = 2; i < u16Count; i += u16Regs)
+	{
+		u16Regs = (u16Count - i > 16) ? 16 : u16Count - i;
+		for (j = 0; j < u16Regs; j++)
+		{
+			u8data[ j * 2 ] = (uint8_t)(u16regs[ i + j ] >> 8);
+			u8data[ j * 2 + 1 ] = (uint8_t)u16regs[ i + j ];
+		}
+		u8exception = ModbusOtaWrite(xOta, u32Offset + (i - 2) * 2, u8data, u16Regs * 2);
+		if (u8exception != 0) return u8exception;
+	}
+	return 0;
+}
+
+/**
+ * @brief
+ * On-read callback of the MB_OTA_WINDOW() segment, loads the status of the transfer
+ * into the first MB_OTA_STATUS registers of the window
+ *
+ * @ingroup setup
+ */
+uint8_t ModbusOtaWindowRead(const modbusSegment_t *xSeg, uint16_t u16Add, uint16_t u16Count)
+{
+	modbusOta_t *xOta = (modbusOta_t *) xSeg->pvContext;
+	uint16_t u16Status[ MB_OTA_STATUS ];
+	uint32_t u32Crc = xOta->u32Crc;
+
+	(void)u16Add; // the whole status is loaded whatever part of the window is read
+	(void)u16Count;
+	u16Status[ 0 ] = (uint16_t)(xOta->u32Received >> 16);
+	u16Status[ 1 ] = (uint16_t)xOta->u32Received;
+	u16Status[ 2 ] = xOta->xState;
+	u16Status[ 3 ] = (uint16_t)(u32Crc >> 16);
+	u16Status[ 4 ] = (uint16_t)u32Crc;
+
+	for (uint16_t i = 0; i < MB_OTA_STATUS && i < xSeg->u16Length; i++)
+	{
+		xSeg->u16regs[ i ] = u16Status[ i ];
+	}
+	return 0;
+}
+
+/**
+ * @brief
+ * Hands the filled buffer to the update task
+ */
+static void submitChunk(modbusOta_t *xOta)
+{
+	xOta->u16Len[ xOta->u8Fill ] = xOta->u16Fill;
+	osMessageQueuePut(xOta->xFull, &xOta->u8Fill, 0, 0); // a queue entry per buffer, it never blocks
+	xOta->u8Fill = MB_OTA_NONE;
+}
+
+/**
+ * @brief
+ * Erases the page a buffer starts, when it is the first one of the page, and programs
+ * the buffer a double word at a time. The tail of the last chunk is padded with 0xFF
+ *
+ * @return false when the flash reports an error
+ */
+static bool programChunk(modbusOta_t *xOta, uint8_t u8Buf)
+{
+	uint32_t u32Addr = xOta->u32Addr[ u8Buf ];
+	uint16_t u16Len = xOta->u16Len[ u8Buf ];
+	uint32_t u32PageError;
+	FLASH_EraseInitTypeDef xErase;
+	uint64_t u64Word;
+	bool xOk = true;
+
+	memset(&xOta->u8Chunk[ u8Buf ][ u16Len ], 0xFF, ((u16Len + 7) & ~7U) - u16Len);
+
+	MB_OTA_FLASH_BEGIN();
+	if (((u32Addr - xOta->u32Slot) % FLASH_PAGE_SIZE) == 0)
+	{
+		xErase.TypeErase = FLASH_TYPEERASE_PAGES;
+		xErase.Page = (u32Addr - FLASH_BASE) / FLASH_PAGE_SIZE;
+		xErase.NbPages = 1;
+		xOk = HAL_FLASHEx_Erase(&xErase, &u32PageError) == HAL_OK;
+	}
+	for (uint16_t i = 0; xOk && i < u16Len; i += 8)
+	{
+		memcpy(&u64Word, &xOta->u8Chunk[ u8Buf ][ i ], 8);
+		xOk = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, u32Addr + i, u64Word) == HAL_OK;
+	}
+	MB_OTA_FLASH_END();
+
+	return xOk;
+}
+
+/**
+ * @brief
+ * Continues a reflected CRC-32, start with 0xFFFFFFFF and invert the result
+ */
+static uint32_t updateCrc32(uint32_t u32Crc, const uint8_t *u8data, uint32_t u32Bytes)
+{
+	for (uint32_t i = 0; i < u32Bytes; i++)
+	{
+		u32Crc ^= u8data[ i ];
+		u32Crc = (u32Crc >> 4) ^ u32Crc32Table[ u32Crc & 0x0F ];
+		u32Crc = (u32Crc >> 4) ^ u32Crc32Table[ u32Crc & 0x0F ];
+	}
+	return u32Crc;
+}
+
+/**
+ * @brief
+ * Update task: programs the queued buffers in order and checks the commit
+ */
+static void StartTaskModbusOta(void *argument)
+{
+	modbusOta_t *xOta = (modbusOta_t *) argument;
+	uint8_t u8Buf;
+
+	for(;;)
+	{
+		osMessageQueueGet(xOta->xFull, &u8Buf, NULL, osWaitForever);
+
+		if (u8Buf == MB_OTA_NONE)
+		{
+			// commit, every chunk of the image is programmed
+			xOta->xState = (!xOta->xFailed && xOta->u32Crc == xOta->u32Expected) ? MB_OTA_DONE : MB_OTA_ERROR;
+			if (xOta->xState == MB_OTA_DONE && xOta->xOnDone != NULL)
+			{
+				xOta->xOnDone(xOta);
+			}
+			continue;
+		}
+
+		if (xOta->u32Addr[ u8Buf ] == xOta->u32Slot)
+		{
+			// first chunk of a transfer
+			xOta->u32Crc = 0;
+			xOta->xFailed = false;
+		}
+		if (!programChunk(xOta, u8Buf))
+		{
+			xOta->xFailed = true;
+		}
+		xOta->u32Crc = ~updateCrc32(~xOta->u32Crc, (const uint8_t *)(uintptr_t) xOta->u32Addr[ u8Buf ], xOta->u16Len[ u8Buf ]);
+		osSemaphoreRelease(xOta->xFree);
+	}
+}
+
+#endif
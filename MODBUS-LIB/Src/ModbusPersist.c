@@ -0,0 +1,308 @@
+/*
+ * ModbusPersist.c
+ *
+ *  Flash journal of the writable tables of a slave, see ModbusPersist.h
+ *
+ *  The slave only marks the written registers in the dirty bitmaps. The journal task,
+ *  woken by the MB_DIRTY_ bits, lets a burst of writes settle for MB_PERSIST_DELAY, then
+ *  programs one double word per written register, which takes tens of microseconds each
+ *  instead of the erase and rewrite of a whole page. A page erase only happens with the
+ *  compaction of a full page, and moves the journal to the next page of the region.
+ */
+
+#include "ModbusPersist.h"
+
+#if ENABLE_MB_PERSIST == 1
+
+static void StartTaskModbusPersist(void *argument);
+static uint64_t makeRecord(uint8_t u8table, uint16_t u16Add, uint16_t u16Value);
+static bool readRecord(uint32_t u32Addr, uint8_t *u8table, uint16_t *u16Add, uint16_t *u16Value);
+static bool isErased(uint32_t u32Addr);
+static uint32_t pageAddr(modbusPersist_t *xPersist, uint8_t u8Page);
+static void replayPage(modbusPersist_t *xPersist);
+static bool compactJournal(modbusPersist_t *xPersist);
+static void journalTable(modbusPersist_t *xPersist, uint8_t u8table, const uint16_t *u16regs, uint16_t u16Size);
+
+/**
+ * @brief
+ * Restores the tables of the slave from the newest page of the journal, then creates the
+ * journal task and makes it the xWriteTask of the slave. Call it after ModbusInit() and
+ * before ModbusStart(), with u16regsHR, u16regsCoils and their dirty bitmaps set. A blank
+ * region keeps the initial tables and gets a snapshot of them
+ *
+ * @ingroup setup
+ */
+void ModbusPersistInit(modbusPersist_t *xPersist)
+{
+	modbusHandler_t *modH = xPersist->modH;
+	osThreadAttr_t xTaskAttr = { .name = "ModbusPersist", .priority = (osPriority_t) MB_PERSIST_TASK_PRIO, .stack_size = MB_PERSIST_STACK };
+	uint8_t u8table;
+	uint16_t u16Add, u16Value;
+	uint32_t u32Seq;
+	bool xFound = false;
+
+	if ((xPersist->u32Base % FLASH_PAGE_SIZE) != 0 || xPersist->u8Pages < 2)
+	{
+		while(1);// error the journal is made of whole pages, at least 2
+	}
+	if (modH->uModbusType != MB_SLAVE || modH->xWriteTask != NULL)
+	{
+		while(1);// error the journal task takes the xWriteTask notifications of a slave
+	}
+	if (modH->u16regHR_size > MB_PERSIST_REGS || modH->u16regCoils_size > MB_PERSIST_REGS ||
+		modH->u16regHR_size + modH->u16regCoils_size > MB_PERSIST_RECORDS / 2)
+	{
+		while(1);// error a table exceeds MB_PERSIST_REGS, or the snapshot fills more than half a page
+	}
+	if ((modH->u16regHR_size > 0 && (modH->u16regsHR == NULL || modH->u32DirtyHR == NULL)) ||
+		(modH->u16regCoils_size > 0 && (modH->u16regsCoils == NULL || modH->u32DirtyCoils == NULL)))
+	{
+		while(1);// error the journal keeps the flat tables, with their dirty bitmaps
+	}
+
+	// the newest page has the highest sequence number with a valid header
+	for (uint8_t i = 0; i < xPersist->u8Pages; i++)
+	{
+		if (!readRecord(pageAddr(xPersist, i), &u8table, &u16Add, &u16Value) || u8table != MB_PERSIST_HEADER) continue;
+
+		u32Seq = ((uint32_t)u16Add << 16) | u16Value;
+		if (!xFound || (int32_t)(u32Seq - xPersist->u32Seq) > 0)
+		{
+			xPersist->u32Seq = u32Seq;
+			xPersist->u8Page = i;
+			xFound = true;
+		}
+	}
+
+	xPersist->u32Records = 0;
+	xPersist->u32Compactions = 0;
+	if (xFound)
+	{
+		replayPage(xPersist);
+		xPersist->xFailed = false;
+	}
+	else
+	{
+		// blank region, the first snapshot goes to page 0
+		xPersist->u8Page = xPersist->u8Pages - 1;
+		xPersist->u32Seq = 0;
+		xPersist->xFailed = !compactJournal(xPersist);
+	}
+
+#if ENABLE_MB_STATIC == 1
+	xTaskAttr.cb_mem = &xPersist->xTaskCb;
+	xTaskAttr.cb_size = sizeof(xPersist->xTaskCb);
+	xTaskAttr.stack_mem = xPersist->xTaskStack;
+	xTaskAttr.stack_size = sizeof(xPersist->xTaskStack);
+#endif
+
+	xPersist->xTask = osThreadNew(StartTaskModbusPersist, xPersist, &xTaskAttr);
+	if (xPersist->xTask == NULL)
+	{
+		while(1);// error creating the journal task, check heap and stack size
+	}
+	modH->xWriteTask = (TaskHandle_t) xPersist->xTask;
+}
+
+/**
+ * @brief
+ * Record of a register: table, MB_PERSIST_MAGIC, address and value high byte first,
+ * then the CRC of these 6 bytes
+ */
+static uint64_t makeRecord(uint8_t u8table, uint16_t u16Add, uint16_t u16Value)
+{
+	uint8_t u8rec[ 8 ] = { u8table, MB_PERSIST_MAGIC, (uint8_t)(u16Add >> 8), (uint8_t)u16Add,
+			(uint8_t)(u16Value >> 8), (uint8_t)u16Value };
+	uint16_t u16crc = 0xFFFF;
+	uint64_t u64Rec;
+
+	for (uint8_t i = 0; i < 6; i++) u16crc = calcCRCByte(u16crc, u8rec[ i ]);
+	u8rec[ 6 ] = (uint8_t)(u16crc >> 8);
+	u8rec[ 7 ] = (uint8_t)u16crc;
+	memcpy(&u64Rec, u8rec, 8);
+	return u64Rec;
+}
+
+/**
+ * @brief
+ * Decodes the record programmed at u32Addr
+ *
+ * @return false for an erased record or a record torn by a reset during its programming
+ */
+static bool readRecord(uint32_t u32Addr, uint8_t *u8table, uint16_t *u16Add, uint16_t *u16Value)
+{
+	uint8_t u8rec[ 8 ];
+	uint16_t u16crc = 0xFFFF;
+
+	memcpy(u8rec, (const void *)(uintptr_t) u32Addr, 8);
+	for (uint8_t i = 0; i < 6; i++) u16crc = calcCRCByte(u16crc, u8rec[ i ]);
+	if (u8rec[ 1 ] != MB_PERSIST_MAGIC || u16crc != (((uint16_t)u8rec[ 6 ] << 8) | u8rec[ 7 ])) return false;
+
+	*u8table = u8rec[ 0 ];
+	*u16Add = ((uint16_t)u8rec[ 2 ] << 8) | u8rec[ 3 ];
+	*u16Value = ((uint16_t)u8rec[ 4 ] << 8) | u8rec[ 5 ];
+	return true;
+}
+
+/* true when the record at u32Addr was never programmed since the erase of its page */
+static bool isErased(uint32_t u32Addr)
+{
+	uint64_t u64Rec;
+
+	memcpy(&u64Rec, (const void *)(uintptr_t) u32Addr, 8);
+	return u64Rec == UINT64_MAX;
+}
+
+static uint32_t pageAddr(modbusPersist_t *xPersist, uint8_t u8Page)
+{
+	return xPersist->u32Base + (uint32_t)u8Page * FLASH_PAGE_SIZE;
+}
+
+/**
+ * @brief
+ * Writes the records of the active page to the tables in order, the snapshot first, and
+ * sets the append position after the last programmed record
+ */
+static void replayPage(modbusPersist_t *xPersist)
+{
+	modbusHandler_t *modH = xPersist->modH;
+	uint32_t u32Page = pageAddr(xPersist, xPersist->u8Page);
+	uint8_t u8table;
+	uint16_t u16Add, u16Value;
+	uint16_t i;
+
+	for (i = 1; i < MB_PERSIST_RECORDS && !isErased(u32Page + i * 8); i++)
+	{
+		if (!readRecord(u32Page + i * 8, &u8table, &u16Add, &u16Value)) continue;
+
+		if (u8table == DB_HOLDING_REGISTER && u16Add < modH->u16regHR_size)
+		{
+			modH->u16regsHR[ u16Add ] = u16Value;
+		}
+		else if (u8table == DB_COILS && u16Add < modH->u16regCoils_size)
+		{
+			modH->u16regsCoils[ u16Add ] = u16Value;
+		}
+	}
+	xPersist->u16Next = i;
+}
+
+/**
+ * @brief
+ * Erases the next page, writes a snapshot of both tables in it and then its header, so a
+ * reset during the compaction leaves the previous page the newest valid one. The journal
+ * moves to that page even on a failure, the next compaction then tries the following one
+ *
+ * @return false when the flash reports an error
+ */
+static bool compactJournal(modbusPersist_t *xPersist)
+{
+	modbusHandler_t *modH = xPersist->modH;
+	uint8_t u8Page = (xPersist->u8Page + 1) % xPersist->u8Pages;
+	uint32_t u32Page = pageAddr(xPersist, u8Page);
+	uint32_t u32Seq = xPersist->u32Seq + 1;
+	uint32_t u32PageError;
+	FLASH_EraseInitTypeDef xErase;
+	uint16_t u16Rec = 1;
+	bool xOk;
+
+	xErase.TypeErase = FLASH_TYPEERASE_PAGES;
+	xErase.Page = (u32Page - FLASH_BASE) / FLASH_PAGE_SIZE;
+	xErase.NbPages = 1;
+
+	MB_PERSIST_FLASH_BEGIN();
+	xOk = HAL_FLASHEx_Erase(&xErase, &u32PageError) == HAL_OK;
+	for (uint16_t i = 0; xOk && i < modH->u16regHR_size; i++, u16Rec++)
+	{
+		xOk = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, u32Page + u16Rec * 8,
+				makeRecord(DB_HOLDING_REGISTER, i, modH->u16regsHR[ i ])) == HAL_OK;
+	}
+	for (uint16_t i = 0; xOk && i < modH->u16regCoils_size; i++, u16Rec++)
+	{
+		xOk = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, u32Page + u16Rec * 8,
+				makeRecord(DB_COILS, i, modH->u16regsCoils[ i ])) == HAL_OK;
+	}
+	if (xOk)
+	{
+		xOk = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, u32Page,
+				makeRecord(MB_PERSIST_HEADER, (uint16_t)(u32Seq >> 16), (uint16_t)u32Seq)) == HAL_OK;
+	}
+	MB_PERSIST_FLASH_END();
+
+	xPersist->u8Page = u8Page;
+	xPersist->u32Seq = u32Seq;
+	xPersist->u16Next = u16Rec;
+	if (xOk) xPersist->u32Compactions++;
+	return xOk;
+}
+
+/**
+ * @brief
+ * Appends a record per register of the table written since the last batch. A batch
+ * that does not fit in the active page, or follows a flash error, is replaced by a
+ * compaction: the snapshot already holds its values
+ */
+static void journalTable(modbusPersist_t *xPersist, uint8_t u8table, const uint16_t *u16regs, uint16_t u16Size)
+{
+	uint16_t u16Words = MB_DIRTY_WORDS(u16Size);
+	uint32_t u32Page = pageAddr(xPersist, xPersist->u8Page);
+	uint32_t u32Bits;
+	uint16_t u16Count = 0;
+	uint16_t u16Add;
+	bool xOk = true;
+
+	if (u16Size == 0 || !ModbusTakeDirty(xPersist->modH, u8table, xPersist->u32Dirty, u16Words)) return;
+
+	for (uint16_t i = 0; i < u16Words; i++)
+	{
+		for (u32Bits = xPersist->u32Dirty[ i ]; u32Bits != 0; u32Bits &= u32Bits - 1) u16Count++;
+	}
+
+	if (xPersist->xFailed || xPersist->u16Next + u16Count > MB_PERSIST_RECORDS)
+	{
+		xPersist->xFailed = !compactJournal(xPersist);
+		return;
+	}
+
+	MB_PERSIST_FLASH_BEGIN();
+	for (uint16_t i = 0; xOk && i < u16Words; i++)
+	{
+		for (u32Bits = xPersist->u32Dirty[ i ]; xOk && u32Bits != 0; u32Bits &= u32Bits - 1)
+		{
+			u16Add = i * 32 + (31 - __CLZ(u32Bits & -u32Bits)); // lowest set bit
+			xOk = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, u32Page + xPersist->u16Next * 8,
+					makeRecord(u8table, u16Add, u16regs[ u16Add ])) == HAL_OK;
+			xPersist->u16Next++;
+			xPersist->u32Records++;
+		}
+	}
+	MB_PERSIST_FLASH_END();
+
+	if (!xOk)
+	{
+		xPersist->xFailed = !compactJournal(xPersist); // the rest of the batch is in the snapshot
+	}
+}
+
+/**
+ * @brief
+ * Journal task: each notification of the slave starts a batch once the writes settled
+ */
+static void StartTaskModbusPersist(void *argument)
+{
+	modbusPersist_t *xPersist = (modbusPersist_t *) argument;
+	modbusHandler_t *modH = xPersist->modH;
+	uint32_t u32Events;
+
+	for(;;)
+	{
+		xTaskNotifyWait(0, UINT32_MAX, &u32Events, portMAX_DELAY);
+		osDelay(MB_PERSIST_DELAY);
+		xTaskNotifyWait(0, UINT32_MAX, &u32Events, 0); // the writes of the delay are in the bitmaps already
+
+		journalTable(xPersist, DB_HOLDING_REGISTER, modH->u16regsHR, modH->u16regHR_size);
+		journalTable(xPersist, DB_COILS, modH->u16regsCoils, modH->u16regCoils_size);
+	}
+}
+
+#endif
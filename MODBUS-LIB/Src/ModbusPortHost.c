@@ -0,0 +1,288 @@
+/*
+ * ModbusPortHost.c
+ *
+ *  Fake UARTs and cycle counter of the host port, see ModbusPortHost.h
+ *
+ *  A frame sent is copied at once to the line of the peer, or kept for HostUartRead(). The line
+ *  task then takes each port every tick: it feeds the bytes on its line to the armed reception
+ *  one by one, as the RXNE interrupt would, and completes a frame sent as the TC interrupt does.
+ *  A whole frame arrives in one pass, the T35 timer of the library then ends it.
+ */
+
+#include "Modbus.h"
+
+#if MB_PORT_HOST == 1 && MB_PORT_POSIX != 1
+
+#include <string.h>
+#include <time.h>
+
+static void StartTaskModbusLine(void *argument);
+static uint16_t putLine(uint8_t *u8Ring, volatile uint32_t *u32Head, uint32_t u32Tail, const uint8_t *pData, uint16_t Size);
+static void feedPort(UART_HandleTypeDef *huart);
+
+static UART_HandleTypeDef *xHostPorts[MB_HOST_PORTS];
+static uint8_t u8HostPorts;
+static osThreadId_t xLineTask;
+
+uint32_t SystemCoreClock = 1000000000UL; // DWT counts nanoseconds
+CoreDebug_Type xHostCoreDebug;
+static DWT_Type xHostDwt;
+
+/**
+ * @brief
+ * Registers the port with the line task, which starts with the first port. The
+ * line of the port is emptied, Init only matters to the T35 of the library
+ *
+ * @return HAL_OK, HAL_ERROR without baud rate or with MB_HOST_PORTS ports already
+ * @ingroup port
+ */
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+	osThreadAttr_t xTaskAttr = { .name = "ModbusLine", .priority = (osPriority_t) MB_HOST_LINE_PRIO, .stack_size = MB_HOST_LINE_STACK };
+	uint8_t i;
+
+	if (huart->Init.BaudRate == 0) return HAL_ERROR;
+
+	for (i = 0; i < u8HostPorts && xHostPorts[i] != huart; i++);
+	if (i == u8HostPorts)
+	{
+		if (u8HostPorts == MB_HOST_PORTS) return HAL_ERROR;
+		xHostPorts[u8HostPorts++] = huart;
+	}
+
+	huart->Instance = huart;
+	huart->gState = HAL_UART_STATE_READY;
+	huart->RxState = HAL_UART_STATE_READY;
+	huart->ErrorCode = HAL_UART_ERROR_NONE;
+	huart->xTxDone = false;
+	huart->u32LineHead = huart->u32LineTail = 0;
+	huart->u32SentHead = huart->u32SentTail = 0;
+
+	if (xLineTask == NULL)
+	{
+		xLineTask = osThreadNew(StartTaskModbusLine, NULL, &xTaskAttr);
+		if (xLineTask == NULL) return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+
+/**
+ * @brief
+ * Takes the port off the line task
+ *
+ * @ingroup port
+ */
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart)
+{
+	taskENTER_CRITICAL();
+	for (uint8_t i = 0; i < u8HostPorts; i++)
+	{
+		if (xHostPorts[i] != huart) continue;
+		xHostPorts[i] = xHostPorts[--u8HostPorts];
+		break;
+	}
+	huart->gState = HAL_UART_STATE_RESET;
+	huart->RxState = HAL_UART_STATE_RESET;
+	taskEXIT_CRITICAL();
+	return HAL_OK;
+}
+
+/**
+ * @brief
+ * Arms the reception of Size bytes, the line task calls HAL_UART_RxCpltCallback() once they are in pData
+ *
+ * @ingroup port
+ */
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if (huart->RxState != HAL_UART_STATE_READY) return HAL_BUSY;
+	if (pData == NULL || Size == 0) return HAL_ERROR;
+
+	huart->pRxBuffPtr = pData;
+	huart->RxXferSize = Size;
+	huart->RxXferCount = Size;
+	huart->RxState = HAL_UART_STATE_BUSY_RX;
+	return HAL_OK;
+}
+
+/**
+ * @brief
+ * Puts a frame on the line of the peer, or keeps it for HostUartRead(). The line task calls
+ * HAL_UART_TxCpltCallback() at its next pass, the bytes a full line refuses are lost as on a
+ * noisy bus
+ *
+ * @ingroup port
+ */
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+	UART_HandleTypeDef *pxPeer = huart->pxPeer;
+
+	if (huart->gState != HAL_UART_STATE_READY) return HAL_BUSY;
+	if (pData == NULL || Size == 0) return HAL_ERROR;
+
+	taskENTER_CRITICAL();
+	huart->gState = HAL_UART_STATE_BUSY_TX;
+	if (pxPeer != NULL) putLine(pxPeer->u8Line, &pxPeer->u32LineHead, pxPeer->u32LineTail, pData, Size);
+	else putLine(huart->u8Sent, &huart->u32SentHead, huart->u32SentTail, pData, Size);
+	huart->xTxDone = true;
+	taskEXIT_CRITICAL();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart)
+{
+	taskENTER_CRITICAL();
+	huart->xTxDone = false;
+	huart->gState = HAL_UART_STATE_READY;
+	taskEXIT_CRITICAL();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart)
+{
+	taskENTER_CRITICAL();
+	huart->RxXferCount = 0;
+	huart->RxState = HAL_UART_STATE_READY;
+	taskEXIT_CRITICAL();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart)
+{
+	HAL_UART_AbortTransmit(huart);
+	return HAL_UART_AbortReceive(huart);
+}
+
+HAL_UART_StateTypeDef HAL_UART_GetState(UART_HandleTypeDef *huart)
+{
+	return huart->gState | huart->RxState;
+}
+
+/**
+ * @brief
+ * Puts the bytes of a device on the line of the port, they are received at the next pass of the line task
+ *
+ * @return bytes taken, fewer than Size when the line is full
+ * @ingroup port
+ */
+uint16_t HostUartWrite(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+	uint16_t u16Len;
+
+	taskENTER_CRITICAL();
+	u16Len = putLine(huart->u8Line, &huart->u32LineHead, huart->u32LineTail, pData, Size);
+	taskEXIT_CRITICAL();
+	return u16Len;
+}
+
+/**
+ * @brief
+ * Takes the bytes sent by a port without peer, oldest first
+ *
+ * @return bytes copied to pData
+ * @ingroup port
+ */
+uint16_t HostUartRead(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	uint16_t u16Len = 0;
+
+	taskENTER_CRITICAL();
+	while (u16Len < Size && huart->u32SentTail != huart->u32SentHead)
+	{
+		pData[ u16Len++ ] = huart->u8Sent[ huart->u32SentTail & (MB_HOST_LINE - 1) ];
+		huart->u32SentTail++;
+	}
+	taskEXIT_CRITICAL();
+	return u16Len;
+}
+
+/**
+ * @brief
+ * Cycle counter of the host: CYCCNT is brought to the nanoseconds of CLOCK_MONOTONIC, it wraps
+ * every 4.3 s as the counter of a 1 GHz core would
+ *
+ * @ingroup port
+ */
+DWT_Type *hostDwt(void)
+{
+	struct timespec xNow;
+
+	clock_gettime(CLOCK_MONOTONIC, &xNow);
+	xHostDwt.CYCCNT = (uint32_t)((uint64_t)xNow.tv_sec * 1000000000ULL + (uint64_t)xNow.tv_nsec);
+	return &xHostDwt;
+}
+
+/**
+ * @brief
+ * Line task: one pass over the ports every tick, the part of the UART interrupts
+ *
+ * @ingroup port
+ */
+static void StartTaskModbusLine(void *argument)
+{
+	(void)argument;
+
+	for(;;)
+	{
+		for (uint8_t i = 0; i < u8HostPorts; i++)
+		{
+			UART_HandleTypeDef *huart = xHostPorts[i];
+
+			feedPort(huart);
+			if (huart->xTxDone)
+			{
+				huart->xTxDone = false;
+				huart->gState = HAL_UART_STATE_READY;
+				HAL_UART_TxCpltCallback(huart);
+			}
+		}
+		vTaskDelay(1);
+	}
+}
+
+/* copies what the ring has room for, the writer owns the head */
+static uint16_t putLine(uint8_t *u8Ring, volatile uint32_t *u32Head, uint32_t u32Tail, const uint8_t *pData, uint16_t Size)
+{
+	uint16_t u16Len = 0;
+
+	while (u16Len < Size && *u32Head - u32Tail < MB_HOST_LINE)
+	{
+		u8Ring[ *u32Head & (MB_HOST_LINE - 1) ] = pData[ u16Len++ ];
+		(*u32Head)++;
+	}
+	return u16Len;
+}
+
+/**
+ * @brief
+ * Hands the bytes on the line of a port to the armed reception one by one. The callback
+ * of the library arms the next one, a byte arriving while none is armed is an overrun
+ *
+ * @ingroup port
+ */
+static void feedPort(UART_HandleTypeDef *huart)
+{
+	while (huart->u32LineTail != huart->u32LineHead)
+	{
+		uint8_t u8Rx = huart->u8Line[ huart->u32LineTail & (MB_HOST_LINE - 1) ];
+
+		huart->u32LineTail++;
+		if (huart->RxState != HAL_UART_STATE_BUSY_RX)
+		{
+			huart->ErrorCode |= HAL_UART_ERROR_ORE;
+#if ENABLE_MB_ERR_STATS == 1
+			HAL_UART_ErrorCallback(huart);
+#endif
+			huart->ErrorCode = HAL_UART_ERROR_NONE;
+			continue;
+		}
+		*huart->pRxBuffPtr++ = u8Rx;
+		if (--huart->RxXferCount == 0)
+		{
+			huart->RxState = HAL_UART_STATE_READY;
+			HAL_UART_RxCpltCallback(huart);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,902 @@
+/*
+ * ModbusPortPosix.c
+ *
+ *  Serial ports of the Linux port, see ModbusPortPosix.h
+ *
+ *  Each event loop task owns an epoll instance with the ttys of its ports. Every tick it takes
+ *  the ready ones, feeds the received bytes to the armed reception of each port one by one,
+ *  as the RXNE interrupt would, and moves the rest of a frame to the kernel as its queue frees.
+ *  A frame queued whole keeps EPOLLOUT until TIOCOUTQ reports the queue of the tty empty, this
+ *  is the TC interrupt that releases the line. The engine above is the one of the target.
+ *
+ *  The sockets of the netconns have an epoll instance of their own, in the one of loop 0: the
+ *  loop takes their events in the same pass and calls the callback of each netconn, as the
+ *  tcpip thread of lwIP does. The sockets are edge-triggered, the library reads a netconn until
+ *  ERR_WOULDBLOCK once woken.
+ */
+
+#define _GNU_SOURCE // accept4()
+#include "Modbus.h"
+
+#if MB_PORT_POSIX == 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#if ENABLE_TCP == 1 || ENABLE_UDP == 1
+#include <string.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+static void StartTaskModbusLoop(void *argument);
+static bool startLoop(uint8_t u8Loop);
+static speed_t getSpeed(uint32_t u32Baud);
+static void setEvents(UART_HandleTypeDef *huart, uint32_t u32Events);
+static void readPort(UART_HandleTypeDef *huart);
+static void writePort(UART_HandleTypeDef *huart);
+static void drainPort(UART_HandleTypeDef *huart);
+#if ENABLE_TCP == 1 || ENABLE_UDP == 1
+static bool startNet(void);
+static void serveNet(void);
+static bool watchSocket(struct netconn *conn);
+static err_t getSocketError(int iErrno);
+static bool waitSocket(struct netconn *conn, short sEvents, TickType_t xTimeout);
+static struct sockaddr_in getSockAddr(const ip_addr_t *addr, u16_t port);
+static err_t sendDatagram(struct netconn *conn, struct netbuf *buf, const struct sockaddr_in *xTo);
+static struct pbuf *allocPbuf(u16_t len);
+#endif
+
+static int iLoopEpoll[MB_POSIX_LOOPS];
+static osThreadId_t xLoopTask[MB_POSIX_LOOPS];
+#if ENABLE_TCP == 1 || ENABLE_UDP == 1
+static int iNetEpoll = -1;
+
+const ip_addr_t ip_addr_any = { 0 };
+#endif
+
+/**
+ * @brief
+ * Opens the tty of the port on its first call and applies Init to it, raw 8N1 style
+ * framing with the data bits left by the parity bit, as the word length of the HAL
+ * counts it. With xRs485 the kernel raises RTS while it sends. The port then joins
+ * the epoll instance of its loop, which starts with its first port
+ *
+ * @return HAL_OK, HAL_ERROR if the device, the baud rate or the loop is refused
+ * @ingroup port
+ */
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+	struct termios xTio;
+	speed_t xSpeed = getSpeed(huart->Init.BaudRate);
+	uint32_t u32Bits = (huart->Init.WordLength == UART_WORDLENGTH_9B) ? 9 : (huart->Init.WordLength == UART_WORDLENGTH_7B) ? 7 : 8;
+
+	if (huart->pcDevice == NULL || huart->u8Loop >= MB_POSIX_LOOPS || xSpeed == B0) return HAL_ERROR;
+	if (huart->Init.Parity != UART_PARITY_NONE) u32Bits--;
+	if (u32Bits < 7) return HAL_ERROR;
+
+	if (huart->Instance != huart)
+	{
+		huart->Instance = huart;
+		huart->iFd = -1;
+	}
+	if (huart->iFd < 0)
+	{
+		huart->iFd = open(huart->pcDevice, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+		if (huart->iFd < 0) return HAL_ERROR;
+	}
+
+	if (tcgetattr(huart->iFd, &xTio) != 0) return HAL_ERROR;
+	cfmakeraw(&xTio);
+	cfsetispeed(&xTio, xSpeed);
+	cfsetospeed(&xTio, xSpeed);
+	xTio.c_cflag &= ~(CSIZE | CSTOPB | PARENB | PARODD | CRTSCTS);
+	xTio.c_cflag |= CLOCAL | CREAD | ((u32Bits == 7) ? CS7 : CS8);
+	if (huart->Init.StopBits == UART_STOPBITS_2) xTio.c_cflag |= CSTOPB;
+	if (huart->Init.Parity != UART_PARITY_NONE)
+	{
+		xTio.c_cflag |= PARENB;
+		if (huart->Init.Parity == UART_PARITY_ODD) xTio.c_cflag |= PARODD;
+		xTio.c_iflag |= INPCK; // a byte with a parity error reads as 0, the CRC drops the frame
+	}
+	xTio.c_cc[VMIN] = 0;
+	xTio.c_cc[VTIME] = 0;
+	if (tcsetattr(huart->iFd, TCSANOW, &xTio) != 0) return HAL_ERROR;
+
+	if (huart->xRs485)
+	{
+		struct serial_rs485 xRs485 = { .flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND };
+		if (ioctl(huart->iFd, TIOCSRS485, &xRs485) != 0) return HAL_ERROR;
+	}
+	tcflush(huart->iFd, TCIOFLUSH);
+
+	huart->gState = HAL_UART_STATE_READY;
+	huart->RxState = HAL_UART_STATE_READY;
+	huart->ErrorCode = HAL_UART_ERROR_NONE;
+	huart->TxXferCount = 0;
+	huart->xTxDrain = false;
+
+	if (!startLoop(huart->u8Loop)) return HAL_ERROR;
+	struct epoll_event xEvent = { .events = EPOLLIN, .data.ptr = huart };
+	if (epoll_ctl(iLoopEpoll[huart->u8Loop], EPOLL_CTL_ADD, huart->iFd, &xEvent) != 0 && errno != EEXIST) return HAL_ERROR;
+	setEvents(huart, EPOLLIN); // a new Init ends the frame being sent
+
+	return HAL_OK;
+}
+
+/**
+ * @brief
+ * Removes the port from its loop and closes its tty
+ *
+ * @ingroup port
+ */
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart)
+{
+	if (huart->Instance != huart || huart->iFd < 0) return HAL_ERROR;
+
+	HAL_UART_Abort(huart);
+	epoll_ctl(iLoopEpoll[huart->u8Loop], EPOLL_CTL_DEL, huart->iFd, NULL);
+	close(huart->iFd);
+	huart->iFd = -1;
+	huart->gState = HAL_UART_STATE_RESET;
+	huart->RxState = HAL_UART_STATE_RESET;
+	return HAL_OK;
+}
+
+/**
+ * @brief
+ * Arms the reception of Size bytes, the loop calls HAL_UART_RxCpltCallback() once they are in pData
+ *
+ * @ingroup port
+ */
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if (huart->RxState != HAL_UART_STATE_READY) return HAL_BUSY;
+	if (pData == NULL || Size == 0) return HAL_ERROR;
+
+	huart->pRxBuffPtr = pData;
+	huart->RxXferSize = Size;
+	huart->RxXferCount = Size;
+	huart->RxState = HAL_UART_STATE_BUSY_RX;
+	return HAL_OK;
+}
+
+/**
+ * @brief
+ * Queues a frame in the tty, the loop writes what the kernel did not take and calls
+ * HAL_UART_TxCpltCallback() once the last byte left. pData must stay valid until then
+ *
+ * @ingroup port
+ */
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+	if (huart->gState != HAL_UART_STATE_READY) return HAL_BUSY;
+	if (pData == NULL || Size == 0) return HAL_ERROR;
+
+	taskENTER_CRITICAL();
+	huart->gState = HAL_UART_STATE_BUSY_TX;
+	huart->pTxBuffPtr = pData;
+	huart->TxXferCount = Size;
+	huart->xTxDrain = false;
+	writePort(huart);
+	taskEXIT_CRITICAL();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart)
+{
+	taskENTER_CRITICAL();
+	huart->TxXferCount = 0;
+	huart->xTxDrain = false;
+	tcflush(huart->iFd, TCOFLUSH);
+	setEvents(huart, EPOLLIN);
+	huart->gState = HAL_UART_STATE_READY;
+	taskEXIT_CRITICAL();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart)
+{
+	taskENTER_CRITICAL();
+	huart->RxXferCount = 0;
+	huart->RxState = HAL_UART_STATE_READY;
+	tcflush(huart->iFd, TCIFLUSH);
+	taskEXIT_CRITICAL();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart)
+{
+	HAL_UART_AbortTransmit(huart);
+	return HAL_UART_AbortReceive(huart);
+}
+
+HAL_UART_StateTypeDef HAL_UART_GetState(UART_HandleTypeDef *huart)
+{
+	return huart->gState | huart->RxState;
+}
+
+/**
+ * @brief
+ * Creates the epoll instance and the task of a loop, once
+ *
+ * @return false if the system refused one of them
+ * @ingroup port
+ */
+static bool startLoop(uint8_t u8Loop)
+{
+	osThreadAttr_t xTaskAttr = { .name = "ModbusLoop", .priority = (osPriority_t) MB_POSIX_LOOP_PRIO, .stack_size = MB_POSIX_LOOP_STACK };
+
+	if (xLoopTask[u8Loop] != NULL) return true;
+
+	iLoopEpoll[u8Loop] = epoll_create1(EPOLL_CLOEXEC);
+	if (iLoopEpoll[u8Loop] < 0) return false;
+	xLoopTask[u8Loop] = osThreadNew(StartTaskModbusLoop, (void *)(intptr_t)u8Loop, &xTaskAttr);
+	return xLoopTask[u8Loop] != NULL;
+}
+
+/**
+ * @brief
+ * Event loop task: one pass over the ready ports every tick. The pass never blocks in
+ * epoll_wait(), the POSIX port of FreeRTOS would run no other task meanwhile
+ *
+ * @ingroup port
+ */
+static void StartTaskModbusLoop(void *argument)
+{
+	int iEpoll = iLoopEpoll[(intptr_t)argument];
+	struct epoll_event xEvents[MB_POSIX_EVENTS];
+
+	for(;;)
+	{
+		int iReady = epoll_wait(iEpoll, xEvents, MB_POSIX_EVENTS, 0);
+
+		for (int i = 0; i < iReady; i++)
+		{
+			UART_HandleTypeDef *huart = (UART_HandleTypeDef *) xEvents[i].data.ptr;
+
+#if ENABLE_TCP == 1 || ENABLE_UDP == 1
+			if (huart == NULL)
+			{
+				serveNet(); // the epoll instance of the sockets
+				continue;
+			}
+#endif
+			if (xEvents[i].events & EPOLLIN) readPort(huart);
+			if (xEvents[i].events & EPOLLOUT) drainPort(huart);
+		}
+		vTaskDelay(1);
+	}
+}
+
+/* the frame continues while the kernel takes bytes, EPOLLOUT tells when it has room again */
+static void writePort(UART_HandleTypeDef *huart)
+{
+	while (huart->TxXferCount > 0)
+	{
+		ssize_t iSent = write(huart->iFd, huart->pTxBuffPtr, huart->TxXferCount);
+
+		if (iSent < 0 && errno == EINTR) continue;
+		if (iSent < 0 && errno != EAGAIN)
+		{
+			huart->TxXferCount = 0; // the tty is gone, the frame is lost as on a cut line
+			break;
+		}
+		if (iSent <= 0) break;
+		huart->pTxBuffPtr += iSent;
+		huart->TxXferCount -= (uint16_t)iSent;
+	}
+	if (huart->TxXferCount == 0) huart->xTxDrain = true;
+	setEvents(huart, EPOLLIN | EPOLLOUT);
+}
+
+/**
+ * @brief
+ * EPOLLOUT of a port sending a frame: writes the rest of it, then waits for the empty
+ * output queue and completes the transmission as the TC interrupt does
+ *
+ * @ingroup port
+ */
+static void drainPort(UART_HandleTypeDef *huart)
+{
+	int iQueued = 0;
+	bool xDone = false;
+
+	taskENTER_CRITICAL();
+	if (huart->gState == HAL_UART_STATE_BUSY_TX)
+	{
+		if (!huart->xTxDrain) writePort(huart);
+		if (huart->xTxDrain && (ioctl(huart->iFd, TIOCOUTQ, &iQueued) != 0 || iQueued == 0))
+		{
+			huart->xTxDrain = false;
+			huart->gState = HAL_UART_STATE_READY;
+			setEvents(huart, EPOLLIN);
+			xDone = true;
+		}
+	}
+	else
+	{
+		setEvents(huart, EPOLLIN);
+	}
+	taskEXIT_CRITICAL();
+
+	if (xDone) HAL_UART_TxCpltCallback(huart);
+}
+
+/**
+ * @brief
+ * EPOLLIN of a port: hands the received bytes to the armed reception one by one. The
+ * callback of the library arms the next one, a byte arriving while none is armed is
+ * an overrun
+ *
+ * @ingroup port
+ */
+static void readPort(UART_HandleTypeDef *huart)
+{
+	uint8_t u8Rx[64];
+	ssize_t iLen;
+
+	while ((iLen = read(huart->iFd, u8Rx, sizeof(u8Rx))) > 0)
+	{
+		for (ssize_t i = 0; i < iLen; i++)
+		{
+			if (huart->RxState != HAL_UART_STATE_BUSY_RX)
+			{
+				huart->ErrorCode |= HAL_UART_ERROR_ORE;
+#if ENABLE_MB_ERR_STATS == 1
+				HAL_UART_ErrorCallback(huart);
+#endif
+				huart->ErrorCode = HAL_UART_ERROR_NONE;
+				continue;
+			}
+			*huart->pRxBuffPtr++ = u8Rx[ i ];
+			if (--huart->RxXferCount == 0)
+			{
+				huart->RxState = HAL_UART_STATE_READY;
+				HAL_UART_RxCpltCallback(huart);
+			}
+		}
+	}
+}
+
+static void setEvents(UART_HandleTypeDef *huart, uint32_t u32Events)
+{
+	struct epoll_event xEvent = { .events = u32Events, .data.ptr = huart };
+	epoll_ctl(iLoopEpoll[huart->u8Loop], EPOLL_CTL_MOD, huart->iFd, &xEvent);
+}
+
+/* the speeds of termios, B0 for a baud rate it does not have */
+static speed_t getSpeed(uint32_t u32Baud)
+{
+	switch (u32Baud)
+	{
+	case 1200:   return B1200;
+	case 2400:   return B2400;
+	case 4800:   return B4800;
+	case 9600:   return B9600;
+	case 19200:  return B19200;
+	case 38400:  return B38400;
+	case 57600:  return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	case 921600: return B921600;
+	case 1000000: return B1000000;
+	case 2000000: return B2000000;
+	default:     return B0;
+	}
+}
+
+#if ENABLE_TCP == 1 || ENABLE_UDP == 1
+/**
+ * @brief
+ * Creates the epoll instance of the sockets in the one of loop 0, once
+ *
+ * @return false if the system refused it
+ * @ingroup port
+ */
+static bool startNet(void)
+{
+	struct epoll_event xEvent = { .events = EPOLLIN, .data.ptr = NULL };
+
+	if (iNetEpoll >= 0) return true;
+	if (!startLoop(0)) return false;
+
+	iNetEpoll = epoll_create1(EPOLL_CLOEXEC);
+	if (iNetEpoll < 0) return false;
+	if (epoll_ctl(iLoopEpoll[0], EPOLL_CTL_ADD, iNetEpoll, &xEvent) != 0)
+	{
+		close(iNetEpoll);
+		iNetEpoll = -1;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief
+ * Pass of loop 0 over the ready sockets: new data, a new client, a close or an error
+ * are all NETCONN_EVT_RCVPLUS for the callback, as in lwIP
+ *
+ * @ingroup port
+ */
+static void serveNet(void)
+{
+	struct epoll_event xEvents[MB_POSIX_EVENTS];
+	int iReady = epoll_wait(iNetEpoll, xEvents, MB_POSIX_EVENTS, 0);
+
+	for (int i = 0; i < iReady; i++)
+	{
+		struct netconn *conn = (struct netconn *) xEvents[i].data.ptr;
+
+		if (conn->callback != NULL) conn->callback(conn, NETCONN_EVT_RCVPLUS, 0);
+	}
+}
+
+/* the socket joins the epoll instance of loop 0 once it can receive */
+static bool watchSocket(struct netconn *conn)
+{
+	struct epoll_event xEvent = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+
+	return epoll_ctl(iNetEpoll, EPOLL_CTL_ADD, conn->iFd, &xEvent) == 0 || errno == EEXIST;
+}
+
+/* the lwIP error of an errno */
+static err_t getSocketError(int iErrno)
+{
+	switch (iErrno)
+	{
+	case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+	case EWOULDBLOCK:
+#endif
+	case EINPROGRESS:  return ERR_WOULDBLOCK;
+	case ENOMEM:
+	case ENOBUFS:      return ERR_MEM;
+	case EADDRINUSE:   return ERR_USE;
+	case ETIMEDOUT:    return ERR_TIMEOUT;
+	case ECONNRESET:
+	case EPIPE:        return ERR_RST;
+	case EINVAL:
+	case EBADF:        return ERR_ARG;
+	default:           return ERR_CONN;
+	}
+}
+
+/**
+ * @brief
+ * Waits for an event of the socket a tick at a time, the other tasks run meanwhile
+ *
+ * @return false after xTimeout ticks without the event
+ * @ingroup port
+ */
+static bool waitSocket(struct netconn *conn, short sEvents, TickType_t xTimeout)
+{
+	struct pollfd xPoll = { .fd = conn->iFd, .events = sEvents };
+	TickType_t xStart = xTaskGetTickCount();
+
+	while (poll(&xPoll, 1, 0) == 0 || (xPoll.revents == 0))
+	{
+		if (xTaskGetTickCount() - xStart >= xTimeout) return false;
+		vTaskDelay(1);
+	}
+	return true;
+}
+
+static struct sockaddr_in getSockAddr(const ip_addr_t *addr, u16_t port)
+{
+	struct sockaddr_in xAddr = { .sin_family = AF_INET, .sin_port = htons(port) };
+
+	xAddr.sin_addr.s_addr = (addr != NULL) ? addr->addr : htonl(INADDR_ANY);
+	return xAddr;
+}
+
+/**
+ * @brief
+ * Opens a non-blocking socket of the kernel. A UDP socket is watched at once, a
+ * TCP one once it listens or is connected
+ *
+ * @return the netconn, NULL if the system refused the socket
+ * @ingroup port
+ */
+struct netconn *netconn_new_with_callback(enum netconn_type t, netconn_callback callback)
+{
+	struct netconn *conn;
+
+	if (!startNet()) return NULL;
+
+	conn = pvPortMalloc(sizeof(struct netconn));
+	if (conn == NULL) return NULL;
+	conn->type = t;
+	conn->callback = callback;
+	conn->xNonBlocking = false;
+	conn->iFd = socket(AF_INET, ((t == NETCONN_UDP) ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn->iFd < 0 || (t == NETCONN_UDP && !watchSocket(conn)))
+	{
+		if (conn->iFd >= 0) close(conn->iFd);
+		vPortFree(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+/**
+ * @brief
+ * Closes the socket and frees the netconn
+ *
+ * @ingroup port
+ */
+err_t netconn_delete(struct netconn *conn)
+{
+	if (conn == NULL) return ERR_OK;
+
+	epoll_ctl(iNetEpoll, EPOLL_CTL_DEL, conn->iFd, NULL);
+	close(conn->iFd);
+	vPortFree(conn);
+	return ERR_OK;
+}
+
+/**
+ * @brief
+ * Binds the socket to addr:port, reusing the address so a restarted gateway gets its port back at once
+ *
+ * @ingroup port
+ */
+err_t netconn_bind(struct netconn *conn, const ip_addr_t *addr, u16_t port)
+{
+	struct sockaddr_in xAddr = getSockAddr(addr, port);
+	int iOn = 1;
+
+	setsockopt(conn->iFd, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+	if (bind(conn->iFd, (struct sockaddr *)&xAddr, sizeof(xAddr)) != 0) return getSocketError(errno);
+	return ERR_OK;
+}
+
+/**
+ * @brief
+ * Connects a TCP socket to addr:port, waiting up to MB_POSIX_NET_TIMEOUT ticks for the
+ * server. A UDP socket only records the address, as in lwIP
+ *
+ * @ingroup port
+ */
+err_t netconn_connect(struct netconn *conn, const ip_addr_t *addr, u16_t port)
+{
+	struct sockaddr_in xAddr = getSockAddr(addr, port);
+	int iErr = 0, iOn = 1;
+	socklen_t xLen = sizeof(iErr);
+
+	if (connect(conn->iFd, (struct sockaddr *)&xAddr, sizeof(xAddr)) != 0)
+	{
+		if (errno != EINPROGRESS) return getSocketError(errno);
+		if (!waitSocket(conn, POLLOUT, MB_POSIX_NET_TIMEOUT)) return ERR_TIMEOUT;
+		if (getsockopt(conn->iFd, SOL_SOCKET, SO_ERROR, &iErr, &xLen) != 0 || iErr != 0) return getSocketError(iErr);
+	}
+	if (conn->type == NETCONN_TCP)
+	{
+		setsockopt(conn->iFd, IPPROTO_TCP, TCP_NODELAY, &iOn, sizeof(iOn)); // the library groups its writes itself
+		if (!watchSocket(conn)) return ERR_MEM;
+	}
+	return ERR_OK;
+}
+
+err_t netconn_listen(struct netconn *conn)
+{
+	if (listen(conn->iFd, SOMAXCONN) != 0) return getSocketError(errno);
+	return watchSocket(conn) ? ERR_OK : ERR_MEM;
+}
+
+/**
+ * @brief
+ * Takes a client of a listening netconn, the new netconn gets the callback of the
+ * listening one. A non-blocking netconn returns ERR_WOULDBLOCK without client
+ *
+ * @ingroup port
+ */
+err_t netconn_accept(struct netconn *conn, struct netconn **new_conn)
+{
+	struct netconn *xNew;
+	int iFd, iOn = 1;
+
+	*new_conn = NULL;
+	while ((iFd = accept4(conn->iFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+	{
+		if (errno == EINTR) continue;
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || conn->xNonBlocking) return getSocketError(errno);
+		waitSocket(conn, POLLIN, portMAX_DELAY);
+	}
+
+	xNew = pvPortMalloc(sizeof(struct netconn));
+	if (xNew == NULL)
+	{
+		close(iFd);
+		return ERR_MEM;
+	}
+	xNew->iFd = iFd;
+	xNew->type = NETCONN_TCP;
+	xNew->callback = conn->callback;
+	xNew->xNonBlocking = false;
+	setsockopt(iFd, IPPROTO_TCP, TCP_NODELAY, &iOn, sizeof(iOn));
+	if (!watchSocket(xNew))
+	{
+		netconn_delete(xNew);
+		return ERR_MEM;
+	}
+	*new_conn = xNew;
+	return ERR_OK;
+}
+
+/* ends the connection both ways, netconn_delete() then releases the socket */
+err_t netconn_close(struct netconn *conn)
+{
+	if (conn->type == NETCONN_TCP) shutdown(conn->iFd, SHUT_RDWR);
+	return ERR_OK;
+}
+
+/**
+ * @brief
+ * Reads the bytes the socket holds, up to MB_POSIX_PBUF, into a new pbuf
+ *
+ * @param apiflags NETCONN_DONTBLOCK returns ERR_WOULDBLOCK instead of waiting for data
+ * @return ERR_OK with *new_buf, ERR_CLSD once the peer closed, or the error of the connection
+ * @ingroup port
+ */
+err_t netconn_recv_tcp_pbuf_flags(struct netconn *conn, struct pbuf **new_buf, u8_t apiflags)
+{
+	struct pbuf *p = allocPbuf(MB_POSIX_PBUF);
+	ssize_t iLen;
+
+	*new_buf = NULL;
+	if (p == NULL) return ERR_MEM;
+
+	while ((iLen = recv(conn->iFd, p->payload, MB_POSIX_PBUF, 0)) < 0)
+	{
+		if (errno == EINTR) continue;
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || (apiflags & NETCONN_DONTBLOCK))
+		{
+			pbuf_free(p);
+			return getSocketError(errno);
+		}
+		waitSocket(conn, POLLIN, portMAX_DELAY);
+	}
+	if (iLen == 0)
+	{
+		pbuf_free(p);
+		return ERR_CLSD;
+	}
+
+	p->len = p->tot_len = (u16_t)iLen;
+	*new_buf = p;
+	return ERR_OK;
+}
+
+/**
+ * @brief
+ * Takes one datagram and its source, MB_POSIX_PBUF bytes of it at most
+ *
+ * @ingroup port
+ */
+err_t netconn_recv_udp_raw_netbuf_flags(struct netconn *conn, struct netbuf **new_buf, u8_t apiflags)
+{
+	struct netbuf *buf = netbuf_new();
+	struct sockaddr_in xFrom;
+	socklen_t xLen = sizeof(xFrom);
+	ssize_t iLen;
+
+	*new_buf = NULL;
+	if (buf == NULL || netbuf_alloc(buf, MB_POSIX_PBUF) == NULL)
+	{
+		netbuf_delete(buf);
+		return ERR_MEM;
+	}
+
+	while ((iLen = recvfrom(conn->iFd, buf->p->payload, MB_POSIX_PBUF, 0, (struct sockaddr *)&xFrom, &xLen)) < 0)
+	{
+		if (errno == EINTR) continue;
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || (apiflags & NETCONN_DONTBLOCK))
+		{
+			netbuf_delete(buf);
+			return getSocketError(errno);
+		}
+		waitSocket(conn, POLLIN, portMAX_DELAY);
+	}
+
+	buf->p->len = buf->p->tot_len = (u16_t)iLen;
+	buf->addr.addr = xFrom.sin_addr.s_addr;
+	buf->port = ntohs(xFrom.sin_port);
+	*new_buf = buf;
+	return ERR_OK;
+}
+
+/**
+ * @brief
+ * Queues the bytes in the socket, waiting while the window is full as netconn_write()
+ * blocks in lwIP, MB_POSIX_NET_TIMEOUT ticks at most. The kernel copies them, NETCONN_MORE
+ * holds them back for the data that follows
+ *
+ * @ingroup port
+ */
+err_t netconn_write(struct netconn *conn, const void *dataptr, size_t size, u8_t apiflags)
+{
+	const uint8_t *u8Data = dataptr;
+	int iFlags = MSG_NOSIGNAL | MSG_DONTWAIT | ((apiflags & NETCONN_MORE) ? MSG_MORE : 0);
+
+	while (size > 0)
+	{
+		ssize_t iSent = send(conn->iFd, u8Data, size, iFlags);
+
+		if (iSent > 0)
+		{
+			u8Data += iSent;
+			size -= (size_t)iSent;
+			continue;
+		}
+		if (iSent < 0 && errno == EINTR) continue;
+		if (iSent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return getSocketError(errno);
+		if (!waitSocket(conn, POLLOUT, MB_POSIX_NET_TIMEOUT)) return ERR_TIMEOUT; // the peer stopped reading
+	}
+	return ERR_OK;
+}
+
+/* one datagram, dropped like a lost one when the socket has no room for it */
+static err_t sendDatagram(struct netconn *conn, struct netbuf *buf, const struct sockaddr_in *xTo)
+{
+	ssize_t iSent;
+
+	if (buf->p == NULL) return ERR_ARG;
+	do
+	{
+		iSent = sendto(conn->iFd, buf->p->payload, buf->p->len, MSG_NOSIGNAL | MSG_DONTWAIT,
+				(const struct sockaddr *)xTo, (xTo != NULL) ? sizeof(*xTo) : 0);
+	} while (iSent < 0 && errno == EINTR);
+
+	if (iSent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? ERR_MEM : getSocketError(errno);
+	return ERR_OK;
+}
+
+err_t netconn_send(struct netconn *conn, struct netbuf *buf)
+{
+	return sendDatagram(conn, buf, NULL);
+}
+
+err_t netconn_sendto(struct netconn *conn, struct netbuf *buf, const ip_addr_t *addr, u16_t port)
+{
+	struct sockaddr_in xTo = getSockAddr(addr, port);
+
+	return sendDatagram(conn, buf, &xTo);
+}
+
+struct netbuf *netbuf_new(void)
+{
+	struct netbuf *buf = pvPortMalloc(sizeof(struct netbuf));
+
+	if (buf != NULL) memset(buf, 0, sizeof(struct netbuf));
+	return buf;
+}
+
+/* a single pbuf of size bytes, the one of the netbuf before is freed */
+void *netbuf_alloc(struct netbuf *buf, u16_t size)
+{
+	pbuf_free(buf->p);
+	buf->p = buf->ptr = allocPbuf(size);
+	return (buf->p != NULL) ? buf->p->payload : NULL;
+}
+
+void netbuf_delete(struct netbuf *buf)
+{
+	if (buf == NULL) return;
+	pbuf_free(buf->p);
+	vPortFree(buf);
+}
+
+/* a pbuf of len bytes, its payload right behind it */
+static struct pbuf *allocPbuf(u16_t len)
+{
+	struct pbuf *p = pvPortMalloc(sizeof(struct pbuf) + len);
+
+	if (p == NULL) return NULL;
+	p->next = NULL;
+	p->payload = p + 1;
+	p->len = p->tot_len = len;
+	return p;
+}
+
+/* frees the whole chain, lwIP counts a reference per pbuf and the library holds one */
+u8_t pbuf_free(struct pbuf *p)
+{
+	u8_t u8Count = 0;
+
+	while (p != NULL)
+	{
+		struct pbuf *next = p->next;
+
+		vPortFree(p);
+		p = next;
+		u8Count++;
+	}
+	return u8Count;
+}
+
+void pbuf_cat(struct pbuf *head, struct pbuf *tail)
+{
+	struct pbuf *p;
+
+	for (p = head; p->next != NULL; p = p->next) p->tot_len += tail->tot_len;
+	p->tot_len += tail->tot_len;
+	p->next = tail;
+}
+
+/* the byte at offset in the chain, 0 past its end */
+u8_t pbuf_get_at(const struct pbuf *p, u16_t offset)
+{
+	while (p != NULL && offset >= p->len)
+	{
+		offset -= p->len;
+		p = p->next;
+	}
+	return (p != NULL) ? ((const uint8_t *)p->payload)[ offset ] : 0;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset)
+{
+	uint8_t *u8Dst = dataptr;
+	u16_t u16Copied = 0;
+
+	for (; p != NULL && u16Copied < len; p = p->next)
+	{
+		if (offset >= p->len)
+		{
+			offset -= p->len;
+			continue;
+		}
+		u16_t u16Len = p->len - offset;
+		if (u16Len > len - u16Copied) u16Len = len - u16Copied;
+		memcpy(&u8Dst[ u16Copied ], (const uint8_t *)p->payload + offset, u16Len);
+		u16Copied += u16Len;
+		offset = 0;
+	}
+	return u16Copied;
+}
+
+/**
+ * @brief
+ * Drops the first size bytes of the chain: the pbufs they cover are freed, the
+ * payload of the one they end in moves forward
+ *
+ * @return the rest of the chain, NULL when nothing is left
+ * @ingroup port
+ */
+struct pbuf *pbuf_free_header(struct pbuf *q, u16_t size)
+{
+	while (q != NULL && size > 0)
+	{
+		if (size >= q->len)
+		{
+			struct pbuf *next = q->next;
+
+			size -= q->len;
+			vPortFree(q);
+			q = next;
+			continue;
+		}
+		q->payload = (uint8_t *)q->payload + size;
+		q->len -= size;
+		q->tot_len -= size;
+		size = 0;
+	}
+	return q;
+}
+
+int ipaddr_aton(const char *cp, ip_addr_t *addr)
+{
+	return inet_pton(AF_INET, cp, &addr->addr) == 1;
+}
+#endif
+
+#endif
@@ -5,11 +5,172 @@
  *      Author: Alejandro Mera
  */
 
-#include "FreeRTOS.h"
-#include "cmsis_os.h"
-#include "task.h"
-#include "main.h"
-#include "Modbus.h"
+#include "Modbus.h" // HAL and FreeRTOS through ModbusPort.h
+
+
+#if ENABLE_RX_PREDICT == 1
+/* header of the frame in USART_HW mode, true when the byte completes the predicted length with its CRC */
+static inline bool predictRxByte(modbusHandler_t *modH, uint8_t u8byte)
+{
+	if (modH->u16RxCount < MB_RX_HEADER) modH->u8RxHead[modH->u16RxCount] = u8byte;
+	modH->u16RxCount++;
+	if (modH->u16RxNeed == 0 || modH->u16RxCount < modH->u16RxNeed) return false;
+
+	modH->u16RxNeed = predictFrameLength(modH, modH->u8RxHead, modH->u16RxCount);
+	return modH->u16RxNeed == modH->u16RxCount && modH->u16RxCRC == 0;
+}
+#endif
+
+#if ENABLE_MB_RX_MUTE == 1
+/* the rest of a frame for another slave raises no interrupt, the receiver wakes up at the next idle line */
+static inline void muteRx(modbusHandler_t *modH)
+{
+#ifdef USART_RQR_MMRQ
+	modH->port->Instance->RQR = USART_RQR_MMRQ;
+#else
+	SET_BIT(modH->port->Instance->CR1, USART_CR1_RWU);
+#endif
+}
+#endif
+
+/* stores one received byte in USART_HW mode, true when ENABLE_RX_PREDICT ends the frame with it */
+static inline bool addRxByte(modbusHandler_t *modH, uint8_t u8byte)
+{
+#if ENABLE_RX_MERGE == 1 && ENABLE_MB_ERR_STATS == 1
+	uint32_t u32Now = DWT->CYCCNT;
+
+	if (!modH->xRxStart && !modH->xRxDrop && u32Now - modH->u32RxLast > modH->u32RxGap
+#if ENABLE_USART_FIFO == 1
+		&& !modH->xFIFO // the bytes of a FIFO block come at once
+#endif
+		)
+	{
+		modH->xErrStats.u32Gaps++; // T1.5 violation, the bytes up to T35 still make one frame
+	}
+	modH->u32RxLast = u32Now;
+#endif
+	if (modH->xRxStart)
+	{
+		// address of a new frame, frames for other slaves never reach the task
+		modH->xRxStart = false;
+		modH->xRxDrop = !isRxAddress(modH, u8byte);
+#if ENABLE_MB_RX_MUTE == 1
+		if (modH->xRxDrop) muteRx(modH);
+#endif
+#if ENABLE_RX_PREDICT == 1
+		modH->xRxEarly = false;
+		modH->u16RxCount = 0;
+		modH->u16RxNeed = 2;
+#endif
+	}
+	if (modH->xRxDrop) return false;
+
+	RingAdd(&modH->xBufferRX, u8byte);
+#if ENABLE_RX_CRC == 1
+	modH->u16RxCRC = calcCRCByte(modH->u16RxCRC, u8byte);
+#endif
+#if ENABLE_RX_PREDICT == 1
+	return predictRxByte(modH, u8byte);
+#else
+	return false;
+#endif
+}
+
+#if ENABLE_MB_ASCII == 1
+/* one character in ASCII_HW mode, the hex pairs are stored as bytes: true at the LF of a frame for the task */
+static inline bool addRxAscii(modbusHandler_t *modH, uint8_t u8char)
+{
+	uint8_t u8value = (u8char < 0x80) ? u8HexValue[u8char] : MB_ASCII_NONE;
+
+	if (u8char == ':')
+	{
+		// a frame without its CRLF is dropped with the next ':'
+		if (modH->xAsciiFrame) modH->xBufferRX.u16head = modH->u16AsciiStart;
+		modH->u16AsciiStart = modH->xBufferRX.u16head;
+		modH->xAsciiFrame = true;
+		modH->xRxStart = true;
+		modH->xRxDrop = false;
+		modH->u8AsciiHigh = MB_ASCII_NONE;
+		return false;
+	}
+	if (!modH->xAsciiFrame || u8char == '\r') return false;
+	if (u8char == '\n' && modH->u8AsciiHigh == MB_ASCII_NONE && !modH->xRxStart)
+	{
+		modH->xAsciiFrame = false;
+		return !modH->xRxDrop;
+	}
+	if (u8value == MB_ASCII_NONE || modH->xRxDrop)
+	{
+		// not a hex digit, or a LF after an odd digit: the frame is dropped up to the next ':'
+		modH->xBufferRX.u16head = modH->u16AsciiStart; // the producer takes its bytes back
+		modH->xRxDrop = true;
+		return false;
+	}
+	if (modH->u8AsciiHigh == MB_ASCII_NONE)
+	{
+		modH->u8AsciiHigh = u8value;
+		return false;
+	}
+	u8value |= (uint8_t)(modH->u8AsciiHigh << 4);
+	modH->u8AsciiHigh = MB_ASCII_NONE;
+	if (modH->xRxStart)
+	{
+		// address of the frame, frames for other slaves never reach the task
+		modH->xRxStart = false;
+		modH->xRxDrop = !isRxAddress(modH, u8value);
+		if (modH->xRxDrop) return false;
+	}
+	RingAdd(&modH->xBufferRX, u8value);
+	return false;
+}
+#endif
+
+#if ENABLE_TIM_T35 == 1
+/* one byte with a shared xTimT35: the compare of the channel of the handler comes T35 later */
+static inline void restartTimCompare(modbusHandler_t *modH)
+{
+	TIM_TypeDef *xTim = modH->xTimT35->Instance;
+	uint32_t u32Bit = TIM_DIER_CC1IE << (modH->u8TimT35Channel - 1); // CCxIF has the same position in SR
+	uint32_t u32Cmp = xTim->CNT + modH->u32T35us;
+	UBaseType_t uxSaved;
+
+	if (u32Cmp > xTim->ARR) u32Cmp -= xTim->ARR + 1;
+	(&xTim->CCR1)[modH->u8TimT35Channel - 1] = u32Cmp;
+	xTim->SR = ~u32Bit;
+	uxSaved = taskENTER_CRITICAL_FROM_ISR(); // DIER is shared with the handlers of the other channels
+	xTim->DIER |= u32Bit;
+	taskEXIT_CRITICAL_FROM_ISR(uxSaved);
+}
+#endif
+
+#if ENABLE_LPTIM_T35 == 1
+/* count of an LPTIM clocked asynchronously, two equal reads in a row are valid */
+static inline uint16_t readLptim(LPTIM_TypeDef *xLptim)
+{
+	uint16_t u16Count;
+
+	do
+	{
+		u16Count = (uint16_t)xLptim->CNT;
+	} while (u16Count != (uint16_t)xLptim->CNT);
+	return u16Count;
+}
+
+/* one byte of an LPUART_HW frame, the first one starts the LPTIM from 0 with its compare at T35 */
+static inline void restartLptim(modbusHandler_t *modH)
+{
+	if (modH->xLpArmed)
+	{
+		modH->u16LpLast = readLptim(modH->xLptimT35);
+		return;
+	}
+	modH->u16LpLast = 0;
+	modH->xLpArmed = true;
+	modH->xLptimT35->CR = LPTIM_CR_ENABLE;
+	modH->xLptimT35->CMP = modH->u16LpT35;
+	modH->xLptimT35->CR = LPTIM_CR_ENABLE | LPTIM_CR_CNTSTRT;
+}
+#endif
 
 
 /**
@@ -21,21 +182,43 @@
  * @ingroup UartHandle UART HAL handler
  */
 
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+MB_HOT_CODE void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
 {
 	/* Modbus RTU TX callback BEGIN */
 	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-	int i;
-	for (i = 0; i < numberHandlers; i++ )
-	{
-	   	if (mHandlers[i]->port == huart  )
-	   	{
-	   		// notify the end of TX
-	   		xTaskNotifyFromISR(mHandlers[i]->myTaskModbusAHandle, 0, eNoAction, &xHigherPriorityTaskWoken);
-	   		break;
-	   	}
+	MB_ISR_START();
+	MB_HOOK_ISR_ENTER(MB_HOOK_TX_CPLT);
+	modbusHandler_t *modH = getModbusHandler(huart);
 
+	if (modH != NULL)
+	{
+		// the HAL calls this on TC, the last stop bit is out of the shift register
+		if (modH->EN_Port != NULL)
+		{
+			//return RS485 transceiver to receive mode
+			HAL_GPIO_WritePin(modH->EN_Port, modH->EN_Pin, GPIO_PIN_RESET);
+			//enable receiver, disable transmitter
+			HAL_HalfDuplex_EnableReceiver(huart);
+		}
+		MB_TRACE(modH, MB_TS_TX_DONE);
+		// notify the end of TX
+#if ENABLE_MB_SHARED_TASK == 1
+#if MB_ENABLE_MASTER == 1
+		if (modH->uModbusType == MB_MASTER)
+		{
+			// the answer timeout starts when the query is on the line
+			startTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+		}
+#endif
+#elif ENABLE_MB_TX_BUFFER == 1
+		// a slave does not wait for it, see sendTxBuffer()
+		if (modH->uModbusType == MB_MASTER)
+#endif
+		notifyModbusFromISR(modH, MB_EV_TX, &xHigherPriorityTaskWoken);
 	}
+
+	MB_ISR_CHARGE(modH);
+	MB_HOOK_ISR_EXIT(MB_HOOK_TX_CPLT);
 	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
 
 	/* Modbus RTU TX callback END */
@@ -57,27 +240,106 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
  * Modbus functionality.
  * @ingroup UartHandle UART HAL handler
  */
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *UartHandle)
+MB_HOT_CODE void HAL_UART_RxCpltCallback(UART_HandleTypeDef *UartHandle)
 {
 	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
 
 	/* Modbus RTU RX callback BEGIN */
-    int i;
-    for (i = 0; i < numberHandlers; i++ )
-    {
-    	if (mHandlers[i]->port == UartHandle  )
-    	{
-
-    		if(mHandlers[i]->xTypeHW == USART_HW)
-    		{
-    			RingAdd(&mHandlers[i]->xBufferRX, mHandlers[i]->dataRX);
-    			HAL_UART_Receive_IT(mHandlers[i]->port, &mHandlers[i]->dataRX, 1);
-    			xTimerResetFromISR(mHandlers[i]->xTimerT35, &xHigherPriorityTaskWoken);
-    		}
-    		break;
-    	}
-    }
-    portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+	MB_ISR_START();
+	MB_HOOK_ISR_ENTER(MB_HOOK_RX_CPLT);
+	modbusHandler_t *modH = getModbusHandler(UartHandle);
+
+	if (modH != NULL)
+	{
+#if ENABLE_MB_ASCII == 1
+		if(modH->xTypeHW == ASCII_HW)
+		{
+			bool xEnd = addRxAscii(modH, modH->dataRX);
+			HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1);
+			if(xEnd)
+			{
+				// the LF ends the frame, there is no T35
+#if MB_ENABLE_MASTER == 1
+				if(modH->uModbusType == MB_MASTER)
+				{
+					stopTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+				}
+#endif
+				MB_TRACE_FRAME(modH);
+				notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+			}
+		}
+		else
+#endif
+		if(modH->xTypeHW == USART_HW || modH->xTypeHW == LPUART_HW)
+		{
+			bool xEnd = false;
+#if ENABLE_USART_FIFO == 1
+			if(modH->xFIFO)
+			{
+				// a whole FIFO threshold block, the tail of the frame comes with the receiver timeout
+				uint16_t j;
+				for(j = 0; j < UartHandle->RxXferSize; j++)
+				{
+					xEnd |= addRxByte(modH, modH->u8FifoRx[j]);
+				}
+				HAL_UART_Receive_IT(modH->port, modH->u8FifoRx, modH->port->NbRxDataToProcess);
+			}
+			else
+#endif
+			{
+				xEnd = addRxByte(modH, modH->dataRX);
+				HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1);
+			}
+#if ENABLE_RX_PREDICT == 1
+			if(xEnd)
+			{
+				// complete at its predicted length with a matching CRC, T35 is not waited for
+				endRxFrame(modH);
+				modH->xRxEarly = true;
+#if MB_ENABLE_MASTER == 1
+				if(modH->uModbusType == MB_MASTER)
+				{
+					stopTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+				}
+#endif
+				MB_TRACE_FRAME(modH);
+				notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+			}
+#else
+			(void)xEnd;
+#endif
+#if ENABLE_USART_RTO == 1
+			if(!modH->xRTO) // with the receiver timeout the USART detects T35 by itself
+#endif
+			{
+#if ENABLE_TIM_T35 == 1
+				if(modH->xTimT35 != NULL && modH->u8TimT35Channel != 0)
+				{
+					restartTimCompare(modH);
+				}
+				else if(modH->xTimT35 != NULL)
+				{
+					// restart the one-pulse timer, its update event marks T35
+					__HAL_TIM_SET_COUNTER(modH->xTimT35, 0);
+					__HAL_TIM_ENABLE(modH->xTimT35);
+				}
+				else
+#endif
+#if ENABLE_LPTIM_T35 == 1
+				if(modH->xLptimT35 != NULL)
+				{
+					restartLptim(modH);
+				}
+				else
+#endif
+				restartT35FromISR(modH, &xHigherPriorityTaskWoken);
+			}
+		}
+	}
+	MB_ISR_CHARGE(modH);
+	MB_HOOK_ISR_EXIT(MB_HOOK_RX_CPLT);
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
 
 	/* Modbus RTU RX callback END */
 
@@ -90,72 +352,735 @@ void HAL_UART_RxCpltCallback(UART_HandleTypeDef *UartHandle)
 }
 
 
-#if  ENABLE_USART_DMA ==  1
+#if ENABLE_MB_ISR_DEFER == 1
+/**
+ * @brief
+ * Handler of MB_DEFER_IRQn, pended by the UART and DMA interrupts above
+ * configMAX_SYSCALL_INTERRUPT_PRIORITY. Does their T35 and timeout operations
+ * and notifies the tasks, at a kernel-aware priority. The IRQ handler of
+ * MB_DEFER_IRQn has to call this function
+ * @ingroup huart UART HAL handler
+ */
+void ModbusDeferCallback(void)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	int i;
+
+	for (i = 0; i < numberHandlers; i++)
+	{
+		modbusHandler_t *modH = mHandlers[i];
+		uint16_t u16Ops;
+
+		if (modH == NULL) continue;
+		do
+		{
+			u16Ops = __LDREXH(&modH->u16DeferOps);
+		} while (__STREXH(0, &modH->u16DeferOps) != 0);
+		if (u16Ops == 0) continue;
+
+		if (u16Ops & MB_DEFER_T35) restartT35FromISR(modH, &xHigherPriorityTaskWoken);
+#if MB_ENABLE_MASTER == 1
+		if (u16Ops & MB_DEFER_TIMEOUT) startTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+		if (u16Ops & MB_DEFER_TIMEOUT_STOP) stopTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+#endif
+		// the end of a transmission comes before the answer to it
+		if (u16Ops & MB_EV_TX) notifyModbusFromISR(modH, MB_EV_TX, &xHigherPriorityTaskWoken);
+		if (u16Ops & MB_EV_RX_ERR) notifyModbusFromISR(modH, MB_EV_RX_ERR, &xHigherPriorityTaskWoken);
+		if (u16Ops & MB_EV_TIMEOUT) notifyModbusFromISR(modH, MB_EV_TIMEOUT, &xHigherPriorityTaskWoken);
+		if (u16Ops & MB_EV_RX) notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+	}
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
+#endif
+
+
+#if ENABLE_TIM_T35 == 1
+/**
+ * @brief
+ * This is the T35 callback for the hardware timers used by Modbus in USART_HW mode.
+ * HAL_TIM_PeriodElapsedCallback() usually belongs to the application (HAL time base),
+ * so it has to call this function for every timer update event.
+ * @ingroup htim TIM HAL handler
+ */
+MB_HOT_CODE void ModbusT35TimerCallback(TIM_HandleTypeDef *htim)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	int i;
+	MB_HOOK_ISR_ENTER(MB_HOOK_T35);
+	for (i = 0; i < numberHandlers; i++ )
+	{
+		if (mHandlers[i] != NULL && mHandlers[i]->xTimT35 == htim  )
+		{
+			// T35 elapsed, the timer stopped by itself in one-pulse mode
+			if(endRxFrame(mHandlers[i]))
+			{
+#if MB_ENABLE_MASTER == 1
+				if(mHandlers[i]->uModbusType == MB_MASTER)
+				{
+					stopTimeoutFromISR(mHandlers[i], &xHigherPriorityTaskWoken);
+				}
+#endif
+				MB_TRACE_FRAME(mHandlers[i]);
+				notifyModbusFromISR(mHandlers[i], MB_EV_RX, &xHigherPriorityTaskWoken);
+			}
+			break;
+		}
+	}
+	MB_HOOK_ISR_EXIT(MB_HOOK_T35);
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
+
+/**
+ * @brief
+ * This is the T35 callback for a free-running timer shared by several handlers in
+ * USART_HW mode, each one on its compare channel u8TimT35Channel. The application
+ * calls it from HAL_TIM_OC_DelayElapsedCallback(), the HAL sets htim->Channel to
+ * the channel that matched. The channel is disabled until the next received byte.
+ * @ingroup htim TIM HAL handler
+ */
+MB_HOT_CODE void ModbusT35CompareCallback(TIM_HandleTypeDef *htim)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	UBaseType_t uxSaved;
+	modbusHandler_t *modH;
+	int i;
+	MB_HOOK_ISR_ENTER(MB_HOOK_T35);
+	for (i = 0; i < numberHandlers; i++ )
+	{
+		modH = mHandlers[i];
+		if (modH == NULL || modH->xTimT35 != htim || modH->u8TimT35Channel == 0 ||
+			htim->Channel != (HAL_TIM_ActiveChannel)(1U << (modH->u8TimT35Channel - 1))) continue;
+
+		// T35 elapsed since the last byte, the next byte arms the compare again
+		uxSaved = taskENTER_CRITICAL_FROM_ISR();
+		htim->Instance->DIER &= ~(TIM_DIER_CC1IE << (modH->u8TimT35Channel - 1));
+		taskEXIT_CRITICAL_FROM_ISR(uxSaved);
+		if(endRxFrame(modH))
+		{
+#if MB_ENABLE_MASTER == 1
+			if(modH->uModbusType == MB_MASTER)
+			{
+				stopTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+			}
+#endif
+			MB_TRACE_FRAME(modH);
+			notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+		}
+		break;
+	}
+	MB_HOOK_ISR_EXIT(MB_HOOK_T35);
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
+#endif
+
+#if ENABLE_LPTIM_T35 == 1
+/**
+ * @brief
+ * This is the T35 callback for the LPTIMs used by Modbus in LPUART_HW mode, the
+ * LPTIMx_IRQHandler() of the application must call it. The compare match comes T35
+ * after the byte that started the LPTIM: it is moved after the last byte until the
+ * line stayed silent for T35, then the LPTIM stops until the next frame.
+ * The LPTIM and LPUART interrupts should have the same priority.
+ * @ingroup xLptim LPTIM registers
+ */
+void ModbusLptimCallback(LPTIM_TypeDef *xLptim)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	modbusHandler_t *modH;
+	int i;
+
+	if ((xLptim->ISR & LPTIM_ISR_CMPM) == 0) return;
+	xLptim->ICR = LPTIM_ICR_CMPMCF;
+
+	MB_HOOK_ISR_ENTER(MB_HOOK_T35);
+	for (i = 0; i < numberHandlers; i++ )
+	{
+		modH = mHandlers[i];
+		if (modH == NULL || modH->xLptimT35 != xLptim || !modH->xLpArmed) continue;
+
+		if ((uint16_t)(readLptim(xLptim) - modH->u16LpLast) < modH->u16LpT35)
+		{
+			// bytes received since the compare was set
+			xLptim->CMP = (uint16_t)(modH->u16LpLast + modH->u16LpT35);
+			break;
+		}
+
+		xLptim->CR = 0;
+		modH->xLpArmed = false;
+		if(endRxFrame(modH))
+		{
+#if MB_ENABLE_MASTER == 1
+			if(modH->uModbusType == MB_MASTER)
+			{
+				stopTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+			}
+#endif
+			MB_TRACE_FRAME(modH);
+			notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+		}
+		break;
+	}
+	MB_HOOK_ISR_EXIT(MB_HOOK_T35);
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
+#endif
+
+
+#if ENABLE_USART_DMA == 1
+/*
+ * The HAL refused to restart the DMA reception: the Modbus task retries it instead of
+ * the interrupt. A master retries before its next query, its task waits for the answer
+ */
+static void deferRxRestart(modbusHandler_t *modH, BaseType_t *pxHigherPriorityTaskWoken)
+{
+	modH->xRxRestart = true;
+#if ENABLE_MB_ERR_STATS == 1
+	modH->xErrStats.u32RxDeferred++;
+#endif
+#if ENABLE_MB_SHARED_TASK != 1
+	if(modH->uModbusType != MB_SLAVE) return;
+#endif
+	notifyModbusFromISR(modH, MB_EV_RX_ERR, pxHigherPriorityTaskWoken);
+}
+
+/**
+ * @brief
+ * Restarts the DMA reception of a USART_HW_DMA or USART_HW_DMA_CIRC handler stopped
+ * by an error, with a single attempt. The error flags and the received data are
+ * cleared first and the frame in progress is dropped. Called by the error callback
+ * and, when it fails, by the Modbus task
+ *
+ * @return false if the HAL refused it
+ * @ingroup huart UART HAL handler
+ */
+bool rearmRxDMA(modbusHandler_t *modH)
+{
+	UART_HandleTypeDef *huart = modH->port;
+
+	__HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_OREF | UART_CLEAR_NEF | UART_CLEAR_FEF | UART_CLEAR_PEF);
+	__HAL_UART_SEND_REQ(huart, UART_RXDATA_FLUSH_REQUEST);
+	if(huart->RxState != HAL_UART_STATE_READY)
+	{
+		HAL_UART_AbortReceive(huart); // the reception still runs after a non blocking error
+	}
+#if ENABLE_RX_MERGE == 1
+	modH->xRxMerging = false;
+#endif
+#if ENABLE_RX_MERGE == 1 || ENABLE_RX_PREDICT == 1
+	modH->u16RxMerged = 0; // a pending T35 finds nothing to end
+	modH->u16RxMergeCRC = 0xFFFF;
+#endif
+
+	if(modH->xTypeHW == USART_HW_DMA_CIRC)
+	{
+		modH->u16RxPos = modH->u16RxFrameStart = modH->u16RxFrameLen = 0;
+		modH->u32RxTotal += MAX_BUFFER_RX; // the DMA starts again at 0, over the frames still queued
+		flushDCache(modH->xBufferRX.uxBuffer, MAX_BUFFER_RX);
+		return HAL_UARTEx_ReceiveToIdle_DMA(huart, modH->xBufferRX.uxBuffer, MAX_BUFFER_RX) == HAL_OK;
+	}
+	flushDCache(modH->xBufferRX.uxBuffer, MAX_BUFFER_RX);
+	if(HAL_UARTEx_ReceiveToIdle_DMA(huart, modH->xBufferRX.uxBuffer, MB_RX_DMA_FIRST) != HAL_OK)
+	{
+		return false;
+	}
+	__HAL_DMA_DISABLE_IT(huart->hdmarx, DMA_IT_HT); // we don't need half-transfer interrupt
+	return true;
+}
+
+/* USART_HW_DMA: receives the next bytes in uxBuffer from u16Offset up to u16End */
+static void restartRxDMA(modbusHandler_t *modH, uint16_t u16Offset, uint16_t u16End)
+{
+	flushDCache(&modH->xBufferRX.uxBuffer[u16Offset], u16End - u16Offset);
+	if(HAL_UARTEx_ReceiveToIdle_DMA(modH->port, &modH->xBufferRX.uxBuffer[u16Offset], u16End - u16Offset) != HAL_OK)
+	{
+		deferRxRestart(modH, NULL); // the task restarts it from the start of uxBuffer
+		return;
+	}
+	__HAL_DMA_DISABLE_IT(modH->port->hdmarx, DMA_IT_HT); // we don't need half-transfer interrupt
+}
+
+#if ENABLE_MB_RX_QUEUE == 1
+/* USART_HW_DMA: copies the frame at the start of uxBuffer to xRxQueue, the DMA may restart over it then */
+static void queueRxDMA(modbusHandler_t *modH, uint16_t u16Len, BaseType_t *pxHigherPriorityTaskWoken)
+{
+	if(xMessageBufferSendFromISR(modH->xRxQueue, modH->xBufferRX.uxBuffer, u16Len, pxHigherPriorityTaskWoken) != u16Len)
+	{
+		modH->xBufferRX.overflow = true; // xRxQueue full, the frame is lost, report it to the task
+	}
+}
+#endif
+
+/* USART_HW_DMA_CIRC: queues the frame in progress for the task, false when it is not for us */
+static bool publishRxCirc(modbusHandler_t *modH)
+{
+	uint8_t u8next = (modH->u8RxFrameHead + 1) % MAX_RX_FRAMES;
+	bool xNotify = false;
+
+	if(!isRxAddress(modH, modH->xBufferRX.uxBuffer[modH->u16RxFrameStart]))
+	{
+		// frame for another slave, skip it in the ring without waking the task
+	}
+	else if(u8next != modH->u8RxFrameTail)
+	{
+		// publish the frame, the DMA keeps running so there is no re-arm window
+		modH->xRxFrames[modH->u8RxFrameHead].u16Offset = modH->u16RxFrameStart;
+		modH->xRxFrames[modH->u8RxFrameHead].u16Length = modH->u16RxFrameLen;
+		modH->xRxFrames[modH->u8RxFrameHead].u32Start = modH->u32RxTotal - modH->u16RxFrameLen;
+#if ENABLE_MB_MONITOR == 1
+		modH->xRxFrames[modH->u8RxFrameHead].u32End = DWT->CYCCNT;
+#endif
+		modH->u8RxFrameHead = u8next;
+		xNotify = true;
+	}
+	else
+	{
+		modH->xBufferRX.overflow = true; // descriptor queue full, the frame is lost, report it to the task
+	}
+	modH->u16RxFrameStart = modH->u16RxPos;
+	modH->u16RxFrameLen = 0;
+	return xNotify;
+}
+
+#if ENABLE_RX_MERGE == 1 || ENABLE_RX_PREDICT == 1
+/* adds the bytes of the frame in progress received since the last event to its running CRC */
+static void addRxFragmentCRC(modbusHandler_t *modH, uint16_t u16Len)
+{
+	uint16_t i;
+
+	for (i = modH->u16RxMerged; i < u16Len; i++)
+	{
+		uint16_t u16Pos = (modH->xTypeHW == USART_HW_DMA_CIRC) ? (modH->u16RxFrameStart + i) % MAX_BUFFER_RX : i;
+		modH->u16RxMergeCRC = calcCRCByte(modH->u16RxMergeCRC, modH->xBufferRX.uxBuffer[u16Pos]);
+	}
+	modH->u16RxMerged = u16Len;
+}
+#endif
+
+#if ENABLE_RX_MERGE == 1
+/*
+ * IDLE event inside a frame: the line was silent for one character, which a slow sender or
+ * a USB-serial adapter may do in the middle of a frame. The frame only ends here when the CRC
+ * of its u16Len bytes matches or when it fills the buffer, the other fragments wait for the
+ * next ones up to T35. Returns true when the frame ended
+ */
+static bool mergeRxFragment(modbusHandler_t *modH, uint16_t u16Len, BaseType_t *pxHigherPriorityTaskWoken)
+{
+#if ENABLE_MB_ERR_STATS == 1
+	if (modH->xRxMerging)
+	{
+		modH->xErrStats.u32Gaps++; // bytes came after the fragment before T35
+	}
+#endif
+	addRxFragmentCRC(modH, u16Len);
+
+	if (modH->u16RxMergeCRC != 0 && u16Len < MAX_BUFFER)
+	{
+		modH->xRxMerging = true;
+		restartT35FromISR(modH, pxHigherPriorityTaskWoken);
+		return false;
+	}
+	if (modH->xRxMerging)
+	{
+		stopT35FromISR(modH, pxHigherPriorityTaskWoken);
+	}
+	modH->xRxMerging = false;
+	modH->u16RxMerged = 0;
+	modH->u16RxMergeCRC = 0xFFFF;
+	return true;
+}
+
+/**
+ * @brief
+ * Ends the merged fragments of a USART_HW_DMA or USART_HW_DMA_CIRC frame at T35,
+ * called by endRxFrame() from the T35 timer callback. The frame goes to the task
+ * with its bad CRC, which counts it.
+ *
+ * @return true if the task has to be notified
+ * @ingroup huart UART HAL handler
+ */
+bool endRxMerge(modbusHandler_t *modH)
+{
+	UBaseType_t uxSaved = taskENTER_CRITICAL_FROM_ISR(); // the RX event may come meanwhile, also from the timer task
+	bool xNotify = false;
+
+	if (modH->xRxMerging)
+	{
+		modH->xRxMerging = false;
+		if (modH->xTypeHW == USART_HW_DMA)
+		{
+			uint16_t u16Len = modH->u16RxMerged;
+
+			// bytes received since the last IDLE event were too late for this frame
+			HAL_UART_AbortReceive(modH->port);
+			xNotify = isRxAddress(modH, modH->xBufferRX.uxBuffer[0]);
+#if ENABLE_MB_RX_QUEUE == 1
+			if(xNotify) queueRxDMA(modH, u16Len, NULL);
+#else
+			modH->xBufferRX.u16head = u16Len;
+			modH->xBufferRX.overflow = false;
+#endif
+#if ENABLE_USART_DMA_INPLACE == 1
+			if(!xNotify) // the frame is u8Buffer, the task restarts the DMA once it is served
+#endif
+			restartRxDMA(modH, 0, MB_RX_DMA_FIRST);
+		}
+		else
+		{
+			xNotify = publishRxCirc(modH);
+		}
+		modH->u16RxMerged = 0;
+		modH->u16RxMergeCRC = 0xFFFF;
+	}
+	taskEXIT_CRITICAL_FROM_ISR(uxSaved);
+	return xNotify;
+}
+#endif
+
+#if ENABLE_RX_MERGE == 1 || ENABLE_RX_PREDICT == 1
+/*
+ * RX event of USART_HW_DMA with the first u16Len bytes of the frame in progress. With
+ * ENABLE_RX_PREDICT each transfer ends at the length predicted from the header, the frame
+ * ends there when its CRC matches, without waiting for the IDLE event. Returns false when
+ * the DMA goes on after them
+ */
+static bool takeRxFragment(modbusHandler_t *modH, uint16_t u16Len, HAL_UART_RxEventTypeTypeDef xEvent, BaseType_t *pxHigherPriorityTaskWoken)
+{
+	uint16_t u16End = MAX_BUFFER;
+
+	addRxFragmentCRC(modH, u16Len);
+#if ENABLE_RX_PREDICT == 1
+	uint16_t u16Need = predictFrameLength(modH, modH->xBufferRX.uxBuffer, u16Len);
+
+	if (u16Need > u16Len) u16End = u16Need;
+	if (xEvent == HAL_UART_RXEVENT_TC && u16Len < MAX_BUFFER && (u16Need != u16Len || modH->u16RxMergeCRC != 0))
+	{
+		// the programmed count arrived, the header or the frame goes on
+#if ENABLE_RX_MERGE == 1
+		if (modH->xRxMerging)
+		{
+			restartT35FromISR(modH, pxHigherPriorityTaskWoken); // T35 counts from the last byte
+		}
+#endif
+		restartRxDMA(modH, u16Len, u16End);
+		return false;
+	}
+#endif
+#if ENABLE_RX_MERGE == 1
+	if (!mergeRxFragment(modH, u16Len, pxHigherPriorityTaskWoken))
+	{
+		restartRxDMA(modH, u16Len, u16End);
+		return false;
+	}
+#endif
+	modH->u16RxMerged = 0;
+	modH->u16RxMergeCRC = 0xFFFF;
+	return true;
+}
+#endif
+
+#endif
+
+
+#if  ENABLE_USART_DMA ==  1 || ENABLE_USART_RTO == 1 || ENABLE_MB_ERR_STATS == 1
 /*
  * DMA requires to handle callbacks for special communication modes of the HAL
  * It also has to handle eventual errors including extra steps that are not automatically
  * handled by the HAL
+ * The receiver timeout (T35 detection in USART_HW mode) is also reported by the HAL as an error
  * */
 
 
 void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
 {
 
- int i;
+	modbusHandler_t *modH = getModbusHandler(huart);
+#if ENABLE_USART_RTO == 1 || ENABLE_USART_DMA == 1
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+#endif
+
+	if (modH != NULL)
+	{
+#if ENABLE_MB_ERR_STATS == 1
+		if(huart->ErrorCode & HAL_UART_ERROR_ORE) modH->xErrStats.u32Overrun++;
+		if(huart->ErrorCode & HAL_UART_ERROR_FE) modH->xErrStats.u32Framing++;
+		if(huart->ErrorCode & HAL_UART_ERROR_NE) modH->xErrStats.u32Noise++;
+		if(huart->ErrorCode & HAL_UART_ERROR_PE) modH->xErrStats.u32Parity++;
+
+		// the HAL aborts the interrupt reception on an overrun, restart it
+		if((modH->xTypeHW == USART_HW || modH->xTypeHW == LPUART_HW || modH->xTypeHW == ASCII_HW) && huart->RxState == HAL_UART_STATE_READY
+#if ENABLE_USART_RTO == 1
+		   && !modH->xRTO
+#endif
+		   )
+		{
+			HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1);
+		}
+#endif
+
+#if ENABLE_USART_RTO == 1
+		if(modH->xTypeHW == USART_HW && modH->xRTO)
+		{
+#if ENABLE_USART_FIFO == 1
+			if(modH->xFIFO)
+			{
+				if(huart->RxState == HAL_UART_STATE_READY)
+				{
+					// reception aborted: keep the bytes of the unfinished block and the ones under the FIFO threshold
+					uint16_t j;
+					for(j = 0; j < huart->RxXferSize - huart->RxXferCount; j++)
+					{
+						addRxByte(modH, modH->u8FifoRx[j]);
+					}
+					while(__HAL_UART_GET_FLAG(huart, UART_FLAG_RXFNE))
+					{
+						addRxByte(modH, (uint8_t)huart->Instance->RDR);
+					}
+					HAL_UART_Receive_IT(modH->port, modH->u8FifoRx, modH->port->NbRxDataToProcess);
+				}
+			}
+			else
+#endif
+			// RTO and overrun errors abort the reception, restart it for the next frame
+			HAL_UART_Receive_IT(modH->port, &modH->dataRX, 1);
+
+			if(huart->ErrorCode & HAL_UART_ERROR_RTO)
+			{
+				// T35 elapsed, notify the task directly without the timer service task
+				if(endRxFrame(modH))
+				{
+#if MB_ENABLE_MASTER == 1
+					if(modH->uModbusType == MB_MASTER)
+					{
+						stopTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+					}
+#endif
+					MB_TRACE_FRAME(modH);
+					notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+				}
+			}
+		}
+#endif
+#if ENABLE_USART_DMA == 1
+		if(modH->xTypeHW == USART_HW_DMA || modH->xTypeHW == USART_HW_DMA_CIRC)
+		{
+			// the HAL stops the DMA on errors, one attempt here and no loop at this priority
+			if(!rearmRxDMA(modH))
+			{
+				deferRxRestart(modH, &xHigherPriorityTaskWoken);
+			}
+		}
+#endif
+	}
+#if ENABLE_USART_RTO == 1 || ENABLE_USART_DMA == 1
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+#endif
+}
+
+#endif
+
+
+#if  ENABLE_USART_DMA ==  1
+
+
+MB_HOT_CODE void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	/* Modbus RTU RX callback BEGIN */
+	MB_ISR_START();
+	MB_HOOK_ISR_ENTER(MB_HOOK_RX_EVENT);
+	modbusHandler_t *modH = getModbusHandler(huart);
+
+	if (modH != NULL)
+	{
+		if(modH->xTypeHW == USART_HW_DMA || modH->xTypeHW == USART_HW_DMA_CIRC)
+		{
+			// the callback reads the bytes the DMA wrote, the address and the fragments of the frame
+			invalidateDCache(modH->xBufferRX.uxBuffer, MAX_BUFFER_RX);
+		}
+
+		if(modH->xTypeHW == USART_HW_DMA)
+		{
+#if ENABLE_RX_MERGE == 1 || ENABLE_RX_PREDICT == 1
+			if(Size)
+			{
+				// Size counts from the end of the fragments already received
+				Size += modH->u16RxMerged;
+				if(!takeRxFragment(modH, Size, HAL_UARTEx_GetRxEventType(huart), &xHigherPriorityTaskWoken))
+				{
+					Size = 0;
+				}
+			}
+#endif
+			if(Size) //check if we have received any byte
+			{
+				bool xForUs = isRxAddress(modH, modH->xBufferRX.uxBuffer[0]); // frames for other slaves are dropped here
+
+#if ENABLE_MB_RX_QUEUE != 1
+				modH->xBufferRX.u16head = Size; // frame length, the DMA always starts at uxBuffer[0]
+				modH->xBufferRX.overflow = false;
+#endif
+#if ENABLE_MB_FAST_READ == 1
+				if(xForUs && answerFastRead(modH, Size, &xHigherPriorityTaskWoken))
+				{
+					xForUs = false; // answered here, the task keeps waiting
+				}
+#endif
+#if ENABLE_MB_RX_QUEUE == 1
+				if(xForUs)
+				{
+					queueRxDMA(modH, Size, &xHigherPriorityTaskWoken); // before the DMA restarts over it
+				}
+#endif
 
- for (i = 0; i < numberHandlers; i++ )
- {
-    	if (mHandlers[i]->port == huart  )
-    	{
+#if ENABLE_USART_DMA_INPLACE == 1
+				if(!xForUs) // the frame is u8Buffer, the task restarts the DMA once it is served
+#endif
+				{
+					restartRxDMA(modH, 0, MB_RX_DMA_FIRST);
+				}
 
-    		if(mHandlers[i]->xTypeHW == USART_HW_DMA)
-    		{
-    			while(HAL_UARTEx_ReceiveToIdle_DMA(mHandlers[i]->port, mHandlers[i]->xBufferRX.uxBuffer, MAX_BUFFER) != HAL_OK)
-    		    {
-    					HAL_UART_DMAStop(mHandlers[i]->port);
-   				}
-				__HAL_DMA_DISABLE_IT(mHandlers[i]->port->hdmarx, DMA_IT_HT); // we don't need half-transfer interrupt
+				if(xForUs)
+				{
+					MB_TRACE_FRAME(modH);
+					notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+				}
+			}
+		}
+		else if(modH->xTypeHW == USART_HW_DMA_CIRC)
+		{
+			uint16_t u16Pos = Size % MAX_BUFFER_RX; // Size is the DMA position inside the ring
+			uint16_t u16New = (u16Pos + MAX_BUFFER_RX - modH->u16RxPos) % MAX_BUFFER_RX;
 
-    		}
+			// account the bytes written by the DMA since the last event (half, full or idle)
+			modH->u16RxFrameLen += u16New;
+			modH->u32RxTotal += u16New;
+			modH->u16RxPos = u16Pos;
 
-    		break;
-    	}
-   }
+			if(HAL_UARTEx_GetRxEventType(huart) == HAL_UART_RXEVENT_IDLE && modH->u16RxFrameLen
+#if ENABLE_RX_MERGE == 1
+			   && mergeRxFragment(modH, modH->u16RxFrameLen, &xHigherPriorityTaskWoken)
+#endif
+			   )
+			{
+				if(publishRxCirc(modH))
+				{
+					MB_TRACE_FRAME(modH);
+					notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+				}
+			}
+		}
+	}
+	MB_ISR_CHARGE(modH);
+	MB_HOOK_ISR_EXIT(MB_HOOK_RX_EVENT);
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
 }
 
+#endif
+
 
-void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+#if ENABLE_USB_CDC == 1
+/* handler of a USB CDC device */
+static modbusHandler_t *getUsbHandler(USBD_HandleTypeDef *pdev)
 {
-	    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-		/* Modbus RTU RX callback BEGIN */
-	    int i;
-	    for (i = 0; i < numberHandlers; i++ )
-	    {
-	    	if (mHandlers[i]->port == huart  )
-	    	{
+	for (uint8_t i = 0; i < numberHandlers; i++)
+	{
+		if (mHandlers[i] != NULL && mHandlers[i]->xTypeHW == USB_CDC_HW && mHandlers[i]->xUsbDevice == pdev)
+		{
+			return mHandlers[i];
+		}
+	}
+	return NULL;
+}
 
+/* receives the next packet of the frame at its end in u8Buffer */
+static inline void armUsbRx(modbusHandler_t *modH, USBD_HandleTypeDef *pdev)
+{
+	USBD_CDC_SetRxBuffer(pdev, &modH->u8Buffer[ modH->u16UsbRxLen ]);
+	USBD_CDC_ReceivePacket(pdev);
+}
 
-	    		if(mHandlers[i]->xTypeHW == USART_HW_DMA)
-	    		{
-	    			if(Size) //check if we have received any byte
-	    			{
-		    				mHandlers[i]->xBufferRX.u8available = Size;
-		    				mHandlers[i]->xBufferRX.overflow = false;
+/**
+ * @brief
+ * This is the receive callback of the USB_CDC_HW handlers, CDC_Receive_FS() of usbd_cdc_if.c
+ * must call it instead of arming the OUT endpoint again. The packets are received in place in
+ * u8Buffer and the USB transfer delimits the frame, no T35 timer runs: a short packet ends it,
+ * and so does a full one whose last two bytes are the CRC of the frame. The endpoint then stays
+ * NAKed, the host holds the next request until the task served this one.
+ * The USB interrupt must not be above configMAX_SYSCALL_INTERRUPT_PRIORITY.
+ * @ingroup pdev USB device handler
+ */
+void ModbusUsbRxCallback(USBD_HandleTypeDef *pdev, uint8_t *Buf, uint32_t u32Len)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	modbusHandler_t *modH = getUsbHandler(pdev);
+	uint8_t *u8Rx;
 
-		    				while(HAL_UARTEx_ReceiveToIdle_DMA(mHandlers[i]->port, mHandlers[i]->xBufferRX.uxBuffer, MAX_BUFFER) != HAL_OK)
-		    				{
-		    					HAL_UART_DMAStop(mHandlers[i]->port);
-		    				}
-		    				__HAL_DMA_DISABLE_IT(mHandlers[i]->port->hdmarx, DMA_IT_HT); // we don't need half-transfer interrupt
+	// a packet received after a new enumeration, while the task still owns u8Buffer, is dropped
+	if (modH == NULL || !modH->xUsbRxArmed) return;
+	MB_HOOK_ISR_ENTER(MB_HOOK_RX_EVENT);
 
-		    				xTaskNotifyFromISR(mHandlers[i]->myTaskModbusAHandle, 0 , eSetValueWithOverwrite, &xHigherPriorityTaskWoken);
-	    			}
-	    		}
+	u8Rx = &modH->u8Buffer[ modH->u16UsbRxLen ];
+	if (u32Len > MB_USB_PACKET) u32Len = MB_USB_PACKET;
+	if (Buf != u8Rx)
+	{
+		// the first packet after the enumeration is in the buffer of usbd_cdc_if.c
+		memmove(u8Rx, Buf, u32Len);
+	}
+	for (uint32_t i = 0; i < u32Len; i++)
+	{
+		modH->u16UsbRxCRC = calcCRCByte(modH->u16UsbRxCRC, u8Rx[ i ]);
+	}
+	modH->u16UsbRxLen += u32Len;
 
-	    		break;
-	    	}
-	    }
-	    portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+	if (modH->u16UsbRxLen == 0 ||
+		(u32Len == MB_USB_PACKET && modH->u16UsbRxCRC != 0 && modH->u16UsbRxLen <= MAX_BUFFER - MB_USB_PACKET))
+	{
+		// zero length packet between two frames, or the frame goes on in the next packet
+		armUsbRx(modH, pdev);
+	}
+	else if (!isRxAddress(modH, modH->u8Buffer[ ID ]))
+	{
+		// frame for another slave, receive the next one over it
+		modH->u16UsbRxLen = 0;
+		modH->u16UsbRxCRC = 0xFFFF;
+		armUsbRx(modH, pdev);
+	}
+	else
+	{
+		modH->xUsbRxArmed = false;
+#if MB_ENABLE_MASTER == 1
+		if (modH->uModbusType == MB_MASTER)
+		{
+			stopTimeoutFromISR(modH, &xHigherPriorityTaskWoken);
+		}
+#endif
+		MB_TRACE_FRAME(modH);
+		notifyModbusFromISR(modH, MB_EV_RX, &xHigherPriorityTaskWoken);
+	}
+
+	MB_HOOK_ISR_EXIT(MB_HOOK_RX_EVENT);
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
 }
 
+/**
+ * @brief
+ * This is the transmit callback of the USB_CDC_HW handlers, CDC_TransmitCplt_FS() of
+ * usbd_cdc_if.c calls it when the host took the last packet of a frame.
+ * Without it sendTxBuffer() polls the CDC class every tick.
+ * @ingroup pdev USB device handler
+ */
+void ModbusUsbTxCallback(USBD_HandleTypeDef *pdev)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	modbusHandler_t *modH = getUsbHandler(pdev);
+
+	MB_HOOK_ISR_ENTER(MB_HOOK_TX_CPLT);
+	if (modH != NULL)
+	{
+		MB_TRACE(modH, MB_TS_TX_DONE);
+		notifyModbusFromISR(modH, MB_EV_TX, &xHigherPriorityTaskWoken);
+	}
+	MB_HOOK_ISR_EXIT(MB_HOOK_TX_CPLT);
+	portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+}
 #endif
@@ -0,0 +1,494 @@
+#!/usr/bin/env python3
+"""
+ModbusMapGen.py
+
+Generator of the register map of a slave from its CSV or JSON description.
+
+    python3 ModbusMapGen.py pump.csv --name pump --out Core
+
+writes Core/Inc/pump_map.h and Core/Src/pump_map.c (or both in --out when it has no Inc
+and Src). They hold, for the holding and the input registers of the description:
+
+  - the storage of the registers, initialised with the default values of the fields,
+  - the sorted segment table served through xSegHR and xSegRO, one modbusSegment_t per
+    run of contiguous registers, const in flash,
+  - the u32ReadOnly/u32Locked bitmaps of ENABLE_MB_ACCESS and the xLimits tables of
+    ENABLE_MB_LIMITS, from the access, min, max and enum columns,
+  - the address of each field as a define and its typed get/set accessors, the 32 and
+    64 bit ones converted with their word order under the lock of the table,
+  - pump_Attach(modH), which serves the map, to call before ModbusStart(),
+  - ModbusMapLookup() for ENABLE_MB_MAP_LOOKUP: findSegment() then finds the segment of a
+    request with a direct index table (a small map) or with comparisons against constants
+    instead of its binary search over the segment table. One map of the firmware defines it,
+    the others are generated with --no-lookup and are searched as before.
+
+A CSV description has a header line and one field per line, a JSON description is a list of
+objects, or an object whose "fields" is that list, with the same keys:
+
+    table        HR (holding registers, the default) or IR (input registers)
+    address      Modbus address of the first register, decimal or 0x hex
+    name         C identifier of the field
+    type         u16, i16, u32, i32, f32, u64, i64, f64 or bits
+    bit, width   first bit and number of bits of a bits field, width 1 by default
+    order        ABCD (the default), CDAB, BADC or DCBA: mb_wordorder_t of a 32 or 64 bit field
+    access       rw (the default), ro or locked, holding registers only
+    default      initial value
+    min, max     values the master may write, 16 bit fields only
+    enum         values the master may write, separated by |, replaces min and max
+    description  comment of the field
+
+Empty cells take the defaults. The generator refuses fields sharing register bits, bits of
+one register with different access and a map of more than 255 segments, as the library does.
+"""
+
+import argparse
+import csv
+import json
+import os
+import re
+import struct
+import sys
+
+TYPES = {
+    # type: (words, C type, struct format of the big endian value)
+    'u16': (1, 'uint16_t', '>H'),
+    'i16': (1, 'int16_t', '>h'),
+    'u32': (2, 'uint32_t', '>I'),
+    'i32': (2, 'int32_t', '>i'),
+    'f32': (2, 'float', '>f'),
+    'u64': (4, 'uint64_t', '>Q'),
+    'i64': (4, 'int64_t', '>q'),
+    'f64': (4, 'double', '>d'),
+    'bits': (1, 'uint16_t', None),
+}
+
+ORDERS = {
+    'ABCD': 'MB_WORD_HL', 'HL': 'MB_WORD_HL',
+    'CDAB': 'MB_WORD_LH', 'LH': 'MB_WORD_LH',
+    'BADC': 'MB_WORD_HL_SWAP', 'HL_SWAP': 'MB_WORD_HL_SWAP',
+    'DCBA': 'MB_WORD_LH_SWAP', 'LH_SWAP': 'MB_WORD_LH_SWAP',
+}
+
+TABLES = {'HR': 'DB_HOLDING_REGISTER', 'IR': 'DB_INPUT_REGISTERS'}
+
+DIRECT_MAX = 1024  # largest span of addresses looked up with a direct index table
+
+
+class MapError(Exception):
+    pass
+
+
+def fail(xField, sText):
+    """xField: the row of the description or its Field, None for the whole map"""
+    if isinstance(xField, dict):
+        sName = xField.get('name') or '?'
+    else:
+        sName = xField.sName if xField is not None else 'map'
+    raise MapError('%s: %s' % (sName, sText))
+
+
+def toInt(sVal):
+    return int(str(sVal).strip(), 0)
+
+
+def readSpec(sPath):
+    """List of the fields of a description, as dictionaries of strings"""
+    with open(sPath, newline='') as xFile:
+        if sPath.lower().endswith('.json'):
+            xSpec = json.load(xFile)
+            if isinstance(xSpec, dict):
+                xSpec = xSpec.get('fields', [])
+            return [{k: ('' if v is None else str(v)) for k, v in f.items()} for f in xSpec]
+        xRows = csv.DictReader(row for row in xFile if row.strip() and not row.lstrip().startswith('#'))
+        return [{(k or '').strip().lower(): (v or '').strip() for k, v in row.items()} for row in xRows]
+
+
+class Field:
+    def __init__(self, xRaw):
+        self.sName = xRaw.get('name', '').strip()
+        if not re.match(r'^[A-Za-z_][A-Za-z0-9_]*$', self.sName):
+            fail(xRaw, 'the name must be a C identifier')
+        self.sTable = (xRaw.get('table') or 'HR').strip().upper()
+        if self.sTable not in TABLES:
+            fail(xRaw, 'table is HR or IR')
+        self.sType = (xRaw.get('type') or 'u16').strip().lower()
+        if self.sType not in TYPES:
+            fail(xRaw, 'unknown type %s' % self.sType)
+        self.u16Words, self.sCType, self.sFormat = TYPES[self.sType]
+        self.u32Add = toInt(xRaw.get('address', ''))
+        if self.u32Add < 0 or self.u32Add + self.u16Words > 0x10000:
+            fail(xRaw, 'the field ends beyond address 0xFFFF')
+
+        self.u8Bit = toInt(xRaw.get('bit') or 0)
+        self.u8Width = toInt(xRaw.get('width') or 1)
+        if self.sType == 'bits':
+            if self.u8Width < 1 or self.u8Bit + self.u8Width > 16:
+                fail(xRaw, 'the bits must fit in one register')
+            self.u16Mask = ((1 << self.u8Width) - 1) << self.u8Bit
+        else:
+            self.u8Bit, self.u8Width, self.u16Mask = 0, 16, 0xFFFF
+
+        self.sOrder = ORDERS.get((xRaw.get('order') or 'ABCD').strip().upper())
+        if self.sOrder is None:
+            fail(xRaw, 'order is ABCD, CDAB, BADC or DCBA')
+
+        self.sAccess = (xRaw.get('access') or 'rw').strip().lower()
+        if self.sAccess not in ('rw', 'ro', 'locked'):
+            fail(xRaw, 'access is rw, ro or locked')
+        if self.sTable == 'IR' and self.sAccess == 'locked':
+            fail(xRaw, 'the input registers are never written by the master')
+
+        sDefault = (xRaw.get('default') or '').strip()
+        self.xDefault = (float(sDefault) if self.sType in ('f32', 'f64') else toInt(sDefault)) if sDefault else 0
+
+        self.xEnum = sorted(toInt(v) for v in (xRaw.get('enum') or '').split('|') if v.strip())
+        sMin, sMax = (xRaw.get('min') or '').strip(), (xRaw.get('max') or '').strip()
+        self.xLimit = None
+        if self.xEnum or sMin or sMax:
+            if self.sType not in ('u16', 'i16') or self.sTable != 'HR':
+                fail(xRaw, 'min, max and enum are checked on 16 bit holding registers only')
+            xSigned = self.sType == 'i16'
+            xLow, xHigh = (-0x8000, 0x7FFF) if xSigned else (0, 0xFFFF)
+            self.xLimit = (toInt(sMin) if sMin else xLow, toInt(sMax) if sMax else xHigh, xSigned)
+            if len(self.xEnum) > 255:
+                fail(xRaw, 'an enum holds 255 values at most')
+        self.sDesc = (xRaw.get('description') or '').strip()
+
+    def words(self):
+        """Registers of the default value, in the word and byte order of the field"""
+        if self.sType == 'bits':
+            return [(self.xDefault << self.u8Bit) & self.u16Mask]
+        xBytes = struct.pack(self.sFormat, self.xDefault)
+        xWords = [(xBytes[i] << 8) | xBytes[i + 1] for i in range(0, len(xBytes), 2)]
+        if self.sOrder in ('MB_WORD_LH', 'MB_WORD_LH_SWAP'):
+            xWords.reverse()
+        if self.sOrder in ('MB_WORD_HL_SWAP', 'MB_WORD_LH_SWAP'):
+            xWords = [((w & 0xFF) << 8) | (w >> 8) for w in xWords]
+        return xWords
+
+
+class Table:
+    """Registers of one table: fields, segments and their storage"""
+
+    def __init__(self, sTable, xFields):
+        self.sTable = sTable
+        self.xFields = sorted(xFields, key=lambda f: (f.u32Add, f.u8Bit))
+        self.xSegments = []  # [start, length, offset]
+        self.xOffset = {}    # Modbus address -> index in the storage
+
+        u32End = -1
+        for i, f in enumerate(self.xFields):
+            for g in self.xFields[i + 1:]:
+                if g.u32Add >= f.u32Add + f.u16Words:
+                    break
+                if f.u16Mask & g.u16Mask:
+                    fail(g, 'shares register bits with %s' % f.sName)
+                if f.sAccess != g.sAccess:
+                    fail(g, 'shares a register with %s but not its access' % f.sName)
+            if f.u32Add > u32End:
+                u16Offset = self.xSegments[-1][2] + self.xSegments[-1][1] if self.xSegments else 0
+                self.xSegments.append([f.u32Add, 0, u16Offset])
+            u32End = max(u32End, f.u32Add + f.u16Words)
+            self.xSegments[-1][1] = u32End - self.xSegments[-1][0]
+        if len(self.xSegments) > 255:
+            fail(None, '%s has %d segments, 255 at most' % (sTable, len(self.xSegments)))
+
+        self.u16Size = sum(s[1] for s in self.xSegments)
+        self.u16Regs = [0] * self.u16Size
+        for s in self.xSegments:
+            for a in range(s[1]):
+                self.xOffset[s[0] + a] = s[2] + a
+        for f in self.xFields:
+            for k, w in enumerate(f.words()):
+                self.u16Regs[self.xOffset[f.u32Add + k]] |= w
+
+    def segmentOf(self, f):
+        for i, s in enumerate(self.xSegments):
+            if s[0] <= f.u32Add < s[0] + s[1]:
+                return i
+        return None
+
+    def bitmap(self, iSeg, sAccess):
+        """Words of the u32ReadOnly or u32Locked bitmap of a segment, None when empty"""
+        u16Start, u16Length, _ = self.xSegments[iSeg]
+        xBits = [0] * ((u16Length + 31) // 32)
+        for f in self.xFields:
+            if f.sAccess == sAccess and self.segmentOf(f) == iSeg:
+                for k in range(f.u16Words):
+                    i = f.u32Add + k - u16Start
+                    xBits[i // 32] |= 1 << (i % 32)
+        return xBits if any(xBits) else None
+
+    def limits(self, iSeg):
+        u16Start = self.xSegments[iSeg][0]
+        return [f for f in self.xFields if f.xLimit and self.segmentOf(f) == iSeg and f.u32Add >= u16Start]
+
+
+def lookupCode(xTable, sIndent):
+    """Body computing u8lo, the number of segments of the table starting at or before u16Add"""
+    xStarts = [s[0] for s in xTable.xSegments]
+    u32Base, u32Span = xStarts[0], xTable.xSegments[-1][0] + xTable.xSegments[-1][1] - xStarts[0]
+    xLines = []
+    if u32Span <= DIRECT_MAX:
+        xIndex = [sum(1 for st in xStarts if st <= u32Base + a) for a in range(u32Span)]
+        xLines.append('%sstatic const uint8_t u8Index[ %d ] =' % (sIndent, u32Span))
+        xLines.append('%s{' % sIndent)
+        for i in range(0, u32Span, 16):
+            xLines.append('%s\t%s,' % (sIndent, ', '.join('%d' % v for v in xIndex[i:i + 16])))
+        xLines.append('%s};' % sIndent)
+        xLines.append('')
+        if u32Base > 0:
+            xLines.append('%sif (u16Add < %du) return 0;' % (sIndent, u32Base))
+        xLines.append('%sif (u16Add >= %du) return %d;' % (sIndent, u32Base + u32Span, len(xStarts)))
+        xLines.append('%sreturn u8Index[ u16Add%s ];' % (sIndent, ' - %du' % u32Base if u32Base else ''))
+        return xLines
+
+    # balanced comparisons against the segment starts
+    def tree(iLo, iHi, sTab):
+        if iLo == iHi:
+            return ['%sreturn %d;' % (sTab, iLo)]
+        iMid = (iLo + iHi + 1) // 2
+        if xStarts[iMid - 1] == 0:
+            return tree(iMid, iHi, sTab)  # no address is below 0
+        return (['%sif (u16Add < %du)' % (sTab, xStarts[iMid - 1]), '%s{' % sTab] + tree(iLo, iMid - 1, sTab + '\t') +
+                ['%s}' % sTab] + tree(iMid, iHi, sTab))
+    return tree(0, len(xStarts), sIndent)
+
+
+def accessors(sName, xTable, sTableId):
+    sStore = '%s_u16regs%s' % (sName, xTable.sTable)
+    xLines = []
+    for f in xTable.xFields:
+        i = xTable.xOffset[f.u32Add]
+        sFn = '%s_%s' % (sName, f.sName)
+        if f.sDesc:
+            xLines.append('/* %s */' % f.sDesc)
+        if f.u16Words == 1 and f.sType != 'bits':
+            xLines.append('static inline %s %s_get(void) { return (%s)%s[ %d ]; }' % (f.sCType, sFn, f.sCType, sStore, i))
+            xLines.append('static inline void %s_set(%s xVal) { %s[ %d ] = (uint16_t)xVal; ModbusMapChanged(%s); }' %
+                          (sFn, f.sCType, sStore, i, sTableId))
+        elif f.sType == 'bits':
+            xLines.append('static inline uint16_t %s_get(void) { return (uint16_t)((%s[ %d ] & 0x%04Xu) >> %d); }' %
+                          (sFn, sStore, i, f.u16Mask, f.u8Bit))
+            xLines += [
+                'static inline void %s_set(uint16_t xVal)' % sFn,
+                '{',
+                '\tModbusMapLock(%s);' % sTableId,
+                '\t%s[ %d ] = (uint16_t)((%s[ %d ] & ~0x%04Xu) | ((xVal << %d) & 0x%04Xu));' %
+                (sStore, i, sStore, i, f.u16Mask, f.u8Bit, f.u16Mask),
+                '\tModbusMapUnlock(%s);' % sTableId,
+                '}',
+            ]
+        else:
+            u8Bits = 16 * f.u16Words
+            xLines += [
+                'static inline %s %s_get(void)' % (f.sCType, sFn),
+                '{',
+                '\tuint%d_t u%dVal;' % (u8Bits, u8Bits),
+                '\t%s xVal;' % f.sCType,
+                '',
+                '\tModbusMapLock(%s);' % sTableId,
+                '\tu%dVal = ModbusRegsToU%d(&%s[ %d ], %s);' % (u8Bits, u8Bits, sStore, i, f.sOrder),
+                '\tModbusMapUnlock(%s);' % sTableId,
+                '\tmemcpy(&xVal, &u%dVal, sizeof(xVal));' % u8Bits,
+                '\treturn xVal;',
+                '}',
+                'static inline void %s_set(%s xVal)' % (sFn, f.sCType),
+                '{',
+                '\tuint%d_t u%dVal;' % (u8Bits, u8Bits),
+                '',
+                '\tmemcpy(&u%dVal, &xVal, sizeof(u%dVal));' % (u8Bits, u8Bits),
+                '\tModbusMapLock(%s);' % sTableId,
+                '\tModbusU%dToRegs(&%s[ %d ], u%dVal, %s);' % (u8Bits, sStore, i, u8Bits, f.sOrder),
+                '\tModbusMapUnlock(%s);' % sTableId,
+                '}',
+            ]
+        xLines.append('')
+    return xLines
+
+
+def header(sName, xTables, sSource, xLookup):
+    sGuard = 'MODBUS_MAP_%s_H_' % sName.upper()
+    xLines = [
+        '/*',
+        ' * %s_map.h' % sName,
+        ' *',
+        ' *  Register map %s, generated by ModbusMapGen.py from %s, do not edit.' % (sName, os.path.basename(sSource)),
+        ' *  %s_Attach() serves it, before ModbusStart(); the accessors lock the table as ModbusGetU32() does.' % sName,
+        ' */',
+        '',
+        '#ifndef %s' % sGuard,
+        '#define %s' % sGuard,
+        '',
+        '#include "Modbus.h"',
+        '#include <string.h>',
+        '',
+        'extern modbusHandler_t *%s_modH;' % sName,
+        '',
+        '#define ModbusMapLock(u8table)     do { if (%s_modH != NULL) ModbusLock(%s_modH, (u8table)); } while (0)' % (sName, sName),
+        '#define ModbusMapUnlock(u8table)   do { if (%s_modH != NULL) { ModbusTableChanged(%s_modH, (u8table)); ModbusUnlock(%s_modH, (u8table)); } } while (0)' % (sName, sName, sName),
+        '#define ModbusMapChanged(u8table)  do { if (%s_modH != NULL) ModbusTableChanged(%s_modH, (u8table)); } while (0)' % (sName, sName),
+        '',
+    ]
+    for xTable in xTables:
+        sUp = '%s_%s' % (sName.upper(), xTable.sTable)
+        xDefines = [('SIZE', '%d' % xTable.u16Size, 'registers'), ('SEGMENTS', '%d' % len(xTable.xSegments), '')]
+        for f in xTable.xFields:
+            sBits = ('bit %d' % f.u8Bit if f.u8Width == 1 else 'bits %d..%d' % (f.u8Bit, f.u8Bit + f.u8Width - 1)) if f.sType == 'bits' else ''
+            xDefines.append((f.sName.upper(), '%d' % f.u32Add, sBits))
+        iWidth = max(len(d[0]) for d in xDefines) + 2
+        for sDef, sVal, sNote in xDefines:
+            xLines.append(('#define %s_%s%s' % (sUp, sDef.ljust(iWidth), sVal) + ('  // %s' % sNote if sNote else '')))
+        xLines.append('')
+        xLines.append('extern uint16_t %s_u16regs%s[ %s_SIZE ];' % (sName, xTable.sTable, sUp))
+        xLines.append('extern const modbusSegment_t %s_xSeg%s[ %s_SEGMENTS ];' % (sName, xTable.sTable, sUp))
+        xLines.append('')
+    xLines.append('void %s_Attach(modbusHandler_t *modH); // serves the map, before ModbusStart()' % sName)
+    if xLookup:
+        xLines += ['', '#if ENABLE_MB_MAP_LOOKUP != 1',
+                   '#warning "%s_map.c defines ModbusMapLookup(), enable ENABLE_MB_MAP_LOOKUP or generate it with --no-lookup"' % sName,
+                   '#endif']
+    xLines.append('')
+    for xTable in xTables:
+        xLines += accessors(sName, xTable, TABLES[xTable.sTable])
+    xLines += ['#undef ModbusMapLock', '#undef ModbusMapUnlock', '#undef ModbusMapChanged', '',
+               '#endif /* %s */' % sGuard, '']
+    return '\n'.join(xLines)
+
+
+def source(sName, xTables, sSource, xLookup):
+    xLines = [
+        '/*',
+        ' * %s_map.c' % sName,
+        ' *',
+        ' *  Register map %s, generated by ModbusMapGen.py from %s, do not edit.' % (sName, os.path.basename(sSource)),
+        ' */',
+        '',
+        '#include "%s_map.h"' % sName,
+        '',
+        'modbusHandler_t *%s_modH;' % sName,
+        '',
+    ]
+    for xTable in xTables:
+        sT = xTable.sTable
+        sUp = '%s_%s' % (sName.upper(), sT)
+        xLines.append('uint16_t %s_u16regs%s[ %s_SIZE ] =' % (sName, sT, sUp))
+        xLines.append('{')
+        for i in range(0, xTable.u16Size, 8):
+            xLines.append('\t%s,' % ', '.join('0x%04X' % w for w in xTable.u16Regs[i:i + 8]))
+        xLines += ['};', '']
+
+        xAccess = []
+        for iSeg in range(len(xTable.xSegments)):
+            xRo = xTable.bitmap(iSeg, 'ro') if sT == 'HR' else None
+            xLk = xTable.bitmap(iSeg, 'locked') if sT == 'HR' else None
+            xLim = xTable.limits(iSeg)
+            xAccess.append((xRo, xLk, xLim))
+        if any(a[0] or a[1] for a in xAccess):
+            xLines.append('#if ENABLE_MB_ACCESS == 1')
+            for iSeg, (xRo, xLk, _) in enumerate(xAccess):
+                for sKind, xBits in (('ReadOnly', xRo), ('Locked', xLk)):
+                    if xBits:
+                        xLines.append('static const uint32_t u32%s%s%d[] = { %s };' %
+                                      (sKind, sT, iSeg, ', '.join('0x%08Xu' % b for b in xBits)))
+            xLines += ['#endif', '']
+        if any(a[2] for a in xAccess):
+            xLines.append('#if ENABLE_MB_LIMITS == 1')
+            for iSeg, (_, _, xLim) in enumerate(xAccess):
+                for f in xLim:
+                    if f.xEnum:
+                        xLines.append('static const uint16_t u16Enum_%s[] = { %s };' %
+                                      (f.sName, ', '.join('%d' % (v & 0xFFFF) for v in f.xEnum)))
+                if xLim:
+                    xLines.append('static const modbusLimit_t xLimits%s%d[] =' % (sT, iSeg))
+                    xLines.append('{')
+                    for f in xLim:
+                        sEnum = ('%d, u16Enum_%s' % (len(f.xEnum), f.sName)) if f.xEnum else '0, NULL'
+                        xLines.append('\t{ %d, 1, (uint16_t)%d, (uint16_t)%d, %s, %s }, // %s' %
+                                      (f.u32Add - xTable.xSegments[iSeg][0], f.xLimit[0], f.xLimit[1],
+                                       'true' if f.xLimit[2] else 'false', sEnum, f.sName))
+                    xLines.append('};')
+            xLines += ['#endif', '']
+
+        xLines.append('const modbusSegment_t %s_xSeg%s[ %s_SEGMENTS ] =' % (sName, sT, sUp))
+        xLines.append('{')
+        for iSeg, (u16Start, u16Length, u16Offset) in enumerate(xTable.xSegments):
+            xRo, xLk, xLim = xAccess[iSeg]
+            xLines.append('\t{')
+            xLines.append('\t\t.u16Start = %d, .u16Length = %d, .u16regs = &%s_u16regs%s[ %d ],' %
+                          (u16Start, u16Length, sName, sT, u16Offset))
+            if xRo or xLk:
+                xLines.append('#if ENABLE_MB_ACCESS == 1')
+                xLines.append('\t\t.u32ReadOnly = %s, .u32Locked = %s,' %
+                              ('u32ReadOnly%s%d' % (sT, iSeg) if xRo else 'NULL', 'u32Locked%s%d' % (sT, iSeg) if xLk else 'NULL'))
+                xLines.append('#endif')
+            if xLim:
+                xLines.append('#if ENABLE_MB_LIMITS == 1')
+                xLines.append('\t\t.xLimits = xLimits%s%d, .u8Limits = %d,' % (sT, iSeg, len(xLim)))
+                xLines.append('#endif')
+            xLines.append('\t},')
+        xLines += ['};', '']
+
+    xLines += ['/**', ' * @brief', ' * Serves the tables of the map %s on a slave, call it before ModbusStart()' % sName, ' */',
+               'void %s_Attach(modbusHandler_t *modH)' % sName, '{', '\t%s_modH = modH;' % sName]
+    for xTable in xTables:
+        sT = xTable.sTable
+        sHandler = 'RO' if sT == 'IR' else 'HR'
+        xLines.append('\tmodH->xSeg%s = %s_xSeg%s;' % (sHandler, sName, sT))
+        xLines.append('\tmodH->u8Seg%s_count = %s_%s_SEGMENTS;' % (sHandler, sName.upper(), sT))
+    xLines += ['}', '']
+
+    if xLookup:
+        xLines += [
+            '#if ENABLE_MB_MAP_LOOKUP == 1',
+            '/**',
+            ' * @brief',
+            ' * Segments of the table xSeg starting at or before u16Add, what the binary search of',
+            ' * findSegment() finds, computed for the exact map',
+            ' *',
+            ' * @return 0xFF when xSeg is not a table of the map',
+            ' */',
+            'uint8_t ModbusMapLookup(const modbusSegment_t *xSeg, uint16_t u16Add)',
+            '{',
+        ]
+        for xTable in xTables:
+            xLines.append('\tif (xSeg == %s_xSeg%s)' % (sName, xTable.sTable))
+            xLines.append('\t{')
+            xLines += lookupCode(xTable, '\t\t')
+            xLines.append('\t}')
+        xLines += ['\treturn 0xFF;', '}', '#endif', '']
+    return '\n'.join(xLines)
+
+
+def main():
+    xArgs = argparse.ArgumentParser(description='Generates the register map of a Modbus slave')
+    xArgs.add_argument('spec', help='CSV or JSON description of the map')
+    xArgs.add_argument('--name', required=True, help='C prefix of the map')
+    xArgs.add_argument('--out', default='.', help='directory of the output, its Inc and Src when it has them')
+    xArgs.add_argument('--no-lookup', action='store_true', help='do not define ModbusMapLookup(), another map does')
+    xOpt = xArgs.parse_args()
+
+    if not re.match(r'^[A-Za-z_][A-Za-z0-9_]*$', xOpt.name):
+        sys.exit('--name must be a C identifier')
+    try:
+        xFields = [Field(f) for f in readSpec(xOpt.spec)]
+        xNames = [f.sName for f in xFields]
+        for s in set(xNames):
+            if xNames.count(s) > 1:
+                fail(None, 'the name %s is used twice' % s)
+        xTables = [Table(t, [f for f in xFields if f.sTable == t]) for t in TABLES if any(f.sTable == t for f in xFields)]
+        if not xTables:
+            fail(None, 'the description has no field')
+    except (MapError, ValueError, KeyError, struct.error) as e:
+        sys.exit('%s: %s' % (xOpt.spec, e))
+
+    sInc = os.path.join(xOpt.out, 'Inc') if os.path.isdir(os.path.join(xOpt.out, 'Inc')) else xOpt.out
+    sSrc = os.path.join(xOpt.out, 'Src') if os.path.isdir(os.path.join(xOpt.out, 'Src')) else xOpt.out
+    with open(os.path.join(sInc, '%s_map.h' % xOpt.name), 'w') as xFile:
+        xFile.write(header(xOpt.name, xTables, xOpt.spec, not xOpt.no_lookup))
+    with open(os.path.join(sSrc, '%s_map.c' % xOpt.name), 'w') as xFile:
+        xFile.write(source(xOpt.name, xTables, xOpt.spec, not xOpt.no_lookup))
+
+
+if __name__ == '__main__':
+    main()
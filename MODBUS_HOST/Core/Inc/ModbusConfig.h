@@ -0,0 +1,29 @@
+/*
+ * ModbusConfig.h
+ *
+ *  Configuration of the Modbus library for the host build: the library runs on a PC over the
+ *  POSIX port of FreeRTOS, with the fake UARTs of ModbusPortHost.c in place of the USARTs.
+ */
+
+#ifndef THIRD_PARTY_MODBUS_LIB_CONFIG_MODBUSCONFIG_H_
+#define THIRD_PARTY_MODBUS_LIB_CONFIG_MODBUSCONFIG_H_
+
+#define MB_PORT_HOST 1          // ModbusPortHost.h in place of main.h
+#define ENABLE_MB_NATIVE_RTOS 1 // the FreeRTOS API, cmsis_os2.c is not built on the host
+
+#define T35  5              // Initial timer T35 period (in ticks), ModbusStart() recomputes it from the baud rate.
+#define MAX_BUFFER  256	    // Maximum size for the communication buffer in bytes, 256 holds any RTU frame.
+#define TIMEOUT_MODBUS 1000 // Timeout for master query (in ticks)
+#define MAX_M_HANDLERS 4    //Maximum number of modbus handlers that can work concurrently
+#define MAX_TELEGRAMS 2     //Max number of Telegrams in master queue
+#define MB_TASK_STACK  (64 * 1024) //Stack size of the Modbus tasks in bytes, the thread of a task runs on it
+#define MB_HOST_LINE_STACK  (64 * 1024) //Stack size of the line task of the fake UARTs in bytes
+#ifndef CRC_MODE
+#define CRC_MODE  CRC_TABLE // CRC16 backend: CRC_BITWISE, CRC_TABLE or CRC_NIBBLE, CRC_HARDWARE needs the CRC unit of an STM32
+#endif
+
+#define ENABLE_MB_BENCH 1 // ModbusBenchmark() of host_bench, in ns as the DWT of the host counts them
+#define ENABLE_MB_FUZZ 1  // ModbusFuzzFrame() of host_fuzz, its cost in ns of the same DWT
+#define ENABLE_MB_REPLAY 1 // ModbusReplay() of host_replay
+
+#endif /* THIRD_PARTY_MODBUS_LIB_CONFIG_MODBUSCONFIG_H_ */
@@ -0,0 +1,19 @@
+/*
+ * app_freertos.c
+ *
+ *  FreeRTOS hooks of the host programs
+ */
+
+#include "FreeRTOS.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief
+ * configASSERT() of the host build: the process stops on the failed line, the run fails
+ */
+void vAssertCalled(const char *pcFile, unsigned long ulLine)
+{
+	fprintf(stderr, "%s:%lu: FreeRTOS assert\n", pcFile, ulLine);
+	abort();
+}
@@ -0,0 +1,119 @@
+/*
+ * host_bench.c
+ *
+ *  Benchmark of the protocol kernels on the host: ModbusBenchmark() on a slave with the largest
+ *  tables a frame reaches. The DWT of the host port counts nanoseconds, so the cycles of the
+ *  report are the nanoseconds of one frame. The build makes one program per CRC_MODE, as a
+ *  target is rebuilt to compare the backends. The process fails when a kernel reads 0.
+ */
+
+#include "Modbus.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_REGS   125 // registers of the largest FC3 answer
+#define BENCH_COILS  125 // words of the 2000 coils of the largest FC1 answer
+
+static UART_HandleTypeDef xBenchPort;
+static modbusHandler_t ModbusBench;
+static uint16_t u16BenchRegs[BENCH_REGS];
+static uint16_t u16BenchCoils[BENCH_COILS];
+
+static void StartBenchTask(void *argument);
+static uint32_t clockOverhead(void);
+static const char *crcModeName(void);
+
+int main(void)
+{
+	xBenchPort.Init.BaudRate = 115200;
+	xBenchPort.Init.WordLength = UART_WORDLENGTH_8B;
+	xBenchPort.Init.StopBits = UART_STOPBITS_1;
+	xBenchPort.Init.Parity = UART_PARITY_NONE;
+	if (HAL_UART_Init(&xBenchPort) != HAL_OK)
+	{
+		printf("fake UART refused\n");
+		return 1;
+	}
+
+	for (uint16_t i = 0; i < BENCH_REGS; i++) u16BenchRegs[i] = i * 0x0101;
+	for (uint16_t i = 0; i < BENCH_COILS; i++) u16BenchCoils[i] = 0xA5C3;
+
+	ModbusBench.uModbusType = MB_SLAVE;
+	ModbusBench.port = &xBenchPort;
+	ModbusBench.u8id = 1;
+	ModbusBench.u16timeOut = 1000;
+	ModbusBench.EN_Port = NULL;
+	ModbusBench.u16regsHR = u16BenchRegs;
+	ModbusBench.u16regHR_size = BENCH_REGS;
+	ModbusBench.u16regsCoils = u16BenchCoils;
+	ModbusBench.u16regCoils_size = BENCH_COILS;
+	ModbusBench.xTypeHW = USART_HW;
+	ModbusInit(&ModbusBench); // not started, the benchmark owns u8Buffer
+
+	xTaskCreate(StartBenchTask, "Bench", configMINIMAL_STACK_SIZE * 4, NULL, tskIDLE_PRIORITY + 1, NULL);
+	vTaskStartScheduler();
+	return 1; // the scheduler never returns
+}
+
+/**
+ * @brief
+ * Runs the benchmark from a task and prints it in ns, per frame and per byte or register
+ */
+static void StartBenchTask(void *argument)
+{
+	modbusBench_t xBench;
+	int iZero = 0;
+	(void)argument;
+
+	ModbusBenchmark(&ModbusBench, &xBench);
+
+	printf("host bench, %s, ns per frame (fastest of %d runs, %lu ns of clock reads included)\n",
+			crcModeName(), MB_BENCH_RUNS, (unsigned long)clockOverhead());
+	for (uint8_t s = 0; s < MB_BENCH_SIZES; s++)
+	{
+		printf("  calcCRC      %4u bytes  %7lu ns  %6.2f ns/byte   calcCRCByte %7lu ns  %6.2f ns/byte\n",
+				xBench.u16CrcBytes[s], (unsigned long)xBench.u32Crc[s], (double)xBench.u32Crc[s] / xBench.u16CrcBytes[s],
+				(unsigned long)xBench.u32CrcByte[s], (double)xBench.u32CrcByte[s] / xBench.u16CrcBytes[s]);
+		iZero += xBench.u32Crc[s] == 0 || xBench.u32CrcByte[s] == 0;
+	}
+	for (uint8_t s = 0; s < MB_BENCH_SIZES; s++)
+	{
+		printf("  FC3 answer   %4u regs   %7lu ns  %6.2f ns/reg\n",
+				xBench.u16Regs[s], (unsigned long)xBench.u32FC3[s], (double)xBench.u32FC3[s] / xBench.u16Regs[s]);
+		iZero += xBench.u32FC3[s] == 0;
+	}
+	for (uint8_t s = 0; s < MB_BENCH_SIZES; s++)
+	{
+		printf("  FC1 answer   %4u coils  %7lu ns  %6.2f ns/coil\n",
+				xBench.u16Coils[s], (unsigned long)xBench.u32FC1[s], (double)xBench.u32FC1[s] / xBench.u16Coils[s]);
+		iZero += xBench.u32FC1[s] == 0;
+	}
+	printf("  validateRequest of a 16 registers FC3 request %lu ns\n", (unsigned long)xBench.u32Validate);
+	iZero += xBench.u32Validate == 0;
+
+	exit(iZero != 0);
+}
+
+/* the fastest of two reads of the clock back to back, included in every measure */
+static uint32_t clockOverhead(void)
+{
+	uint32_t u32Best = UINT32_MAX;
+
+	for (uint8_t i = 0; i < MB_BENCH_RUNS; i++)
+	{
+		uint32_t u32Start = DWT->CYCCNT;
+		uint32_t u32Cycles = DWT->CYCCNT - u32Start;
+		if (u32Cycles < u32Best) u32Best = u32Cycles;
+	}
+	return u32Best;
+}
+
+static const char *crcModeName(void)
+{
+	switch (CRC_MODE)
+	{
+	case CRC_TABLE:  return "CRC_TABLE";
+	case CRC_NIBBLE: return "CRC_NIBBLE";
+	default:         return "CRC_BITWISE";
+	}
+}
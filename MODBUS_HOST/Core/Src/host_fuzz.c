@@ -0,0 +1,130 @@
+/*
+ * host_fuzz.c
+ *
+ *  Fuzzing harness of the slave path on the host: every input is one frame as the slave loop
+ *  receives it, CRC included, served by ModbusFuzzFrame() on a slave with all four tables. An
+ *  answer longer than MAX_BUFFER or a frame costing more than FUZZ_COST_BOUND ns of
+ *  MB_COST_CLOCK() aborts, so the fuzzer keeps it with the crashes.
+ *
+ *  With clang and -DMODBUS_HOST_FUZZ=ON, host_fuzz is a libFuzzer target:
+ *    host_fuzz -max_len=256 Corpus/fuzz
+ *  host_fuzz_run is the same harness with a main() of its own, for AFL (afl-clang-fast,
+ *  "afl-fuzz -i Corpus/fuzz -o out -- host_fuzz_run @@") and for ctest, which replays the seed
+ *  corpus. It reads each file given, or stdin, and prints the result and cost of each frame.
+ *
+ *  The scheduler is not started: ModbusInit() creates the task of the slave, which never runs,
+ *  and the harness serves the frames from the thread of the fuzzer.
+ */
+
+#include "Modbus.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef FUZZ_COST_BOUND
+#define FUZZ_COST_BOUND  1000000UL // ns of one frame, a slower one is an error of the harness
+#endif
+
+#define FUZZ_REGS   64
+#define FUZZ_COILS  8 // words of coils and of discrete inputs
+
+static UART_HandleTypeDef xFuzzPort;
+static modbusHandler_t ModbusFuzz;
+static uint16_t u16FuzzRegs[FUZZ_REGS];
+static uint16_t u16FuzzInputs[FUZZ_REGS];
+static uint16_t u16FuzzCoils[FUZZ_COILS];
+static uint16_t u16FuzzDiscrete[FUZZ_COILS];
+static int16_t i16FuzzResult; // result and cost of the last frame
+static uint32_t u32FuzzCost;
+
+int LLVMFuzzerTestOneInput(const uint8_t *u8Data, size_t xSize);
+
+/**
+ * @brief
+ * Sets up the slave once, on the first input
+ */
+static void initFuzz(void)
+{
+	static bool xReady;
+
+	if (xReady) return;
+	xReady = true;
+
+	xFuzzPort.Init.BaudRate = 115200;
+	xFuzzPort.Init.WordLength = UART_WORDLENGTH_8B;
+	xFuzzPort.Init.StopBits = UART_STOPBITS_1;
+	xFuzzPort.Init.Parity = UART_PARITY_NONE;
+	if (HAL_UART_Init(&xFuzzPort) != HAL_OK) abort();
+
+	ModbusFuzz.uModbusType = MB_SLAVE;
+	ModbusFuzz.port = &xFuzzPort;
+	ModbusFuzz.u8id = 1;
+	ModbusFuzz.u16timeOut = 1000;
+	ModbusFuzz.EN_Port = NULL;
+	ModbusFuzz.u16regsHR = u16FuzzRegs;
+	ModbusFuzz.u16regHR_size = FUZZ_REGS;
+	ModbusFuzz.u16regsRO = u16FuzzInputs;
+	ModbusFuzz.u16regRO_size = FUZZ_REGS;
+	ModbusFuzz.u16regsCoils = u16FuzzCoils;
+	ModbusFuzz.u16regCoils_size = FUZZ_COILS;
+	ModbusFuzz.u16regsCoilsRO = u16FuzzDiscrete;
+	ModbusFuzz.u16regCoilsRO_size = FUZZ_COILS;
+	ModbusFuzz.xTypeHW = USART_HW;
+	ModbusInit(&ModbusFuzz); // not started, the harness owns u8Buffer
+}
+
+/**
+ * @brief
+ * Serves one input, the entry point of libFuzzer
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *u8Data, size_t xSize)
+{
+	initFuzz();
+	if (xSize > UINT16_MAX) return 0;
+
+	i16FuzzResult = ModbusFuzzFrame(&ModbusFuzz, u8Data, (uint16_t)xSize, &u32FuzzCost);
+	if (ModbusFuzz.u16BufferSize > MAX_BUFFER) abort();
+	if (i16FuzzResult == 0 && ModbusFuzz.u8Buffer[ ID ] != 0 && ModbusFuzz.u16BufferSize == 0) abort(); // an answer was lost
+	if (u32FuzzCost > FUZZ_COST_BOUND)
+	{
+		fprintf(stderr, "slow frame: %lu ns\n", (unsigned long)u32FuzzCost);
+		abort();
+	}
+	return 0;
+}
+
+#ifdef FUZZ_MAIN
+/**
+ * @brief
+ * Serves the file, at most MAX_BUFFER + 1 bytes as a longer frame is refused the same way
+ */
+static void runFile(const char *pcName, FILE *pxFile)
+{
+	uint8_t u8Frame[ MAX_BUFFER + 1 ];
+	size_t xSize = fread(u8Frame, 1, sizeof(u8Frame), pxFile);
+
+	LLVMFuzzerTestOneInput(u8Frame, xSize);
+	printf("%s: %u bytes, result %d, %lu ns\n", pcName, (unsigned)xSize, i16FuzzResult, (unsigned long)u32FuzzCost);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		runFile("stdin", stdin);
+		return 0;
+	}
+	for (int i = 1; i < argc; i++)
+	{
+		FILE *pxFile = fopen(argv[i], "rb");
+
+		if (pxFile == NULL)
+		{
+			printf("%s: cannot open\n", argv[i]);
+			return 1;
+		}
+		runFile(argv[i], pxFile);
+		fclose(pxFile);
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,136 @@
+/*
+ * host_replay.c
+ *
+ *  Replay of a bus capture on the host: the file is served by ModbusReplay() on a slave with all
+ *  four tables, and the report printed with the cost of the frames in ns of MB_COST_CLOCK().
+ *
+ *    host_replay [-t] capture
+ *
+ *  A capture is a list of records, the gap since the previous frame in microseconds (4 bytes),
+ *  the length of the frame (2 bytes), both little endian, then the frame, CRC included. With -t
+ *  the gaps of the capture are kept to the tick, otherwise the frames run back to back. The
+ *  process fails when the capture cannot be read or ends in the middle of a record.
+ */
+
+#include "Modbus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REPLAY_REGS   64
+#define REPLAY_COILS  8 // words of coils and of discrete inputs
+
+static UART_HandleTypeDef xReplayPort;
+static modbusHandler_t ModbusReplaySlave;
+static uint16_t u16ReplayRegs[REPLAY_REGS];
+static uint16_t u16ReplayInputs[REPLAY_REGS];
+static uint16_t u16ReplayCoils[REPLAY_COILS];
+static uint16_t u16ReplayDiscrete[REPLAY_COILS];
+
+static uint8_t *u8Capture;
+static uint32_t u32CaptureSize;
+static bool xTimed;
+
+static void StartReplayTask(void *argument);
+static bool readCapture(const char *pcName);
+
+int main(int argc, char **argv)
+{
+	int iArg = 1;
+
+	if (argc > 1 && strcmp(argv[1], "-t") == 0)
+	{
+		xTimed = true;
+		iArg++;
+	}
+	if (iArg != argc - 1)
+	{
+		printf("usage: host_replay [-t] capture\n");
+		return 1;
+	}
+	if (!readCapture(argv[iArg])) return 1;
+
+	xReplayPort.Init.BaudRate = 115200;
+	xReplayPort.Init.WordLength = UART_WORDLENGTH_8B;
+	xReplayPort.Init.StopBits = UART_STOPBITS_1;
+	xReplayPort.Init.Parity = UART_PARITY_NONE;
+	if (HAL_UART_Init(&xReplayPort) != HAL_OK)
+	{
+		printf("fake UART refused\n");
+		return 1;
+	}
+
+	ModbusReplaySlave.uModbusType = MB_SLAVE;
+	ModbusReplaySlave.port = &xReplayPort;
+	ModbusReplaySlave.u8id = 1;
+	ModbusReplaySlave.u16timeOut = 1000;
+	ModbusReplaySlave.EN_Port = NULL;
+	ModbusReplaySlave.u16regsHR = u16ReplayRegs;
+	ModbusReplaySlave.u16regHR_size = REPLAY_REGS;
+	ModbusReplaySlave.u16regsRO = u16ReplayInputs;
+	ModbusReplaySlave.u16regRO_size = REPLAY_REGS;
+	ModbusReplaySlave.u16regsCoils = u16ReplayCoils;
+	ModbusReplaySlave.u16regCoils_size = REPLAY_COILS;
+	ModbusReplaySlave.u16regsCoilsRO = u16ReplayDiscrete;
+	ModbusReplaySlave.u16regCoilsRO_size = REPLAY_COILS;
+	ModbusReplaySlave.xTypeHW = USART_HW;
+	ModbusInit(&ModbusReplaySlave); // not started, the replay owns u8Buffer
+
+	xTaskCreate(StartReplayTask, "Replay", configMINIMAL_STACK_SIZE * 4, NULL, tskIDLE_PRIORITY + 1, NULL);
+	vTaskStartScheduler();
+	return 1; // the scheduler never returns
+}
+
+/**
+ * @brief
+ * Replays the capture from a task, as ModbusReplay() waits the gaps with vTaskDelay()
+ */
+static void StartReplayTask(void *argument)
+{
+	modbusReplay_t xReport;
+	bool xComplete;
+	(void)argument;
+
+	xComplete = ModbusReplay(&ModbusReplaySlave, u8Capture, u32CaptureSize, xTimed, &xReport);
+
+	printf("host replay, %s: frames %lu, bytes %lu, answers %lu, exceptions %lu, other unit %lu, dropped %lu\n",
+			xTimed ? "timed" : "back to back", (unsigned long)xReport.u32Frames, (unsigned long)xReport.u32Bytes,
+			(unsigned long)xReport.u32Answers, (unsigned long)xReport.u32Exceptions,
+			(unsigned long)xReport.u32OtherUnit, (unsigned long)xReport.u32Dropped);
+	printf("  %lu ticks, slave path %llu ns, %lu ns per frame, p50 %lu ns, p99 %lu ns, max %lu ns\n",
+			(unsigned long)xReport.u32Ticks, (unsigned long long)xReport.u64Cost,
+			(unsigned long)ModbusHistMean(&xReport.xCost), (unsigned long)ModbusHistPercentile(&xReport.xCost, 50),
+			(unsigned long)ModbusHistPercentile(&xReport.xCost, 99), (unsigned long)xReport.xCost.u32Max);
+	if (!xComplete) printf("  the capture ends in the middle of a record\n");
+
+	exit(xComplete ? 0 : 1);
+}
+
+/**
+ * @brief
+ * Loads the whole capture file in u8Capture
+ */
+static bool readCapture(const char *pcName)
+{
+	FILE *pxFile = fopen(pcName, "rb");
+	long lSize;
+
+	if (pxFile == NULL)
+	{
+		printf("%s: cannot open\n", pcName);
+		return false;
+	}
+	fseek(pxFile, 0, SEEK_END);
+	lSize = ftell(pxFile);
+	fseek(pxFile, 0, SEEK_SET);
+	u8Capture = malloc(lSize > 0 ? (size_t)lSize : 1);
+	if (lSize < 0 || u8Capture == NULL || fread(u8Capture, 1, (size_t)lSize, pxFile) != (size_t)lSize)
+	{
+		printf("%s: cannot read\n", pcName);
+		fclose(pxFile);
+		return false;
+	}
+	fclose(pxFile);
+	u32CaptureSize = (uint32_t)lSize;
+	return true;
+}
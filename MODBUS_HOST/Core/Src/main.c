@@ -0,0 +1,233 @@
+/*
+ * main.c
+ *
+ *  Regression run of the Modbus library on the host. A master and a slave share a fake bus,
+ *  the fake UART of each one sends to the other, and the master reads and writes the tables of
+ *  the slave. A second slave has no peer: the test writes raw request frames on its line and
+ *  reads its answers back. The process exits with the number of failed checks.
+ */
+
+#include "Modbus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HOST_BAUD  115200
+#define HOST_REGS  32
+
+static UART_HandleTypeDef xMasterPort;
+static UART_HandleTypeDef xSlavePort;
+static UART_HandleTypeDef xRawPort;
+
+static modbusHandler_t ModbusMaster;
+static modbusHandler_t ModbusSlave;
+static modbusHandler_t ModbusRaw;
+
+static uint16_t u16SlaveRegs[HOST_REGS];
+static uint16_t u16SlaveInputs[HOST_REGS];
+static uint16_t u16SlaveCoils[2];
+static uint16_t u16MasterRegs[HOST_REGS];
+static uint16_t u16RawRegs[4] = { 0x1234, 0x5678, 0x9ABC, 0xDEF0 };
+
+static int iFailed;
+
+static void StartTestTask(void *argument);
+static void initPort(UART_HandleTypeDef *huart, UART_HandleTypeDef *pxPeer);
+static void initSlave(modbusHandler_t *modH, UART_HandleTypeDef *huart, uint8_t u8id, uint16_t *u16regs, uint16_t u16size);
+static int8_t query(uint8_t u8id, mb_functioncode_t u8fct, uint16_t u16RegAdd, uint16_t u16CoilsNo, uint16_t u16timeOut);
+static uint16_t exchangeRaw(const uint8_t *u8Request, uint8_t u8Size, uint8_t *u8Answer, uint16_t u16max);
+static uint16_t crc16(const uint8_t *u8Data, uint16_t u16Size);
+static void check(int iPassed, const char *pcWhat, int iLine);
+
+#define CHECK(x)  check((x), #x, __LINE__)
+
+int main(void)
+{
+	initPort(&xMasterPort, &xSlavePort);
+	initPort(&xSlavePort, &xMasterPort);
+	initPort(&xRawPort, NULL);
+
+	ModbusMaster.uModbusType = MB_MASTER;
+	ModbusMaster.port = &xMasterPort;
+	ModbusMaster.u8id = 0;
+	ModbusMaster.u16timeOut = 1000;
+	ModbusMaster.EN_Port = NULL;
+	ModbusMaster.u16regsHR = u16MasterRegs;
+	ModbusMaster.u16regHR_size = HOST_REGS;
+	ModbusMaster.xTypeHW = USART_HW;
+	ModbusInit(&ModbusMaster);
+	ModbusStart(&ModbusMaster);
+
+	initSlave(&ModbusSlave, &xSlavePort, 1, u16SlaveRegs, HOST_REGS);
+	ModbusSlave.u16regsRO = u16SlaveInputs;
+	ModbusSlave.u16regRO_size = HOST_REGS;
+	ModbusSlave.u16regsCoils = u16SlaveCoils;
+	ModbusSlave.u16regCoils_size = 2;
+	ModbusInit(&ModbusSlave);
+	ModbusStart(&ModbusSlave);
+
+	initSlave(&ModbusRaw, &xRawPort, 2, u16RawRegs, 4);
+	ModbusInit(&ModbusRaw);
+	ModbusStart(&ModbusRaw);
+
+	xTaskCreate(StartTestTask, "Test", configMINIMAL_STACK_SIZE * 4, NULL, tskIDLE_PRIORITY + 1, NULL);
+	vTaskStartScheduler();
+	return 1; // the scheduler never returns
+}
+
+/**
+ * @brief
+ * Runs the checks from a task, the master notifies it as it would an application task
+ */
+static void StartTestTask(void *argument)
+{
+	uint8_t u8Answer[MAX_BUFFER];
+	uint16_t u16Len;
+	uint8_t i;
+	(void)argument;
+
+	for (i = 0; i < HOST_REGS; i++) u16SlaveRegs[i] = 0x100 + i;
+
+	/* FC3 of 8 registers */
+	CHECK(query(1, MB_FC_READ_REGISTERS, 4, 8, 0) == ERR_OK_QUERY);
+	for (i = 0; i < 8; i++) CHECK(u16MasterRegs[i] == 0x104 + i);
+
+	/* FC16 then FC6 change the tables of the slave */
+	for (i = 0; i < 4; i++) u16MasterRegs[i] = 0xA0 + i;
+	CHECK(query(1, MB_FC_WRITE_MULTIPLE_REGISTERS, 10, 4, 0) == ERR_OK_QUERY);
+	for (i = 0; i < 4; i++) CHECK(u16SlaveRegs[10 + i] == 0xA0 + i);
+	u16MasterRegs[0] = 0x1234;
+	CHECK(query(1, MB_FC_WRITE_REGISTER, 20, 1, 0) == ERR_OK_QUERY);
+	CHECK(u16SlaveRegs[20] == 0x1234);
+
+	/* FC5 sets one coil, FC1 reads it back with its neighbours */
+	u16MasterRegs[0] = 1;
+	CHECK(query(1, MB_FC_WRITE_COIL, 19, 1, 0) == ERR_OK_QUERY);
+	CHECK(u16SlaveCoils[1] == (1 << 3));
+	CHECK(query(1, MB_FC_READ_COILS, 16, 8, 0) == ERR_OK_QUERY);
+	CHECK((u16MasterRegs[0] & 0xFF) == (1 << 3));
+
+	/* FC15 of 10 coils across the byte boundaries of the frame, FC1 reads them back */
+	u16MasterRegs[0] = 0x01CD;
+	CHECK(query(1, MB_FC_WRITE_MULTIPLE_COILS, 19, 10, 0) == ERR_OK_QUERY);
+	CHECK(u16SlaveCoils[0] == 0 && u16SlaveCoils[1] == 0x0E68);
+	u16MasterRegs[0] = 0;
+	CHECK(query(1, MB_FC_READ_COILS, 19, 10, 0) == ERR_OK_QUERY);
+	CHECK((u16MasterRegs[0] & 0x03FF) == 0x01CD);
+
+	/* 1969 coils do not fit the byte count of FC15, the master refuses the query */
+	CHECK(query(1, MB_FC_WRITE_MULTIPLE_COILS, 0, 1969, 0) == ERR_BAD_SIZE);
+
+	/* a range past the table is an exception, an absent slave a timeout */
+	CHECK(query(1, MB_FC_READ_REGISTERS, HOST_REGS - 2, 4, 0) == ERR_EXCEPTION);
+	CHECK(query(9, MB_FC_READ_REGISTERS, 0, 1, 50) == ERR_TIME_OUT);
+	CHECK(query(1, MB_FC_READ_INPUT_REGISTER, 0, HOST_REGS, 0) == ERR_OK_QUERY);
+
+	/* raw frames on the line of the second slave: an FC3 request, then one with a bad CRC */
+	const uint8_t u8Read[] = { 2, MB_FC_READ_REGISTERS, 0, 1, 0, 3 };
+	u16Len = exchangeRaw(u8Read, sizeof(u8Read), u8Answer, sizeof(u8Answer));
+	CHECK(u16Len == 11);
+	CHECK(u16Len == 11 && u8Answer[2] == 6 && u8Answer[3] == 0x56 && u8Answer[4] == 0x78 && u8Answer[7] == 0xDE);
+	CHECK(u16Len == 11 && crc16(u8Answer, 9) == (uint16_t)(u8Answer[9] | (u8Answer[10] << 8)));
+
+	uint8_t u8Bad[] = { 2, MB_FC_READ_REGISTERS, 0, 0, 0, 1, 0, 0 };
+	HostUartWrite(&xRawPort, u8Bad, sizeof(u8Bad));
+	vTaskDelay(50);
+	CHECK(HostUartRead(&xRawPort, u8Answer, sizeof(u8Answer)) == 0);
+	CHECK(ModbusRaw.i8lastError == ERR_BAD_CRC);
+
+	printf("host loopback: %d failed\n", iFailed);
+	exit(iFailed);
+}
+
+static void initPort(UART_HandleTypeDef *huart, UART_HandleTypeDef *pxPeer)
+{
+	huart->pxPeer = pxPeer;
+	huart->Init.BaudRate = HOST_BAUD;
+	huart->Init.WordLength = UART_WORDLENGTH_8B;
+	huart->Init.StopBits = UART_STOPBITS_1;
+	huart->Init.Parity = UART_PARITY_NONE;
+	if (HAL_UART_Init(huart) != HAL_OK)
+	{
+		printf("fake UART refused\n");
+		exit(1);
+	}
+}
+
+static void initSlave(modbusHandler_t *modH, UART_HandleTypeDef *huart, uint8_t u8id, uint16_t *u16regs, uint16_t u16size)
+{
+	modH->uModbusType = MB_SLAVE;
+	modH->port = huart;
+	modH->u8id = u8id;
+	modH->u16timeOut = 1000;
+	modH->EN_Port = NULL;
+	modH->u16regsHR = u16regs;
+	modH->u16regHR_size = u16size;
+	modH->xTypeHW = USART_HW;
+}
+
+/**
+ * @brief
+ * One query of the master, the registers or coils in u16MasterRegs
+ *
+ * @return the notification of the master, ERR_OK_QUERY or the mb_errot_t of the query
+ */
+static int8_t query(uint8_t u8id, mb_functioncode_t u8fct, uint16_t u16RegAdd, uint16_t u16CoilsNo, uint16_t u16timeOut)
+{
+	modbus_t telegram = {0};
+
+	telegram.u8id = u8id;
+	telegram.u8fct = u8fct;
+	telegram.u16RegAdd = u16RegAdd;
+	telegram.u16CoilsNo = u16CoilsNo;
+	telegram.u16reg = u16MasterRegs;
+	telegram.u16timeOut = u16timeOut;
+
+	ModbusQuery(&ModbusMaster, telegram);
+	return (int8_t)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+/**
+ * @brief
+ * Puts a request with its CRC on the line of the second slave and takes the answer it sends
+ *
+ * @return bytes of the answer, 0 without answer
+ */
+static uint16_t exchangeRaw(const uint8_t *u8Request, uint8_t u8Size, uint8_t *u8Answer, uint16_t u16max)
+{
+	uint8_t u8Frame[MAX_BUFFER];
+	uint16_t u16Crc = crc16(u8Request, u8Size);
+	uint16_t u16Len = 0;
+
+	memcpy(u8Frame, u8Request, u8Size);
+	u8Frame[ u8Size ] = u16Crc & 0xFF;
+	u8Frame[ u8Size + 1 ] = u16Crc >> 8;
+	HostUartWrite(&xRawPort, u8Frame, u8Size + 2);
+
+	for (uint8_t i = 0; i < 50 && u16Len == 0; i++)
+	{
+		vTaskDelay(2);
+		u16Len = HostUartRead(&xRawPort, u8Answer, u16max);
+	}
+	return u16Len;
+}
+
+/* CRC of the test, bit by bit, independent of the CRC_MODE of the library */
+static uint16_t crc16(const uint8_t *u8Data, uint16_t u16Size)
+{
+	uint16_t u16Crc = 0xFFFF;
+
+	for (uint16_t i = 0; i < u16Size; i++)
+	{
+		u16Crc ^= u8Data[i];
+		for (uint8_t j = 0; j < 8; j++) u16Crc = (u16Crc & 1) ? (u16Crc >> 1) ^ 0xA001 : u16Crc >> 1;
+	}
+	return u16Crc;
+}
+
+static void check(int iPassed, const char *pcWhat, int iLine)
+{
+	if (iPassed) return;
+	printf("main.c:%d: failed: %s\n", iLine, pcWhat);
+	iFailed++;
+}
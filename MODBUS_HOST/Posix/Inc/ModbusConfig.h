@@ -0,0 +1,27 @@
+/*
+ * ModbusConfig.h
+ *
+ *  Configuration of the Modbus library for the Linux build of MODBUS_HOST: ttys and kernel sockets
+ *  of ModbusPortPosix.c, over the POSIX port of FreeRTOS.
+ */
+
+#ifndef THIRD_PARTY_MODBUS_LIB_CONFIG_MODBUSCONFIG_H_
+#define THIRD_PARTY_MODBUS_LIB_CONFIG_MODBUSCONFIG_H_
+
+#define MB_PORT_HOST 1          // no main.h of the target
+#define MB_PORT_POSIX 1         // ModbusPortPosix.h: ttys, and the netconn API over the sockets of Linux
+#define ENABLE_MB_NATIVE_RTOS 1 // the FreeRTOS API, cmsis_os2.c is not built on the host
+
+#define ENABLE_TCP 1        // Modbus TCP server and client on kernel sockets
+#define ENABLE_UDP 1        // Modbus over UDP on kernel sockets
+
+#define T35  5              // Initial timer T35 period (in ticks), ModbusStart() recomputes it from the baud rate.
+#define MAX_BUFFER  256	    // Maximum size for the communication buffer in bytes, 256 holds any RTU frame.
+#define TIMEOUT_MODBUS 1000 // Timeout for master query (in ticks)
+#define MAX_M_HANDLERS 6    //Maximum number of modbus handlers that can work concurrently
+#define MAX_TELEGRAMS 2     //Max number of Telegrams in master queue
+#define MB_TASK_STACK  (64 * 1024) //Stack size of the Modbus tasks in bytes, the thread of a task runs on it
+#define MB_POSIX_LOOP_STACK  (64 * 1024) //Stack size of the epoll loop tasks in bytes
+#define CRC_MODE  CRC_TABLE // CRC16 backend: CRC_BITWISE, CRC_TABLE or CRC_NIBBLE
+
+#endif /* THIRD_PARTY_MODBUS_LIB_CONFIG_MODBUSCONFIG_H_ */
@@ -0,0 +1,226 @@
+/*
+ * main.c
+ *
+ *  Regression run of the Linux port on the host: a TCP master and a UDP master query their slaves
+ *  over the loopback interface of the kernel, a raw client pipelines two requests on one TCP
+ *  connection, and an RTU slave answers on the slave side of a pseudo terminal at 2 Mbaud. The
+ *  process exits with the number of failed checks.
+ */
+
+#define _GNU_SOURCE
+#include "Modbus.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define POSIX_TCP_PORT  15020
+#define POSIX_UDP_PORT  15021
+#define POSIX_REGS      32
+
+static modbusHandler_t ModbusTcpSlave;
+static modbusHandler_t ModbusTcpMaster;
+static modbusHandler_t ModbusUdpSlave;
+static modbusHandler_t ModbusUdpMaster;
+static modbusHandler_t ModbusRtuSlave;
+static UART_HandleTypeDef xRtuPort;
+static int iPtyMaster = -1;
+
+static uint16_t u16SlaveRegs[POSIX_REGS];
+static uint16_t u16MasterRegs[POSIX_REGS];
+
+static int iFailed;
+
+static void StartTestTask(void *argument);
+static void initSlave(modbusHandler_t *modH, mb_hardware_t xType, uint8_t u8id);
+static void initMaster(modbusHandler_t *modH, mb_hardware_t xType, uint16_t u16Port);
+static int8_t query(modbusHandler_t *modH, mb_functioncode_t u8fct, uint16_t u16RegAdd, uint16_t u16CoilsNo);
+static uint16_t recvAll(int iFd, uint8_t *u8Rx, uint16_t u16Size);
+static uint16_t crc16(const uint8_t *u8Data, uint16_t u16Size);
+static void check(int iPassed, const char *pcWhat, int iLine);
+
+#define CHECK(x)  check((x), #x, __LINE__)
+
+int main(void)
+{
+	for (uint8_t i = 0; i < POSIX_REGS; i++) u16SlaveRegs[i] = 0x200 + i;
+
+	initSlave(&ModbusTcpSlave, TCP_HW, 1);
+	ModbusTcpSlave.u16TcpPort = POSIX_TCP_PORT;
+	ModbusInit(&ModbusTcpSlave);
+	ModbusStart(&ModbusTcpSlave);
+
+	initSlave(&ModbusUdpSlave, UDP_HW, 1);
+	ModbusUdpSlave.u16TcpPort = POSIX_UDP_PORT;
+	ModbusInit(&ModbusUdpSlave);
+	ModbusStart(&ModbusUdpSlave);
+
+	initMaster(&ModbusTcpMaster, TCP_HW, POSIX_TCP_PORT);
+	initMaster(&ModbusUdpMaster, UDP_HW, POSIX_UDP_PORT);
+
+	/* the RTU slave owns the slave side of a pseudo terminal, the test the master side */
+	iPtyMaster = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (iPtyMaster < 0 || grantpt(iPtyMaster) != 0 || unlockpt(iPtyMaster) != 0)
+	{
+		printf("no pseudo terminal\n");
+		return 1;
+	}
+	xRtuPort.pcDevice = ptsname(iPtyMaster);
+	xRtuPort.Init.BaudRate = 2000000;
+	xRtuPort.Init.WordLength = UART_WORDLENGTH_8B;
+	xRtuPort.Init.StopBits = UART_STOPBITS_1;
+	xRtuPort.Init.Parity = UART_PARITY_NONE;
+	if (HAL_UART_Init(&xRtuPort) != HAL_OK)
+	{
+		printf("%s refused at 2 Mbaud\n", xRtuPort.pcDevice);
+		return 1;
+	}
+	initSlave(&ModbusRtuSlave, USART_HW, 3);
+	ModbusRtuSlave.port = &xRtuPort;
+	ModbusInit(&ModbusRtuSlave);
+	ModbusStart(&ModbusRtuSlave);
+
+	xTaskCreate(StartTestTask, "Test", configMINIMAL_STACK_SIZE * 4, NULL, tskIDLE_PRIORITY + 1, NULL);
+	vTaskStartScheduler();
+	return 1; // the scheduler never returns
+}
+
+/**
+ * @brief
+ * Runs the checks from a task, the masters notify it as they would an application task
+ */
+static void StartTestTask(void *argument)
+{
+	uint8_t u8Rx[64];
+	uint16_t u16Len;
+	(void)argument;
+
+	/* TCP master: FC3, then FC16 changes the table of the slave */
+	CHECK(query(&ModbusTcpMaster, MB_FC_READ_REGISTERS, 2, 6) == ERR_OK_QUERY);
+	for (uint8_t i = 0; i < 6; i++) CHECK(u16MasterRegs[i] == 0x202 + i);
+	for (uint8_t i = 0; i < 3; i++) u16MasterRegs[i] = 0xB0 + i;
+	CHECK(query(&ModbusTcpMaster, MB_FC_WRITE_MULTIPLE_REGISTERS, 20, 3) == ERR_OK_QUERY);
+	for (uint8_t i = 0; i < 3; i++) CHECK(u16SlaveRegs[20 + i] == 0xB0 + i);
+	CHECK(query(&ModbusTcpMaster, MB_FC_READ_REGISTERS, POSIX_REGS - 1, 2) == ERR_EXCEPTION);
+
+	/* UDP master */
+	CHECK(query(&ModbusUdpMaster, MB_FC_READ_REGISTERS, 20, 3) == ERR_OK_QUERY);
+	for (uint8_t i = 0; i < 3; i++) CHECK(u16MasterRegs[i] == 0xB0 + i);
+
+	/* two requests pipelined in one segment, each answered with its transaction ID */
+	const uint8_t u8Pipelined[] = {
+		0x01, 0x01, 0, 0, 0, 6, 1, MB_FC_READ_REGISTERS, 0, 0, 0, 1,
+		0x01, 0x02, 0, 0, 0, 6, 1, MB_FC_READ_REGISTERS, 0, 1, 0, 2 };
+	struct sockaddr_in xAddr = { .sin_family = AF_INET, .sin_port = htons(POSIX_TCP_PORT) };
+	int iFd = socket(AF_INET, SOCK_STREAM, 0);
+
+	xAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	CHECK(iFd >= 0 && connect(iFd, (struct sockaddr *)&xAddr, sizeof(xAddr)) == 0);
+	fcntl(iFd, F_SETFL, O_NONBLOCK);
+	CHECK(send(iFd, u8Pipelined, sizeof(u8Pipelined), 0) == sizeof(u8Pipelined));
+	u16Len = recvAll(iFd, u8Rx, 11 + 13);
+	CHECK(u16Len == 11 + 13);
+	CHECK(u8Rx[1] == 0x01 && u8Rx[8] == 2 && u8Rx[9] == 0x02 && u8Rx[10] == 0x00);
+	CHECK(u8Rx[12] == 0x02 && u8Rx[19] == 4 && u8Rx[21] == 0x01 && u8Rx[23] == 0x02);
+	close(iFd);
+
+	/* RTU over the pseudo terminal */
+	uint8_t u8Read[8] = { 3, MB_FC_READ_REGISTERS, 0, 4, 0, 2 };
+	uint16_t u16Crc = crc16(u8Read, 6);
+	u8Read[6] = u16Crc & 0xFF;
+	u8Read[7] = u16Crc >> 8;
+	CHECK(write(iPtyMaster, u8Read, sizeof(u8Read)) == sizeof(u8Read));
+	u16Len = recvAll(iPtyMaster, u8Rx, 9);
+	CHECK(u16Len == 9);
+	CHECK(u16Len == 9 && u8Rx[2] == 4 && u8Rx[3] == 0x02 && u8Rx[4] == 0x04 && u8Rx[6] == 0x05);
+	CHECK(u16Len == 9 && crc16(u8Rx, 7) == (uint16_t)(u8Rx[7] | (u8Rx[8] << 8)));
+
+	printf("host posix: %d failed\n", iFailed);
+	exit(iFailed);
+}
+
+static void initSlave(modbusHandler_t *modH, mb_hardware_t xType, uint8_t u8id)
+{
+	modH->uModbusType = MB_SLAVE;
+	modH->xTypeHW = xType;
+	modH->port = NULL;
+	modH->u8id = u8id;
+	modH->u16timeOut = 1000;
+	modH->EN_Port = NULL;
+	modH->u16regsHR = u16SlaveRegs;
+	modH->u16regHR_size = POSIX_REGS;
+}
+
+static void initMaster(modbusHandler_t *modH, mb_hardware_t xType, uint16_t u16Port)
+{
+	modH->uModbusType = MB_MASTER;
+	modH->xTypeHW = xType;
+	modH->port = NULL;
+	modH->u8id = 0;
+	modH->u16timeOut = 1000;
+	modH->EN_Port = NULL;
+	modH->u16regsHR = u16MasterRegs;
+	modH->u16regHR_size = POSIX_REGS;
+	modH->u16TcpPort = u16Port;
+	ipaddr_aton("127.0.0.1", &modH->xTcpServer);
+	ModbusInit(modH);
+	ModbusStart(modH);
+}
+
+/**
+ * @brief
+ * One query of a master to unit 1, the registers in u16MasterRegs
+ *
+ * @return the notification of the master, ERR_OK_QUERY or the mb_errot_t of the query
+ */
+static int8_t query(modbusHandler_t *modH, mb_functioncode_t u8fct, uint16_t u16RegAdd, uint16_t u16CoilsNo)
+{
+	modbus_t telegram = {0};
+
+	telegram.u8id = 1;
+	telegram.u8fct = u8fct;
+	telegram.u16RegAdd = u16RegAdd;
+	telegram.u16CoilsNo = u16CoilsNo;
+	telegram.u16reg = u16MasterRegs;
+
+	ModbusQuery(modH, telegram);
+	return (int8_t)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+/* reads a non-blocking descriptor until u16Size bytes or 100 ticks without them */
+static uint16_t recvAll(int iFd, uint8_t *u8Rx, uint16_t u16Size)
+{
+	uint16_t u16Len = 0;
+
+	for (uint8_t i = 0; i < 100 && u16Len < u16Size; i++)
+	{
+		ssize_t iLen = read(iFd, &u8Rx[u16Len], u16Size - u16Len);
+
+		if (iLen > 0) u16Len += (uint16_t)iLen;
+		else vTaskDelay(1);
+	}
+	return u16Len;
+}
+
+/* CRC of the test, bit by bit, independent of the CRC_MODE of the library */
+static uint16_t crc16(const uint8_t *u8Data, uint16_t u16Size)
+{
+	uint16_t u16Crc = 0xFFFF;
+
+	for (uint16_t i = 0; i < u16Size; i++)
+	{
+		u16Crc ^= u8Data[i];
+		for (uint8_t j = 0; j < 8; j++) u16Crc = (u16Crc & 1) ? (u16Crc >> 1) ^ 0xA001 : u16Crc >> 1;
+	}
+	return u16Crc;
+}
+
+static void check(int iPassed, const char *pcWhat, int iLine)
+{
+	if (iPassed) return;
+	printf("main.c:%d: failed: %s\n", iLine, pcWhat);
+	iFailed++;
+}
@@ -165,6 +165,20 @@ standard names. */
 
 /* USER CODE BEGIN Defines */
 /* Section where parameter definitions can be added (for instance, to override default ones in FreeRTOS.h) */
+#if LOOPBACK_BENCH == 1
+/* loopback benchmark: CPU load from the run-time stats, counted by the DWT cycle counter.
+   The master handler and the benchmark task need a larger heap */
+#if defined(__ICCARM__) || defined(__CC_ARM) || defined(__GNUC__)
+extern void LoopbackBenchTimerInit(void);
+extern uint32_t LoopbackBenchCycles(void);
+#endif
+#define configGENERATE_RUN_TIME_STATS            1
+#define INCLUDE_xTaskGetIdleTaskHandle           1
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS() LoopbackBenchTimerInit()
+#define portGET_RUN_TIME_COUNTER_VALUE()         LoopbackBenchCycles()
+#undef configTOTAL_HEAP_SIZE
+#define configTOTAL_HEAP_SIZE                    ((size_t)8192)
+#endif
 /* USER CODE END Defines */
 
 #endif /* FREERTOS_CONFIG_H */
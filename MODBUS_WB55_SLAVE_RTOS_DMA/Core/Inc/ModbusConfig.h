@@ -15,11 +15,12 @@
 #define ENABLE_USART_DMA 1
 
 
-#define T35  5              // Timer T35 period (in ticks) for end frame detection.
-#define MAX_BUFFER  128	    // Maximum size for the communication buffer in bytes.
+#define T35  5              // Initial timer T35 period (in ticks), ModbusStart() recomputes it from the baud rate.
+#define MAX_BUFFER  256	    // Maximum size for the communication buffer in bytes, 256 holds any RTU frame.
 #define TIMEOUT_MODBUS 1000 // Timeout for master query (in ticks)
 #define MAX_M_HANDLERS 2    //Maximum number of modbus handlers that can work concurrently
 #define MAX_TELEGRAMS 2     //Max number of Telegrams in master queue
+#define CRC_MODE  CRC_TABLE // CRC16 backend: CRC_BITWISE, CRC_TABLE, CRC_NIBBLE or CRC_HARDWARE
 
 
 
@@ -0,0 +1,73 @@
+/*
+ * loopback_bench.h
+ *
+ *  Loopback throughput benchmark of the Modbus library.
+ *
+ *  A master on LPUART1 queries the slave of this example on USART1 of the same WB55, the two
+ *  ports wired back to back without transceivers:
+ *  - PA2 (LPUART1_TX) to PB7 (USART1_RX)
+ *  - PB6 (USART1_TX) to PA3 (LPUART1_RX)
+ *
+ *  It sweeps the baud rate, the function code and the request size, and stores for every step the
+ *  transactions per second, the latency percentiles and the CPU load taken from the FreeRTOS
+ *  run-time stats in xLoopbackResults[]. Watch it in the Live Expressions view, u8LoopbackDone
+ *  is set to 1 when the sweep is over.
+ *
+ *  Build with LOOPBACK_BENCH=1 in the preprocessor symbols of the project, the file compiles to
+ *  nothing otherwise.
+ */
+
+#ifndef INC_LOOPBACK_BENCH_H_
+#define INC_LOOPBACK_BENCH_H_
+
+#include "main.h"
+
+#if LOOPBACK_BENCH == 1
+
+#ifndef LOOPBACK_STEP_MS
+#define LOOPBACK_STEP_MS    2000  // Duration of one step in ms
+#endif
+
+#ifndef LOOPBACK_SAMPLES
+#define LOOPBACK_SAMPLES    256   // Latencies kept per step for the percentiles
+#endif
+
+#define LOOPBACK_REGS       123   // Largest request size, the limit of FC16
+
+#define LOOPBACK_BAUDS      6
+#define LOOPBACK_FCS        2
+#define LOOPBACK_SIZES      4
+#define LOOPBACK_STEPS      (LOOPBACK_BAUDS * LOOPBACK_FCS * LOOPBACK_SIZES)
+
+/**
+ * @struct loopbackResult_t
+ * @brief
+ * Result of one step of the sweep
+ */
+typedef struct
+{
+	uint32_t u32Baud;         /*!< Baud rate of both ports */
+	uint8_t  u8fct;           /*!< MB_FC_READ_REGISTERS or MB_FC_WRITE_MULTIPLE_REGISTERS */
+	uint16_t u16Regs;         /*!< Registers per request */
+	uint32_t u32Transactions; /*!< Queries answered without error */
+	uint32_t u32Errors;       /*!< Queries ended with an error or a timeout */
+	uint32_t u32TPSx10;       /*!< Transactions per second, x10 */
+	uint32_t u32P50;          /*!< Latency percentiles in us, from ModbusQuery() to the notification */
+	uint32_t u32P90;
+	uint32_t u32P99;
+	uint32_t u32Max;
+	uint16_t u16CpuLoad;      /*!< CPU load in 0.1 %, 1000 minus the share of the idle task */
+}
+loopbackResult_t;
+
+extern loopbackResult_t xLoopbackResults[LOOPBACK_STEPS];
+extern volatile uint8_t u8LoopbackDone;
+
+void LoopbackBenchInit(modbusHandler_t *modSlave); // after the handler setup and before ModbusInit() of the slave
+void LoopbackBenchStart(void); // creates the master and the benchmark task, call before osKernelStart()
+void LoopbackBenchTimerInit(void); // run-time stats counter of FreeRTOS, the DWT cycle counter
+uint32_t LoopbackBenchCycles(void);
+
+#endif
+
+#endif /* INC_LOOPBACK_BENCH_H_ */
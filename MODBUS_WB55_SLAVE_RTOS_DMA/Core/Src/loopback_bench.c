@@ -0,0 +1,270 @@
+/*
+ * loopback_bench.c
+ *
+ *  Loopback throughput benchmark of the Modbus library, see loopback_bench.h
+ *
+ *  The slave keeps the USART1 DMA setup of the example, the master runs on LPUART1 with
+ *  interrupts. For every baud rate both ports are stopped, reprogrammed and restarted with
+ *  ModbusStart(), which recomputes T35 from the new baud rate.
+ */
+
+#include "loopback_bench.h"
+
+#if LOOPBACK_BENCH == 1
+
+UART_HandleTypeDef hlpuart1;
+
+loopbackResult_t xLoopbackResults[LOOPBACK_STEPS];
+volatile uint8_t u8LoopbackDone = 0;
+
+static modbusHandler_t ModbusMaster;
+static modbusHandler_t *xSlave;
+
+static uint16_t u16SlaveRegs[LOOPBACK_REGS];
+static uint16_t u16SlaveInputs[LOOPBACK_REGS];
+static uint16_t u16MasterRegs[LOOPBACK_REGS];
+static uint32_t u32Latency[LOOPBACK_SAMPLES];
+
+static const uint32_t u32Bauds[LOOPBACK_BAUDS] = { 9600, 19200, 115200, 460800, 1000000, 2000000 };
+static const mb_functioncode_t xFcts[LOOPBACK_FCS] = { MB_FC_READ_REGISTERS, MB_FC_WRITE_MULTIPLE_REGISTERS };
+static const uint16_t u16Sizes[LOOPBACK_SIZES] = { 1, 16, 64, LOOPBACK_REGS };
+
+static osThreadId_t xBenchTaskHandle;
+static const osThreadAttr_t xBenchTask_attributes = {
+  .name = "LoopbackBench",
+  .priority = (osPriority_t) osPriorityBelowNormal,
+  .stack_size = 128 * 4
+};
+
+static void MX_LPUART1_UART_Init(void);
+static void setBaud(modbusHandler_t *modH, uint32_t u32Baud);
+static void runStep(loopbackResult_t *xResult);
+static void sortLatency(uint32_t u32Count);
+static void StartBenchTask(void *argument);
+
+/**
+ * @brief
+ * Replaces the register images of the slave with ones large enough for the biggest request
+ */
+void LoopbackBenchInit(modbusHandler_t *modSlave)
+{
+	xSlave = modSlave;
+	xSlave->u16regsHR = u16SlaveRegs;
+	xSlave->u16regsRO = u16SlaveInputs;
+	xSlave->u16regHR_size = LOOPBACK_REGS;
+	xSlave->u16regRO_size = LOOPBACK_REGS;
+}
+
+/**
+ * @brief
+ * Initializes LPUART1 and the master handler, and creates the benchmark task
+ */
+void LoopbackBenchStart(void)
+{
+	MX_LPUART1_UART_Init();
+
+	ModbusMaster.uModbusType = MB_MASTER;
+	ModbusMaster.port = &hlpuart1;
+	ModbusMaster.u8id = 0;
+	ModbusMaster.u16timeOut = 1000;
+	ModbusMaster.EN_Port = NULL;
+	ModbusMaster.u16regsHR = u16MasterRegs;
+	ModbusMaster.u16regHR_size = LOOPBACK_REGS;
+	ModbusMaster.xTypeHW = USART_HW;
+
+	ModbusInit(&ModbusMaster);
+	ModbusStart(&ModbusMaster);
+
+	xBenchTaskHandle = osThreadNew(StartBenchTask, NULL, &xBenchTask_attributes);
+}
+
+/**
+ * @brief
+ * Starts the DWT cycle counter, it feeds the run-time stats of FreeRTOS and the latencies
+ */
+void LoopbackBenchTimerInit(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t LoopbackBenchCycles(void)
+{
+	return DWT->CYCCNT;
+}
+
+/**
+ * @brief
+ * LPUART1 on PA2/PA3 with the same frame format as USART1, clocked from PCLK1
+ */
+static void MX_LPUART1_UART_Init(void)
+{
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+	__HAL_RCC_LPUART1_CLK_ENABLE();
+	__HAL_RCC_GPIOA_CLK_ENABLE();
+
+	GPIO_InitStruct.Pin = GPIO_PIN_2|GPIO_PIN_3;
+	GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+	GPIO_InitStruct.Pull = GPIO_PULLUP;
+	GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+	GPIO_InitStruct.Alternate = GPIO_AF8_LPUART1;
+	HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+	HAL_NVIC_SetPriority(LPUART1_IRQn, 5, 0);
+	HAL_NVIC_EnableIRQ(LPUART1_IRQn);
+
+	hlpuart1.Instance = LPUART1;
+	hlpuart1.Init.BaudRate = u32Bauds[0];
+	hlpuart1.Init.WordLength = UART_WORDLENGTH_8B;
+	hlpuart1.Init.StopBits = UART_STOPBITS_1;
+	hlpuart1.Init.Parity = UART_PARITY_NONE;
+	hlpuart1.Init.Mode = UART_MODE_TX_RX;
+	hlpuart1.Init.HwFlowCtl = UART_HWCONTROL_NONE;
+	hlpuart1.Init.OneBitSampling = UART_ONE_BIT_SAMPLE_DISABLE;
+	hlpuart1.Init.ClockPrescaler = UART_PRESCALER_DIV1;
+	hlpuart1.AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_NO_INIT;
+	if (HAL_UART_Init(&hlpuart1) != HAL_OK)
+	{
+		Error_Handler();
+	}
+}
+
+void LPUART1_IRQHandler(void)
+{
+	HAL_UART_IRQHandler(&hlpuart1);
+}
+
+/**
+ * @brief
+ * Stops the port of a handler, changes its baud rate and starts it again
+ */
+static void setBaud(modbusHandler_t *modH, uint32_t u32Baud)
+{
+	HAL_UART_Abort(modH->port);
+	modH->port->Init.BaudRate = u32Baud;
+	if (HAL_UART_Init(modH->port) != HAL_OK)
+	{
+		Error_Handler();
+	}
+	ModbusStart(modH);
+}
+
+/**
+ * @brief
+ * Queries the slave back to back for LOOPBACK_STEP_MS and fills one result
+ */
+static void runStep(loopbackResult_t *xResult)
+{
+	modbus_t telegram = {0};
+	uint32_t u32Ticks = SystemCoreClock / 1000000UL;
+	uint32_t u32Count = 0;
+	uint32_t u32Start, u32Cycles, u32Notify;
+	uint32_t u32Idle, u32Total;
+	TickType_t xEnd;
+
+	telegram.u8id = xSlave->u8id;
+	telegram.u8fct = (mb_functioncode_t) xResult->u8fct;
+	telegram.u16RegAdd = 0;
+	telegram.u16CoilsNo = xResult->u16Regs;
+	telegram.u16reg = u16MasterRegs;
+	telegram.u16timeOut = 0;
+	telegram.u8retries = 0;
+
+	xResult->u32Transactions = xResult->u32Errors = xResult->u32Max = 0;
+	xResult->u32P50 = xResult->u32P90 = xResult->u32P99 = 0;
+
+	u32Idle = ulTaskGetIdleRunTimeCounter();
+	u32Total = LoopbackBenchCycles();
+	xEnd = xTaskGetTickCount() + pdMS_TO_TICKS(LOOPBACK_STEP_MS);
+
+	while ((int32_t)(xEnd - xTaskGetTickCount()) > 0)
+	{
+		u32Start = LoopbackBenchCycles();
+		ModbusQuery(&ModbusMaster, telegram);
+		u32Notify = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		u32Cycles = LoopbackBenchCycles() - u32Start;
+
+		if ((int8_t)u32Notify != ERR_OK_QUERY)
+		{
+			xResult->u32Errors++;
+			continue;
+		}
+
+		xResult->u32Transactions++;
+		if (u32Cycles > xResult->u32Max) xResult->u32Max = u32Cycles;
+		if (u32Count < LOOPBACK_SAMPLES) u32Latency[u32Count++] = u32Cycles;
+	}
+
+	// the cycle counter wraps after 2^32 cycles, one step must stay well below it
+	u32Idle = ulTaskGetIdleRunTimeCounter() - u32Idle;
+	u32Total = LoopbackBenchCycles() - u32Total;
+
+	xResult->u32TPSx10 = (xResult->u32Transactions * 10000UL) / LOOPBACK_STEP_MS;
+	xResult->u16CpuLoad = (u32Total == 0) ? 0 : (uint16_t)(1000 - (uint32_t)(((uint64_t)u32Idle * 1000) / u32Total));
+	xResult->u32Max /= u32Ticks;
+
+	if (u32Count == 0) return;
+	sortLatency(u32Count);
+	xResult->u32P50 = u32Latency[((u32Count - 1) * 50) / 100] / u32Ticks;
+	xResult->u32P90 = u32Latency[((u32Count - 1) * 90) / 100] / u32Ticks;
+	xResult->u32P99 = u32Latency[((u32Count - 1) * 99) / 100] / u32Ticks;
+}
+
+/**
+ * @brief
+ * Insertion sort of the latencies of the step, done once after it
+ */
+static void sortLatency(uint32_t u32Count)
+{
+	uint32_t i, j, u32Value;
+
+	for (i = 1; i < u32Count; i++)
+	{
+		u32Value = u32Latency[i];
+		for (j = i; j > 0 && u32Latency[j - 1] > u32Value; j--)
+		{
+			u32Latency[j] = u32Latency[j - 1];
+		}
+		u32Latency[j] = u32Value;
+	}
+}
+
+/**
+ * @brief
+ * Sweeps baud rate, function code and request size
+ */
+static void StartBenchTask(void *argument)
+{
+	uint8_t u8Baud, u8Fct, u8Size;
+	loopbackResult_t *xResult = xLoopbackResults;
+
+	for (u8Baud = 0; u8Baud < LOOPBACK_BAUDS; u8Baud++)
+	{
+		setBaud(xSlave, u32Bauds[u8Baud]);
+		setBaud(&ModbusMaster, u32Bauds[u8Baud]);
+		osDelay(10);
+
+		for (u8Fct = 0; u8Fct < LOOPBACK_FCS; u8Fct++)
+		{
+			for (u8Size = 0; u8Size < LOOPBACK_SIZES; u8Size++)
+			{
+				xResult->u32Baud = u32Bauds[u8Baud];
+				xResult->u8fct = xFcts[u8Fct];
+				xResult->u16Regs = u16Sizes[u8Size];
+				runStep(xResult);
+				xResult++;
+			}
+		}
+	}
+
+	u8LoopbackDone = 1;
+
+	for(;;)
+	{
+		osDelay(1000);
+	}
+}
+
+#endif
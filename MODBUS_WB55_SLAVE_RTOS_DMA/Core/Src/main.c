@@ -22,6 +22,7 @@
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "loopback_bench.h"
 
 /* USER CODE END Includes */
 
@@ -134,6 +135,10 @@ int main(void)
   ModbusH.u16regCoilsRO_size = sizeof(Input_Coils_Database)/sizeof(Input_Coils_Database[0]);
   ModbusH.xTypeHW = USART_HW_DMA;
 
+#if LOOPBACK_BENCH == 1
+  LoopbackBenchInit(&ModbusH);
+#endif
+
   //Initialize MODBUS library
   ModbusInit(&ModbusH);
 
@@ -167,6 +172,9 @@ int main(void)
 
   /* USER CODE BEGIN RTOS_THREADS */
   /* add threads, ... */
+#if LOOPBACK_BENCH == 1
+  LoopbackBenchStart();
+#endif
   /* USER CODE END RTOS_THREADS */
 
   /* USER CODE BEGIN RTOS_EVENTS */